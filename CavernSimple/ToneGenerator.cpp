@@ -14,35 +14,8 @@ Abstract:
 #include "definitions.h"
 #include "ToneGenerator.h"
 
-const double TWO_PI = M_PI * 2;
-
 extern DWORD g_DisableToneGenerator;
 
-//
-// Double to long conversion.
-//
-long ConvertToLong(double Value)
-{
-    return (long)(Value * _I32_MAX);
-};
-
-//
-// Double to short conversion.
-//
-short ConvertToShort(double Value)
-{
-    return (short)(Value * _I16_MAX);
-};
-
-//
-// Double to char conversion.
-//
-unsigned char ConvertToUChar(double Value)
-{
-    const double F_127_5 = 127.5;
-    return (unsigned char)(Value * F_127_5 + F_127_5);
-};
-
 //
 // Ctor: basic init.
 //
@@ -54,10 +27,12 @@ ToneGenerator::ToneGenerator()
   m_Mute(false),
   m_PartialFrame(NULL),
   m_PartialFrameBytes(0),
-  m_FrameSize(0)
+  m_FrameSize(0),
+  m_BlockSamples(NULL),
+  m_GainStage(NULL)
 {
-    // Theta (double) and SampleIncrement (double) are init in the Init() method 
-    // after saving the floating point state. 
+    // The oscillator is set up in the Init() method after saving the
+    // floating point state.
 }
 
 //
@@ -71,67 +46,90 @@ ToneGenerator::~ToneGenerator()
         m_PartialFrame = NULL;
         m_PartialFrameBytes = 0;
     }
+
+    if (m_BlockSamples)
+    {
+        ExFreePoolWithTag(m_BlockSamples, SIMPLEAUDIOSAMPLE_POOLTAG);
+        m_BlockSamples = NULL;
+    }
 }
 
 // 
-// Init a new frame. 
+// Init new frames: copy a block of the sine from the cached period (or
+// synthesize it with the oscillator when the period was too long to cache),
+// copy each value to every channel (or take a block of the measurement
+// signal), apply the stream gain if one is set, then convert the block with
+// the format kernel picked in Init(). The block is dithered here, after the
+// copy, so the dither never repeats with the period.
 // Note: caller will save and restore the floatingpoint state.
 //
 #pragma warning(push)
 // Caller wraps this routine between KeSaveFloatingPointState/KeRestoreFloatingPointState calls.
 #pragma warning(disable: 28110)
 
-VOID ToneGenerator::InitNewFrame
+VOID ToneGenerator::InitNewFrames
 (
-    _Out_writes_bytes_(FrameSize)    BYTE*  Frame, 
-    _In_                             DWORD  FrameSize
+    _Out_writes_bytes_(FrameCount * m_FrameSize) BYTE*  Frames,
+    _In_                                         size_t FrameCount
 )
 {
-    double sinValue = m_ToneDCOffset + m_ToneAmplitude * sin( m_Theta );
-
-    if (FrameSize != (DWORD)m_ChannelCount * m_BitsPerSample/8)
+    while (FrameCount > 0)
     {
-        ASSERT(FALSE);
-        RtlZeroMemory(Frame, FrameSize);
-        return;
-    }
+        size_t blockFrames = MIN(FrameCount, TONE_BLOCK_FRAMES);
+        float *sample = m_BlockSamples;
 
-    /* Use __analysis_assume to suppress the reports of a false OACR error. */
-    for(ULONG i = 0; i < m_ChannelCount; ++i)
-    {
-        if (m_BitsPerSample == 8)
+        if (m_TestSignal.IsInitialized())
         {
-            __analysis_assume((DWORD)m_ChannelCount == FrameSize);
-            unsigned char *dataBuffer = reinterpret_cast<unsigned char *>(Frame);
-            dataBuffer[i] = ConvertToUChar(sinValue);
+            m_TestSignal.Generate(m_BlockSamples, blockFrames);
         }
-        else if (m_BitsPerSample == 16)
+        else
         {
-            __analysis_assume((DWORD)(m_ChannelCount) * 2 == FrameSize);
-            short *dataBuffer = reinterpret_cast<short *>(Frame);
-            dataBuffer[i] = ConvertToShort(sinValue);
+            if (m_TonePeriod.IsInitialized())
+            {
+                m_TonePeriod.Generate(m_ToneSamples, blockFrames);
+            }
+            else
+            {
+                m_Oscillator.Generate(m_ToneSamples, blockFrames);
+            }
+
+            for (size_t i = 0; i < blockFrames; ++i)
+            {
+                float value = m_ToneSamples[i];
+
+                for (ULONG c = 0; c < m_ChannelCount; ++c)
+                {
+                    *sample++ = value;
+                }
+            }
         }
-        else if (m_BitsPerSample == 24)
-        {
-            __analysis_assume((DWORD)(m_ChannelCount) * 3 == FrameSize);
-            BYTE *dataBuffer = Frame;
-            long val = ConvertToLong(sinValue);
-            val = val >> 8;
-            RtlCopyMemory(dataBuffer, &val, 3);
-        }
-        else if (m_BitsPerSample == 32)
+
+        if (m_GainStage)
         {
-            __analysis_assume((DWORD)(m_ChannelCount) * 4 == FrameSize);
-            long *dataBuffer = reinterpret_cast<long *>(Frame);
-            dataBuffer[i] = ConvertToLong(sinValue);
+            m_GainStage->ProcessFloat(m_BlockSamples, blockFrames);
         }
+
+        m_Requantizer.Process(m_BlockSamples, Frames, blockFrames);
+
+        Frames += blockFrames * m_FrameSize;
+        FrameCount -= blockFrames;
     }
+}
 
-    m_Theta += m_SampleIncrement;
-    if (m_Theta >= TWO_PI)
+VOID ToneGenerator::InitNewFrame
+(
+    _Out_writes_bytes_(FrameSize)    BYTE*  Frame, 
+    _In_                             DWORD  FrameSize
+)
+{
+    if (FrameSize != (DWORD)m_ChannelCount * m_BitsPerSample/8)
     {
-        m_Theta -= TWO_PI;
+        ASSERT(FALSE);
+        RtlZeroMemory(Frame, FrameSize);
+        return;
     }
+
+    InitNewFrames(Frame, 1);
 }
 #pragma warning(pop)
 
@@ -195,12 +193,9 @@ void ToneGenerator::GenerateSine
 
     size_t frames = length/m_FrameSize;
 
-    for (size_t i = 0; i < frames; ++i)
-    {
-        InitNewFrame(buffer, m_FrameSize);
-        buffer += m_FrameSize;
-        length -= m_FrameSize;
-    }
+    InitNewFrames(buffer, frames);
+    buffer += frames * m_FrameSize;
+    length -= frames * m_FrameSize;
 
     IF_TRUE_JUMP(length == 0, Done);
     
@@ -228,6 +223,7 @@ NTSTATUS ToneGenerator::Init
     _In_    double                  ToneAmplitude,
     _In_    double                  ToneDCOffset,
     _In_    double                  ToneInitialPhase,
+    _In_    CAVERN_TEST_SIGNAL      TestSignal,
     _In_    PWAVEFORMATEXTENSIBLE   WfExt
 )
 {
@@ -254,7 +250,6 @@ NTSTATUS ToneGenerator::Init
     //
     // Basic init.
     //
-    m_Theta             = ToneInitialPhase;
     m_Frequency         = ToneFrequency;
     m_ToneAmplitude     = ToneAmplitude;
     m_ToneDCOffset      = ToneDCOffset;
@@ -263,14 +258,69 @@ NTSTATUS ToneGenerator::Init
     m_BitsPerSample     = WfExt->Format.wBitsPerSample; // bits per sample.
     m_SamplesPerSecond  = WfExt->Format.nSamplesPerSec; // samples per sec.
     m_Mute              = false;
-    m_SampleIncrement   = (m_Frequency * TWO_PI) / (double)m_SamplesPerSecond;
     m_FrameSize         = (DWORD)m_ChannelCount * m_BitsPerSample/8;
     ASSERT(m_FrameSize == WfExt->Format.nBlockAlign);
     
+    //
+    // Whole periods of the tone to copy from, the phase accumulator and
+    // sine table when the period is too long to cache, or the latency
+    // measurement signal in place of the tone.
+    //
+    if (TestSignal != CavernTestNone)
+    {
+        status = m_TestSignal.Init(
+                        TestSignal,
+                        m_ChannelCount,
+                        m_SamplesPerSecond,
+                        TONE_TEST_SIGNAL_ORDER,
+                        (float)fabs(ToneAmplitude));
+    }
+    else
+    {
+        status = m_TonePeriod.Init(
+                        m_Frequency,
+                        m_SamplesPerSecond,
+                        ToneAmplitude,
+                        ToneDCOffset,
+                        ToneInitialPhase);
+        if (NT_SUCCESS(status))
+        {
+            DPF(D_VERBOSE, ("Tone period of %u frames cached as %u frames",
+                m_TonePeriod.GetPeriodFrames(), m_TonePeriod.GetCacheFrames()));
+        }
+        else if (status == STATUS_NOT_SUPPORTED)
+        {
+            status = m_Oscillator.Init(
+                            m_Frequency,
+                            m_SamplesPerSecond,
+                            (float)ToneAmplitude,
+                            (float)ToneDCOffset,
+                            ToneInitialPhase,
+                            TRUE);
+        }
+    }
+
+    //
+    // Pick the float-to-PCM requantizer for the stream format.
+    //
+    if (NT_SUCCESS(status))
+    {
+        status = m_Requantizer.Init(
+                        CavernSampleFormatFromWave(
+                            WfExt->Format.wBitsPerSample,
+                            (WfExt->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE) ?
+                                WfExt->Samples.wValidBitsPerSample : WfExt->Format.wBitsPerSample,
+                            FALSE),
+                        m_ChannelCount,
+                        CAVERN_DEFAULT_DITHER,
+                        TRUE);
+    }
+    
     //
     // Restore floating state.
     //
     KeRestoreFloatingPointState(&saveData);
+    IF_FAILED_JUMP(status, Done);
 
     // 
     // Allocate a buffer to hold a partial frame.
@@ -281,6 +331,16 @@ NTSTATUS ToneGenerator::Init
                                     SIMPLEAUDIOSAMPLE_POOLTAG);
 
     IF_TRUE_ACTION_JUMP(m_PartialFrame == NULL, status = STATUS_INSUFFICIENT_RESOURCES, Done);
+
+    //
+    // Float staging for one block of frames.
+    //
+    m_BlockSamples = (float*)ExAllocatePool2(
+                                    POOL_FLAG_NON_PAGED,
+                                    TONE_BLOCK_FRAMES * m_ChannelCount * sizeof(float),
+                                    SIMPLEAUDIOSAMPLE_POOLTAG);
+
+    IF_TRUE_ACTION_JUMP(m_BlockSamples == NULL, status = STATUS_INSUFFICIENT_RESOURCES, Done);
     
     status = STATUS_SUCCESS;
 
@@ -16,6 +16,19 @@ Abstract:
 #define _USE_MATH_DEFINES
 #include <math.h>
 #include <limits.h>
+#include "CavernFormatConvert.h"
+#include "CavernGainStage.h"
+#include "CavernOscillator.h"
+#include "CavernRequantizer.h"
+#include "CavernTestSignal.h"
+#include "CavernTonePeriod.h"
+
+// Frames synthesized per conversion call
+#define TONE_BLOCK_FRAMES   64
+
+// Excitation length of the measurement signals, 2^order frames (341 ms at
+// 48 kHz, repeated every 683 ms)
+#define TONE_TEST_SIGNAL_ORDER  14
 
 class ToneGenerator
 {
@@ -24,14 +37,19 @@ public:
     WORD            m_ChannelCount; 
     WORD            m_BitsPerSample;
     DWORD           m_SamplesPerSecond;
-    double          m_Theta;
-    double          m_SampleIncrement;  
     bool            m_Mute;
     BYTE*           m_PartialFrame;
     DWORD           m_PartialFrameBytes;
     DWORD           m_FrameSize;
     double          m_ToneAmplitude;
     double          m_ToneDCOffset;
+    CCavernTonePeriod m_TonePeriod;
+    CCavernOscillator m_Oscillator;
+    CCavernTestSignal m_TestSignal;
+    CCavernRequantizer m_Requantizer;
+    float           m_ToneSamples[TONE_BLOCK_FRAMES];
+    float*          m_BlockSamples;
+    CCavernGainStage* m_GainStage;
 
 public:
     ToneGenerator();
@@ -44,6 +62,7 @@ public:
         _In_    double                  ToneAmplitude,
         _In_    double                  ToneDCOffset,
         _In_    double                  ToneInitialPhase,
+        _In_    CAVERN_TEST_SIGNAL      TestSignal,
         _In_    PWAVEFORMATEXTENSIBLE   WfExt
     );
     
@@ -63,12 +82,28 @@ public:
         m_Mute = Value;
     }
 
+    // Volume and mute applied to each float block before conversion.
+    VOID
+    SetGainStage
+    (
+        _In_opt_ CCavernGainStage *GainStage
+    )
+    {
+        m_GainStage = GainStage;
+    }
+
 private:
     VOID InitNewFrame
     (
         _Out_writes_bytes_(FrameSize)   BYTE*  Frame, 
         _In_                            DWORD  FrameSize
     );
+
+    VOID InitNewFrames
+    (
+        _Out_writes_bytes_(FrameCount * m_FrameSize) BYTE*  Frames,
+        _In_                                         size_t FrameCount
+    );
 };
 
 #endif // _SIMPLEAUDIOSAMPLE_TONEGENERATOR_H
@@ -272,6 +272,20 @@ Return Value:
 
     NTSTATUS                    ntStatus = STATUS_INVALID_DEVICE_REQUEST;
 
+    // The Cavern meter set shares ids with KSPROPSETID_Audio.
+    if (IsEqualGUIDAligned(*PropertyRequest->PropertyItem->Set, KSPROPSETID_CavernMeter))
+    {
+        if (PropertyRequest->PropertyItem->Id == KSPROPERTY_CAVERN_METER_RMS)
+        {
+            ntStatus = PropertyHandler_RmsMeter(
+                                m_AdapterCommon,
+                                PropertyRequest,
+                                m_DeviceMaxChannels);
+        }
+
+        return ntStatus;
+    }
+
     switch (PropertyRequest->PropertyItem->Id)
     {
         case KSPROPERTY_AUDIO_VOLUMELEVEL:
@@ -23,7 +23,6 @@ Abstract:
 // CSaveData statics
 //-----------------------------------------------------------------------------
 
-PSAVEWORKER_PARAM       CSaveData::m_pWorkItems = NULL;
 PDEVICE_OBJECT          CSaveData::m_pDeviceObject = NULL;
 //=============================================================================
 // Classes
@@ -141,6 +140,20 @@ class CAdapterCommon :
             _In_  ULONG           Channel
         );
 
+        STDMETHODIMP_(LONG)     MixerRmsMeterRead
+        ( 
+            _In_  ULONG           Index,
+            _In_  ULONG           Channel
+        );
+
+        STDMETHODIMP_(VOID)     MixerPeakMeterWrite
+        ( 
+            _In_  ULONG           Index,
+            _In_  ULONG           Channels,
+            _In_reads_(Channels) const LONG * Peak,
+            _In_reads_(Channels) const LONG * Rms
+        );
+
         STDMETHODIMP_(NTSTATUS) WriteEtwEvent 
         ( 
             _In_ EPcMiniportEngineEvent    miniportEventType,
@@ -437,7 +450,6 @@ Return Value:
         m_pHW = NULL;
     }
     
-    CSaveData::DestroyWorkItems();
     SAFE_RELEASE(m_pPortClsEtwHelper);
     SAFE_RELEASE(m_pServiceGroupWave);
  
@@ -612,8 +624,7 @@ Return Value:
     //
     // Initialize SaveData class.
     //
-    CSaveData::SetDeviceObject(DeviceObject);   //device object is needed by CSaveData
-    ntStatus = CSaveData::InitializeWorkItems(DeviceObject);
+    ntStatus = CSaveData::SetDeviceObject(DeviceObject);   //device object is needed by CSaveData
     IF_FAILED_JUMP(ntStatus, Done);
 Done:
 
@@ -1239,6 +1250,79 @@ Return Value:
     return 0;
 } // MixerVolumeRead
 
+//=============================================================================
+#pragma code_seg()
+STDMETHODIMP_(LONG)
+CAdapterCommon::MixerRmsMeterRead
+( 
+    _In_  ULONG                   Index,
+    _In_  ULONG                   Channel
+)
+/*++
+
+Routine Description:
+
+  Return the RMS level the stream published with MixerPeakMeterWrite.
+
+Arguments:
+
+  Index - node id
+
+  Channel = which channel
+
+Return Value:
+
+    LONG - RMS level of the last metering window, on the peak meter scale
+
+--*/
+{
+    if (m_pHW)
+    {
+        return m_pHW->GetMixerRmsMeter(Index, Channel);
+    }
+
+    return 0;
+} // MixerRmsMeterRead
+
+//=============================================================================
+#pragma code_seg()
+STDMETHODIMP_(VOID)
+CAdapterCommon::MixerPeakMeterWrite
+( 
+    _In_  ULONG                   Index,
+    _In_  ULONG                   Channels,
+    _In_reads_(Channels) const LONG * Peak,
+    _In_reads_(Channels) const LONG * Rms
+)
+/*++
+
+Routine Description:
+
+  Store the levels of one metering window in the mixer register array.
+  Callable at DISPATCH_LEVEL.
+
+Arguments:
+
+  Index - node id
+
+  Channels - number of levels
+
+  Peak - sample peak per channel
+
+  Rms - RMS level per channel
+
+Return Value:
+
+    void
+
+--*/
+{
+    if (m_pHW)
+    {
+        m_pHW->SetMixerPeakMeter(Index, Channels, Peak, Rms);
+    }
+} // MixerPeakMeterWrite
+
 //=============================================================================
 #pragma code_seg()
 STDMETHODIMP_(void)
@@ -355,6 +355,22 @@ DECLARE_INTERFACE_(IAdapterCommon, IUnknown)
         _In_  ULONG               Channel
     ) PURE;
 
+    STDMETHOD_(LONG,            MixerRmsMeterRead) 
+    ( 
+        THIS_
+        _In_  ULONG               Index,
+        _In_  ULONG               Channel
+    ) PURE;
+
+    STDMETHOD_(VOID,            MixerPeakMeterWrite) 
+    ( 
+        THIS_
+        _In_  ULONG               Index,
+        _In_  ULONG               Channels,
+        _In_reads_(Channels) const LONG * Peak,
+        _In_reads_(Channels) const LONG * Rms
+    ) PURE;
+
     STDMETHOD_(VOID,            MixerReset) 
     ( 
         THIS 
@@ -34,6 +34,19 @@ Abstract:
 DEFINE_GUIDSTRUCT("836BA6D1-3FF7-4411-8BCD-469553452DCE", PID_SIMPLEAUDIOSAMPLE);
 #define PID_SIMPLEAUDIOSAMPLE DEFINE_GUIDNAMED(PID_SIMPLEAUDIOSAMPLE)
 
+// Cavern meter properties, on the topology peak meter nodes next to
+// KSPROPERTY_AUDIO_PEAKMETER2
+// {C1D7F362-A44C-4CCA-9AA2-CB5E9FA6C168}
+#define STATIC_KSPROPSETID_CavernMeter\
+    0xc1d7f362, 0xa44c, 0x4cca, 0x9a, 0xa2, 0xcb, 0x5e, 0x9f, 0xa6, 0xc1, 0x68
+DEFINE_GUIDSTRUCT("C1D7F362-A44C-4CCA-9AA2-CB5E9FA6C168", KSPROPSETID_CavernMeter);
+#define KSPROPSETID_CavernMeter DEFINE_GUIDNAMED(KSPROPSETID_CavernMeter)
+
+typedef enum
+{
+    KSPROPERTY_CAVERN_METER_RMS = 0     // LONG per channel, peak meter scale
+} KSPROPERTY_CAVERN_METER;
+
 // Pool tag used for SIMPLEAUDIOSAMPLE allocations
 #define SIMPLEAUDIOSAMPLE_POOLTAG               'SASM'  
 
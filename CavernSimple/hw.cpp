@@ -214,11 +214,9 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
-    
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
     {
-        return m_MuteControls[ulNode];
+        return m_MuteControls[ulNode][ulChannel];
     }
 
     return 0;
@@ -269,11 +267,9 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
-
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
     {
-        return m_VolumeControls[ulNode];
+        return m_VolumeControls[ulNode][ulChannel];
     }
 
     return 0;
@@ -290,7 +286,8 @@ CSimpleAudioSampleHW::GetMixerPeakMeter
 
 Routine Description:
 
-  Gets the HW (!) peak meter for Simple Audio Sample.
+  Gets the HW (!) peak meter for Simple Audio Sample. The value is the
+  sample peak of the last metering window published by the stream.
 
 Arguments:
 
@@ -304,15 +301,90 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
+    {
+        return m_PeakMeterControls[ulNode][ulChannel];
+    }
+
+    return 0;
+} // GetMixerPeakMeter
+
+//=============================================================================
+LONG
+CSimpleAudioSampleHW::GetMixerRmsMeter
+(   
+    _In_  ULONG                   ulNode,
+    _In_  ULONG                   ulChannel
+)
+/*++
+
+Routine Description:
 
-    if (ulNode < MAX_TOPOLOGY_NODES)
+  Gets the RMS level of the last metering window, on the peak meter scale.
+
+Arguments:
+
+  ulNode - topology node id
+
+  ulChannel - which channel are we reading?
+
+Return Value:
+
+  LONG - RMS level
+
+--*/
+{
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
     {
-        return m_PeakMeterControls[ulNode];
+        return m_RmsMeterControls[ulNode][ulChannel];
     }
 
     return 0;
-} // GetMixerVolume
+} // GetMixerRmsMeter
+
+//=============================================================================
+void
+CSimpleAudioSampleHW::SetMixerPeakMeter
+(
+    _In_  ULONG                   ulNode,
+    _In_  ULONG                   ulChannels,
+    _In_reads_(ulChannels) const LONG * plPeak,
+    _In_reads_(ulChannels) const LONG * plRms
+)
+/*++
+
+Routine Description:
+
+  Publishes the levels of one metering window. Called from the stream's
+  DPC; each level is a single interlocked store so readers never wait.
+
+Arguments:
+
+  ulNode - topology node id
+
+  ulChannels - number of levels in plPeak and plRms
+
+  plPeak - sample peak per channel
+
+  plRms - RMS level per channel
+
+Return Value:
+
+  void
+
+--*/
+{
+    if (ulNode >= MAX_TOPOLOGY_NODES)
+    {
+        return;
+    }
+
+    for (ULONG i = 0; i < ulChannels && i < MAX_NODE_CHANNELS; ++i)
+    {
+        InterlockedExchange(&m_PeakMeterControls[ulNode][i], plPeak[i]);
+        InterlockedExchange(&m_RmsMeterControls[ulNode][i], plRms[i]);
+    }
+} // SetMixerPeakMeter
 
 //=============================================================================
 #pragma code_seg("PAGE")
@@ -334,14 +406,13 @@ Return Value:
 {
     PAGED_CODE();
     
-    RtlFillMemory(m_VolumeControls, sizeof(LONG) * MAX_TOPOLOGY_NODES, 0xFF);
+    RtlFillMemory((PVOID)m_VolumeControls, sizeof(m_VolumeControls), 0xFF);
     // Endpoints are not muted by default.
-    RtlZeroMemory(m_MuteControls, sizeof(BOOL) * MAX_TOPOLOGY_NODES);
+    RtlZeroMemory((PVOID)m_MuteControls, sizeof(m_MuteControls));
 
-    for (ULONG i=0; i<MAX_TOPOLOGY_NODES; ++i)
-    {
-        m_PeakMeterControls[i] = PEAKMETER_SIGNED_MAXIMUM/2;
-    }
+    // Meters read silence until a stream publishes.
+    RtlZeroMemory((PVOID)m_PeakMeterControls, sizeof(m_PeakMeterControls));
+    RtlZeroMemory((PVOID)m_RmsMeterControls, sizeof(m_RmsMeterControls));
     
     // BUGBUG change this depending on the topology
     m_ulMux = 2;
@@ -376,11 +447,9 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
-
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
     {
-        m_MuteControls[ulNode] = fMute;
+        InterlockedExchange((volatile LONG *)&m_MuteControls[ulNode][ulChannel], fMute);
     }
 } // SetMixerMute
 
@@ -437,10 +506,8 @@ Return Value:
 
 --*/
 {
-    UNREFERENCED_PARAMETER(ulChannel);
-
-    if (ulNode < MAX_TOPOLOGY_NODES)
+    if (ulNode < MAX_TOPOLOGY_NODES && ulChannel < MAX_NODE_CHANNELS)
     {
-        m_VolumeControls[ulNode] = lVolume;
+        InterlockedExchange(&m_VolumeControls[ulNode][ulChannel], lVolume);
     }
 } // SetMixerVolume
@@ -21,6 +21,8 @@ Abstract:
 //=============================================================================
 // BUGBUG we should dynamically allocate this...
 #define MAX_TOPOLOGY_NODES      20
+// Channels with their own register per node
+#define MAX_NODE_CHANNELS       16
 
 //=============================================================================
 // Classes
@@ -34,9 +36,13 @@ class CSimpleAudioSampleHW
 {
 public:
 protected:
-    BOOL                        m_MuteControls[MAX_TOPOLOGY_NODES];
-    LONG                        m_VolumeControls[MAX_TOPOLOGY_NODES];
-    LONG                        m_PeakMeterControls[MAX_TOPOLOGY_NODES];
+    // Per-channel registers shared between the topology property handlers
+    // and the streams' DPCs. Each is a single aligned LONG written with an
+    // interlocked store, so neither side locks.
+    volatile BOOL               m_MuteControls[MAX_TOPOLOGY_NODES][MAX_NODE_CHANNELS];
+    volatile LONG               m_VolumeControls[MAX_TOPOLOGY_NODES][MAX_NODE_CHANNELS];
+    volatile LONG               m_PeakMeterControls[MAX_TOPOLOGY_NODES][MAX_NODE_CHANNELS];
+    volatile LONG               m_RmsMeterControls[MAX_TOPOLOGY_NODES][MAX_NODE_CHANNELS];
     ULONG                       m_ulMux;            // Mux selection
     BOOL                        m_bDevSpecific;
     INT                         m_iDevSpecific;
@@ -96,6 +102,18 @@ public:
         _In_  ULONG               ulNode,
         _In_  ULONG               ulChannel
     );
+    LONG                        GetMixerRmsMeter
+    (   
+        _In_  ULONG               ulNode,
+        _In_  ULONG               ulChannel
+    );
+    void                        SetMixerPeakMeter
+    (
+        _In_  ULONG               ulNode,
+        _In_  ULONG               ulChannels,
+        _In_reads_(ulChannels) const LONG * plPeak,
+        _In_reads_(ulChannels) const LONG * plRms
+    );
 
 protected:
 private:
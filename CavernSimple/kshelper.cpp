@@ -733,7 +733,7 @@ Return Value:
             {
                 if (ALL_CHANNELS_ID == ulChannel)
                 {
-                    for (ULONG i=0; i<ulChannel; ++i)
+                    for (ULONG i=0; i<MaxChannels; ++i)
                     {
                         AdapterCommon->MixerVolumeWrite
                         (
@@ -840,7 +840,7 @@ Return Value:
             {
                 if (ALL_CHANNELS_ID == ulChannel)
                 {
-                    for (ULONG i=0; i<ulChannel; ++i)
+                    for (ULONG i=0; i<MaxChannels; ++i)
                     {
                         AdapterCommon->MixerMuteWrite
                         (
@@ -956,3 +956,89 @@ Return Value:
     return ntStatus;
 } // PropertyHandlerVolume
 
+
+//=============================================================================
+#pragma code_seg("PAGE")
+NTSTATUS
+PropertyHandler_RmsMeter
+(
+    _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  PPCPROPERTY_REQUEST   PropertyRequest,
+    _In_  ULONG                 MaxChannels
+)
+/*++
+
+Routine Description:
+
+  Property handler for KSPROPERTY_CAVERN_METER_RMS. Same scale and ranges
+  as KSPROPERTY_AUDIO_PEAKMETER2, read from the same metering window.
+
+Arguments:
+
+  AdapterCommon - interface to the common adapter object.
+  
+  PropertyRequest - property request structure.
+
+  MaxChannels - # of supported channels.
+
+Return Value:
+
+  NT status code.
+
+--*/
+{
+    PAGED_CODE();
+
+    DPF_ENTER(("[%s]",__FUNCTION__));
+
+    NTSTATUS ntStatus = STATUS_INVALID_DEVICE_REQUEST;
+    ULONG    ulChannel;
+    PLONG    plSample;
+
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT)
+    {
+        ntStatus = PropertyHandler_BasicSupportPeakMeter2(
+                            PropertyRequest,
+                            MaxChannels);
+    }
+    else
+    {
+        ntStatus = 
+            ValidatePropertyParams
+            (
+                PropertyRequest, 
+                sizeof(LONG),    // level is a LONG
+                sizeof(ULONG)    // instance is the channel number
+            );
+        if (NT_SUCCESS(ntStatus))
+        {
+            ulChannel = * (PULONG (PropertyRequest->Instance));
+            plSample  = PLONG (PropertyRequest->Value);
+
+            if (ulChannel >= MaxChannels &&
+                ulChannel != ALL_CHANNELS_ID)
+            {
+               ntStatus = STATUS_INVALID_PARAMETER;
+            }
+            else if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET)
+            {
+                *plSample = 
+                    PEAKMETER_NORMALIZE_IN_RANGE(
+                        AdapterCommon->MixerRmsMeterRead
+                        (
+                            PropertyRequest->Node, 
+                            ulChannel == ALL_CHANNELS_ID ? 0 : ulChannel
+                        ));
+                
+                PropertyRequest->ValueSize = sizeof(ULONG);                
+            }
+        }
+
+        if (!NT_SUCCESS(ntStatus))
+        {
+            DPF(D_TERSE, ("[%s - ntStatus=0x%08x]",__FUNCTION__,ntStatus));
+        }
+    }
+
+    return ntStatus;
+} // PropertyHandler_RmsMeter
@@ -89,6 +89,14 @@ PropertyHandler_PeakMeter2
     _In_  ULONG                 MaxChannels
 );
 
+NTSTATUS
+PropertyHandler_RmsMeter
+(
+    _In_  PADAPTERCOMMON        AdapterCommon,
+    _In_  PPCPROPERTY_REQUEST   PropertyRequest,
+    _In_  ULONG                 MaxChannels
+);
+
 //=============================================================================
 // Property helpers
 //=============================================================================
@@ -6,6 +6,10 @@
 #include "minwavertstream.h"
 #define MINWAVERTSTREAM_POOLTAG 'SRWM'
 
+// Length of one peak meter reading
+#define PEAKMETER_WINDOW_MS     10
+#define GAIN_RAMP_MS            5
+
 // Cavern pipe name
 #define CAVERN_PIPE_NAME L"\\??\\pipe\\CavernAudioPipe"
 
@@ -123,6 +127,9 @@ NTSTATUS CMiniportWaveRTStream::ReadRegistrySettings()
         { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"HostCaptureToneAmplitude",        &m_dwHostCaptureToneAmplitude,          (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwHostCaptureToneAmplitude,              sizeof(DWORD) },
         { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"HostCaptureToneDCOffset",         &m_dwHostCaptureToneDCOffset,           (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwHostCaptureToneDCOffset,               sizeof(DWORD) },
         { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"HostCaptureToneInitialPhase",     &m_dwHostCaptureToneInitialPhase,       (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwHostCaptureToneInitialPhase,           sizeof(DWORD) },
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"HostCaptureTestSignal",           &m_dwHostCaptureTestSignal,             (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwHostCaptureTestSignal,                 sizeof(DWORD) },
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"RenderDataContainer",             &m_dwRenderDataContainer,               (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwRenderDataContainer,                   sizeof(DWORD) },
+        { NULL,   RTL_QUERY_REGISTRY_DIRECT | RTL_QUERY_REGISTRY_TYPECHECK, L"RenderDataBackend",               &m_dwRenderDataBackend,                 (REG_DWORD << RTL_QUERY_REGISTRY_TYPECHECK_SHIFT) | REG_DWORD,  &m_dwRenderDataBackend,                     sizeof(DWORD) },
         { NULL,   0,                                                        NULL,                               NULL,                                   0,                                                              NULL,                                       0 }
     };
 
@@ -225,6 +232,7 @@ Return Value:
     m_plPeakMeter = NULL;
     m_pWfExt = NULL;
     m_ullLinearPosition = 0;
+    m_ullGainPosition = 0;
     m_ullPresentationPosition = 0;
     m_ulContentId = 0;
     m_ulCurrentWritePosition = 0;
@@ -239,6 +247,9 @@ Return Value:
     m_dwHostCaptureToneAmplitude = 50;
     m_dwHostCaptureToneDCOffset = 0;
     m_dwHostCaptureToneInitialPhase = 0;
+    m_dwHostCaptureTestSignal = CavernTestNone;
+    m_dwRenderDataContainer = CavernWaveRf64;
+    m_dwRenderDataBackend = SaveDataBuffered;
 
     m_pPortStream = PortStream_;
     InitializeListHead(&m_NotificationList);
@@ -314,6 +325,75 @@ Return Value:
         return STATUS_INSUFFICIENT_RESOURCES;
     }
 
+    //
+    // The meter and the gain stage both work on the stream's sample format.
+    //
+    BOOLEAN isFloat = 
+        m_pWfExt->Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT ||
+        (m_pWfExt->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+         IsEqualGUIDAligned(m_pWfExt->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT));
+    BOOLEAN isPcm = 
+        m_pWfExt->Format.wFormatTag == WAVE_FORMAT_PCM ||
+        (m_pWfExt->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+         IsEqualGUIDAligned(m_pWfExt->SubFormat, KSDATAFORMAT_SUBTYPE_PCM));
+    CAVERN_SAMPLE_FORMAT sampleFormat = CavernSampleFormatFromWave(
+        m_pWfExt->Format.wBitsPerSample,
+        (m_pWfExt->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE) ?
+            m_pWfExt->Samples.wValidBitsPerSample : m_pWfExt->Format.wBitsPerSample,
+        isFloat);
+
+    //
+    // Meter what passes through the stream for the topology peak meter
+    // node. Formats the meter does not handle just read silence.
+    //
+    m_ulPeakMeterNode = m_bCapture ? KSNODE_TOPO_PEAKMETER : KSNODE_TOPO_WAVEOUT_PEAKMETER;
+    {
+        NTSTATUS meterStatus = m_LevelMeter.Init(
+                    sampleFormat,
+                    m_pWfExt->Format.nChannels,
+                    m_pWfExt->Format.nSamplesPerSec * PEAKMETER_WINDOW_MS / 1000,
+                    TRUE);
+        if (!NT_SUCCESS(meterStatus))
+        {
+            DPF(D_TERSE, ("Peak meter not available for this format, 0x%x", meterStatus));
+        }
+    }
+
+    //
+    // Apply the topology volume and mute to the signal itself. Only PCM and
+    // float streams are scaled; bitstreams (AC-3 over S/PDIF, IEC 61937
+    // subformats) must reach the pipe bit-exact, so they get no gain stage.
+    //
+    m_ulVolumeNode = m_bCapture ? KSNODE_TOPO_VOLUME : KSNODE_TOPO_WAVEOUT_VOLUME;
+    m_ulMuteNode = m_bCapture ? KSNODE_TOPO_MUTE : KSNODE_TOPO_WAVEOUT_MUTE;
+    {
+        KFLOATING_SAVE saveData;
+
+        if (!isPcm && !isFloat)
+        {
+            DPF(D_TERSE, ("Bitstream format, volume and mute are not applied"));
+        }
+        else if (NT_SUCCESS(KeSaveFloatingPointState(&saveData)))
+        {
+            NTSTATUS gainStatus = m_GainStage.Init(
+                        sampleFormat,
+                        m_pWfExt->Format.nChannels,
+                        m_pWfExt->Format.nSamplesPerSec,
+                        GAIN_RAMP_MS,
+                        CAVERN_DEFAULT_DITHER,
+                        TRUE);
+            KeRestoreFloatingPointState(&saveData);
+
+            if (!NT_SUCCESS(gainStatus))
+            {
+                DPF(D_TERSE, ("Gain stage not available for this format, 0x%x", gainStatus));
+            }
+        }
+
+        // Start from the current control values rather than ramping to them.
+        UpdateGainTargets();
+    }
+
     if (m_bCapture)
     {
         ReadRegistrySettings();
@@ -361,23 +441,34 @@ Return Value:
 
         toneInitialPhaseDouble = (double)toneInitialPhase / 10000;
 
-        ntStatus = m_ToneGenerator.Init(toneFrequency, toneAmplitudeDouble, toneDCOffsetDouble, toneInitialPhaseDouble, m_pWfExt);
+        CAVERN_TEST_SIGNAL testSignal = (m_dwHostCaptureTestSignal < CavernTestSignalCount) ?
+                                            (CAVERN_TEST_SIGNAL)m_dwHostCaptureTestSignal : CavernTestNone;
+
+        ntStatus = m_ToneGenerator.Init(toneFrequency, toneAmplitudeDouble, toneDCOffsetDouble, toneInitialPhaseDouble, testSignal, m_pWfExt);
 
         if (!NT_SUCCESS(ntStatus))
         {
             return ntStatus;
         }
+
+        if (m_GainStage.IsInitialized())
+        {
+            m_ToneGenerator.SetGainStage(&m_GainStage);
+        }
     }
     else if (!g_DoNotCreateDataFiles)
     {
         //
         // Create an output file for the render data.
         //
+        ReadRegistrySettings();
+
         DPF(D_TERSE, ("SaveData %p", &m_SaveData));
         ntStatus = m_SaveData.SetDataFormat(DataFormat_);
         if (NT_SUCCESS(ntStatus))
         {
-            ntStatus = m_SaveData.Initialize();
+            ntStatus = m_SaveData.Initialize((CAVERN_WAVE_CONTAINER)m_dwRenderDataContainer,
+                                             (SAVEDATA_BACKEND)m_dwRenderDataBackend);
         }
     
         if (!NT_SUCCESS(ntStatus))
@@ -500,8 +591,8 @@ NTSTATUS CMiniportWaveRTStream::AllocateBufferWithNotification
     {
         NTSTATUS ntStatus;
         
-        // Simple Audio Sample uses following buffer to hold data before writing to a file.
-        // Allocating larger buffer will reduce File I/O operations.
+        // The capture buffer holds at least this much, so that a writer
+        // stall of a few DMA buffers' length loses nothing.
         ntStatus = m_SaveData.SetMaxWriteSize(RequestedSize_ * 4);
         if (!NT_SUCCESS(ntStatus))
         {
@@ -1200,6 +1291,7 @@ NTSTATUS CMiniportWaveRTStream::SetState
             m_ullPlayPosition = 0;
             m_ullWritePosition = 0;
             m_ullLinearPosition = 0;
+            m_ullGainPosition = 0;
             m_ullPresentationPosition = 0;
             
             // Reset OS read/write positions
@@ -1211,14 +1303,18 @@ NTSTATUS CMiniportWaveRTStream::SetState
 
             KeReleaseSpinLock(&m_PositionSpinLock, oldIrql);
 
-            // Wait until all work items are completed.
+            // Wait until all queued data is written.
             if (!m_bCapture && !g_DoNotCreateDataFiles)
             {
-                m_SaveData.WaitAllWorkItems();
+                m_SaveData.WaitAllWrites();
             }
             
             // Cavern: disconnect pipe when stopping
             CavernDisconnectPipe();
+
+            // Meters fall to silence while the stream is stopped.
+            m_LevelMeter.Reset();
+            PublishPeakMeter(NULL);
             
             break;
 
@@ -1385,11 +1481,8 @@ VOID CMiniportWaveRTStream::UpdatePosition
             m_bLastBufferRendered = TRUE;
         }
 
-        if (!g_DoNotCreateDataFiles)
-        {
-            // Read from buffer and write to a file.
-            ReadBytes(ByteDisplacement);
-        }
+        // Read from buffer, meter it and write it to a file.
+        ReadBytes(ByteDisplacement);
     }
     
     // Increment the DMA position by the number of bytes displaced since the last
@@ -1428,6 +1521,9 @@ ByteDisplacement - # of bytes to process.
 {
     ULONG bufferOffset = m_ullLinearPosition % m_ulDmaBufferSize;
 
+    // The tone generator scales its float blocks through m_GainStage.
+    UpdateGainTargets();
+
     // Normally this will loop no more than once for a single wrap, but if
     // many bytes have been displaced then this may loops many times.
     while (ByteDisplacement > 0)
@@ -1435,6 +1531,8 @@ ByteDisplacement - # of bytes to process.
         ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
         
         m_ToneGenerator.GenerateSine(m_pDmaBuffer + bufferOffset, runWrite);
+
+        MeterBytes(m_pDmaBuffer + bufferOffset, runWrite);
         
         // Cavern: forward to pipe
         CavernForwardToPipe(m_pDmaBuffer + bufferOffset, runWrite);
@@ -1454,7 +1552,8 @@ VOID CMiniportWaveRTStream::ReadBytes
 
 Routine Description:
 
-This function reads the audio buffer and saves the data in a file.
+This function reads the audio buffer, applies volume and mute, meters it
+and saves the data in a file unless data files are disabled.
 
 Arguments:
 
@@ -1464,17 +1563,186 @@ ByteDisplacement - # of bytes to process.
 {
     ULONG bufferOffset = m_ullLinearPosition % m_ulDmaBufferSize;
 
+    GainBytes(ByteDisplacement);
+
     // Normally this will loop no more than once for a single wrap, but if
     // many bytes have been displaced then this may loops many times.
     while (ByteDisplacement > 0)
     {
         ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
-        m_SaveData.WriteData(m_pDmaBuffer + bufferOffset, runWrite);
+
+        MeterBytes(m_pDmaBuffer + bufferOffset, runWrite);
+
+        if (!g_DoNotCreateDataFiles)
+        {
+            m_SaveData.WriteData(m_pDmaBuffer + bufferOffset, runWrite);
+        }
         bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
         ByteDisplacement -= runWrite;
     }
 }
 
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::MeterBytes
+(
+    _In_reads_bytes_(Length) BYTE * Buffer,
+    _In_ ULONG Length
+)
+/*++
+
+Routine Description:
+
+Feeds one run of the DMA buffer to the level meter and publishes the
+levels whenever a metering window completes.
+
+Arguments:
+
+Buffer - start of the run.
+
+Length - # of bytes in the run.
+
+--*/
+{
+    KFLOATING_SAVE saveData;
+
+    if (!m_LevelMeter.IsInitialized())
+    {
+        return;
+    }
+
+    if (!NT_SUCCESS(KeSaveFloatingPointState(&saveData)))
+    {
+        m_LevelMeter.Skip(Length);
+        return;
+    }
+
+    if (m_LevelMeter.Measure(Buffer, Length))
+    {
+        PublishPeakMeter(m_LevelMeter.GetLevels());
+    }
+
+    KeRestoreFloatingPointState(&saveData);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::UpdateGainTargets()
+/*++
+
+Routine Description:
+
+Copies the volume and mute registers of the stream's topology nodes into
+the gain stage. Integer work only; the ramp is set up on the next Process.
+
+--*/
+{
+    if (!m_GainStage.IsInitialized())
+    {
+        return;
+    }
+
+    PADAPTERCOMMON pAdapterComm = m_pMiniport->GetAdapterCommObj();
+    ULONG channels = min((ULONG)m_pWfExt->Format.nChannels, (ULONG)CAVERN_MAX_CHANNELS);
+
+    for (ULONG i = 0; i < channels; i++)
+    {
+        m_GainStage.SetTarget(
+            i,
+            pAdapterComm->MixerVolumeRead(m_ulVolumeNode, i),
+            pAdapterComm->MixerMuteRead(m_ulMuteNode, i) ? TRUE : FALSE);
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::GainBytes
+(
+    _In_ ULONG ByteDisplacement
+)
+/*++
+
+Routine Description:
+
+Applies volume and mute in place to the render data about to be read.
+The run is extended to the next frame boundary so the stage only ever
+sees whole frames; the client has already written them, and the DMA
+buffer holds a whole number of frames so no frame straddles the wrap.
+m_ullGainPosition remembers how far the buffer has been scaled.
+
+Arguments:
+
+ByteDisplacement - # of bytes about to be read.
+
+--*/
+{
+    ULONG       blockAlign = m_pWfExt->Format.nBlockAlign;
+    ULONGLONG   end = m_ullLinearPosition + ByteDisplacement;
+    KFLOATING_SAVE saveData;
+
+    if (!m_GainStage.IsInitialized() || blockAlign == 0)
+    {
+        return;
+    }
+
+    end += (blockAlign - end % blockAlign) % blockAlign;
+    if (m_ullGainPosition >= end)
+    {
+        return;
+    }
+
+    UpdateGainTargets();
+
+    if (m_GainStage.IsTransparent() || !NT_SUCCESS(KeSaveFloatingPointState(&saveData)))
+    {
+        m_ullGainPosition = end;
+        return;
+    }
+
+    while (m_ullGainPosition < end)
+    {
+        ULONG offset = (ULONG)(m_ullGainPosition % m_ulDmaBufferSize);
+        ULONG length = (ULONG)min(end - m_ullGainPosition, (ULONGLONG)(m_ulDmaBufferSize - offset));
+
+        m_GainStage.Process(m_pDmaBuffer + offset, length / blockAlign);
+        m_ullGainPosition += length;
+    }
+
+    KeRestoreFloatingPointState(&saveData);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID CMiniportWaveRTStream::PublishPeakMeter
+(
+    _In_opt_ const CAVERN_LEVELS * Levels
+)
+/*++
+
+Routine Description:
+
+Hands the levels of one window to the topology peak meter node; NULL
+publishes silence. Float callers must hold the floating point state.
+
+Arguments:
+
+Levels - levels of the completed window, or NULL.
+
+--*/
+{
+    LONG    peak[CAVERN_MAX_CHANNELS];
+    LONG    rms[CAVERN_MAX_CHANNELS];
+    ULONG   channels = min((ULONG)m_pWfExt->Format.nChannels, (ULONG)CAVERN_MAX_CHANNELS);
+
+    for (ULONG i = 0; i < channels; i++)
+    {
+        peak[i] = Levels ? CavernLevelToPeakMeter(Levels->Peak[i]) : 0;
+        rms[i] = Levels ? CavernLevelToPeakMeter(Levels->Rms[i]) : 0;
+    }
+
+    m_pMiniport->GetAdapterCommObj()->MixerPeakMeterWrite(m_ulPeakMeterNode, channels, peak, rms);
+}
+
 //=============================================================================
 #pragma code_seg("PAGE")
 STDMETHODIMP_(NTSTATUS) 
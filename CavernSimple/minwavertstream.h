@@ -16,6 +16,8 @@ Abstract:
 
 #include "savedata.h"
 #include "ToneGenerator.h"
+#include "CavernLevelMeter.h"
+#include "CavernGainStage.h"
 
 //
 // Structure to store notifications events in a protected list
@@ -113,6 +115,12 @@ protected:
     ULONG                       m_ulContentId;
     CSaveData                   m_SaveData;
     ToneGenerator               m_ToneGenerator;
+    CCavernLevelMeter           m_LevelMeter;
+    ULONG                       m_ulPeakMeterNode;
+    CCavernGainStage            m_GainStage;
+    ULONG                       m_ulVolumeNode;
+    ULONG                       m_ulMuteNode;
+    ULONGLONG                   m_ullGainPosition;  // linear, frame aligned
     GUID                        m_SignalProcessingMode;
     BOOLEAN                     m_bEoSReceived;
     BOOLEAN                     m_bLastBufferRendered;
@@ -134,6 +142,9 @@ protected:
     DWORD                       m_dwLoopbackCaptureToneDCOffset; // must be between -100 to 100
     DWORD                       m_dwHostCaptureToneInitialPhase;   // must be between -31416 to 31416
     DWORD                       m_dwLoopbackCaptureToneInitialPhase; // must be between -31416 to 31416
+    DWORD                       m_dwHostCaptureTestSignal;   // CAVERN_TEST_SIGNAL, 0 for the tone
+    DWORD                       m_dwRenderDataContainer;     // CAVERN_WAVE_CONTAINER of the render data file
+    DWORD                       m_dwRenderDataBackend;       // SAVEDATA_BACKEND that writes it
     // Member variable as config params for tone generator
 
 public:
@@ -177,6 +188,24 @@ private:
     (
         _In_ ULONG ByteDisplacement
     );
+
+    VOID MeterBytes
+    (
+        _In_reads_bytes_(Length) BYTE * Buffer,
+        _In_ ULONG Length
+    );
+
+    VOID PublishPeakMeter
+    (
+        _In_opt_ const CAVERN_LEVELS * Levels
+    );
+
+    VOID UpdateGainTargets();
+
+    VOID GainBytes
+    (
+        _In_ ULONG ByteDisplacement
+    );
     
     VOID UpdatePosition
     (
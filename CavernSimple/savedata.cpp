@@ -10,11 +10,25 @@ Abstract:
 
     Implementation of Simple Audio Sample data saving class.
 
-    To save the playback data to disk, this class maintains a circular data
-    buffer, associated frame structures and worker items to save frames to
-    disk.
-    Each frame structure represents a portion of buffer. When that portion
-    of frame is full, a workitem is scheduled to save it to disk.
+    To save the playback data to disk, this class queues the data into a
+    circular buffer of fixed slots (CCavernCaptureQueue) from the stream's
+    DPC. A writer thread, one per stream and alive as long as the file is,
+    drains the published slots and writes the runs of them that follow each
+    other in the buffer with one ZwWriteFile each. When the writer falls a
+    whole buffer behind, data is dropped and counted rather than waited for.
+
+    The file is RIFF, RF64 or Wave64 (CavernWaveHeader.h), so captures can
+    pass 4 GB. Its header has a fixed size; the writer rewrites it in place
+    every SAVEDATA_CHECKPOINT_MS of data and when the stream stops, so the
+    file on disk stays readable while it grows.
+
+    The writer puts the data in the file through one of three backends:
+    buffered ZwWriteFile; copies into a sliding mapped view of the file,
+    which leaves the write-back to the memory manager; or non-cached,
+    sector-aligned writes straight from the queue, which keep the data out
+    of the cache. The last two allocate the file SAVEDATA_RESERVE_MS ahead
+    of the data, so it grows in a few large extents, and trim it when the
+    stream ends.
 --*/
 #pragma warning (disable : 4127)
 #pragma warning (disable : 26165)
@@ -35,22 +49,38 @@ Abstract:
 //=============================================================================
 // Defines
 //=============================================================================
-#define RIFF_TAG                    0x46464952;
-#define WAVE_TAG                    0x45564157;
-#define FMT__TAG                    0x20746D66;
-#define DATA_TAG                    0x61746164;
+#define SAVEDATA_SLOT_SIZE          (PAGE_SIZE * 16)
+#define DEFAULT_BUFFER_SIZE         (SAVEDATA_SLOT_SIZE * 4)
 
-#define DEFAULT_FRAME_COUNT         4
-#define DEFAULT_FRAME_SIZE          PAGE_SIZE * 4 
-#define DEFAULT_BUFFER_SIZE         DEFAULT_FRAME_SIZE * DEFAULT_FRAME_COUNT
+// Buffer for this long a writer stall at the stream's byte rate
+#define SAVEDATA_BUFFER_MS          500
+
+// Largest single file write, and how often the writer looks for data
+// when not woken by a filling buffer
+#define SAVEDATA_MAX_BATCH          (1024 * 1024)
+#define SAVEDATA_WRITER_PERIOD_MS   20
+
+// Stream time between header updates
+#define SAVEDATA_CHECKPOINT_MS      1000
+
+// File space allocated ahead of the data by the mapped and direct backends
+#define SAVEDATA_RESERVE_MS         10000
+#define SAVEDATA_MIN_RESERVE        (16 * 1024 * 1024)
+
+// Mapped view size, a multiple of the 64 KiB allocation granularity
+#define SAVEDATA_MAP_WINDOW         (4 * 1024 * 1024)
+
+// Offset, length and buffer alignment of non-cached writes; a page covers
+// any sector size
+#define SAVEDATA_SECTOR_ALIGNMENT   PAGE_SIZE
 
 #define DEFAULT_FILE_FOLDER1        L"\\DriverData\\Audio_Samples"
 #define DEFAULT_FILE_FOLDER2        L"\\DriverData\\Audio_Samples\\SimpleAudioSample"
 #define DEFAULT_FILE_NAME           L"\\DriverData\\Audio_Samples\\SimpleAudioSample\\STREAM"
 #define OFFLOAD_FILE_NAME           L"OFFLOAD"
 #define HOST_FILE_NAME              L"HOST"
-
-#define MAX_WORKER_ITEM_COUNT       15
+#define WAVE_FILE_EXTENSION         L"wav"
+#define WAVE64_FILE_EXTENSION       L"w64"
 
 //=============================================================================
 // Statics
@@ -64,31 +94,37 @@ ULONG CSaveData::m_ulStreamId = 0;
 
 //=============================================================================
 CSaveData::CSaveData()
-:   m_pDataBuffer(NULL),
-    m_FileHandle(NULL),
-    m_ulFrameCount(DEFAULT_FRAME_COUNT),
-    m_ulBufferSize(DEFAULT_BUFFER_SIZE),
-    m_ulFrameSize(DEFAULT_FRAME_SIZE),
-    m_ulBufferOffset(0),
-    m_ulFrameIndex(0),
-    m_fFrameUsed(NULL),
+:   m_FileHandle(NULL),
+    m_ulBufferSize(0),
+    m_ulWakeSlots(1),
+    m_ullReportedDrops(0),
+    m_pWriterThread(NULL),
+    m_fStopWriter(FALSE),
+    m_Container(CavernWaveRf64),
+    m_pHeader(NULL),
+    m_ulHeaderAlloc(0),
+    m_ulHeaderBytes(0),
     m_waveFormat(NULL),
+    m_ulFormatBytes(0),
     m_pFilePtr(NULL),
+    m_ullCheckpointBytes(0),
+    m_ullNextCheckpoint(0),
+    m_Backend(SaveDataBuffered),
+    m_ullReserveBytes(0),
+    m_ullReserved(0),
+    m_SectionHandle(NULL),
+    m_pView(NULL),
+    m_ullViewOffset(0),
+    m_ViewBytes(0),
     m_fWriteDisabled(FALSE),
     m_bInitialized(FALSE)
 {
     PAGED_CODE();
 
-    m_FileHeader.dwRiff           = RIFF_TAG;
-    m_FileHeader.dwFileSize       = 0;
-    m_FileHeader.dwWave           = WAVE_TAG;
-    m_FileHeader.dwFormat         = FMT__TAG;
-    m_FileHeader.dwFormatLength   = sizeof(WAVEFORMATEX);
-
-    m_DataHeader.dwData           = DATA_TAG;
-    m_DataHeader.dwDataLength     = 0;
-
     RtlZeroMemory(&m_objectAttributes, sizeof(m_objectAttributes));
+
+    KeInitializeEvent(&m_WakeEvent, SynchronizationEvent, FALSE);
+    KeInitializeEvent(&m_IdleEvent, NotificationEvent, FALSE);
 } // CSaveData
 
 //=============================================================================
@@ -98,35 +134,15 @@ CSaveData::~CSaveData()
 
     DPF_ENTER(("[CSaveData::~CSaveData]"));
 
-    // Update the wave header in data file with real file size.
+    // Write out what is still queued, finish the file and close it.
     //
-    if(m_pFilePtr)
-    {
-        m_FileHeader.dwFileSize =
-            (DWORD) m_pFilePtr->QuadPart - 2 * sizeof(DWORD);
-        m_DataHeader.dwDataLength = (DWORD) m_pFilePtr->QuadPart -
-                                     sizeof(m_FileHeader)        -
-                                     m_FileHeader.dwFormatLength -
-                                     sizeof(m_DataHeader);
-
-        if (STATUS_SUCCESS == KeWaitForSingleObject
-            (
-                &m_FileSync,
-                Executive,
-                KernelMode,
-                FALSE,
-                NULL
-            ))
-        {
-            if (NT_SUCCESS(FileOpen(FALSE)))
-            {
-                FileWriteHeader();
-
-                FileClose();
-            }
+    StopWriter();
+    ReportDrops();
 
-            KeReleaseMutex(&m_FileSync, FALSE);
-        }
+    if (m_pHeader)
+    {
+        ExFreePoolWithTag(m_pHeader, SAVEDATA_POOLTAG4);
+        m_pHeader = NULL;
     }
 
     if (m_waveFormat)
@@ -135,11 +151,10 @@ CSaveData::~CSaveData()
         m_waveFormat = NULL;
     }
 
-    if (m_fFrameUsed)
+    if (m_pFilePtr)
     {
-        ExFreePoolWithTag(m_fFrameUsed, SAVEDATA_POOLTAG2);
-        m_fFrameUsed = NULL;
-        // NOTE : Do not release m_pFilePtr.
+        ExFreePoolWithTag(m_pFilePtr, SAVEDATA_POOLTAG2);
+        m_pFilePtr = NULL;
     }
 
     if (m_FileName.Buffer)
@@ -147,39 +162,8 @@ CSaveData::~CSaveData()
         ExFreePoolWithTag(m_FileName.Buffer, SAVEDATA_POOLTAG3);
         m_FileName.Buffer = NULL;
     }
-
-    if (m_pDataBuffer)
-    {
-        ExFreePoolWithTag(m_pDataBuffer, SAVEDATA_POOLTAG4);
-        m_pDataBuffer = NULL;
-    }
 } // CSaveData
 
-//=============================================================================
-void
-CSaveData::DestroyWorkItems
-(
-    void
-)
-{
-    PAGED_CODE();
-
-    if (m_pWorkItems)
-    {
-        for (int i = 0; i < MAX_WORKER_ITEM_COUNT; i++)
-        {
-            if (m_pWorkItems[i].WorkItem!=NULL)
-            {
-                IoFreeWorkItem(m_pWorkItems[i].WorkItem);
-                m_pWorkItems[i].WorkItem = NULL;
-            }
-        }
-        ExFreePoolWithTag(m_pWorkItems, SAVEDATA_POOLTAG);
-        m_pWorkItems = NULL;
-    }
-
-} // DestroyWorkItems
-
 //=============================================================================
 void
 CSaveData::Disable
@@ -200,6 +184,8 @@ CSaveData::FileClose(void)
 
     NTSTATUS                    ntStatus = STATUS_SUCCESS;
 
+    UnmapWindow(TRUE);
+
     if (m_FileHandle)
     {
         ntStatus = ZwClose(m_FileHandle);
@@ -220,6 +206,10 @@ CSaveData::FileOpen
 
     NTSTATUS                    ntStatus = STATUS_SUCCESS;
     IO_STATUS_BLOCK             ioStatusBlock;
+    ACCESS_MASK                 desiredAccess = GENERIC_WRITE | SYNCHRONIZE;
+    ULONG                       createOptions = FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT;
+    LARGE_INTEGER               allocationSize;
+    PLARGE_INTEGER              pAllocationSize = NULL;
 
     if( FALSE == m_bInitialized )
     {
@@ -228,18 +218,36 @@ CSaveData::FileOpen
 
     if(!m_FileHandle)
     {
+        if (m_Backend == SaveDataMapped)
+        {
+            // A read/write section needs read access to the file as well.
+            desiredAccess |= GENERIC_READ;
+        }
+        else if (m_Backend == SaveDataDirect)
+        {
+            createOptions |= FILE_NO_INTERMEDIATE_BUFFERING;
+        }
+
+        // A new file gets its first extent up front.
+        if (fOverWrite && m_Backend != SaveDataBuffered)
+        {
+            m_ullReserved = m_ulHeaderBytes + m_ullReserveBytes;
+            allocationSize.QuadPart = m_ullReserved;
+            pAllocationSize = &allocationSize;
+        }
+
         ntStatus =
             ZwCreateFile
             (
                 &m_FileHandle,
-                GENERIC_WRITE | SYNCHRONIZE,
+                desiredAccess,
                 &m_objectAttributes,
                 &ioStatusBlock,
-                NULL,
+                pAllocationSize,
                 FILE_ATTRIBUTE_NORMAL,
                 0,
                 fOverWrite ? FILE_OVERWRITE_IF : FILE_OPEN_IF,
-                FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+                createOptions,
                 NULL,
                 0
             );
@@ -267,7 +275,20 @@ CSaveData::FileWrite
 
     NTSTATUS                    ntStatus;
 
-    if (m_FileHandle)
+    if (!m_FileHandle)
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWrite : File not open]"));
+        ntStatus = STATUS_INVALID_HANDLE;
+    }
+    else if (m_Backend == SaveDataMapped)
+    {
+        ntStatus = FileWriteMapped(pData, ulDataSize);
+    }
+    else if (m_Backend == SaveDataDirect)
+    {
+        ntStatus = FileWriteDirect(pData, ulDataSize);
+    }
+    else
     {
         IO_STATUS_BLOCK         ioStatusBlock;
 
@@ -292,194 +313,513 @@ CSaveData::FileWrite
             DPF(D_TERSE, ("[CSaveData::FileWrite : WriteFileError]"));
         }
     }
-    else
-    {
-        DPF(D_TERSE, ("[CSaveData::FileWrite : File not open]"));
-        ntStatus = STATUS_INVALID_HANDLE;
-    }
 
     return ntStatus;
 } // FileWrite
 
 //=============================================================================
 NTSTATUS
-CSaveData::FileWriteHeader(void)
+CSaveData::FileWriteMapped
+(
+    _In_reads_bytes_(ulDataSize)    PBYTE   pData,
+    _In_                            ULONG   ulDataSize
+)
+/*++
+
+Routine Description:
+
+  Copies the data into the mapped window at m_pFilePtr, sliding the window
+  along as it fills. Writer thread only: the view belongs to its process.
+
+--*/
 {
     PAGED_CODE();
 
     NTSTATUS                    ntStatus;
+    ULONG                       written = 0;
 
-    if (m_FileHandle && m_waveFormat)
-    {
-        IO_STATUS_BLOCK         ioStatusBlock;
-
-        m_pFilePtr->QuadPart = 0;
+    ntStatus = FileReserve(m_pFilePtr->QuadPart + ulDataSize);
 
-        m_FileHeader.dwFormatLength = (m_waveFormat->wFormatTag == WAVE_FORMAT_PCM) ?
-                                        sizeof( PCMWAVEFORMAT ) :
-                                        sizeof( WAVEFORMATEX ) + m_waveFormat->cbSize;
-
-        ntStatus = ZwWriteFile( m_FileHandle,
-                                NULL,
-                                NULL,
-                                NULL,
-                                &ioStatusBlock,
-                                &m_FileHeader,
-                                sizeof(m_FileHeader),
-                                m_pFilePtr,
-                                NULL);
+    while (NT_SUCCESS(ntStatus) && written < ulDataSize)
+    {
+        ntStatus = MapWindow(m_pFilePtr->QuadPart);
         if (!NT_SUCCESS(ntStatus))
         {
-            DPF(D_TERSE, ("[CSaveData::FileWriteHeader : Write File Header Error]"));
+            break;
         }
 
-        m_pFilePtr->QuadPart += sizeof(m_FileHeader);
+        SIZE_T  at = (SIZE_T)(m_pFilePtr->QuadPart - m_ullViewOffset);
+        ULONG   run = (ULONG)min((SIZE_T)(ulDataSize - written), m_ViewBytes - at);
 
-        ntStatus = ZwWriteFile( m_FileHandle,
-                                NULL,
-                                NULL,
-                                NULL,
-                                &ioStatusBlock,
-                                m_waveFormat,
-                                m_FileHeader.dwFormatLength,
-                                m_pFilePtr,
-                                NULL);
-        if (!NT_SUCCESS(ntStatus))
+        // An in-page error on the view surfaces as an exception.
+        __try
         {
-            DPF(D_TERSE, ("[CSaveData::FileWriteHeader : Write Format Error]"));
+            RtlCopyMemory(m_pView + at, pData + written, run);
         }
+        __except (EXCEPTION_EXECUTE_HANDLER)
+        {
+            ntStatus = GetExceptionCode();
+            break;
+        }
+
+        m_pFilePtr->QuadPart += run;
+        written += run;
+    }
+
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWriteMapped : Error 0x%08x]", ntStatus));
+    }
+
+    return ntStatus;
+} // FileWriteMapped
+
+//=============================================================================
+NTSTATUS
+CSaveData::FileWriteDirect
+(
+    _In_reads_bytes_(ulDataSize)    PBYTE   pData,
+    _In_                            ULONG   ulDataSize
+)
+/*++
+
+Routine Description:
+
+  Non-cached writes of the data at m_pFilePtr, aligned by m_Aligner: the
+  body of a run straight from the queue, the last sector padded from the
+  bounce buffer. m_pFilePtr moves on even if a write fails, so the data
+  that follows stays where the aligner put it.
+
+--*/
+{
+    PAGED_CODE();
 
-        m_pFilePtr->QuadPart += m_FileHeader.dwFormatLength;
+    NTSTATUS                    ntStatus;
+    CAVERN_ALIGNED_WRITE        writes[CAVERN_ALIGNER_MAX_WRITES];
+    ULONG                       count = 0;
+
+    ASSERT(m_Aligner.GetEnd() == (ULONGLONG)m_pFilePtr->QuadPart);
+
+    ntStatus = FileReserve(m_pFilePtr->QuadPart + ulDataSize + SAVEDATA_SECTOR_ALIGNMENT);
+    if (NT_SUCCESS(ntStatus))
+    {
+        ntStatus = m_Aligner.Plan(pData, ulDataSize, writes, &count);
+    }
+
+    for (ULONG i = 0; NT_SUCCESS(ntStatus) && i < count; i++)
+    {
+        IO_STATUS_BLOCK         ioStatusBlock;
+        LARGE_INTEGER           offset;
 
+        offset.QuadPart = writes[i].Offset;
         ntStatus = ZwWriteFile( m_FileHandle,
                                 NULL,
                                 NULL,
                                 NULL,
                                 &ioStatusBlock,
-                                &m_DataHeader,
-                                sizeof(m_DataHeader),
-                                m_pFilePtr,
+                                (PVOID)writes[i].Data,
+                                writes[i].Bytes,
+                                &offset,
                                 NULL);
-        if (!NT_SUCCESS(ntStatus))
-        {
-            DPF(D_TERSE, ("[CSaveData::FileWriteHeader : Write Data Header Error]"));
-        }
+    }
 
-        m_pFilePtr->QuadPart += sizeof(m_DataHeader);
+    if (NT_SUCCESS(ntStatus) || count)
+    {
+        m_pFilePtr->QuadPart += ulDataSize;
     }
-    else
+    if (!NT_SUCCESS(ntStatus))
     {
-        DPF(D_TERSE, ("[CSaveData::FileWriteHeader : File not open]"));
-        ntStatus = STATUS_INVALID_HANDLE;
+        DPF(D_TERSE, ("[CSaveData::FileWriteDirect : Error 0x%08x]", ntStatus));
     }
 
     return ntStatus;
-} // FileWriteHeader
+} // FileWriteDirect
+
+//=============================================================================
 NTSTATUS
-CSaveData::SetDeviceObject
+CSaveData::FileReserve
 (
-    _In_  PDEVICE_OBJECT        DeviceObject
+    _In_  ULONGLONG             ullEnd
 )
+/*++
+
+Routine Description:
+
+  Makes sure the file has space allocated up to ullEnd, growing it by a
+  whole m_ullReserveBytes extent when it does not. The mapped backend then
+  needs a section of the new size; the next MapWindow creates it.
+
+--*/
 {
     PAGED_CODE();
 
-    ASSERT(DeviceObject);
-
     NTSTATUS                    ntStatus = STATUS_SUCCESS;
-    
-    m_pDeviceObject = DeviceObject;
+    IO_STATUS_BLOCK             ioStatusBlock;
+    FILE_ALLOCATION_INFORMATION allocationInfo;
+
+    if (ullEnd <= m_ullReserved)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    allocationInfo.AllocationSize.QuadPart = ullEnd + m_ullReserveBytes;
+
+    ntStatus = ZwSetInformationFile( m_FileHandle,
+                                     &ioStatusBlock,
+                                     &allocationInfo,
+                                     sizeof(allocationInfo),
+                                     FileAllocationInformation);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::FileReserve : Could not allocate %I64u bytes]", allocationInfo.AllocationSize.QuadPart));
+        return ntStatus;
+    }
+
+    m_ullReserved = allocationInfo.AllocationSize.QuadPart;
+    UnmapWindow(TRUE);
+
     return ntStatus;
-}
+} // FileReserve
 
-PDEVICE_OBJECT
-CSaveData::GetDeviceObject
+//=============================================================================
+NTSTATUS
+CSaveData::MapWindow
 (
-    void
+    _In_  ULONGLONG             ullOffset
 )
+/*++
+
+Routine Description:
+
+  Maps the SAVEDATA_MAP_WINDOW aligned window of the file that holds
+  ullOffset, unless it is mapped already. The section spans the space
+  reserved so far; creating it extends the file to that size.
+
+--*/
 {
     PAGED_CODE();
 
-    return m_pDeviceObject;
-}
+    NTSTATUS                    ntStatus = STATUS_SUCCESS;
+    LARGE_INTEGER               sectionOffset;
+    SIZE_T                      viewBytes = 0;
+    PVOID                       view = NULL;
 
-#pragma code_seg()
-//=============================================================================
-PSAVEWORKER_PARAM
-CSaveData::GetNewWorkItem
-(
-    void
-)
-{
-    LARGE_INTEGER               timeOut = { 0 };
-    NTSTATUS                    ntStatus;
+    if (m_pView && ullOffset >= m_ullViewOffset && ullOffset < m_ullViewOffset + m_ViewBytes)
+    {
+        return STATUS_SUCCESS;
+    }
 
-    for (int i = 0; i < MAX_WORKER_ITEM_COUNT; i++)
+    UnmapWindow(FALSE);
+
+    if (ullOffset >= m_ullReserved)
     {
-        ntStatus =
-            KeWaitForSingleObject
-            (
-                &m_pWorkItems[i].EventDone,
-                Executive,
-                KernelMode,
-                FALSE,
-                &timeOut
-            );
-        if (STATUS_SUCCESS == ntStatus)
+        return STATUS_END_OF_FILE;
+    }
+
+    if (!m_SectionHandle)
+    {
+        OBJECT_ATTRIBUTES       objectAttributes;
+        LARGE_INTEGER           maximumSize;
+
+        InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+        maximumSize.QuadPart = m_ullReserved;
+
+        ntStatus = ZwCreateSection( &m_SectionHandle,
+                                    SECTION_MAP_READ | SECTION_MAP_WRITE,
+                                    &objectAttributes,
+                                    &maximumSize,
+                                    PAGE_READWRITE,
+                                    SEC_COMMIT,
+                                    m_FileHandle);
+        if (!NT_SUCCESS(ntStatus))
         {
-            if (m_pWorkItems[i].WorkItem)
-                return &(m_pWorkItems[i]);
-            else
-                return NULL;
+            DPF(D_TERSE, ("[CSaveData::MapWindow : Could not create section]"));
+            m_SectionHandle = NULL;
+            return ntStatus;
         }
     }
 
-    return NULL;
-} // GetNewWorkItem
-#pragma code_seg("PAGE")
+    sectionOffset.QuadPart = ullOffset & ~((ULONGLONG)SAVEDATA_MAP_WINDOW - 1);
+    viewBytes = (SIZE_T)min((ULONGLONG)SAVEDATA_MAP_WINDOW, m_ullReserved - sectionOffset.QuadPart);
+
+    ntStatus = ZwMapViewOfSection( m_SectionHandle,
+                                   ZwCurrentProcess(),
+                                   &view,
+                                   0,
+                                   0,
+                                   &sectionOffset,
+                                   &viewBytes,
+                                   ViewUnmap,
+                                   0,
+                                   PAGE_READWRITE);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::MapWindow : Could not map view at %I64u]", sectionOffset.QuadPart));
+        return ntStatus;
+    }
+
+    m_pView = (PUCHAR)view;
+    m_ullViewOffset = sectionOffset.QuadPart;
+    m_ViewBytes = (SIZE_T)min((ULONGLONG)viewBytes, m_ullReserved - m_ullViewOffset);
+
+    return ntStatus;
+} // MapWindow
 
 //=============================================================================
-NTSTATUS
-CSaveData::Initialize
+void
+CSaveData::UnmapWindow
 (
+    _In_  BOOL                  fCloseSection
 )
 {
     PAGED_CODE();
 
-    NTSTATUS            ntStatus = STATUS_SUCCESS;
-    WCHAR               szTemp[MAX_PATH];
-    size_t              cLen = 0;   
-    IO_STATUS_BLOCK     ioStatusBlock = {0};
-    HANDLE              fileHandle;
-    OBJECT_ATTRIBUTES   objectAttributes;
-    UNICODE_STRING      fileName;
+    if (m_pView)
+    {
+        ZwUnmapViewOfSection(ZwCurrentProcess(), m_pView);
+        m_pView = NULL;
+        m_ullViewOffset = 0;
+        m_ViewBytes = 0;
+    }
 
-    DPF_ENTER(("[CSaveData::Initialize]"));
+    if (fCloseSection && m_SectionHandle)
+    {
+        ZwClose(m_SectionHandle);
+        m_SectionHandle = NULL;
+    }
+} // UnmapWindow
 
-    m_ulStreamId++;
+//=============================================================================
+NTSTATUS
+CSaveData::FileFinish(void)
+/*++
 
-    RtlInitUnicodeString(&fileName, DEFAULT_FILE_FOLDER1);
-    InitializeObjectAttributes(
-            &objectAttributes,
-            &fileName,
-            OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
-            NULL,
-            NULL);
+Routine Description:
 
-    // Create the folder.
-    ntStatus = ZwCreateFile(
-            &fileHandle,
-            0,
-            &objectAttributes,
-            &ioStatusBlock,
-            NULL,
-            FILE_ATTRIBUTE_NORMAL,
-            0,
-            FILE_OPEN_IF,
-            FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
-            NULL,
-            0);
+  Ends the file at the data and the container's padding, which reads as
+  zeros: that drops the reserved space, the tail of the direct backend's
+  last sector and of the mapped section. Then writes the final header.
 
-    if (NT_SUCCESS(ntStatus))
+--*/
+{
+    PAGED_CODE();
+
+    NTSTATUS                    ntStatus;
+    IO_STATUS_BLOCK             ioStatusBlock;
+    FILE_END_OF_FILE_INFORMATION endOfFileInfo;
+
+    // The file cannot shrink under a mapped section.
+    UnmapWindow(TRUE);
+
+    endOfFileInfo.EndOfFile.QuadPart = m_pFilePtr->QuadPart +
+        CavernWavePadBytes(m_Container, m_pFilePtr->QuadPart - m_ulHeaderBytes);
+
+    ntStatus = ZwSetInformationFile( m_FileHandle,
+                                     &ioStatusBlock,
+                                     &endOfFileInfo,
+                                     sizeof(endOfFileInfo),
+                                     FileEndOfFileInformation);
+    if (NT_SUCCESS(ntStatus) && m_Backend != SaveDataBuffered)
+    {
+        FILE_ALLOCATION_INFORMATION allocationInfo;
+
+        allocationInfo.AllocationSize = endOfFileInfo.EndOfFile;
+        ntStatus = ZwSetInformationFile( m_FileHandle,
+                                         &ioStatusBlock,
+                                         &allocationInfo,
+                                         sizeof(allocationInfo),
+                                         FileAllocationInformation);
+        m_ullReserved = endOfFileInfo.EndOfFile.QuadPart;
+    }
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::FileFinish : Could not set the file size]"));
+    }
+
+    return FileWriteHeader();
+} // FileFinish
+
+//=============================================================================
+NTSTATUS
+CSaveData::FileWriteHeader(void)
+/*++
+
+Routine Description:
+
+  Writes the header for the data up to m_pFilePtr at the start of the file,
+  in place. The data offset does not depend on the data size, so this can
+  be done at any time. For the direct backend the header is padded to a
+  whole sector.
+
+--*/
+{
+    PAGED_CODE();
+
+    NTSTATUS                    ntStatus;
+
+    if (m_FileHandle && m_waveFormat)
+    {
+        IO_STATUS_BLOCK         ioStatusBlock;
+        LARGE_INTEGER           headerPtr;
+
+        ntStatus = CavernWaveBuildHeader( m_Container,
+                                          m_waveFormat,
+                                          m_ulFormatBytes,
+                                          (m_Backend == SaveDataDirect) ? SAVEDATA_SECTOR_ALIGNMENT : 0,
+                                          m_pFilePtr->QuadPart - m_ulHeaderBytes,
+                                          m_pHeader,
+                                          m_ulHeaderAlloc);
+        if (NT_SUCCESS(ntStatus))
+        {
+            headerPtr.QuadPart = 0;
+
+            ntStatus = ZwWriteFile( m_FileHandle,
+                                    NULL,
+                                    NULL,
+                                    NULL,
+                                    &ioStatusBlock,
+                                    m_pHeader,
+                                    m_ulHeaderBytes,
+                                    &headerPtr,
+                                    NULL);
+        }
+        if (!NT_SUCCESS(ntStatus))
+        {
+            DPF(D_TERSE, ("[CSaveData::FileWriteHeader : Write File Header Error]"));
+        }
+    }
+    else
+    {
+        DPF(D_TERSE, ("[CSaveData::FileWriteHeader : File not open]"));
+        ntStatus = STATUS_INVALID_HANDLE;
+    }
+
+    return ntStatus;
+} // FileWriteHeader
+
+//=============================================================================
+NTSTATUS
+CSaveData::SetDeviceObject
+(
+    _In_  PDEVICE_OBJECT        DeviceObject
+)
+{
+    PAGED_CODE();
+
+    ASSERT(DeviceObject);
+
+    NTSTATUS                    ntStatus = STATUS_SUCCESS;
+    
+    m_pDeviceObject = DeviceObject;
+    return ntStatus;
+}
+
+PDEVICE_OBJECT
+CSaveData::GetDeviceObject
+(
+    void
+)
+{
+    PAGED_CODE();
+
+    return m_pDeviceObject;
+}
+
+//=============================================================================
+NTSTATUS
+CSaveData::Initialize
+(
+    _In_  CAVERN_WAVE_CONTAINER Container,
+    _In_  SAVEDATA_BACKEND      Backend
+)
+{
+    PAGED_CODE();
+
+    NTSTATUS            ntStatus = STATUS_SUCCESS;
+    WCHAR               szTemp[MAX_PATH];
+    size_t              cLen = 0;   
+    IO_STATUS_BLOCK     ioStatusBlock = {0};
+    HANDLE              fileHandle;
+    OBJECT_ATTRIBUTES   objectAttributes;
+    UNICODE_STRING      fileName;
+
+    DPF_ENTER(("[CSaveData::Initialize]"));
+
+    m_ulStreamId++;
+
+    // The header size, and so the data offset, is fixed from here on.
+    //
+    m_Container = (Container < CavernWaveContainerCount) ? Container : CavernWaveRf64;
+    m_Backend = (Backend < SaveDataBackendCount) ? Backend : SaveDataBuffered;
+    m_ulHeaderBytes = m_waveFormat ?
+        CavernWaveHeaderBytes(m_Container, m_ulFormatBytes, (m_Backend == SaveDataDirect) ? SAVEDATA_SECTOR_ALIGNMENT : 0) : 0;
+    if (0 == m_ulHeaderBytes)
+    {
+        DPF(D_TERSE, ("[CSaveData::Initialize : No data format or format too large]"));
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    m_ullCheckpointBytes = max((ULONGLONG)m_waveFormat->nAvgBytesPerSec * SAVEDATA_CHECKPOINT_MS / 1000,
+                               (ULONGLONG)SAVEDATA_SLOT_SIZE);
+
+    // Reserve whole mapped windows at a time
+    m_ullReserveBytes = max((ULONGLONG)m_waveFormat->nAvgBytesPerSec * SAVEDATA_RESERVE_MS / 1000,
+                            (ULONGLONG)SAVEDATA_MIN_RESERVE);
+    m_ullReserveBytes = (m_ullReserveBytes + SAVEDATA_MAP_WINDOW - 1) & ~((ULONGLONG)SAVEDATA_MAP_WINDOW - 1);
+    m_ullReserved = 0;
+
+    // Header buffer of a page or more, which the pool hands out page
+    // aligned, as non-cached writes need
+    m_ulHeaderAlloc = max(m_ulHeaderBytes, (ULONG)PAGE_SIZE);
+    m_pHeader = (PUCHAR)
+        ExAllocatePool2
+        (
+            POOL_FLAG_NON_PAGED,
+            m_ulHeaderAlloc,
+            SAVEDATA_POOLTAG4
+        );
+    if (!m_pHeader)
+    {
+        DPF(D_TERSE, ("[Could not allocate memory for the file header]"));
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    if (m_Backend == SaveDataDirect)
+    {
+        ntStatus = m_Aligner.Init(SAVEDATA_SECTOR_ALIGNMENT, SAVEDATA_MAX_BATCH);
+        if (NT_SUCCESS(ntStatus))
+        {
+            ntStatus = m_Aligner.Reset(m_ulHeaderBytes);
+        }
+        if (!NT_SUCCESS(ntStatus))
+        {
+            DPF(D_TERSE, ("[Could not set up aligned writes]"));
+            return ntStatus;
+        }
+    }
+
+    RtlInitUnicodeString(&fileName, DEFAULT_FILE_FOLDER1);
+    InitializeObjectAttributes(
+            &objectAttributes,
+            &fileName,
+            OBJ_KERNEL_HANDLE | OBJ_CASE_INSENSITIVE,
+            NULL,
+            NULL);
+
+    // Create the folder.
+    ntStatus = ZwCreateFile(
+            &fileHandle,
+            0,
+            &objectAttributes,
+            &ioStatusBlock,
+            NULL,
+            FILE_ATTRIBUTE_NORMAL,
+            0,
+            FILE_OPEN_IF,
+            FILE_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+            NULL,
+            0);
+
+    if (NT_SUCCESS(ntStatus))
     {
         ZwClose(fileHandle);
         fileHandle = NULL;
@@ -517,7 +857,8 @@ CSaveData::Initialize
     {
         // Allocate data file name.
         //
-        RtlStringCchPrintfW(szTemp, MAX_PATH, L"%s_%s_%d.wav", DEFAULT_FILE_NAME, HOST_FILE_NAME, m_ulStreamId);
+        RtlStringCchPrintfW(szTemp, MAX_PATH, L"%s_%s_%d.%s", DEFAULT_FILE_NAME, HOST_FILE_NAME, m_ulStreamId,
+                            (m_Container == CavernWave64) ? WAVE64_FILE_EXTENSION : WAVE_FILE_EXTENSION);
         m_FileName.Length = 0;
         ntStatus = RtlStringCchLengthW (szTemp, sizeof(szTemp)/sizeof(szTemp[0]), &cLen);
     }
@@ -539,7 +880,7 @@ CSaveData::Initialize
         }
     }
 
-    // Allocate memory for data buffer.
+    // Allocate the capture buffer, sized for the stream format.
     //
     if (NT_SUCCESS(ntStatus))
     {
@@ -547,43 +888,32 @@ CSaveData::Initialize
         m_FileName.Length = (USHORT)wcslen(m_FileName.Buffer) * sizeof(WCHAR);
         DPF(D_BLAB, ("[New DataFile -- %S", m_FileName.Buffer));
 
-        m_pDataBuffer = (PBYTE)
-            ExAllocatePool2
-            (
-                POOL_FLAG_NON_PAGED,
-                m_ulBufferSize,
-                SAVEDATA_POOLTAG4
-            );
-        if (!m_pDataBuffer)
+        m_ulBufferSize = GetBufferSize(0);
+        ntStatus = m_Queue.Init(SAVEDATA_SLOT_SIZE, m_ulBufferSize / SAVEDATA_SLOT_SIZE);
+        if (!NT_SUCCESS(ntStatus))
         {
             DPF(D_TERSE, ("[Could not allocate memory for Saving Data]"));
-            ntStatus = STATUS_INSUFFICIENT_RESOURCES;
         }
     }
 
-    // Allocate memory for frame usage flags and m_pFilePtr.
+    // Allocate memory for m_pFilePtr.
     //
     if (NT_SUCCESS(ntStatus))
     {
-        m_fFrameUsed = (PBOOL)
+        m_pFilePtr = (PLARGE_INTEGER)
             ExAllocatePool2
             (
                 POOL_FLAG_NON_PAGED,
-                m_ulFrameCount * sizeof(BOOL) +
                 sizeof(LARGE_INTEGER),
                 SAVEDATA_POOLTAG2
             );
-        if (!m_fFrameUsed)
+        if (!m_pFilePtr)
         {
-            DPF(D_TERSE, ("[Could not allocate memory for frame flags]"));
+            DPF(D_TERSE, ("[Could not allocate memory for file pointer]"));
             ntStatus = STATUS_INSUFFICIENT_RESOURCES;
         }
     }
 
-    // Initialize the spinlock to synchronize access to the frames
-    //
-    KeInitializeSpinLock ( &m_FrameInUseSpinLock ) ;
-
     // Initialize the file mutex
     //
     KeInitializeMutex( &m_FileSync, 1 ) ;
@@ -592,11 +922,6 @@ CSaveData::Initialize
     //
     if (NT_SUCCESS(ntStatus))
     {
-        // m_fFrameUsed has additional memory to hold m_pFilePtr
-        //
-        m_pFilePtr = (PLARGE_INTEGER)
-            (((PBYTE) m_fFrameUsed) + m_ulFrameCount * sizeof(BOOL));
-
         // Create data file.
         InitializeObjectAttributes
         (
@@ -621,6 +946,9 @@ CSaveData::Initialize
 
         if (STATUS_SUCCESS == ntStatus)
         {
+            m_pFilePtr->QuadPart = m_ulHeaderBytes;
+            m_ullNextCheckpoint = m_ulHeaderBytes + m_ullCheckpointBytes;
+
             ntStatus = FileOpen(TRUE);
             if (NT_SUCCESS(ntStatus))
             {
@@ -633,121 +961,15 @@ CSaveData::Initialize
         }
     }
 
-    return ntStatus;
-} // Initialize
-
-//=============================================================================
-NTSTATUS
-CSaveData::InitializeWorkItems
-(
-    _In_  PDEVICE_OBJECT        DeviceObject
-)
-{
-    PAGED_CODE();
-
-    ASSERT(DeviceObject);
-
-    NTSTATUS                    ntStatus = STATUS_SUCCESS;
-
-    DPF_ENTER(("[CSaveData::InitializeWorkItems]"));
-
-    if (m_pWorkItems != NULL)
-    {
-        return ntStatus;
-    }
-
-    m_pWorkItems = (PSAVEWORKER_PARAM)
-        ExAllocatePool2
-        (
-            POOL_FLAG_NON_PAGED,
-            sizeof(SAVEWORKER_PARAM) * MAX_WORKER_ITEM_COUNT,
-            SAVEDATA_POOLTAG
-        );
-    if (m_pWorkItems)
-    {
-        for (int i = 0; i < MAX_WORKER_ITEM_COUNT; i++)
-        {
-
-            m_pWorkItems[i].WorkItem = IoAllocateWorkItem(DeviceObject);
-            if(m_pWorkItems[i].WorkItem == NULL)
-            {
-              return STATUS_INSUFFICIENT_RESOURCES;
-            }
-            KeInitializeEvent
-            (
-                &m_pWorkItems[i].EventDone,
-                NotificationEvent,
-                TRUE
-            );
-        }
-    }
-    else
+    // Start the thread that writes the queued data.
+    //
+    if (NT_SUCCESS(ntStatus))
     {
-        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        ntStatus = StartWriter();
     }
 
     return ntStatus;
-} // InitializeWorkItems
-
-//=============================================================================
-
-IO_WORKITEM_ROUTINE SaveFrameWorkerCallback;
-
-VOID
-SaveFrameWorkerCallback
-(
-    _In_        PDEVICE_OBJECT         pDeviceObject, 
-    _In_opt_    PVOID                  Context
-)
-{
-    UNREFERENCED_PARAMETER(pDeviceObject);
-
-    PAGED_CODE();
-
-    ASSERT(Context);
-
-    PSAVEWORKER_PARAM           pParam = (PSAVEWORKER_PARAM) Context;
-    PCSaveData                  pSaveData;
-    
-    if (NULL == pParam)
-    {
-        // This is completely unexpected, assert here.
-        //
-        ASSERT(pParam);
-        return;
-    }
-
-    DPF(D_VERBOSE, ("[SaveFrameWorkerCallback], %d", pParam->ulFrameNo));
-
-    ASSERT(pParam->pSaveData);
-    ASSERT(pParam->pSaveData->m_fFrameUsed);
-
-    if (pParam->WorkItem)
-    {
-        pSaveData = pParam->pSaveData;
-
-        if (STATUS_SUCCESS == KeWaitForSingleObject
-            (
-                &pSaveData->m_FileSync,
-                Executive,
-                KernelMode,
-                FALSE,
-                NULL
-            ))
-        {
-            if (NT_SUCCESS(pSaveData->FileOpen(FALSE)))
-            { 
-                pSaveData->FileWrite(pParam->pData, pParam->ulDataSize);
-                pSaveData->FileClose();
-            }
-            InterlockedExchange( (LONG *)&(pSaveData->m_fFrameUsed[pParam->ulFrameNo]), FALSE );
-
-            KeReleaseMutex( &pSaveData->m_FileSync, FALSE );
-        }
-    }
-
-    KeSetEvent(&pParam->EventDone, 0, FALSE);
-} // SaveFrameWorkerCallback
+} // Initialize
 
 //=============================================================================
 NTSTATUS
@@ -797,11 +1019,12 @@ CSaveData::SetDataFormat
 
         if(m_waveFormat)
         {
+            m_ulFormatBytes = (pwfx->wFormatTag == WAVE_FORMAT_PCM) ?
+                              sizeof( PCMWAVEFORMAT ) :
+                              sizeof( WAVEFORMATEX ) + pwfx->cbSize;
             RtlCopyMemory( m_waveFormat,
                            pwfx,
-                           (pwfx->wFormatTag == WAVE_FORMAT_PCM) ?
-                           sizeof( PCMWAVEFORMAT ) :
-                           sizeof( WAVEFORMATEX ) + pwfx->cbSize);
+                           m_ulFormatBytes);
         }
         else
         {
@@ -821,60 +1044,40 @@ CSaveData::SetMaxWriteSize
     PAGED_CODE();
     
     NTSTATUS    ntStatus    = STATUS_SUCCESS;
-    ULONG       bufferSize  = 0;
-    PBYTE       buffer      = NULL;
+    ULONG       bufferSize  = GetBufferSize(ulMaxWriteSize);
  
     DPF_ENTER(("[CSaveData::SetMaxWriteSize]"));
 
-    // 
-    // Compute new buffer size.
-    //
-    ntStatus = RtlULongMult(ulMaxWriteSize, DEFAULT_FRAME_COUNT, &bufferSize);
-    if (!NT_SUCCESS(ntStatus))
+    if (bufferSize <= m_ulBufferSize)
     {
-        DPF(D_TERSE, ("[Could not allocate memory for Saving Data, MaxWriteSize %u is too big]", ulMaxWriteSize));
-        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
         goto Done;
     }
 
     //
-    // Alloc memory for buffer.
+    // The stream is not running yet: stop the writer, which writes out
+    // anything queued, and start it again on the larger buffer.
     //
-    buffer = (PBYTE)
-        ExAllocatePool2
-        (
-            POOL_FLAG_NON_PAGED,
-            bufferSize,
-            SAVEDATA_POOLTAG4
-        );
-    if (!buffer)
+    StopWriter();
+
+    ntStatus = m_Queue.Init(SAVEDATA_SLOT_SIZE, bufferSize / SAVEDATA_SLOT_SIZE);
+    if (!NT_SUCCESS(ntStatus))
     {
-        DPF(D_TERSE, ("[Could not allocate memory for Saving Data]"));
-        ntStatus = STATUS_INSUFFICIENT_RESOURCES;
+        DPF(D_TERSE, ("[Could not allocate memory for Saving Data, MaxWriteSize %u]", ulMaxWriteSize));
+        m_ulBufferSize = 0;
         goto Done;
     }
 
-    //
-    // Free old one.
-    //
-    if (m_pDataBuffer)
+    m_ulBufferSize = bufferSize;
+    m_ullReportedDrops = 0;
+
+    if (m_bInitialized)
     {
-        ExFreePoolWithTag(m_pDataBuffer, SAVEDATA_POOLTAG4);
-        m_pDataBuffer = NULL;
+        ntStatus = StartWriter();
     }
 
-    //
-    // Init new buffer settings.
-    //
-    m_pDataBuffer  = buffer;
-    m_ulBufferSize = bufferSize;
-    m_ulFrameSize  = ulMaxWriteSize;
-    
-    ntStatus = STATUS_SUCCESS;
-
 Done:
     return ntStatus;
-} // SetDataFormat
+} // SetMaxWriteSize
 
 //=============================================================================
 void
@@ -893,64 +1096,333 @@ CSaveData::ReadData
 } // ReadData
 
 //=============================================================================
-#pragma code_seg()
-void
-CSaveData::SaveFrame
+ULONG
+CSaveData::GetBufferSize
 (
-    _In_ ULONG                  ulFrameNo,
-    _In_ ULONG                  ulDataSize
+    _In_ ULONG                  ulMaxWriteSize
 )
+/*++
+
+Routine Description:
+
+  Buffer for SAVEDATA_BUFFER_MS of the stream, and no less than
+  ulMaxWriteSize, in whole slots of a power-of-two count.
+
+--*/
 {
-    PSAVEWORKER_PARAM           pParam = NULL;
+    PAGED_CODE();
 
-    DPF_ENTER(("[CSaveData::SaveFrame]"));
+    ULONGLONG   bufferSize = DEFAULT_BUFFER_SIZE;
+    ULONG       slots = 1;
 
-    pParam = GetNewWorkItem();
-    if (pParam)
+    if (m_waveFormat)
     {
-        pParam->pSaveData = this;
-        pParam->ulFrameNo = ulFrameNo;
-        pParam->ulDataSize = ulDataSize;
-        pParam->pData = m_pDataBuffer + ulFrameNo * m_ulFrameSize;
-        KeResetEvent(&pParam->EventDone);
-        IoQueueWorkItem(pParam->WorkItem, SaveFrameWorkerCallback,
-                        CriticalWorkQueue, (PVOID)pParam);
+        bufferSize = max(bufferSize, (ULONGLONG)m_waveFormat->nAvgBytesPerSec * SAVEDATA_BUFFER_MS / 1000);
     }
-} // SaveFrame
-#pragma code_seg("PAGE")
+    bufferSize = max(bufferSize, (ULONGLONG)ulMaxWriteSize);
+
+    while ((ULONGLONG)slots * SAVEDATA_SLOT_SIZE < bufferSize && slots < CAVERN_CAPTURE_MAX_SLOTS)
+    {
+        slots <<= 1;
+    }
+
+    return slots * SAVEDATA_SLOT_SIZE;
+} // GetBufferSize
+
+//=============================================================================
+NTSTATUS
+CSaveData::StartWriter
+(
+    void
+)
+{
+    PAGED_CODE();
+
+    NTSTATUS                    ntStatus;
+    HANDLE                      threadHandle = NULL;
+    OBJECT_ATTRIBUTES           objectAttributes;
+
+    DPF_ENTER(("[CSaveData::StartWriter]"));
+
+    if (m_pWriterThread)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    // Wake the writer once a quarter of the buffer is waiting; it also
+    // looks every SAVEDATA_WRITER_PERIOD_MS.
+    m_ulWakeSlots = m_Queue.GetSlotCount() / 4;
+    if (m_ulWakeSlots == 0)
+    {
+        m_ulWakeSlots = 1;
+    }
+    m_fStopWriter = FALSE;
+    KeClearEvent(&m_WakeEvent);
+
+    InitializeObjectAttributes(&objectAttributes, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+
+    ntStatus = PsCreateSystemThread
+        (
+            &threadHandle,
+            THREAD_ALL_ACCESS,
+            &objectAttributes,
+            NULL,
+            NULL,
+            WriterThread,
+            this
+        );
+    if (!NT_SUCCESS(ntStatus))
+    {
+        DPF(D_TERSE, ("[CSaveData::StartWriter : Could not create writer thread]"));
+        return ntStatus;
+    }
+
+    ntStatus = ObReferenceObjectByHandle
+        (
+            threadHandle,
+            THREAD_ALL_ACCESS,
+            *PsThreadType,
+            KernelMode,
+            (PVOID *)&m_pWriterThread,
+            NULL
+        );
+    if (!NT_SUCCESS(ntStatus))
+    {
+        // Without the object the thread cannot be waited for later, so
+        // stop it now.
+        m_fStopWriter = TRUE;
+        KeSetEvent(&m_WakeEvent, 0, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        m_pWriterThread = NULL;
+    }
+
+    ZwClose(threadHandle);
+
+    return ntStatus;
+} // StartWriter
+
 //=============================================================================
 void
-CSaveData::WaitAllWorkItems
+CSaveData::StopWriter
 (
     void
 )
 {
     PAGED_CODE();
 
-    DPF_ENTER(("[CSaveData::WaitAllWorkItems]"));
+    DPF_ENTER(("[CSaveData::StopWriter]"));
 
-    // Save the last partially-filled frame
-    if (m_ulBufferOffset > m_ulFrameIndex * m_ulFrameSize)
+    if (m_pWriterThread)
     {
-        ULONG size;
-        
-        size = m_ulBufferOffset - m_ulFrameIndex * m_ulFrameSize;
-        SaveFrame(m_ulFrameIndex, size);
+        m_fStopWriter = TRUE;
+        KeSetEvent(&m_WakeEvent, 0, FALSE);
+
+        KeWaitForSingleObject
+        (
+            m_pWriterThread,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+        );
+
+        ObDereferenceObject(m_pWriterThread);
+        m_pWriterThread = NULL;
     }
-    
-    for (int i = 0; i < MAX_WORKER_ITEM_COUNT; i++)
+} // StopWriter
+
+//=============================================================================
+VOID
+CSaveData::WriterThread
+(
+    _In_ PVOID                  Context
+)
+/*++
+
+Routine Description:
+
+  Writer thread. Sleeps until woken or for SAVEDATA_WRITER_PERIOD_MS,
+  drains the queue and keeps the file open between writes. After a stop
+  request it drains the queue once more and closes the file.
+
+--*/
+{
+    PAGED_CODE();
+
+    PCSaveData                  pSaveData = (PCSaveData)Context;
+    LARGE_INTEGER               timeOut;
+    BOOL                        fStop = FALSE;
+
+    // Run ahead of ordinary threads so that disk latency, not scheduling,
+    // is what the buffer has to absorb.
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+
+    timeOut.QuadPart = -10000LL * SAVEDATA_WRITER_PERIOD_MS;
+
+    while (!fStop)
     {
-        DPF(D_VERBOSE, ("[Waiting for WorkItem] %d", i));
         KeWaitForSingleObject
         (
-            &(m_pWorkItems[i].EventDone),
+            &pSaveData->m_WakeEvent,
+            Executive,
+            KernelMode,
+            FALSE,
+            &timeOut
+        );
+
+        fStop = pSaveData->m_fStopWriter;
+
+        pSaveData->DrainQueue();
+        KeSetEvent(&pSaveData->m_IdleEvent, 0, FALSE);
+    }
+
+    if (STATUS_SUCCESS == KeWaitForSingleObject
+        (
+            &pSaveData->m_FileSync,
             Executive,
             KernelMode,
             FALSE,
             NULL
+        ))
+    {
+        // Trim the file and write the last header; the file is only open
+        // if data was written.
+        if (pSaveData->m_FileHandle)
+        {
+            pSaveData->FileFinish();
+        }
+        pSaveData->FileClose();
+        KeReleaseMutex(&pSaveData->m_FileSync, FALSE);
+    }
+
+    PsTerminateSystemThread(STATUS_SUCCESS);
+} // WriterThread
+
+//=============================================================================
+void
+CSaveData::DrainQueue
+(
+    void
+)
+{
+    PAGED_CODE();
+
+    CAVERN_CAPTURE_RUN          run;
+
+    while (m_Queue.Peek(&run, SAVEDATA_MAX_BATCH))
+    {
+        DPF(D_VERBOSE, ("[CSaveData::DrainQueue] %lu bytes, %lu slots", run.Bytes, run.Slots));
+
+        if (STATUS_SUCCESS == KeWaitForSingleObject
+            (
+                &m_FileSync,
+                Executive,
+                KernelMode,
+                FALSE,
+                NULL
+            ))
+        {
+            if (NT_SUCCESS(FileOpen(FALSE)))
+            {
+                FileWrite(run.Data, run.Bytes);
+
+                if ((ULONGLONG)m_pFilePtr->QuadPart >= m_ullNextCheckpoint)
+                {
+                    FileWriteHeader();
+                    m_ullNextCheckpoint = m_pFilePtr->QuadPart + m_ullCheckpointBytes;
+                }
+            }
+
+            KeReleaseMutex(&m_FileSync, FALSE);
+        }
+
+        m_Queue.Release(&run);
+    }
+} // DrainQueue
+
+//=============================================================================
+void
+CSaveData::ReportDrops
+(
+    void
+)
+{
+    PAGED_CODE();
+
+    ULONGLONG                   dropped = m_Queue.GetDroppedBytes();
+
+    if (dropped != m_ullReportedDrops)
+    {
+        DPF(D_TERSE, ("[CSaveData : %I64u bytes dropped in %lu writes, %lu of %lu slots used at most]",
+                      dropped - m_ullReportedDrops,
+                      m_Queue.GetDrops(),
+                      m_Queue.GetHighWater(),
+                      m_Queue.GetSlotCount()));
+        m_ullReportedDrops = dropped;
+    }
+} // ReportDrops
+
+//=============================================================================
+void
+CSaveData::WaitAllWrites
+(
+    void
+)
+{
+    PAGED_CODE();
+
+    LARGE_INTEGER               timeOut;
+
+    DPF_ENTER(("[CSaveData::WaitAllWrites]"));
+
+    // Save the last partially-filled slot
+    m_Queue.Flush();
+
+    if (!m_pWriterThread)
+    {
+        return;
+    }
+
+    // The idle event may be left over from before the flush, so check the
+    // queue itself after every wait.
+    timeOut.QuadPart = -10000LL * SAVEDATA_WRITER_PERIOD_MS;
+
+    while (m_Queue.GetPendingSlots())
+    {
+        KeClearEvent(&m_IdleEvent);
+        KeSetEvent(&m_WakeEvent, 0, FALSE);
+        KeWaitForSingleObject
+        (
+            &m_IdleEvent,
+            Executive,
+            KernelMode,
+            FALSE,
+            &timeOut
         );
     }
-} // WaitAllWorkItems
+
+    // Checkpoint the header while the stream is stopped; the writer is
+    // idle, so m_pFilePtr holds still.
+    if (STATUS_SUCCESS == KeWaitForSingleObject
+        (
+            &m_FileSync,
+            Executive,
+            KernelMode,
+            FALSE,
+            NULL
+        ))
+    {
+        if (m_FileHandle)
+        {
+            FileWriteHeader();
+            m_ullNextCheckpoint = m_pFilePtr->QuadPart + m_ullCheckpointBytes;
+        }
+
+        KeReleaseMutex(&m_FileSync, FALSE);
+    }
+
+    ReportDrops();
+} // WaitAllWrites
 
 #pragma code_seg()
 //=============================================================================
@@ -963,10 +1435,6 @@ CSaveData::WriteData
 {
     ASSERT(pBuffer);
 
-    BOOL                        fSaveFrame = FALSE;
-    ULONG                       ulSaveFrameIndex = 0;
-    KIRQL                       oldIrql;
-
     // If stream writing is disabled, then exit.
     //
     if (m_fWriteDisabled)
@@ -976,85 +1444,20 @@ CSaveData::WriteData
 
     DPF_ENTER(("[CSaveData::WriteData ulByteCount=%lu]", ulByteCount));
 
-    if( 0 == ulByteCount )
+    if( 0 == ulByteCount || !m_Queue.IsInitialized() )
     {
         return;
     }
 
-    // The logic below assumes that write size is <= than frame size.
-    if (ulByteCount > m_ulFrameSize)
+    // Never waits: what does not fit is dropped and counted by the queue.
+    if (m_Queue.Write(pBuffer, ulByteCount) != ulByteCount)
     {
-        ulByteCount = m_ulFrameSize;
+        DPF(D_BLAB, ("[Capture buffer full, data dropped]"));
     }
-        
-    // Check to see if this frame is available.
-    KeAcquireSpinLock(&m_FrameInUseSpinLock, &oldIrql);
-    if (!m_fFrameUsed[m_ulFrameIndex])
-    {
-        KeReleaseSpinLock(&m_FrameInUseSpinLock, oldIrql );
-
-        ULONG ulWriteBytes = ulByteCount;
-
-        if( (m_ulBufferSize - m_ulBufferOffset) < ulWriteBytes )
-        {
-            ulWriteBytes = m_ulBufferSize - m_ulBufferOffset;
-        }
-
-        RtlCopyMemory(m_pDataBuffer + m_ulBufferOffset, pBuffer, ulWriteBytes);
-        m_ulBufferOffset += ulWriteBytes;
 
-        // Check to see if we need to save this frame
-        if (m_ulBufferOffset >= ((m_ulFrameIndex + 1) * m_ulFrameSize))
-        {
-            fSaveFrame = TRUE;
-        }
-
-        // Loop the buffer, if we reached the end.
-        if (m_ulBufferOffset == m_ulBufferSize)
-        {
-            fSaveFrame = TRUE;
-            m_ulBufferOffset = 0;
-        }
-
-        if (fSaveFrame)
-        {
-            InterlockedExchange( (LONG *)&(m_fFrameUsed[m_ulFrameIndex]), TRUE );
-            ulSaveFrameIndex = m_ulFrameIndex;
-            m_ulFrameIndex = (m_ulFrameIndex + 1) % m_ulFrameCount;
-        }
-
-        // Write the left over if the next frame is available.
-        if (ulWriteBytes != ulByteCount)
-        {
-            KeAcquireSpinLock(&m_FrameInUseSpinLock, &oldIrql );
-            if (!m_fFrameUsed[m_ulFrameIndex])
-            {
-                KeReleaseSpinLock(&m_FrameInUseSpinLock, oldIrql );
-                RtlCopyMemory
-                (
-                    m_pDataBuffer + m_ulBufferOffset,
-                    pBuffer + ulWriteBytes,
-                    ulByteCount - ulWriteBytes
-                );
-                
-                m_ulBufferOffset += ulByteCount - ulWriteBytes;
-            }
-            else
-            {
-                KeReleaseSpinLock(&m_FrameInUseSpinLock, oldIrql);
-                DPF(D_BLAB, ("[Frame overflow, next frame is in use]"));
-            }
-        }
-
-        if (fSaveFrame)
-        {
-            SaveFrame(ulSaveFrameIndex, m_ulFrameSize);
-        }
-    }
-    else
+    if (m_Queue.GetPendingSlots() >= m_ulWakeSlots)
     {
-        KeReleaseSpinLock(&m_FrameInUseSpinLock, oldIrql );
-        DPF(D_BLAB, ("[Frame %d is in use]", m_ulFrameIndex));
+        KeSetEvent(&m_WakeEvent, 0, FALSE);
     }
 
 } // WriteData
@@ -16,6 +16,10 @@ to save data to disk.
 #ifndef _SIMPLEAUDIOSAMPLE_SAVEDATA_H
 #define _SIMPLEAUDIOSAMPLE_SAVEDATA_H
 
+#include "CavernCaptureQueue.h"
+#include "CavernCaptureAligner.h"
+#include "CavernWaveHeader.h"
+
 //-----------------------------------------------------------------------------
 //  Forward declaration
 //-----------------------------------------------------------------------------
@@ -24,42 +28,17 @@ typedef CSaveData *PCSaveData;
 
 
 //-----------------------------------------------------------------------------
-//  Structs
+//  Types
 //-----------------------------------------------------------------------------
 
-// Parameter to workitem.
-#include <pshpack1.h>
-typedef struct _SAVEWORKER_PARAM {
-    PIO_WORKITEM     WorkItem;
-    ULONG            ulFrameNo;
-    ULONG            ulDataSize;
-    PBYTE            pData;
-    PCSaveData       pSaveData;
-    KEVENT           EventDone;
-} SAVEWORKER_PARAM;
-typedef SAVEWORKER_PARAM *PSAVEWORKER_PARAM;
-#include <poppack.h>
-
-// wave file header.
-#include <pshpack1.h>
-typedef struct _OUTPUT_FILE_HEADER
-{
-    DWORD           dwRiff;
-    DWORD           dwFileSize;
-    DWORD           dwWave;
-    DWORD           dwFormat;
-    DWORD           dwFormatLength;
-} OUTPUT_FILE_HEADER;
-typedef OUTPUT_FILE_HEADER *POUTPUT_FILE_HEADER;
-
-typedef struct _OUTPUT_DATA_HEADER
+// How the writer thread puts the data in the file
+typedef enum _SAVEDATA_BACKEND
 {
-    DWORD           dwData;
-    DWORD           dwDataLength;
-} OUTPUT_DATA_HEADER;
-typedef OUTPUT_DATA_HEADER *POUTPUT_DATA_HEADER;
-
-#include <poppack.h>
+    SaveDataBuffered = 0,       // ZwWriteFile through the cache
+    SaveDataMapped,             // copies into a sliding view of the file
+    SaveDataDirect,             // non-cached, sector-aligned ZwWriteFile
+    SaveDataBackendCount
+} SAVEDATA_BACKEND;
 
 //-----------------------------------------------------------------------------
 //  Classes
@@ -68,35 +47,50 @@ typedef OUTPUT_DATA_HEADER *POUTPUT_DATA_HEADER;
 ///////////////////////////////////////////////////////////////////////////////
 // CSaveData
 //   Saves the wave data to disk.
+//   WriteData queues the data into a CCavernCaptureQueue at DPC level; one
+//   writer thread per stream drains it to the file in large writes and
+//   rewrites the fixed-size header in place at checkpoints. The mapped and
+//   direct backends allocate file space ahead of the data, in extents.
 //
-IO_WORKITEM_ROUTINE SaveFrameWorkerCallback;
-
 class CSaveData
 {
 protected:
     UNICODE_STRING              m_FileName;         // DataFile name.
     HANDLE                      m_FileHandle;       // DataFile handle.
-    PBYTE                       m_pDataBuffer;      // Data buffer.
     ULONG                       m_ulBufferSize;     // Total buffer size.
-
-    ULONG                       m_ulFrameIndex;     // Current Frame.
-    ULONG                       m_ulFrameCount;     // Frame count.
-    ULONG                       m_ulFrameSize;
-    ULONG                       m_ulBufferOffset;   // index in buffer.
-    PBOOL                       m_fFrameUsed;       // Frame usage table.
-    KSPIN_LOCK                  m_FrameInUseSpinLock; // Spinlock for synch.
+    ULONG                       m_ulWakeSlots;      // Pending slots that wake the writer.
+    CCavernCaptureQueue         m_Queue;            // DPC to writer thread hand-off.
+    ULONGLONG                   m_ullReportedDrops; // Dropped bytes already reported.
+
+    PKTHREAD                    m_pWriterThread;    // Writer thread object.
+    KEVENT                      m_WakeEvent;        // Data pending or stop requested.
+    KEVENT                      m_IdleEvent;        // Writer found the queue empty.
+    volatile BOOL               m_fStopWriter;
     KMUTEX                      m_FileSync;         // Synchronizes file access
 
     OBJECT_ATTRIBUTES           m_objectAttributes; // Used for opening file.
 
-    OUTPUT_FILE_HEADER          m_FileHeader;
+    CAVERN_WAVE_CONTAINER       m_Container;        // RIFF, RF64 or Wave64.
+    PUCHAR                      m_pHeader;          // Page aligned for direct writes.
+    ULONG                       m_ulHeaderAlloc;
+    ULONG                       m_ulHeaderBytes;    // Offset of the data.
     PWAVEFORMATEX               m_waveFormat;
-    OUTPUT_DATA_HEADER          m_DataHeader;
-    PLARGE_INTEGER              m_pFilePtr;
+    ULONG                       m_ulFormatBytes;    // fmt chunk payload.
+    PLARGE_INTEGER              m_pFilePtr;         // End of the data written.
+    ULONGLONG                   m_ullCheckpointBytes; // Data between header updates.
+    ULONGLONG                   m_ullNextCheckpoint;  // File offset of the next one.
+
+    SAVEDATA_BACKEND            m_Backend;
+    ULONGLONG                   m_ullReserveBytes;  // Extent allocated ahead of the data.
+    ULONGLONG                   m_ullReserved;      // File space allocated so far.
+    HANDLE                      m_SectionHandle;    // Mapped: section over the reserved file.
+    PUCHAR                      m_pView;            // Mapped: window into the section,
+    ULONGLONG                   m_ullViewOffset;    //   mapped in the writer thread's
+    SIZE_T                      m_ViewBytes;        //   (the system) process.
+    CCavernCaptureAligner       m_Aligner;          // Direct: sector-aligned writes.
 
     static PDEVICE_OBJECT       m_pDeviceObject;
     static ULONG                m_ulStreamId;
-    static PSAVEWORKER_PARAM    m_pWorkItems;
 
     BOOL                        m_fWriteDisabled;
 
@@ -106,24 +100,14 @@ public:
     CSaveData();
     ~CSaveData();
 
-    static NTSTATUS             InitializeWorkItems
-    (
-        _In_  PDEVICE_OBJECT    DeviceObject
-    );
-    static void                 DestroyWorkItems
-    (
-        void
-    );
     void                        Disable
     (
         _In_ BOOL               fDisable
     );
-    static PSAVEWORKER_PARAM    GetNewWorkItem
-    (
-        void
-    );
     NTSTATUS                    Initialize
     (
+        _In_  CAVERN_WAVE_CONTAINER Container,
+        _In_  SAVEDATA_BACKEND  Backend
     );
 	static NTSTATUS             SetDeviceObject
 	(
@@ -146,7 +130,7 @@ public:
     (
         _In_  ULONG             ulMaxWriteSize
     );  
-    void                        WaitAllWorkItems
+    void                        WaitAllWrites
     (
         void
     );
@@ -174,15 +158,55 @@ private:
     (
         void
     );
+    NTSTATUS                    FileWriteMapped
+    (
+        _In_reads_bytes_(ulDataSize)    PBYTE   pData,
+        _In_                            ULONG   ulDataSize
+    );
+    NTSTATUS                    FileWriteDirect
+    (
+        _In_reads_bytes_(ulDataSize)    PBYTE   pData,
+        _In_                            ULONG   ulDataSize
+    );
+    NTSTATUS                    FileReserve
+    (
+        _In_  ULONGLONG         ullEnd
+    );
+    NTSTATUS                    FileFinish
+    (
+        void
+    );
+    NTSTATUS                    MapWindow
+    (
+        _In_  ULONGLONG         ullOffset
+    );
+    void                        UnmapWindow
+    (
+        _In_  BOOL              fCloseSection
+    );
 
-    void                        SaveFrame
+    ULONG                       GetBufferSize
+    (
+        _In_ ULONG              ulMaxWriteSize
+    );
+    NTSTATUS                    StartWriter
     (
-        _In_ ULONG              ulFrameNo,
-        _In_ ULONG              ulDataSize
+        void
+    );
+    void                        StopWriter
+    (
+        void
+    );
+    void                        DrainQueue
+    (
+        void
+    );
+    void                        ReportDrops
+    (
+        void
     );
 
-    friend
-    IO_WORKITEM_ROUTINE         SaveFrameWorkerCallback;
+    static KSTART_ROUTINE       WriterThread;
 };
 typedef CSaveData *PCSaveData;
 
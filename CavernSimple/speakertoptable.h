@@ -131,6 +131,26 @@ PCPROPERTY_ITEM SpeakerPropertiesMute[] =
 
 DEFINE_PCAUTOMATION_TABLE_PROP(AutomationSpeakerMute, SpeakerPropertiesMute);
 
+//=============================================================================
+static
+PCPROPERTY_ITEM SpeakerPropertiesPeakMeter[] =
+{
+  {
+    &KSPROPSETID_Audio,
+    KSPROPERTY_AUDIO_PEAKMETER2,
+    KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+    PropertyHandler_SpeakerTopology
+  },
+  {
+    &KSPROPSETID_CavernMeter,
+    KSPROPERTY_CAVERN_METER_RMS,
+    KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_BASICSUPPORT,
+    PropertyHandler_SpeakerTopology
+  }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(AutomationSpeakerPeakMeter, SpeakerPropertiesPeakMeter);
+
 //=============================================================================
 static
 PCNODE_DESCRIPTOR SpeakerTopologyNodes[] =
@@ -148,11 +168,19 @@ PCNODE_DESCRIPTOR SpeakerTopologyNodes[] =
       &AutomationSpeakerMute,       // AutomationTable
       &KSNODETYPE_MUTE,               // Type
       &KSAUDFNAME_MASTER_MUTE            // Name
+    },
+    // KSNODE_TOPO_WAVEOUT_PEAKMETER
+    {
+      0,                              // Flags
+      &AutomationSpeakerPeakMeter,    // AutomationTable
+      &KSNODETYPE_PEAKMETER,          // Type
+      &KSAUDFNAME_PEAKMETER           // Name
     }
 };
 
 C_ASSERT(KSNODE_TOPO_VOLUME == 0);
 C_ASSERT(KSNODE_TOPO_MUTE == 1);
+C_ASSERT(KSNODE_TOPO_WAVEOUT_PEAKMETER == 2);
 
 static
 PCCONNECTION_DESCRIPTOR SpeakerTopoMiniportConnections[] =
@@ -160,7 +188,8 @@ PCCONNECTION_DESCRIPTOR SpeakerTopoMiniportConnections[] =
     //  FromNode,                 FromPin,                    ToNode,                 ToPin
     {   PCFILTER_NODE,            KSPIN_TOPO_WAVEOUT_SOURCE,    KSNODE_TOPO_VOLUME,     1 },
     {   KSNODE_TOPO_VOLUME,       0,                          KSNODE_TOPO_MUTE,       1 },
-    {   KSNODE_TOPO_MUTE,         0,                          PCFILTER_NODE,          KSPIN_TOPO_LINEOUT_DEST }
+    {   KSNODE_TOPO_MUTE,         0,                          KSNODE_TOPO_WAVEOUT_PEAKMETER, 1 },
+    {   KSNODE_TOPO_WAVEOUT_PEAKMETER, 0,                     PCFILTER_NODE,          KSPIN_TOPO_LINEOUT_DEST }
 };
 
 //=============================================================================
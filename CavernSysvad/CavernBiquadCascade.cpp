@@ -0,0 +1,504 @@
+/***************************************************************************
+ * CavernBiquadCascade.cpp
+ *
+ * Per-channel biquad cascade implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernBiquadCascade.h"
+
+// MXCSR flush-to-zero and denormals-are-zero
+#define CAVERN_MXCSR_FTZ_DAZ    0x8040
+
+NTSTATUS CavernBiquadDesign(
+    _In_ CAVERN_BIQUAD_TYPE Type,
+    _In_ double Frequency,
+    _In_ double Q,
+    _In_ double GainDb,
+    _In_ ULONG SampleRate,
+    _Out_ PCAVERN_BIQUAD_COEFFICIENTS Coefficients
+)
+{
+    if (!SampleRate || !(Frequency > 0.0) || !(Frequency < SampleRate / 2.0) || !(Q > 0.0) ||
+        Type >= CavernBiquadTypeCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    const double pi = 3.14159265358979323846;
+    double w0 = 2.0 * pi * Frequency / SampleRate;
+    double cosw = cos(w0);
+    double alpha = sin(w0) / (2.0 * Q);
+    double a = pow(10.0, GainDb / 40.0);
+    double root = 2.0 * sqrt(a) * alpha;
+    double b0, b1, b2, a0, a1, a2;
+
+    switch (Type) {
+    case CavernBiquadPeak:
+        b0 = 1.0 + alpha * a;
+        b1 = -2.0 * cosw;
+        b2 = 1.0 - alpha * a;
+        a0 = 1.0 + alpha / a;
+        a1 = -2.0 * cosw;
+        a2 = 1.0 - alpha / a;
+        break;
+    case CavernBiquadLowShelf:
+        b0 = a * ((a + 1.0) - (a - 1.0) * cosw + root);
+        b1 = 2.0 * a * ((a - 1.0) - (a + 1.0) * cosw);
+        b2 = a * ((a + 1.0) - (a - 1.0) * cosw - root);
+        a0 = (a + 1.0) + (a - 1.0) * cosw + root;
+        a1 = -2.0 * ((a - 1.0) + (a + 1.0) * cosw);
+        a2 = (a + 1.0) + (a - 1.0) * cosw - root;
+        break;
+    case CavernBiquadHighShelf:
+        b0 = a * ((a + 1.0) + (a - 1.0) * cosw + root);
+        b1 = -2.0 * a * ((a - 1.0) + (a + 1.0) * cosw);
+        b2 = a * ((a + 1.0) + (a - 1.0) * cosw - root);
+        a0 = (a + 1.0) - (a - 1.0) * cosw + root;
+        a1 = 2.0 * ((a - 1.0) - (a + 1.0) * cosw);
+        a2 = (a + 1.0) - (a - 1.0) * cosw - root;
+        break;
+    case CavernBiquadLowPass:
+        b0 = (1.0 - cosw) / 2.0;
+        b1 = 1.0 - cosw;
+        b2 = b0;
+        a0 = 1.0 + alpha;
+        a1 = -2.0 * cosw;
+        a2 = 1.0 - alpha;
+        break;
+    default:
+        b0 = (1.0 + cosw) / 2.0;
+        b1 = -(1.0 + cosw);
+        b2 = b0;
+        a0 = 1.0 + alpha;
+        a1 = -2.0 * cosw;
+        a2 = 1.0 - alpha;
+        break;
+    }
+
+    Coefficients->B0 = b0 / a0;
+    Coefficients->B1 = b1 / a0;
+    Coefficients->B2 = b2 / a0;
+    Coefficients->A1 = a1 / a0;
+    Coefficients->A2 = a2 / a0;
+    return STATUS_SUCCESS;
+}
+
+//
+// Every band of every channel passes the signal unchanged.
+//
+static VOID ClearBank(_Out_ PCAVERN_BIQUAD_BANK Bank)
+{
+    RtlZeroMemory(Bank, sizeof(*Bank));
+    for (ULONG b = 0; b < CAVERN_BIQUAD_MAX_BANDS; b++) {
+        for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+            Bank->B0[b][c] = 1.0;
+        }
+    }
+}
+
+CCavernBiquadCascade::CCavernBiquadCascade()
+    : m_ulChannels(0),
+      m_AllowSimd(FALSE),
+      m_lActive(0),
+      m_lPending(-1),
+      m_lPublished(0),
+      m_lStaging(-1),
+      m_pBanks(NULL),
+      m_pBlock(NULL)
+{
+    RtlZeroMemory(m_Z1, sizeof(m_Z1));
+    RtlZeroMemory(m_Z2, sizeof(m_Z2));
+}
+
+CCavernBiquadCascade::~CCavernBiquadCascade()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernBiquadCascade::Init(
+    _In_ ULONG Channels,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SIZE_T banks = 2 * sizeof(CAVERN_BIQUAD_BANK);
+    SIZE_T block = (SIZE_T)CAVERN_BIQUAD_BLOCK_FRAMES * Channels * sizeof(double);
+
+    m_pBanks = (PCAVERN_BIQUAD_BANK)CavernAllocate(banks + block, CAVERN_BIQUAD_POOLTAG);
+    if (!m_pBanks) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pBlock = (double *)((PUCHAR)m_pBanks + banks);
+
+    ClearBank(&m_pBanks[0]);
+    ClearBank(&m_pBanks[1]);
+    m_lActive = 0;
+    m_lPending = -1;
+    m_lPublished = 0;
+    m_lStaging = -1;
+    Reset();
+
+    m_ulChannels = Channels;
+    m_AllowSimd = AllowSimd;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernBiquadCascade::Cleanup()
+{
+    if (m_pBanks) {
+        CavernFree(m_pBanks, CAVERN_BIQUAD_POOLTAG);
+        m_pBanks = NULL;
+    }
+    m_pBlock = NULL;
+    m_ulChannels = 0;
+}
+
+//
+// An update Process has not taken yet is withdrawn and becomes the
+// staging bank again; Process is still on the other one. Otherwise
+// Process has the published bank and the other one is free.
+//
+VOID CCavernBiquadCascade::BeginUpdate()
+{
+    if (!m_pBanks) {
+        return;
+    }
+
+    LONG withdrawn = CavernInterlockedExchange(&m_lPending, -1);
+
+    if (withdrawn >= 0) {
+        m_lStaging = withdrawn;
+        return;
+    }
+
+    m_lStaging = 1 - m_lPublished;
+    RtlCopyMemory(&m_pBanks[m_lStaging], &m_pBanks[m_lPublished], sizeof(CAVERN_BIQUAD_BANK));
+}
+
+VOID CCavernBiquadCascade::SetBand(
+    _In_ ULONG Channel,
+    _In_ ULONG Band,
+    _In_opt_ const CAVERN_BIQUAD_COEFFICIENTS *Coefficients
+)
+{
+    ASSERT(m_lStaging >= 0);
+
+    if (m_lStaging < 0 || Channel >= CAVERN_MAX_CHANNELS || Band >= CAVERN_BIQUAD_MAX_BANDS) {
+        return;
+    }
+
+    PCAVERN_BIQUAD_BANK bank = &m_pBanks[m_lStaging];
+
+    if (Coefficients) {
+        bank->B0[Band][Channel] = Coefficients->B0;
+        bank->B1[Band][Channel] = Coefficients->B1;
+        bank->B2[Band][Channel] = Coefficients->B2;
+        bank->A1[Band][Channel] = Coefficients->A1;
+        bank->A2[Band][Channel] = Coefficients->A2;
+        bank->Assigned[Band] |= 1UL << Channel;
+    } else {
+        bank->B0[Band][Channel] = 1.0;
+        bank->B1[Band][Channel] = 0.0;
+        bank->B2[Band][Channel] = 0.0;
+        bank->A1[Band][Channel] = 0.0;
+        bank->A2[Band][Channel] = 0.0;
+        bank->Assigned[Band] &= ~(1UL << Channel);
+    }
+}
+
+VOID CCavernBiquadCascade::ClearBands()
+{
+    ASSERT(m_lStaging >= 0);
+
+    if (m_lStaging >= 0) {
+        ClearBank(&m_pBanks[m_lStaging]);
+    }
+}
+
+//
+// Only bands up to the last one set on any channel are run.
+//
+VOID CCavernBiquadCascade::CommitUpdate()
+{
+    ASSERT(m_lStaging >= 0);
+
+    if (m_lStaging < 0) {
+        return;
+    }
+
+    PCAVERN_BIQUAD_BANK bank = &m_pBanks[m_lStaging];
+
+    bank->Bands = 0;
+    for (ULONG b = 0; b < CAVERN_BIQUAD_MAX_BANDS; b++) {
+        if (bank->Assigned[b]) {
+            bank->Bands = b + 1;
+        }
+    }
+
+    m_lPublished = m_lStaging;
+    m_lStaging = -1;
+    CavernInterlockedExchange(&m_lPending, m_lPublished);
+}
+
+VOID CCavernBiquadCascade::Reset()
+{
+    RtlZeroMemory(m_Z1, sizeof(m_Z1));
+    RtlZeroMemory(m_Z2, sizeof(m_Z2));
+}
+
+#if defined(CAVERN_HAVE_AVX2)
+//
+// One frame of one band for four channels from Channel on; the state
+// stays in registers across the block.
+//
+static inline __m256d SectionAvx2(
+    _In_ const CAVERN_BIQUAD_BANK *Bank,
+    _In_ ULONG Band,
+    _In_ ULONG Channel,
+    _In_ __m256d x,
+    _Inout_ __m256d &z1,
+    _Inout_ __m256d &z2
+)
+{
+    __m256d y = _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&Bank->B0[Band][Channel]), x), z1);
+    z1 = _mm256_sub_pd(
+        _mm256_add_pd(_mm256_mul_pd(_mm256_loadu_pd(&Bank->B1[Band][Channel]), x), z2),
+        _mm256_mul_pd(_mm256_loadu_pd(&Bank->A1[Band][Channel]), y));
+    z2 = _mm256_sub_pd(
+        _mm256_mul_pd(_mm256_loadu_pd(&Bank->B2[Band][Channel]), x),
+        _mm256_mul_pd(_mm256_loadu_pd(&Bank->A2[Band][Channel]), y));
+    return y;
+}
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+// SectionAvx2 for two channels
+static inline __m128d SectionSse2(
+    _In_ const CAVERN_BIQUAD_BANK *Bank,
+    _In_ ULONG Band,
+    _In_ ULONG Channel,
+    _In_ __m128d x,
+    _Inout_ __m128d &z1,
+    _Inout_ __m128d &z2
+)
+{
+    __m128d y = _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&Bank->B0[Band][Channel]), x), z1);
+    z1 = _mm_sub_pd(
+        _mm_add_pd(_mm_mul_pd(_mm_loadu_pd(&Bank->B1[Band][Channel]), x), z2),
+        _mm_mul_pd(_mm_loadu_pd(&Bank->A1[Band][Channel]), y));
+    z2 = _mm_sub_pd(
+        _mm_mul_pd(_mm_loadu_pd(&Bank->B2[Band][Channel]), x),
+        _mm_mul_pd(_mm_loadu_pd(&Bank->A2[Band][Channel]), y));
+    return y;
+}
+#endif
+
+//
+// Runs the widened block through one band at a time, a run of channels at
+// a time, keeping that run's state in registers. Per band and channel:
+//   y = B0 x + Z1;  Z1 = (B1 x + Z2) - A1 y;  Z2 = B2 x - A2 y
+// (Z2 is added before A1 y is known, one operation off the recursion.)
+// Four vectors go through a band together where the channels allow: their
+// recursions do not depend on each other, so they overlap instead of each
+// waiting out its own latency.
+//
+VOID CCavernBiquadCascade::ProcessBlock(
+    _In_ const CAVERN_BIQUAD_BANK *Bank,
+    _In_ SIZE_T FrameCount
+)
+{
+    const ULONG channels = m_ulChannels;
+    const ULONG bands = Bank->Bands;
+    double *block = m_pBlock;
+    ULONG c = 0;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_AllowSimd) {
+        for (; c + 16 <= channels; c += 16) {
+            for (ULONG b = 0; b < bands; b++) {
+                __m256d z1a = _mm256_loadu_pd(&m_Z1[b][c]);
+                __m256d z1b = _mm256_loadu_pd(&m_Z1[b][c + 4]);
+                __m256d z1c = _mm256_loadu_pd(&m_Z1[b][c + 8]);
+                __m256d z1d = _mm256_loadu_pd(&m_Z1[b][c + 12]);
+                __m256d z2a = _mm256_loadu_pd(&m_Z2[b][c]);
+                __m256d z2b = _mm256_loadu_pd(&m_Z2[b][c + 4]);
+                __m256d z2c = _mm256_loadu_pd(&m_Z2[b][c + 8]);
+                __m256d z2d = _mm256_loadu_pd(&m_Z2[b][c + 12]);
+
+                for (SIZE_T f = 0; f < FrameCount; f++) {
+                    double *frame = block + f * channels + c;
+                    _mm256_storeu_pd(frame, SectionAvx2(Bank, b, c, _mm256_loadu_pd(frame), z1a, z2a));
+                    _mm256_storeu_pd(frame + 4, SectionAvx2(Bank, b, c + 4, _mm256_loadu_pd(frame + 4), z1b, z2b));
+                    _mm256_storeu_pd(frame + 8, SectionAvx2(Bank, b, c + 8, _mm256_loadu_pd(frame + 8), z1c, z2c));
+                    _mm256_storeu_pd(frame + 12, SectionAvx2(Bank, b, c + 12, _mm256_loadu_pd(frame + 12), z1d, z2d));
+                }
+
+                _mm256_storeu_pd(&m_Z1[b][c], z1a);
+                _mm256_storeu_pd(&m_Z1[b][c + 4], z1b);
+                _mm256_storeu_pd(&m_Z1[b][c + 8], z1c);
+                _mm256_storeu_pd(&m_Z1[b][c + 12], z1d);
+                _mm256_storeu_pd(&m_Z2[b][c], z2a);
+                _mm256_storeu_pd(&m_Z2[b][c + 4], z2b);
+                _mm256_storeu_pd(&m_Z2[b][c + 8], z2c);
+                _mm256_storeu_pd(&m_Z2[b][c + 12], z2d);
+            }
+        }
+        for (; c + 4 <= channels; c += 4) {
+            for (ULONG b = 0; b < bands; b++) {
+                __m256d z1 = _mm256_loadu_pd(&m_Z1[b][c]);
+                __m256d z2 = _mm256_loadu_pd(&m_Z2[b][c]);
+
+                for (SIZE_T f = 0; f < FrameCount; f++) {
+                    double *frame = block + f * channels + c;
+                    _mm256_storeu_pd(frame, SectionAvx2(Bank, b, c, _mm256_loadu_pd(frame), z1, z2));
+                }
+
+                _mm256_storeu_pd(&m_Z1[b][c], z1);
+                _mm256_storeu_pd(&m_Z2[b][c], z2);
+            }
+        }
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_AllowSimd) {
+        for (; c + 8 <= channels; c += 8) {
+            for (ULONG b = 0; b < bands; b++) {
+                __m128d z1a = _mm_loadu_pd(&m_Z1[b][c]);
+                __m128d z1b = _mm_loadu_pd(&m_Z1[b][c + 2]);
+                __m128d z1c = _mm_loadu_pd(&m_Z1[b][c + 4]);
+                __m128d z1d = _mm_loadu_pd(&m_Z1[b][c + 6]);
+                __m128d z2a = _mm_loadu_pd(&m_Z2[b][c]);
+                __m128d z2b = _mm_loadu_pd(&m_Z2[b][c + 2]);
+                __m128d z2c = _mm_loadu_pd(&m_Z2[b][c + 4]);
+                __m128d z2d = _mm_loadu_pd(&m_Z2[b][c + 6]);
+
+                for (SIZE_T f = 0; f < FrameCount; f++) {
+                    double *frame = block + f * channels + c;
+                    _mm_storeu_pd(frame, SectionSse2(Bank, b, c, _mm_loadu_pd(frame), z1a, z2a));
+                    _mm_storeu_pd(frame + 2, SectionSse2(Bank, b, c + 2, _mm_loadu_pd(frame + 2), z1b, z2b));
+                    _mm_storeu_pd(frame + 4, SectionSse2(Bank, b, c + 4, _mm_loadu_pd(frame + 4), z1c, z2c));
+                    _mm_storeu_pd(frame + 6, SectionSse2(Bank, b, c + 6, _mm_loadu_pd(frame + 6), z1d, z2d));
+                }
+
+                _mm_storeu_pd(&m_Z1[b][c], z1a);
+                _mm_storeu_pd(&m_Z1[b][c + 2], z1b);
+                _mm_storeu_pd(&m_Z1[b][c + 4], z1c);
+                _mm_storeu_pd(&m_Z1[b][c + 6], z1d);
+                _mm_storeu_pd(&m_Z2[b][c], z2a);
+                _mm_storeu_pd(&m_Z2[b][c + 2], z2b);
+                _mm_storeu_pd(&m_Z2[b][c + 4], z2c);
+                _mm_storeu_pd(&m_Z2[b][c + 6], z2d);
+            }
+        }
+        for (; c + 2 <= channels; c += 2) {
+            for (ULONG b = 0; b < bands; b++) {
+                __m128d z1 = _mm_loadu_pd(&m_Z1[b][c]);
+                __m128d z2 = _mm_loadu_pd(&m_Z2[b][c]);
+
+                for (SIZE_T f = 0; f < FrameCount; f++) {
+                    double *frame = block + f * channels + c;
+                    _mm_storeu_pd(frame, SectionSse2(Bank, b, c, _mm_loadu_pd(frame), z1, z2));
+                }
+
+                _mm_storeu_pd(&m_Z1[b][c], z1);
+                _mm_storeu_pd(&m_Z2[b][c], z2);
+            }
+        }
+    }
+#endif
+
+    // The remaining channels side by side, so their recursions overlap
+    // too; the state goes through memory
+    const ULONG first = c;
+
+    for (ULONG b = 0; b < bands && first < channels; b++) {
+        for (SIZE_T f = 0; f < FrameCount; f++) {
+            double *frame = block + f * channels;
+
+            for (c = first; c < channels; c++) {
+                double x = frame[c];
+                double y = Bank->B0[b][c] * x + m_Z1[b][c];
+                m_Z1[b][c] = (Bank->B1[b][c] * x + m_Z2[b][c]) - Bank->A1[b][c] * y;
+                m_Z2[b][c] = Bank->B2[b][c] * x - Bank->A2[b][c] * y;
+                frame[c] = y;
+            }
+        }
+    }
+}
+
+VOID CCavernBiquadCascade::FlushState(_In_ ULONG Bands)
+{
+    for (ULONG b = 0; b < Bands; b++) {
+        for (ULONG c = 0; c < m_ulChannels; c++) {
+            if (m_Z1[b][c] < CAVERN_BIQUAD_STATE_FLOOR && m_Z1[b][c] > -CAVERN_BIQUAD_STATE_FLOOR) {
+                m_Z1[b][c] = 0.0;
+            }
+            if (m_Z2[b][c] < CAVERN_BIQUAD_STATE_FLOOR && m_Z2[b][c] > -CAVERN_BIQUAD_STATE_FLOOR) {
+                m_Z2[b][c] = 0.0;
+            }
+        }
+    }
+}
+
+//
+// Takes a newly published bank first. Bands the new set no longer runs
+// lose their state, so they start clean if a later set uses them again.
+//
+VOID CCavernBiquadCascade::Process(
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_pBanks) {
+        return;
+    }
+
+    if (m_lPending >= 0) {
+        LONG pending = CavernInterlockedExchange(&m_lPending, -1);
+        if (pending >= 0) {
+            m_lActive = pending;
+            for (ULONG b = m_pBanks[pending].Bands; b < CAVERN_BIQUAD_MAX_BANDS; b++) {
+                RtlZeroMemory(m_Z1[b], sizeof(m_Z1[b]));
+                RtlZeroMemory(m_Z2[b], sizeof(m_Z2[b]));
+            }
+        }
+    }
+
+    const CAVERN_BIQUAD_BANK *bank = &m_pBanks[m_lActive];
+    if (!bank->Bands) {
+        return;
+    }
+
+#if defined(CAVERN_HAVE_SSE2)
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | CAVERN_MXCSR_FTZ_DAZ);
+#endif
+
+    for (SIZE_T done = 0; done < FrameCount; ) {
+        SIZE_T frames = min(FrameCount - done, (SIZE_T)CAVERN_BIQUAD_BLOCK_FRAMES);
+        SIZE_T samples = frames * m_ulChannels;
+        float *data = Samples + done * m_ulChannels;
+
+        for (SIZE_T i = 0; i < samples; i++) {
+            m_pBlock[i] = data[i];
+        }
+        ProcessBlock(bank, frames);
+        for (SIZE_T i = 0; i < samples; i++) {
+            data[i] = (float)m_pBlock[i];
+        }
+
+        FlushState(bank->Bands);
+        done += frames;
+    }
+
+#if defined(CAVERN_HAVE_SSE2)
+    _mm_setcsr(csr);
+#endif
+}
@@ -0,0 +1,172 @@
+/***************************************************************************
+ * CavernBiquadCascade.h
+ *
+ * Per-channel cascade of biquad filters for room correction. Every channel
+ * has up to CAVERN_BIQUAD_MAX_BANDS second-order sections in transposed
+ * direct form II, each with its own coefficients. Channels are the SIMD
+ * lanes: a band runs over a block with one lane per channel, two (SSE2) or
+ * four (AVX2) channels to a vector, so the recursion never has to be
+ * vectorized along time. The kernels multiply then add in the scalar
+ * loop's order (no FMA), so the output is bit-identical to it.
+ *
+ * Sections run in double precision. At 192 kHz the poles of a 40 Hz shelf
+ * sit so close to z = 1 that float state leaves roundoff noise only some
+ * 60 dB down; each block is widened to double once, run through all bands
+ * and narrowed back, which keeps the noise below 24-bit output.
+ *
+ * Coefficients live in two banks. Updates are written into the bank
+ * Process is not reading and published with an interlocked exchange;
+ * Process switches banks when it is next called, so a set is never applied
+ * half written and the writer never waits. An update that has not been
+ * picked up yet is taken back and edited in place. Filter state carries
+ * over the switch; there is no crossfade.
+ *
+ * Decaying state is kept out of the denormal range twice over: Process
+ * runs with flush-to-zero and denormals-are-zero set in MXCSR where SSE is
+ * available, and state below CAVERN_BIQUAD_STATE_FLOOR is zeroed after
+ * every block, which keeps other targets from crawling through a tail of
+ * denormals after the signal stops.
+ *
+ * BeginUpdate/SetBand/ClearBands/CommitUpdate do no float arithmetic; the
+ * caller serializes them. CavernBiquadDesign and Process must be bracketed
+ * with KeSaveFloatingPointState / KeRestoreFloatingPointState, and Process
+ * is called from one thread at a time.
+ ***************************************************************************/
+
+#ifndef _CAVERN_BIQUADCASCADE_H_
+#define _CAVERN_BIQUADCASCADE_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+// Sections per channel
+#define CAVERN_BIQUAD_MAX_BANDS     16
+
+#define CAVERN_BIQUAD_POOLTAG       'qBvC'
+
+// Frames widened and run through all bands at a time; the double block
+// stays in L1
+#define CAVERN_BIQUAD_BLOCK_FRAMES  128
+
+// State smaller than this (about -300 dBFS) is flushed to zero
+#define CAVERN_BIQUAD_STATE_FLOOR   1e-15
+
+typedef enum _CAVERN_BIQUAD_TYPE {
+    CavernBiquadPeak = 0,       // bell; Gain at Frequency, width Q
+    CavernBiquadLowShelf,
+    CavernBiquadHighShelf,
+    CavernBiquadLowPass,        // Gain ignored
+    CavernBiquadHighPass,       // Gain ignored
+    CavernBiquadTypeCount
+} CAVERN_BIQUAD_TYPE;
+
+// a0 is normalized to 1: y = B0 x + B1 x[-1] + B2 x[-2] - A1 y[-1] - A2 y[-2]
+typedef struct _CAVERN_BIQUAD_COEFFICIENTS {
+    double  B0;
+    double  B1;
+    double  B2;
+    double  A1;
+    double  A2;
+} CAVERN_BIQUAD_COEFFICIENTS, *PCAVERN_BIQUAD_COEFFICIENTS;
+
+//
+// Designs one section from the RBJ cookbook formulas. Fails for
+// frequencies outside (0, SampleRate / 2) and non-positive Q.
+//
+NTSTATUS CavernBiquadDesign(
+    _In_ CAVERN_BIQUAD_TYPE Type,
+    _In_ double Frequency,
+    _In_ double Q,
+    _In_ double GainDb,
+    _In_ ULONG SampleRate,
+    _Out_ PCAVERN_BIQUAD_COEFFICIENTS Coefficients
+);
+
+// One coefficient set; coefficient arrays are indexed [band][channel] so a
+// run of channels loads as a vector.
+typedef struct _CAVERN_BIQUAD_BANK {
+    ULONG   Bands;                                  // sections run
+    ULONG   Assigned[CAVERN_BIQUAD_MAX_BANDS];      // channel mask per band
+    double  B0[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+    double  B1[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+    double  B2[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+    double  A1[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+    double  A2[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+} CAVERN_BIQUAD_BANK, *PCAVERN_BIQUAD_BANK;
+
+class CCavernBiquadCascade
+{
+public:
+    CCavernBiquadCascade();
+    ~CCavernBiquadCascade();
+
+    // Allocates the banks; every band starts out passing the signal.
+    NTSTATUS Init(
+        _In_ ULONG Channels,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Opens an update on a copy of the latest published set.
+    VOID BeginUpdate();
+
+    // Sets one band of one channel in the open update; NULL passes the
+    // signal through.
+    VOID SetBand(
+        _In_ ULONG Channel,
+        _In_ ULONG Band,
+        _In_opt_ const CAVERN_BIQUAD_COEFFICIENTS *Coefficients
+    );
+
+    // Passes every band of every channel through in the open update.
+    VOID ClearBands();
+
+    // Publishes the open update; picked up by the next Process.
+    VOID CommitUpdate();
+
+    // Filters FrameCount interleaved float frames in place.
+    VOID Process(
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    // Clears the filter state.
+    VOID Reset();
+
+    BOOLEAN IsInitialized() const { return m_pBanks != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+
+    // TRUE while no band is in use and no new set is waiting.
+    BOOLEAN IsTransparent() const { return (!m_pBanks || !m_pBanks[m_lActive].Bands) && m_lPending < 0; }
+
+private:
+    VOID ProcessBlock(
+        _In_ const CAVERN_BIQUAD_BANK *Bank,
+        _In_ SIZE_T FrameCount
+    );
+    VOID FlushState(_In_ ULONG Bands);
+
+    ULONG               m_ulChannels;
+    BOOLEAN             m_AllowSimd;
+
+    // Bank Process reads, and the one published to it (-1: none waiting)
+    LONG                m_lActive;
+    volatile LONG       m_lPending;
+
+    // Writer side: last published bank and the one being edited
+    LONG                m_lPublished;
+    LONG                m_lStaging;
+
+    // Two banks, then the widened block
+    PCAVERN_BIQUAD_BANK m_pBanks;
+    double             *m_pBlock;
+
+    // Transposed direct form II state, [band][channel]
+    double              m_Z1[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+    double              m_Z2[CAVERN_BIQUAD_MAX_BANDS][CAVERN_MAX_CHANNELS];
+};
+
+#endif // _CAVERN_BIQUADCASCADE_H_
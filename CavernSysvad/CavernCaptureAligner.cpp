@@ -0,0 +1,157 @@
+/***************************************************************************
+ * CavernCaptureAligner.cpp
+ *
+ * Sector-aligned capture writes implementation
+ ***************************************************************************/
+
+#include "CavernCaptureAligner.h"
+
+CCavernCaptureAligner::CCavernCaptureAligner()
+    : m_pBounce(NULL),
+      m_ulBounceBytes(0),
+      m_ulAlignment(0),
+      m_ulMaxBytes(0),
+      m_ulTailOffset(0),
+      m_ullEnd(0),
+      m_ullCopiedBytes(0)
+{
+}
+
+CCavernCaptureAligner::~CCavernCaptureAligner()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernCaptureAligner::Init(_In_ ULONG Alignment, _In_ ULONG MaxBytes)
+{
+    Cleanup();
+
+    if (!Alignment || Alignment > CAVERN_ALIGNER_MAX_ALIGNMENT || (Alignment & (Alignment - 1)) ||
+        !MaxBytes || MaxBytes > 0x7FFFFFFF - 2 * CAVERN_ALIGNER_MAX_ALIGNMENT) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // A partial sector carried over, the run, and zeros to the sector end;
+    // a page or more, so the pool hands it out page aligned
+    ULONG bytes = (MaxBytes + 2 * Alignment + Alignment - 1) & ~(Alignment - 1);
+    if (bytes < CAVERN_ALIGNER_MAX_ALIGNMENT) {
+        bytes = CAVERN_ALIGNER_MAX_ALIGNMENT;
+    }
+
+    m_pBounce = (PUCHAR)CavernAllocate(bytes, CAVERN_ALIGNER_POOLTAG);
+    if (!m_pBounce) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    if ((SIZE_T)m_pBounce & (Alignment - 1)) {
+        CavernFree(m_pBounce, CAVERN_ALIGNER_POOLTAG);
+        m_pBounce = NULL;
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    m_ulBounceBytes = bytes;
+    m_ulAlignment = Alignment;
+    m_ulMaxBytes = MaxBytes;
+    m_ulTailOffset = 0;
+    m_ullEnd = 0;
+    m_ullCopiedBytes = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernCaptureAligner::Cleanup()
+{
+    if (m_pBounce) {
+        CavernFree(m_pBounce, CAVERN_ALIGNER_POOLTAG);
+        m_pBounce = NULL;
+    }
+    m_ulBounceBytes = 0;
+    m_ulAlignment = 0;
+    m_ulMaxBytes = 0;
+    m_ulTailOffset = 0;
+    m_ullEnd = 0;
+}
+
+NTSTATUS CCavernCaptureAligner::Reset(_In_ ULONGLONG Offset)
+{
+    if (!m_pBounce || (Offset & (m_ulAlignment - 1))) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    m_ullEnd = Offset;
+    m_ulTailOffset = 0;
+    m_ullCopiedBytes = 0;
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CCavernCaptureAligner::Plan(
+    _In_reads_bytes_(Bytes) const UCHAR *Data,
+    _In_ ULONG Bytes,
+    _Out_writes_(CAVERN_ALIGNER_MAX_WRITES) PCAVERN_ALIGNED_WRITE Writes,
+    _Out_ PULONG Count
+)
+{
+    *Count = 0;
+
+    if (!m_pBounce || !Data || Bytes > m_ulMaxBytes) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (!Bytes) {
+        return STATUS_SUCCESS;
+    }
+
+    const ULONG mask = m_ulAlignment - 1;
+    ULONG carry = (ULONG)(m_ullEnd & mask);
+    ULONGLONG start = m_ullEnd - carry;
+    ULONG body;
+    ULONG tailBytes;
+    ULONG count = 0;
+
+    if (!carry && !((SIZE_T)Data & mask)) {
+        // Aligned: the body goes straight from Data
+        body = Bytes & ~mask;
+        tailBytes = Bytes - body;
+        if (body) {
+            Writes[count].Data = Data;
+            Writes[count].Bytes = body;
+            Writes[count].Offset = start;
+            count++;
+        }
+        RtlCopyMemory(m_pBounce, Data + body, tailBytes);
+        m_ulTailOffset = 0;
+    }
+    else {
+        // The last partial sector, kept from the previous Plan, leads the
+        // bounce buffer and the run follows it
+        if (m_ulTailOffset) {
+            RtlMoveMemory(m_pBounce, m_pBounce + m_ulTailOffset, carry);
+        }
+        RtlCopyMemory(m_pBounce + carry, Data, Bytes);
+        m_ullCopiedBytes += Bytes;
+
+        body = (carry + Bytes) & ~mask;
+        tailBytes = carry + Bytes - body;
+        if (body) {
+            Writes[count].Data = m_pBounce;
+            Writes[count].Bytes = body;
+            Writes[count].Offset = start;
+            count++;
+        }
+        m_ulTailOffset = body;
+    }
+
+    // The sector the stream now ends in, zero padded
+    if (tailBytes) {
+        PUCHAR tail = m_pBounce + m_ulTailOffset;
+
+        RtlZeroMemory(tail + tailBytes, m_ulAlignment - tailBytes);
+        m_ullCopiedBytes += m_ulAlignment;
+
+        Writes[count].Data = tail;
+        Writes[count].Bytes = m_ulAlignment;
+        Writes[count].Offset = start + body;
+        count++;
+    }
+
+    m_ullEnd += Bytes;
+    *Count = count;
+    return STATUS_SUCCESS;
+}
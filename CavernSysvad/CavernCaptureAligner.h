@@ -0,0 +1,82 @@
+/***************************************************************************
+ * CavernCaptureAligner.h
+ *
+ * Turns the capture writer's runs into writes a non-cached file handle
+ * accepts (FILE_NO_INTERMEDIATE_BUFFERING, O_DIRECT): each one starts at a
+ * multiple of the alignment in the file and in memory, and is a multiple
+ * of it long.
+ *
+ * The file data is one contiguous stream that starts at an aligned offset.
+ * While the stream stays aligned and a run's memory is aligned (the queue's
+ * slots are), the aligned body of the run is written straight from it. The
+ * sector the data ends in is written from a bounce buffer, padded with
+ * zeros, and rewritten with the next run's start. Once a short run (a flush
+ * on pause) has left the stream end unaligned, later runs are copied
+ * through the bounce buffer.
+ *
+ * One writer; Plan's writes must be issued before the next Plan, which may
+ * reuse the bounce buffer. Integer work only.
+ ***************************************************************************/
+
+#ifndef _CAVERN_CAPTUREALIGNER_H_
+#define _CAVERN_CAPTUREALIGNER_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_ALIGNER_POOLTAG          'aCvC'
+
+// Largest alignment (a sector, at most a page)
+#define CAVERN_ALIGNER_MAX_ALIGNMENT    4096
+
+// Writes one Plan produces: the aligned body, then the padded last sector
+#define CAVERN_ALIGNER_MAX_WRITES       2
+
+typedef struct _CAVERN_ALIGNED_WRITE {
+    const UCHAR *Data;
+    ULONG       Bytes;
+    ULONGLONG   Offset;         // file offset
+} CAVERN_ALIGNED_WRITE, *PCAVERN_ALIGNED_WRITE;
+
+class CCavernCaptureAligner
+{
+public:
+    CCavernCaptureAligner();
+    ~CCavernCaptureAligner();
+
+    // Alignment is a power of two up to CAVERN_ALIGNER_MAX_ALIGNMENT;
+    // MaxBytes is the largest run Plan takes.
+    NTSTATUS Init(_In_ ULONG Alignment, _In_ ULONG MaxBytes);
+    VOID Cleanup();
+
+    // Starts the stream at Offset, which must be aligned.
+    NTSTATUS Reset(_In_ ULONGLONG Offset);
+
+    // Fills Writes with the writes that put Bytes of Data at the end of
+    // the stream, and sets *Count to how many there are.
+    NTSTATUS Plan(
+        _In_reads_bytes_(Bytes) const UCHAR *Data,
+        _In_ ULONG Bytes,
+        _Out_writes_(CAVERN_ALIGNER_MAX_WRITES) PCAVERN_ALIGNED_WRITE Writes,
+        _Out_ PULONG Count
+    );
+
+    BOOLEAN IsInitialized() const { return m_pBounce != NULL; }
+    ULONG GetAlignment() const { return m_ulAlignment; }
+
+    // File offset of the end of the stream
+    ULONGLONG GetEnd() const { return m_ullEnd; }
+
+    // Bytes that went through the bounce buffer, data and padding
+    ULONGLONG GetCopiedBytes() const { return m_ullCopiedBytes; }
+
+private:
+    PUCHAR              m_pBounce;
+    ULONG               m_ulBounceBytes;
+    ULONG               m_ulAlignment;
+    ULONG               m_ulMaxBytes;
+    ULONG               m_ulTailOffset;     // where the partial last sector sits in m_pBounce
+    ULONGLONG           m_ullEnd;
+    ULONGLONG           m_ullCopiedBytes;
+};
+
+#endif // _CAVERN_CAPTUREALIGNER_H_
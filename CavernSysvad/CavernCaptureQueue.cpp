@@ -0,0 +1,216 @@
+/***************************************************************************
+ * CavernCaptureQueue.cpp
+ *
+ * Single-producer, single-consumer capture slot queue implementation
+ ***************************************************************************/
+
+#include "CavernCaptureQueue.h"
+
+CCavernCaptureQueue::CCavernCaptureQueue()
+    : m_pData(NULL),
+      m_pSlotLength(NULL),
+      m_ulSlotBytes(0),
+      m_ulSlotCount(0),
+      m_ulSlotMask(0),
+      m_lHead(0),
+      m_lTail(0),
+      m_ulFill(0),
+      m_ullQueuedBytes(0),
+      m_ullDroppedBytes(0),
+      m_ulDrops(0),
+      m_ulHighWater(0)
+{
+}
+
+CCavernCaptureQueue::~CCavernCaptureQueue()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernCaptureQueue::Init(_In_ ULONG SlotBytes, _In_ ULONG SlotCount)
+{
+    Cleanup();
+
+    if (!SlotBytes || !SlotCount || SlotCount > CAVERN_CAPTURE_MAX_SLOTS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG count = CAVERN_CAPTURE_MIN_SLOTS;
+    while (count < SlotCount) {
+        count <<= 1;
+    }
+    if ((ULONGLONG)SlotBytes * count > 0x7FFFFFFF) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    m_pSlotLength = (ULONG *)CavernAllocate(count * sizeof(ULONG), CAVERN_CAPTURE_POOLTAG);
+    if (!m_pSlotLength) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pData = (PUCHAR)CavernAllocate((SIZE_T)SlotBytes * count, CAVERN_CAPTURE_POOLTAG);
+    if (!m_pData) {
+        CavernFree(m_pSlotLength, CAVERN_CAPTURE_POOLTAG);
+        m_pSlotLength = NULL;
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    m_ulSlotBytes = SlotBytes;
+    m_ulSlotCount = count;
+    m_ulSlotMask = count - 1;
+    m_lHead = 0;
+    m_lTail = 0;
+    m_ulFill = 0;
+    m_ullQueuedBytes = 0;
+    m_ullDroppedBytes = 0;
+    m_ulDrops = 0;
+    m_ulHighWater = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernCaptureQueue::Cleanup()
+{
+    if (m_pData) {
+        CavernFree(m_pData, CAVERN_CAPTURE_POOLTAG);
+        m_pData = NULL;
+    }
+    if (m_pSlotLength) {
+        CavernFree(m_pSlotLength, CAVERN_CAPTURE_POOLTAG);
+        m_pSlotLength = NULL;
+    }
+    m_ulSlotBytes = 0;
+    m_ulSlotCount = 0;
+    m_ulSlotMask = 0;
+    m_lHead = 0;
+    m_lTail = 0;
+    m_ulFill = 0;
+}
+
+//
+// Hands the slot at the head to the consumer: its length first, so the
+// consumer never sees the new head without it.
+//
+VOID CCavernCaptureQueue::Publish()
+{
+    ULONG head = (ULONG)m_lHead;
+
+    m_pSlotLength[head & m_ulSlotMask] = m_ulFill;
+    m_ulFill = 0;
+    CavernMemoryBarrier();
+    m_lHead = (LONG)(head + 1);
+
+    ULONG pending = head + 1 - (ULONG)m_lTail;
+    if (pending > m_ulHighWater) {
+        m_ulHighWater = pending;
+    }
+}
+
+ULONG CCavernCaptureQueue::Write(_In_reads_bytes_(Bytes) const UCHAR *Data, _In_ ULONG Bytes)
+{
+    if (!m_pData || !Data) {
+        return 0;
+    }
+
+    ULONG queued = 0;
+
+    while (queued < Bytes) {
+        ULONG head = (ULONG)m_lHead;
+
+        // The slot at the head is free once the consumer has released
+        // the one a ring earlier; its write must be over before we copy
+        if (head - (ULONG)m_lTail >= m_ulSlotCount) {
+            m_ullDroppedBytes += Bytes - queued;
+            m_ulDrops++;
+            break;
+        }
+        CavernMemoryBarrier();
+
+        PUCHAR slot = m_pData + (SIZE_T)(head & m_ulSlotMask) * m_ulSlotBytes;
+        ULONG run = min(Bytes - queued, m_ulSlotBytes - m_ulFill);
+
+        RtlCopyMemory(slot + m_ulFill, Data + queued, run);
+        m_ulFill += run;
+        queued += run;
+
+        if (m_ulFill == m_ulSlotBytes) {
+            Publish();
+        }
+    }
+
+    m_ullQueuedBytes += queued;
+    return queued;
+}
+
+ULONG CCavernCaptureQueue::GetFreeBytes() const
+{
+    if (!m_pData) {
+        return 0;
+    }
+
+    ULONG freeSlots = m_ulSlotCount - ((ULONG)m_lHead - (ULONG)m_lTail);
+
+    return freeSlots ? freeSlots * m_ulSlotBytes - m_ulFill : 0;
+}
+
+BOOLEAN CCavernCaptureQueue::Flush()
+{
+    if (!m_pData || !m_ulFill) {
+        return FALSE;
+    }
+
+    // A partial slot can only be published if it is free
+    if ((ULONG)m_lHead - (ULONG)m_lTail >= m_ulSlotCount) {
+        return FALSE;
+    }
+    Publish();
+    return TRUE;
+}
+
+BOOLEAN CCavernCaptureQueue::Peek(_Out_ PCAVERN_CAPTURE_RUN Run, _In_ ULONG MaxBytes)
+{
+    Run->Data = NULL;
+    Run->Bytes = 0;
+    Run->Slots = 0;
+
+    if (!m_pData) {
+        return FALSE;
+    }
+
+    ULONG tail = (ULONG)m_lTail;
+    ULONG head = (ULONG)m_lHead;
+    if (head == tail) {
+        return FALSE;
+    }
+    CavernMemoryBarrier();
+
+    ULONG first = tail & m_ulSlotMask;
+    ULONG bytes = m_pSlotLength[first];
+    ULONG slots = 1;
+
+    // Joins full slots up to the end of the ring; a partial slot ends
+    // the run, as the next one does not follow on from its data
+    while (tail + slots != head && first + slots < m_ulSlotCount) {
+        ULONG length = m_pSlotLength[first + slots];
+
+        if (m_pSlotLength[first + slots - 1] != m_ulSlotBytes || bytes + length > MaxBytes) {
+            break;
+        }
+        bytes += length;
+        slots++;
+    }
+
+    Run->Data = m_pData + (SIZE_T)first * m_ulSlotBytes;
+    Run->Bytes = bytes;
+    Run->Slots = slots;
+    return TRUE;
+}
+
+VOID CCavernCaptureQueue::Release(_In_ const CAVERN_CAPTURE_RUN *Run)
+{
+    if (!m_pData || !Run->Slots) {
+        return;
+    }
+
+    // The run's data must be read before the producer may reuse it
+    CavernMemoryBarrier();
+    m_lTail = (LONG)((ULONG)m_lTail + Run->Slots);
+}
@@ -0,0 +1,101 @@
+/***************************************************************************
+ * CavernCaptureQueue.h
+ *
+ * Lock-free hand-off of captured stream data from the stream's DPC to a
+ * file writer thread. The data ring is cut into fixed slots; the producer
+ * copies into the slot at the head, and publishes it (its byte count in
+ * the slot's descriptor, then the head index) once it is full or on Flush.
+ * The consumer takes the published slots from the tail, joins those that
+ * follow each other in the ring into one run for a single large write, and
+ * releases them once written.
+ *
+ * The producer never waits: with every slot published and not yet written,
+ * the rest of a Write is dropped and counted, so a stalled disk costs data
+ * rather than DPC time. Nothing is dropped while the ring can absorb the
+ * writer's worst stall.
+ *
+ * One producer and one consumer, each used from one thread at a time; the
+ * two only share the head and tail indices. Integer work only.
+ ***************************************************************************/
+
+#ifndef _CAVERN_CAPTUREQUEUE_H_
+#define _CAVERN_CAPTUREQUEUE_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_CAPTURE_POOLTAG          'qCvC'
+
+// Slot count Init rounds up to (a power of two, so the free-running
+// indices can wrap)
+#define CAVERN_CAPTURE_MIN_SLOTS        4
+#define CAVERN_CAPTURE_MAX_SLOTS        4096
+
+typedef struct _CAVERN_CAPTURE_RUN {
+    PUCHAR      Data;           // first byte of the run in the ring
+    ULONG       Bytes;
+    ULONG       Slots;          // released together
+} CAVERN_CAPTURE_RUN, *PCAVERN_CAPTURE_RUN;
+
+class CCavernCaptureQueue
+{
+public:
+    CCavernCaptureQueue();
+    ~CCavernCaptureQueue();
+
+    // SlotBytes is the smallest unit handed to the consumer and the
+    // granularity of a run; SlotCount * SlotBytes is the ring.
+    NTSTATUS Init(_In_ ULONG SlotBytes, _In_ ULONG SlotCount);
+    VOID Cleanup();
+
+    // Producer side. Queues Bytes of Data and returns how many were
+    // queued; the remainder was dropped for want of a free slot.
+    ULONG Write(_In_reads_bytes_(Bytes) const UCHAR *Data, _In_ ULONG Bytes);
+
+    // Bytes a Write would queue in full right now, for producers that
+    // must not split what they queue (the consumer may free more).
+    ULONG GetFreeBytes() const;
+
+    // Publishes the partly filled slot, if any. TRUE if it did.
+    BOOLEAN Flush();
+
+    // Consumer side. Fills Run with the oldest published slots that are
+    // contiguous in the ring, up to MaxBytes (at least one slot); FALSE
+    // if nothing is published. Release hands the slots back.
+    BOOLEAN Peek(_Out_ PCAVERN_CAPTURE_RUN Run, _In_ ULONG MaxBytes);
+    VOID Release(_In_ const CAVERN_CAPTURE_RUN *Run);
+
+    BOOLEAN IsInitialized() const { return m_pData != NULL; }
+    ULONG GetSlotBytes() const { return m_ulSlotBytes; }
+    ULONG GetSlotCount() const { return m_ulSlotCount; }
+
+    // Published slots not yet released
+    ULONG GetPendingSlots() const { return (ULONG)m_lHead - (ULONG)m_lTail; }
+
+    // Producer statistics: bytes queued and dropped, Writes that dropped
+    // data, and the most slots ever pending
+    ULONGLONG GetQueuedBytes() const { return m_ullQueuedBytes; }
+    ULONGLONG GetDroppedBytes() const { return m_ullDroppedBytes; }
+    ULONG GetDrops() const { return m_ulDrops; }
+    ULONG GetHighWater() const { return m_ulHighWater; }
+
+private:
+    VOID Publish();
+
+    PUCHAR              m_pData;
+    ULONG              *m_pSlotLength;      // bytes published per slot
+    ULONG               m_ulSlotBytes;
+    ULONG               m_ulSlotCount;
+    ULONG               m_ulSlotMask;
+
+    volatile LONG       m_lHead;            // slots published
+    volatile LONG       m_lTail;            // slots released
+
+    // Producer only
+    ULONG               m_ulFill;           // bytes in the slot at the head
+    ULONGLONG           m_ullQueuedBytes;
+    ULONGLONG           m_ullDroppedBytes;
+    ULONG               m_ulDrops;
+    ULONG               m_ulHighWater;
+};
+
+#endif // _CAVERN_CAPTUREQUEUE_H_
@@ -0,0 +1,310 @@
+/***************************************************************************
+ * CavernChannelRemap.cpp
+ *
+ * Channel reorder/remap implementation
+ ***************************************************************************/
+
+#include "CavernChannelRemap.h"
+
+#define FL  SPEAKER_FRONT_LEFT
+#define FR  SPEAKER_FRONT_RIGHT
+#define FC  SPEAKER_FRONT_CENTER
+#define LFE SPEAKER_LOW_FREQUENCY
+#define BL  SPEAKER_BACK_LEFT
+#define BR  SPEAKER_BACK_RIGHT
+#define FLC SPEAKER_FRONT_LEFT_OF_CENTER
+#define FRC SPEAKER_FRONT_RIGHT_OF_CENTER
+#define SL  SPEAKER_SIDE_LEFT
+#define SR  SPEAKER_SIDE_RIGHT
+#define TFL SPEAKER_TOP_FRONT_LEFT
+#define TFC SPEAKER_TOP_FRONT_CENTER
+#define TFR SPEAKER_TOP_FRONT_RIGHT
+#define TBL SPEAKER_TOP_BACK_LEFT
+#define TBC SPEAKER_TOP_BACK_CENTER
+#define TBR SPEAKER_TOP_BACK_RIGHT
+
+static const CAVERN_CHANNEL_LAYOUT g_StandardLayouts[CavernLayoutCount] = {
+    {  2, { FL, FR } },
+    {  6, { FL, FR, FC, LFE, SL, SR } },
+    {  8, { FL, FR, FC, LFE, BL, BR, SL, SR } },
+    {  8, { FL, FR, FC, LFE, SL, SR, TFL, TFR } },
+    { 10, { FL, FR, FC, LFE, SL, SR, TFL, TFR, TBL, TBR } },
+    { 10, { FL, FR, FC, LFE, BL, BR, SL, SR, TFL, TFR } },
+    { 12, { FL, FR, FC, LFE, BL, BR, SL, SR, TFL, TFR, TBL, TBR } },
+    { 16, { FL, FR, FC, LFE, BL, BR, FLC, FRC, SL, SR, TFL, TFC, TFR, TBL, TBC, TBR } },
+};
+
+// 5.1 content is tagged with either back or side surrounds
+static const ULONG g_Aliases[][2] = {
+    { SL, BL }, { SR, BR }, { BL, SL }, { BR, SR },
+};
+
+NTSTATUS CavernGetStandardLayout(
+    _In_ CAVERN_LAYOUT_ID Id,
+    _Out_ PCAVERN_CHANNEL_LAYOUT Layout
+)
+{
+    if ((ULONG)Id >= CavernLayoutCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    *Layout = g_StandardLayouts[Id];
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CavernLayoutFromMask(
+    _In_ ULONG ChannelMask,
+    _In_ ULONG Channels,
+    _Out_ PCAVERN_CHANNEL_LAYOUT Layout
+)
+{
+    RtlZeroMemory(Layout, sizeof(*Layout));
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    Layout->Channels = Channels;
+
+    ULONG channel = 0;
+    for (ULONG bit = 0; bit < 32 && channel < Channels; bit++) {
+        if (ChannelMask & (1u << bit)) {
+            Layout->Speakers[channel++] = 1u << bit;
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+ULONG CavernLayoutMask(_In_ CAVERN_LAYOUT_ID Id)
+{
+    ULONG mask = 0;
+
+    if ((ULONG)Id < CavernLayoutCount) {
+        for (ULONG i = 0; i < g_StandardLayouts[Id].Channels; i++) {
+            mask |= g_StandardLayouts[Id].Speakers[i];
+        }
+    }
+
+    return mask;
+}
+
+ULONG CavernDefaultChannelMask(_In_ ULONG Channels)
+{
+    static const ULONG masks[] = {
+        0,
+        FC,                                 // mono
+        FL | FR,                            // stereo
+        FL | FR | FC,
+        FL | FR | BL | BR,                  // quad
+        FL | FR | FC | BL | BR,
+        FL | FR | FC | LFE | BL | BR,       // 5.1
+        FL | FR | FC | LFE | BL | BR | SPEAKER_BACK_CENTER,
+        FL | FR | FC | LFE | BL | BR | SL | SR,     // 7.1 surround
+    };
+
+    if (Channels < sizeof(masks) / sizeof(masks[0])) {
+        return masks[Channels];
+    }
+
+    return (Channels >= 32) ? ~0u : ((1u << Channels) - 1);
+}
+
+CAVERN_LAYOUT_ID CavernCoveringLayout(_In_ ULONG ChannelMask)
+{
+    // The matrix spreads a centre-only stream over the pair
+    if (ChannelMask == FC) {
+        return CavernLayoutStereo;
+    }
+
+    for (ULONG id = 0; id < CavernLayoutCount; id++) {
+        ULONG layout = CavernLayoutMask((CAVERN_LAYOUT_ID)id);
+        ULONG missing = ChannelMask & ~layout;
+
+        for (ULONG a = 0; a < sizeof(g_Aliases) / sizeof(g_Aliases[0]); a++) {
+            if ((missing & g_Aliases[a][0]) && (layout & g_Aliases[a][1]) && !(ChannelMask & g_Aliases[a][1])) {
+                missing &= ~g_Aliases[a][0];
+            }
+        }
+
+        if (!missing) {
+            return (CAVERN_LAYOUT_ID)id;
+        }
+    }
+
+    return CavernLayoutFull16;
+}
+
+//=============================================================================
+// Kernels
+//=============================================================================
+
+static VOID RemapCopy(const CAVERN_REMAP_PLAN *Plan, const ULONG *Source, ULONG *Destination, SIZE_T Frames)
+{
+    RtlCopyMemory(Destination, Source, Frames * Plan->TargetChannels * sizeof(ULONG));
+}
+
+static VOID RemapGeneric(const CAVERN_REMAP_PLAN *Plan, const ULONG *Source, ULONG *Destination, SIZE_T Frames)
+{
+    const ULONG sourceChannels = Plan->SourceChannels;
+    const ULONG targetChannels = Plan->TargetChannels;
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        for (ULONG t = 0; t < targetChannels; t++) {
+            LONG s = Plan->Map[t];
+            Destination[t] = (s >= 0) ? Source[s] : 0;
+        }
+        Source += sourceChannels;
+        Destination += targetChannels;
+    }
+}
+
+//
+// Target width fixed at compile time: the channel loop is fully unrolled
+// and the map lives in registers. Silent targets read channel 0 through an
+// all-zero mask, so there are no branches per sample.
+//
+template <ULONG TargetChannels>
+static VOID RemapFixed(const CAVERN_REMAP_PLAN *Plan, const ULONG *Source, ULONG *Destination, SIZE_T Frames)
+{
+    const ULONG sourceChannels = Plan->SourceChannels;
+    ULONG index[TargetChannels];
+    ULONG keep[TargetChannels];
+
+    for (ULONG t = 0; t < TargetChannels; t++) {
+        index[t] = (Plan->Map[t] >= 0) ? (ULONG)Plan->Map[t] : 0;
+        keep[t] = (Plan->Map[t] >= 0) ? ~0u : 0;
+    }
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        for (ULONG t = 0; t < TargetChannels; t++) {
+            Destination[t] = Source[index[t]] & keep[t];
+        }
+        Source += sourceChannels;
+        Destination += TargetChannels;
+    }
+}
+
+#if defined(CAVERN_HAVE_AVX2)
+
+//
+// Eight target channels per gather; masked lanes (silence) stay zero.
+//
+template <ULONG TargetChannels>
+static VOID RemapGatherAvx2(const CAVERN_REMAP_PLAN *Plan, const ULONG *Source, ULONG *Destination, SIZE_T Frames)
+{
+    const ULONG sourceChannels = Plan->SourceChannels;
+    __m256i index[TargetChannels / 8];
+    __m256i mask[TargetChannels / 8];
+
+    for (ULONG v = 0; v < TargetChannels / 8; v++) {
+        index[v] = _mm256_loadu_si256((const __m256i *)&Plan->Map[v * 8]);
+        mask[v] = _mm256_cmpgt_epi32(index[v], _mm256_set1_epi32(-1));
+        index[v] = _mm256_and_si256(index[v], mask[v]);
+    }
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        for (ULONG v = 0; v < TargetChannels / 8; v++) {
+            __m256i values = _mm256_mask_i32gather_epi32(_mm256_setzero_si256(),
+                (const int *)Source, index[v], mask[v], 4);
+            _mm256_storeu_si256((__m256i *)(Destination + v * 8), values);
+        }
+        Source += sourceChannels;
+        Destination += TargetChannels;
+    }
+}
+
+#endif // CAVERN_HAVE_AVX2
+
+static PCAVERN_REMAP_KERNEL SelectKernel(ULONG TargetChannels)
+{
+    switch (TargetChannels) {
+#if defined(CAVERN_HAVE_AVX2)
+        case 8:  return RemapGatherAvx2<8>;
+        case 16: return RemapGatherAvx2<16>;
+#else
+        case 8:  return RemapFixed<8>;
+        case 16: return RemapFixed<16>;
+#endif
+        case 2:  return RemapFixed<2>;
+        case 6:  return RemapFixed<6>;
+        case 10: return RemapFixed<10>;
+        case 12: return RemapFixed<12>;
+        default: return RemapGeneric;
+    }
+}
+
+//=============================================================================
+// Plan compiler
+//=============================================================================
+
+static LONG FindSpeaker(const CAVERN_CHANNEL_LAYOUT *Layout, ULONG Speaker, ULONG Used)
+{
+    if (!Speaker) {
+        return -1;
+    }
+
+    for (ULONG i = 0; i < Layout->Channels; i++) {
+        if (Layout->Speakers[i] == Speaker && !(Used & (1u << i))) {
+            return (LONG)i;
+        }
+    }
+    return -1;
+}
+
+NTSTATUS CavernCompileRemap(
+    _In_ const CAVERN_CHANNEL_LAYOUT *Source,
+    _In_ const CAVERN_CHANNEL_LAYOUT *Target,
+    _Out_ PCAVERN_REMAP_PLAN Plan
+)
+{
+    ULONG used = 0;
+
+    RtlZeroMemory(Plan, sizeof(*Plan));
+
+    if (!Source->Channels || Source->Channels > CAVERN_MAX_CHANNELS ||
+        !Target->Channels || Target->Channels > CAVERN_MAX_CHANNELS) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    Plan->SourceChannels = Source->Channels;
+    Plan->TargetChannels = Target->Channels;
+
+    // Exact positions first, so an alias never steals a channel that has
+    // its own target.
+    for (ULONG t = 0; t < CAVERN_MAX_CHANNELS; t++) {
+        Plan->Map[t] = -1;
+        if (t < Target->Channels) {
+            Plan->Map[t] = FindSpeaker(Source, Target->Speakers[t], used);
+            if (Plan->Map[t] >= 0) {
+                used |= 1u << Plan->Map[t];
+            }
+        }
+    }
+
+    for (ULONG t = 0; t < Target->Channels; t++) {
+        if (Plan->Map[t] >= 0) {
+            continue;
+        }
+        for (ULONG a = 0; a < sizeof(g_Aliases) / sizeof(g_Aliases[0]); a++) {
+            if (g_Aliases[a][0] == Target->Speakers[t]) {
+                Plan->Map[t] = FindSpeaker(Source, g_Aliases[a][1], used);
+                if (Plan->Map[t] >= 0) {
+                    used |= 1u << Plan->Map[t];
+                    break;
+                }
+            }
+        }
+    }
+
+    Plan->DroppedSources = ~used & ((Source->Channels == 32) ? ~0u : ((1u << Source->Channels) - 1));
+
+    Plan->Identity = (Source->Channels == Target->Channels);
+    for (ULONG t = 0; t < Target->Channels && Plan->Identity; t++) {
+        Plan->Identity = (Plan->Map[t] == (LONG)t);
+    }
+
+    Plan->Kernel = Plan->Identity ? RemapCopy : SelectKernel(Target->Channels);
+
+    return STATUS_SUCCESS;
+}
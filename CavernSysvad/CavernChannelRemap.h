@@ -0,0 +1,124 @@
+/***************************************************************************
+ * CavernChannelRemap.h
+ *
+ * Channel reorder/remap for interleaved 32-bit samples (float or LONG).
+ * A (source layout, target layout) pair is compiled once into a plan
+ * holding, for every target channel, the source channel it reads or -1
+ * for silence, together with the kernel specialized for the target
+ * width. Running the plan is a straight gather per frame.
+ ***************************************************************************/
+
+#ifndef _CAVERN_CHANNELREMAP_H_
+#define _CAVERN_CHANNELREMAP_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+// Speaker positions, as in ksmedia.h
+#ifndef SPEAKER_FRONT_LEFT
+#define SPEAKER_FRONT_LEFT              0x1
+#define SPEAKER_FRONT_RIGHT             0x2
+#define SPEAKER_FRONT_CENTER            0x4
+#define SPEAKER_LOW_FREQUENCY           0x8
+#define SPEAKER_BACK_LEFT               0x10
+#define SPEAKER_BACK_RIGHT              0x20
+#define SPEAKER_FRONT_LEFT_OF_CENTER    0x40
+#define SPEAKER_FRONT_RIGHT_OF_CENTER   0x80
+#define SPEAKER_BACK_CENTER             0x100
+#define SPEAKER_SIDE_LEFT               0x200
+#define SPEAKER_SIDE_RIGHT              0x400
+#define SPEAKER_TOP_CENTER              0x800
+#define SPEAKER_TOP_FRONT_LEFT          0x1000
+#define SPEAKER_TOP_FRONT_CENTER        0x2000
+#define SPEAKER_TOP_FRONT_RIGHT         0x4000
+#define SPEAKER_TOP_BACK_LEFT           0x8000
+#define SPEAKER_TOP_BACK_CENTER         0x10000
+#define SPEAKER_TOP_BACK_RIGHT          0x20000
+#endif
+
+// Channel order of a stream: Speakers[i] is the position carried by
+// interleaved channel i, 0 for a channel without a position.
+typedef struct _CAVERN_CHANNEL_LAYOUT {
+    ULONG   Channels;
+    ULONG   Speakers[CAVERN_MAX_CHANNELS];
+} CAVERN_CHANNEL_LAYOUT, *PCAVERN_CHANNEL_LAYOUT;
+
+// Canonical speaker sets of the downstream renderer
+typedef enum _CAVERN_LAYOUT_ID {
+    CavernLayoutStereo = 0,
+    CavernLayout5_1,
+    CavernLayout7_1,
+    CavernLayout5_1_2,
+    CavernLayout5_1_4,
+    CavernLayout7_1_2,
+    CavernLayout7_1_4,
+    CavernLayoutFull16,         // 7.1.4 + wide fronts + top centers
+    CavernLayoutCount
+} CAVERN_LAYOUT_ID;
+
+struct _CAVERN_REMAP_PLAN;
+
+typedef VOID (*PCAVERN_REMAP_KERNEL)(
+    _In_ const struct _CAVERN_REMAP_PLAN *Plan,
+    _In_ const ULONG *Source,
+    _Out_ ULONG *Destination,
+    _In_ SIZE_T Frames
+);
+
+typedef struct _CAVERN_REMAP_PLAN {
+    ULONG                   SourceChannels;
+    ULONG                   TargetChannels;
+    LONG                    Map[CAVERN_MAX_CHANNELS];   // source index or -1
+    ULONG                   DroppedSources;             // bit i: source i unused
+    BOOLEAN                 Identity;
+    PCAVERN_REMAP_KERNEL    Kernel;
+} CAVERN_REMAP_PLAN, *PCAVERN_REMAP_PLAN;
+
+NTSTATUS CavernGetStandardLayout(
+    _In_ CAVERN_LAYOUT_ID Id,
+    _Out_ PCAVERN_CHANNEL_LAYOUT Layout
+);
+
+// Layout of a WAVEFORMATEXTENSIBLE stream: positions in dwChannelMask bit
+// order, channels past the last mask bit have no position.
+NTSTATUS CavernLayoutFromMask(
+    _In_ ULONG ChannelMask,
+    _In_ ULONG Channels,
+    _Out_ PCAVERN_CHANNEL_LAYOUT Layout
+);
+
+// Speaker positions of a standard layout, as a dwChannelMask.
+ULONG CavernLayoutMask(_In_ CAVERN_LAYOUT_ID Id);
+
+// dwChannelMask assumed for a stream that does not carry one, as for the
+// KSAUDIO_SPEAKER_* configurations; counts without one get the lowest bits.
+ULONG CavernDefaultChannelMask(_In_ ULONG Channels);
+
+// Smallest standard layout that carries every position in ChannelMask,
+// directly or through the back/side alias. Mono goes to stereo; a mask no
+// layout covers gets CavernLayoutFull16.
+CAVERN_LAYOUT_ID CavernCoveringLayout(_In_ ULONG ChannelMask);
+
+// Compiles the plan. Target positions missing from the source take the
+// back/side alias when it is otherwise unused, else silence.
+NTSTATUS CavernCompileRemap(
+    _In_ const CAVERN_CHANNEL_LAYOUT *Source,
+    _In_ const CAVERN_CHANNEL_LAYOUT *Target,
+    _Out_ PCAVERN_REMAP_PLAN Plan
+);
+
+// Source and Destination must not overlap.
+inline VOID CavernRemap(
+    _In_ const CAVERN_REMAP_PLAN *Plan,
+    _In_reads_bytes_(Frames * Plan->SourceChannels * 4) const VOID *Source,
+    _Out_writes_bytes_(Frames * Plan->TargetChannels * 4) VOID *Destination,
+    _In_ SIZE_T Frames
+)
+{
+    Plan->Kernel(Plan, (const ULONG *)Source, (ULONG *)Destination, Frames);
+}
+
+#endif // _CAVERN_CHANNELREMAP_H_
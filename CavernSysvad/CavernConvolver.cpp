@@ -0,0 +1,242 @@
+/***************************************************************************
+ * CavernConvolver.cpp
+ *
+ * Partitioned overlap-save convolver implementation
+ ***************************************************************************/
+
+#include "CavernConvolver.h"
+
+// MXCSR flush-to-zero and denormals-are-zero
+#define CAVERN_MXCSR_FTZ_DAZ    0x8040
+
+CCavernConvolver::CCavernConvolver()
+    : m_ulChannels(0),
+      m_ulLanes(0),
+      m_ulBlock(0),
+      m_ulMaxPartitions(0),
+      m_ulPartitions(0),
+      m_ulFill(0),
+      m_ulNewest(0),
+      m_ulAccumulated(0),
+      m_pFilters(NULL),
+      m_pHistory(NULL),
+      m_pSum(NULL),
+      m_pInput(NULL),
+      m_pOutput(NULL),
+      m_pTime(NULL)
+{
+}
+
+CCavernConvolver::~CCavernConvolver()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernConvolver::Init(
+    _In_ ULONG Channels,
+    _In_ ULONG BlockFrames,
+    _In_ ULONG MaxTaps,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS ||
+        BlockFrames < CAVERN_CONVOLVER_MIN_BLOCK || BlockFrames > CAVERN_CONVOLVER_MAX_BLOCK ||
+        (BlockFrames & (BlockFrames - 1)) || !MaxTaps || MaxTaps > CAVERN_CONVOLVER_MAX_TAPS) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG width = CCavernFft::LaneWidth(AllowSimd);
+    ULONG lanes = (Channels + width - 1) / width * width;
+
+    NTSTATUS status = m_Fft.Init(2 * BlockFrames, lanes, AllowSimd);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ULONG partitions = (MaxTaps + BlockFrames - 1) / BlockFrames;
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats() * sizeof(float);
+    SIZE_T row = (SIZE_T)lanes * sizeof(float);
+    SIZE_T total = 2 * partitions * spectrum + spectrum + 5 * BlockFrames * row;
+
+    m_pFilters = (float *)CavernAllocate(total, CAVERN_CONVOLVER_POOLTAG);
+    if (!m_pFilters) {
+        m_Fft.Cleanup();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pHistory = (float *)((PUCHAR)m_pFilters + partitions * spectrum);
+    m_pSum = (float *)((PUCHAR)m_pHistory + partitions * spectrum);
+    m_pInput = (float *)((PUCHAR)m_pSum + spectrum);
+    m_pOutput = (float *)((PUCHAR)m_pInput + 2 * BlockFrames * row);
+    m_pTime = (float *)((PUCHAR)m_pOutput + BlockFrames * row);
+
+    m_ulChannels = Channels;
+    m_ulLanes = lanes;
+    m_ulBlock = BlockFrames;
+    m_ulMaxPartitions = partitions;
+    m_ulPartitions = 0;
+    Reset();
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernConvolver::Cleanup()
+{
+    if (m_pFilters) {
+        CavernFree(m_pFilters, CAVERN_CONVOLVER_POOLTAG);
+        m_pFilters = NULL;
+    }
+    m_Fft.Cleanup();
+    m_pHistory = NULL;
+    m_pSum = NULL;
+    m_pInput = NULL;
+    m_pOutput = NULL;
+    m_pTime = NULL;
+    m_ulChannels = 0;
+    m_ulLanes = 0;
+    m_ulBlock = 0;
+    m_ulMaxPartitions = 0;
+    m_ulPartitions = 0;
+}
+
+NTSTATUS CCavernConvolver::SetFilters(
+    _In_reads_(TapCount * m_ulChannels) const float *Taps,
+    _In_ ULONG TapCount
+)
+{
+    if (!IsInitialized()) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    if ((TapCount && !Taps) || TapCount > m_ulMaxPartitions * m_ulBlock) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats();
+    ULONG partitions = (TapCount + m_ulBlock - 1) / m_ulBlock;
+
+    // Inverse returns 2 * block times the signal
+    float scale = 1.0f / (2 * m_ulBlock);
+
+    for (ULONG p = 0; p < partitions; p++) {
+        RtlZeroMemory(m_pTime, (SIZE_T)2 * m_ulBlock * m_ulLanes * sizeof(float));
+        for (ULONG i = 0; i < m_ulBlock && p * m_ulBlock + i < TapCount; i++) {
+            const float *tap = Taps + (SIZE_T)(p * m_ulBlock + i) * m_ulChannels;
+            for (ULONG c = 0; c < m_ulChannels; c++) {
+                m_pTime[(SIZE_T)i * m_ulLanes + c] = tap[c] * scale;
+            }
+        }
+        m_Fft.Forward(m_pTime, m_pFilters + p * spectrum);
+    }
+
+    m_ulPartitions = partitions;
+    Reset();
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernConvolver::Reset()
+{
+    if (!IsInitialized()) {
+        return;
+    }
+
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats() * sizeof(float);
+    SIZE_T row = (SIZE_T)m_ulLanes * sizeof(float);
+
+    RtlZeroMemory(m_pHistory, m_ulMaxPartitions * spectrum);
+    RtlZeroMemory(m_pSum, spectrum);
+    RtlZeroMemory(m_pInput, 2 * m_ulBlock * row);
+    RtlZeroMemory(m_pOutput, m_ulBlock * row);
+    m_ulFill = 0;
+    m_ulNewest = 0;
+    m_ulAccumulated = 0;
+}
+
+//
+// Adds partitions up to Partitions (1-based, partition 0 waits for the
+// block itself) into the sum for the block being filled. Partition p
+// multiplies the spectrum of the block p blocks back.
+//
+VOID CCavernConvolver::Accumulate(_In_ ULONG Partitions)
+{
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats();
+
+    while (m_ulAccumulated < Partitions) {
+        ULONG p = m_ulAccumulated + 1;
+        ULONG slot = (m_ulNewest + m_ulPartitions - (p - 1)) % m_ulPartitions;
+
+        m_Fft.MultiplyAdd(m_pHistory + slot * spectrum, m_pFilters + p * spectrum, m_pSum);
+        m_ulAccumulated = p;
+    }
+}
+
+//
+// The current block is full: transform the last two blocks, add partition
+// 0 and turn the sum back into the block's output.
+//
+VOID CCavernConvolver::RunBlock()
+{
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats();
+    SIZE_T half = (SIZE_T)m_ulBlock * m_ulLanes;
+    float *newest;
+
+    Accumulate(m_ulPartitions - 1);
+
+    m_ulNewest = (m_ulNewest + 1) % m_ulPartitions;
+    newest = m_pHistory + m_ulNewest * spectrum;
+    m_Fft.Forward(m_pInput, newest);
+    m_Fft.MultiplyAdd(newest, m_pFilters, m_pSum);
+
+    // Overlap-save: the first block of the inverse is wrapped around
+    m_Fft.Inverse(m_pSum, m_pTime);
+    RtlCopyMemory(m_pOutput, m_pTime + half, half * sizeof(float));
+    RtlCopyMemory(m_pInput, m_pInput + half, half * sizeof(float));
+
+    RtlZeroMemory(m_pSum, spectrum * sizeof(float));
+    m_ulAccumulated = 0;
+}
+
+VOID CCavernConvolver::Process(
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_ulPartitions || !Samples) {
+        return;
+    }
+
+#if defined(CAVERN_HAVE_SSE2)
+    unsigned int csr = _mm_getcsr();
+    _mm_setcsr(csr | CAVERN_MXCSR_FTZ_DAZ);
+#endif
+
+    for (SIZE_T done = 0; done < FrameCount; ) {
+        SIZE_T frames = min(FrameCount - done, (SIZE_T)(m_ulBlock - m_ulFill));
+        float *data = Samples + done * m_ulChannels;
+        float *in = m_pInput + ((SIZE_T)m_ulBlock + m_ulFill) * m_ulLanes;
+        const float *out = m_pOutput + (SIZE_T)m_ulFill * m_ulLanes;
+
+        for (SIZE_T f = 0; f < frames; f++) {
+            for (ULONG c = 0; c < m_ulChannels; c++) {
+                in[c] = data[c];
+                data[c] = out[c];
+            }
+            data += m_ulChannels;
+            in += m_ulLanes;
+            out += m_ulLanes;
+        }
+        m_ulFill += (ULONG)frames;
+        done += frames;
+
+        // The older partitions' share of the frames passed in so far
+        Accumulate((ULONG)((ULONGLONG)(m_ulPartitions - 1) * m_ulFill / m_ulBlock));
+
+        if (m_ulFill == m_ulBlock) {
+            RunBlock();
+            m_ulFill = 0;
+        }
+    }
+
+#if defined(CAVERN_HAVE_SSE2)
+    _mm_setcsr(csr);
+#endif
+}
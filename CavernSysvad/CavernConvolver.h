@@ -0,0 +1,133 @@
+/***************************************************************************
+ * CavernConvolver.h
+ *
+ * Long per-channel FIR filters (room correction measured as impulse
+ * responses, up to CAVERN_CONVOLVER_MAX_TAPS per channel) by uniformly
+ * partitioned overlap-save convolution. The filter is cut into partitions
+ * of one block each and every partition is kept as a spectrum of a 2 *
+ * block real FFT (CavernFft.h). The spectra of the last input blocks sit
+ * in a frequency-domain delay line, so each block costs one forward and
+ * one inverse transform plus one complex multiply-add per partition,
+ * against block * taps multiply-adds for direct convolution.
+ *
+ * Output lags input by exactly one block. Samples go in and come out
+ * through a FIFO, so Process takes any frame count; a block is transformed
+ * when it fills up. Partitions 1 and up only see older blocks, so their
+ * multiply-adds for the next block are done a share at a time while the
+ * current one fills, in proportion to the frames passed in; the call that
+ * completes a block only runs the transforms and partition 0. A 1 ms
+ * caller sees about the same cost on every call instead of all of it
+ * every block.
+ *
+ * SetFilters transforms the taps and resets the state; it must not run
+ * concurrently with Process. Init computes twiddles, so Init, SetFilters
+ * and Process must be bracketed with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState. Everything is allocated at Init for the
+ * longest filter the caller will load.
+ ***************************************************************************/
+
+#ifndef _CAVERN_CONVOLVER_H_
+#define _CAVERN_CONVOLVER_H_
+
+#include "CavernPortable.h"
+#include "CavernFft.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_CONVOLVER_POOLTAG        'vCvC'
+
+// Longest filter per channel
+#define CAVERN_CONVOLVER_MAX_TAPS       65536
+
+// Block sizes Init accepts
+#define CAVERN_CONVOLVER_MIN_BLOCK      32
+#define CAVERN_CONVOLVER_MAX_BLOCK      8192
+
+//
+// Largest power-of-two block that fits in PeriodMs at SampleRate, so the
+// added latency stays within one period.
+//
+inline ULONG CavernConvolverBlockFrames(_In_ ULONG SampleRate, _In_ ULONG PeriodMs)
+{
+    ULONG period = (ULONG)((ULONGLONG)SampleRate * PeriodMs / 1000);
+    ULONG block = CAVERN_CONVOLVER_MIN_BLOCK;
+
+    while (block * 2 <= period && block * 2 <= CAVERN_CONVOLVER_MAX_BLOCK) {
+        block *= 2;
+    }
+    return block;
+}
+
+class CCavernConvolver
+{
+public:
+    CCavernConvolver();
+    ~CCavernConvolver();
+
+    // BlockFrames is a power of two; MaxTaps sizes the partition storage.
+    NTSTATUS Init(
+        _In_ ULONG Channels,
+        _In_ ULONG BlockFrames,
+        _In_ ULONG MaxTaps,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Loads TapCount frames of interleaved taps, one per channel; zero taps
+    // passes the signal through with no delay.
+    NTSTATUS SetFilters(
+        _In_reads_(TapCount * m_ulChannels) const float *Taps,
+        _In_ ULONG TapCount
+    );
+
+    // Filters FrameCount interleaved float frames in place.
+    VOID Process(
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    // Clears the input history and the FIFO.
+    VOID Reset();
+
+    BOOLEAN IsInitialized() const { return m_pFilters != NULL; }
+    BOOLEAN IsTransparent() const { return m_ulPartitions == 0; }
+    ULONG GetChannels() const { return m_ulChannels; }
+    ULONG GetBlockFrames() const { return m_ulBlock; }
+    ULONG GetPartitions() const { return m_ulPartitions; }
+
+    // Frames of delay the filters add
+    ULONG GetLatency() const { return m_ulPartitions ? m_ulBlock : 0; }
+
+private:
+    VOID Accumulate(_In_ ULONG Partitions);
+    VOID RunBlock();
+
+    CCavernFft          m_Fft;
+    ULONG               m_ulChannels;
+    ULONG               m_ulLanes;          // channels padded to the vector width
+    ULONG               m_ulBlock;
+    ULONG               m_ulMaxPartitions;
+    ULONG               m_ulPartitions;     // 0: no filter loaded
+
+    ULONG               m_ulFill;           // frames of the current block
+    ULONG               m_ulNewest;         // delay line slot of the last block
+    ULONG               m_ulAccumulated;    // older partitions already in m_pSum
+
+    // Partition spectra, then the delay line of input spectra (one slot per
+    // partition, newest at m_ulNewest)
+    float              *m_pFilters;
+    float              *m_pHistory;
+
+    // Running sum of the spectrum of the block being filled
+    float              *m_pSum;
+
+    // Last two input blocks (2 * block rows), the output of the last block,
+    // and transform rows
+    float              *m_pInput;
+    float              *m_pOutput;
+    float              *m_pTime;
+};
+
+#endif // _CAVERN_CONVOLVER_H_
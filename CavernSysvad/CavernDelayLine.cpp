@@ -0,0 +1,360 @@
+/***************************************************************************
+ * CavernDelayLine.cpp
+ *
+ * Per-channel fractional delay implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernDelayLine.h"
+
+#define CAVERN_DELAY_ONE    (1UL << CAVERN_DELAY_FRACTION_BITS)
+
+//
+// Output[f] = sum over k of Coefficients[k] * History[f + TAPS - 1 - k],
+// History holding one channel oldest first. The vector kernels compute
+// four or eight frames at once, multiply then add in the same tap order,
+// so they match the scalar loop exactly.
+//
+static VOID Interpolate(
+    _In_reads_(CAVERN_DELAY_TAPS) const float *Coefficients,
+    _In_reads_(Frames + CAVERN_DELAY_TAPS - 1) const float *History,
+    _In_ SIZE_T Frames,
+    _Out_writes_(Frames) float *Output,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    const float *newest = History + CAVERN_DELAY_TAPS - 1;
+    SIZE_T f = 0;
+
+    // Two or four independent sums per pass hide the add latency
+#if defined(CAVERN_HAVE_AVX2)
+    if (AllowSimd) {
+        for (; f + 16 <= Frames; f += 16) {
+            __m256 a = _mm256_setzero_ps();
+            __m256 b = _mm256_setzero_ps();
+            for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+                __m256 h = _mm256_set1_ps(Coefficients[k]);
+                a = _mm256_add_ps(a, _mm256_mul_ps(h, _mm256_loadu_ps(newest + f - k)));
+                b = _mm256_add_ps(b, _mm256_mul_ps(h, _mm256_loadu_ps(newest + f + 8 - k)));
+            }
+            _mm256_storeu_ps(Output + f, a);
+            _mm256_storeu_ps(Output + f + 8, b);
+        }
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        for (; f + 16 <= Frames; f += 16) {
+            __m128 a = _mm_setzero_ps();
+            __m128 b = _mm_setzero_ps();
+            __m128 c = _mm_setzero_ps();
+            __m128 d = _mm_setzero_ps();
+            for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+                __m128 h = _mm_set1_ps(Coefficients[k]);
+                a = _mm_add_ps(a, _mm_mul_ps(h, _mm_loadu_ps(newest + f - k)));
+                b = _mm_add_ps(b, _mm_mul_ps(h, _mm_loadu_ps(newest + f + 4 - k)));
+                c = _mm_add_ps(c, _mm_mul_ps(h, _mm_loadu_ps(newest + f + 8 - k)));
+                d = _mm_add_ps(d, _mm_mul_ps(h, _mm_loadu_ps(newest + f + 12 - k)));
+            }
+            _mm_storeu_ps(Output + f, a);
+            _mm_storeu_ps(Output + f + 4, b);
+            _mm_storeu_ps(Output + f + 8, c);
+            _mm_storeu_ps(Output + f + 12, d);
+        }
+        for (; f + 4 <= Frames; f += 4) {
+            __m128 a = _mm_setzero_ps();
+            for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+                a = _mm_add_ps(a, _mm_mul_ps(_mm_set1_ps(Coefficients[k]), _mm_loadu_ps(newest + f - k)));
+            }
+            _mm_storeu_ps(Output + f, a);
+        }
+    }
+#endif
+
+    UNREFERENCED_PARAMETER(AllowSimd);
+
+    for (; f < Frames; f++) {
+        float sum = 0.0f;
+        for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+            sum += Coefficients[k] * newest[f - k];
+        }
+        Output[f] = sum;
+    }
+}
+
+// Zeroth-order modified Bessel function of the first kind
+static double BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 50 && term > sum * 1e-17; k++) {
+        double half = x / (2.0 * k);
+        term *= half * half;
+        sum += term;
+    }
+    return sum;
+}
+
+//
+// Taps for one delay. A whole-frame delay is a single tap. Otherwise
+// CAVERN_DELAY_TAPS taps, at First .. First + CAVERN_DELAY_TAPS - 1
+// frames, sample a windowed sinc at the point p frames past the first.
+// First puts the point between the middle two taps when the delay allows;
+// the taps are normalised so DC passes at unity.
+//
+static VOID ComputeTap(_In_ ULONG Delay, _Out_ PCAVERN_DELAY_TAP Tap)
+{
+    ULONG whole = Delay >> CAVERN_DELAY_FRACTION_BITS;
+
+    RtlZeroMemory(Tap, sizeof(*Tap));
+    Tap->Delay = Delay;
+
+    if (!Delay) {
+        return;
+    }
+
+    if (!(Delay & (CAVERN_DELAY_ONE - 1))) {
+        Tap->First = whole;
+        Tap->Taps = 1;
+        Tap->Coefficients[0] = 1.0f;
+        return;
+    }
+
+    Tap->First = (whole >= CAVERN_DELAY_CENTER_FRAMES) ? whole - CAVERN_DELAY_CENTER_FRAMES : 0;
+    Tap->Taps = CAVERN_DELAY_TAPS;
+
+    const double pi = 3.14159265358979323846;
+    const double half = CAVERN_DELAY_TAPS / 2;
+    const double norm = BesselI0(CAVERN_DELAY_KAISER_BETA);
+    double p = (double)(Delay - (Tap->First << CAVERN_DELAY_FRACTION_BITS)) / (double)CAVERN_DELAY_ONE;
+    double taps[CAVERN_DELAY_TAPS];
+    double sum = 0.0;
+
+    for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+        double x = (double)k - p;
+        double r = x / half;
+        double window = (r * r < 1.0) ? BesselI0(CAVERN_DELAY_KAISER_BETA * sqrt(1.0 - r * r)) / norm : 0.0;
+
+        taps[k] = sin(pi * x) / (pi * x) * window;
+        sum += taps[k];
+    }
+
+    for (ULONG k = 0; k < CAVERN_DELAY_TAPS; k++) {
+        Tap->Coefficients[k] = (float)(taps[k] / sum);
+    }
+}
+
+CCavernDelayLine::CCavernDelayLine()
+    : m_pRing(NULL),
+      m_ulRingFrames(0),
+      m_ulMask(0),
+      m_ulChannels(0),
+      m_ulMaxDelay(0),
+      m_ulWrite(0),
+      m_AllowSimd(FALSE),
+      m_ulSequence(0),
+      m_ulAppliedSequence(0),
+      m_bDelayed(FALSE)
+{
+    RtlZeroMemory((PVOID)m_Requested, sizeof(m_Requested));
+    RtlZeroMemory(m_Taps, sizeof(m_Taps));
+}
+
+CCavernDelayLine::~CCavernDelayLine()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernDelayLine::Init(
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG MaxDelayMs,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || !SampleRate) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONGLONG maxFrames = ((ULONGLONG)SampleRate * MaxDelayMs + 999) / 1000;
+    if (maxFrames >= (CAVERN_DELAY_ONE - 1)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // A block, the longest delay and the older interpolation taps
+    ULONG needed = CAVERN_DELAY_BLOCK_FRAMES + (ULONG)maxFrames + CAVERN_DELAY_TAPS;
+    ULONG ringFrames = 1;
+    while (ringFrames < needed) {
+        ringFrames <<= 1;
+    }
+
+    m_pRing = (float *)CavernAllocate((SIZE_T)ringFrames * Channels * sizeof(float), CAVERN_DELAY_POOLTAG);
+    if (!m_pRing) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    m_ulRingFrames = ringFrames;
+    m_ulMask = ringFrames - 1;
+    m_ulChannels = Channels;
+    m_ulMaxDelay = (ULONG)maxFrames << CAVERN_DELAY_FRACTION_BITS;
+    m_ulWrite = 0;
+    m_AllowSimd = AllowSimd;
+
+    RtlZeroMemory((PVOID)m_Requested, sizeof(m_Requested));
+    RtlZeroMemory(m_Taps, sizeof(m_Taps));
+    m_ulSequence = 0;
+    m_ulAppliedSequence = 0;
+    m_bDelayed = FALSE;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernDelayLine::Cleanup()
+{
+    if (m_pRing) {
+        CavernFree(m_pRing, CAVERN_DELAY_POOLTAG);
+        m_pRing = NULL;
+    }
+    m_ulRingFrames = 0;
+    m_ulMask = 0;
+    m_ulChannels = 0;
+    m_bDelayed = FALSE;
+}
+
+VOID CCavernDelayLine::SetDelays(_In_reads_(Count) const ULONG *Delays, _In_ ULONG Count)
+{
+    m_ulSequence++;
+    CavernMemoryBarrier();
+
+    for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+        m_Requested[c] = (c < Count) ? min(Delays[c], m_ulMaxDelay) : 0;
+    }
+
+    CavernMemoryBarrier();
+    m_ulSequence++;
+}
+
+VOID CCavernDelayLine::Reset()
+{
+    if (m_pRing) {
+        RtlZeroMemory(m_pRing, (SIZE_T)m_ulRingFrames * m_ulChannels * sizeof(float));
+    }
+}
+
+//
+// Takes the requested set if SetDelays is not in the middle of writing
+// it, and only if it did not start another one while it was copied.
+//
+VOID CCavernDelayLine::ApplyDelays()
+{
+    ULONG requested[CAVERN_MAX_CHANNELS];
+    ULONG sequence = m_ulSequence;
+
+    if (sequence == m_ulAppliedSequence || (sequence & 1)) {
+        return;
+    }
+
+    CavernMemoryBarrier();
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        requested[c] = m_Requested[c];
+    }
+    CavernMemoryBarrier();
+
+    if (m_ulSequence != sequence) {
+        return;
+    }
+
+    m_bDelayed = FALSE;
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        if (m_Taps[c].Delay != requested[c]) {
+            ComputeTap(requested[c], &m_Taps[c]);
+        }
+        m_bDelayed |= (m_Taps[c].Taps != 0);
+    }
+
+    m_ulAppliedSequence = sequence;
+}
+
+//
+// Reads one channel of the block just written back from the ring. Ring
+// frame (m_ulWrite + f - First - k) holds tap k of output frame f.
+//
+VOID CCavernDelayLine::DelayChannel(
+    _In_ ULONG Channel,
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    const CAVERN_DELAY_TAP *tap = &m_Taps[Channel];
+    const float *ring = m_pRing + Channel;
+    const ULONG channels = m_ulChannels;
+    const ULONG mask = m_ulMask;
+    ULONG newest = m_ulWrite - tap->First;
+    float *out = Samples + Channel;
+
+    if (tap->Taps == 1) {
+        for (SIZE_T f = 0; f < FrameCount; f++) {
+            out[f * channels] = ring[((newest + (ULONG)f) & mask) * channels];
+        }
+        return;
+    }
+
+    // Gather the channel's window, then filter it contiguously
+    ULONG oldest = newest - (CAVERN_DELAY_TAPS - 1);
+    SIZE_T span = FrameCount + CAVERN_DELAY_TAPS - 1;
+
+    for (SIZE_T j = 0; j < span; j++) {
+        m_History[j] = ring[((oldest + (ULONG)j) & mask) * channels];
+    }
+
+    Interpolate(tap->Coefficients, m_History, FrameCount, m_Filtered, m_AllowSimd);
+
+    for (SIZE_T f = 0; f < FrameCount; f++) {
+        out[f * channels] = m_Filtered[f];
+    }
+}
+
+//
+// Each block goes into the ring first and is then read back per channel,
+// so the delay may be shorter than the block and the data may be
+// processed in place. With no channel delayed only the history is kept.
+//
+VOID CCavernDelayLine::Process(
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_pRing) {
+        return;
+    }
+
+    ApplyDelays();
+
+    while (FrameCount) {
+        ULONG block = (ULONG)min(FrameCount, (SIZE_T)CAVERN_DELAY_BLOCK_FRAMES);
+        ULONG offset = m_ulWrite & m_ulMask;
+        ULONG first = min(block, m_ulRingFrames - offset);
+
+        RtlCopyMemory(m_pRing + (SIZE_T)offset * m_ulChannels, Samples, (SIZE_T)first * m_ulChannels * sizeof(float));
+        if (first < block) {
+            RtlCopyMemory(m_pRing, Samples + (SIZE_T)first * m_ulChannels,
+                          (SIZE_T)(block - first) * m_ulChannels * sizeof(float));
+        }
+
+        if (m_bDelayed) {
+            for (ULONG c = 0; c < m_ulChannels; c++) {
+                if (m_Taps[c].Taps) {
+                    DelayChannel(c, Samples, block);
+                }
+            }
+        }
+
+        m_ulWrite += block;
+        Samples += (SIZE_T)block * m_ulChannels;
+        FrameCount -= block;
+    }
+}
@@ -0,0 +1,138 @@
+/***************************************************************************
+ * CavernDelayLine.h
+ *
+ * Per-channel delay for speaker time alignment. Each channel of an
+ * interleaved float stream is delayed by a whole number of frames plus a
+ * fraction. Whole-frame delays are copied exactly. Fractional ones go
+ * through a CAVERN_DELAY_TAPS-tap Kaiser-windowed sinc, flat to about
+ * 16 kHz at 48 kHz (4-point Lagrange interpolation is a dB down by
+ * 10 kHz); the channel is gathered out of the ring and filtered several
+ * frames at a time with SSE2/AVX2. The window is centred on the delay only
+ * from CAVERN_DELAY_CENTER_FRAMES up, so callers aligning speakers should
+ * give every channel at least that much.
+ *
+ * All channels share one interleaved ring allocated at Init, a power of
+ * two frames long so positions wrap with a mask. Delays are given in
+ * 1/65536 frame and replaced as a whole set: SetDelays writes them under a
+ * sequence count, like the position register page, and Process picks up a
+ * complete set at its next block (a set still being written waits for the
+ * following one). Nothing is allocated after Init. A new delay takes
+ * effect without a crossfade, which suits set-up rather than automation.
+ *
+ * SetDelays does no float work; the caller serializes calls to it. Process
+ * must be bracketed with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState and called from one thread at a time.
+ ***************************************************************************/
+
+#ifndef _CAVERN_DELAYLINE_H_
+#define _CAVERN_DELAYLINE_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_DELAY_POOLTAG        'lDvC'
+
+// Longest delay Init is normally asked for; room for speakers some 30 m
+// apart plus their network path differences
+#define CAVERN_DELAY_MAX_MS         100
+
+// Frames written into the ring before they are read back
+#define CAVERN_DELAY_BLOCK_FRAMES   256
+
+// Delays are fixed point with this many fraction bits
+#define CAVERN_DELAY_FRACTION_BITS  16
+
+// Interpolation window for fractional delays, and its shape (about 85 dB
+// error below 10 kHz at 48 kHz)
+#define CAVERN_DELAY_TAPS           16
+#define CAVERN_DELAY_KAISER_BETA    8.0
+
+// Shortest fractional delay the window is centred on
+#define CAVERN_DELAY_CENTER_FRAMES  (CAVERN_DELAY_TAPS / 2 - 1)
+
+//
+// Delay in 1/65536 frame for a time in microseconds; no float work.
+//
+inline ULONG CavernDelayFromMicroseconds(_In_ ULONG Microseconds, _In_ ULONG SampleRate)
+{
+    ULONGLONG delay = ((ULONGLONG)Microseconds * SampleRate << CAVERN_DELAY_FRACTION_BITS) / 1000000;
+    return (delay > 0xFFFFFFFF) ? 0xFFFFFFFF : (ULONG)delay;
+}
+
+typedef struct _CAVERN_DELAY_TAP {
+    ULONG       Delay;          // applied, 1/65536 frame
+    ULONG       First;          // whole-frame delay of the first tap
+    ULONG       Taps;           // 0: not delayed, 1: copy, or CAVERN_DELAY_TAPS
+    float       Coefficients[CAVERN_DELAY_TAPS];
+} CAVERN_DELAY_TAP, *PCAVERN_DELAY_TAP;
+
+class CCavernDelayLine
+{
+public:
+    CCavernDelayLine();
+    ~CCavernDelayLine();
+
+    // MaxDelayMs: longest delay SetDelays may ask for; longer ones are
+    // clamped to it.
+    NTSTATUS Init(
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG MaxDelayMs,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Replaces the delays of all channels (1/65536 frame each); channels
+    // from Count on are not delayed. Picked up by the next Process.
+    VOID SetDelays(_In_reads_(Count) const ULONG *Delays, _In_ ULONG Count);
+
+    // Delays FrameCount interleaved float frames in place.
+    VOID Process(
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    // Forgets the history; the next frames are delayed behind silence.
+    VOID Reset();
+
+    BOOLEAN IsInitialized() const { return m_pRing != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+    ULONG GetMaxDelay() const { return m_ulMaxDelay; }
+
+    // TRUE while no channel is delayed and no new set is waiting.
+    BOOLEAN IsTransparent() const { return !m_bDelayed && m_ulSequence == m_ulAppliedSequence; }
+
+private:
+    VOID ApplyDelays();
+    VOID DelayChannel(
+        _In_ ULONG Channel,
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    float              *m_pRing;
+    ULONG               m_ulRingFrames;
+    ULONG               m_ulMask;
+    ULONG               m_ulChannels;
+    ULONG               m_ulMaxDelay;       // 1/65536 frame
+    ULONG               m_ulWrite;          // frames written; free-running
+    BOOLEAN             m_AllowSimd;
+
+    // Requested set; written only while m_ulSequence is odd
+    volatile ULONG      m_ulSequence;
+    volatile ULONG      m_Requested[CAVERN_MAX_CHANNELS];
+
+    // Applied set; Process only
+    ULONG               m_ulAppliedSequence;
+    BOOLEAN             m_bDelayed;
+    CAVERN_DELAY_TAP    m_Taps[CAVERN_MAX_CHANNELS];
+
+    // One channel of a block, gathered and filtered
+    float               m_History[CAVERN_DELAY_BLOCK_FRAMES + CAVERN_DELAY_TAPS - 1];
+    float               m_Filtered[CAVERN_DELAY_BLOCK_FRAMES];
+};
+
+#endif // _CAVERN_DELAYLINE_H_
@@ -0,0 +1,514 @@
+/***************************************************************************
+ * CavernFft.cpp
+ *
+ * Lane-parallel real FFT implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernFft.h"
+
+//
+// Vector of lanes the kernels are written against. Each butterfly below is
+// the scalar one on V::Type; lanes never mix.
+//
+struct CavernFftScalar {
+    typedef float Type;
+    enum { Width = 1 };
+    static Type Load(const float *p) { return *p; }
+    static VOID Store(float *p, Type v) { *p = v; }
+    static Type Set(float v) { return v; }
+    static Type Add(Type a, Type b) { return a + b; }
+    static Type Sub(Type a, Type b) { return a - b; }
+    static Type Mul(Type a, Type b) { return a * b; }
+};
+
+#if defined(CAVERN_HAVE_SSE2)
+struct CavernFftSse2 {
+    typedef __m128 Type;
+    enum { Width = 4 };
+    static Type Load(const float *p) { return _mm_loadu_ps(p); }
+    static VOID Store(float *p, Type v) { _mm_storeu_ps(p, v); }
+    static Type Set(float v) { return _mm_set1_ps(v); }
+    static Type Add(Type a, Type b) { return _mm_add_ps(a, b); }
+    static Type Sub(Type a, Type b) { return _mm_sub_ps(a, b); }
+    static Type Mul(Type a, Type b) { return _mm_mul_ps(a, b); }
+};
+#endif
+
+#if defined(CAVERN_HAVE_AVX2)
+struct CavernFftAvx2 {
+    typedef __m256 Type;
+    enum { Width = 8 };
+    static Type Load(const float *p) { return _mm256_loadu_ps(p); }
+    static VOID Store(float *p, Type v) { _mm256_storeu_ps(p, v); }
+    static Type Set(float v) { return _mm256_set1_ps(v); }
+    static Type Add(Type a, Type b) { return _mm256_add_ps(a, b); }
+    static Type Sub(Type a, Type b) { return _mm256_sub_ps(a, b); }
+    static Type Mul(Type a, Type b) { return _mm256_mul_ps(a, b); }
+};
+#endif
+
+//
+// Forward complex transform of Points rows, natural order in, bit-reversed
+// out. W holds Points twiddles, real parts then imaginary parts.
+//
+template <class V>
+static VOID ForwardComplex(
+    _Inout_ float *Re,
+    _Inout_ float *Im,
+    _In_ const float *W,
+    _In_ ULONG Points,
+    _In_ ULONG Lanes
+)
+{
+    const float *wr = W;
+    const float *wi = W + Points;
+    ULONG length = Points;
+
+    // Two radix-2 stages at a time: spans q * 2 and q
+    for (; length >= 4; length /= 4) {
+        ULONG q = length / 4;
+        ULONG stride = Points / length;
+
+        for (ULONG start = 0; start < Points; start += length) {
+            for (ULONG j = 0; j < q; j++) {
+                typename V::Type w1r = V::Set(wr[j * stride]), w1i = V::Set(wi[j * stride]);
+                typename V::Type w2r = V::Set(wr[2 * j * stride]), w2i = V::Set(wi[2 * j * stride]);
+                typename V::Type w3r = V::Set(wr[3 * j * stride]), w3i = V::Set(wi[3 * j * stride]);
+                SIZE_T r0 = (SIZE_T)(start + j) * Lanes;
+                SIZE_T r1 = r0 + (SIZE_T)q * Lanes;
+                SIZE_T r2 = r1 + (SIZE_T)q * Lanes;
+                SIZE_T r3 = r2 + (SIZE_T)q * Lanes;
+
+                for (ULONG l = 0; l < Lanes; l += V::Width) {
+                    typename V::Type a0r = V::Load(Re + r0 + l), a0i = V::Load(Im + r0 + l);
+                    typename V::Type a1r = V::Load(Re + r1 + l), a1i = V::Load(Im + r1 + l);
+                    typename V::Type a2r = V::Load(Re + r2 + l), a2i = V::Load(Im + r2 + l);
+                    typename V::Type a3r = V::Load(Re + r3 + l), a3i = V::Load(Im + r3 + l);
+
+                    typename V::Type b0r = V::Add(a0r, a2r), b0i = V::Add(a0i, a2i);
+                    typename V::Type d0r = V::Sub(a0r, a2r), d0i = V::Sub(a0i, a2i);
+                    typename V::Type b1r = V::Add(a1r, a3r), b1i = V::Add(a1i, a3i);
+
+                    // d1 = -i (a1 - a3)
+                    typename V::Type d1r = V::Sub(a1i, a3i), d1i = V::Sub(a3r, a1r);
+
+                    typename V::Type x1r = V::Sub(b0r, b1r), x1i = V::Sub(b0i, b1i);
+                    typename V::Type x2r = V::Add(d0r, d1r), x2i = V::Add(d0i, d1i);
+                    typename V::Type x3r = V::Sub(d0r, d1r), x3i = V::Sub(d0i, d1i);
+
+                    V::Store(Re + r0 + l, V::Add(b0r, b1r));
+                    V::Store(Im + r0 + l, V::Add(b0i, b1i));
+                    V::Store(Re + r1 + l, V::Sub(V::Mul(x1r, w2r), V::Mul(x1i, w2i)));
+                    V::Store(Im + r1 + l, V::Add(V::Mul(x1r, w2i), V::Mul(x1i, w2r)));
+                    V::Store(Re + r2 + l, V::Sub(V::Mul(x2r, w1r), V::Mul(x2i, w1i)));
+                    V::Store(Im + r2 + l, V::Add(V::Mul(x2r, w1i), V::Mul(x2i, w1r)));
+                    V::Store(Re + r3 + l, V::Sub(V::Mul(x3r, w3r), V::Mul(x3i, w3i)));
+                    V::Store(Im + r3 + l, V::Add(V::Mul(x3r, w3i), V::Mul(x3i, w3r)));
+                }
+            }
+        }
+    }
+
+    // Odd number of radix-2 stages: the last one has no twiddles
+    if (length == 2) {
+        for (ULONG start = 0; start < Points; start += 2) {
+            SIZE_T r0 = (SIZE_T)start * Lanes;
+            SIZE_T r1 = r0 + Lanes;
+
+            for (ULONG l = 0; l < Lanes; l += V::Width) {
+                typename V::Type ar = V::Load(Re + r0 + l), ai = V::Load(Im + r0 + l);
+                typename V::Type br = V::Load(Re + r1 + l), bi = V::Load(Im + r1 + l);
+                V::Store(Re + r0 + l, V::Add(ar, br));
+                V::Store(Im + r0 + l, V::Add(ai, bi));
+                V::Store(Re + r1 + l, V::Sub(ar, br));
+                V::Store(Im + r1 + l, V::Sub(ai, bi));
+            }
+        }
+    }
+}
+
+//
+// Undoes ForwardComplex: bit-reversed order in, natural order out, Points
+// times the original.
+//
+template <class V>
+static VOID InverseComplex(
+    _Inout_ float *Re,
+    _Inout_ float *Im,
+    _In_ const float *W,
+    _In_ ULONG Points,
+    _In_ ULONG Lanes
+)
+{
+    const float *wr = W;
+    const float *wi = W + Points;
+    ULONG length = 4;
+
+    // Forward ended with a radix-2 stage when log2(Points) is odd
+    if (Points & 0xAAAAAAAA) {
+        for (ULONG start = 0; start < Points; start += 2) {
+            SIZE_T r0 = (SIZE_T)start * Lanes;
+            SIZE_T r1 = r0 + Lanes;
+
+            for (ULONG l = 0; l < Lanes; l += V::Width) {
+                typename V::Type ar = V::Load(Re + r0 + l), ai = V::Load(Im + r0 + l);
+                typename V::Type br = V::Load(Re + r1 + l), bi = V::Load(Im + r1 + l);
+                V::Store(Re + r0 + l, V::Add(ar, br));
+                V::Store(Im + r0 + l, V::Add(ai, bi));
+                V::Store(Re + r1 + l, V::Sub(ar, br));
+                V::Store(Im + r1 + l, V::Sub(ai, bi));
+            }
+        }
+        length = 8;
+    }
+
+    for (; length <= Points; length *= 4) {
+        ULONG q = length / 4;
+        ULONG stride = Points / length;
+
+        for (ULONG start = 0; start < Points; start += length) {
+            for (ULONG j = 0; j < q; j++) {
+                typename V::Type w1r = V::Set(wr[j * stride]), w1i = V::Set(wi[j * stride]);
+                typename V::Type w2r = V::Set(wr[2 * j * stride]), w2i = V::Set(wi[2 * j * stride]);
+                typename V::Type w3r = V::Set(wr[3 * j * stride]), w3i = V::Set(wi[3 * j * stride]);
+                SIZE_T r0 = (SIZE_T)(start + j) * Lanes;
+                SIZE_T r1 = r0 + (SIZE_T)q * Lanes;
+                SIZE_T r2 = r1 + (SIZE_T)q * Lanes;
+                SIZE_T r3 = r2 + (SIZE_T)q * Lanes;
+
+                for (ULONG l = 0; l < Lanes; l += V::Width) {
+                    typename V::Type x0r = V::Load(Re + r0 + l), x0i = V::Load(Im + r0 + l);
+                    typename V::Type x1r = V::Load(Re + r1 + l), x1i = V::Load(Im + r1 + l);
+                    typename V::Type x2r = V::Load(Re + r2 + l), x2i = V::Load(Im + r2 + l);
+                    typename V::Type x3r = V::Load(Re + r3 + l), x3i = V::Load(Im + r3 + l);
+
+                    // Conjugate twiddles
+                    typename V::Type vr = V::Add(V::Mul(x1r, w2r), V::Mul(x1i, w2i));
+                    typename V::Type vi = V::Sub(V::Mul(x1i, w2r), V::Mul(x1r, w2i));
+                    typename V::Type ur = V::Add(V::Mul(x2r, w1r), V::Mul(x2i, w1i));
+                    typename V::Type ui = V::Sub(V::Mul(x2i, w1r), V::Mul(x2r, w1i));
+                    typename V::Type tr = V::Add(V::Mul(x3r, w3r), V::Mul(x3i, w3i));
+                    typename V::Type ti = V::Sub(V::Mul(x3i, w3r), V::Mul(x3r, w3i));
+
+                    typename V::Type pr = V::Add(x0r, vr), pi = V::Add(x0i, vi);
+                    typename V::Type mr = V::Sub(x0r, vr), mi = V::Sub(x0i, vi);
+                    typename V::Type sr = V::Add(ur, tr), si = V::Add(ui, ti);
+                    typename V::Type dr = V::Sub(ur, tr), di = V::Sub(ui, ti);
+
+                    // a1 = m + i d, a3 = m - i d
+                    V::Store(Re + r0 + l, V::Add(pr, sr));
+                    V::Store(Im + r0 + l, V::Add(pi, si));
+                    V::Store(Re + r2 + l, V::Sub(pr, sr));
+                    V::Store(Im + r2 + l, V::Sub(pi, si));
+                    V::Store(Re + r1 + l, V::Sub(mr, di));
+                    V::Store(Im + r1 + l, V::Add(mi, dr));
+                    V::Store(Re + r3 + l, V::Add(mr, di));
+                    V::Store(Im + r3 + l, V::Sub(mi, dr));
+                }
+            }
+        }
+    }
+}
+
+//
+// Real transform of Points * 2 samples: complex transform of the sample
+// pairs, then split into Points + 1 bins. X[k] and X[Points - k] come from
+// the same two complex bins.
+//
+template <class V>
+static VOID ForwardReal(
+    _In_ const float *Time,
+    _Out_ float *Spectrum,
+    _Inout_ float *Work,
+    _In_ const float *W,
+    _In_ const float *S,
+    _In_ const ULONG *Reverse,
+    _In_ ULONG Points,
+    _In_ ULONG Lanes
+)
+{
+    float *zr = Work;
+    float *zi = Work + (SIZE_T)Points * Lanes;
+    float *xr = Spectrum;
+    float *xi = Spectrum + (SIZE_T)(Points + 1) * Lanes;
+    typename V::Type half = V::Set(0.5f);
+
+    for (ULONG m = 0; m < Points; m++) {
+        RtlCopyMemory(zr + (SIZE_T)m * Lanes, Time + (SIZE_T)2 * m * Lanes, Lanes * sizeof(float));
+        RtlCopyMemory(zi + (SIZE_T)m * Lanes, Time + ((SIZE_T)2 * m + 1) * Lanes, Lanes * sizeof(float));
+    }
+
+    ForwardComplex<V>(zr, zi, W, Points, Lanes);
+
+    for (ULONG k = 0; k <= Points / 2; k++) {
+        SIZE_T rk = (SIZE_T)Reverse[k] * Lanes;
+        SIZE_T rj = (SIZE_T)Reverse[(Points - k) & (Points - 1)] * Lanes;
+        SIZE_T ok = (SIZE_T)k * Lanes;
+        SIZE_T oj = (SIZE_T)(Points - k) * Lanes;
+        typename V::Type wr = V::Set(S[k]);
+        typename V::Type wi = V::Set(S[Points + 1 + k]);
+
+        for (ULONG l = 0; l < Lanes; l += V::Width) {
+            typename V::Type ar = V::Load(zr + rk + l), ai = V::Load(zi + rk + l);
+            typename V::Type cr = V::Load(zr + rj + l), ci = V::Load(zi + rj + l);
+
+            // Even and odd sample spectra
+            typename V::Type er = V::Mul(V::Add(ar, cr), half);
+            typename V::Type ei = V::Mul(V::Sub(ai, ci), half);
+            typename V::Type fr = V::Mul(V::Add(ai, ci), half);
+            typename V::Type fi = V::Mul(V::Sub(cr, ar), half);
+
+            typename V::Type gr = V::Sub(V::Mul(fr, wr), V::Mul(fi, wi));
+            typename V::Type gi = V::Add(V::Mul(fr, wi), V::Mul(fi, wr));
+
+            V::Store(xr + ok + l, V::Add(er, gr));
+            V::Store(xi + ok + l, V::Add(ei, gi));
+            V::Store(xr + oj + l, V::Sub(er, gr));
+            V::Store(xi + oj + l, V::Sub(gi, ei));
+        }
+    }
+}
+
+//
+// Inverse of ForwardReal without the halving, so the samples come out
+// Points * 2 times too large.
+//
+template <class V>
+static VOID InverseReal(
+    _In_ const float *Spectrum,
+    _Out_ float *Time,
+    _Inout_ float *Work,
+    _In_ const float *W,
+    _In_ const float *S,
+    _In_ const ULONG *Reverse,
+    _In_ ULONG Points,
+    _In_ ULONG Lanes
+)
+{
+    float *zr = Work;
+    float *zi = Work + (SIZE_T)Points * Lanes;
+    const float *xr = Spectrum;
+    const float *xi = Spectrum + (SIZE_T)(Points + 1) * Lanes;
+
+    for (ULONG k = 0; k <= Points / 2; k++) {
+        SIZE_T ik = (SIZE_T)k * Lanes;
+        SIZE_T ij = (SIZE_T)(Points - k) * Lanes;
+        SIZE_T rk = (SIZE_T)Reverse[k] * Lanes;
+        SIZE_T rj = (SIZE_T)Reverse[(Points - k) & (Points - 1)] * Lanes;
+        typename V::Type wr = V::Set(S[k]);
+        typename V::Type wi = V::Set(S[Points + 1 + k]);
+
+        for (ULONG l = 0; l < Lanes; l += V::Width) {
+            typename V::Type ar = V::Load(xr + ik + l), ai = V::Load(xi + ik + l);
+            typename V::Type cr = V::Load(xr + ij + l), ci = V::Load(xi + ij + l);
+
+            typename V::Type er = V::Add(ar, cr), ei = V::Sub(ai, ci);
+            typename V::Type tr = V::Sub(ar, cr), ti = V::Add(ai, ci);
+
+            // Odd spectrum: t times the conjugate twiddle
+            typename V::Type fr = V::Add(V::Mul(tr, wr), V::Mul(ti, wi));
+            typename V::Type fi = V::Sub(V::Mul(ti, wr), V::Mul(tr, wi));
+
+            // Z[k] = e + i f, Z[Points - k] = conj(e) + i conj(f); k = 0
+            // and k = Points / 2 write the same row twice with one value
+            V::Store(zr + rj + l, V::Add(er, fi));
+            V::Store(zi + rj + l, V::Sub(fr, ei));
+            V::Store(zr + rk + l, V::Sub(er, fi));
+            V::Store(zi + rk + l, V::Add(ei, fr));
+        }
+    }
+
+    InverseComplex<V>(zr, zi, W, Points, Lanes);
+
+    for (ULONG m = 0; m < Points; m++) {
+        RtlCopyMemory(Time + (SIZE_T)2 * m * Lanes, zr + (SIZE_T)m * Lanes, Lanes * sizeof(float));
+        RtlCopyMemory(Time + ((SIZE_T)2 * m + 1) * Lanes, zi + (SIZE_T)m * Lanes, Lanes * sizeof(float));
+    }
+}
+
+template <class V>
+static VOID MultiplyAddKernel(
+    _In_ const float *Spectrum,
+    _In_ const float *Filter,
+    _Inout_ float *Accumulator,
+    _In_ SIZE_T Count
+)
+{
+    const float *xi = Spectrum + Count;
+    const float *hi = Filter + Count;
+    float *yi = Accumulator + Count;
+
+    for (SIZE_T n = 0; n < Count; n += V::Width) {
+        typename V::Type ar = V::Load(Spectrum + n), ai = V::Load(xi + n);
+        typename V::Type br = V::Load(Filter + n), bi = V::Load(hi + n);
+        V::Store(Accumulator + n, V::Add(V::Load(Accumulator + n), V::Sub(V::Mul(ar, br), V::Mul(ai, bi))));
+        V::Store(yi + n, V::Add(V::Load(yi + n), V::Add(V::Mul(ar, bi), V::Mul(ai, br))));
+    }
+}
+
+CCavernFft::CCavernFft()
+    : m_ulSize(0),
+      m_ulLanes(0),
+      m_ulWidth(1),
+      m_pTwiddles(NULL),
+      m_pSplit(NULL),
+      m_pReverse(NULL),
+      m_pWork(NULL)
+{
+}
+
+CCavernFft::~CCavernFft()
+{
+    Cleanup();
+}
+
+ULONG CCavernFft::LaneWidth(_In_ BOOLEAN AllowSimd)
+{
+    if (!AllowSimd) {
+        return 1;
+    }
+#if defined(CAVERN_HAVE_AVX2)
+    return CavernFftAvx2::Width;
+#elif defined(CAVERN_HAVE_SSE2)
+    return CavernFftSse2::Width;
+#else
+    return 1;
+#endif
+}
+
+NTSTATUS CCavernFft::Init(
+    _In_ ULONG Size,
+    _In_ ULONG Lanes,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    ULONG width = LaneWidth(AllowSimd);
+
+    if (Size < CAVERN_FFT_MIN_SIZE || Size > CAVERN_FFT_MAX_SIZE || (Size & (Size - 1)) ||
+        !Lanes || Lanes % width) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG points = Size / 2;
+    SIZE_T twiddles = (SIZE_T)2 * points * sizeof(float);
+    SIZE_T split = (SIZE_T)2 * (points + 1) * sizeof(float);
+    SIZE_T reverse = (SIZE_T)points * sizeof(ULONG);
+    SIZE_T work = (SIZE_T)2 * points * Lanes * sizeof(float);
+
+    m_pTwiddles = (float *)CavernAllocate(twiddles + split + reverse + work, CAVERN_FFT_POOLTAG);
+    if (!m_pTwiddles) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pSplit = (float *)((PUCHAR)m_pTwiddles + twiddles);
+    m_pReverse = (ULONG *)((PUCHAR)m_pSplit + split);
+    m_pWork = (float *)((PUCHAR)m_pReverse + reverse);
+
+    const double pi = 3.14159265358979323846;
+    ULONG bits = 0;
+
+    while ((1UL << bits) < points) {
+        bits++;
+    }
+    for (ULONG j = 0; j < points; j++) {
+        m_pTwiddles[j] = (float)cos(2.0 * pi * j / points);
+        m_pTwiddles[points + j] = (float)-sin(2.0 * pi * j / points);
+
+        ULONG r = 0;
+        for (ULONG b = 0; b < bits; b++) {
+            r |= ((j >> b) & 1) << (bits - 1 - b);
+        }
+        m_pReverse[j] = r;
+    }
+    for (ULONG k = 0; k <= points; k++) {
+        m_pSplit[k] = (float)cos(2.0 * pi * k / Size);
+        m_pSplit[points + 1 + k] = (float)-sin(2.0 * pi * k / Size);
+    }
+
+    m_ulSize = Size;
+    m_ulLanes = Lanes;
+    m_ulWidth = width;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernFft::Cleanup()
+{
+    if (m_pTwiddles) {
+        CavernFree(m_pTwiddles, CAVERN_FFT_POOLTAG);
+        m_pTwiddles = NULL;
+    }
+    m_pSplit = NULL;
+    m_pReverse = NULL;
+    m_pWork = NULL;
+    m_ulSize = 0;
+    m_ulLanes = 0;
+}
+
+VOID CCavernFft::Forward(
+    _In_reads_(Size * Lanes) const float *Time,
+    _Out_writes_(2 * Bins * Lanes) float *Spectrum
+)
+{
+    ULONG points = m_ulSize / 2;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_ulWidth == CavernFftAvx2::Width) {
+        ForwardReal<CavernFftAvx2>(Time, Spectrum, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+        return;
+    }
+#endif
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_ulWidth == CavernFftSse2::Width) {
+        ForwardReal<CavernFftSse2>(Time, Spectrum, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+        return;
+    }
+#endif
+    ForwardReal<CavernFftScalar>(Time, Spectrum, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+}
+
+VOID CCavernFft::Inverse(
+    _In_reads_(2 * Bins * Lanes) const float *Spectrum,
+    _Out_writes_(Size * Lanes) float *Time
+)
+{
+    ULONG points = m_ulSize / 2;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_ulWidth == CavernFftAvx2::Width) {
+        InverseReal<CavernFftAvx2>(Spectrum, Time, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+        return;
+    }
+#endif
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_ulWidth == CavernFftSse2::Width) {
+        InverseReal<CavernFftSse2>(Spectrum, Time, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+        return;
+    }
+#endif
+    InverseReal<CavernFftScalar>(Spectrum, Time, m_pWork, m_pTwiddles, m_pSplit, m_pReverse, points, m_ulLanes);
+}
+
+VOID CCavernFft::MultiplyAdd(
+    _In_reads_(2 * Bins * Lanes) const float *Spectrum,
+    _In_reads_(2 * Bins * Lanes) const float *Filter,
+    _Inout_updates_(2 * Bins * Lanes) float *Accumulator
+)
+{
+    SIZE_T count = (SIZE_T)GetBins() * m_ulLanes;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_ulWidth == CavernFftAvx2::Width) {
+        MultiplyAddKernel<CavernFftAvx2>(Spectrum, Filter, Accumulator, count);
+        return;
+    }
+#endif
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_ulWidth == CavernFftSse2::Width) {
+        MultiplyAddKernel<CavernFftSse2>(Spectrum, Filter, Accumulator, count);
+        return;
+    }
+#endif
+    MultiplyAddKernel<CavernFftScalar>(Spectrum, Filter, Accumulator, count);
+}
@@ -0,0 +1,100 @@
+/***************************************************************************
+ * CavernFft.h
+ *
+ * Real FFT for several channels at once. Like the biquad cascade, the
+ * channels are the SIMD lanes: a signal is Size rows of Lanes floats (one
+ * row per sample, one lane per channel), and every butterfly works on
+ * whole rows, so the transform is the plain scalar algorithm run on
+ * vectors of four (SSE2) or eight (AVX2) channels with no shuffles. The
+ * kernels multiply then add in the scalar loop's order, so the result is
+ * bit-identical to it.
+ *
+ * A real transform of Size points is a complex one of Size / 2 points on
+ * the even and odd samples, split into Size / 2 + 1 bins afterwards. The
+ * complex transform is decimation in frequency with radix-2^2 stages (two
+ * radix-2 stages fused, three twiddle multiplies per four points) and a
+ * radix-2 stage when log2(Size / 2) is odd. It leaves the bins in
+ * bit-reversed order and the inverse (decimation in time) takes them that
+ * way, so neither direction permutes data; only the split between
+ * complex and real bins looks rows up through a bit-reversal table.
+ *
+ * Spectra are Size / 2 + 1 rows of real parts followed by as many rows of
+ * imaginary parts. Inverse is not normalized: it returns Size times the
+ * signal, which callers fold into their filters. Everything is allocated
+ * at Init. Forward, Inverse and MultiplyAdd must be bracketed with
+ * KeSaveFloatingPointState / KeRestoreFloatingPointState and called from
+ * one thread at a time.
+ ***************************************************************************/
+
+#ifndef _CAVERN_FFT_H_
+#define _CAVERN_FFT_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_FFT_POOLTAG      'tFvC'
+
+// Transform sizes Init accepts
+#define CAVERN_FFT_MIN_SIZE     8
+#define CAVERN_FFT_MAX_SIZE     65536
+
+class CCavernFft
+{
+public:
+    CCavernFft();
+    ~CCavernFft();
+
+    // Lanes must be a multiple of LaneWidth(AllowSimd).
+    NTSTATUS Init(
+        _In_ ULONG Size,
+        _In_ ULONG Lanes,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Time: Size rows. Spectrum: GetBins() rows of real, then imaginary
+    // parts.
+    VOID Forward(
+        _In_reads_(Size * Lanes) const float *Time,
+        _Out_writes_(2 * Bins * Lanes) float *Spectrum
+    );
+
+    // Size times the signal whose spectrum is given.
+    VOID Inverse(
+        _In_reads_(2 * Bins * Lanes) const float *Spectrum,
+        _Out_writes_(Size * Lanes) float *Time
+    );
+
+    // Accumulator += Spectrum * Filter, bin by bin.
+    VOID MultiplyAdd(
+        _In_reads_(2 * Bins * Lanes) const float *Spectrum,
+        _In_reads_(2 * Bins * Lanes) const float *Filter,
+        _Inout_updates_(2 * Bins * Lanes) float *Accumulator
+    );
+
+    BOOLEAN IsInitialized() const { return m_pTwiddles != NULL; }
+    ULONG GetSize() const { return m_ulSize; }
+    ULONG GetBins() const { return m_ulSize / 2 + 1; }
+    ULONG GetLanes() const { return m_ulLanes; }
+
+    // Floats in one spectrum
+    SIZE_T GetSpectrumFloats() const { return (SIZE_T)2 * GetBins() * m_ulLanes; }
+
+    // Vector width the kernels would use; lane counts are padded to it.
+    static ULONG LaneWidth(_In_ BOOLEAN AllowSimd);
+
+private:
+    ULONG               m_ulSize;
+    ULONG               m_ulLanes;
+    ULONG               m_ulWidth;          // 8 AVX2, 4 SSE2, 1 scalar
+
+    // e^(-2 pi i j / (Size / 2)) for the complex transform, then
+    // e^(-2 pi i k / Size) for the split, real parts first
+    float              *m_pTwiddles;
+    float              *m_pSplit;
+    ULONG              *m_pReverse;         // bit reversal over Size / 2
+
+    // Complex work rows, real then imaginary
+    float              *m_pWork;
+};
+
+#endif // _CAVERN_FFT_H_
@@ -0,0 +1,438 @@
+/***************************************************************************
+ * CavernFormatConvert.cpp
+ *
+ * PCM sample-format conversion kernels
+ ***************************************************************************/
+
+#include "CavernFormatConvert.h"
+
+#define CAVERN_SCALE_8      (1.0f / 128.0f)
+#define CAVERN_SCALE_16     (1.0f / 32768.0f)
+#define CAVERN_SCALE_24     (1.0f / 8388608.0f)
+#define CAVERN_SCALE_32     (1.0f / 2147483648.0f)
+
+// Largest float below 2^31; 2^31 itself does not fit a LONG
+#define CAVERN_MAX_S32_FLOAT    2147483520.0f
+
+//=============================================================================
+// Scalar helpers. Clamp and rounding follow the SSE2 instructions exactly:
+// max/min return the bound for NaN and cvtps2dq rounds to nearest-even.
+//=============================================================================
+
+static inline float ClampSample(float Value, float Low, float High)
+{
+    Value = (Value > Low) ? Value : Low;
+    Value = (Value < High) ? Value : High;
+    return Value;
+}
+
+static inline LONG RoundToLong(float Value)
+{
+    // Adding and removing 2^23 drops the fraction with round-to-nearest-even;
+    // at or above 2^23 every float is already an integer.
+    // Written as selects rather than branches so the loops vectorize.
+    float magic = (Value >= 0.0f) ? 8388608.0f : -8388608.0f;
+    float rounded = (Value + magic) - magic;
+
+    return (LONG)((Value >= 8388608.0f || Value <= -8388608.0f) ? Value : rounded);
+}
+
+static inline LONG LoadS24(const BYTE *Source)
+{
+    return (LONG)(((ULONG)Source[0] << 8) | ((ULONG)Source[1] << 16) | ((ULONG)Source[2] << 24)) >> 8;
+}
+
+static inline VOID StoreS24(BYTE *Destination, LONG Value)
+{
+    Destination[0] = (BYTE)Value;
+    Destination[1] = (BYTE)(Value >> 8);
+    Destination[2] = (BYTE)(Value >> 16);
+}
+
+//=============================================================================
+// Scalar kernels
+//=============================================================================
+
+static VOID U8ToFloatScalar(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const BYTE *source = (const BYTE *)Source;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        Destination[i] = (float)((LONG)source[i] - 128) * CAVERN_SCALE_8;
+    }
+}
+
+static VOID FloatToU8Scalar(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    BYTE *destination = (BYTE *)Destination;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        destination[i] = (BYTE)(RoundToLong(ClampSample(Source[i] * 128.0f, -128.0f, 127.0f)) + 128);
+    }
+}
+
+static VOID S16ToFloatScalar(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const SHORT *source = (const SHORT *)Source;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        Destination[i] = (float)source[i] * CAVERN_SCALE_16;
+    }
+}
+
+static VOID FloatToS16Scalar(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    SHORT *destination = (SHORT *)Destination;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        destination[i] = (SHORT)RoundToLong(ClampSample(Source[i] * 32768.0f, -32768.0f, 32767.0f));
+    }
+}
+
+static VOID S24PackedToFloatScalar(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const BYTE *source = (const BYTE *)Source;
+
+    for (SIZE_T i = 0; i < Samples; i++, source += 3) {
+        Destination[i] = (float)LoadS24(source) * CAVERN_SCALE_24;
+    }
+}
+
+static VOID FloatToS24PackedScalar(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    BYTE *destination = (BYTE *)Destination;
+
+    for (SIZE_T i = 0; i < Samples; i++, destination += 3) {
+        StoreS24(destination, RoundToLong(ClampSample(Source[i] * 8388608.0f, -8388608.0f, 8388607.0f)));
+    }
+}
+
+static VOID S24In32ToFloatScalar(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const LONG *source = (const LONG *)Source;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        Destination[i] = (float)(source[i] >> 8) * CAVERN_SCALE_24;
+    }
+}
+
+static VOID FloatToS24In32Scalar(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    LONG *destination = (LONG *)Destination;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        LONG value = RoundToLong(ClampSample(Source[i] * 8388608.0f, -8388608.0f, 8388607.0f));
+        destination[i] = (LONG)((ULONG)value << 8);
+    }
+}
+
+static VOID S32ToFloatScalar(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const LONG *source = (const LONG *)Source;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        Destination[i] = (float)source[i] * CAVERN_SCALE_32;
+    }
+}
+
+static VOID FloatToS32Scalar(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    LONG *destination = (LONG *)Destination;
+
+    for (SIZE_T i = 0; i < Samples; i++) {
+        destination[i] = RoundToLong(ClampSample(Source[i] * 2147483648.0f, -2147483648.0f, CAVERN_MAX_S32_FLOAT));
+    }
+}
+
+static VOID F32ToFloat(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    RtlCopyMemory(Destination, Source, Samples * sizeof(float));
+}
+
+static VOID FloatToF32(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    RtlCopyMemory(Destination, Source, Samples * sizeof(float));
+}
+
+//=============================================================================
+// SSE2 kernels. Each handles whole vectors and finishes with the scalar
+// kernel, so the two paths agree bit for bit.
+//=============================================================================
+
+#if defined(CAVERN_HAVE_SSE2)
+
+static inline __m128i FloatToLongSse2(__m128 Value, __m128 Scale, __m128 Low, __m128 High)
+{
+    Value = _mm_mul_ps(Value, Scale);
+    Value = _mm_max_ps(Value, Low);
+    Value = _mm_min_ps(Value, High);
+    return _mm_cvtps_epi32(Value);
+}
+
+static VOID U8ToFloatSse2(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const BYTE *source = (const BYTE *)Source;
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i bias = _mm_set1_epi16(128);
+    const __m128 scale = _mm_set1_ps(CAVERN_SCALE_8);
+    SIZE_T i = 0;
+
+    for (; i + 16 <= Samples; i += 16) {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)(source + i));
+        __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(bytes, zero), bias);
+        __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(bytes, zero), bias);
+
+        _mm_storeu_ps(Destination + i,      _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(lo, lo), 16)), scale));
+        _mm_storeu_ps(Destination + i + 4,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(lo, lo), 16)), scale));
+        _mm_storeu_ps(Destination + i + 8,  _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(hi, hi), 16)), scale));
+        _mm_storeu_ps(Destination + i + 12, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(hi, hi), 16)), scale));
+    }
+
+    U8ToFloatScalar(source + i, Destination + i, Samples - i);
+}
+
+static VOID FloatToU8Sse2(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    BYTE *destination = (BYTE *)Destination;
+    const __m128 scale = _mm_set1_ps(128.0f);
+    const __m128 low = _mm_set1_ps(-128.0f);
+    const __m128 high = _mm_set1_ps(127.0f);
+    const __m128i bias = _mm_set1_epi16(128);
+    SIZE_T i = 0;
+
+    for (; i + 16 <= Samples; i += 16) {
+        __m128i a = FloatToLongSse2(_mm_loadu_ps(Source + i),      scale, low, high);
+        __m128i b = FloatToLongSse2(_mm_loadu_ps(Source + i + 4),  scale, low, high);
+        __m128i c = FloatToLongSse2(_mm_loadu_ps(Source + i + 8),  scale, low, high);
+        __m128i d = FloatToLongSse2(_mm_loadu_ps(Source + i + 12), scale, low, high);
+        __m128i lo = _mm_add_epi16(_mm_packs_epi32(a, b), bias);
+        __m128i hi = _mm_add_epi16(_mm_packs_epi32(c, d), bias);
+
+        _mm_storeu_si128((__m128i *)(destination + i), _mm_packus_epi16(lo, hi));
+    }
+
+    FloatToU8Scalar(Source + i, destination + i, Samples - i);
+}
+
+static VOID S16ToFloatSse2(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const SHORT *source = (const SHORT *)Source;
+    const __m128 scale = _mm_set1_ps(CAVERN_SCALE_16);
+    SIZE_T i = 0;
+
+    for (; i + 8 <= Samples; i += 8) {
+        __m128i words = _mm_loadu_si128((const __m128i *)(source + i));
+
+        _mm_storeu_ps(Destination + i,     _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16)), scale));
+        _mm_storeu_ps(Destination + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpackhi_epi16(words, words), 16)), scale));
+    }
+
+    S16ToFloatScalar(source + i, Destination + i, Samples - i);
+}
+
+static VOID FloatToS16Sse2(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    SHORT *destination = (SHORT *)Destination;
+    const __m128 scale = _mm_set1_ps(32768.0f);
+    const __m128 low = _mm_set1_ps(-32768.0f);
+    const __m128 high = _mm_set1_ps(32767.0f);
+    SIZE_T i = 0;
+
+    for (; i + 8 <= Samples; i += 8) {
+        __m128i a = FloatToLongSse2(_mm_loadu_ps(Source + i),     scale, low, high);
+        __m128i b = FloatToLongSse2(_mm_loadu_ps(Source + i + 4), scale, low, high);
+
+        _mm_storeu_si128((__m128i *)(destination + i), _mm_packs_epi32(a, b));
+    }
+
+    FloatToS16Scalar(Source + i, destination + i, Samples - i);
+}
+
+static VOID S24PackedToFloatSse2(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const BYTE *source = (const BYTE *)Source;
+    const __m128 scale = _mm_set1_ps(CAVERN_SCALE_24);
+    SIZE_T i = 0;
+
+    // No byte shuffle in SSE2: gather the four samples with scalar loads
+    // and do the conversion and scaling in vector registers.
+    for (; i + 4 <= Samples; i += 4, source += 12) {
+        __m128i values = _mm_set_epi32(LoadS24(source + 9), LoadS24(source + 6),
+                                       LoadS24(source + 3), LoadS24(source));
+
+        _mm_storeu_ps(Destination + i, _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+    }
+
+    S24PackedToFloatScalar(source, Destination + i, Samples - i);
+}
+
+static VOID FloatToS24PackedSse2(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    BYTE *destination = (BYTE *)Destination;
+    const __m128 scale = _mm_set1_ps(8388608.0f);
+    const __m128 low = _mm_set1_ps(-8388608.0f);
+    const __m128 high = _mm_set1_ps(8388607.0f);
+    SIZE_T i = 0;
+
+    for (; i + 4 <= Samples; i += 4, destination += 12) {
+        __m128i values = FloatToLongSse2(_mm_loadu_ps(Source + i), scale, low, high);
+        __m128i mask = _mm_set1_epi32(0x00FFFFFF);
+
+        // Pack four 24-bit values into 12 bytes: low dword keeps 3 bytes
+        // of sample 0 plus 1 of sample 1, and so on.
+        values = _mm_and_si128(values, mask);
+        ULONG s0 = (ULONG)_mm_cvtsi128_si32(values);
+        ULONG s1 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(values, 4));
+        ULONG s2 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(values, 8));
+        ULONG s3 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(values, 12));
+        ULONG words[3] = {
+            s0 | (s1 << 24),
+            (s1 >> 8) | (s2 << 16),
+            (s2 >> 16) | (s3 << 8)
+        };
+
+        RtlCopyMemory(destination, words, sizeof(words));
+    }
+
+    FloatToS24PackedScalar(Source + i, destination, Samples - i);
+}
+
+static VOID S24In32ToFloatSse2(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const LONG *source = (const LONG *)Source;
+    const __m128 scale = _mm_set1_ps(CAVERN_SCALE_24);
+    SIZE_T i = 0;
+
+    for (; i + 4 <= Samples; i += 4) {
+        __m128i values = _mm_srai_epi32(_mm_loadu_si128((const __m128i *)(source + i)), 8);
+
+        _mm_storeu_ps(Destination + i, _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+    }
+
+    S24In32ToFloatScalar(source + i, Destination + i, Samples - i);
+}
+
+static VOID FloatToS24In32Sse2(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    LONG *destination = (LONG *)Destination;
+    const __m128 scale = _mm_set1_ps(8388608.0f);
+    const __m128 low = _mm_set1_ps(-8388608.0f);
+    const __m128 high = _mm_set1_ps(8388607.0f);
+    SIZE_T i = 0;
+
+    for (; i + 4 <= Samples; i += 4) {
+        __m128i values = FloatToLongSse2(_mm_loadu_ps(Source + i), scale, low, high);
+
+        _mm_storeu_si128((__m128i *)(destination + i), _mm_slli_epi32(values, 8));
+    }
+
+    FloatToS24In32Scalar(Source + i, destination + i, Samples - i);
+}
+
+static VOID S32ToFloatSse2(const VOID *Source, float *Destination, SIZE_T Samples)
+{
+    const LONG *source = (const LONG *)Source;
+    const __m128 scale = _mm_set1_ps(CAVERN_SCALE_32);
+    SIZE_T i = 0;
+
+    for (; i + 4 <= Samples; i += 4) {
+        __m128i values = _mm_loadu_si128((const __m128i *)(source + i));
+
+        _mm_storeu_ps(Destination + i, _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+    }
+
+    S32ToFloatScalar(source + i, Destination + i, Samples - i);
+}
+
+static VOID FloatToS32Sse2(const float *Source, VOID *Destination, SIZE_T Samples)
+{
+    LONG *destination = (LONG *)Destination;
+    const __m128 scale = _mm_set1_ps(2147483648.0f);
+    const __m128 low = _mm_set1_ps(-2147483648.0f);
+    const __m128 high = _mm_set1_ps(CAVERN_MAX_S32_FLOAT);
+    SIZE_T i = 0;
+
+    for (; i + 4 <= Samples; i += 4) {
+        _mm_storeu_si128((__m128i *)(destination + i),
+                         FloatToLongSse2(_mm_loadu_ps(Source + i), scale, low, high));
+    }
+
+    FloatToS32Scalar(Source + i, destination + i, Samples - i);
+}
+
+#endif // CAVERN_HAVE_SSE2
+
+//=============================================================================
+// Selection
+//=============================================================================
+
+typedef struct _CAVERN_CONVERTER_ENTRY {
+    ULONG               BytesPerSample;
+    PCAVERN_TO_FLOAT    ToFloatScalar;
+    PCAVERN_FROM_FLOAT  FromFloatScalar;
+    PCAVERN_TO_FLOAT    ToFloatSimd;
+    PCAVERN_FROM_FLOAT  FromFloatSimd;
+} CAVERN_CONVERTER_ENTRY;
+
+#if defined(CAVERN_HAVE_SSE2)
+#define CAVERN_SIMD(Kernel) Kernel##Sse2
+#else
+#define CAVERN_SIMD(Kernel) NULL
+#endif
+
+static const CAVERN_CONVERTER_ENTRY g_Converters[CavernSampleFormatCount] = {
+    { 0, NULL, NULL, NULL, NULL },
+    { 1, U8ToFloatScalar,        FloatToU8Scalar,        CAVERN_SIMD(U8ToFloat),        CAVERN_SIMD(FloatToU8) },
+    { 2, S16ToFloatScalar,       FloatToS16Scalar,       CAVERN_SIMD(S16ToFloat),       CAVERN_SIMD(FloatToS16) },
+    { 3, S24PackedToFloatScalar, FloatToS24PackedScalar, CAVERN_SIMD(S24PackedToFloat), CAVERN_SIMD(FloatToS24Packed) },
+    { 4, S24In32ToFloatScalar,   FloatToS24In32Scalar,   CAVERN_SIMD(S24In32ToFloat),   CAVERN_SIMD(FloatToS24In32) },
+    { 4, S32ToFloatScalar,       FloatToS32Scalar,       CAVERN_SIMD(S32ToFloat),       CAVERN_SIMD(FloatToS32) },
+    { 4, F32ToFloat,             FloatToF32,             NULL,                          NULL },
+};
+
+CAVERN_SAMPLE_FORMAT CavernSampleFormatFromWave(
+    _In_ USHORT BitsPerSample,
+    _In_ USHORT ValidBitsPerSample,
+    _In_ BOOLEAN IsFloat
+)
+{
+    if (IsFloat) {
+        return BitsPerSample == 32 ? CavernSampleF32 : CavernSampleUnknown;
+    }
+
+    switch (BitsPerSample) {
+        case 8:  return CavernSampleU8;
+        case 16: return CavernSampleS16;
+        case 24: return CavernSampleS24Packed;
+        case 32: return (ValidBitsPerSample == 24) ? CavernSampleS24In32 : CavernSampleS32;
+        default: return CavernSampleUnknown;
+    }
+}
+
+NTSTATUS CavernSelectConverter(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ BOOLEAN AllowSimd,
+    _Out_ PCAVERN_CONVERTER Converter
+)
+{
+    RtlZeroMemory(Converter, sizeof(*Converter));
+
+    if (Format <= CavernSampleUnknown || Format >= CavernSampleFormatCount) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    const CAVERN_CONVERTER_ENTRY *entry = &g_Converters[Format];
+
+    Converter->Format = Format;
+    Converter->BytesPerSample = entry->BytesPerSample;
+    Converter->ToFloat = entry->ToFloatScalar;
+    Converter->FromFloat = entry->FromFloatScalar;
+
+    if (AllowSimd && entry->ToFloatSimd && entry->FromFloatSimd) {
+        Converter->ToFloat = entry->ToFloatSimd;
+        Converter->FromFloat = entry->FromFloatSimd;
+        Converter->Simd = TRUE;
+    }
+
+    return STATUS_SUCCESS;
+}
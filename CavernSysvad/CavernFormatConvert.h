@@ -0,0 +1,65 @@
+/***************************************************************************
+ * CavernFormatConvert.h
+ *
+ * PCM sample-format conversion to and from the 32-bit float processing
+ * format. Every format has a scalar kernel and, where available, an SSE2
+ * kernel that produces bit-identical output. Float to integer rounds to
+ * nearest-even and saturates; integer to float scales by 2^-(bits-1).
+ *
+ * Kernel callers must bracket the kernels with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState, as ToneGenerator does.
+ ***************************************************************************/
+
+#ifndef _CAVERN_FORMATCONVERT_H_
+#define _CAVERN_FORMATCONVERT_H_
+
+#include "CavernPortable.h"
+
+typedef enum _CAVERN_SAMPLE_FORMAT {
+    CavernSampleUnknown = 0,
+    CavernSampleU8,             // unsigned 8-bit, 128 = silence
+    CavernSampleS16,
+    CavernSampleS24Packed,      // 3 bytes per sample
+    CavernSampleS24In32,        // 24 valid bits, MSB-aligned in 32
+    CavernSampleS32,
+    CavernSampleF32,
+    CavernSampleFormatCount
+} CAVERN_SAMPLE_FORMAT;
+
+typedef VOID (*PCAVERN_TO_FLOAT)(
+    _In_reads_bytes_(Samples * BytesPerSample) const VOID *Source,
+    _Out_writes_(Samples) float *Destination,
+    _In_ SIZE_T Samples
+);
+
+typedef VOID (*PCAVERN_FROM_FLOAT)(
+    _In_reads_(Samples) const float *Source,
+    _Out_writes_bytes_(Samples * BytesPerSample) VOID *Destination,
+    _In_ SIZE_T Samples
+);
+
+typedef struct _CAVERN_CONVERTER {
+    CAVERN_SAMPLE_FORMAT    Format;
+    ULONG                   BytesPerSample;
+    BOOLEAN                 Simd;
+    PCAVERN_TO_FLOAT        ToFloat;
+    PCAVERN_FROM_FLOAT      FromFloat;
+} CAVERN_CONVERTER, *PCAVERN_CONVERTER;
+
+// Maps the fields of a WAVEFORMATEX(TENSIBLE) onto a sample format.
+// IsFloat is TRUE for WAVE_FORMAT_IEEE_FLOAT or the IEEE float subformat.
+CAVERN_SAMPLE_FORMAT CavernSampleFormatFromWave(
+    _In_ USHORT BitsPerSample,
+    _In_ USHORT ValidBitsPerSample,
+    _In_ BOOLEAN IsFloat
+);
+
+// Fills Converter with the kernels for Format. AllowSimd = FALSE forces
+// the scalar kernels.
+NTSTATUS CavernSelectConverter(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ BOOLEAN AllowSimd,
+    _Out_ PCAVERN_CONVERTER Converter
+);
+
+#endif // _CAVERN_FORMATCONVERT_H_
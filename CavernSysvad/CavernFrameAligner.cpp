@@ -0,0 +1,351 @@
+/***************************************************************************
+ * CavernFrameAligner.cpp
+ *
+ * Frame-aligned forwarding implementation
+ ***************************************************************************/
+
+#include "CavernFrameAligner.h"
+
+// IEC 61937 preamble Pa/Pb (0xF872, 0x4E1F) as little-endian 16-bit words
+#define IEC61937_SYNC_0     0x72
+#define IEC61937_SYNC_1     0xF8
+#define IEC61937_SYNC_2     0x1F
+#define IEC61937_SYNC_3     0x4E
+#define IEC61937_HEADER     8
+
+// AC-3 frame sizes in 16-bit words, [frmsizecod][fscod] (48, 44.1, 32 kHz)
+static const USHORT g_Ac3FrameWords[38][3] = {
+    {   64,   69,   96 }, {   64,   70,   96 }, {   80,   87,  120 }, {   80,   88,  120 },
+    {   96,  104,  144 }, {   96,  105,  144 }, {  112,  121,  168 }, {  112,  122,  168 },
+    {  128,  139,  192 }, {  128,  140,  192 }, {  160,  174,  240 }, {  160,  175,  240 },
+    {  192,  208,  288 }, {  192,  209,  288 }, {  224,  243,  336 }, {  224,  244,  336 },
+    {  256,  278,  384 }, {  256,  279,  384 }, {  320,  348,  480 }, {  320,  349,  480 },
+    {  384,  417,  576 }, {  384,  418,  576 }, {  448,  487,  672 }, {  448,  488,  672 },
+    {  512,  557,  768 }, {  512,  558,  768 }, {  640,  696,  960 }, {  640,  697,  960 },
+    {  768,  835, 1152 }, {  768,  836, 1152 }, {  896,  975, 1344 }, {  896,  976, 1344 },
+    { 1024, 1114, 1536 }, { 1024, 1115, 1536 }, { 1152, 1253, 1728 }, { 1152, 1254, 1728 },
+    { 1280, 1393, 1920 }, { 1280, 1394, 1920 }
+};
+
+//
+// Burst repetition period in stereo 16-bit frames for an IEC 61937 data
+// type, 0 when the period has to be found from the next preamble.
+//
+static ULONG Iec61937RepetitionFrames(_In_ ULONG DataType)
+{
+    switch (DataType) {
+        case 1:  return 1536;       // AC-3
+        case 11: return 512;        // DTS type I
+        case 12: return 1024;       // DTS type II
+        case 13: return 2048;       // DTS type III
+        case 21: return 6144;       // E-AC-3
+        case 22: return 15360;      // MAT (TrueHD)
+        default: return 0;
+    }
+}
+
+static BOOLEAN IsIec61937Sync(_In_reads_bytes_(4) const BYTE *Buffer)
+{
+    return Buffer[0] == IEC61937_SYNC_0 && Buffer[1] == IEC61937_SYNC_1 &&
+           Buffer[2] == IEC61937_SYNC_2 && Buffer[3] == IEC61937_SYNC_3;
+}
+
+static BOOLEAN IsTrueHdMajorSync(_In_reads_bytes_(8) const BYTE *Buffer)
+{
+    return Buffer[4] == 0xF8 && Buffer[5] == 0x72 && Buffer[6] == 0x6F &&
+           (Buffer[7] == 0xBA || Buffer[7] == 0xBB);
+}
+
+CAVERN_PARSE_RESULT CavernParseCodecFrame(
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length,
+    _Inout_ CAVERN_CODEC *Codec,
+    _Out_ ULONG *FrameLength
+)
+{
+    ULONG frameLength = 0;
+
+    *FrameLength = 0;
+
+    if (Length < 8) {
+        return CavernParseNeedMore;
+    }
+
+    if (IsIec61937Sync(Buffer)) {
+        ULONG frames = Iec61937RepetitionFrames(Buffer[4] & 0x7F);
+
+        if (frames) {
+            frameLength = frames * 4;
+        } else {
+            // Unknown data type: the burst runs up to the next preamble
+            for (ULONG i = IEC61937_HEADER; i + 4 <= Length; i += 2) {
+                if (IsIec61937Sync(Buffer + i)) {
+                    frameLength = i;
+                    break;
+                }
+            }
+            if (!frameLength) {
+                *Codec = CavernCodecIec61937;
+                return CavernParseNeedMore;
+            }
+        }
+        *Codec = CavernCodecIec61937;
+    }
+    else if (Buffer[0] == 0x0B && Buffer[1] == 0x77) {
+        ULONG bsid = Buffer[5] >> 3;
+
+        if (bsid <= 10) {
+            ULONG fscod = Buffer[4] >> 6;
+            ULONG frmsizecod = Buffer[4] & 0x3F;
+
+            if (fscod == 3 || frmsizecod >= 38) {
+                return CavernParseNoSync;
+            }
+            frameLength = (ULONG)g_Ac3FrameWords[frmsizecod][fscod] * 2;
+        } else if (bsid <= 16) {
+            frameLength = ((((ULONG)Buffer[2] & 0x07) << 8) | Buffer[3]) * 2 + 2;
+        } else {
+            return CavernParseNoSync;
+        }
+        *Codec = CavernCodecAc3;
+    }
+    else if (Buffer[0] == 0x7F && Buffer[1] == 0xFE && Buffer[2] == 0x80 && Buffer[3] == 0x01) {
+        frameLength = ((((ULONG)Buffer[5] & 0x03) << 12) |
+                       ((ULONG)Buffer[6] << 4) |
+                       ((ULONG)Buffer[7] >> 4)) + 1;
+        if (frameLength < 96) {
+            return CavernParseNoSync;
+        }
+        *Codec = CavernCodecDts;
+    }
+    else if (IsTrueHdMajorSync(Buffer) || *Codec == CavernCodecTrueHd) {
+        // Only major sync access units carry a sync word; once locked the
+        // access unit length in the first word chains the rest.
+        frameLength = ((((ULONG)Buffer[0] & 0x0F) << 8) | Buffer[1]) * 2;
+        if (frameLength < 8) {
+            *Codec = CavernCodecNone;
+            return CavernParseNoSync;
+        }
+        *Codec = CavernCodecTrueHd;
+    }
+    else {
+        return CavernParseNoSync;
+    }
+
+    if (frameLength > Length) {
+        *FrameLength = frameLength;
+        return CavernParseNeedMore;
+    }
+
+    *FrameLength = frameLength;
+    return CavernParseFrame;
+}
+
+//=============================================================================
+// CCavernFrameAligner
+//=============================================================================
+
+CCavernFrameAligner::CCavernFrameAligner()
+    : m_Mode(CavernForwardRaw),
+      m_Codec(CavernCodecNone),
+      m_ulBlockAlign(1),
+      m_ulMaxLatencyBytes(0),
+      m_ulFrameBytes(0),
+      m_Sink(NULL),
+      m_SinkContext(NULL),
+      m_pStaging(NULL),
+      m_ulStagingSize(0),
+      m_ulPending(0),
+      m_ulForcedFlushes(0)
+{
+}
+
+CCavernFrameAligner::~CCavernFrameAligner()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernFrameAligner::Init(
+    _In_ CAVERN_FORWARD_MODE Mode,
+    _In_ ULONG BlockAlign,
+    _In_ ULONG StagingSize,
+    _In_ ULONG MaxLatencyBytes,
+    _In_ PCAVERN_FORWARD_SINK Sink,
+    _In_opt_ PVOID SinkContext
+)
+{
+    if (!Sink || !BlockAlign || (Mode != CavernForwardRaw && StagingSize < BlockAlign)) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    Cleanup();
+
+    m_Mode = Mode;
+    m_ulBlockAlign = BlockAlign;
+    m_ulMaxLatencyBytes = max(MaxLatencyBytes, BlockAlign);
+    m_ulFrameBytes = 0;
+    m_Sink = Sink;
+    m_SinkContext = SinkContext;
+    m_Codec = CavernCodecNone;
+    m_ulPending = 0;
+    m_ulForcedFlushes = 0;
+
+    if (Mode == CavernForwardRaw) {
+        return STATUS_SUCCESS;
+    }
+
+    m_pStaging = (BYTE *)CavernAllocate(StagingSize, CAVERN_FRAMEALIGNER_POOLTAG);
+    if (!m_pStaging) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_ulStagingSize = StagingSize;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernFrameAligner::Cleanup()
+{
+    if (m_pStaging) {
+        CavernFree(m_pStaging, CAVERN_FRAMEALIGNER_POOLTAG);
+        m_pStaging = NULL;
+    }
+    m_ulStagingSize = 0;
+    m_ulPending = 0;
+}
+
+VOID CCavernFrameAligner::Reset()
+{
+    m_ulPending = 0;
+    m_ulFrameBytes = 0;
+    m_Codec = CavernCodecNone;
+}
+
+//
+// Number of leading bytes of Buffer that end on a frame boundary. Bytes
+// ahead of the first sync are carried along with the first whole frame.
+//
+ULONG CCavernFrameAligner::AlignedLength(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    if (m_Mode == CavernForwardPcmFrames) {
+        return Length - Length % m_ulBlockAlign;
+    }
+
+    if (m_Mode != CavernForwardCodecFrames) {
+        return Length;
+    }
+
+    ULONG aligned = 0;
+    ULONG pos = 0;
+
+    while (pos < Length) {
+        ULONG frameLength;
+        CAVERN_PARSE_RESULT result = CavernParseCodecFrame(Buffer + pos, Length - pos, &m_Codec, &frameLength);
+
+        // The staging can hold the frame, so the escape hatch waits for it
+        if (result != CavernParseNoSync && frameLength <= m_ulStagingSize) {
+            m_ulFrameBytes = max(m_ulFrameBytes, frameLength);
+        }
+
+        if (result == CavernParseFrame) {
+            pos += frameLength;
+            aligned = pos;
+        } else if (result == CavernParseNeedMore) {
+            break;
+        } else {
+            pos++;
+        }
+    }
+
+    return aligned;
+}
+
+ULONG CCavernFrameAligner::GetHoldLimit() const
+{
+    return max(m_ulMaxLatencyBytes, m_ulFrameBytes);
+}
+
+NTSTATUS CCavernFrameAligner::Emit(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    return Length ? m_Sink(m_SinkContext, Buffer, Length) : STATUS_SUCCESS;
+}
+
+NTSTATUS CCavernFrameAligner::DrainStaging(_In_ BOOLEAN Force)
+{
+    ULONG length = Force ? m_ulPending : AlignedLength(m_pStaging, m_ulPending);
+    NTSTATUS status = Emit(m_pStaging, length);
+
+    if (length < m_ulPending) {
+        RtlMoveMemory(m_pStaging, m_pStaging + length, m_ulPending - length);
+    }
+    m_ulPending -= length;
+
+    return status;
+}
+
+NTSTATUS CCavernFrameAligner::Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    NTSTATUS status = STATUS_SUCCESS;
+    NTSTATUS result;
+
+    if (m_Mode == CavernForwardRaw || !m_pStaging) {
+        return Emit(Buffer, Length);
+    }
+
+    while (Length > 0) {
+        // Nothing staged: forward the aligned prefix straight from the
+        // caller's buffer and stage only the tail.
+        if (m_ulPending == 0) {
+            ULONG aligned = AlignedLength(Buffer, Length);
+
+            result = Emit(Buffer, aligned);
+            if (!NT_SUCCESS(result)) {
+                status = result;
+            }
+            Buffer += aligned;
+            Length -= aligned;
+
+            if (Length == 0) {
+                break;
+            }
+        }
+
+        ULONG copy = min(Length, m_ulStagingSize - m_ulPending);
+
+        if (copy == 0) {
+            // A frame larger than the staging buffer; give up on it
+            m_ulForcedFlushes++;
+            result = DrainStaging(TRUE);
+        } else {
+            RtlCopyMemory(m_pStaging + m_ulPending, Buffer, copy);
+            m_ulPending += copy;
+            Buffer += copy;
+            Length -= copy;
+            result = DrainStaging(FALSE);
+        }
+
+        if (!NT_SUCCESS(result)) {
+            status = result;
+        }
+    }
+
+    // Escape hatch: never hold bytes longer than the latency budget, or
+    // than a whole frame when frames are longer than that
+    if (m_ulPending > GetHoldLimit()) {
+        m_ulForcedFlushes++;
+        result = DrainStaging(TRUE);
+        if (!NT_SUCCESS(result)) {
+            status = result;
+        }
+    }
+
+    return status;
+}
+
+NTSTATUS CCavernFrameAligner::Flush()
+{
+    if (!m_pStaging || !m_ulPending) {
+        return STATUS_SUCCESS;
+    }
+
+    return DrainStaging(TRUE);
+}
@@ -0,0 +1,118 @@
+/***************************************************************************
+ * CavernFrameAligner.h
+ *
+ * Frame-aligned forwarding for the Cavern stream. Bytes pulled from the
+ * DMA ring are cut at frame boundaries before they reach the pipe, so
+ * every write carries whole PCM frames (multiples of nBlockAlign) or
+ * whole codec frames (AC-3, E-AC-3, TrueHD, DTS or IEC 61937 bursts) and
+ * the receiver can decode it without reassembly.
+ ***************************************************************************/
+
+#ifndef _CAVERN_FRAMEALIGNER_H_
+#define _CAVERN_FRAMEALIGNER_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_FRAMEALIGNER_POOLTAG     'aFvC'
+
+// Default staging size; holds the largest IEC 61937 burst (MAT, 61440
+// bytes) with room to spare.
+#define CAVERN_FORWARD_STAGING_SIZE     (128 * 1024)
+
+// Default escape hatch: bytes older than this are forwarded even if they
+// do not complete a frame. Once a codec frame or IEC 61937 burst has been
+// seen, the hatch waits for at least its length instead, since a burst
+// repetition period (AC-3 32 ms, E-AC-3 128 ms) is longer than this.
+#define CAVERN_MAX_FORWARD_LATENCY_MS   20
+
+typedef enum _CAVERN_FORWARD_MODE {
+    CavernForwardRaw = 0,       // pass through as delivered
+    CavernForwardPcmFrames,     // whole nBlockAlign frames
+    CavernForwardCodecFrames    // whole bitstream frames
+} CAVERN_FORWARD_MODE;
+
+typedef enum _CAVERN_CODEC {
+    CavernCodecNone = 0,
+    CavernCodecIec61937,
+    CavernCodecAc3,             // AC-3 and E-AC-3
+    CavernCodecTrueHd,
+    CavernCodecDts
+} CAVERN_CODEC;
+
+typedef enum _CAVERN_PARSE_RESULT {
+    CavernParseFrame = 0,       // *FrameLength is a complete frame
+    CavernParseNeedMore,        // a frame starts here but is incomplete
+    CavernParseNoSync           // no recognizable frame header here
+} CAVERN_PARSE_RESULT;
+
+// Receives each aligned run. Returns the status of the write.
+typedef NTSTATUS (*PCAVERN_FORWARD_SINK)(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length
+);
+
+// Parses the frame header at Buffer. Codec is the stream's locked codec
+// (CavernCodecNone while searching) and is updated on a sync match. On
+// CavernParseNeedMore, *FrameLength is the length the frame will have
+// once complete, or 0 if the header does not tell.
+CAVERN_PARSE_RESULT CavernParseCodecFrame(
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length,
+    _Inout_ CAVERN_CODEC *Codec,
+    _Out_ ULONG *FrameLength
+);
+
+class CCavernFrameAligner
+{
+public:
+    CCavernFrameAligner();
+    ~CCavernFrameAligner();
+
+    NTSTATUS Init(
+        _In_ CAVERN_FORWARD_MODE Mode,
+        _In_ ULONG BlockAlign,
+        _In_ ULONG StagingSize,
+        _In_ ULONG MaxLatencyBytes,
+        _In_ PCAVERN_FORWARD_SINK Sink,
+        _In_opt_ PVOID SinkContext
+    );
+    VOID Cleanup();
+
+    // Accepts the next run of the stream and forwards every complete frame.
+    NTSTATUS Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+
+    // Forwards everything still staged, whole frames or not.
+    NTSTATUS Flush();
+
+    // Drops staged bytes and codec lock (stream reset).
+    VOID Reset();
+
+    CAVERN_FORWARD_MODE GetMode() const { return m_Mode; }
+    ULONG GetPendingBytes() const { return m_ulPending; }
+    ULONG GetForcedFlushCount() const { return m_ulForcedFlushes; }
+
+    // Bytes held before the escape hatch forwards them: the latency budget,
+    // or the longest frame seen if that is longer
+    ULONG GetHoldLimit() const;
+    CAVERN_CODEC GetCodec() const { return m_Codec; }
+
+private:
+    ULONG AlignedLength(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    NTSTATUS Emit(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    NTSTATUS DrainStaging(_In_ BOOLEAN Force);
+
+    CAVERN_FORWARD_MODE     m_Mode;
+    CAVERN_CODEC            m_Codec;
+    ULONG                   m_ulBlockAlign;
+    ULONG                   m_ulMaxLatencyBytes;
+    ULONG                   m_ulFrameBytes;     // longest frame seen
+    PCAVERN_FORWARD_SINK    m_Sink;
+    PVOID                   m_SinkContext;
+    BYTE                   *m_pStaging;
+    ULONG                   m_ulStagingSize;
+    ULONG                   m_ulPending;
+    ULONG                   m_ulForcedFlushes;
+};
+
+#endif // _CAVERN_FRAMEALIGNER_H_
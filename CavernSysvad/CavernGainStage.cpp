@@ -0,0 +1,255 @@
+/***************************************************************************
+ * CavernGainStage.cpp
+ *
+ * Ramped per-channel gain implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernGainStage.h"
+
+CCavernGainStage::CCavernGainStage()
+    : m_ulChannels(0),
+      m_ulFrameSize(0),
+      m_ulRampFrames(1),
+      m_AllowSimd(FALSE),
+      m_bTargetsChanged(FALSE),
+      m_ulRampRemaining(0),
+      m_bUnity(TRUE)
+{
+    RtlZeroMemory(&m_Converter, sizeof(m_Converter));
+}
+
+NTSTATUS CCavernGainStage::Init(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG RampMs,
+    _In_ CAVERN_DITHER_MODE Dither,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    m_ulChannels = 0;
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    NTSTATUS status = CavernSelectConverter(Format, AllowSimd, &m_Converter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = m_Requantizer.Init(Format, Channels, Dither, AllowSimd);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    for (ULONG i = 0; i < CAVERN_GAIN_TABLE_ENTRIES; i++) {
+        double dB = (double)(CAVERN_VOLUME_MINIMUM + (LONG)i * CAVERN_VOLUME_STEP) / 65536.0;
+        m_GainTable[i] = (float)pow(10.0, dB / 20.0);
+    }
+
+    for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+        m_lVolume[c] = CAVERN_VOLUME_MAXIMUM;
+        m_Mute[c] = FALSE;
+        m_Current[c] = 1.0f;
+        m_Target[c] = 1.0f;
+        m_Step[c] = 0.0f;
+    }
+
+    m_ulFrameSize = Channels * m_Converter.BytesPerSample;
+    m_ulRampFrames = max(SampleRate / 1000 * RampMs, 1u);
+    m_AllowSimd = AllowSimd;
+    m_bTargetsChanged = FALSE;
+    m_ulRampRemaining = 0;
+    m_bUnity = TRUE;
+    m_ulChannels = Channels;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernGainStage::SetTarget(
+    _In_ ULONG Channel,
+    _In_ LONG VolumeLevel,
+    _In_ BOOLEAN Mute
+)
+{
+    if (Channel >= m_ulChannels) {
+        return;
+    }
+
+    if (m_lVolume[Channel] != VolumeLevel || m_Mute[Channel] != Mute) {
+        m_lVolume[Channel] = VolumeLevel;
+        m_Mute[Channel] = Mute;
+        m_bTargetsChanged = TRUE;
+    }
+}
+
+//
+// Resolves the recorded targets and, when any moved, starts a ramp from
+// wherever the gains are now (mid-ramp included).
+//
+VOID CCavernGainStage::UpdateTargets()
+{
+    BOOLEAN moved = FALSE;
+
+    m_bTargetsChanged = FALSE;
+    m_bUnity = TRUE;
+
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        LONG level = min(max(m_lVolume[c], (LONG)CAVERN_VOLUME_MINIMUM), (LONG)CAVERN_VOLUME_MAXIMUM);
+        ULONG index = (ULONG)(level - CAVERN_VOLUME_MINIMUM + CAVERN_VOLUME_STEP / 2) / CAVERN_VOLUME_STEP;
+        float target = m_Mute[c] ? 0.0f : m_GainTable[min(index, (ULONG)CAVERN_GAIN_TABLE_ENTRIES - 1)];
+
+        if (target != m_Target[c]) {
+            m_Target[c] = target;
+            moved = TRUE;
+        }
+        m_bUnity = m_bUnity && (target == 1.0f);
+    }
+
+    if (moved) {
+        for (ULONG c = 0; c < m_ulChannels; c++) {
+            m_Step[c] = (m_Target[c] - m_Current[c]) / (float)m_ulRampFrames;
+        }
+        m_ulRampRemaining = m_ulRampFrames;
+    }
+}
+
+//
+// Multiplies FrameCount frames by the current gains, advancing them by
+// m_Step per frame when ramping. The SSE2 path lays the gains out over
+// lcm(channels, 4) samples so each lane keeps to one channel. Ramp gains
+// are always Current + frame * Step from an exact frame index, as in the
+// scalar loop, so long ramps do not drift from repeated additions.
+//
+VOID CCavernGainStage::Scale(float *Samples, SIZE_T FrameCount, BOOLEAN Ramp)
+{
+    const ULONG channels = m_ulChannels;
+    SIZE_T frame = 0;
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_AllowSimd) {
+        ULONG stride = channels;
+        while (stride % 4) {
+            stride += channels;
+        }
+
+        const ULONG vectors = stride / 4;
+        const ULONG framesPerStride = stride / channels;
+        const __m128 advance = _mm_set1_ps((float)framesPerStride);
+        __m128 current[CAVERN_MAX_CHANNELS];
+        __m128 step[CAVERN_MAX_CHANNELS];
+        __m128 index[CAVERN_MAX_CHANNELS];
+
+        for (ULONG v = 0; v < vectors; v++) {
+            float lanes[4];
+            float steps[4];
+            float frames[4];
+            for (ULONG j = 0; j < 4; j++) {
+                ULONG k = v * 4 + j;
+                lanes[j] = m_Current[k % channels];
+                steps[j] = m_Step[k % channels];
+                frames[j] = (float)(k / channels);
+            }
+            current[v] = _mm_loadu_ps(lanes);
+            step[v] = _mm_loadu_ps(steps);
+            index[v] = _mm_loadu_ps(frames);
+        }
+
+        if (Ramp) {
+            for (; frame + framesPerStride <= FrameCount; frame += framesPerStride) {
+                float *p = Samples + frame * channels;
+                for (ULONG v = 0; v < vectors; v++) {
+                    __m128 gain = _mm_add_ps(current[v], _mm_mul_ps(index[v], step[v]));
+                    _mm_storeu_ps(p + v * 4, _mm_mul_ps(_mm_loadu_ps(p + v * 4), gain));
+                    index[v] = _mm_add_ps(index[v], advance);
+                }
+            }
+        } else {
+            for (; frame + framesPerStride <= FrameCount; frame += framesPerStride) {
+                float *p = Samples + frame * channels;
+                for (ULONG v = 0; v < vectors; v++) {
+                    _mm_storeu_ps(p + v * 4, _mm_mul_ps(_mm_loadu_ps(p + v * 4), current[v]));
+                }
+            }
+        }
+    }
+#endif
+
+    for (; frame < FrameCount; frame++) {
+        float *p = Samples + frame * channels;
+        for (ULONG c = 0; c < channels; c++) {
+            p[c] *= Ramp ? m_Current[c] + (float)frame * m_Step[c] : m_Current[c];
+        }
+    }
+
+    if (Ramp) {
+        for (ULONG c = 0; c < channels; c++) {
+            m_Current[c] += (float)FrameCount * m_Step[c];
+        }
+    }
+}
+
+VOID CCavernGainStage::ProcessFloat(
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_ulChannels) {
+        return;
+    }
+
+    if (m_bTargetsChanged) {
+        UpdateTargets();
+    }
+
+    while (FrameCount && m_ulRampRemaining) {
+        SIZE_T frames = min(FrameCount, (SIZE_T)m_ulRampRemaining);
+
+        Scale(Samples, frames, TRUE);
+
+        m_ulRampRemaining -= (ULONG)frames;
+        if (!m_ulRampRemaining) {
+            // Land exactly on the targets, whatever the float steps added up to
+            for (ULONG c = 0; c < m_ulChannels; c++) {
+                m_Current[c] = m_Target[c];
+                m_Step[c] = 0.0f;
+            }
+        }
+
+        Samples += frames * m_ulChannels;
+        FrameCount -= frames;
+    }
+
+    if (FrameCount && !m_bUnity) {
+        Scale(Samples, FrameCount, FALSE);
+    }
+}
+
+VOID CCavernGainStage::Process(
+    _Inout_updates_bytes_(FrameCount * m_ulFrameSize) VOID *Frames,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_ulChannels || IsTransparent()) {
+        return;
+    }
+
+    if (m_Converter.Format == CavernSampleF32) {
+        ProcessFloat((float *)Frames, FrameCount);
+        return;
+    }
+
+    BYTE *frames = (BYTE *)Frames;
+    while (FrameCount) {
+        SIZE_T block = min(FrameCount, (SIZE_T)CAVERN_GAIN_BLOCK_FRAMES);
+
+        m_Converter.ToFloat(frames, m_Block, block * m_ulChannels);
+        ProcessFloat(m_Block, block);
+        m_Requantizer.Process(m_Block, frames, block);
+
+        frames += block * m_ulFrameSize;
+        FrameCount -= block;
+    }
+}
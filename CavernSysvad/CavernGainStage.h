@@ -0,0 +1,103 @@
+/***************************************************************************
+ * CavernGainStage.h
+ *
+ * Per-channel volume and mute for interleaved PCM. Targets arrive as
+ * KSPROPERTY_AUDIO_VOLUMELEVEL values (1/65536 dB) and mute flags, are
+ * looked up in a dB-to-linear table built at Init, and every change is
+ * reached through a short linear ramp so the output never steps. At unity
+ * gain with no ramp running the stage leaves the data untouched; otherwise
+ * integer formats are requantized with the Init dither mode.
+ *
+ * SetTarget does no float work and may be called from anywhere the stage
+ * is owned; the Process routines must be bracketed with
+ * KeSaveFloatingPointState / KeRestoreFloatingPointState, as ToneGenerator
+ * does. Bitstream (IEC 61937) formats must not be given to the stage.
+ ***************************************************************************/
+
+#ifndef _CAVERN_GAINSTAGE_H_
+#define _CAVERN_GAINSTAGE_H_
+
+#include "CavernFormatConvert.h"
+#include "CavernRequantizer.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+// Topology volume range and stepping: -96 dB to 0 dB in 0.5 dB steps
+#define CAVERN_VOLUME_MINIMUM       (-96 * 0x10000)
+#define CAVERN_VOLUME_MAXIMUM       0
+#define CAVERN_VOLUME_STEP          0x8000
+#define CAVERN_GAIN_TABLE_ENTRIES   ((CAVERN_VOLUME_MAXIMUM - CAVERN_VOLUME_MINIMUM) / CAVERN_VOLUME_STEP + 1)
+
+// Frames converted per block when the stream format is not float
+#define CAVERN_GAIN_BLOCK_FRAMES    64
+
+class CCavernGainStage
+{
+public:
+    CCavernGainStage();
+
+    // RampMs: length of the fade to a new target (at least one frame).
+    // Dither: how scaled integer formats are requantized.
+    NTSTATUS Init(
+        _In_ CAVERN_SAMPLE_FORMAT Format,
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG RampMs,
+        _In_ CAVERN_DITHER_MODE Dither,
+        _In_ BOOLEAN AllowSimd
+    );
+
+    // Records the target for one channel; picked up by the next Process.
+    VOID SetTarget(
+        _In_ ULONG Channel,
+        _In_ LONG VolumeLevel,
+        _In_ BOOLEAN Mute
+    );
+
+    // Scales FrameCount interleaved float frames in place.
+    VOID ProcessFloat(
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    // Scales FrameCount frames of the Init format in place.
+    VOID Process(
+        _Inout_updates_bytes_(FrameCount * m_ulFrameSize) VOID *Frames,
+        _In_ SIZE_T FrameCount
+    );
+
+    BOOLEAN IsInitialized() const { return m_ulChannels != 0; }
+
+    // TRUE while the output equals the input (unity gain, no ramp).
+    BOOLEAN IsTransparent() const { return m_bUnity && !m_bTargetsChanged && !m_ulRampRemaining; }
+
+private:
+    VOID UpdateTargets();
+    VOID Scale(float *Samples, SIZE_T FrameCount, BOOLEAN Ramp);
+
+    CAVERN_CONVERTER    m_Converter;
+    CCavernRequantizer  m_Requantizer;
+    ULONG               m_ulChannels;
+    ULONG               m_ulFrameSize;
+    ULONG               m_ulRampFrames;
+    BOOLEAN             m_AllowSimd;
+
+    float               m_GainTable[CAVERN_GAIN_TABLE_ENTRIES];
+
+    // Requested targets; plain LONG stores so SetTarget needs no float
+    LONG                m_lVolume[CAVERN_MAX_CHANNELS];
+    BOOLEAN             m_Mute[CAVERN_MAX_CHANNELS];
+    BOOLEAN             m_bTargetsChanged;
+
+    float               m_Current[CAVERN_MAX_CHANNELS];
+    float               m_Target[CAVERN_MAX_CHANNELS];
+    float               m_Step[CAVERN_MAX_CHANNELS];    // per frame while ramping
+    ULONG               m_ulRampRemaining;
+    BOOLEAN             m_bUnity;
+
+    float               m_Block[CAVERN_GAIN_BLOCK_FRAMES * CAVERN_MAX_CHANNELS];
+};
+
+#endif // _CAVERN_GAINSTAGE_H_
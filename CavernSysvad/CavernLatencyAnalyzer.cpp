@@ -0,0 +1,224 @@
+/***************************************************************************
+ * CavernLatencyAnalyzer.cpp
+ *
+ * FFT cross-correlation latency analyzer implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernLatencyAnalyzer.h"
+
+CCavernLatencyAnalyzer::CCavernLatencyAnalyzer()
+    : m_ulChannels(0),
+      m_ulLanes(0),
+      m_ulLength(0),
+      m_ulPeriod(0),
+      m_ulWindow(0),
+      m_pReference(NULL),
+      m_pSpectrum(NULL),
+      m_pProduct(NULL),
+      m_pTime(NULL)
+{
+}
+
+CCavernLatencyAnalyzer::~CCavernLatencyAnalyzer()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernLatencyAnalyzer::Init(
+    _In_ CAVERN_TEST_SIGNAL Kind,
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG Order,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (Kind <= CavernTestNone || Kind >= CavernTestSignalCount ||
+        !Channels || Channels > CAVERN_MAX_CHANNELS || !SampleRate ||
+        Order < CAVERN_TEST_MIN_ORDER || Order > CAVERN_TEST_MAX_ORDER) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG length = 1UL << Order;
+    ULONG window = 4 * length;
+    ULONG width = CCavernFft::LaneWidth(AllowSimd);
+    ULONG lanes = (Channels + width - 1) / width * width;
+
+    NTSTATUS status = m_Fft.Init(window, lanes, AllowSimd);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    SIZE_T spectrum = m_Fft.GetSpectrumFloats() * sizeof(float);
+    SIZE_T time = (SIZE_T)window * lanes * sizeof(float);
+
+    m_pReference = (float *)CavernAllocate(3 * spectrum + time, CAVERN_LATENCY_POOLTAG);
+    if (!m_pReference) {
+        m_Fft.Cleanup();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pSpectrum = (float *)((PUCHAR)m_pReference + spectrum);
+    m_pProduct = (float *)((PUCHAR)m_pSpectrum + spectrum);
+    m_pTime = (float *)((PUCHAR)m_pProduct + spectrum);
+
+    // Circularly reversed, r'[(window - n) % window] = r[n], so multiplying
+    // spectra correlates: lag k sums capture[k + n] * r[n]
+    float *excitation = m_pProduct;
+    CavernTestExcitation(Kind, Order, SampleRate, excitation);
+
+    RtlZeroMemory(m_pTime, time);
+    for (ULONG n = 0; n < length; n++) {
+        float *row = m_pTime + (SIZE_T)((window - n) % window) * lanes;
+        for (ULONG c = 0; c < lanes; c++) {
+            row[c] = excitation[n];
+        }
+    }
+    m_Fft.Forward(m_pTime, m_pReference);
+
+    m_ulChannels = Channels;
+    m_ulLanes = lanes;
+    m_ulLength = length;
+    m_ulPeriod = 2 * length;
+    m_ulWindow = window;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernLatencyAnalyzer::Cleanup()
+{
+    if (m_pReference) {
+        CavernFree(m_pReference, CAVERN_LATENCY_POOLTAG);
+        m_pReference = NULL;
+    }
+    m_Fft.Cleanup();
+    m_pSpectrum = NULL;
+    m_pProduct = NULL;
+    m_pTime = NULL;
+    m_ulChannels = 0;
+    m_ulLanes = 0;
+    m_ulWindow = 0;
+}
+
+//
+// Decodes the marker of the period whose excitation starts at Lag. When
+// the window starts inside that marker, the next period's is read.
+//
+VOID CCavernLatencyAnalyzer::ReadMarker(
+    _In_ const float *Capture,
+    _In_ ULONG Channel,
+    _In_ LONG Lag,
+    _In_ float Polarity,
+    _In_ ULONGLONG FirstFrame,
+    _Out_ PCAVERN_LATENCY_RESULT Result
+)
+{
+    LONG start = Lag - CAVERN_TEST_EXCITATION_OFFSET;
+    if (start < 0) {
+        start += (LONG)m_ulPeriod;
+    }
+
+    ULONGLONG marker = 0;
+    for (ULONG b = 0; b < CAVERN_TEST_MARKER_BITS; b++) {
+        const float *bit = Capture + ((SIZE_T)start + (SIZE_T)b * 2 * CAVERN_TEST_HALF_BIT_FRAMES) * m_ulChannels + Channel;
+        float first = 0.0f, second = 0.0f;
+
+        for (ULONG i = 0; i < CAVERN_TEST_HALF_BIT_FRAMES; i++) {
+            first += bit[(SIZE_T)i * m_ulChannels];
+            second += bit[(SIZE_T)(i + CAVERN_TEST_HALF_BIT_FRAMES) * m_ulChannels];
+        }
+        marker = (marker << 1) | (((first - second) * Polarity > 0.0f) ? 1 : 0);
+    }
+
+    ULONGLONG frame;
+    ULONG source;
+    if (!CavernTestParseMarker(marker, &frame, &source)) {
+        Result->Found = FALSE;
+        return;
+    }
+
+    Result->SourceChannel = source;
+    Result->MarkerFrame = frame;
+    Result->CaptureFrame = FirstFrame + (ULONGLONG)start;
+}
+
+VOID CCavernLatencyAnalyzer::Analyze(
+    _In_reads_(m_ulWindow * m_ulChannels) const float *Capture,
+    _In_ ULONGLONG FirstFrame,
+    _Out_writes_(m_ulChannels) PCAVERN_LATENCY_RESULT Results
+)
+{
+    if (!m_pReference || !Capture || !Results) {
+        return;
+    }
+
+    for (ULONG n = 0; n < m_ulWindow; n++) {
+        float *row = m_pTime + (SIZE_T)n * m_ulLanes;
+        const float *frame = Capture + (SIZE_T)n * m_ulChannels;
+
+        for (ULONG c = 0; c < m_ulChannels; c++) {
+            row[c] = frame[c];
+        }
+        for (ULONG c = m_ulChannels; c < m_ulLanes; c++) {
+            row[c] = 0.0f;
+        }
+    }
+
+    m_Fft.Forward(m_pTime, m_pSpectrum);
+    RtlZeroMemory(m_pProduct, m_Fft.GetSpectrumFloats() * sizeof(float));
+    m_Fft.MultiplyAdd(m_pSpectrum, m_pReference, m_pProduct);
+    m_Fft.Inverse(m_pProduct, m_pTime);
+
+    // Lags past window - length would wrap the excitation around
+    ULONG lags = m_ulWindow - m_ulLength + 1;
+
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        PCAVERN_LATENCY_RESULT result = &Results[c];
+        double energy = 0.0;
+        float peak = 0.0f;
+        ULONG lag = 0;
+
+        RtlZeroMemory(result, sizeof(*result));
+
+        for (ULONG k = 0; k < lags; k++) {
+            float value = m_pTime[(SIZE_T)k * m_ulLanes + c];
+            float magnitude = fabsf(value);
+
+            energy += (double)value * value;
+            if (magnitude > peak) {
+                peak = magnitude;
+                lag = k;
+            }
+        }
+
+        double rms = sqrt(energy / lags);
+        if (peak <= 0.0f || rms <= 0.0) {
+            continue;
+        }
+        result->PeakDb = (float)(20.0 * log10(peak / rms));
+        if (result->PeakDb < CAVERN_LATENCY_MIN_PEAK_DB) {
+            continue;
+        }
+
+        float center = m_pTime[(SIZE_T)lag * m_ulLanes + c];
+        float polarity = (center < 0.0f) ? -1.0f : 1.0f;
+        result->Inverted = center < 0.0f;
+
+        // Parabola through the peak and its neighbours
+        double fraction = 0.0;
+        if (lag > 0 && lag + 1 < lags) {
+            double before = m_pTime[(SIZE_T)(lag - 1) * m_ulLanes + c] * polarity;
+            double after = m_pTime[(SIZE_T)(lag + 1) * m_ulLanes + c] * polarity;
+            double curve = before - 2.0 * center * polarity + after;
+            if (curve < 0.0) {
+                fraction = 0.5 * (before - after) / curve;
+            }
+        }
+
+        result->Found = TRUE;
+        ReadMarker(Capture, c, (LONG)lag, polarity, FirstFrame, result);
+        if (result->Found) {
+            result->Latency = (double)(LONGLONG)(result->CaptureFrame - result->MarkerFrame) + fraction;
+        }
+    }
+}
@@ -0,0 +1,98 @@
+/***************************************************************************
+ * CavernLatencyAnalyzer.h
+ *
+ * Receiver side of the CavernTestSignal measurement. A capture window of
+ * two signal periods (GetWindowFrames(), four excitation lengths) always
+ * holds one whole excitation, wherever it starts. Every channel of the
+ * window is cross-correlated with the excitation in one CCavernFft pass,
+ * the channels as lanes: the capture spectrum is multiplied by that of
+ * the time-reversed excitation, which turns the convolution into a
+ * correlation. The strongest lag is the excitation start, refined to a
+ * fraction of a frame by a parabola through the peak and its neighbours.
+ *
+ * The marker in front of that excitation (or of the next one, when the
+ * window cuts it off) gives the generator frame the period started at, so
+ * latency is the capture frame of the period start minus that frame.
+ *
+ * Used by the measurement tools rather than the drivers: the transform
+ * buffers take some 16 MB at the longest excitation and 16 channels.
+ * Analyze must be bracketed with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState like Init.
+ ***************************************************************************/
+
+#ifndef _CAVERN_LATENCYANALYZER_H_
+#define _CAVERN_LATENCYANALYZER_H_
+
+#include "CavernPortable.h"
+#include "CavernFft.h"
+#include "CavernTestSignal.h"
+
+#define CAVERN_LATENCY_POOLTAG          'aLvC'
+
+// Correlation peak over its RMS needed to take a channel as found
+#define CAVERN_LATENCY_MIN_PEAK_DB      15.0f
+
+typedef struct _CAVERN_LATENCY_RESULT {
+    BOOLEAN     Found;          // excitation located and marker checked
+    BOOLEAN     Inverted;       // captured with the polarity reversed
+    ULONG       SourceChannel;  // from the marker; CAVERN_TEST_ALL_CHANNELS
+    ULONGLONG   MarkerFrame;    // generator frame the period started at
+    ULONGLONG   CaptureFrame;   // capture frame the period starts at
+    double      Latency;        // CaptureFrame - MarkerFrame, plus fraction
+    float       PeakDb;         // correlation peak over its RMS
+} CAVERN_LATENCY_RESULT, *PCAVERN_LATENCY_RESULT;
+
+class CCavernLatencyAnalyzer
+{
+public:
+    CCavernLatencyAnalyzer();
+    ~CCavernLatencyAnalyzer();
+
+    // The same Kind, SampleRate and Order as the generator.
+    NTSTATUS Init(
+        _In_ CAVERN_TEST_SIGNAL Kind,
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG Order,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Capture holds GetWindowFrames() interleaved frames, the first of
+    // which is capture frame FirstFrame. Fills one result per channel.
+    VOID Analyze(
+        _In_reads_(m_ulWindow * m_ulChannels) const float *Capture,
+        _In_ ULONGLONG FirstFrame,
+        _Out_writes_(m_ulChannels) PCAVERN_LATENCY_RESULT Results
+    );
+
+    BOOLEAN IsInitialized() const { return m_pReference != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+    ULONG GetWindowFrames() const { return m_ulWindow; }
+
+private:
+    VOID ReadMarker(
+        _In_ const float *Capture,
+        _In_ ULONG Channel,
+        _In_ LONG Lag,
+        _In_ float Polarity,
+        _In_ ULONGLONG FirstFrame,
+        _Out_ PCAVERN_LATENCY_RESULT Result
+    );
+
+    CCavernFft          m_Fft;
+    ULONG               m_ulChannels;
+    ULONG               m_ulLanes;
+    ULONG               m_ulLength;         // excitation frames
+    ULONG               m_ulPeriod;
+    ULONG               m_ulWindow;         // transform size
+
+    // Spectrum of the reversed excitation in every lane, then the capture
+    // spectrum, the product and the time rows
+    float              *m_pReference;
+    float              *m_pSpectrum;
+    float              *m_pProduct;
+    float              *m_pTime;
+};
+
+#endif // _CAVERN_LATENCYANALYZER_H_
@@ -0,0 +1,322 @@
+/***************************************************************************
+ * CavernLevelMeter.cpp
+ *
+ * Peak/RMS metering implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernLevelMeter.h"
+
+// Strides accumulated in float before the squared sums move to double
+#define METER_FLUSH_STRIDES     1024
+
+//=============================================================================
+// Scalar kernels
+//=============================================================================
+
+template <CAVERN_SAMPLE_FORMAT Format>
+static inline float ReadRaw(const BYTE *Sample)
+{
+    switch (Format) {
+        case CavernSampleU8:
+            return (float)((LONG)Sample[0] - 128);
+        case CavernSampleS16:
+            return (float)*(const SHORT *)Sample;
+        case CavernSampleS24Packed:
+            return (float)((LONG)(((ULONG)Sample[0] << 8) | ((ULONG)Sample[1] << 16) | ((ULONG)Sample[2] << 24)) >> 8);
+        case CavernSampleS24In32:
+        case CavernSampleS32:
+            return (float)*(const LONG *)Sample;
+        default:
+            return *(const float *)Sample;
+    }
+}
+
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample>
+static VOID MeterScalar(const BYTE *Source, SIZE_T Samples, ULONG FirstChannel, ULONG Channels, float *Peak, double *SumSquares)
+{
+    ULONG channel = FirstChannel;
+
+    for (SIZE_T s = 0; s < Samples; s++) {
+        float value = ReadRaw<Format>(Source + s * BytesPerSample);
+        float magnitude = fabsf(value);
+
+        Peak[channel] = (magnitude > Peak[channel]) ? magnitude : Peak[channel];
+        SumSquares[channel] += (double)value * value;
+
+        if (++channel == Channels) {
+            channel = 0;
+        }
+    }
+}
+
+#if defined(CAVERN_HAVE_SSE2)
+
+//=============================================================================
+// SSE2 kernels. The accumulators cover lcm(Channels, 4) samples, so every
+// lane keeps seeing the same channel and the per-channel fold happens once
+// per call instead of once per sample.
+//=============================================================================
+
+static ULONG MeterVectors(ULONG Channels)
+{
+    ULONG stride = Channels;
+
+    while (stride % 4) {
+        stride += Channels;
+    }
+    return stride / 4;
+}
+
+template <CAVERN_SAMPLE_FORMAT Format>
+static inline __m128 LoadRaw4(const BYTE *Source)
+{
+    switch (Format) {
+        case CavernSampleS16: {
+            __m128i s16 = _mm_loadl_epi64((const __m128i *)Source);
+            return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(s16, s16), 16));
+        }
+        case CavernSampleS24In32:
+        case CavernSampleS32:
+            return _mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)Source));
+        default:
+            return _mm_loadu_ps((const float *)Source);
+    }
+}
+
+//
+// One stride: accumulator v takes the four samples at Source + v*4. The
+// recursion unrolls the stride at compile time so the accumulators are
+// indexed by constants and stay in registers.
+//
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample, ULONG V>
+struct MeterStride {
+    static inline VOID Run(const BYTE *Source, __m128 AbsMask, __m128 *Peak, __m128 *Sum)
+    {
+        MeterStride<Format, BytesPerSample, V - 1>::Run(Source, AbsMask, Peak, Sum);
+
+        __m128 value = LoadRaw4<Format>(Source + (V - 1) * 4 * BytesPerSample);
+        Peak[V - 1] = _mm_max_ps(Peak[V - 1], _mm_and_ps(value, AbsMask));
+        Sum[V - 1] = _mm_add_ps(Sum[V - 1], _mm_mul_ps(value, value));
+    }
+};
+
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample>
+struct MeterStride<Format, BytesPerSample, 0> {
+    static inline VOID Run(const BYTE *, __m128, __m128 *, __m128 *)
+    {
+    }
+};
+
+//
+// Vectors is the accumulator count when fixed at compile time, 0 to derive
+// it from Channels (odd channel counts above 5).
+//
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample, ULONG Vectors>
+static VOID MeterSse2(const BYTE *Source, SIZE_T Samples, ULONG FirstChannel, ULONG Channels, float *Peak, double *SumSquares)
+{
+    const ULONG vectors = Vectors ? Vectors : MeterVectors(Channels);
+    const SIZE_T stride = (SIZE_T)vectors * 4;     // a multiple of Channels
+    const __m128 absMask = _mm_castsi128_ps(_mm_set1_epi32(0x7FFFFFFF));
+    __m128 peak[Vectors ? Vectors : CAVERN_MAX_CHANNELS];
+    SIZE_T s = 0;
+
+    for (ULONG v = 0; v < vectors; v++) {
+        peak[v] = _mm_setzero_ps();
+    }
+
+    while (s + stride <= Samples) {
+        __m128 sum[Vectors ? Vectors : CAVERN_MAX_CHANNELS];
+        SIZE_T end = s + min((Samples - s) / stride, (SIZE_T)METER_FLUSH_STRIDES) * stride;
+        SIZE_T base = s;
+
+        for (ULONG v = 0; v < vectors; v++) {
+            sum[v] = _mm_setzero_ps();
+        }
+
+        for (; s < end; s += stride) {
+            if (Vectors) {
+                MeterStride<Format, BytesPerSample, Vectors>::Run(Source + s * BytesPerSample, absMask, peak, sum);
+                continue;
+            }
+            for (ULONG v = 0; v < vectors; v++) {
+                __m128 value = LoadRaw4<Format>(Source + (s + v * 4) * BytesPerSample);
+                peak[v] = _mm_max_ps(peak[v], _mm_and_ps(value, absMask));
+                sum[v] = _mm_add_ps(sum[v], _mm_mul_ps(value, value));
+            }
+        }
+
+        // Lane j of accumulator v saw the channel of sample base + v*4 + j
+        for (ULONG v = 0; v < vectors; v++) {
+            float lanes[4];
+            _mm_storeu_ps(lanes, sum[v]);
+            for (ULONG j = 0; j < 4; j++) {
+                SumSquares[(FirstChannel + base + v * 4 + j) % Channels] += lanes[j];
+            }
+        }
+    }
+
+    for (ULONG v = 0; v < vectors; v++) {
+        float lanes[4];
+        _mm_storeu_ps(lanes, peak[v]);
+        for (ULONG j = 0; j < 4; j++) {
+            ULONG channel = (FirstChannel + v * 4 + j) % Channels;
+            Peak[channel] = (lanes[j] > Peak[channel]) ? lanes[j] : Peak[channel];
+        }
+    }
+
+    MeterScalar<Format, BytesPerSample>(Source + s * BytesPerSample, Samples - s,
+        (ULONG)((FirstChannel + s) % Channels), Channels, Peak, SumSquares);
+}
+
+//
+// Any multiple of the lane period works as the accumulator count; narrow
+// layouts take four so there are enough independent max/add chains to keep
+// the vector units busy.
+//
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample>
+static PCAVERN_METER_KERNEL SelectSse2(ULONG Channels)
+{
+    switch (MeterVectors(Channels)) {
+        case 1:                                                     // 1, 2, 4 channels
+        case 2:                                                     // 8
+        case 4:  return MeterSse2<Format, BytesPerSample, 4>;       // 16
+        case 3:  return MeterSse2<Format, BytesPerSample, 3>;       // 6, 12
+        case 5:  return MeterSse2<Format, BytesPerSample, 5>;       // 10
+        default: return MeterSse2<Format, BytesPerSample, 0>;
+    }
+}
+
+#endif // CAVERN_HAVE_SSE2
+
+static PCAVERN_METER_KERNEL SelectMeterKernel(CAVERN_SAMPLE_FORMAT Format, ULONG Channels, BOOLEAN AllowSimd)
+{
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        switch (Format) {
+            case CavernSampleS16:     return SelectSse2<CavernSampleS16, 2>(Channels);
+            case CavernSampleS24In32: return SelectSse2<CavernSampleS24In32, 4>(Channels);
+            case CavernSampleS32:     return SelectSse2<CavernSampleS32, 4>(Channels);
+            case CavernSampleF32:     return SelectSse2<CavernSampleF32, 4>(Channels);
+            default:                  break;
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(Channels);
+    UNREFERENCED_PARAMETER(AllowSimd);
+#endif
+
+    switch (Format) {
+        case CavernSampleU8:        return MeterScalar<CavernSampleU8, 1>;
+        case CavernSampleS16:       return MeterScalar<CavernSampleS16, 2>;
+        case CavernSampleS24Packed: return MeterScalar<CavernSampleS24Packed, 3>;
+        case CavernSampleS24In32:   return MeterScalar<CavernSampleS24In32, 4>;
+        case CavernSampleS32:       return MeterScalar<CavernSampleS32, 4>;
+        case CavernSampleF32:       return MeterScalar<CavernSampleF32, 4>;
+        default:                    return NULL;
+    }
+}
+
+//=============================================================================
+// CCavernLevelMeter
+//=============================================================================
+
+CCavernLevelMeter::CCavernLevelMeter()
+    : m_Kernel(NULL),
+      m_ulBytesPerSample(0),
+      m_ulChannels(0),
+      m_ulWindowFrames(0),
+      m_Scale(0.0f)
+{
+    Reset();
+    RtlZeroMemory(&m_Levels, sizeof(m_Levels));
+}
+
+NTSTATUS CCavernLevelMeter::Init(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ ULONG Channels,
+    _In_ ULONG WindowFrames,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    static const float scales[CavernSampleFormatCount] = {
+        0.0f,
+        1.0f / 128.0f,
+        1.0f / 32768.0f,
+        1.0f / 8388608.0f,
+        1.0f / 2147483648.0f,
+        1.0f / 2147483648.0f,
+        1.0f,
+    };
+    static const ULONG sizes[CavernSampleFormatCount] = { 0, 1, 2, 3, 4, 4, 4 };
+
+    m_Kernel = NULL;
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || (ULONG)Format >= CavernSampleFormatCount) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    m_Kernel = SelectMeterKernel(Format, Channels, AllowSimd);
+    if (!m_Kernel) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    m_ulBytesPerSample = sizes[Format];
+    m_ulChannels = Channels;
+    m_ulWindowFrames = max(WindowFrames, 1u);
+    m_Scale = scales[Format];
+
+    Reset();
+    RtlZeroMemory(&m_Levels, sizeof(m_Levels));
+    m_Levels.Channels = Channels;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernLevelMeter::Reset()
+{
+    m_ullBytes = 0;
+    m_ullWindowSamples = 0;
+    RtlZeroMemory(m_Peak, sizeof(m_Peak));
+    RtlZeroMemory(m_SumSquares, sizeof(m_SumSquares));
+}
+
+BOOLEAN CCavernLevelMeter::Measure(
+    _In_reads_bytes_(Length) const VOID *Buffer,
+    _In_ SIZE_T Length
+)
+{
+    if (!m_Kernel || !Length) {
+        return FALSE;
+    }
+
+    // Skip the tail of a sample split by the previous chunk
+    const BYTE *source = (const BYTE *)Buffer;
+    SIZE_T skip = (SIZE_T)((m_ulBytesPerSample - m_ullBytes % m_ulBytesPerSample) % m_ulBytesPerSample);
+    ULONGLONG firstSample = (m_ullBytes + skip) / m_ulBytesPerSample;
+
+    m_ullBytes += Length;
+
+    if (skip >= Length) {
+        return FALSE;
+    }
+
+    SIZE_T samples = (Length - skip) / m_ulBytesPerSample;
+    m_Kernel(source + skip, samples, (ULONG)(firstSample % m_ulChannels), m_ulChannels, m_Peak, m_SumSquares);
+    m_ullWindowSamples += samples;
+
+    if (m_ullWindowSamples < (ULONGLONG)m_ulWindowFrames * m_ulChannels) {
+        return FALSE;
+    }
+
+    double frames = (double)m_ullWindowSamples / m_ulChannels;
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        m_Levels.Peak[c] = m_Peak[c] * m_Scale;
+        m_Levels.Rms[c] = (float)sqrt(m_SumSquares[c] / frames) * m_Scale;
+        m_Peak[c] = 0.0f;
+        m_SumSquares[c] = 0.0;
+    }
+    m_ullWindowSamples = 0;
+
+    return TRUE;
+}
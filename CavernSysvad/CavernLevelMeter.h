@@ -0,0 +1,100 @@
+/***************************************************************************
+ * CavernLevelMeter.h
+ *
+ * Per-channel peak and RMS metering of interleaved PCM as it passes
+ * through the stream. Each chunk is reduced with SIMD abs/max and
+ * square/add over the raw samples, without converting the chunk; results
+ * are handed out once per metering window so the caller can publish them
+ * where readers never touch the audio path.
+ *
+ * Measure callers must bracket it with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState, as ToneGenerator does.
+ ***************************************************************************/
+
+#ifndef _CAVERN_LEVELMETER_H_
+#define _CAVERN_LEVELMETER_H_
+
+#include "CavernFormatConvert.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+// Levels of one window, linear and normalized to full scale (1.0).
+typedef struct _CAVERN_LEVELS {
+    ULONG   Channels;
+    float   Peak[CAVERN_MAX_CHANNELS];
+    float   Rms[CAVERN_MAX_CHANNELS];
+} CAVERN_LEVELS, *PCAVERN_LEVELS;
+
+// Accumulates raw (unscaled) |sample| maxima and squared sums for Samples
+// interleaved samples, the first of which belongs to FirstChannel.
+typedef VOID (*PCAVERN_METER_KERNEL)(
+    _In_reads_bytes_(Samples * BytesPerSample) const BYTE *Source,
+    _In_ SIZE_T Samples,
+    _In_ ULONG FirstChannel,
+    _In_ ULONG Channels,
+    _Inout_updates_(Channels) float *Peak,
+    _Inout_updates_(Channels) double *SumSquares
+);
+
+class CCavernLevelMeter
+{
+public:
+    CCavernLevelMeter();
+
+    // WindowFrames: frames per published reading (at least one).
+    NTSTATUS Init(
+        _In_ CAVERN_SAMPLE_FORMAT Format,
+        _In_ ULONG Channels,
+        _In_ ULONG WindowFrames,
+        _In_ BOOLEAN AllowSimd
+    );
+
+    // Starts a new window and forgets the byte phase; the next Measure
+    // must begin on a frame boundary.
+    VOID Reset();
+
+    // Meters the next Length bytes of the stream. Chunks may split frames
+    // and samples. Returns TRUE when a window completed; the levels are
+    // then in GetLevels() until the next window completes.
+    BOOLEAN Measure(
+        _In_reads_bytes_(Length) const VOID *Buffer,
+        _In_ SIZE_T Length
+    );
+
+    // Accounts for bytes that went by unmetered, keeping the channel phase.
+    VOID Skip(_In_ SIZE_T Length) { m_ullBytes += Length; }
+
+    const CAVERN_LEVELS *GetLevels() const { return &m_Levels; }
+    BOOLEAN IsInitialized() const { return m_Kernel != NULL; }
+
+private:
+    PCAVERN_METER_KERNEL    m_Kernel;
+    ULONG                   m_ulBytesPerSample;
+    ULONG                   m_ulChannels;
+    ULONG                   m_ulWindowFrames;
+    float                   m_Scale;            // raw sample -> full scale
+
+    // Current window
+    ULONGLONG               m_ullBytes;         // stream bytes seen
+    ULONGLONG               m_ullWindowSamples;
+    float                   m_Peak[CAVERN_MAX_CHANNELS];
+    double                  m_SumSquares[CAVERN_MAX_CHANNELS];
+
+    CAVERN_LEVELS           m_Levels;
+};
+
+// Full-scale level -> KSPROPERTY_AUDIO_PEAKMETER2 value (0..LONG_MAX).
+inline LONG CavernLevelToPeakMeter(_In_ float Level)
+{
+    if (!(Level > 0.0f)) {
+        return 0;
+    }
+    if (Level >= 1.0f) {
+        return 0x7FFFFFFF;
+    }
+    return (LONG)(Level * 2147483520.0f);   // largest float below 2^31
+}
+
+#endif // _CAVERN_LEVELMETER_H_
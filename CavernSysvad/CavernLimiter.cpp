@@ -0,0 +1,396 @@
+/***************************************************************************
+ * CavernLimiter.cpp
+ *
+ * Look-ahead true-peak limiter implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernLimiter.h"
+
+// Release state this close to unity is unity (-180 dB)
+#define CAVERN_LIMITER_UNITY_EPSILON    1e-9
+
+CCavernLimiter::CCavernLimiter()
+    : m_ulChannels(0),
+      m_ulLookahead(0),
+      m_ulWindow(0),
+      m_ulDelayFrames(1),
+      m_Linked(FALSE),
+      m_AllowSimd(FALSE),
+      m_fCeiling(1.0f),
+      m_dRelease(0.0),
+      m_dInverseLookahead(1.0),
+      m_pHistory(NULL),
+      m_pDelay(NULL),
+      m_ulHistoryPos(0),
+      m_ulDelayPos(0),
+      m_pDequeValue(NULL),
+      m_pDequeFrame(NULL),
+      m_pBox(NULL),
+      m_ulBoxPos(0),
+      m_ulFrame(0),
+      m_ullLimitedFrames(0)
+{
+    RtlZeroMemory(m_Splat, sizeof(m_Splat));
+}
+
+CCavernLimiter::~CCavernLimiter()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernLimiter::Init(
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG LookaheadUs,
+    _In_ ULONG ReleaseMs,
+    _In_ LONG CeilingCentiDb,
+    _In_ BOOLEAN Linked,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || !SampleRate ||
+        LookaheadUs > CAVERN_LIMITER_MAX_LOOKAHEAD_US || !ReleaseMs || CeilingCentiDb > 0) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG lookahead = (ULONG)((ULONGLONG)SampleRate * LookaheadUs / 1000000);
+    lookahead = max(lookahead, (ULONG)1);
+
+    ULONG curves = Linked ? 1 : Channels;
+    ULONG window = lookahead + 1;
+    ULONG delay = CAVERN_LIMITER_DETECTOR_DELAY + lookahead;
+    SIZE_T history = (SIZE_T)2 * CAVERN_LIMITER_TAPS * Channels * sizeof(float);
+    SIZE_T delayed = (SIZE_T)delay * Channels * sizeof(float);
+    SIZE_T box = (SIZE_T)curves * lookahead * sizeof(double);
+    SIZE_T values = (SIZE_T)curves * window * sizeof(float);
+    SIZE_T frames = (SIZE_T)curves * window * sizeof(ULONG);
+
+    m_pBox = (double *)CavernAllocate(box + history + delayed + values + frames, CAVERN_LIMITER_POOLTAG);
+    if (!m_pBox) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    m_pHistory = (float *)((PUCHAR)m_pBox + box);
+    m_pDelay = (float *)((PUCHAR)m_pHistory + history);
+    m_pDequeValue = (float *)((PUCHAR)m_pDelay + delayed);
+    m_pDequeFrame = (ULONG *)((PUCHAR)m_pDequeValue + values);
+
+    // Windowed sinc at 1/4, 2/4 and 3/4 of a frame past the middle tap,
+    // normalized to unity gain at DC
+    const double pi = 3.14159265358979323846;
+    const double half = CAVERN_LIMITER_TAPS / 2.0;
+
+    for (ULONG phase = 0; phase < 3; phase++) {
+        double taps[CAVERN_LIMITER_TAPS];
+        double sum = 0.0;
+
+        for (ULONG t = 0; t < CAVERN_LIMITER_TAPS; t++) {
+            double u = (CAVERN_LIMITER_DETECTOR_DELAY - 1.0) - t + (phase + 1) / 4.0;
+            double sinc = sin(pi * u) / (pi * u);
+            double window = 0.5 * (1.0 + cos(pi * u / half));
+            taps[t] = sinc * window;
+            sum += taps[t];
+        }
+        for (ULONG t = 0; t < CAVERN_LIMITER_TAPS; t++) {
+            for (ULONG l = 0; l < CAVERN_LIMITER_SPLAT; l++) {
+                m_Splat[phase][t][l] = (float)(taps[t] / sum);
+            }
+        }
+    }
+
+    m_ulChannels = Channels;
+    m_ulLookahead = lookahead;
+    m_ulWindow = window;
+    m_ulDelayFrames = delay;
+    m_Linked = Linked;
+    m_AllowSimd = AllowSimd;
+    m_fCeiling = (float)pow(10.0, CeilingCentiDb / 2000.0);
+    m_dRelease = 1.0 - exp(-1000.0 / ((double)ReleaseMs * SampleRate));
+    m_dInverseLookahead = 1.0 / lookahead;
+    Reset();
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernLimiter::Cleanup()
+{
+    if (m_pBox) {
+        CavernFree(m_pBox, CAVERN_LIMITER_POOLTAG);
+        m_pBox = NULL;
+    }
+    m_pHistory = NULL;
+    m_pDelay = NULL;
+    m_pDequeValue = NULL;
+    m_pDequeFrame = NULL;
+    m_ulChannels = 0;
+    m_ulDelayFrames = 1;
+}
+
+VOID CCavernLimiter::Reset()
+{
+    if (!IsInitialized()) {
+        return;
+    }
+
+    ULONG curves = m_Linked ? 1 : m_ulChannels;
+
+    RtlZeroMemory(m_pHistory, (SIZE_T)2 * CAVERN_LIMITER_TAPS * m_ulChannels * sizeof(float));
+    RtlZeroMemory(m_pDelay, (SIZE_T)m_ulDelayFrames * m_ulChannels * sizeof(float));
+    for (ULONG i = 0; i < curves * m_ulLookahead; i++) {
+        m_pBox[i] = 1.0;
+    }
+    for (ULONG g = 0; g < CAVERN_MAX_CHANNELS; g++) {
+        m_DequeHead[g] = 0;
+        m_DequeCount[g] = 0;
+        m_Release[g] = 1.0;
+        m_BoxSum[g] = m_ulLookahead;
+    }
+    m_ulHistoryPos = 0;
+    m_ulDelayPos = 0;
+    m_ulBoxPos = 0;
+    m_ulFrame = 0;
+    m_ullLimitedFrames = 0;
+}
+
+//
+// True peak of every channel for the frame CAVERN_LIMITER_DETECTOR_DELAY
+// back: the sample and the three points interpolated after it. Window is
+// the last CAVERN_LIMITER_TAPS frames, oldest first.
+//
+VOID CCavernLimiter::DetectPeaks(_In_ const float *Window)
+{
+    const ULONG channels = m_ulChannels;
+    const float *center = Window + (SIZE_T)(CAVERN_LIMITER_DETECTOR_DELAY - 1) * channels;
+    ULONG c = 0;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_AllowSimd) {
+        const __m256 sign = _mm256_set1_ps(-0.0f);
+
+        for (; c + 8 <= channels; c += 8) {
+            __m256 sum0 = _mm256_setzero_ps();
+            __m256 sum1 = _mm256_setzero_ps();
+            __m256 sum2 = _mm256_setzero_ps();
+
+            for (ULONG t = 0; t < CAVERN_LIMITER_TAPS; t++) {
+                __m256 x = _mm256_loadu_ps(Window + (SIZE_T)t * channels + c);
+                sum0 = _mm256_add_ps(sum0, _mm256_mul_ps(_mm256_loadu_ps(m_Splat[0][t]), x));
+                sum1 = _mm256_add_ps(sum1, _mm256_mul_ps(_mm256_loadu_ps(m_Splat[1][t]), x));
+                sum2 = _mm256_add_ps(sum2, _mm256_mul_ps(_mm256_loadu_ps(m_Splat[2][t]), x));
+            }
+
+            __m256 peak = _mm256_andnot_ps(sign, _mm256_loadu_ps(center + c));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, sum0));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, sum1));
+            peak = _mm256_max_ps(peak, _mm256_andnot_ps(sign, sum2));
+            _mm256_storeu_ps(m_Peaks + c, peak);
+        }
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_AllowSimd) {
+        const __m128 sign = _mm_set1_ps(-0.0f);
+
+        for (; c + 4 <= channels; c += 4) {
+            __m128 sum0 = _mm_setzero_ps();
+            __m128 sum1 = _mm_setzero_ps();
+            __m128 sum2 = _mm_setzero_ps();
+
+            for (ULONG t = 0; t < CAVERN_LIMITER_TAPS; t++) {
+                __m128 x = _mm_loadu_ps(Window + (SIZE_T)t * channels + c);
+                sum0 = _mm_add_ps(sum0, _mm_mul_ps(_mm_loadu_ps(m_Splat[0][t]), x));
+                sum1 = _mm_add_ps(sum1, _mm_mul_ps(_mm_loadu_ps(m_Splat[1][t]), x));
+                sum2 = _mm_add_ps(sum2, _mm_mul_ps(_mm_loadu_ps(m_Splat[2][t]), x));
+            }
+
+            __m128 peak = _mm_andnot_ps(sign, _mm_loadu_ps(center + c));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, sum0));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, sum1));
+            peak = _mm_max_ps(peak, _mm_andnot_ps(sign, sum2));
+            _mm_storeu_ps(m_Peaks + c, peak);
+        }
+    }
+#endif
+
+    for (; c < channels; c++) {
+        float sum0 = 0.0f, sum1 = 0.0f, sum2 = 0.0f;
+
+        for (ULONG t = 0; t < CAVERN_LIMITER_TAPS; t++) {
+            float x = Window[(SIZE_T)t * channels + c];
+            sum0 = sum0 + m_Splat[0][t][0] * x;
+            sum1 = sum1 + m_Splat[1][t][0] * x;
+            sum2 = sum2 + m_Splat[2][t][0] * x;
+        }
+
+        float peak = fabsf(center[c]);
+        sum0 = fabsf(sum0);
+        sum1 = fabsf(sum1);
+        sum2 = fabsf(sum2);
+        peak = max(peak, sum0);
+        peak = max(peak, sum1);
+        peak = max(peak, sum2);
+        m_Peaks[c] = peak;
+    }
+}
+
+//
+// Advances one gain curve by a frame whose true peak is Peak and returns
+// the gain for the frame leaving the delay.
+//
+float CCavernLimiter::NextGain(_In_ ULONG Curve, _In_ float Peak)
+{
+    float *values = m_pDequeValue + (SIZE_T)Curve * m_ulWindow;
+    ULONG *frames = m_pDequeFrame + (SIZE_T)Curve * m_ulWindow;
+    ULONG head = m_DequeHead[Curve];
+    ULONG count = m_DequeCount[Curve];
+
+    // Sliding maximum: drop the candidate that left the window, then every
+    // candidate the new peak outlasts and outweighs
+    if (count && m_ulFrame - frames[head] >= m_ulWindow) {
+        head = (head + 1 == m_ulWindow) ? 0 : head + 1;
+        count--;
+    }
+    while (count) {
+        ULONG back = head + count - 1;
+        back -= (back >= m_ulWindow) ? m_ulWindow : 0;
+        if (values[back] > Peak) {
+            break;
+        }
+        count--;
+    }
+    ULONG tail = head + count;
+    tail -= (tail >= m_ulWindow) ? m_ulWindow : 0;
+    values[tail] = Peak;
+    frames[tail] = m_ulFrame;
+    count++;
+
+    m_DequeHead[Curve] = head;
+    m_DequeCount[Curve] = count;
+
+    float maximum = values[head];
+    double target = (maximum > m_fCeiling) ? (double)m_fCeiling / maximum : 1.0;
+
+    // Down at once, back up along the release curve
+    double release = m_Release[Curve];
+    if (target < release) {
+        release = target;
+    } else {
+        release += (target - release) * m_dRelease;
+        if (1.0 - release < CAVERN_LIMITER_UNITY_EPSILON) {
+            release = 1.0;
+        }
+    }
+    m_Release[Curve] = release;
+
+    // Averaged over the look-ahead into a ramp
+    double *box = m_pBox + (SIZE_T)Curve * m_ulLookahead;
+    m_BoxSum[Curve] += release - box[m_ulBoxPos];
+    box[m_ulBoxPos] = release;
+
+    return (m_BoxSum[Curve] >= m_ulLookahead) ? 1.0f : (float)(m_BoxSum[Curve] * m_dInverseLookahead);
+}
+
+//
+// Frame = Delayed * gain, clamped to the ceiling.
+//
+VOID CCavernLimiter::ApplyGains(_In_ const float *Delayed, _Out_ float *Frame)
+{
+    const ULONG channels = m_ulChannels;
+    ULONG c = 0;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_AllowSimd) {
+        const __m256 high = _mm256_set1_ps(m_fCeiling);
+        const __m256 low = _mm256_set1_ps(-m_fCeiling);
+
+        for (; c + 8 <= channels; c += 8) {
+            __m256 y = _mm256_mul_ps(_mm256_loadu_ps(Delayed + c), _mm256_loadu_ps(m_Gains + c));
+            _mm256_storeu_ps(Frame + c, _mm256_min_ps(_mm256_max_ps(y, low), high));
+        }
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_AllowSimd) {
+        const __m128 high = _mm_set1_ps(m_fCeiling);
+        const __m128 low = _mm_set1_ps(-m_fCeiling);
+
+        for (; c + 4 <= channels; c += 4) {
+            __m128 y = _mm_mul_ps(_mm_loadu_ps(Delayed + c), _mm_loadu_ps(m_Gains + c));
+            _mm_storeu_ps(Frame + c, _mm_min_ps(_mm_max_ps(y, low), high));
+        }
+    }
+#endif
+
+    for (; c < channels; c++) {
+        float y = Delayed[c] * m_Gains[c];
+        y = (y < -m_fCeiling) ? -m_fCeiling : y;
+        Frame[c] = (y > m_fCeiling) ? m_fCeiling : y;
+    }
+}
+
+VOID CCavernLimiter::Process(
+    _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!IsInitialized() || !Samples) {
+        return;
+    }
+
+    const ULONG channels = m_ulChannels;
+    const SIZE_T frameBytes = (SIZE_T)channels * sizeof(float);
+    float *frame = Samples;
+
+    for (SIZE_T n = 0; n < FrameCount; n++, frame += channels) {
+        float *history = m_pHistory + (SIZE_T)m_ulHistoryPos * channels;
+        RtlCopyMemory(history, frame, frameBytes);
+        RtlCopyMemory(history + (SIZE_T)CAVERN_LIMITER_TAPS * channels, frame, frameBytes);
+        m_ulHistoryPos = (m_ulHistoryPos + 1 == CAVERN_LIMITER_TAPS) ? 0 : m_ulHistoryPos + 1;
+        DetectPeaks(m_pHistory + (SIZE_T)m_ulHistoryPos * channels);
+
+        // The frame leaving the delay is the oldest one in it
+        ULONG oldest = (m_ulDelayPos + 1 == m_ulDelayFrames) ? 0 : m_ulDelayPos + 1;
+        RtlCopyMemory(m_pDelay + (SIZE_T)m_ulDelayPos * channels, frame, frameBytes);
+
+        BOOLEAN limited = FALSE;
+        if (m_Linked) {
+            float peak = m_Peaks[0];
+            for (ULONG c = 1; c < channels; c++) {
+                peak = max(peak, m_Peaks[c]);
+            }
+            float gain = NextGain(0, peak);
+            for (ULONG c = 0; c < channels; c++) {
+                m_Gains[c] = gain;
+            }
+            limited = gain < 1.0f;
+        } else {
+            for (ULONG c = 0; c < channels; c++) {
+                m_Gains[c] = NextGain(c, m_Peaks[c]);
+                limited |= m_Gains[c] < 1.0f;
+            }
+        }
+        m_ullLimitedFrames += limited;
+
+        ApplyGains(m_pDelay + (SIZE_T)oldest * channels, frame);
+        m_ulDelayPos = oldest;
+        m_ulFrame++;
+
+        // Re-add the box sums once per lap so rounding cannot build up
+        if (++m_ulBoxPos == m_ulLookahead) {
+            ULONG curves = m_Linked ? 1 : channels;
+            for (ULONG g = 0; g < curves; g++) {
+                const double *box = m_pBox + (SIZE_T)g * m_ulLookahead;
+                double sum = 0.0;
+                for (ULONG i = 0; i < m_ulLookahead; i++) {
+                    sum += box[i];
+                }
+                m_BoxSum[g] = sum;
+            }
+            m_ulBoxPos = 0;
+        }
+    }
+}
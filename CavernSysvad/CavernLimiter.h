@@ -0,0 +1,134 @@
+/***************************************************************************
+ * CavernLimiter.h
+ *
+ * Look-ahead brickwall limiter for the summed output, ahead of the integer
+ * converters, which would otherwise clip. The signal is delayed by the
+ * look-ahead and every sample is scaled by a gain that has already come
+ * down far enough for the loudest true peak within reach of it.
+ *
+ * The level detector is a true-peak meter: besides each sample it
+ * interpolates three points between it and the next (4x oversampling,
+ * CAVERN_LIMITER_TAPS-tap windowed-sinc phases), so peaks between samples,
+ * which a DAC reconstructs, are caught too. The peaks go through a
+ * sliding-window maximum over the look-ahead, kept in a monotonic deque so
+ * each frame costs O(1) whatever the window. The gain the maximum demands
+ * is released towards unity with a one-pole curve and then averaged over
+ * the look-ahead, which turns every gain step into a ramp that finishes
+ * before the peak arrives and never rises above what any peak in its span
+ * allows. A final clamp to the ceiling only catches rounding.
+ *
+ * Linked mode drives every channel from the loudest, which keeps the
+ * image in place; unlinked mode limits each channel on its own. The peak
+ * detector and the gain stage run across channels as SIMD lanes (SSE2,
+ * AVX2), bit-identical to the scalar loop; the deque and gain curve are
+ * per channel, or once when linked.
+ *
+ * Below the ceiling the output is the input delayed by GetLatency()
+ * frames, bit for bit. Init and Process must be bracketed with
+ * KeSaveFloatingPointState / KeRestoreFloatingPointState; Process is
+ * called from one thread at a time.
+ ***************************************************************************/
+
+#ifndef _CAVERN_LIMITER_H_
+#define _CAVERN_LIMITER_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_LIMITER_POOLTAG          'mLvC'
+
+// Taps per phase of the true-peak interpolator; the detector reports a
+// frame CAVERN_LIMITER_DETECTOR_DELAY frames after it arrives
+#define CAVERN_LIMITER_TAPS             12
+#define CAVERN_LIMITER_DETECTOR_DELAY   (CAVERN_LIMITER_TAPS / 2)
+
+// Widest vector the detector loads coefficients into
+#define CAVERN_LIMITER_SPLAT            8
+
+// Longest look-ahead Init accepts
+#define CAVERN_LIMITER_MAX_LOOKAHEAD_US 2000
+
+class CCavernLimiter
+{
+public:
+    CCavernLimiter();
+    ~CCavernLimiter();
+
+    // CeilingCentiDb is the highest true peak let through, in 1/100 dBFS
+    // (negative). ReleaseMs is the time constant of the gain recovery.
+    NTSTATUS Init(
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG LookaheadUs,
+        _In_ ULONG ReleaseMs,
+        _In_ LONG CeilingCentiDb,
+        _In_ BOOLEAN Linked,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Limits FrameCount interleaved float frames in place.
+    VOID Process(
+        _Inout_updates_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    // Clears the delay, the detector and the gain curve.
+    VOID Reset();
+
+    BOOLEAN IsInitialized() const { return m_pHistory != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+
+    // Frames of delay the limiter adds
+    ULONG GetLatency() const { return m_ulDelayFrames - 1; }
+
+    // Output frames that were turned down, since Init or Reset
+    ULONGLONG GetLimitedFrames() const { return m_ullLimitedFrames; }
+
+private:
+    VOID DetectPeaks(_In_ const float *Window);
+    float NextGain(_In_ ULONG Curve, _In_ float Peak);
+    VOID ApplyGains(_In_ const float *Delayed, _Out_ float *Frame);
+
+    ULONG               m_ulChannels;
+    ULONG               m_ulLookahead;      // frames the gain ramps over
+    ULONG               m_ulWindow;         // frames in the peak maximum
+    ULONG               m_ulDelayFrames;    // detector delay + look-ahead
+    BOOLEAN             m_Linked;
+    BOOLEAN             m_AllowSimd;
+    float               m_fCeiling;
+    double              m_dRelease;         // one-pole coefficient per frame
+    double              m_dInverseLookahead;
+
+    // Interpolator phases at 1/4, 2/4 and 3/4 of a frame, each tap repeated
+    // across a vector
+    float               m_Splat[3][CAVERN_LIMITER_TAPS][CAVERN_LIMITER_SPLAT];
+
+    // Detector input, written twice so the last CAVERN_LIMITER_TAPS frames
+    // are contiguous, and the delayed signal
+    float              *m_pHistory;
+    float              *m_pDelay;
+    ULONG               m_ulHistoryPos;
+    ULONG               m_ulDelayPos;
+
+    // Per gain curve (one when linked): deque of window maxima candidates,
+    // release state and box average
+    float              *m_pDequeValue;
+    ULONG              *m_pDequeFrame;
+    double             *m_pBox;
+    ULONG               m_DequeHead[CAVERN_MAX_CHANNELS];
+    ULONG               m_DequeCount[CAVERN_MAX_CHANNELS];
+    double              m_Release[CAVERN_MAX_CHANNELS];
+    double              m_BoxSum[CAVERN_MAX_CHANNELS];
+    ULONG               m_ulBoxPos;
+
+    float               m_Peaks[CAVERN_MAX_CHANNELS];
+    float               m_Gains[CAVERN_MAX_CHANNELS];
+    ULONG               m_ulFrame;
+    ULONGLONG           m_ullLimitedFrames;
+};
+
+#endif // _CAVERN_LIMITER_H_
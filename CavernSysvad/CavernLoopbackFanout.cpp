@@ -0,0 +1,324 @@
+/***************************************************************************
+ * CavernLoopbackFanout.cpp
+ *
+ * Render to loopback fan-out implementation
+ ***************************************************************************/
+
+#include "CavernLoopbackFanout.h"
+
+//
+// First ring byte still holding published data: one window behind the end
+// of the data being copied in, and never before the writer last skipped
+// the copy for want of readers.
+//
+static ULONGLONG OldestValid(ULONGLONG Reserve, ULONGLONG ValidFrom, ULONG Window)
+{
+    ULONGLONG oldest = (Reserve > Window) ? Reserve - Window : 0;
+    return max(oldest, ValidFrom);
+}
+
+//
+// Smallest position >= Position on the frame phase of the capture stream,
+// so that frames land whole in the reader's DMA buffer.
+//
+static ULONGLONG AlignToPhase(ULONGLONG Position, ULONGLONG LinearPosition, ULONG BlockAlign)
+{
+    ULONG have = (ULONG)(Position % BlockAlign);
+    ULONG want = (ULONG)(LinearPosition % BlockAlign);
+    return Position + (want + BlockAlign - have) % BlockAlign;
+}
+
+//
+// Largest offset <= Offset into a capture buffer that starts at
+// LinearPosition which falls on a frame boundary, or 0.
+//
+static ULONG FrameFloor(ULONGLONG Offset, ULONGLONG LinearPosition, ULONG BlockAlign)
+{
+    ULONG over = (ULONG)((LinearPosition + Offset) % BlockAlign);
+    return (Offset > over) ? (ULONG)(Offset - over) : 0;
+}
+
+CCavernLoopbackFanout::CCavernLoopbackFanout()
+    : m_pRing(NULL),
+      m_ulCapacity(0),
+      m_ulWindow(0),
+      m_ulBlockAlign(0),
+      m_ulLead(0),
+      m_ulEpoch(0),
+      m_ullWrite(0),
+      m_ullReserve(0),
+      m_ullValidFrom(0),
+      m_lReaders(0),
+      m_ullPublished(0)
+{
+}
+
+CCavernLoopbackFanout::~CCavernLoopbackFanout()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernLoopbackFanout::Init(_In_ ULONG Capacity)
+{
+    Cleanup();
+
+    if (!Capacity) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    m_pRing = (BYTE *)CavernAllocate(Capacity, CAVERN_LOOPBACK_POOLTAG);
+    if (!m_pRing) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    m_ulCapacity = Capacity;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernLoopbackFanout::Cleanup()
+{
+    Stop();
+
+    if (m_pRing) {
+        CavernFree(m_pRing, CAVERN_LOOPBACK_POOLTAG);
+        m_pRing = NULL;
+    }
+    m_ulCapacity = 0;
+}
+
+NTSTATUS CCavernLoopbackFanout::Start(
+    _In_ ULONG BlockAlign,
+    _In_ ULONG BytesPerSecond,
+    _In_ ULONGLONG LinearPosition
+)
+{
+    if (!m_pRing) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    if (!BlockAlign || BytesPerSecond < BlockAlign) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG window = (ULONG)min((ULONGLONG)BytesPerSecond * CAVERN_LOOPBACK_RING_MS / 1000,
+                              (ULONGLONG)m_ulCapacity);
+    window -= window % BlockAlign;
+
+    ULONG lead = (ULONG)((ULONGLONG)BytesPerSecond * CAVERN_LOOPBACK_LEAD_MS / 1000);
+    lead = max(lead - lead % BlockAlign, BlockAlign);
+
+    if (window < 2 * lead) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    m_ulEpoch++;
+    CavernMemoryBarrier();
+
+    m_ulWindow = window;
+    m_ulBlockAlign = BlockAlign;
+    m_ulLead = lead;
+    m_ullValidFrom = LinearPosition;
+    m_ullReserve = LinearPosition;
+    m_ullWrite = LinearPosition;
+
+    CavernMemoryBarrier();
+    m_ulEpoch++;
+
+    // Epoch 0 is what a reader holds when it has to resync
+    if (!m_ulEpoch) {
+        m_ulEpoch += 2;
+    }
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernLoopbackFanout::Stop()
+{
+    if (!m_ulWindow) {
+        return;
+    }
+
+    m_ulEpoch++;
+    CavernMemoryBarrier();
+
+    m_ulWindow = 0;
+
+    CavernMemoryBarrier();
+    m_ulEpoch++;
+}
+
+//
+// The reserve moves first, so a reader that copied from the part of the
+// ring being overwritten sees it when it re-checks. Spans longer than the
+// ring only leave their tail in it.
+//
+VOID CCavernLoopbackFanout::Publish(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    ULONG window = m_ulWindow;
+
+    if (!window || !Length) {
+        return;
+    }
+
+    ULONGLONG end = m_ullWrite + Length;
+
+    if (!m_lReaders) {
+        m_ullValidFrom = end;
+        CavernMemoryBarrier();
+        m_ullReserve = end;
+        m_ullWrite = end;
+        return;
+    }
+
+    if (Length > window) {
+        Buffer += Length - window;
+        Length = window;
+    }
+
+    m_ullReserve = end;
+    CavernMemoryBarrier();
+
+    ULONG offset = (ULONG)((end - Length) % window);
+    ULONG first = min(Length, window - offset);
+
+    RtlCopyMemory(m_pRing + offset, Buffer, first);
+    if (first < Length) {
+        RtlCopyMemory(m_pRing, Buffer + first, Length - first);
+    }
+
+    CavernMemoryBarrier();
+    m_ullWrite = end;
+
+    m_ullPublished += Length;
+}
+
+VOID CCavernLoopbackFanout::AttachReader(_Out_ PCAVERN_LOOPBACK_READER Reader)
+{
+    RtlZeroMemory(Reader, sizeof(*Reader));
+    CavernInterlockedIncrement(&m_lReaders);
+}
+
+VOID CCavernLoopbackFanout::DetachReader(_Inout_ PCAVERN_LOOPBACK_READER Reader)
+{
+    Reader->Epoch = 0;
+    CavernInterlockedDecrement(&m_lReaders);
+}
+
+VOID CCavernLoopbackFanout::CopyOut(
+    _In_ ULONGLONG Position,
+    _Out_writes_bytes_(Length) BYTE *Destination,
+    _In_ ULONG Length
+) const
+{
+    ULONG offset = (ULONG)(Position % m_ulWindow);
+    ULONG first = min(Length, m_ulWindow - offset);
+
+    RtlCopyMemory(Destination, m_pRing + offset, first);
+    if (first < Length) {
+        RtlCopyMemory(Destination + first, m_pRing, Length - first);
+    }
+}
+
+//
+// A reader starts one lead behind the writer, on its own frame phase. It
+// then copies whatever has been published up to what it was asked for; an
+// underrun zeroes the rest and waits for the lead again. If the writer has
+// moved more than a ring ahead, before or during the copy, the overwritten
+// bytes are zeroed and counted as lost, and the reader restarts one lead
+// behind the writer. Nothing here is seen by the writer.
+//
+ULONG CCavernLoopbackFanout::Read(
+    _Inout_ PCAVERN_LOOPBACK_READER Reader,
+    _In_ ULONG BlockAlign,
+    _In_ ULONGLONG LinearPosition,
+    _Out_writes_bytes_(Length) BYTE *Destination,
+    _In_ ULONG Length
+)
+{
+    ULONG epoch = m_ulEpoch;
+    CavernMemoryBarrier();
+
+    ULONG window = m_ulWindow;
+    ULONG lead = m_ulLead;
+
+    if ((epoch & 1) || !window || BlockAlign != m_ulBlockAlign) {
+        RtlZeroMemory(Destination, Length);
+        Reader->Epoch = 0;
+        Reader->SilenceBytes += Length;
+        return 0;
+    }
+
+    ULONGLONG write = m_ullWrite;
+    CavernMemoryBarrier();
+    ULONGLONG oldest = OldestValid(m_ullReserve, m_ullValidFrom, window);
+
+    if (Reader->Epoch != epoch) {
+        Reader->Epoch = epoch;
+        Reader->Position = max(write, oldest);
+        Reader->Primed = FALSE;
+    }
+    else if (Reader->Position < oldest) {
+        ULONGLONG restart = (write > oldest + lead) ? write - lead : oldest;
+
+        Reader->LostBytes += restart - Reader->Position;
+        Reader->Position = restart;
+        Reader->Primed = FALSE;
+        Reader->Laps++;
+    }
+
+    if (!Reader->Primed) {
+        ULONGLONG start = AlignToPhase(Reader->Position, LinearPosition, BlockAlign);
+
+        if (start > write || write - start < lead) {
+            RtlZeroMemory(Destination, Length);
+            Reader->SilenceBytes += Length;
+            return 0;
+        }
+
+        Reader->LostBytes += start - Reader->Position;
+        Reader->Position = start;
+        Reader->Primed = TRUE;
+    }
+
+    // Short of data, stop on a frame boundary so the silence is whole frames
+    ULONG copied = Length;
+    if (write - Reader->Position < Length) {
+        copied = FrameFloor(write - Reader->Position, LinearPosition, BlockAlign);
+    }
+
+    CopyOut(Reader->Position, Destination, copied);
+    CavernMemoryBarrier();
+
+    // Re-check: anything the writer reserved since is suspect
+    ULONG torn = 0;
+
+    if (m_ulEpoch != epoch) {
+        torn = copied;
+        Reader->Epoch = 0;
+    }
+    else {
+        oldest = OldestValid(m_ullReserve, m_ullValidFrom, window);
+        if (oldest > Reader->Position) {
+            ULONGLONG overwritten = oldest - Reader->Position + BlockAlign - 1;
+
+            torn = min(FrameFloor(overwritten, LinearPosition, BlockAlign), copied);
+            Reader->Laps++;
+        }
+    }
+
+    if (torn) {
+        RtlZeroMemory(Destination, torn);
+        Reader->LostBytes += torn;
+    }
+
+    Reader->Position += copied;
+    Reader->ReadBytes += copied - torn;
+
+    if (copied < Length) {
+        RtlZeroMemory(Destination + copied, Length - copied);
+        Reader->SilenceBytes += Length - copied;
+        Reader->Primed = FALSE;
+    }
+
+    return copied - torn;
+}
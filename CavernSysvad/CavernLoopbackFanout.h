@@ -0,0 +1,117 @@
+/***************************************************************************
+ * CavernLoopbackFanout.h
+ *
+ * Render to loopback fan-out. One render stream publishes each DMA span it
+ * consumes into a shared ring, once, whatever the number of listeners; any
+ * number of loopback readers copy from the ring straight into their own DMA
+ * buffers at their own pace. The render DMA buffer itself cannot be lent
+ * out: the audio engine refills a span as soon as the play position has
+ * passed it.
+ *
+ * The writer never waits. Positions are byte counts on the render stream's
+ * linear position; a reader checks its range against the writer's position
+ * before and after copying (like the position register page), so a reader
+ * that falls more than a ring behind finds out itself, zeroes what was
+ * overwritten, counts it as lost and skips ahead. Readers are reference
+ * counted; with none attached the writer only advances its position.
+ *
+ * One writer (Start/Stop/Publish serialized by the caller), any number of
+ * readers, each reader used from one thread at a time. Integer work only.
+ *
+ * Only the SysVAD miniport (minwavert.cpp, minwavertstream.cpp) uses it,
+ * for the loopback pins of its offload filter. Those files are not built
+ * by CavernAudioDriver.vcxproj, whose CCavernMiniportWaveRT has no
+ * loopback pin: loopback capture of that endpoint is done by the audio
+ * engine. In this tree the fan-out runs in the DSP bench loopback suite.
+ ***************************************************************************/
+
+#ifndef _CAVERN_LOOPBACK_FANOUT_H_
+#define _CAVERN_LOOPBACK_FANOUT_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_LOOPBACK_POOLTAG     'bLvC'
+
+// Ring allocated at Init; about 1.3 s of 48 kHz stereo 16-bit
+#define CAVERN_LOOPBACK_RING_BYTES  (256 * 1024)
+
+// Longest history kept for a started format, if the ring is large enough
+#define CAVERN_LOOPBACK_RING_MS     500
+
+// Data a reader waits for before it starts (again) after an underrun;
+// covers the jitter between the render and loopback timer DPCs
+#define CAVERN_LOOPBACK_LEAD_MS     20
+
+typedef struct _CAVERN_LOOPBACK_READER {
+    ULONGLONG   Position;       // next ring byte to copy
+    ULONG       Epoch;          // writer epoch Position belongs to, 0: resync
+    BOOLEAN     Primed;         // FALSE: waiting for the lead
+    ULONG       Laps;           // times the writer overran this reader
+    ULONGLONG   ReadBytes;
+    ULONGLONG   LostBytes;      // overwritten before this reader got to them
+    ULONGLONG   SilenceBytes;   // written as silence (no source, underrun)
+} CAVERN_LOOPBACK_READER, *PCAVERN_LOOPBACK_READER;
+
+class CCavernLoopbackFanout
+{
+public:
+    CCavernLoopbackFanout();
+    ~CCavernLoopbackFanout();
+
+    NTSTATUS Init(_In_ ULONG Capacity);
+    VOID Cleanup();
+
+    // Writer side. Start begins an epoch at the render stream's linear
+    // position; readers resync to it. Stop leaves readers on silence.
+    NTSTATUS Start(
+        _In_ ULONG BlockAlign,
+        _In_ ULONG BytesPerSecond,
+        _In_ ULONGLONG LinearPosition
+    );
+    VOID Stop();
+
+    // Publishes the next Length bytes of the render stream.
+    VOID Publish(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+
+    // Reader side.
+    VOID AttachReader(_Out_ PCAVERN_LOOPBACK_READER Reader);
+    VOID DetachReader(_Inout_ PCAVERN_LOOPBACK_READER Reader);
+
+    // Fills Length bytes of a capture buffer in the writer's format whose
+    // first byte is at LinearPosition of the capture stream (only its frame
+    // phase matters). Bytes without data are zeroed. Returns the number of
+    // bytes that carry render data.
+    ULONG Read(
+        _Inout_ PCAVERN_LOOPBACK_READER Reader,
+        _In_ ULONG BlockAlign,
+        _In_ ULONGLONG LinearPosition,
+        _Out_writes_bytes_(Length) BYTE *Destination,
+        _In_ ULONG Length
+    );
+
+    BOOLEAN IsInitialized() const { return m_pRing != NULL; }
+    BOOLEAN IsActive() const { return m_ulWindow != 0; }
+    LONG GetReaderCount() const { return m_lReaders; }
+    ULONGLONG GetPublishedBytes() const { return m_ullPublished; }
+
+private:
+    VOID CopyOut(_In_ ULONGLONG Position, _Out_writes_bytes_(Length) BYTE *Destination, _In_ ULONG Length) const;
+
+    BYTE               *m_pRing;
+    ULONG               m_ulCapacity;
+
+    // Format of the current epoch; written only while m_ulEpoch is odd
+    ULONG               m_ulWindow;         // ring bytes in use, 0: stopped
+    ULONG               m_ulBlockAlign;
+    ULONG               m_ulLead;
+
+    volatile ULONG      m_ulEpoch;          // odd while Start/Stop update
+    volatile ULONGLONG  m_ullWrite;         // end of the published data
+    volatile ULONGLONG  m_ullReserve;       // end of the data being copied in
+    volatile ULONGLONG  m_ullValidFrom;     // first byte actually in the ring
+    volatile LONG       m_lReaders;
+
+    ULONGLONG           m_ullPublished;     // bytes copied into the ring
+};
+
+#endif // _CAVERN_LOOPBACK_FANOUT_H_
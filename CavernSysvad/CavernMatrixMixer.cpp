@@ -0,0 +1,520 @@
+/***************************************************************************
+ * CavernMatrixMixer.cpp
+ *
+ * Matrix downmix/upmix implementation
+ ***************************************************************************/
+
+#include "CavernMatrixMixer.h"
+
+#define MINUS_3DB   0.70710678f
+#define MINUS_6DB   0.5f
+
+#define FOLD_MAX_DEPTH  4
+
+//=============================================================================
+// Fold rules: for a speaker the target lacks, the alternatives are tried in
+// order and the first one whose speakers all exist in the target is used.
+// If none does, the last alternative is resolved recursively.
+//=============================================================================
+
+typedef struct _CAVERN_FOLD_ALTERNATIVE {
+    ULONG   Speaker[2];
+    float   Gain[2];
+} CAVERN_FOLD_ALTERNATIVE;
+
+typedef struct _CAVERN_FOLD_RULE {
+    ULONG                   Speaker;
+    ULONG                   Count;
+    CAVERN_FOLD_ALTERNATIVE Alternatives[3];
+} CAVERN_FOLD_RULE;
+
+static const CAVERN_FOLD_RULE g_FoldRules[] = {
+    { SPEAKER_FRONT_CENTER, 1, {
+        { { SPEAKER_FRONT_LEFT, SPEAKER_FRONT_RIGHT }, { MINUS_3DB, MINUS_3DB } } } },
+    { SPEAKER_FRONT_LEFT_OF_CENTER, 1, {
+        { { SPEAKER_FRONT_LEFT, 0 }, { 1.0f, 0 } } } },
+    { SPEAKER_FRONT_RIGHT_OF_CENTER, 1, {
+        { { SPEAKER_FRONT_RIGHT, 0 }, { 1.0f, 0 } } } },
+    { SPEAKER_SIDE_LEFT, 2, {
+        { { SPEAKER_BACK_LEFT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_FRONT_LEFT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_SIDE_RIGHT, 2, {
+        { { SPEAKER_BACK_RIGHT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_FRONT_RIGHT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_BACK_LEFT, 2, {
+        { { SPEAKER_SIDE_LEFT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_FRONT_LEFT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_BACK_RIGHT, 2, {
+        { { SPEAKER_SIDE_RIGHT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_FRONT_RIGHT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_BACK_CENTER, 3, {
+        { { SPEAKER_BACK_LEFT, SPEAKER_BACK_RIGHT }, { MINUS_3DB, MINUS_3DB } },
+        { { SPEAKER_SIDE_LEFT, SPEAKER_SIDE_RIGHT }, { MINUS_3DB, MINUS_3DB } },
+        { { SPEAKER_FRONT_LEFT, SPEAKER_FRONT_RIGHT }, { MINUS_6DB, MINUS_6DB } } } },
+    { SPEAKER_TOP_FRONT_LEFT, 1, {
+        { { SPEAKER_FRONT_LEFT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_FRONT_RIGHT, 1, {
+        { { SPEAKER_FRONT_RIGHT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_FRONT_CENTER, 2, {
+        { { SPEAKER_TOP_FRONT_LEFT, SPEAKER_TOP_FRONT_RIGHT }, { MINUS_3DB, MINUS_3DB } },
+        { { SPEAKER_FRONT_CENTER, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_BACK_LEFT, 2, {
+        { { SPEAKER_TOP_FRONT_LEFT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_BACK_LEFT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_BACK_RIGHT, 2, {
+        { { SPEAKER_TOP_FRONT_RIGHT, 0 }, { 1.0f, 0 } },
+        { { SPEAKER_BACK_RIGHT, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_BACK_CENTER, 3, {
+        { { SPEAKER_TOP_BACK_LEFT, SPEAKER_TOP_BACK_RIGHT }, { MINUS_3DB, MINUS_3DB } },
+        { { SPEAKER_TOP_FRONT_LEFT, SPEAKER_TOP_FRONT_RIGHT }, { MINUS_3DB, MINUS_3DB } },
+        { { SPEAKER_BACK_CENTER, 0 }, { MINUS_3DB, 0 } } } },
+    { SPEAKER_TOP_CENTER, 2, {
+        { { SPEAKER_TOP_FRONT_LEFT, SPEAKER_TOP_FRONT_RIGHT }, { MINUS_6DB, MINUS_6DB } },
+        { { SPEAKER_FRONT_LEFT, SPEAKER_FRONT_RIGHT }, { MINUS_6DB, MINUS_6DB } } } },
+};
+
+static LONG FindOutput(const CAVERN_CHANNEL_LAYOUT *Target, ULONG Speaker)
+{
+    for (ULONG o = 0; o < Target->Channels; o++) {
+        if (Speaker && Target->Speakers[o] == Speaker) {
+            return (LONG)o;
+        }
+    }
+    return -1;
+}
+
+static const CAVERN_FOLD_RULE *FindFoldRule(ULONG Speaker)
+{
+    for (ULONG r = 0; r < sizeof(g_FoldRules) / sizeof(g_FoldRules[0]); r++) {
+        if (g_FoldRules[r].Speaker == Speaker) {
+            return &g_FoldRules[r];
+        }
+    }
+    return NULL;
+}
+
+// Adds Gain x input channel Input to whatever outputs Speaker lands on.
+static VOID RouteSpeaker(
+    const CAVERN_CHANNEL_LAYOUT *Target,
+    ULONG Speaker,
+    ULONG Input,
+    float Gain,
+    ULONG Depth,
+    PCAVERN_MIX_MATRIX Matrix
+)
+{
+    LONG output = FindOutput(Target, Speaker);
+
+    if (output >= 0) {
+        Matrix->Columns[Input][output] += Gain;
+        return;
+    }
+
+    const CAVERN_FOLD_RULE *rule = FindFoldRule(Speaker);
+    if (!rule || Depth >= FOLD_MAX_DEPTH) {
+        return;
+    }
+
+    const CAVERN_FOLD_ALTERNATIVE *chosen = &rule->Alternatives[rule->Count - 1];
+    for (ULONG a = 0; a < rule->Count; a++) {
+        const CAVERN_FOLD_ALTERNATIVE *alternative = &rule->Alternatives[a];
+
+        if ((!alternative->Speaker[0] || FindOutput(Target, alternative->Speaker[0]) >= 0) &&
+            (!alternative->Speaker[1] || FindOutput(Target, alternative->Speaker[1]) >= 0)) {
+            chosen = alternative;
+            break;
+        }
+    }
+
+    for (ULONG k = 0; k < 2; k++) {
+        if (chosen->Speaker[k]) {
+            RouteSpeaker(Target, chosen->Speaker[k], Input, Gain * chosen->Gain[k], Depth + 1, Matrix);
+        }
+    }
+}
+
+//=============================================================================
+// Kernels. Destination frame = sum over inputs of input sample x column.
+//=============================================================================
+
+static VOID MixScalar(const CAVERN_MIX_MATRIX *Matrix, const float *Source, float *Destination, SIZE_T Frames)
+{
+    const ULONG inputs = Matrix->InputChannels;
+    const ULONG outputs = Matrix->OutputChannels;
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        for (ULONG o = 0; o < outputs; o++) {
+            float sum = 0.0f;
+            for (ULONG i = 0; i < inputs; i++) {
+                sum += Source[i] * Matrix->Columns[i][o];
+            }
+            Destination[o] = sum;
+        }
+        Source += inputs;
+        Destination += outputs;
+    }
+}
+
+#if defined(CAVERN_HAVE_AVX2) && defined(CAVERN_HAVE_FMA)
+
+template <ULONG Inputs, ULONG Outputs>
+static VOID MixFixed(const CAVERN_MIX_MATRIX *Matrix, const float *Source, float *Destination, SIZE_T Frames)
+{
+    const ULONG vectors = (Outputs + 7) / 8;
+    const ULONG tail = Outputs - (vectors - 1) * 8;
+    __m256 columns[Inputs][vectors];
+    __m256i tailMask = _mm256_cmpgt_epi32(_mm256_set1_epi32((int)tail),
+                                          _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+    for (ULONG i = 0; i < Inputs; i++) {
+        for (ULONG v = 0; v < vectors; v++) {
+            columns[i][v] = _mm256_loadu_ps(&Matrix->Columns[i][v * 8]);
+        }
+    }
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        __m256 sum[vectors];
+
+        for (ULONG v = 0; v < vectors; v++) {
+            sum[v] = _mm256_setzero_ps();
+        }
+        for (ULONG i = 0; i < Inputs; i++) {
+            __m256 sample = _mm256_broadcast_ss(Source + i);
+            for (ULONG v = 0; v < vectors; v++) {
+                sum[v] = _mm256_fmadd_ps(sample, columns[i][v], sum[v]);
+            }
+        }
+        for (ULONG v = 0; v + 1 < vectors; v++) {
+            _mm256_storeu_ps(Destination + v * 8, sum[v]);
+        }
+        _mm256_maskstore_ps(Destination + (vectors - 1) * 8, tailMask, sum[vectors - 1]);
+
+        Source += Inputs;
+        Destination += Outputs;
+    }
+}
+
+#elif defined(CAVERN_HAVE_SSE2)
+
+template <ULONG Inputs, ULONG Outputs>
+static VOID MixFixed(const CAVERN_MIX_MATRIX *Matrix, const float *Source, float *Destination, SIZE_T Frames)
+{
+    const ULONG vectors = (Outputs + 3) / 4;
+    const ULONG fullVectors = Outputs / 4;
+    __m128 columns[Inputs][vectors];
+
+    for (ULONG i = 0; i < Inputs; i++) {
+        for (ULONG v = 0; v < vectors; v++) {
+            columns[i][v] = _mm_loadu_ps(&Matrix->Columns[i][v * 4]);
+        }
+    }
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        __m128 sum[vectors];
+
+        for (ULONG v = 0; v < vectors; v++) {
+            sum[v] = _mm_setzero_ps();
+        }
+        for (ULONG i = 0; i < Inputs; i++) {
+            __m128 sample = _mm_set1_ps(Source[i]);
+            for (ULONG v = 0; v < vectors; v++) {
+                sum[v] = _mm_add_ps(sum[v], _mm_mul_ps(sample, columns[i][v]));
+            }
+        }
+        for (ULONG v = 0; v < fullVectors; v++) {
+            _mm_storeu_ps(Destination + v * 4, sum[v]);
+        }
+        if (Outputs % 4) {
+            float last[4];
+            _mm_storeu_ps(last, sum[vectors - 1]);
+            for (ULONG o = 0; o < Outputs % 4; o++) {
+                Destination[fullVectors * 4 + o] = last[o];
+            }
+        }
+
+        Source += Inputs;
+        Destination += Outputs;
+    }
+}
+
+//
+// Stereo output fills only half a vector per frame, so two frames are mixed
+// at once: lanes are (frame 0 L, frame 0 R, frame 1 L, frame 1 R).
+//
+template <ULONG Inputs>
+static VOID MixToStereo(const CAVERN_MIX_MATRIX *Matrix, const float *Source, float *Destination, SIZE_T Frames)
+{
+    __m128 columns[Inputs];
+    SIZE_T f = 0;
+
+    for (ULONG i = 0; i < Inputs; i++) {
+        columns[i] = _mm_setr_ps(Matrix->Columns[i][0], Matrix->Columns[i][1],
+                                 Matrix->Columns[i][0], Matrix->Columns[i][1]);
+    }
+
+    for (; f + 2 <= Frames; f += 2) {
+        __m128 sum = _mm_setzero_ps();
+
+        for (ULONG i = 0; i < Inputs; i++) {
+            __m128 samples = _mm_setr_ps(Source[i], Source[i], Source[Inputs + i], Source[Inputs + i]);
+            sum = _mm_add_ps(sum, _mm_mul_ps(samples, columns[i]));
+        }
+        _mm_storeu_ps(Destination, sum);
+
+        Source += 2 * Inputs;
+        Destination += 4;
+    }
+
+    if (f < Frames) {
+        MixScalar(Matrix, Source, Destination, 1);
+    }
+}
+
+#endif
+
+typedef struct _CAVERN_MIX_SHAPE {
+    ULONG               Inputs;
+    ULONG               Outputs;
+    PCAVERN_MIX_KERNEL  Kernel;
+} CAVERN_MIX_SHAPE;
+
+#if defined(CAVERN_HAVE_AVX2) && defined(CAVERN_HAVE_FMA)
+#define CAVERN_MIX_SHAPE_ENTRY(In, Out) { In, Out, MixFixed<In, Out> }
+#elif defined(CAVERN_HAVE_SSE2)
+#define CAVERN_MIX_SHAPE_ENTRY(In, Out) { In, Out, (Out == 2) ? MixToStereo<In> : MixFixed<In, Out> }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+
+// Downmixes from the standard layouts, plus the common upmixes
+static const CAVERN_MIX_SHAPE g_MixShapes[] = {
+    CAVERN_MIX_SHAPE_ENTRY(16, 12), CAVERN_MIX_SHAPE_ENTRY(16, 10), CAVERN_MIX_SHAPE_ENTRY(16, 8),
+    CAVERN_MIX_SHAPE_ENTRY(16, 6),  CAVERN_MIX_SHAPE_ENTRY(16, 2),
+    CAVERN_MIX_SHAPE_ENTRY(12, 10), CAVERN_MIX_SHAPE_ENTRY(12, 8),  CAVERN_MIX_SHAPE_ENTRY(12, 6),
+    CAVERN_MIX_SHAPE_ENTRY(12, 2),
+    CAVERN_MIX_SHAPE_ENTRY(10, 8),  CAVERN_MIX_SHAPE_ENTRY(10, 6),  CAVERN_MIX_SHAPE_ENTRY(10, 2),
+    CAVERN_MIX_SHAPE_ENTRY(8, 6),   CAVERN_MIX_SHAPE_ENTRY(8, 2),
+    CAVERN_MIX_SHAPE_ENTRY(6, 2),
+    CAVERN_MIX_SHAPE_ENTRY(2, 6),   CAVERN_MIX_SHAPE_ENTRY(2, 8),   CAVERN_MIX_SHAPE_ENTRY(6, 8),
+    CAVERN_MIX_SHAPE_ENTRY(6, 12),  CAVERN_MIX_SHAPE_ENTRY(8, 12),
+};
+#endif
+
+static PCAVERN_MIX_KERNEL SelectMixKernel(ULONG Inputs, ULONG Outputs)
+{
+#if defined(CAVERN_HAVE_SSE2)
+    for (ULONG s = 0; s < sizeof(g_MixShapes) / sizeof(g_MixShapes[0]); s++) {
+        if (g_MixShapes[s].Inputs == Inputs && g_MixShapes[s].Outputs == Outputs) {
+            return g_MixShapes[s].Kernel;
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(Inputs);
+    UNREFERENCED_PARAMETER(Outputs);
+#endif
+    return MixScalar;
+}
+
+//=============================================================================
+// Matrix construction
+//=============================================================================
+
+NTSTATUS CavernBuildMixMatrix(
+    _In_ const CAVERN_CHANNEL_LAYOUT *Source,
+    _In_ const CAVERN_CHANNEL_LAYOUT *Target,
+    _In_ CAVERN_LFE_POLICY LfePolicy,
+    _Out_ PCAVERN_MIX_MATRIX Matrix
+)
+{
+    RtlZeroMemory(Matrix, sizeof(*Matrix));
+
+    if (!Source->Channels || Source->Channels > CAVERN_MAX_CHANNELS ||
+        !Target->Channels || Target->Channels > CAVERN_MAX_CHANNELS) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    Matrix->InputChannels = Source->Channels;
+    Matrix->OutputChannels = Target->Channels;
+    Matrix->LfePolicy = LfePolicy;
+
+    for (ULONG i = 0; i < Source->Channels; i++) {
+        ULONG speaker = Source->Speakers[i];
+
+        if (speaker != SPEAKER_LOW_FREQUENCY) {
+            RouteSpeaker(Target, speaker, i, 1.0f, 0, Matrix);
+            continue;
+        }
+
+        LONG lfe = FindOutput(Target, SPEAKER_LOW_FREQUENCY);
+        if (LfePolicy == CavernLfeDrop) {
+            continue;
+        }
+        if (lfe >= 0) {
+            Matrix->Columns[i][lfe] = 1.0f;
+        } else if (LfePolicy == CavernLfeFold) {
+            RouteSpeaker(Target, SPEAKER_FRONT_LEFT, i, MINUS_6DB, 0, Matrix);
+            RouteSpeaker(Target, SPEAKER_FRONT_RIGHT, i, MINUS_6DB, 0, Matrix);
+        }
+    }
+
+    // Scale so the loudest output row cannot exceed full scale
+    float peak = 0.0f;
+    for (ULONG o = 0; o < Target->Channels; o++) {
+        float row = 0.0f;
+        for (ULONG i = 0; i < Source->Channels; i++) {
+            row += Matrix->Columns[i][o];
+        }
+        peak = max(peak, row);
+    }
+    if (peak > 1.0f) {
+        float scale = 1.0f / peak;
+        for (ULONG i = 0; i < Source->Channels; i++) {
+            for (ULONG o = 0; o < Target->Channels; o++) {
+                Matrix->Columns[i][o] *= scale;
+            }
+        }
+    }
+
+    Matrix->Kernel = SelectMixKernel(Source->Channels, Target->Channels);
+    Matrix->Valid = TRUE;
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+// CCavernMatrixMixer
+//=============================================================================
+
+CCavernMatrixMixer::CCavernMatrixMixer()
+    : m_pCurrent(NULL),
+      m_ullUseCounter(0),
+      m_ulCacheMisses(0),
+      m_ForceScalar(FALSE)
+{
+    RtlZeroMemory(m_Cache, sizeof(m_Cache));
+}
+
+NTSTATUS CCavernMatrixMixer::Configure(
+    _In_ ULONG InputMask,
+    _In_ ULONG InputChannels,
+    _In_ CAVERN_LAYOUT_ID OutputLayout,
+    _In_ CAVERN_LFE_POLICY LfePolicy
+)
+{
+    PCAVERN_MIX_MATRIX victim = &m_Cache[0];
+
+    for (ULONG e = 0; e < CAVERN_MIXER_CACHE_ENTRIES; e++) {
+        PCAVERN_MIX_MATRIX entry = &m_Cache[e];
+
+        if (entry->Valid &&
+            entry->InputMask == InputMask &&
+            entry->InputChannels == InputChannels &&
+            entry->OutputLayout == OutputLayout &&
+            entry->LfePolicy == LfePolicy) {
+            entry->LastUse = ++m_ullUseCounter;
+            m_pCurrent = entry;
+            return STATUS_SUCCESS;
+        }
+
+        // Least recently used (or empty) entry is replaced on a miss
+        if (!entry->Valid || (victim->Valid && entry->LastUse < victim->LastUse)) {
+            victim = entry;
+        }
+    }
+
+    CAVERN_CHANNEL_LAYOUT source;
+    CAVERN_CHANNEL_LAYOUT target;
+    NTSTATUS status = CavernLayoutFromMask(InputMask, InputChannels, &source);
+
+    if (NT_SUCCESS(status)) {
+        status = CavernGetStandardLayout(OutputLayout, &target);
+    }
+    if (NT_SUCCESS(status)) {
+        status = CavernBuildMixMatrix(&source, &target, LfePolicy, victim);
+    }
+    if (!NT_SUCCESS(status)) {
+        victim->Valid = FALSE;
+        if (m_pCurrent == victim) {
+            m_pCurrent = NULL;
+        }
+        return status;
+    }
+
+    victim->InputMask = InputMask;
+    victim->OutputLayout = OutputLayout;
+    victim->LastUse = ++m_ullUseCounter;
+    m_ulCacheMisses++;
+    m_pCurrent = victim;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernMatrixMixer::Process(
+    _In_reads_(Frames * GetInputChannels()) const float *Source,
+    _Out_writes_(Frames * GetOutputChannels()) float *Destination,
+    _In_ SIZE_T Frames
+)
+{
+    if (!m_pCurrent) {
+        return;
+    }
+
+    if (m_ForceScalar) {
+        MixScalar(m_pCurrent, Source, Destination, Frames);
+    } else {
+        m_pCurrent->Kernel(m_pCurrent, Source, Destination, Frames);
+    }
+}
+
+//=============================================================================
+// Channel router
+//=============================================================================
+
+CCavernChannelRouter::CCavernChannelRouter()
+    : m_UseMatrix(FALSE)
+{
+    RtlZeroMemory(&m_Remap, sizeof(m_Remap));
+}
+
+NTSTATUS CCavernChannelRouter::Configure(
+    _In_ ULONG ChannelMask,
+    _In_ ULONG Channels,
+    _In_ CAVERN_LAYOUT_ID Layout,
+    _In_ CAVERN_LFE_POLICY LfePolicy
+)
+{
+    CAVERN_CHANNEL_LAYOUT source;
+    CAVERN_CHANNEL_LAYOUT target;
+
+    m_UseMatrix = FALSE;
+
+    NTSTATUS status = CavernLayoutFromMask(ChannelMask, Channels, &source);
+    if (NT_SUCCESS(status)) {
+        status = CavernGetStandardLayout(Layout, &target);
+    }
+    if (NT_SUCCESS(status)) {
+        status = CavernCompileRemap(&source, &target, &m_Remap);
+    }
+    if (!NT_SUCCESS(status) || !m_Remap.DroppedSources) {
+        return status;
+    }
+
+    // A channel without a speaker of its own is folded into its neighbours
+    status = m_Matrix.Configure(ChannelMask, Channels, Layout, LfePolicy);
+    m_UseMatrix = NT_SUCCESS(status);
+
+    return status;
+}
+
+VOID CCavernChannelRouter::Process(
+    _In_reads_(Frames * GetInputChannels()) const float *Source,
+    _Out_writes_(Frames * GetOutputChannels()) float *Destination,
+    _In_ SIZE_T Frames
+)
+{
+    if (m_UseMatrix) {
+        m_Matrix.Process(Source, Destination, Frames);
+    } else {
+        CavernRemap(&m_Remap, Source, Destination, Frames);
+    }
+}
@@ -0,0 +1,134 @@
+/***************************************************************************
+ * CavernMatrixMixer.h
+ *
+ * Downmix/upmix of interleaved float frames through a coefficient matrix.
+ * Matrices are derived from the speaker positions of the input mask and
+ * the output layout, and kept in a small cache keyed on (input mask,
+ * output layout, LFE policy) so switching between streams or layouts does
+ * not rebuild them. Common NxM shapes get kernels specialized at compile
+ * time (SSE2, or AVX2/FMA when the build targets it).
+ ***************************************************************************/
+
+#ifndef _CAVERN_MATRIXMIXER_H_
+#define _CAVERN_MATRIXMIXER_H_
+
+#include "CavernChannelRemap.h"
+
+#define CAVERN_MIXER_CACHE_ENTRIES  8
+
+typedef enum _CAVERN_LFE_POLICY {
+    CavernLfeKeep = 0,          // to the LFE output if there is one, else dropped
+    CavernLfeDrop,              // always dropped
+    CavernLfeFold               // into the front mains at -6 dB when there is no LFE output
+} CAVERN_LFE_POLICY;
+
+struct _CAVERN_MIX_MATRIX;
+
+typedef VOID (*PCAVERN_MIX_KERNEL)(
+    _In_ const struct _CAVERN_MIX_MATRIX *Matrix,
+    _In_ const float *Source,
+    _Out_ float *Destination,
+    _In_ SIZE_T Frames
+);
+
+typedef struct _CAVERN_MIX_MATRIX {
+    // Key
+    ULONG               InputMask;
+    ULONG               InputChannels;
+    CAVERN_LAYOUT_ID    OutputLayout;
+    CAVERN_LFE_POLICY   LfePolicy;
+
+    ULONG               OutputChannels;
+    // Columns[i][o]: gain from input channel i to output channel o; each
+    // column is zero-padded to CAVERN_MAX_CHANNELS for vector loads.
+    float               Columns[CAVERN_MAX_CHANNELS][CAVERN_MAX_CHANNELS];
+    PCAVERN_MIX_KERNEL  Kernel;
+    ULONGLONG           LastUse;
+    BOOLEAN             Valid;
+} CAVERN_MIX_MATRIX, *PCAVERN_MIX_MATRIX;
+
+// Builds the gains for Source -> Target. Speakers missing from the target
+// fold into their nearest neighbours (-3 dB when split over a pair or
+// moved down from the height layer); target speakers the source lacks stay
+// silent. The result is scaled down so no output can exceed full scale.
+NTSTATUS CavernBuildMixMatrix(
+    _In_ const CAVERN_CHANNEL_LAYOUT *Source,
+    _In_ const CAVERN_CHANNEL_LAYOUT *Target,
+    _In_ CAVERN_LFE_POLICY LfePolicy,
+    _Out_ PCAVERN_MIX_MATRIX Matrix
+);
+
+class CCavernMatrixMixer
+{
+public:
+    CCavernMatrixMixer();
+
+    // Makes the matrix for the key current, building it on a cache miss.
+    NTSTATUS Configure(
+        _In_ ULONG InputMask,
+        _In_ ULONG InputChannels,
+        _In_ CAVERN_LAYOUT_ID OutputLayout,
+        _In_ CAVERN_LFE_POLICY LfePolicy
+    );
+
+    // Source and Destination must not overlap.
+    VOID Process(
+        _In_reads_(Frames * GetInputChannels()) const float *Source,
+        _Out_writes_(Frames * GetOutputChannels()) float *Destination,
+        _In_ SIZE_T Frames
+    );
+
+    ULONG GetInputChannels() const { return m_pCurrent ? m_pCurrent->InputChannels : 0; }
+    ULONG GetOutputChannels() const { return m_pCurrent ? m_pCurrent->OutputChannels : 0; }
+    const CAVERN_MIX_MATRIX *GetMatrix() const { return m_pCurrent; }
+    ULONG GetCacheMisses() const { return m_ulCacheMisses; }
+
+    // Uses the scalar kernel regardless of shape (reference and fallback).
+    VOID ForceScalar(_In_ BOOLEAN Scalar) { m_ForceScalar = Scalar; }
+
+private:
+    CAVERN_MIX_MATRIX   m_Cache[CAVERN_MIXER_CACHE_ENTRIES];
+    PCAVERN_MIX_MATRIX  m_pCurrent;
+    ULONGLONG           m_ullUseCounter;
+    ULONG               m_ulCacheMisses;
+    BOOLEAN             m_ForceScalar;
+};
+
+//
+// Takes a stream's channels to a mix layout: a straight gather by speaker
+// position when every channel has its speaker in the layout (or the back/
+// side alias), the matrix when some would otherwise be dropped. Configure
+// may build a matrix, so it needs the floating point state like Process.
+//
+class CCavernChannelRouter
+{
+public:
+    CCavernChannelRouter();
+
+    NTSTATUS Configure(
+        _In_ ULONG ChannelMask,
+        _In_ ULONG Channels,
+        _In_ CAVERN_LAYOUT_ID Layout,
+        _In_ CAVERN_LFE_POLICY LfePolicy
+    );
+
+    // Source and Destination must not overlap.
+    VOID Process(
+        _In_reads_(Frames * GetInputChannels()) const float *Source,
+        _Out_writes_(Frames * GetOutputChannels()) float *Destination,
+        _In_ SIZE_T Frames
+    );
+
+    // Source already in the layout: nothing to do
+    BOOLEAN IsIdentity() const { return !m_UseMatrix && m_Remap.Identity; }
+    BOOLEAN UsesMatrix() const { return m_UseMatrix; }
+    ULONG GetInputChannels() const { return m_Remap.SourceChannels; }
+    ULONG GetOutputChannels() const { return m_Remap.TargetChannels; }
+
+private:
+    CAVERN_REMAP_PLAN   m_Remap;
+    CCavernMatrixMixer  m_Matrix;
+    BOOLEAN             m_UseMatrix;
+};
+
+#endif // _CAVERN_MATRIXMIXER_H_
@@ -14,6 +14,180 @@
 
 #define CAVERN_PIPE_NAME L"\\??\\pipe\\CavernAudioPipe"
 
+#ifndef WAVE_FORMAT_DOLBY_AC3_SPDIF
+#define WAVE_FORMAT_DOLBY_AC3_SPDIF 0x0092
+#endif
+
+#pragma code_seg()
+//
+// Forwarding granularity for a negotiated format: whole codec frames for
+// IEC 61937 / AC-3 passthrough, whole nBlockAlign frames for PCM.
+//
+static CAVERN_FORWARD_MODE CavernForwardModeFromFormat(_In_opt_ PWAVEFORMATEXTENSIBLE Format)
+{
+    if (!Format || !Format->Format.nBlockAlign) {
+        return CavernForwardRaw;
+    }
+    
+    WORD formatTag = Format->Format.wFormatTag;
+    
+    if (formatTag == WAVE_FORMAT_EXTENSIBLE &&
+        Format->Format.cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX)) {
+        if (IsEqualGUID(Format->SubFormat, KSDATAFORMAT_SUBTYPE_PCM) ||
+            IsEqualGUID(Format->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT)) {
+            return CavernForwardPcmFrames;
+        }
+        return CavernForwardCodecFrames;
+    } else if (formatTag == WAVE_FORMAT_DOLBY_AC3_SPDIF) {
+        return CavernForwardCodecFrames;
+    }
+    
+    return CavernForwardPcmFrames;
+}
+
+//
+// Sample format of a PCM stream, as the portable converters name it.
+//
+static CAVERN_SAMPLE_FORMAT CavernSampleFormatFromFormat(_In_ PWAVEFORMATEXTENSIBLE Format)
+{
+    BOOLEAN extensible = Format->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+        Format->Format.cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+    BOOLEAN isFloat = Format->Format.wFormatTag == WAVE_FORMAT_IEEE_FLOAT ||
+        (extensible && IsEqualGUID(Format->SubFormat, KSDATAFORMAT_SUBTYPE_IEEE_FLOAT));
+    
+    return CavernSampleFormatFromWave(
+        Format->Format.wBitsPerSample,
+        extensible ? Format->Samples.wValidBitsPerSample : Format->Format.wBitsPerSample,
+        isFloat);
+}
+
+//
+// Speaker positions of a PCM stream; a stream without a mask gets the
+// usual layout for its channel count.
+//
+static ULONG CavernChannelMaskFromFormat(_In_ PWAVEFORMATEXTENSIBLE Format)
+{
+    if (Format->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+        Format->Format.cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX) &&
+        Format->dwChannelMask) {
+        return Format->dwChannelMask;
+    }
+    
+    return CavernDefaultChannelMask(Format->Format.nChannels);
+}
+
+#pragma code_seg("PAGE")
+//
+// Copies the ChannelDelays value, up to CAVERN_MAX_CHANNELS DWORDs, into
+// the array at EntryContext. Other value types are ignored.
+//
+static NTSTATUS CavernQueryChannelDelays(
+    _In_ PWSTR ValueName,
+    _In_ ULONG ValueType,
+    _In_ PVOID ValueData,
+    _In_ ULONG ValueLength,
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID EntryContext
+)
+{
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+    
+    PAGED_CODE();
+    
+    if (ValueType == REG_BINARY && EntryContext) {
+        ULONG count = min(ValueLength / sizeof(ULONG), (ULONG)CAVERN_MAX_CHANNELS);
+        RtlCopyMemory(EntryContext, ValueData, count * sizeof(ULONG));
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+//
+// Copies the ChannelEq value, up to CAVERN_EQ_MAX_FILTERS whole filters,
+// into the CAVERN_EQ_SETTINGS at EntryContext. Other value types are
+// ignored.
+//
+static NTSTATUS CavernQueryChannelEq(
+    _In_ PWSTR ValueName,
+    _In_ ULONG ValueType,
+    _In_ PVOID ValueData,
+    _In_ ULONG ValueLength,
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID EntryContext
+)
+{
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+    
+    PAGED_CODE();
+    
+    PCAVERN_EQ_SETTINGS settings = (PCAVERN_EQ_SETTINGS)EntryContext;
+    
+    if (ValueType == REG_BINARY && settings) {
+        settings->Count = min((ULONG)(ValueLength / sizeof(CAVERN_EQ_FILTER)), (ULONG)CAVERN_EQ_MAX_FILTERS);
+        RtlCopyMemory(settings->Filters, ValueData, settings->Count * sizeof(CAVERN_EQ_FILTER));
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+//
+// Copies the RoomFilter path into the CAVERN_ROOM_FILTER_MAX_PATH buffer
+// at EntryContext. Longer paths and other value types are ignored.
+//
+static NTSTATUS CavernQueryRoomFilterPath(
+    _In_ PWSTR ValueName,
+    _In_ ULONG ValueType,
+    _In_ PVOID ValueData,
+    _In_ ULONG ValueLength,
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID EntryContext
+)
+{
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+    
+    PAGED_CODE();
+    
+    PWCHAR path = (PWCHAR)EntryContext;
+    
+    if (ValueType == REG_SZ && path && ValueLength < CAVERN_ROOM_FILTER_MAX_PATH * sizeof(WCHAR)) {
+        RtlCopyMemory(path, ValueData, ValueLength);
+        path[ValueLength / sizeof(WCHAR)] = L'\0';
+    }
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+//
+// Copies a DWORD value (LimiterMode, MixLayout) into the ULONG at
+// EntryContext. Other value types are ignored.
+//
+static NTSTATUS CavernQueryDword(
+    _In_ PWSTR ValueName,
+    _In_ ULONG ValueType,
+    _In_ PVOID ValueData,
+    _In_ ULONG ValueLength,
+    _In_opt_ PVOID Context,
+    _In_opt_ PVOID EntryContext
+)
+{
+    UNREFERENCED_PARAMETER(ValueName);
+    UNREFERENCED_PARAMETER(Context);
+    
+    PAGED_CODE();
+    
+    if (ValueType == REG_DWORD && ValueLength == sizeof(ULONG) && EntryContext) {
+        *(PULONG)EntryContext = *(PULONG)ValueData;
+    }
+    
+    return STATUS_SUCCESS;
+}
+
 //=============================================================================
 // CCavernMiniportWaveRT Implementation
 //=============================================================================
@@ -48,15 +222,55 @@ NTSTATUS CreateCavernMiniportWaveRT(
 CCavernMiniportWaveRT::CCavernMiniportWaveRT(PUNKNOWN OuterUnknown)
     : CUnknown(OuterUnknown),
       m_pPort(NULL),
-      m_pStream(NULL)
+      m_pExclusiveStream(NULL),
+      m_ulMixStreams(0),
+      m_ulMixRunning(0),
+      m_pMixTimer(NULL),
+      m_MixLayout(CavernLayoutStereo),
+      m_ulMixLayoutSetting(CavernLayoutCount),
+      m_ulLimiterMode(CavernLimiterLinked),
+      m_pMixBlock(NULL),
+      m_pMixBytes(NULL),
+      m_llMixStartQpc(0),
+      m_ullMixedFrames(0),
+      m_ullMixForwardedBytes(0)
 {
     PAGED_CODE();
+    RtlZeroMemory((PVOID)m_pStreams, sizeof(m_pStreams));
+    RtlZeroMemory(&m_MixFormat, sizeof(m_MixFormat));
+    RtlZeroMemory(m_ulChannelDelaysUs, sizeof(m_ulChannelDelaysUs));
+    RtlZeroMemory(&m_EqSettings, sizeof(m_EqSettings));
+    RtlZeroMemory(m_szRoomFilterPath, sizeof(m_szRoomFilterPath));
+    KeInitializeMutex(&m_OutputMutex, 0);
+    KeInitializeSpinLock(&m_MixLock);
+    m_PerfFrequency.QuadPart = 0;
 }
 
 #pragma code_seg("PAGE")
 CCavernMiniportWaveRT::~CCavernMiniportWaveRT()
 {
     PAGED_CODE();
+    
+    if (m_pMixTimer) {
+        ExDeleteTimer(m_pMixTimer, TRUE, TRUE, NULL);
+        m_pMixTimer = NULL;
+    }
+    KeFlushQueuedDpcs();
+    
+    m_Output.Close();
+    m_Output.DeleteRegister();
+    m_Mixer.Cleanup();
+    m_Eq.Cleanup();
+    m_RoomFilter.Cleanup();
+    m_DelayLine.Cleanup();
+    m_Limiter.Cleanup();
+    
+    if (m_pMixBlock) {
+        ExFreePoolWithTag(m_pMixBlock, CAVERN_WAVERT_POOLTAG);
+    }
+    if (m_pMixBytes) {
+        ExFreePoolWithTag(m_pMixBytes, CAVERN_WAVERT_POOLTAG);
+    }
 }
 
 #pragma code_seg("PAGE")
@@ -103,49 +317,434 @@ NTSTATUS CCavernMiniportWaveRT::Init(_In_ PPORTWAVERT Port)
         m_pPort->AddRef();
     }
     
+    m_pMixTimer = ExAllocateTimer(CavernMixTimerNotify, this, EX_TIMER_HIGH_RESOLUTION);
+    if (!m_pMixTimer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    // Largest mix block: CAVERN_MAX_CHANNELS of float or 32-bit samples
+    m_pMixBlock = (float *)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        CAVERN_MIX_BLOCK_FRAMES * CAVERN_MAX_CHANNELS * sizeof(float),
+        CAVERN_WAVERT_POOLTAG
+    );
+    m_pMixBytes = (PBYTE)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        CAVERN_MIX_BLOCK_FRAMES * CAVERN_MAX_FRAME_BYTES,
+        CAVERN_WAVERT_POOLTAG
+    );
+    if (!m_pMixBlock || !m_pMixBytes) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    ReadChannelDelays();
+    ReadChannelEq();
+    ReadRoomFilterPath();
+    ReadLimiterMode();
+    ReadMixLayout();
+    
+    // Without the page the consumer falls back to its own clock
+    m_Output.CreateRegister();
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+//
+// Missing or malformed delays leave every channel undelayed.
+//
+VOID CCavernMiniportWaveRT::ReadChannelDelays()
+{
+    PAGED_CODE();
+    
+    RTL_QUERY_REGISTRY_TABLE paramTable[] = {
+        { CavernQueryChannelDelays, 0, (PWSTR)CAVERN_CHANNEL_DELAYS_VALUE, m_ulChannelDelaysUs, REG_NONE, NULL, 0 },
+        { NULL, 0, NULL, NULL, 0, NULL, 0 }
+    };
+    
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_SERVICES, CAVERN_PARAMETERS_KEY, paramTable, NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: No channel delays in the registry (0x%08X)\n", status));
+        RtlZeroMemory(m_ulChannelDelaysUs, sizeof(m_ulChannelDelaysUs));
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// Without a ChannelEq value the mix is forwarded uncorrected.
+//
+VOID CCavernMiniportWaveRT::ReadChannelEq()
+{
+    PAGED_CODE();
+    
+    RTL_QUERY_REGISTRY_TABLE paramTable[] = {
+        { CavernQueryChannelEq, 0, (PWSTR)CAVERN_CHANNEL_EQ_VALUE, &m_EqSettings, REG_NONE, NULL, 0 },
+        { NULL, 0, NULL, NULL, 0, NULL, 0 }
+    };
+    
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_SERVICES, CAVERN_PARAMETERS_KEY, paramTable, NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: No room EQ in the registry (0x%08X)\n", status));
+        m_EqSettings.Count = 0;
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// Without a RoomFilter value the mix is forwarded unconvolved.
+//
+VOID CCavernMiniportWaveRT::ReadRoomFilterPath()
+{
+    PAGED_CODE();
+    
+    RTL_QUERY_REGISTRY_TABLE paramTable[] = {
+        { CavernQueryRoomFilterPath, 0, (PWSTR)CAVERN_ROOM_FILTER_VALUE, m_szRoomFilterPath, REG_NONE, NULL, 0 },
+        { NULL, 0, NULL, NULL, 0, NULL, 0 }
+    };
+    
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_SERVICES, CAVERN_PARAMETERS_KEY, paramTable, NULL, NULL);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: No room filter in the registry (0x%08X)\n", status));
+        m_szRoomFilterPath[0] = L'\0';
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// Without a LimiterMode value all channels are limited together.
+//
+VOID CCavernMiniportWaveRT::ReadLimiterMode()
+{
+    PAGED_CODE();
+    
+    RTL_QUERY_REGISTRY_TABLE paramTable[] = {
+        { CavernQueryDword, 0, (PWSTR)CAVERN_LIMITER_MODE_VALUE, &m_ulLimiterMode, REG_NONE, NULL, 0 },
+        { NULL, 0, NULL, NULL, 0, NULL, 0 }
+    };
+    
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_SERVICES, CAVERN_PARAMETERS_KEY, paramTable, NULL, NULL);
+    if (!NT_SUCCESS(status) || m_ulLimiterMode > CavernLimiterOff) {
+        m_ulLimiterMode = CavernLimiterLinked;
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// Reads the MixLayout value; anything but a CAVERN_LAYOUT_ID leaves the
+// layout to the first stream of each mix.
+//
+VOID CCavernMiniportWaveRT::ReadMixLayout()
+{
+    PAGED_CODE();
+    
+    RTL_QUERY_REGISTRY_TABLE paramTable[] = {
+        { CavernQueryDword, 0, (PWSTR)CAVERN_MIX_LAYOUT_VALUE, &m_ulMixLayoutSetting, REG_NONE, NULL, 0 },
+        { NULL, 0, NULL, NULL, 0, NULL, 0 }
+    };
+    
+    NTSTATUS status = RtlQueryRegistryValues(RTL_REGISTRY_SERVICES, CAVERN_PARAMETERS_KEY, paramTable, NULL, NULL);
+    if (!NT_SUCCESS(status) || m_ulMixLayoutSetting > CavernLayoutCount) {
+        m_ulMixLayoutSetting = CavernLayoutCount;
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// KSPROPSETID_CavernStream on a render pin instance. MinorTarget is the
+// stream NewStream returned.
+//
+static NTSTATUS CavernPropertyHandlerStream(_In_ PPCPROPERTY_REQUEST PropertyRequest)
+{
+    PAGED_CODE();
+    
+    if (!PropertyRequest->MinorTarget) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    
+    PCCavernMiniportWaveRTStream stream = static_cast<PCCavernMiniportWaveRTStream>(
+        reinterpret_cast<PMINIPORTWAVERTSTREAM>(PropertyRequest->MinorTarget));
+    BOOLEAN isVolume = PropertyRequest->PropertyItem->Id == KSPROPERTY_CAVERN_STREAM_VOLUMELEVEL;
+    
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT) {
+        ULONG fullSize = sizeof(KSPROPERTY_DESCRIPTION);
+        
+        if (isVolume) {
+            fullSize += sizeof(KSPROPERTY_MEMBERSHEADER) + sizeof(KSPROPERTY_STEPPING_LONG);
+        }
+        
+        if (PropertyRequest->ValueSize == 0) {
+            PropertyRequest->ValueSize = fullSize;
+            return STATUS_BUFFER_OVERFLOW;
+        }
+        if (PropertyRequest->ValueSize < sizeof(KSPROPERTY_DESCRIPTION)) {
+            if (PropertyRequest->ValueSize < sizeof(ULONG)) {
+                return STATUS_BUFFER_TOO_SMALL;
+            }
+            *(PULONG)PropertyRequest->Value = KSPROPERTY_TYPE_ALL;
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            return STATUS_SUCCESS;
+        }
+        
+        PKSPROPERTY_DESCRIPTION desc = (PKSPROPERTY_DESCRIPTION)PropertyRequest->Value;
+        desc->AccessFlags = KSPROPERTY_TYPE_ALL;
+        desc->DescriptionSize = fullSize;
+        desc->PropTypeSet.Set = KSPROPTYPESETID_General;
+        desc->PropTypeSet.Id = isVolume ? VT_I4 : VT_BOOL;
+        desc->PropTypeSet.Flags = 0;
+        desc->MembersListCount = isVolume ? 1 : 0;
+        desc->Reserved = 0;
+        
+        // The range follows when the buffer holds it
+        if (!isVolume || PropertyRequest->ValueSize < fullSize) {
+            PropertyRequest->ValueSize = sizeof(KSPROPERTY_DESCRIPTION);
+            return STATUS_SUCCESS;
+        }
+        
+        PKSPROPERTY_MEMBERSHEADER members = (PKSPROPERTY_MEMBERSHEADER)(desc + 1);
+        members->MembersFlags = KSPROPERTY_MEMBER_STEPPEDRANGES;
+        members->MembersSize = sizeof(KSPROPERTY_STEPPING_LONG);
+        members->MembersCount = 1;
+        members->Flags = 0;
+        
+        PKSPROPERTY_STEPPING_LONG range = (PKSPROPERTY_STEPPING_LONG)(members + 1);
+        range->Bounds.SignedMinimum = CAVERN_STREAM_VOLUME_MIN;
+        range->Bounds.SignedMaximum = CAVERN_STREAM_VOLUME_MAX;
+        range->SteppingDelta = CAVERN_STREAM_VOLUME_STEP;
+        range->Reserved = 0;
+        PropertyRequest->ValueSize = fullSize;
+        return STATUS_SUCCESS;
+    }
+    
+    ULONG valueSize = isVolume ? sizeof(LONG) : sizeof(BOOL);
+    
+    if (PropertyRequest->ValueSize < valueSize) {
+        PropertyRequest->ValueSize = valueSize;
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+    
+    LONG volumeLevel = stream->GetVolumeLevel();
+    BOOLEAN mute = stream->IsMuted();
+    
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET) {
+        if (isVolume) {
+            *(PLONG)PropertyRequest->Value = volumeLevel;
+        } else {
+            *(PBOOL)PropertyRequest->Value = mute;
+        }
+    } else if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET) {
+        if (isVolume) {
+            volumeLevel = *(PLONG)PropertyRequest->Value;
+            if (volumeLevel < CAVERN_STREAM_VOLUME_MIN) {
+                volumeLevel = CAVERN_STREAM_VOLUME_MIN;
+            } else if (volumeLevel > CAVERN_STREAM_VOLUME_MAX) {
+                volumeLevel = CAVERN_STREAM_VOLUME_MAX;
+            }
+        } else {
+            mute = *(PBOOL)PropertyRequest->Value ? TRUE : FALSE;
+        }
+        stream->SetGain(volumeLevel, mute);
+    } else {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    
+    PropertyRequest->ValueSize = valueSize;
     return STATUS_SUCCESS;
 }
 
+static PCPROPERTY_ITEM CavernStreamProperties[] = {
+    {
+        &KSPROPSETID_CavernStream,
+        KSPROPERTY_CAVERN_STREAM_VOLUMELEVEL,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        CavernPropertyHandlerStream
+    },
+    {
+        &KSPROPSETID_CavernStream,
+        KSPROPERTY_CAVERN_STREAM_MUTE,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        CavernPropertyHandlerStream
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(CavernAutomationStream, CavernStreamProperties);
+
+#pragma code_seg("PAGE")
+//
+// KSPROPSETID_CavernRoom on the filter. MajorTarget is the miniport. A SET
+// takes effect from the next mix block and is kept for later mixes.
+//
+static NTSTATUS CavernPropertyHandlerRoom(_In_ PPCPROPERTY_REQUEST PropertyRequest)
+{
+    PAGED_CODE();
+    
+    if (!PropertyRequest->MajorTarget) {
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    
+    PCCavernMiniportWaveRT miniport = static_cast<PCCavernMiniportWaveRT>(
+        reinterpret_cast<PMINIPORTWAVERT>(PropertyRequest->MajorTarget));
+    ULONG itemSize;
+    ULONG maxItems;
+    
+    switch (PropertyRequest->PropertyItem->Id) {
+    case KSPROPERTY_CAVERN_ROOM_CHANNEL_DELAYS:
+        itemSize = sizeof(ULONG);
+        maxItems = CAVERN_MAX_CHANNELS;
+        break;
+    case KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ:
+        itemSize = sizeof(CAVERN_EQ_FILTER);
+        maxItems = CAVERN_EQ_MAX_FILTERS;
+        break;
+    default:
+        return STATUS_INVALID_DEVICE_REQUEST;
+    }
+    
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_BASICSUPPORT) {
+        if (PropertyRequest->ValueSize < sizeof(ULONG)) {
+            PropertyRequest->ValueSize = sizeof(ULONG);
+            return STATUS_BUFFER_OVERFLOW;
+        }
+        *(PULONG)PropertyRequest->Value = KSPROPERTY_TYPE_BASICSUPPORT | KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET;
+        PropertyRequest->ValueSize = sizeof(ULONG);
+        return STATUS_SUCCESS;
+    }
+    
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_GET) {
+        ULONG fullSize = itemSize * maxItems;
+        
+        if (PropertyRequest->ValueSize == 0) {
+            PropertyRequest->ValueSize = fullSize;
+            return STATUS_BUFFER_OVERFLOW;
+        }
+        if (PropertyRequest->ValueSize < fullSize) {
+            return STATUS_BUFFER_TOO_SMALL;
+        }
+        
+        // Every channel's delay; only the stored EQ filters
+        if (PropertyRequest->PropertyItem->Id == KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ) {
+            PropertyRequest->ValueSize = itemSize * miniport->GetChannelEq((PCAVERN_EQ_FILTER)PropertyRequest->Value);
+        } else {
+            miniport->GetChannelDelays((PULONG)PropertyRequest->Value);
+            PropertyRequest->ValueSize = fullSize;
+        }
+        return STATUS_SUCCESS;
+    }
+    
+    if (PropertyRequest->Verb & KSPROPERTY_TYPE_SET) {
+        ULONG count = PropertyRequest->ValueSize / itemSize;
+        
+        if (PropertyRequest->ValueSize % itemSize || count > maxItems) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        
+        if (PropertyRequest->PropertyItem->Id == KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ) {
+            miniport->SetChannelEq((const CAVERN_EQ_FILTER *)PropertyRequest->Value, count);
+        } else {
+            miniport->SetChannelDelays((const ULONG *)PropertyRequest->Value, count);
+        }
+        return STATUS_SUCCESS;
+    }
+    
+    return STATUS_INVALID_DEVICE_REQUEST;
+}
+
+static PCPROPERTY_ITEM CavernRoomProperties[] = {
+    {
+        &KSPROPSETID_CavernRoom,
+        KSPROPERTY_CAVERN_ROOM_CHANNEL_DELAYS,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        CavernPropertyHandlerRoom
+    },
+    {
+        &KSPROPSETID_CavernRoom,
+        KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ,
+        KSPROPERTY_TYPE_GET | KSPROPERTY_TYPE_SET | KSPROPERTY_TYPE_BASICSUPPORT,
+        CavernPropertyHandlerRoom
+    }
+};
+
+DEFINE_PCAUTOMATION_TABLE_PROP(CavernAutomationFilter, CavernRoomProperties);
+
 #pragma code_seg("PAGE")
 STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetDescription(_Out_ PPCFILTER_DESCRIPTOR *Description)
 {
-    static KSPIN_DESCRIPTOR_EX PinDescriptor;
-    static KSDATARANGE_AUDIO DataRangeAudio;
-    static PKSDATARANGE DataRanges[1];
+    // IEC 61937 and AC-3 S/PDIF passthrough: 16-bit carriers the frame
+    // aligner cuts into whole bursts. They bypass the mix and own the
+    // output (see CavernForwardModeFromFormat).
+    const struct {
+        GUID SubFormat;
+        ULONG Channels;
+        ULONG MinRate;
+        ULONG MaxRate;
+    } Bitstreams[] = {
+        { KSDATAFORMAT_SUBTYPE_IEC61937_DOLBY_DIGITAL,      2, 32000,  48000  },
+        { KSDATAFORMAT_SUBTYPE_DOLBY_AC3_SPDIF,             2, 32000,  48000  },
+        { KSDATAFORMAT_SUBTYPE_IEC61937_DOLBY_DIGITAL_PLUS, 2, 192000, 192000 },
+        { KSDATAFORMAT_SUBTYPE_IEC61937_DOLBY_MLP,          8, 192000, 192000 },
+        { KSDATAFORMAT_SUBTYPE_IEC61937_DTS,                2, 44100,  48000  },
+        { KSDATAFORMAT_SUBTYPE_IEC61937_DTS_HD,             8, 192000, 192000 }
+    };
+    static KSDATARANGE_AUDIO DataRangeAudio[2 + ARRAYSIZE(Bitstreams)];
+    static PKSDATARANGE DataRanges[ARRAYSIZE(DataRangeAudio)];
     static PCPIN_DESCRIPTOR Pins[1];
     static PCFILTER_DESCRIPTOR FilterDescriptor;
     
     PAGED_CODE();
     
-    RtlZeroMemory(&DataRangeAudio, sizeof(DataRangeAudio));
-    DataRangeAudio.DataRange.FormatSize = sizeof(KSDATARANGE_AUDIO);
-    DataRangeAudio.DataRange.Flags = 0;
-    DataRangeAudio.DataRange.SampleSize = 0;
-    DataRangeAudio.DataRange.Reserved = 0;
-    DataRangeAudio.DataRange.MajorFormat = KSDATAFORMAT_TYPE_AUDIO;
-    DataRangeAudio.DataRange.SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
-    DataRangeAudio.DataRange.Specifier = KSDATAFORMAT_SPECIFIER_WAVEFORMATEX;
-    DataRangeAudio.MaximumChannels = 8;
-    DataRangeAudio.MinimumBitsPerSample = 16;
-    DataRangeAudio.MaximumBitsPerSample = 16;
-    DataRangeAudio.MinimumSampleFrequency = 48000;
-    DataRangeAudio.MaximumSampleFrequency = 48000;
+    // Integer PCM of every width the converters take, and 32-bit float; any
+    // rate the resampler brings to CAVERN_NETWORK_SAMPLE_RATE
+    RtlZeroMemory(DataRangeAudio, sizeof(DataRangeAudio));
+    for (ULONG i = 0; i < ARRAYSIZE(DataRangeAudio); i++) {
+        DataRangeAudio[i].DataRange.FormatSize = sizeof(KSDATARANGE_AUDIO);
+        DataRangeAudio[i].DataRange.Flags = 0;
+        DataRangeAudio[i].DataRange.SampleSize = 0;
+        DataRangeAudio[i].DataRange.Reserved = 0;
+        DataRangeAudio[i].DataRange.MajorFormat = KSDATAFORMAT_TYPE_AUDIO;
+        DataRangeAudio[i].DataRange.Specifier = KSDATAFORMAT_SPECIFIER_WAVEFORMATEX;
+        DataRangeAudio[i].MaximumChannels = CAVERN_MAX_CHANNELS;
+        DataRangeAudio[i].MinimumSampleFrequency = CAVERN_MIN_SAMPLE_RATE;
+        DataRangeAudio[i].MaximumSampleFrequency = CAVERN_MAX_SAMPLE_RATE;
+        DataRanges[i] = (PKSDATARANGE)&DataRangeAudio[i];
+    }
+    
+    DataRangeAudio[0].DataRange.SubFormat = KSDATAFORMAT_SUBTYPE_PCM;
+    DataRangeAudio[0].MinimumBitsPerSample = 8;
+    DataRangeAudio[0].MaximumBitsPerSample = 32;
     
-    DataRanges[0] = (PKSDATARANGE)&DataRangeAudio;
+    DataRangeAudio[1].DataRange.SubFormat = KSDATAFORMAT_SUBTYPE_IEEE_FLOAT;
+    DataRangeAudio[1].MinimumBitsPerSample = 32;
+    DataRangeAudio[1].MaximumBitsPerSample = 32;
     
-    RtlZeroMemory(&PinDescriptor, sizeof(PinDescriptor));
-    PinDescriptor.PinDescriptor.DataRangesCount = 1;
-    PinDescriptor.PinDescriptor.DataRanges = DataRanges;
-    PinDescriptor.PinDescriptor.DataFlow = KSPIN_DATAFLOW_IN;
-    PinDescriptor.PinDescriptor.Communication = KSPIN_COMMUNICATION_SINK;
-    PinDescriptor.PinDescriptor.Category = &KSNODETYPE_SPEAKER;
+    for (ULONG i = 0; i < ARRAYSIZE(Bitstreams); i++) {
+        PKSDATARANGE_AUDIO range = &DataRangeAudio[2 + i];
+        
+        range->DataRange.SubFormat = Bitstreams[i].SubFormat;
+        range->MaximumChannels = Bitstreams[i].Channels;
+        range->MinimumBitsPerSample = 16;
+        range->MaximumBitsPerSample = 16;
+        range->MinimumSampleFrequency = Bitstreams[i].MinRate;
+        range->MaximumSampleFrequency = Bitstreams[i].MaxRate;
+    }
     
-    Pins[0] = (PCPIN_DESCRIPTOR)&PinDescriptor;
+    // One render pin, opened once per concurrent stream; PCM instances are
+    // mixed in the driver
+    RtlZeroMemory(Pins, sizeof(Pins));
+    Pins[0].MaxGlobalInstanceCount = CAVERN_MIXER_MAX_STREAMS;
+    Pins[0].MaxFilterInstanceCount = CAVERN_MIXER_MAX_STREAMS;
+    Pins[0].MinFilterInstanceCount = 0;
+    Pins[0].KsPinDescriptor.DataRangesCount = ARRAYSIZE(DataRanges);
+    Pins[0].KsPinDescriptor.DataRanges = DataRanges;
+    Pins[0].KsPinDescriptor.DataFlow = KSPIN_DATAFLOW_IN;
+    Pins[0].KsPinDescriptor.Communication = KSPIN_COMMUNICATION_SINK;
+    Pins[0].KsPinDescriptor.Category = &KSNODETYPE_SPEAKER;
+    Pins[0].AutomationTable = &CavernAutomationStream;
     
     RtlZeroMemory(&FilterDescriptor, sizeof(FilterDescriptor));
     FilterDescriptor.Version = 1;
+    FilterDescriptor.PinSize = sizeof(PCPIN_DESCRIPTOR);
     FilterDescriptor.PinCount = 1;
     FilterDescriptor.Pins = Pins;
+    FilterDescriptor.AutomationTable = &CavernAutomationFilter;
     
     *Description = &FilterDescriptor;
     
@@ -154,7 +753,7 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetDescription(_Out_ PPCFILTER_DE
 
 #pragma code_seg("PAGE")
 STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::NewStream(
-    _Out_ PMiniportWaveRTStream *Stream,
+    _Out_ PMINIPORTWAVERTSTREAM *Stream,
     _In_ PPORTWAVERTSTREAM PortStream,
     _In_ ULONG Pin,
     _In_ BOOLEAN Capture,
@@ -171,10 +770,6 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::NewStream(
         return STATUS_NOT_SUPPORTED;
     }
     
-    if (m_pStream) {
-        return STATUS_DEVICE_BUSY;
-    }
-    
     CCavernMiniportWaveRTStream *pStream = new (NonPagedPoolNx, CAVERN_WAVERT_POOLTAG)
         CCavernMiniportWaveRTStream(NULL);
     
@@ -187,8 +782,11 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::NewStream(
     ntStatus = pStream->Init(this, PortStream, Pin, Capture, DataFormat);
     
     if (NT_SUCCESS(ntStatus)) {
-        *Stream = (PMiniportWaveRTStream)pStream;
-        m_pStream = pStream;
+        ntStatus = StreamCreated(pStream);
+    }
+    
+    if (NT_SUCCESS(ntStatus)) {
+        *Stream = (IMiniportWaveRTStream *)pStream;
     } else {
         pStream->Release();
     }
@@ -196,6 +794,7 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::NewStream(
     return ntStatus;
 }
 
+#pragma code_seg()
 STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetDeviceDescription(_Out_ PDEVICE_DESCRIPTION Description)
 {
     UNREFERENCED_PARAMETER(Description);
@@ -264,17 +863,30 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::SetOffloadPinStream(
 
 STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetStreamCount(_Out_ PULONG StreamCount)
 {
-    *StreamCount = (m_pStream != NULL) ? 1 : 0;
+    ULONG count = 0;
+    
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        if (m_pStreams[i]) {
+            count++;
+        }
+    }
+    
+    *StreamCount = count;
     return STATUS_SUCCESS;
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetStream(_In_ ULONG StreamIndex, _Out_ PMiniportWaveRTStream *Stream)
+//
+// StreamIndex counts the open streams, in table order.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::GetStream(_In_ ULONG StreamIndex, _Out_ PMINIPORTWAVERTSTREAM *Stream)
 {
-    UNREFERENCED_PARAMETER(StreamIndex);
-    
-    if (m_pStream) {
-        *Stream = (PMiniportWaveRTStream)m_pStream;
-        return STATUS_SUCCESS;
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        PCCavernMiniportWaveRTStream stream = m_pStreams[i];
+        
+        if (stream && StreamIndex-- == 0) {
+            *Stream = (IMiniportWaveRTStream *)stream;
+            return STATUS_SUCCESS;
+        }
     }
     return STATUS_NOT_FOUND;
 }
@@ -292,243 +904,2199 @@ STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRT::ValidateFormat(_In_ PKSDATAFORMAT
     return STATUS_SUCCESS;
 }
 
+//
+// Admits a new stream. PCM streams share the device through the mix; a
+// bitstream needs the output to itself, so it is only admitted alone and
+// keeps everyone else out until it closes.
+//
 NTSTATUS CCavernMiniportWaveRT::StreamCreated(_In_ PCCavernMiniportWaveRTStream Stream)
 {
-    m_pStream = Stream;
-    return STATUS_SUCCESS;
+    NTSTATUS status = STATUS_DEVICE_BUSY;
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    ULONG count = 0;
+    GetStreamCount(&count);
+    
+    if (!m_pExclusiveStream && (Stream->IsMixed() || !count)) {
+        for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+            if (!InterlockedCompareExchangePointer((PVOID volatile *)&m_pStreams[i], Stream, NULL)) {
+                if (!Stream->IsMixed()) {
+                    m_pExclusiveStream = Stream;
+                }
+                status = STATUS_SUCCESS;
+                break;
+            }
+        }
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+    
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Stream refused, %u open%s\n", count,
+            m_pExclusiveStream ? " (bitstream)" : ""));
+    }
+    
+    return status;
 }
 
 NTSTATUS CCavernMiniportWaveRT::StreamClosed(_In_ PCCavernMiniportWaveRTStream Stream)
 {
-    UNREFERENCED_PARAMETER(Stream);
-    m_pStream = NULL;
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        InterlockedCompareExchangePointer((PVOID volatile *)&m_pStreams[i], NULL, Stream);
+    }
+    InterlockedCompareExchangePointer((PVOID volatile *)&m_pExclusiveStream, NULL, Stream);
+    
     return STATUS_SUCCESS;
 }
 
-//=============================================================================
-// CCavernMiniportWaveRTStream Implementation
-//=============================================================================
+NTSTATUS CCavernMiniportWaveRT::OpenExclusiveOutput(_In_ PCCavernMiniportWaveRTStream Stream)
+{
+    NTSTATUS status = STATUS_DEVICE_BUSY;
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    if (m_pExclusiveStream == Stream && !m_Output.IsOpen()) {
+        status = m_Output.Open(Stream->GetFormat());
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+    return status;
+}
 
-#pragma code_seg("PAGE")
-CCavernMiniportWaveRTStream::CCavernMiniportWaveRTStream(PUNKNOWN OuterUnknown)
-    : CUnknown(OuterUnknown),
-      m_pMiniport(NULL),
-      m_pPortStream(NULL),
-      m_State(KSSTATE_STOP),
-      m_Running(FALSE),
-      m_pDmaBuffer(NULL),
-      m_ulDmaBufferSize(0),
-      m_ullLinearPosition(0),
-      m_pWfExt(NULL),
-      m_hPipe(NULL),
-      m_PipeConnected(FALSE)
+VOID CCavernMiniportWaveRT::CloseExclusiveOutput(_In_ PCCavernMiniportWaveRTStream Stream)
 {
-    PAGED_CODE();
-    KeInitializeSpinLock(&m_PipeLock);
-    RtlInitUnicodeString(&m_PipeName, CAVERN_PIPE_NAME);
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    if (m_pExclusiveStream == Stream) {
+        m_Output.Close();
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
 }
 
 #pragma code_seg("PAGE")
-CCavernMiniportWaveRTStream::~CCavernMiniportWaveRTStream()
+//
+// The first PCM stream sets the mix format: its sample format, at the rate
+// it reaches the mix (CAVERN_NETWORK_SAMPLE_RATE when converted), on the
+// MixLayout speakers or else the smallest standard layout that carries
+// all of its own. Later streams may differ in channels and sample format
+// but not in rate; each routes its channels to the mix speakers.
+//
+NTSTATUS CCavernMiniportWaveRT::JoinMix(_In_ PCCavernMiniportWaveRTStream Stream, _Out_ PLONG Slot)
 {
     PAGED_CODE();
     
-    DisconnectPipe();
+    NTSTATUS status = STATUS_SUCCESS;
+    PWAVEFORMATEXTENSIBLE format = Stream->GetFormat();
+    ULONG rate = Stream->GetOutputRate();
     
-    if (m_pMiniport) {
-        m_pMiniport->StreamClosed(this);
-        m_pMiniport->Release();
-    }
+    *Slot = -1;
     
-    if (m_pPortStream) {
-        m_pPortStream->Release();
-    }
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
     
-    if (m_pWfExt) {
+    if (format->Format.nBlockAlign > CAVERN_MAX_FRAME_BYTES) {
+        status = STATUS_NOT_SUPPORTED;
+    } else if (!m_ulMixStreams) {
+        CAVERN_CHANNEL_LAYOUT speakers;
+        CAVERN_SAMPLE_FORMAT sampleFormat = CavernSampleFormatFromFormat(format);
+        BOOLEAN extensible = format->Format.wFormatTag == WAVE_FORMAT_EXTENSIBLE &&
+            format->Format.cbSize >= sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+        
+        m_MixLayout = (m_ulMixLayoutSetting < CavernLayoutCount) ?
+            (CAVERN_LAYOUT_ID)m_ulMixLayoutSetting :
+            CavernCoveringLayout(CavernChannelMaskFromFormat(format));
+        CavernGetStandardLayout(m_MixLayout, &speakers);
+        
+        RtlZeroMemory(&m_MixFormat, sizeof(m_MixFormat));
+        m_MixFormat.Format.wFormatTag = WAVE_FORMAT_EXTENSIBLE;
+        m_MixFormat.Format.nChannels = (WORD)speakers.Channels;
+        m_MixFormat.Format.nSamplesPerSec = rate;
+        m_MixFormat.Format.wBitsPerSample = format->Format.wBitsPerSample;
+        m_MixFormat.Format.nBlockAlign = (WORD)(speakers.Channels * format->Format.wBitsPerSample / 8);
+        m_MixFormat.Format.nAvgBytesPerSec = rate * m_MixFormat.Format.nBlockAlign;
+        m_MixFormat.Format.cbSize = sizeof(WAVEFORMATEXTENSIBLE) - sizeof(WAVEFORMATEX);
+        m_MixFormat.Samples.wValidBitsPerSample = extensible ?
+            format->Samples.wValidBitsPerSample : format->Format.wBitsPerSample;
+        m_MixFormat.dwChannelMask = CavernLayoutMask(m_MixLayout);
+        m_MixFormat.SubFormat = (sampleFormat == CavernSampleF32) ?
+            KSDATAFORMAT_SUBTYPE_IEEE_FLOAT : KSDATAFORMAT_SUBTYPE_PCM;
+        
+        KFLOATING_SAVE saveData;
+        status = KeSaveFloatingPointState(&saveData);
+        if (NT_SUCCESS(status)) {
+            status = m_MixRequantizer.Init(
+                CavernSampleFormatFromFormat(&m_MixFormat),
+                m_MixFormat.Format.nChannels,
+                CAVERN_DEFAULT_DITHER,
+                TRUE
+            );
+            KeRestoreFloatingPointState(&saveData);
+        }
+        
+        if (NT_SUCCESS(status)) {
+            status = m_Mixer.Init(m_MixFormat.Format.nChannels, rate, TRUE);
+        }
+        if (NT_SUCCESS(status)) {
+            // Without it the mix is forwarded uncorrected
+            NTSTATUS eqStatus = m_Eq.Init(m_MixFormat.Format.nChannels, TRUE);
+            if (NT_SUCCESS(eqStatus)) {
+                ApplyChannelEq();
+            } else {
+                KdPrint(("CavernAudio: No room EQ (0x%08X)\n", eqStatus));
+            }
+            
+            // Without it the mix is forwarded unconvolved
+            LoadRoomFilter();
+            
+            // Without it the mix is forwarded undelayed
+            NTSTATUS delayStatus = m_DelayLine.Init(m_MixFormat.Format.nChannels, rate, CAVERN_DELAY_MAX_MS, TRUE);
+            if (NT_SUCCESS(delayStatus)) {
+                ApplyChannelDelays();
+            } else {
+                KdPrint(("CavernAudio: No speaker delays (0x%08X)\n", delayStatus));
+            }
+            
+            // Without it the integer converters clip
+            if (m_ulLimiterMode != CavernLimiterOff) {
+                NTSTATUS limiterStatus = KeSaveFloatingPointState(&saveData);
+                if (NT_SUCCESS(limiterStatus)) {
+                    limiterStatus = m_Limiter.Init(
+                        m_MixFormat.Format.nChannels,
+                        rate,
+                        CAVERN_OUTPUT_LIMITER_LOOKAHEAD_US,
+                        CAVERN_OUTPUT_LIMITER_RELEASE_MS,
+                        CAVERN_OUTPUT_LIMITER_CEILING_CENTIDB,
+                        m_ulLimiterMode == CavernLimiterLinked,
+                        TRUE
+                    );
+                    KeRestoreFloatingPointState(&saveData);
+                }
+                if (!NT_SUCCESS(limiterStatus)) {
+                    KdPrint(("CavernAudio: No output limiter (0x%08X)\n", limiterStatus));
+                }
+            }
+        }
+        if (NT_SUCCESS(status)) {
+            m_ullMixForwardedBytes = 0;
+            status = m_Output.Open(&m_MixFormat);
+        }
+        if (NT_SUCCESS(status)) {
+            KdPrint(("CavernAudio: Mix opened, %u ch at %u Hz\n", m_MixFormat.Format.nChannels, rate));
+        }
+    } else if (rate != m_Mixer.GetSampleRate()) {
+        KdPrint(("CavernAudio: Stream at %u Hz cannot join the %u Hz mix\n", rate, m_Mixer.GetSampleRate()));
+        status = STATUS_NOT_SUPPORTED;
+    }
+    
+    if (NT_SUCCESS(status)) {
+        *Slot = m_Mixer.Open(Stream->GetVolumeLevel(), Stream->IsMuted());
+        if (*Slot < 0) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        } else {
+            m_ulMixStreams++;
+        }
+    }
+    
+    if (!NT_SUCCESS(status) && !m_ulMixStreams) {
+        m_Output.Close();
+        m_Mixer.Cleanup();
+        m_Eq.Cleanup();
+        m_RoomFilter.Cleanup();
+        m_DelayLine.Cleanup();
+        m_Limiter.Cleanup();
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+    return status;
+}
+
+//
+// The slot goes back to the mixer; the others keep playing. After the
+// last stream the output is flushed and closed.
+//
+VOID CCavernMiniportWaveRT::LeaveMix(_Inout_ PLONG Slot)
+{
+    CAVERN_MIXER_STATS stats;
+    
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    if (m_Mixer.GetStats(*Slot, &stats)) {
+        KdPrint(("CavernAudio: Mix slot %d closed, %I64u frames mixed, %u underruns, %I64u dropped\n",
+            *Slot, stats.MixedFrames, stats.Underruns, stats.DroppedFrames));
+    }
+    
+    // Cleared under the mutex so UpdateMixGain never reaches a slot that
+    // may already belong to another stream
+    m_Mixer.Close(*Slot);
+    *Slot = -1;
+    
+    if (m_ulMixStreams && !--m_ulMixStreams) {
+        m_Output.Close();
+        m_Mixer.Cleanup();
+        m_Eq.Cleanup();
+        m_RoomFilter.Cleanup();
+        m_DelayLine.Cleanup();
+        if (m_Limiter.IsInitialized()) {
+            KdPrint(("CavernAudio: Output limiter turned down %I64u frames\n", m_Limiter.GetLimitedFrames()));
+        }
+        m_Limiter.Cleanup();
+        KdPrint(("CavernAudio: Mix closed\n"));
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+#pragma code_seg("PAGE")
+//
+// The stream's slot, if it has joined the mix, takes its current gain;
+// otherwise JoinMix opens the slot at it later.
+//
+VOID CCavernMiniportWaveRT::UpdateMixGain(_In_ PCCavernMiniportWaveRTStream Stream)
+{
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    LONG slot = Stream->GetMixSlot();
+    if (slot >= 0) {
+        m_Mixer.SetGain(slot, Stream->GetVolumeLevel(), Stream->IsMuted());
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+#pragma code_seg()
+//
+// The mix timer runs while any PCM stream is running. Its clock starts
+// from zero each time it starts, like a stream's DMA position. StartMix
+// takes m_MixLock, so neither it nor StopMix is paged.
+//
+VOID CCavernMiniportWaveRT::StartMix()
+{
+    KIRQL oldIrql;
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    if (!m_ulMixRunning++) {
+        LARGE_INTEGER qpc = KeQueryPerformanceCounter(&m_PerfFrequency);
+        
+        m_Output.ConnectPipe();
+        m_Output.ArmFirstByte(qpc.QuadPart, m_PerfFrequency.QuadPart);
+        
+        KeAcquireSpinLock(&m_MixLock, &oldIrql);
+        m_llMixStartQpc = qpc.QuadPart;
+        m_ullMixedFrames = 0;
+        KeReleaseSpinLock(&m_MixLock, oldIrql);
+        
+        ExSetTimer(m_pMixTimer, -CAVERN_TIMER_PERIOD_HNS, CAVERN_TIMER_PERIOD_HNS, NULL);
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+VOID CCavernMiniportWaveRT::StopMix()
+{
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    if (m_ulMixRunning && !--m_ulMixRunning) {
+        ExCancelTimer(m_pMixTimer, NULL);
+        KeFlushQueuedDpcs();
+    }
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+//
+// Sums the frames due since the mix started, one block at a time, and
+// forwards them through the output. Caller holds m_MixLock.
+//
+VOID CCavernMiniportWaveRT::MixOutput(_In_ LARGE_INTEGER Qpc)
+{
+    ULONG rate = m_Mixer.GetSampleRate();
+    ULONG frameSize = m_MixFormat.Format.nBlockAlign;
+    
+    if (!rate || !m_PerfFrequency.QuadPart || !m_Output.IsOpen()) {
+        return;
+    }
+    
+    ULONGLONG due = (ULONGLONG)(Qpc.QuadPart - m_llMixStartQpc) * rate / (ULONGLONG)m_PerfFrequency.QuadPart;
+    if (due <= m_ullMixedFrames) {
+        return;
+    }
+    
+    ULONGLONG frames = due - m_ullMixedFrames;
+    ULONGLONG catchUp = (ULONGLONG)rate * CAVERN_MIX_MAX_CATCHUP_MS / 1000;
+    if (frames > catchUp) {
+        KdPrint(("CavernAudio: Mix timer late, skipping %I64u frames\n", frames - catchUp));
+        m_ullMixedFrames += frames - catchUp;
+        frames = catchUp;
+    }
+    
+    KFLOATING_SAVE saveData;
+    if (!NT_SUCCESS(KeSaveFloatingPointState(&saveData))) {
+        return;
+    }
+    
+    while (frames) {
+        SIZE_T block = (SIZE_T)min(frames, (ULONGLONG)CAVERN_MIX_BLOCK_FRAMES);
+        
+        m_Mixer.Mix(m_pMixBlock, block);
+        m_Eq.Process(m_pMixBlock, block);
+        m_RoomFilter.Process(m_pMixBlock, block);
+        m_DelayLine.Process(m_pMixBlock, block);
+        m_Limiter.Process(m_pMixBlock, block);
+        m_MixRequantizer.Process(m_pMixBlock, m_pMixBytes, block);
+        m_Output.Push(m_pMixBytes, (ULONG)(block * frameSize));
+        
+        m_ullMixedFrames += block;
+        m_ullMixForwardedBytes += block * frameSize;
+        frames -= block;
+    }
+    
+    KeRestoreFloatingPointState(&saveData);
+    
+    m_Output.PublishPosition(m_ullMixForwardedBytes, Qpc.QuadPart, 0);
+}
+
+#pragma code_seg("PAGE")
+VOID CCavernMiniportWaveRT::SetChannelDelays(_In_reads_(Count) const ULONG *Microseconds, _In_ ULONG Count)
+{
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+        m_ulChannelDelaysUs[c] = (c < Count) ? Microseconds[c] : 0;
+    }
+    ApplyChannelDelays();
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+#pragma code_seg("PAGE")
+VOID CCavernMiniportWaveRT::GetChannelDelays(_Out_writes_(CAVERN_MAX_CHANNELS) PULONG Microseconds)
+{
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    RtlCopyMemory(Microseconds, m_ulChannelDelaysUs, sizeof(m_ulChannelDelaysUs));
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+#pragma code_seg("PAGE")
+//
+// Hands the stored delays to the delay line at the mix rate. Only the
+// differences between speakers matter, so when a fractional delay is too
+// short for a centred interpolation window every channel gets
+// CAVERN_DELAY_CENTER_FRAMES more. Caller holds m_OutputMutex, which
+// serializes SetDelays.
+//
+VOID CCavernMiniportWaveRT::ApplyChannelDelays()
+{
+    PAGED_CODE();
+    
+    ULONG delays[CAVERN_MAX_CHANNELS];
+    ULONG rate = m_Mixer.GetSampleRate();
+    
+    if (!m_DelayLine.IsInitialized() || !rate) {
+        return;
+    }
+    
+    const ULONG center = CAVERN_DELAY_CENTER_FRAMES << CAVERN_DELAY_FRACTION_BITS;
+    const ULONG fraction = (1UL << CAVERN_DELAY_FRACTION_BITS) - 1;
+    ULONG offset = 0;
+    
+    for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+        delays[c] = CavernDelayFromMicroseconds(min(m_ulChannelDelaysUs[c], (ULONG)CAVERN_DELAY_MAX_MS * 1000), rate);
+        if ((delays[c] & fraction) && delays[c] < center) {
+            offset = center;
+        }
+        if (m_ulChannelDelaysUs[c]) {
+            KdPrint(("CavernAudio: Channel %u delayed %u us\n", c, m_ulChannelDelaysUs[c]));
+        }
+    }
+    
+    if (offset) {
+        for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+            delays[c] += offset;
+        }
+    }
+    
+    m_DelayLine.SetDelays(delays, CAVERN_MAX_CHANNELS);
+}
+
+#pragma code_seg("PAGE")
+VOID CCavernMiniportWaveRT::SetChannelEq(_In_reads_(Count) const CAVERN_EQ_FILTER *Filters, _In_ ULONG Count)
+{
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    m_EqSettings.Count = min(Count, (ULONG)CAVERN_EQ_MAX_FILTERS);
+    RtlCopyMemory(m_EqSettings.Filters, Filters, m_EqSettings.Count * sizeof(CAVERN_EQ_FILTER));
+    ApplyChannelEq();
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+}
+
+#pragma code_seg("PAGE")
+ULONG CCavernMiniportWaveRT::GetChannelEq(_Out_writes_(CAVERN_EQ_MAX_FILTERS) PCAVERN_EQ_FILTER Filters)
+{
+    PAGED_CODE();
+    
+    KeWaitForSingleObject(&m_OutputMutex, Executive, KernelMode, FALSE, NULL);
+    
+    ULONG count = m_EqSettings.Count;
+    RtlCopyMemory(Filters, m_EqSettings.Filters, count * sizeof(CAVERN_EQ_FILTER));
+    
+    KeReleaseMutex(&m_OutputMutex, FALSE);
+    
+    return count;
+}
+
+#pragma code_seg("PAGE")
+//
+// Designs the stored filters for the mix rate and publishes them as one
+// set. Filters the rate cannot take (at or above Nyquist) and bands past
+// CAVERN_BIQUAD_MAX_BANDS on a channel are left out. Caller holds
+// m_OutputMutex, which serializes the updates.
+//
+VOID CCavernMiniportWaveRT::ApplyChannelEq()
+{
+    PAGED_CODE();
+    
+    ULONG bands[CAVERN_MAX_CHANNELS] = { 0 };
+    ULONG rate = m_Mixer.GetSampleRate();
+    ULONG channels = m_Eq.GetChannels();
+    
+    if (!m_Eq.IsInitialized() || !rate) {
+        return;
+    }
+    
+    KFLOATING_SAVE saveData;
+    NTSTATUS status = KeSaveFloatingPointState(&saveData);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Room EQ not applied (0x%08X)\n", status));
+        return;
+    }
+    
+    m_Eq.BeginUpdate();
+    m_Eq.ClearBands();
+    
+    for (ULONG i = 0; i < m_EqSettings.Count; i++) {
+        const CAVERN_EQ_FILTER *filter = &m_EqSettings.Filters[i];
+        CAVERN_BIQUAD_COEFFICIENTS coefficients;
+        
+        status = CavernBiquadDesign(
+            (CAVERN_BIQUAD_TYPE)filter->Type,
+            (double)filter->FrequencyHz,
+            filter->QMilli / 1000.0,
+            filter->GainCentiDb / 100.0,
+            rate,
+            &coefficients
+        );
+        if (!NT_SUCCESS(status)) {
+            KdPrint(("CavernAudio: Room EQ filter %u (type %u, %u Hz) skipped at %u Hz\n",
+                i, filter->Type, filter->FrequencyHz, rate));
+            continue;
+        }
+        
+        for (ULONG c = 0; c < channels; c++) {
+            if (!(filter->ChannelMask & (1UL << c))) {
+                continue;
+            }
+            if (bands[c] < CAVERN_BIQUAD_MAX_BANDS) {
+                m_Eq.SetBand(c, bands[c]++, &coefficients);
+            } else {
+                KdPrint(("CavernAudio: Room EQ filter %u dropped on channel %u, all bands in use\n", i, c));
+            }
+        }
+    }
+    
+    m_Eq.CommitUpdate();
+    KeRestoreFloatingPointState(&saveData);
+    
+    if (m_EqSettings.Count) {
+        KdPrint(("CavernAudio: Room EQ, %u filters at %u Hz\n", m_EqSettings.Count, rate));
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// Reads the RoomFilter file for the mix format and loads it into the
+// convolver, with a block of at most CAVERN_ROOM_FILTER_PERIOD_MS. A file
+// that is missing, unreadable or shorter than one frame leaves the mix
+// unconvolved; one longer than CAVERN_CONVOLVER_MAX_TAPS frames is cut.
+// Called from JoinMix before the mix timer runs.
+//
+VOID CCavernMiniportWaveRT::LoadRoomFilter()
+{
+    PAGED_CODE();
+    
+    ULONG channels = m_MixFormat.Format.nChannels;
+    ULONG rate = m_Mixer.GetSampleRate();
+    ULONG frameBytes = channels * sizeof(float);
+    
+    m_RoomFilter.Cleanup();
+    if (!m_szRoomFilterPath[0] || !channels || !rate) {
+        return;
+    }
+    
+    UNICODE_STRING path;
+    OBJECT_ATTRIBUTES objAttr;
+    IO_STATUS_BLOCK ioStatus;
+    HANDLE file = NULL;
+    
+    RtlInitUnicodeString(&path, m_szRoomFilterPath);
+    InitializeObjectAttributes(&objAttr, &path, OBJ_CASE_INSENSITIVE | OBJ_KERNEL_HANDLE, NULL, NULL);
+    
+    NTSTATUS status = ZwCreateFile(
+        &file,
+        GENERIC_READ | SYNCHRONIZE,
+        &objAttr,
+        &ioStatus,
+        NULL,
+        FILE_ATTRIBUTE_NORMAL,
+        FILE_SHARE_READ,
+        FILE_OPEN,
+        FILE_NON_DIRECTORY_FILE | FILE_SYNCHRONOUS_IO_NONALERT,
+        NULL,
+        0
+    );
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Room filter %wZ not opened (0x%08X)\n", &path, status));
+        return;
+    }
+    
+    FILE_STANDARD_INFORMATION info;
+    ULONGLONG taps = 0;
+    float *buffer = NULL;
+    
+    status = ZwQueryInformationFile(file, &ioStatus, &info, sizeof(info), FileStandardInformation);
+    if (NT_SUCCESS(status)) {
+        taps = (ULONGLONG)info.EndOfFile.QuadPart / frameBytes;
+        if (taps > CAVERN_CONVOLVER_MAX_TAPS) {
+            KdPrint(("CavernAudio: Room filter cut from %I64u to %u taps\n", taps, CAVERN_CONVOLVER_MAX_TAPS));
+            taps = CAVERN_CONVOLVER_MAX_TAPS;
+        }
+        if (!taps) {
+            status = STATUS_INVALID_PARAMETER;
+        }
+    }
+    if (NT_SUCCESS(status)) {
+        buffer = (float *)ExAllocatePool2(POOL_FLAG_PAGED, (SIZE_T)taps * frameBytes, CAVERN_WAVERT_POOLTAG);
+        if (!buffer) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    if (NT_SUCCESS(status)) {
+        LARGE_INTEGER offset;
+        offset.QuadPart = 0;
+        status = ZwReadFile(file, NULL, NULL, NULL, &ioStatus, buffer, (ULONG)taps * frameBytes, &offset, NULL);
+        if (NT_SUCCESS(status) && ioStatus.Information != (ULONG_PTR)taps * frameBytes) {
+            status = STATUS_END_OF_FILE;
+        }
+    }
+    ZwClose(file);
+    
+    if (NT_SUCCESS(status)) {
+        KFLOATING_SAVE saveData;
+        status = KeSaveFloatingPointState(&saveData);
+        if (NT_SUCCESS(status)) {
+            ULONG block = CavernConvolverBlockFrames(rate, CAVERN_ROOM_FILTER_PERIOD_MS);
+            
+            status = m_RoomFilter.Init(channels, block, (ULONG)taps, TRUE);
+            if (NT_SUCCESS(status)) {
+                status = m_RoomFilter.SetFilters(buffer, (ULONG)taps);
+            }
+            KeRestoreFloatingPointState(&saveData);
+        }
+    }
+    
+    if (buffer) {
+        ExFreePoolWithTag(buffer, CAVERN_WAVERT_POOLTAG);
+    }
+    
+    if (NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Room filter, %u taps per channel in %u partitions of %u frames\n",
+            (ULONG)taps, m_RoomFilter.GetPartitions(), m_RoomFilter.GetBlockFrames()));
+    } else {
+        KdPrint(("CavernAudio: Room filter %wZ not loaded (0x%08X)\n", &path, status));
+        m_RoomFilter.Cleanup();
+    }
+}
+
+//=============================================================================
+// CCavernMiniportWaveRTStream Implementation
+//=============================================================================
+
+#pragma code_seg("PAGE")
+CCavernMiniportWaveRTStream::CCavernMiniportWaveRTStream(PUNKNOWN OuterUnknown)
+    : CUnknown(OuterUnknown),
+      m_pMiniport(NULL),
+      m_pPortStream(NULL),
+      m_State(KSSTATE_STOP),
+      m_Running(FALSE),
+      m_pDmaBuffer(NULL),
+      m_pDmaMdl(NULL),
+      m_ulDmaBufferSize(0),
+      m_ullLinearPosition(0),
+      m_pWfExt(NULL),
+      m_bMixed(FALSE),
+      m_bOutputAcquired(FALSE),
+      m_bMixStarted(FALSE),
+      m_pTimer(NULL),
+      m_bTimerRunning(FALSE),
+      m_ulDmaMovementRate(0),
+      m_hnsDmaTimeStamp(0),
+      m_hnsElapsedTimeCarryForward(0),
+      m_ulByteDisplacementCarryForward(0),
+      m_lMixSlot(-1),
+      m_lVolumeLevel(0),
+      m_bMute(FALSE),
+      m_pMixBuffer(NULL),
+      m_pRouteBuffer(NULL),
+      m_ulFrameCarryBytes(0),
+      m_ulNotificationsPerBuffer(0),
+      m_pRegisters(NULL)
+{
+    PAGED_CODE();
+    KeInitializeSpinLock(&m_PositionLock);
+    InitializeListHead(&m_NotificationList);
+    RtlZeroMemory(&m_Converter, sizeof(m_Converter));
+    m_PerfFrequency.QuadPart = 0;
+    m_Packets.PacketSize = 0;
+    CavernPacketReset(&m_Packets);
+}
+
+#pragma code_seg("PAGE")
+CCavernMiniportWaveRTStream::~CCavernMiniportWaveRTStream()
+{
+    PAGED_CODE();
+    
+    if (m_pTimer) {
+        ExDeleteTimer(m_pTimer, TRUE, TRUE, NULL);
+        m_pTimer = NULL;
+    }
+    KeFlushQueuedDpcs();
+    
+    ReleaseOutput();
+    
+    if (m_pMiniport) {
+        m_pMiniport->StreamClosed(this);
+        m_pMiniport->Release();
+    }
+    
+    if (m_pPortStream) {
+        m_pPortStream->Release();
+    }
+    
+    if (m_pWfExt) {
         ExFreePoolWithTag(m_pWfExt, CAVERN_WAVERT_POOLTAG);
     }
+    
+    if (m_pRegisters) {
+        ExFreePoolWithTag(m_pRegisters, CAVERN_POSITION_REGISTER_POOLTAG);
+    }
+    
+    while (!IsListEmpty(&m_NotificationList)) {
+        PLIST_ENTRY entry = RemoveHeadList(&m_NotificationList);
+        ExFreePoolWithTag(CONTAINING_RECORD(entry, CAVERN_NOTIFICATION_ENTRY, ListEntry), CAVERN_WAVERT_POOLTAG);
+    }
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(ULONG) CCavernMiniportWaveRTStream::AddRef()
+{
+    return CUnknown::AddRef();
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(ULONG) CCavernMiniportWaveRTStream::Release()
+{
+    return CUnknown::Release();
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP CCavernMiniportWaveRTStream::QueryInterface(REFIID InterfaceId, PVOID *Object)
+{
+    PAGED_CODE();
+    
+    if (IsEqualGUID(InterfaceId, IID_IUnknown)) {
+        *Object = (PUNKNOWN)(IMiniportWaveRTStream *)this;
+        AddRef();
+        return STATUS_SUCCESS;
+    }
+    else if (IsEqualGUID(InterfaceId, IID_IMiniportWaveRTStream)) {
+        *Object = (IMiniportWaveRTStream *)this;
+        AddRef();
+        return STATUS_SUCCESS;
+    }
+    else if (IsEqualGUID(InterfaceId, IID_IMiniportWaveRTStreamNotification)) {
+        *Object = (IMiniportWaveRTStreamNotification *)this;
+        AddRef();
+        return STATUS_SUCCESS;
+    }
+    else if (IsEqualGUID(InterfaceId, IID_IMiniportWaveRTOutputStream)) {
+        *Object = (IMiniportWaveRTOutputStream *)this;
+        AddRef();
+        return STATUS_SUCCESS;
+    }
+    
+    *Object = NULL;
+    return STATUS_NOINTERFACE;
+}
+
+#pragma code_seg("PAGE")
+NTSTATUS CCavernMiniportWaveRTStream::Init(
+    _In_ PCCavernMiniportWaveRT Miniport,
+    _In_ PPORTWAVERTSTREAM PortStream,
+    _In_ ULONG Pin,
+    _In_ BOOLEAN Capture,
+    _In_ PKSDATAFORMAT DataFormat
+)
+{
+    UNREFERENCED_PARAMETER(Pin);
+    UNREFERENCED_PARAMETER(Capture);
+    
+    PAGED_CODE();
+    
+    ASSERT(Miniport);
+    ASSERT(PortStream);
+    ASSERT(DataFormat);
+    
+    m_pMiniport = Miniport;
+    m_pMiniport->AddRef();
+    
+    m_pPortStream = PortStream;
+    m_pPortStream->AddRef();
+    
+    if (DataFormat->FormatSize >= sizeof(KSDATAFORMAT_WAVEFORMATEX)) {
+        PWAVEFORMATEX pWfEx = &((PKSDATAFORMAT_WAVEFORMATEX)DataFormat)->WaveFormatEx;
+        ULONG cbWfEx = sizeof(WAVEFORMATEX) + pWfEx->cbSize;
+        
+        if (sizeof(KSDATAFORMAT) + cbWfEx > DataFormat->FormatSize) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        
+        // Always keep room for the extensible part so the channel mask and
+        // subformat can be read without checking cbSize.
+        m_pWfExt = (PWAVEFORMATEXTENSIBLE)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED, 
+            max(cbWfEx, (ULONG)sizeof(WAVEFORMATEXTENSIBLE)), 
+            CAVERN_WAVERT_POOLTAG
+        );
+        
+        if (!m_pWfExt) {
+            return STATUS_INSUFFICIENT_RESOURCES;
+        }
+        
+        RtlCopyMemory(m_pWfExt, pWfEx, cbWfEx);
+        m_ulDmaMovementRate = pWfEx->nAvgBytesPerSec;
+    }
+    
+    m_bMixed = (CavernForwardModeFromFormat(m_pWfExt) == CavernForwardPcmFrames);
+    
+    m_pTimer = ExAllocateTimer(CavernTimerNotify, this, EX_TIMER_HIGH_RESOLUTION);
+    if (!m_pTimer) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    // A whole page so it can be mapped without exposing neighbouring pool
+    m_pRegisters = (PCAVERN_POSITION_REGISTER)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        PAGE_SIZE,
+        CAVERN_POSITION_REGISTER_POOLTAG
+    );
+    
+    if (!m_pRegisters) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    m_pRegisters->Version = CAVERN_POSITION_REGISTER_VERSION;
+    m_pRegisters->QpcFrequency = frequency.QuadPart;
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg()
+//
+// Runs the CavernPlanStateChange actions for the transition (see
+// CavernStreamState.h): the output is acquired on STOP->ACQUIRE and
+// released only on ->STOP, so PAUSE<->RUN toggles never reopen the pipe
+// and the first RUN starts forwarding on the first timer tick.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::SetState(_In_ KSSTATE State)
+{
+    CAVERN_STREAM_STATUS status;
+    CAVERN_STATE_PLAN plan;
+    KIRQL oldIrql;
+    LARGE_INTEGER qpc;
+    
+    status.State = (CAVERN_STREAM_STATE)m_State;
+    status.Mixed = m_bMixed;
+    status.OutputAcquired = m_bOutputAcquired;
+    status.MixStarted = m_bMixStarted;
+    status.TimerRunning = m_bTimerRunning;
+    
+    CavernPlanStateChange(&status, (CAVERN_STREAM_STATE)State, &plan);
+    
+    for (ULONG i = 0; i < plan.Count; i++) {
+        switch (plan.Actions[i]) {
+            case CavernActionStopTimer:
+                ExCancelTimer(m_pTimer, NULL);
+                KeFlushQueuedDpcs();
+                m_bTimerRunning = FALSE;
+                break;
+                
+            case CavernActionCatchUp:
+                KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+                UpdatePosition(KeQueryPerformanceCounter(NULL));
+                KeReleaseSpinLock(&m_PositionLock, oldIrql);
+                break;
+                
+            case CavernActionStopMix:
+                m_pMiniport->StopMix();
+                m_bMixStarted = FALSE;
+                break;
+                
+            case CavernActionReleaseOutput:
+                ReleaseOutput();
+                break;
+                
+            case CavernActionResetPosition:
+                KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+                m_ullLinearPosition = 0;
+                m_hnsElapsedTimeCarryForward = 0;
+                m_ulByteDisplacementCarryForward = 0;
+                
+                // Reset packet mode
+                CavernPacketReset(&m_Packets);
+                
+                CavernPublishPosition(m_pRegisters, 0, KeQueryPerformanceCounter(NULL).QuadPart, 0);
+                KeReleaseSpinLock(&m_PositionLock, oldIrql);
+                break;
+                
+            case CavernActionAcquireOutput: {
+                NTSTATUS ntStatus = AcquireOutput();
+                if (!NT_SUCCESS(ntStatus)) {
+                    return ntStatus;
+                }
+                break;
+            }
+                
+            case CavernActionStartMix:
+                m_pMiniport->StartMix();
+                m_bMixStarted = TRUE;
+                break;
+                
+            case CavernActionConnect:
+                qpc = KeQueryPerformanceCounter(&m_PerfFrequency);
+                m_pMiniport->GetOutput()->ConnectPipe();
+                m_pMiniport->GetOutput()->ArmFirstByte(qpc.QuadPart, m_PerfFrequency.QuadPart);
+                break;
+                
+            case CavernActionStampClock:
+                qpc = KeQueryPerformanceCounter(&m_PerfFrequency);
+                KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+                m_hnsDmaTimeStamp = KSCONVERT_PERFORMANCE_TIME(m_PerfFrequency.QuadPart, qpc);
+                KeReleaseSpinLock(&m_PositionLock, oldIrql);
+                break;
+                
+            case CavernActionStartTimer:
+                ExSetTimer(m_pTimer, -CAVERN_TIMER_PERIOD_HNS, CAVERN_TIMER_PERIOD_HNS, NULL);
+                m_bTimerRunning = TRUE;
+                break;
+        }
+    }
+    
+    m_State = State;
+    m_Running = (State == KSSTATE_RUN);
+    
+    return STATUS_SUCCESS;
+}
+
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetPosition(_Out_ PKSAUDIO_POSITION Position)
+{
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    if (m_Running) {
+        UpdatePosition(KeQueryPerformanceCounter(NULL));
+    }
+    
+    Position->PlayOffset = m_ullLinearPosition;
+    Position->WriteOffset = m_ullLinearPosition;
+    
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    return STATUS_SUCCESS;
+}
+
+//
+// Advances the emulated DMA position by the bytes consumed since the last
+// call and forwards them. Caller holds m_PositionLock.
+//
+VOID CCavernMiniportWaveRTStream::UpdatePosition(_In_ LARGE_INTEGER Qpc)
+{
+    if (!m_ulDmaMovementRate || !m_PerfFrequency.QuadPart) {
+        return;
+    }
+    
+    ULONGLONG hnsCurrentTime = KSCONVERT_PERFORMANCE_TIME(m_PerfFrequency.QuadPart, Qpc);
+    ULONGLONG hnsElapsed = hnsCurrentTime - m_hnsDmaTimeStamp + m_hnsElapsedTimeCarryForward;
+    ULONG timeElapsedMs = (ULONG)(hnsElapsed / 10000);
+    
+    m_hnsElapsedTimeCarryForward = hnsElapsed % 10000;
+    
+    ULONGLONG bytes = (ULONGLONG)m_ulDmaMovementRate * timeElapsedMs + m_ulByteDisplacementCarryForward;
+    m_ulByteDisplacementCarryForward = (ULONG)(bytes % 1000);
+    bytes /= 1000;
+    
+    // Never read past the end of stream
+    bytes = CavernPacketClamp(&m_Packets, m_ullLinearPosition, bytes);
+    
+    WriteBytes((ULONG)bytes);
+    
+    LONGLONG packetCounter = m_Packets.PacketCounter;
+    
+    if (CavernPacketAdvance(&m_Packets, m_ullLinearPosition)) {
+        CompleteEndOfStream();
+    }
+    
+    if (m_ulNotificationsPerBuffer && m_Packets.PacketCounter != packetCounter) {
+        SignalNotifications();
+    }
+    
+    CavernPublishPosition(m_pRegisters, m_ullLinearPosition, Qpc.QuadPart, m_Packets.PacketCounter);
+    
+    // A bitstream owns the output, so the consumer sees its position
+    if (!m_bMixed && m_bOutputAcquired) {
+        m_pMiniport->GetOutput()->PublishPosition(m_ullLinearPosition, Qpc.QuadPart, m_Packets.PacketCounter);
+    }
+    
+    m_hnsDmaTimeStamp = hnsCurrentTime;
+}
+
+//
+// The last byte before EOS has been read from the DMA buffer: push out what
+// is still held back instead of waiting for data that will never come. A
+// bitstream flushes the output's partial frame; a mixed stream only drains
+// its converter, the mix carries on with the others. Caller holds
+// m_PositionLock.
+//
+VOID CCavernMiniportWaveRTStream::CompleteEndOfStream()
+{
+    // Run silence through the converter so its last outputs come out
+    if (m_Resampler.IsInitialized()) {
+        KFLOATING_SAVE saveData;
+        if (NT_SUCCESS(KeSaveFloatingPointState(&saveData))) {
+            ResampleFrames(NULL, m_Resampler.GetLatencyFrames());
+            KeRestoreFloatingPointState(&saveData);
+        }
+    }
+    
+    if (!m_bMixed && m_bOutputAcquired) {
+        m_pMiniport->GetOutput()->Flush();
+    }
+    m_Packets.LastBufferRendered = TRUE;
+    
+    KdPrint(("CavernAudio: EOS reached at %I64u bytes, last packet %u\n",
+        m_ullLinearPosition, m_Packets.LastOsWritePacket));
+}
+
+#pragma code_seg("PAGE")
+//
+// The DMA buffer is pages from the port stream, mapped for the timer DPC
+// that reads it. Its size is kept to whole frames per packet so a packet
+// never ends mid-frame.
+//
+NTSTATUS CCavernMiniportWaveRTStream::AllocateBuffer(
+    _In_ ULONG Packets,
+    _In_ ULONG RequestedSize,
+    _Out_ PMDL *AudioBufferMdl,
+    _Out_ ULONG *ActualSize,
+    _Out_ ULONG *OffsetFromFirstPage,
+    _Out_ MEMORY_CACHING_TYPE *CacheType
+)
+{
+    PAGED_CODE();
+    
+    ULONG blockAlign = m_pWfExt ? m_pWfExt->Format.nBlockAlign : 0;
+    
+    if (!blockAlign || !Packets || RequestedSize / Packets < blockAlign) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    
+    RequestedSize -= RequestedSize % (blockAlign * Packets);
+    
+    PHYSICAL_ADDRESS highAddress;
+    highAddress.QuadPart = MAXULONG;
+    
+    PMDL mdl = m_pPortStream->AllocatePagesForMdl(highAddress, RequestedSize);
+    if (!mdl) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    PVOID buffer = m_pPortStream->MapAllocatedPages(mdl, MmCached);
+    if (!buffer) {
+        m_pPortStream->FreePagesFromMdl(mdl);
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    RtlZeroMemory(buffer, RequestedSize);
+    
+    m_pDmaMdl = mdl;
+    m_pDmaBuffer = buffer;
+    m_ulDmaBufferSize = RequestedSize;
+    m_pRegisters->BufferSize = RequestedSize;
+    
+    // The stream is stopped while its buffer changes, so no packet call
+    // or timer tick can see this half done
+    m_Packets.PacketSize = RequestedSize / Packets;
+    
+    *AudioBufferMdl = mdl;
+    *ActualSize = RequestedSize;
+    *OffsetFromFirstPage = 0;
+    *CacheType = MmCached;
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::AllocateAudioBuffer(
+    _In_ ULONG RequestedSize,
+    _Out_ PMDL *AudioBufferMdl,
+    _Out_ ULONG *ActualSize,
+    _Out_ ULONG *OffsetFromFirstPage,
+    _Out_ MEMORY_CACHING_TYPE *CacheType
+)
+{
+    PAGED_CODE();
+    
+    return AllocateBuffer(CAVERN_PACKETS_PER_BUFFER, RequestedSize, AudioBufferMdl,
+                          ActualSize, OffsetFromFirstPage, CacheType);
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(VOID) CCavernMiniportWaveRTStream::FreeAudioBuffer(_In_opt_ PMDL AudioBufferMdl, _In_ ULONG BufferSize)
+{
+    UNREFERENCED_PARAMETER(BufferSize);
+    
+    PAGED_CODE();
+    
+    if (!AudioBufferMdl) {
+        return;
+    }
+    
+    if (AudioBufferMdl == m_pDmaMdl) {
+        m_pPortStream->UnmapAllocatedPages(m_pDmaBuffer, AudioBufferMdl);
+        m_Packets.PacketSize = 0;
+        m_pDmaBuffer = NULL;
+        m_pDmaMdl = NULL;
+        m_ulDmaBufferSize = 0;
+        m_pRegisters->BufferSize = 0;
+    }
+    
+    m_pPortStream->FreePagesFromMdl(AudioBufferMdl);
+}
+
+#pragma code_seg("PAGE")
+//
+// Event mode: the audio engine asks for one notification per packet, and
+// only then uses the packet calls of IMiniportWaveRTOutputStream.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::AllocateBufferWithNotification(
+    _In_ ULONG NotificationCount,
+    _In_ ULONG RequestedSize,
+    _Out_ PMDL *AudioBufferMdl,
+    _Out_ ULONG *ActualSize,
+    _Out_ ULONG *OffsetFromFirstPage,
+    _Out_ MEMORY_CACHING_TYPE *CacheType
+)
+{
+    PAGED_CODE();
+    
+    NTSTATUS ntStatus = AllocateBuffer(NotificationCount, RequestedSize, AudioBufferMdl,
+                                       ActualSize, OffsetFromFirstPage, CacheType);
+    
+    if (NT_SUCCESS(ntStatus)) {
+        m_ulNotificationsPerBuffer = NotificationCount;
+    }
+    
+    return ntStatus;
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(VOID) CCavernMiniportWaveRTStream::FreeBufferWithNotification(_In_ PMDL AudioBufferMdl, _In_ ULONG BufferSize)
+{
+    PAGED_CODE();
+    
+    FreeAudioBuffer(AudioBufferMdl, BufferSize);
+    m_ulNotificationsPerBuffer = 0;
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::RegisterNotificationEvent(_In_ PKEVENT NotificationEvent)
+{
+    PAGED_CODE();
+    
+    KIRQL oldIrql;
+    PCAVERN_NOTIFICATION_ENTRY newEntry = (PCAVERN_NOTIFICATION_ENTRY)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        sizeof(CAVERN_NOTIFICATION_ENTRY),
+        CAVERN_WAVERT_POOLTAG
+    );
+    
+    if (!newEntry) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    newEntry->Event = NotificationEvent;
+    
+    // The timer DPC walks the list, so it only changes under the lock
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    for (PLIST_ENTRY entry = m_NotificationList.Flink; entry != &m_NotificationList; entry = entry->Flink) {
+        if (CONTAINING_RECORD(entry, CAVERN_NOTIFICATION_ENTRY, ListEntry)->Event == NotificationEvent) {
+            KeReleaseSpinLock(&m_PositionLock, oldIrql);
+            ExFreePoolWithTag(newEntry, CAVERN_WAVERT_POOLTAG);
+            return STATUS_UNSUCCESSFUL;
+        }
+    }
+    
+    InsertTailList(&m_NotificationList, &newEntry->ListEntry);
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg("PAGE")
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::UnregisterNotificationEvent(_In_ PKEVENT NotificationEvent)
+{
+    PAGED_CODE();
+    
+    KIRQL oldIrql;
+    PCAVERN_NOTIFICATION_ENTRY found = NULL;
+    
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    for (PLIST_ENTRY entry = m_NotificationList.Flink; entry != &m_NotificationList; entry = entry->Flink) {
+        PCAVERN_NOTIFICATION_ENTRY current = CONTAINING_RECORD(entry, CAVERN_NOTIFICATION_ENTRY, ListEntry);
+        if (current->Event == NotificationEvent) {
+            RemoveEntryList(entry);
+            found = current;
+            break;
+        }
+    }
+    
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    
+    if (!found) {
+        return STATUS_NOT_FOUND;
+    }
+    
+    ExFreePoolWithTag(found, CAVERN_WAVERT_POOLTAG);
+    return STATUS_SUCCESS;
+}
+
+#pragma code_seg()
+//
+// A packet completed. Caller holds m_PositionLock.
+//
+VOID CCavernMiniportWaveRTStream::SignalNotifications()
+{
+    for (PLIST_ENTRY entry = m_NotificationList.Flink; entry != &m_NotificationList; entry = entry->Flink) {
+        KeSetEvent(CONTAINING_RECORD(entry, CAVERN_NOTIFICATION_ENTRY, ListEntry)->Event, 0, FALSE);
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// The pipe and the server are downstream of the endpoint; nothing sits
+// between the DMA buffer and the point the position reports.
+//
+STDMETHODIMP_(VOID) CCavernMiniportWaveRTStream::GetHWLatency(_Out_ PKSRTAUDIO_HWLATENCY Latency)
+{
+    PAGED_CODE();
+    
+    Latency->FifoSize = 0;
+    Latency->ChipsetDelay = 0;
+    Latency->CodecDelay = 0;
+}
+
+#pragma code_seg("PAGE")
+//
+// The forwarding path (mix slot, resampler, router) is built for one
+// format at ACQUIRE; a new format needs a new stream.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::SetFormat(_In_ PKSDATAFORMAT DataFormat)
+{
+    UNREFERENCED_PARAMETER(DataFormat);
+    
+    PAGED_CODE();
+    
+    return STATUS_NOT_SUPPORTED;
+}
+
+#pragma code_seg()
+//
+// The clock and position registers live in the register page published by
+// UpdatePosition, which PortCls maps into the client for
+// KSPROPERTY_RTAUDIO_CLOCKREGISTER and _POSITIONREGISTER. They advance
+// once per timer tick, which is what the Accuracy fields report.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetClockRegister(_Out_ PKSRTAUDIO_HWREGISTER Register)
+{
+    if (!m_pRegisters || !m_pRegisters->QpcFrequency) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    
+    Register->Register = (PVOID)&m_pRegisters->Qpc;
+    Register->Width = 64;
+    Register->Numerator = (ULONGLONG)m_pRegisters->QpcFrequency;
+    Register->Denominator = 1;
+    Register->Accuracy = CAVERN_TIMER_PERIOD_HNS * 100;    // ns
+    
+    return STATUS_SUCCESS;
+}
+
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetPositionRegister(_Out_ PKSRTAUDIO_HWREGISTER Register)
+{
+    if (!m_pRegisters) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    
+    Register->Register = (PVOID)&m_pRegisters->BufferPosition;
+    Register->Width = 32;
+    Register->Numerator = 0;
+    Register->Denominator = 0;
+    Register->Accuracy = (m_ulDmaMovementRate * (CAVERN_TIMER_PERIOD_HNS / 10000)) / 1000;  // bytes per tick
+    
+    return STATUS_SUCCESS;
+}
+
+//
+// Packet mode, modeled on CMiniportWaveRTStream::SetWritePacket. The DMA
+// buffer is split into one packet per notification; an EOS packet caps
+// the stream at EosPacketLength bytes into that packet, and the aligner
+// is flushed as soon as the position gets there.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::SetWritePacket(_In_ ULONG PacketNumber, _In_ DWORD Flags, _In_ ULONG EosPacketLength)
+{
+    KIRQL oldIrql;
+    BOOLEAN completeNow;
+    
+    if (!m_ulNotificationsPerBuffer) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    
+    // The EOS check and the EOS update happen under the lock together, so
+    // a packet racing the EOS packet is refused rather than accepted
+    // after it
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    NTSTATUS status = CavernPacketWrite(
+        &m_Packets,
+        m_State == KSSTATE_RUN,
+        m_ullLinearPosition,
+        PacketNumber,
+        (Flags & KSSTREAM_HEADER_OPTIONSF_ENDOFSTREAM) != 0,
+        EosPacketLength,
+        &completeNow
+    );
+    
+    if (NT_SUCCESS(status) && completeNow) {
+        CompleteEndOfStream();
+    }
+    
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    return status;
+}
+
+//
+// Packets fully read from the DMA buffer since the stream started; the
+// engine writes packet GetPacketCount() next while stopped, the one after
+// while running.
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetPacketCount(_Out_ ULONG *PacketCount)
+{
+    KIRQL oldIrql;
+    
+    if (!m_ulNotificationsPerBuffer) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    if (m_Running) {
+        UpdatePosition(KeQueryPerformanceCounter(NULL));
+    }
+    *PacketCount = (ULONG)m_Packets.PacketCounter;
+    
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    return STATUS_SUCCESS;
+}
+
+//
+// Frames read from the DMA buffer, and the QPC of that reading; the pipe
+// and the server come after this point (see GetHWLatency).
+//
+STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetOutputStreamPresentationPosition(_Out_ KSAUDIO_PRESENTATION_POSITION *PresentationPosition)
+{
+    KIRQL oldIrql;
+    LARGE_INTEGER qpc;
+    
+    if (!m_pWfExt || !m_pWfExt->Format.nBlockAlign) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    
+    KeAcquireSpinLock(&m_PositionLock, &oldIrql);
+    
+    qpc = KeQueryPerformanceCounter(NULL);
+    if (m_Running) {
+        UpdatePosition(qpc);
+    }
+    PresentationPosition->u64PositionInBlocks = m_ullLinearPosition / m_pWfExt->Format.nBlockAlign;
+    PresentationPosition->u64QPCPosition = (UINT64)qpc.QuadPart;
+    
+    KeReleaseSpinLock(&m_PositionLock, oldIrql);
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernMiniportWaveRTStream::WriteBytes(_In_ ULONG ByteDisplacement)
+{
+    if (!m_pDmaBuffer || !ByteDisplacement) {
+        return;
+    }
+    
+    ULONG bufferOffset = (ULONG)(m_ullLinearPosition % m_ulDmaBufferSize);
+    
+    while (ByteDisplacement > 0) {
+        ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
+        
+        if (m_lMixSlot >= 0) {
+            MixBytes((PBYTE)m_pDmaBuffer + bufferOffset, runWrite);
+        } else if (m_bOutputAcquired && !m_bMixed) {
+            m_pMiniport->GetOutput()->Push((PBYTE)m_pDmaBuffer + bufferOffset, runWrite);
+        }
+        
+        bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
+        ByteDisplacement -= runWrite;
+        m_ullLinearPosition += runWrite;
+    }
+}
+
+//
+// PCM streams that do not run at CAVERN_NETWORK_SAMPLE_RATE get a
+// converter with the same sample format and channel count, so the mixer
+// still sees nBlockAlign frames. Bitstreams are never converted.
+//
+NTSTATUS CCavernMiniportWaveRTStream::InitResampler()
+{
+    CleanupResampler();
+    
+    if (!m_pWfExt || !m_bMixed ||
+        m_pWfExt->Format.nSamplesPerSec == CAVERN_NETWORK_SAMPLE_RATE) {
+        return STATUS_SUCCESS;
+    }
+    
+    CAVERN_SAMPLE_FORMAT format = GetSampleFormat();
+    
+    if (m_pWfExt->Format.nBlockAlign > CAVERN_MAX_FRAME_BYTES) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    
+    // The output stays float (ProcessFloat), so no dither: the mix
+    // requantizes once, on its way to the pipe
+    KFLOATING_SAVE saveData;
+    NTSTATUS status = KeSaveFloatingPointState(&saveData);
+    if (NT_SUCCESS(status)) {
+        status = m_Resampler.Init(
+            format,
+            m_pWfExt->Format.nChannels,
+            m_pWfExt->Format.nSamplesPerSec,
+            CAVERN_NETWORK_SAMPLE_RATE,
+            FALSE,
+            CavernDitherNone,
+            TRUE
+        );
+        KeRestoreFloatingPointState(&saveData);
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: No rate converter for %u Hz, mixing as is (0x%08X)\n",
+            m_pWfExt->Format.nSamplesPerSec, status));
+        CleanupResampler();
+        return status;
+    }
+    
+    KdPrint(("CavernAudio: Converting %u Hz -> %u Hz, %u taps x %u phases\n",
+        m_pWfExt->Format.nSamplesPerSec, CAVERN_NETWORK_SAMPLE_RATE,
+        m_Resampler.GetTaps(), m_Resampler.GetPhases()));
+    
+    return STATUS_SUCCESS;
+}
+
+//
+// Sample format of a PCM stream, as the portable converters name it.
+//
+CAVERN_SAMPLE_FORMAT CCavernMiniportWaveRTStream::GetSampleFormat()
+{
+    return CavernSampleFormatFromFormat(m_pWfExt);
+}
+
+ULONG CCavernMiniportWaveRTStream::GetOutputRate()
+{
+    return m_Resampler.IsInitialized() ? CAVERN_NETWORK_SAMPLE_RATE : m_pWfExt->Format.nSamplesPerSec;
+}
+
+VOID CCavernMiniportWaveRTStream::CleanupResampler()
+{
+    m_Resampler.Cleanup();
+}
+
+//
+// Feeds one run of the DMA ring to the mixer slot, through the converter
+// when there is one. Runs may end inside a frame; the split frame is
+// completed from the next run. Caller holds m_PositionLock.
+//
+VOID CCavernMiniportWaveRTStream::MixBytes(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    ULONG frameSize = m_pWfExt->Format.nBlockAlign;
+    KFLOATING_SAVE saveData;
+    
+    if (!NT_SUCCESS(KeSaveFloatingPointState(&saveData))) {
+        return;
+    }
+    
+    if (m_ulFrameCarryBytes) {
+        ULONG take = min(Length, frameSize - m_ulFrameCarryBytes);
+        
+        RtlCopyMemory(m_FrameCarry + m_ulFrameCarryBytes, Buffer, take);
+        m_ulFrameCarryBytes += take;
+        Buffer += take;
+        Length -= take;
+        
+        if (m_ulFrameCarryBytes == frameSize) {
+            if (m_Resampler.IsInitialized()) {
+                ResampleFrames(m_FrameCarry, 1);
+            } else {
+                MixFrames(m_FrameCarry, 1);
+            }
+            m_ulFrameCarryBytes = 0;
+        }
+    }
+    
+    ULONG frames = Length / frameSize;
+    if (frames) {
+        if (m_Resampler.IsInitialized()) {
+            ResampleFrames(Buffer, frames);
+        } else {
+            MixFrames(Buffer, frames);
+        }
+    }
+    
+    m_ulFrameCarryBytes = Length - frames * frameSize;
+    if (m_ulFrameCarryBytes) {
+        RtlCopyMemory(m_FrameCarry, Buffer + frames * frameSize, m_ulFrameCarryBytes);
+    }
+    
+    KeRestoreFloatingPointState(&saveData);
+}
+
+//
+// Converts whole frames (NULL: silence) straight to float in the mix
+// staging and mixes them, calling again until a call comes back short of
+// the buffer. Caller holds the floating point state.
+//
+VOID CCavernMiniportWaveRTStream::ResampleFrames(_In_reads_bytes_opt_(Frames * m_Resampler.GetFrameSize()) const BYTE *Buffer, _In_ SIZE_T Frames)
+{
+    ULONG frameSize = m_Resampler.GetFrameSize();
+    
+    for (;;) {
+        SIZE_T used = 0;
+        SIZE_T produced = 0;
+        
+        m_Resampler.ProcessFloat(Buffer, Frames, m_pMixBuffer, CAVERN_RESAMPLE_FRAMES, &used, &produced);
+        
+        if (produced) {
+            MixFloat(m_pMixBuffer, produced);
+        }
+        if (Buffer) {
+            Buffer += used * frameSize;
+        }
+        Frames -= used;
+        
+        if (!Frames && produced < CAVERN_RESAMPLE_FRAMES) {
+            break;
+        }
+    }
+}
+
+//
+// Converts whole frames to float and queues them in the stream's mixer
+// slot. Frames that do not fit (the mix is not running) are dropped by the
+// mixer. Caller holds the floating point state.
+//
+VOID CCavernMiniportWaveRTStream::MixFrames(_In_reads_bytes_(Frames * m_pWfExt->Format.nBlockAlign) const BYTE *Buffer, _In_ SIZE_T Frames)
+{
+    ULONG frameSize = m_pWfExt->Format.nBlockAlign;
+    ULONG channels = m_pWfExt->Format.nChannels;
+    
+    while (Frames) {
+        SIZE_T block = min(Frames, (SIZE_T)CAVERN_RESAMPLE_FRAMES);
+        
+        m_Converter.ToFloat(Buffer, m_pMixBuffer, block * channels);
+        MixFloat(m_pMixBuffer, block);
+        
+        Buffer += block * frameSize;
+        Frames -= block;
+    }
+}
+
+//
+// Routes at most CAVERN_RESAMPLE_FRAMES float frames of the stream's
+// layout to the mix layout and writes them to the mixer slot.
+//
+VOID CCavernMiniportWaveRTStream::MixFloat(_In_reads_(Frames * m_pWfExt->Format.nChannels) const float *Samples, _In_ SIZE_T Frames)
+{
+    CCavernStreamMixer *mixer = m_pMiniport->GetMixer();
+    
+    if (m_pRouteBuffer) {
+        m_Router.Process(Samples, m_pRouteBuffer, Frames);
+        mixer->Write(m_lMixSlot, m_pRouteBuffer, Frames);
+    } else {
+        mixer->Write(m_lMixSlot, Samples, Frames);
+    }
+}
+
+#pragma code_seg("PAGE")
+//
+// KSPROPSETID_CavernStream. The values are kept even while the stream is
+// not mixed, so the slot it opens next starts at them.
+//
+VOID CCavernMiniportWaveRTStream::SetGain(_In_ LONG VolumeLevel, _In_ BOOLEAN Mute)
+{
+    PAGED_CODE();
+    
+    m_lVolumeLevel = VolumeLevel;
+    m_bMute = Mute;
+    m_pMiniport->UpdateMixGain(this);
+}
+
+#pragma code_seg()
+//
+// PCM streams get a rate converter when they need one and a slot in the
+// mix; bitstreams take the output for themselves. Neither converter is
+// fatal: without one the stream is mixed at its own rate, which only works
+// if it matches the mix.
+//
+NTSTATUS CCavernMiniportWaveRTStream::AcquireOutput()
+{
+    NTSTATUS status;
+    
+    if (m_bOutputAcquired) {
+        return STATUS_SUCCESS;
+    }
+    
+    if (!m_bMixed) {
+        status = m_pMiniport->OpenExclusiveOutput(this);
+        m_bOutputAcquired = NT_SUCCESS(status);
+        return status;
+    }
+    
+    InitResampler();
+    
+    status = CavernSelectConverter(GetSampleFormat(), TRUE, &m_Converter);
+    if (NT_SUCCESS(status)) {
+        m_pMixBuffer = (float *)ExAllocatePool2(
+            POOL_FLAG_NON_PAGED,
+            CAVERN_RESAMPLE_FRAMES * m_pWfExt->Format.nChannels * sizeof(float),
+            CAVERN_WAVERT_POOLTAG
+        );
+        if (!m_pMixBuffer) {
+            status = STATUS_INSUFFICIENT_RESOURCES;
+        }
+    }
+    
+    if (NT_SUCCESS(status)) {
+        status = m_pMiniport->JoinMix(this, &m_lMixSlot);
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Stream cannot join the mix (0x%08X)\n", status));
+        m_bOutputAcquired = TRUE;
+        ReleaseOutput();
+        return status;
+    }
+    
+    status = InitRoute();
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Stream cannot be routed to the mix (0x%08X)\n", status));
+        m_bOutputAcquired = TRUE;
+        ReleaseOutput();
+        return status;
+    }
+    
+    m_ulFrameCarryBytes = 0;
+    m_bOutputAcquired = TRUE;
+    
+    KdPrint(("CavernAudio: Stream mixed in slot %d\n", m_lMixSlot));
+    return STATUS_SUCCESS;
+}
+
+//
+// Matches the stream's speakers to the mix layout by position, not by
+// channel index, so a 5.1 stream lands on the 5.1 speakers of a 7.1 mix
+// and a back-surround stream plays on side surrounds. Speakers the mix
+// lacks go through the downmix matrix instead of being dropped. Called
+// once the stream has joined the mix, which fixes the layout.
+//
+NTSTATUS CCavernMiniportWaveRTStream::InitRoute()
+{
+    KFLOATING_SAVE saveData;
+    
+    NTSTATUS status = KeSaveFloatingPointState(&saveData);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+    status = m_Router.Configure(
+        CavernChannelMaskFromFormat(m_pWfExt),
+        m_pWfExt->Format.nChannels,
+        m_pMiniport->GetMixLayout(),
+        CavernLfeKeep
+    );
+    
+    KeRestoreFloatingPointState(&saveData);
+    
+    if (!NT_SUCCESS(status) || m_Router.IsIdentity()) {
+        return status;
+    }
+    
+    if (m_Router.UsesMatrix()) {
+        KdPrint(("CavernAudio: Stream downmixed from %u to %u ch\n",
+            m_Router.GetInputChannels(), m_Router.GetOutputChannels()));
+    }
+    
+    m_pRouteBuffer = (float *)ExAllocatePool2(
+        POOL_FLAG_NON_PAGED,
+        CAVERN_RESAMPLE_FRAMES * m_Router.GetOutputChannels() * sizeof(float),
+        CAVERN_WAVERT_POOLTAG
+    );
+    
+    return m_pRouteBuffer ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID CCavernMiniportWaveRTStream::CleanupRoute()
+{
+    if (m_pRouteBuffer) {
+        ExFreePoolWithTag(m_pRouteBuffer, CAVERN_WAVERT_POOLTAG);
+        m_pRouteBuffer = NULL;
+    }
+}
+
+//
+// Undoes AcquireOutput. The timer is stopped, so nothing writes to the
+// slot any more when it is handed back.
+//
+VOID CCavernMiniportWaveRTStream::ReleaseOutput()
+{
+    if (!m_bOutputAcquired) {
+        return;
+    }
+    
+    if (m_bMixStarted) {
+        m_pMiniport->StopMix();
+        m_bMixStarted = FALSE;
+    }
+    
+    if (!m_bMixed) {
+        m_pMiniport->CloseExclusiveOutput(this);
+    } else if (m_lMixSlot >= 0) {
+        m_pMiniport->LeaveMix(&m_lMixSlot);
+    }
+    
+    CleanupResampler();
+    CleanupRoute();
+    m_ulFrameCarryBytes = 0;
+    
+    if (m_pMixBuffer) {
+        ExFreePoolWithTag(m_pMixBuffer, CAVERN_WAVERT_POOLTAG);
+        m_pMixBuffer = NULL;
+    }
+    
+    m_bOutputAcquired = FALSE;
+}
+
+//=============================================================================
+// CCavernPipeOutput Implementation
+//=============================================================================
+
+CCavernPipeOutput::CCavernPipeOutput()
+    : m_Open(FALSE),
+      m_pWriterThread(NULL),
+      m_lStopWriter(0),
+      m_lConnectNow(0),
+      m_hPipe(NULL),
+      m_ullNextConnect(0),
+      m_ullReportedDrops(0),
+      m_llRunStartQpc(0),
+      m_llPerfFrequency(0),
+      m_FirstByteDelivered(FALSE),
+      m_hnsFirstByteLatency(0),
+      m_ulPipeOpenCount(0),
+      m_hRegisterSection(NULL),
+      m_pRegisterSection(NULL),
+      m_pRegisterView(NULL),
+      m_pRegisterMdl(NULL),
+      m_pRegister(NULL)
+{
+    KeInitializeEvent(&m_WakeEvent, SynchronizationEvent, FALSE);
+    RtlInitUnicodeString(&m_PipeName, CAVERN_PIPE_NAME);
+}
+
+CCavernPipeOutput::~CCavernPipeOutput()
+{
+    Close();
+}
+
+NTSTATUS CCavernPipeOutput::Open(_In_ PWAVEFORMATEXTENSIBLE Format)
+{
+    NTSTATUS status = InitAligner(Format);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+    // Without a gate every frame is forwarded
+    InitSilenceGate(Format);
+    
+    // The writer pre-warms the transport. The server may not be up yet;
+    // the writer retries, and RUN asks it to try at once.
+    status = StartWriter(Format);
+    if (!NT_SUCCESS(status)) {
+        m_SilenceGate.Cleanup();
+        m_Aligner.Cleanup();
+        return status;
+    }
+    
+    m_Open = TRUE;
+    
+    // A new owner counts from zero; nothing else writes the page yet
+    PublishPosition(0, KeQueryPerformanceCounter(NULL).QuadPart, 0);
+    
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernPipeOutput::Close()
+{
+    if (m_Open) {
+        // Forward the partial frame still staged, then drop the staging
+        m_Aligner.Flush();
+        m_Aligner.Cleanup();
+        
+        if (m_SilenceGate.IsInitialized()) {
+            m_SilenceGate.Flush();
+            KdPrint(("CavernAudio: Silence gate went idle %u times, %I64u frames not sent\n",
+                m_SilenceGate.GetIdleCount(), m_SilenceGate.GetSuppressedFrames()));
+            m_SilenceGate.Cleanup();
+        }
+        
+        m_Open = FALSE;
+    }
+    
+    // Writes what is queued and disconnects
+    StopWriter();
+}
+
+NTSTATUS CCavernPipeOutput::Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    if (!m_Open) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+    
+    return m_Aligner.Push(Buffer, Length);
 }
 
-#pragma code_seg("PAGE")
-STDMETHODIMP_(ULONG) CCavernMiniportWaveRTStream::AddRef()
+VOID CCavernPipeOutput::Flush()
 {
-    return CUnknown::AddRef();
+    if (m_Open) {
+        m_Aligner.Flush();
+        m_SilenceGate.Flush();
+    }
 }
 
-#pragma code_seg("PAGE")
-STDMETHODIMP_(ULONG) CCavernMiniportWaveRTStream::Release()
+VOID CCavernPipeOutput::PublishPosition(_In_ ULONGLONG LinearPosition, _In_ LONGLONG Qpc, _In_ LONGLONG PacketCount)
 {
-    return CUnknown::Release();
+    if (m_pRegister) {
+        CavernPublishPosition(m_pRegister, LinearPosition, Qpc, PacketCount);
+    }
 }
 
-#pragma code_seg("PAGE")
-STDMETHODIMP CCavernMiniportWaveRTStream::QueryInterface(REFIID InterfaceId, PVOID *Object)
+VOID CCavernPipeOutput::ArmFirstByte(_In_ LONGLONG RunStartQpc, _In_ LONGLONG PerfFrequency)
 {
-    PAGED_CODE();
+    m_llPerfFrequency = PerfFrequency;
+    m_llRunStartQpc = RunStartQpc;
+    m_FirstByteDelivered = FALSE;
+}
+
+//
+// Picks the forwarding granularity for the output format (see
+// CavernForwardModeFromFormat). Anything still short of a frame after
+// CAVERN_MAX_FORWARD_LATENCY_MS is forwarded anyway; a bitstream whose
+// bursts repeat less often than that is held for a whole burst.
+//
+NTSTATUS CCavernPipeOutput::InitAligner(_In_ PWAVEFORMATEXTENSIBLE Format)
+{
+    CAVERN_FORWARD_MODE mode = CavernForwardModeFromFormat(Format);
+    ULONG blockAlign = 1;
+    ULONG maxLatencyBytes = 0;
     
-    if (IsEqualGUID(InterfaceId, IID_IUnknown)) {
-        *Object = (PUNKNOWN)this;
-        AddRef();
-        return STATUS_SUCCESS;
+    if (mode != CavernForwardRaw) {
+        blockAlign = Format->Format.nBlockAlign;
+        maxLatencyBytes = (ULONG)(((ULONGLONG)Format->Format.nAvgBytesPerSec *
+                                   CAVERN_MAX_FORWARD_LATENCY_MS) / 1000);
     }
     
-    *Object = NULL;
-    return STATUS_NOINTERFACE;
+    return m_Aligner.Init(mode, blockAlign, CAVERN_FORWARD_STAGING_SIZE, maxLatencyBytes, AlignerSink, this);
 }
 
-#pragma code_seg("PAGE")
-NTSTATUS CCavernMiniportWaveRTStream::Init(
-    _In_ PCCavernMiniportWaveRT Miniport,
-    _In_ PPORTWAVERTSTREAM PortStream,
-    _In_ ULONG Pin,
-    _In_ BOOLEAN Capture,
-    _In_ PKSDATAFORMAT DataFormat
-)
+//
+// PCM streams, after any rate conversion, get a silence gate between the
+// aligner and the pipe: once the stream has been digital zero for
+// CAVERN_SILENCE_HOLD_MS the pipe only carries a silence packet every
+// CAVERN_SILENCE_MARKER_MS, and the first frame of signal goes out at once.
+// Bitstreams pass through untouched.
+//
+NTSTATUS CCavernPipeOutput::InitSilenceGate(_In_ PWAVEFORMATEXTENSIBLE Format)
 {
-    UNREFERENCED_PARAMETER(Pin);
-    UNREFERENCED_PARAMETER(Capture);
-    
-    PAGED_CODE();
+    m_SilenceGate.Cleanup();
     
-    ASSERT(Miniport);
-    ASSERT(PortStream);
-    ASSERT(DataFormat);
-    
-    m_pMiniport = Miniport;
-    m_pMiniport->AddRef();
+    if (m_Aligner.GetMode() != CavernForwardPcmFrames) {
+        return STATUS_SUCCESS;
+    }
     
-    m_pPortStream = PortStream;
-    m_pPortStream->AddRef();
+    NTSTATUS status = m_SilenceGate.Init(
+        CavernSampleFormatFromFormat(Format),
+        Format->Format.nChannels,
+        Format->Format.nSamplesPerSec,
+        CAVERN_SILENCE_THRESHOLD,
+        TRUE,
+        GateSink,
+        MarkerSink,
+        this
+    );
     
-    if (DataFormat->FormatSize >= sizeof(KSDATAFORMAT_WAVEFORMATEXTENSIBLE)) {
-        m_pWfExt = (PWAVEFORMATEXTENSIBLE)ExAllocatePool2(
-            POOL_FLAG_NON_PAGED, 
-            DataFormat->FormatSize, 
-            CAVERN_WAVERT_POOLTAG
-        );
-        
-        if (!m_pWfExt) {
-            return STATUS_INSUFFICIENT_RESOURCES;
-        }
-        
-        RtlCopyMemory(m_pWfExt, DataFormat, DataFormat->FormatSize);
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: No silence gate, forwarding every frame (0x%08X)\n", status));
     }
     
-    return STATUS_SUCCESS;
+    return status;
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::SetState(_In_ KSSTATE State)
+NTSTATUS CCavernPipeOutput::AlignerSink(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length
+)
 {
-    m_State = State;
-    m_Running = (State == KSSTATE_RUN);
+    PCCavernPipeOutput output = (PCCavernPipeOutput)Context;
     
-    if (m_Running) {
-        ConnectPipe();
-    } else {
-        DisconnectPipe();
+    if (output->m_SilenceGate.IsInitialized()) {
+        return output->m_SilenceGate.Push(Buffer, Length);
     }
     
-    return STATUS_SUCCESS;
+    return output->ForwardToPipe(CavernPipePacketAudio, (PVOID)Buffer, Length);
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetPosition(_Out_ PKSAUDIO_POSITION Position)
+NTSTATUS CCavernPipeOutput::GateSink(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length
+)
 {
-    Position->PlayOffset = m_ullLinearPosition;
-    Position->WriteOffset = m_ullLinearPosition;
-    return STATUS_SUCCESS;
+    return ((PCCavernPipeOutput)Context)->ForwardToPipe(CavernPipePacketAudio, (PVOID)Buffer, Length);
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::AllocateAudioBuffer(
-    _In_ ULONG BufferSize,
-    _Out_ PVOID *Buffer,
-    _Out_ PULONG OffsetFromFirstPage,
-    _Out_ PULONG ActualBufferSize
+NTSTATUS CCavernPipeOutput::MarkerSink(
+    _In_ PVOID Context,
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ ULONG Length
 )
 {
-    PAGED_CODE();
-    
-    *Buffer = ExAllocatePool2(POOL_FLAG_NON_PAGED, BufferSize, CAVERN_WAVERT_POOLTAG);
-    if (!*Buffer) {
-        return STATUS_INSUFFICIENT_RESOURCES;
+    return ((PCCavernPipeOutput)Context)->ForwardToPipe(CavernPipePacketSilence, (PVOID)Buffer, Length);
+}
+
+NTSTATUS CCavernPipeOutput::ConnectPipe()
+{
+    if (!m_pWriterThread) {
+        return STATUS_DEVICE_NOT_READY;
     }
     
-    RtlZeroMemory(*Buffer, BufferSize);
-    *OffsetFromFirstPage = 0;
-    *ActualBufferSize = BufferSize;
-    
-    m_pDmaBuffer = *Buffer;
-    m_ulDmaBufferSize = BufferSize;
+    InterlockedExchange(&m_lConnectNow, 1);
+    KeSetEvent(&m_WakeEvent, 0, FALSE);
     
     return STATUS_SUCCESS;
 }
 
-STDMETHODIMP_(VOID) CCavernMiniportWaveRTStream::FreeAudioBuffer(_In_opt_ PVOID Buffer)
+//
+// Runs in the timer DPCs. A forward that does not fit is dropped whole:
+// the writer is behind by CAVERN_PIPE_QUEUE_MS, and a partial one would
+// tear a frame. The header and the payload go into the queue together,
+// so the server never sees one without the other.
+//
+NTSTATUS CCavernPipeOutput::ForwardToPipe(
+    _In_ CAVERN_PIPE_PACKET_TYPE Type,
+    _In_reads_bytes_(Length) PVOID Buffer,
+    _In_ ULONG Length
+)
 {
-    if (Buffer) {
-        ExFreePoolWithTag(Buffer, CAVERN_WAVERT_POOLTAG);
-        if (m_pDmaBuffer == Buffer) {
-            m_pDmaBuffer = NULL;
-            m_ulDmaBufferSize = 0;
-        }
+    if (!m_Queue.IsInitialized()) {
+        return STATUS_DEVICE_NOT_CONNECTED;
     }
+    
+    if (Length > CAVERN_PIPE_PACKET_MAX_LENGTH) {
+        return STATUS_INVALID_BUFFER_SIZE;
+    }
+    
+    NTSTATUS status = STATUS_SUCCESS;
+    
+    if (sizeof(CAVERN_PIPE_PACKET) + Length > m_Queue.GetFreeBytes()) {
+        status = STATUS_DATA_OVERRUN;
+    } else {
+        CAVERN_PIPE_PACKET packet;
+        CavernInitPipePacket(&packet, Type, Length);
+        
+        m_Queue.Write((const UCHAR *)&packet, sizeof(packet));
+        m_Queue.Write((const UCHAR *)Buffer, Length);
+        m_Queue.Flush();
+    }
+    
+    KeSetEvent(&m_WakeEvent, 0, FALSE);
+    
+    return status;
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetClockRegister(_Out_ PKSRTAUDIO_HWREGISTER Register)
-{
-    UNREFERENCED_PARAMETER(Register);
-    return STATUS_NOT_SUPPORTED;
-}
-
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetPositionRegister(_Out_ PKSRTAUDIO_HWREGISTER Register)
+#pragma code_seg("PAGE")
+//
+// The queue holds CAVERN_PIPE_QUEUE_MS of output. Every timer tick
+// publishes its last slot part filled, so there is a slot per tick on top
+// of the bytes themselves.
+//
+NTSTATUS CCavernPipeOutput::StartWriter(_In_ PWAVEFORMATEXTENSIBLE Format)
 {
-    UNREFERENCED_PARAMETER(Register);
-    return STATUS_NOT_SUPPORTED;
+    PAGED_CODE();
+    
+    HANDLE threadHandle = NULL;
+    OBJECT_ATTRIBUTES objAttr;
+    
+    if (m_pWriterThread) {
+        return STATUS_SUCCESS;
+    }
+    
+    ULONG periodBytes = (ULONG)(((ULONGLONG)Format->Format.nAvgBytesPerSec * CAVERN_TIMER_PERIOD_HNS) / 10000000);
+    ULONG slotBytes = (periodBytes + CAVERN_PIPE_MIN_SLOT_BYTES - 1) & ~(CAVERN_PIPE_MIN_SLOT_BYTES - 1);
+    ULONG queueBytes = (ULONG)(((ULONGLONG)Format->Format.nAvgBytesPerSec * CAVERN_PIPE_QUEUE_MS) / 1000);
+    ULONG ticks = (ULONG)(((ULONGLONG)CAVERN_PIPE_QUEUE_MS * 10000) / CAVERN_TIMER_PERIOD_HNS);
+    
+    slotBytes = max(slotBytes, CAVERN_PIPE_MIN_SLOT_BYTES);
+    
+    NTSTATUS status = m_Queue.Init(slotBytes, queueBytes / slotBytes + ticks);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+    
+    m_lStopWriter = 0;
+    m_lConnectNow = 1;
+    m_ullNextConnect = 0;
+    m_ullReportedDrops = 0;
+    KeClearEvent(&m_WakeEvent);
+    
+    InitializeObjectAttributes(&objAttr, NULL, OBJ_KERNEL_HANDLE, NULL, NULL);
+    
+    status = PsCreateSystemThread(
+        &threadHandle,
+        THREAD_ALL_ACCESS,
+        &objAttr,
+        NULL,
+        NULL,
+        WriterThread,
+        this
+    );
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Could not create the pipe writer 0x%08X\n", status));
+        m_Queue.Cleanup();
+        return status;
+    }
+    
+    status = ObReferenceObjectByHandle(
+        threadHandle,
+        THREAD_ALL_ACCESS,
+        *PsThreadType,
+        KernelMode,
+        (PVOID *)&m_pWriterThread,
+        NULL
+    );
+    if (!NT_SUCCESS(status)) {
+        // Without the object the thread cannot be waited for later, so
+        // stop it now
+        InterlockedExchange(&m_lStopWriter, 1);
+        KeSetEvent(&m_WakeEvent, 0, FALSE);
+        ZwWaitForSingleObject(threadHandle, FALSE, NULL);
+        m_pWriterThread = NULL;
+        m_Queue.Cleanup();
+    }
+    
+    ZwClose(threadHandle);
+    
+    return status;
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::SetWritePacket(_In_ ULONG PacketNumber, _In_ DWORD Flags, _In_ ULONG EosPacketLength)
+VOID CCavernPipeOutput::StopWriter()
 {
-    UNREFERENCED_PARAMETER(PacketNumber);
-    UNREFERENCED_PARAMETER(Flags);
-    UNREFERENCED_PARAMETER(EosPacketLength);
-    return STATUS_SUCCESS;
+    PAGED_CODE();
+    
+    if (!m_pWriterThread) {
+        return;
+    }
+    
+    // The producers are stopped; hand over the last partial slot
+    m_Queue.Flush();
+    
+    InterlockedExchange(&m_lStopWriter, 1);
+    KeSetEvent(&m_WakeEvent, 0, FALSE);
+    
+    // Bounded: a write the writer is in gives up after
+    // CAVERN_PIPE_WRITE_TIMEOUT_MS
+    KeWaitForSingleObject(m_pWriterThread, Executive, KernelMode, FALSE, NULL);
+    
+    ObDereferenceObject(m_pWriterThread);
+    m_pWriterThread = NULL;
+    
+    KdPrint(("CavernAudio: Pipe writer stopped, %I64u bytes queued, %I64u dropped, %u of %u slots used at most\n",
+        m_Queue.GetQueuedBytes(), m_Queue.GetDroppedBytes(), m_Queue.GetHighWater(), m_Queue.GetSlotCount()));
+    
+    m_Queue.Cleanup();
 }
 
-STDMETHODIMP_(NTSTATUS) CCavernMiniportWaveRTStream::GetReadPacket(_Out_ ULONG *PacketNumber, _Out_ DWORD *Flags, _Out_ ULONG *EosPacketLength)
+//
+// Sleeps until a forward or ConnectPipe wakes it, or for
+// CAVERN_PIPE_WRITER_PERIOD_MS, and writes what is queued. After a stop
+// request it drains the queue once more and closes the pipe.
+//
+VOID CCavernPipeOutput::WriterThread(_In_ PVOID Context)
 {
-    UNREFERENCED_PARAMETER(PacketNumber);
-    UNREFERENCED_PARAMETER(Flags);
-    UNREFERENCED_PARAMETER(EosPacketLength);
-    return STATUS_NOT_SUPPORTED;
+    PAGED_CODE();
+    
+    PCCavernPipeOutput output = (PCCavernPipeOutput)Context;
+    LARGE_INTEGER timeOut;
+    BOOLEAN stop = FALSE;
+    
+    // Pipe latency is audio latency; run ahead of ordinary threads
+    KeSetPriorityThread(KeGetCurrentThread(), LOW_REALTIME_PRIORITY);
+    
+    timeOut.QuadPart = -10000LL * CAVERN_PIPE_WRITER_PERIOD_MS;
+    
+    while (!stop) {
+        KeWaitForSingleObject(&output->m_WakeEvent, Executive, KernelMode, FALSE, &timeOut);
+        
+        stop = (output->m_lStopWriter != 0);
+        
+        output->DrainQueue();
+    }
+    
+    output->ClosePipe();
+    
+    PsTerminateSystemThread(STATUS_SUCCESS);
 }
 
-VOID CCavernMiniportWaveRTStream::WriteBytes(_In_ ULONG ByteDisplacement)
+//
+// Writes the queued runs. With no server to take them they are released
+// unwritten: the output is live, and stale audio is worth nothing once the
+// server comes up.
+//
+VOID CCavernPipeOutput::DrainQueue()
 {
-    if (!m_pDmaBuffer || !ByteDisplacement) {
-        return;
-    }
+    PAGED_CODE();
     
-    ULONG bufferOffset = (ULONG)(m_ullLinearPosition % m_ulDmaBufferSize);
+    CAVERN_CAPTURE_RUN run;
     
-    while (ByteDisplacement > 0) {
-        ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
+    if (!m_hPipe) {
+        ULONGLONG now = KeQueryInterruptTime();
         
-        ForwardToPipe((PBYTE)m_pDmaBuffer + bufferOffset, runWrite);
+        if (InterlockedExchange(&m_lConnectNow, 0) || now >= m_ullNextConnect) {
+            m_ullNextConnect = now + 10000ULL * CAVERN_PIPE_RETRY_MS;
+            OpenPipe();
+        }
+    }
+    
+    while (m_Queue.Peek(&run, CAVERN_PIPE_MAX_WRITE)) {
+        if (m_hPipe) {
+            IO_STATUS_BLOCK ioStatus;
+            NTSTATUS status = ZwWriteFile(
+                m_hPipe,
+                NULL,
+                NULL,
+                NULL,
+                &ioStatus,
+                run.Data,
+                run.Bytes,
+                NULL,
+                NULL
+            );
+            
+            // The pipe is open for asynchronous I/O so a full pipe cannot
+            // block here for good. ioStatus stays on this stack until the
+            // write completes or its cancel does.
+            if (status == STATUS_PENDING) {
+                LARGE_INTEGER timeOut;
+                timeOut.QuadPart = -10000LL * CAVERN_PIPE_WRITE_TIMEOUT_MS;
+                
+                if (ZwWaitForSingleObject(m_hPipe, FALSE, &timeOut) == STATUS_TIMEOUT) {
+                    IO_STATUS_BLOCK cancelStatus;
+                    ZwCancelIoFile(m_hPipe, &cancelStatus);
+                    ZwWaitForSingleObject(m_hPipe, FALSE, NULL);
+                }
+                status = ioStatus.Status;
+            }
+            
+            if (NT_SUCCESS(status)) {
+                if (!m_FirstByteDelivered && m_llRunStartQpc && m_llPerfFrequency) {
+                    LARGE_INTEGER now = KeQueryPerformanceCounter(NULL);
+                    
+                    m_hnsFirstByteLatency = ((ULONGLONG)(now.QuadPart - m_llRunStartQpc) * 10000000) /
+                                            (ULONGLONG)m_llPerfFrequency;
+                    m_FirstByteDelivered = TRUE;
+                    
+                    KdPrint(("CavernAudio: First byte %I64u hns after RUN (pipe opens %u)\n",
+                        m_hnsFirstByteLatency, m_ulPipeOpenCount));
+                }
+            } else {
+                // The server went away or stopped reading; reconnect at
+                // the next retry
+                KdPrint(("CavernAudio: Pipe write failed 0x%08X\n", status));
+                ClosePipe();
+            }
+        }
         
-        bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
-        ByteDisplacement -= runWrite;
-        m_ullLinearPosition += runWrite;
+        m_Queue.Release(&run);
+    }
+    
+    ULONGLONG dropped = m_Queue.GetDroppedBytes();
+    if (dropped != m_ullReportedDrops) {
+        KdPrint(("CavernAudio: Pipe behind, %I64u bytes dropped\n", dropped - m_ullReportedDrops));
+        m_ullReportedDrops = dropped;
     }
 }
 
-NTSTATUS CCavernMiniportWaveRTStream::ConnectPipe()
+NTSTATUS CCavernPipeOutput::OpenPipe()
 {
-    KIRQL oldIrql;
-    KeAcquireSpinLock(&m_PipeLock, &oldIrql);
-    
-    if (m_hPipe) {
-        KeReleaseSpinLock(&m_PipeLock, oldIrql);
-        return STATUS_SUCCESS;
-    }
+    PAGED_CODE();
     
     OBJECT_ATTRIBUTES objAttr;
     IO_STATUS_BLOCK ioStatus;
@@ -556,61 +3124,215 @@ NTSTATUS CCavernMiniportWaveRTStream::ConnectPipe()
     );
     
     if (NT_SUCCESS(status)) {
-        m_PipeConnected = TRUE;
-        KdPrint(("CavernAudio: Pipe connected\n"));
+        m_ulPipeOpenCount++;
+        KdPrint(("CavernAudio: Pipe connected (open #%u)\n", m_ulPipeOpenCount));
     } else {
+        m_hPipe = NULL;
         KdPrint(("CavernAudio: Pipe connect failed 0x%08X\n", status));
     }
     
-    KeReleaseSpinLock(&m_PipeLock, oldIrql);
     return status;
 }
 
-VOID CCavernMiniportWaveRTStream::DisconnectPipe()
+VOID CCavernPipeOutput::ClosePipe()
 {
-    KIRQL oldIrql;
-    KeAcquireSpinLock(&m_PipeLock, &oldIrql);
+    PAGED_CODE();
     
     if (m_hPipe) {
         ZwClose(m_hPipe);
         m_hPipe = NULL;
-        m_PipeConnected = FALSE;
         KdPrint(("CavernAudio: Pipe disconnected\n"));
     }
-    
-    KeReleaseSpinLock(&m_PipeLock, oldIrql);
 }
 
-NTSTATUS CCavernMiniportWaveRTStream::ForwardToPipe(_In_reads_bytes_(Length) PVOID Buffer, _In_ ULONG Length)
+//
+// The page is a pagefile-backed section, so the consumer can open it by
+// name and map it read-only: the DACL gives everyone SECTION_MAP_READ and
+// only the system more. The driver's view is locked through an MDL, as
+// the timer DPCs write it at DISPATCH_LEVEL.
+//
+NTSTATUS CCavernPipeOutput::CreateRegister()
 {
-    if (!m_PipeConnected || !m_hPipe) {
-        if (!NT_SUCCESS(ConnectPipe())) {
-            return STATUS_DEVICE_NOT_CONNECTED;
+    PAGED_CODE();
+    
+    UNICODE_STRING name;
+    OBJECT_ATTRIBUTES objAttr;
+    SECURITY_DESCRIPTOR descriptor;
+    LARGE_INTEGER sectionSize;
+    SIZE_T viewSize = 0;
+    NTSTATUS status;
+    
+    ULONG aclSize = sizeof(ACL) +
+        2 * FIELD_OFFSET(ACCESS_ALLOWED_ACE, SidStart) +
+        RtlLengthSid(SeExports->SeLocalSystemSid) +
+        RtlLengthSid(SeExports->SeWorldSid);
+    
+    PACL acl = (PACL)ExAllocatePool2(POOL_FLAG_PAGED, aclSize, CAVERN_POSITION_REGISTER_POOLTAG);
+    if (!acl) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    status = RtlCreateAcl(acl, aclSize, ACL_REVISION);
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_ALL_ACCESS, SeExports->SeLocalSystemSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlAddAccessAllowedAce(acl, ACL_REVISION, SECTION_MAP_READ | SECTION_QUERY, SeExports->SeWorldSid);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlCreateSecurityDescriptor(&descriptor, SECURITY_DESCRIPTOR_REVISION);
+    }
+    if (NT_SUCCESS(status)) {
+        status = RtlSetDaclSecurityDescriptor(&descriptor, TRUE, acl, FALSE);
+    }
+    
+    if (NT_SUCCESS(status)) {
+        RtlInitUnicodeString(&name, CAVERN_POSITION_SECTION_NAME);
+        InitializeObjectAttributes(&objAttr, &name, OBJ_KERNEL_HANDLE, NULL, &descriptor);
+        sectionSize.QuadPart = PAGE_SIZE;
+        
+        status = ZwCreateSection(
+            &m_hRegisterSection,
+            SECTION_ALL_ACCESS,
+            &objAttr,
+            &sectionSize,
+            PAGE_READWRITE,
+            SEC_COMMIT,
+            NULL
+        );
+    }
+    
+    // The section holds its own copy of the descriptor
+    ExFreePoolWithTag(acl, CAVERN_POSITION_REGISTER_POOLTAG);
+    
+    if (!NT_SUCCESS(status)) {
+        // A second Cavern device finds the name taken and runs without
+        KdPrint(("CavernAudio: No consumer position page (0x%08X)\n", status));
+        m_hRegisterSection = NULL;
+        return status;
+    }
+    
+    status = ObReferenceObjectByHandle(m_hRegisterSection, SECTION_MAP_WRITE, NULL, KernelMode, &m_pRegisterSection, NULL);
+    if (NT_SUCCESS(status)) {
+        status = MmMapViewInSystemSpace(m_pRegisterSection, &m_pRegisterView, &viewSize);
+    }
+    
+    if (NT_SUCCESS(status)) {
+        m_pRegisterMdl = IoAllocateMdl(m_pRegisterView, PAGE_SIZE, FALSE, FALSE, NULL);
+        status = m_pRegisterMdl ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    if (NT_SUCCESS(status)) {
+        __try {
+            MmProbeAndLockPages(m_pRegisterMdl, KernelMode, IoWriteAccess);
+        } __except (EXCEPTION_EXECUTE_HANDLER) {
+            status = GetExceptionCode();
+            IoFreeMdl(m_pRegisterMdl);
+            m_pRegisterMdl = NULL;
         }
     }
     
+    if (NT_SUCCESS(status)) {
+        m_pRegister = (PCAVERN_POSITION_REGISTER)MmGetSystemAddressForMdlSafe(
+            m_pRegisterMdl, NormalPagePriority | MdlMappingNoExecute);
+        status = m_pRegister ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+    }
+    
+    if (!NT_SUCCESS(status)) {
+        KdPrint(("CavernAudio: Consumer position page not mapped (0x%08X)\n", status));
+        DeleteRegister();
+        return status;
+    }
+    
+    // The section comes zeroed, which is a valid, even sequence
+    LARGE_INTEGER frequency;
+    KeQueryPerformanceCounter(&frequency);
+    m_pRegister->Version = CAVERN_POSITION_REGISTER_VERSION;
+    m_pRegister->QpcFrequency = frequency.QuadPart;
+    
+    return STATUS_SUCCESS;
+}
+
+//
+// Nothing publishes any more: the output is closed and the timers gone.
+// A consumer still holding a view keeps the page until it unmaps.
+//
+VOID CCavernPipeOutput::DeleteRegister()
+{
+    PAGED_CODE();
+    
+    m_pRegister = NULL;
+    
+    if (m_pRegisterMdl) {
+        MmUnlockPages(m_pRegisterMdl);
+        IoFreeMdl(m_pRegisterMdl);
+        m_pRegisterMdl = NULL;
+    }
+    if (m_pRegisterView) {
+        MmUnmapViewInSystemSpace(m_pRegisterView);
+        m_pRegisterView = NULL;
+    }
+    if (m_pRegisterSection) {
+        ObDereferenceObject(m_pRegisterSection);
+        m_pRegisterSection = NULL;
+    }
+    if (m_hRegisterSection) {
+        ZwClose(m_hRegisterSection);
+        m_hRegisterSection = NULL;
+    }
+}
+#pragma code_seg()
+
+//=============================================================================
+// CavernTimerNotify - 1 ms timer standing in for the DMA engine
+//=============================================================================
+void CavernTimerNotify(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID DeferredContext
+)
+{
+    UNREFERENCED_PARAMETER(Timer);
+    
+    _IRQL_limited_to_(DISPATCH_LEVEL);
+    
+    CCavernMiniportWaveRTStream *_this = (CCavernMiniportWaveRTStream *)DeferredContext;
+    if (!_this) {
+        return;
+    }
+    
     KIRQL oldIrql;
-    KeAcquireSpinLock(&m_PipeLock, &oldIrql);
+    KeAcquireSpinLock(&_this->m_PositionLock, &oldIrql);
     
-    if (!m_hPipe) {
-        KeReleaseSpinLock(&m_PipeLock, oldIrql);
-        return STATUS_DEVICE_NOT_CONNECTED;
+    if (_this->m_Running) {
+        _this->UpdatePosition(KeQueryPerformanceCounter(NULL));
     }
     
-    IO_STATUS_BLOCK ioStatus;
-    NTSTATUS status = ZwWriteFile(
-        m_hPipe,
-        NULL,
-        NULL,
-        NULL,
-        &ioStatus,
-        Buffer,
-        Length,
-        NULL,
-        NULL
-    );
+    KeReleaseSpinLock(&_this->m_PositionLock, oldIrql);
+}
+
+//=============================================================================
+// CavernMixTimerNotify - 1 ms timer that sums the PCM streams
+//=============================================================================
+void CavernMixTimerNotify(
+    _In_ PEX_TIMER Timer,
+    _In_opt_ PVOID DeferredContext
+)
+{
+    UNREFERENCED_PARAMETER(Timer);
     
-    KeReleaseSpinLock(&m_PipeLock, oldIrql);
+    _IRQL_limited_to_(DISPATCH_LEVEL);
     
-    return status;
+    CCavernMiniportWaveRT *_this = (CCavernMiniportWaveRT *)DeferredContext;
+    if (!_this) {
+        return;
+    }
+    
+    KIRQL oldIrql;
+    KeAcquireSpinLock(&_this->m_MixLock, &oldIrql);
+    
+    if (_this->m_ulMixRunning) {
+        _this->MixOutput(KeQueryPerformanceCounter(NULL));
+    }
+    
+    KeReleaseSpinLock(&_this->m_MixLock, oldIrql);
 }
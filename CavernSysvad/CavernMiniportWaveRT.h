@@ -14,21 +14,289 @@
 #include <stdunk.h>
 #include <ks.h>
 #include <ksmedia.h>
+#include "CavernFrameAligner.h"
+#include "CavernCaptureQueue.h"
+#include "CavernPositionRegister.h"
+#include "CavernStreamState.h"
+#include "CavernPacketState.h"
+#include "CavernResampler.h"
+#include "CavernSilenceGate.h"
+#include "CavernStreamMixer.h"
+#include "CavernMatrixMixer.h"
+#include "CavernDelayLine.h"
+#include "CavernBiquadCascade.h"
+#include "CavernConvolver.h"
+#include "CavernLimiter.h"
 
 // Pool tag
 #define CAVERN_WAVERT_POOLTAG 'navC'
 
+// Position timer period (100ns units)
+#define CAVERN_TIMER_PERIOD_HNS 10000
+
+// Packets per DMA buffer in packet (SetWritePacket) mode
+#define CAVERN_PACKETS_PER_BUFFER 2
+
+// Pipe writer queue: how long a stalled pipe server is absorbed before
+// forwards are dropped, and the smallest slot. A slot holds at least one
+// timer period of output, as every tick publishes its last partial slot.
+#define CAVERN_PIPE_QUEUE_MS 250
+#define CAVERN_PIPE_MIN_SLOT_BYTES 512
+
+// Most the pipe writer hands to one ZwWriteFile
+#define CAVERN_PIPE_MAX_WRITE (64 * 1024)
+
+// The pipe writer looks at the queue at least this often, and retries a
+// missing pipe server this often
+#define CAVERN_PIPE_WRITER_PERIOD_MS 10
+#define CAVERN_PIPE_RETRY_MS 500
+
+// A write the server has not taken within this is cancelled and the pipe
+// dropped, so a server that stopped reading cannot hold up STOP or Close
+#define CAVERN_PIPE_WRITE_TIMEOUT_MS 250
+
+// Rate the speaker network runs at; PCM at any other rate is converted
+#define CAVERN_NETWORK_SAMPLE_RATE 48000
+
+// Input rates the render pin offers, all checked by the DSP bench src suite
+#define CAVERN_MIN_SAMPLE_RATE 8000
+#define CAVERN_MAX_SAMPLE_RATE 192000
+
+// Output frames per resampler call
+#define CAVERN_RESAMPLE_FRAMES 256
+
+// Largest PCM frame: 16 channels of 32-bit samples
+#define CAVERN_MAX_FRAME_BYTES (CAVERN_MAX_CHANNELS * 4)
+
+// Largest sample magnitude (16-bit LSBs) the silence gate still treats as
+// idle; 0 only suppresses digital zero, so the idle stream is lossless
+#define CAVERN_SILENCE_THRESHOLD 0
+
+// Frames the mix timer sums per pass
+#define CAVERN_MIX_BLOCK_FRAMES 256
+
+// Gain of one PCM stream in the mix, a property of its render pin
+// instance. The stream's mix slot opens at it and follows every change;
+// bitstreams keep it but pass through untouched.
+// {EA01FBE2-272C-44FB-B729-42EE4A20B5EA}
+#define STATIC_KSPROPSETID_CavernStream\
+    0xea01fbe2, 0x272c, 0x44fb, 0xb7, 0x29, 0x42, 0xee, 0x4a, 0x20, 0xb5, 0xea
+DEFINE_GUIDSTRUCT("EA01FBE2-272C-44FB-B729-42EE4A20B5EA", KSPROPSETID_CavernStream);
+#define KSPROPSETID_CavernStream DEFINE_GUIDNAMED(KSPROPSETID_CavernStream)
+
+typedef enum _KSPROPERTY_CAVERN_STREAM {
+    KSPROPERTY_CAVERN_STREAM_VOLUMELEVEL = 0,   // LONG, 1/65536 dB as KSPROPERTY_AUDIO_VOLUMELEVEL
+    KSPROPERTY_CAVERN_STREAM_MUTE               // BOOL
+} KSPROPERTY_CAVERN_STREAM;
+
+// Stream volume range and step, 1/65536 dB
+#define CAVERN_STREAM_VOLUME_MIN (-96 * 65536)
+#define CAVERN_STREAM_VOLUME_MAX 0
+#define CAVERN_STREAM_VOLUME_STEP (65536 / 2)
+
+// Most the mix timer catches up in one tick; a longer stall is skipped
+#define CAVERN_MIX_MAX_CATCHUP_MS 100
+
+// Service Parameters key holding the per-speaker delays: REG_BINARY, one
+// DWORD of microseconds per mix channel, in channel mask order
+#define CAVERN_PARAMETERS_KEY L"CavernAudio\\Parameters"
+#define CAVERN_CHANNEL_DELAYS_VALUE L"ChannelDelays"
+
+// Room correction settings of the filter, changed while it runs; the
+// registry values above are only read when the device starts.
+// {6C002906-68DD-4090-AB2F-9FF893DFE4A8}
+#define STATIC_KSPROPSETID_CavernRoom\
+    0x6c002906, 0x68dd, 0x4090, 0xab, 0x2f, 0x9f, 0xf8, 0x93, 0xdf, 0xe4, 0xa8
+DEFINE_GUIDSTRUCT("6C002906-68DD-4090-AB2F-9FF893DFE4A8", KSPROPSETID_CavernRoom);
+#define KSPROPSETID_CavernRoom DEFINE_GUIDNAMED(KSPROPSETID_CavernRoom)
+
+typedef enum _KSPROPERTY_CAVERN_ROOM {
+    KSPROPERTY_CAVERN_ROOM_CHANNEL_DELAYS = 0,  // ULONG[], as ChannelDelays
+    KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ           // CAVERN_EQ_FILTER[], as ChannelEq
+} KSPROPERTY_CAVERN_ROOM;
+
+// Room EQ in the same key: REG_BINARY, an array of CAVERN_EQ_FILTER. Each
+// filter takes the next free band of every channel in its mask.
+#define CAVERN_CHANNEL_EQ_VALUE L"ChannelEq"
+#define CAVERN_EQ_MAX_FILTERS 64
+
+typedef struct _CAVERN_EQ_FILTER {
+    ULONG   ChannelMask;        // bit 0: first mix channel
+    ULONG   Type;               // CAVERN_BIQUAD_TYPE
+    ULONG   FrequencyHz;
+    LONG    GainCentiDb;        // 1/100 dB
+    ULONG   QMilli;             // Q x 1000
+} CAVERN_EQ_FILTER, *PCAVERN_EQ_FILTER;
+
+typedef struct _CAVERN_EQ_SETTINGS {
+    ULONG               Count;
+    CAVERN_EQ_FILTER    Filters[CAVERN_EQ_MAX_FILTERS];
+} CAVERN_EQ_SETTINGS, *PCAVERN_EQ_SETTINGS;
+
+// Room correction FIR in the same key: REG_SZ path (\??\C:\...) of a raw
+// file of float32 taps, one per mix channel per frame in channel mask
+// order. Read when a mix opens, up to CAVERN_CONVOLVER_MAX_TAPS frames.
+#define CAVERN_ROOM_FILTER_VALUE L"RoomFilter"
+#define CAVERN_ROOM_FILTER_MAX_PATH 260
+
+// The room filter's convolution block is the largest power of two within
+// this period, which is all the latency it adds
+#define CAVERN_ROOM_FILTER_PERIOD_MS 10
+
+// Brickwall limiter ahead of the integer conversion: look-ahead (all the
+// latency it adds), release time constant and true-peak ceiling
+#define CAVERN_OUTPUT_LIMITER_LOOKAHEAD_US 1000
+#define CAVERN_OUTPUT_LIMITER_RELEASE_MS 50
+#define CAVERN_OUTPUT_LIMITER_CEILING_CENTIDB -30
+
+// Limiter mode in the same key: REG_DWORD, a CAVERN_LIMITER_MODE
+#define CAVERN_LIMITER_MODE_VALUE L"LimiterMode"
+
+typedef enum _CAVERN_LIMITER_MODE {
+    CavernLimiterLinked = 0,    // one gain for all channels (default)
+    CavernLimiterUnlinked,      // each channel limited on its own
+    CavernLimiterOff
+} CAVERN_LIMITER_MODE;
+
+// Mix speaker layout in the same key: REG_DWORD, a CAVERN_LAYOUT_ID. Without
+// it the mix takes the smallest standard layout covering its first stream.
+#define CAVERN_MIX_LAYOUT_VALUE L"MixLayout"
+
 // Forward declarations
 class CCavernMiniportWaveRT;
 class CCavernMiniportWaveRTStream;
+class CCavernPipeOutput;
 
 typedef CCavernMiniportWaveRT *PCCavernMiniportWaveRT;
 typedef CCavernMiniportWaveRTStream *PCCavernMiniportWaveRTStream;
+typedef CCavernPipeOutput *PCCavernPipeOutput;
+
+EXT_CALLBACK CavernTimerNotify;
+EXT_CALLBACK CavernMixTimerNotify;
+
+//=============================================================================
+// CCavernPipeOutput - Frame aligner, silence gate and pipe connection
+//=============================================================================
+//
+// The pipe server takes one connection, so the miniport has one output:
+// either a bitstream stream owns it, or the mix of all PCM streams feeds
+// it. Only one of them pushes at a time.
+//
+// Pushes come from the timer DPCs, where the pipe cannot be touched: the
+// forwarded data is copied into a slot queue and a PASSIVE_LEVEL writer
+// thread, which owns the pipe handle, connects and writes.
+//
+class CCavernPipeOutput
+{
+public:
+    CCavernPipeOutput();
+    ~CCavernPipeOutput();
+    
+    // Sets up forwarding for the given format and starts the writer,
+    // which pre-warms the pipe. PASSIVE_LEVEL.
+    NTSTATUS Open(_In_ PWAVEFORMATEXTENSIBLE Format);
+    
+    // Forwards what is still staged, lets the writer drain it and
+    // disconnects. PASSIVE_LEVEL.
+    VOID Close();
+    
+    NTSTATUS Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    VOID Flush();
+    
+    // Starts the first-byte measurement from RunStartQpc.
+    VOID ArmFirstByte(_In_ LONGLONG RunStartQpc, _In_ LONGLONG PerfFrequency);
+    
+    BOOLEAN IsOpen() const { return m_Open; }
+    
+    // Has the writer connect now rather than at its next retry.
+    NTSTATUS ConnectPipe();
+    
+    // Queues Length bytes for the writer as one packet of Type (see
+    // CavernPipePacket.h), whole or not at all. Any IRQL up to
+    // DISPATCH_LEVEL; never waits.
+    NTSTATUS ForwardToPipe(
+        _In_ CAVERN_PIPE_PACKET_TYPE Type,
+        _In_reads_bytes_(Length) PVOID Buffer,
+        _In_ ULONG Length
+    );
+    
+    // Time from the last armed SetState(KSSTATE_RUN) to the first byte
+    // written to the pipe, in 100ns units. Zero until that write completes.
+    ULONGLONG GetFirstByteLatency() { return m_hnsFirstByteLatency; }
+    
+    // Creates and locks the named register page the consumer maps, and
+    // deletes it again (see CavernPositionRegister.h). PASSIVE_LEVEL; the
+    // output works without the page.
+    NTSTATUS CreateRegister();
+    VOID DeleteRegister();
+    
+    // Publishes the output position to the consumer's page. Called by the
+    // owner of the output only, at any IRQL up to DISPATCH_LEVEL.
+    VOID PublishPosition(_In_ ULONGLONG LinearPosition, _In_ LONGLONG Qpc, _In_ LONGLONG PacketCount);
+
+private:
+    NTSTATUS InitAligner(_In_ PWAVEFORMATEXTENSIBLE Format);
+    NTSTATUS InitSilenceGate(_In_ PWAVEFORMATEXTENSIBLE Format);
+    static NTSTATUS AlignerSink(_In_ PVOID Context, _In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    static NTSTATUS GateSink(_In_ PVOID Context, _In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    static NTSTATUS MarkerSink(_In_ PVOID Context, _In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    
+    // Writer thread, PASSIVE_LEVEL
+    NTSTATUS StartWriter(_In_ PWAVEFORMATEXTENSIBLE Format);
+    VOID StopWriter();
+    static KSTART_ROUTINE WriterThread;
+    VOID DrainQueue();
+    NTSTATUS OpenPipe();
+    VOID ClosePipe();
+    
+    BOOLEAN                   m_Open;
+    UNICODE_STRING            m_PipeName;
+    
+    // Cuts forwarded data at PCM/codec frame boundaries
+    CCavernFrameAligner       m_Aligner;
+    
+    // Replaces long runs of silence after the aligner with compact markers
+    CCavernSilenceGate        m_SilenceGate;
+    
+    // DPC to writer hand-off. The pipe handle and the retry time belong
+    // to the writer thread alone.
+    CCavernCaptureQueue       m_Queue;
+    PKTHREAD                  m_pWriterThread;
+    KEVENT                    m_WakeEvent;
+    volatile LONG             m_lStopWriter;
+    volatile LONG             m_lConnectNow;
+    HANDLE                    m_hPipe;
+    ULONGLONG                 m_ullNextConnect;
+    ULONGLONG                 m_ullReportedDrops;
+    
+    // First-byte instrumentation
+    LONGLONG                  m_llRunStartQpc;
+    LONGLONG                  m_llPerfFrequency;
+    BOOLEAN                   m_FirstByteDelivered;
+    ULONGLONG                 m_hnsFirstByteLatency;
+    ULONG                     m_ulPipeOpenCount;
+    
+    // Consumer's register page: the section, its system view, and the MDL
+    // that keeps the page resident for the DPCs
+    HANDLE                    m_hRegisterSection;
+    PVOID                     m_pRegisterSection;
+    PVOID                     m_pRegisterView;
+    PMDL                      m_pRegisterMdl;
+    PCAVERN_POSITION_REGISTER m_pRegister;
+};
+
+// Event the audio engine registered, set each time a packet completes
+typedef struct _CAVERN_NOTIFICATION_ENTRY {
+    LIST_ENTRY  ListEntry;
+    PKEVENT     Event;
+} CAVERN_NOTIFICATION_ENTRY, *PCAVERN_NOTIFICATION_ENTRY;
 
 //=============================================================================
 // CCavernMiniportWaveRTStream - Stream class
 //=============================================================================
-class CCavernMiniportWaveRTStream : public CUnknown
+class CCavernMiniportWaveRTStream : public IMiniportWaveRTStreamNotification,
+                                    public IMiniportWaveRTOutputStream,
+                                    public CUnknown
 {
 public:
     // IUnknown
@@ -49,40 +317,138 @@ public:
         _In_ PKSDATAFORMAT DataFormat
     );
     
-    // WaveRT Stream methods
+    // IMiniportWaveRTStream
+    STDMETHODIMP_(NTSTATUS) SetFormat(_In_ PKSDATAFORMAT DataFormat);
     STDMETHODIMP_(NTSTATUS) SetState(_In_ KSSTATE State);
     STDMETHODIMP_(NTSTATUS) GetPosition(_Out_ PKSAUDIO_POSITION Position);
     STDMETHODIMP_(NTSTATUS) AllocateAudioBuffer(
-        _In_ ULONG BufferSize,
-        _Out_ PVOID *Buffer,
-        _Out_ PULONG OffsetFromFirstPage,
-        _Out_ PULONG ActualBufferSize
+        _In_ ULONG RequestedSize,
+        _Out_ PMDL *AudioBufferMdl,
+        _Out_ ULONG *ActualSize,
+        _Out_ ULONG *OffsetFromFirstPage,
+        _Out_ MEMORY_CACHING_TYPE *CacheType
     );
-    STDMETHODIMP_(VOID) FreeAudioBuffer(_In_opt_ PVOID Buffer);
-    STDMETHODIMP_(NTSTATUS) GetClockRegister(_Out_ PKSRTAUDIO_HWREGISTER Register);
+    STDMETHODIMP_(VOID) FreeAudioBuffer(_In_opt_ PMDL AudioBufferMdl, _In_ ULONG BufferSize);
+    STDMETHODIMP_(VOID) GetHWLatency(_Out_ PKSRTAUDIO_HWLATENCY Latency);
     STDMETHODIMP_(NTSTATUS) GetPositionRegister(_Out_ PKSRTAUDIO_HWREGISTER Register);
+    STDMETHODIMP_(NTSTATUS) GetClockRegister(_Out_ PKSRTAUDIO_HWREGISTER Register);
+    
+    // IMiniportWaveRTStreamNotification
+    STDMETHODIMP_(NTSTATUS) AllocateBufferWithNotification(
+        _In_ ULONG NotificationCount,
+        _In_ ULONG RequestedSize,
+        _Out_ PMDL *AudioBufferMdl,
+        _Out_ ULONG *ActualSize,
+        _Out_ ULONG *OffsetFromFirstPage,
+        _Out_ MEMORY_CACHING_TYPE *CacheType
+    );
+    STDMETHODIMP_(VOID) FreeBufferWithNotification(_In_ PMDL AudioBufferMdl, _In_ ULONG BufferSize);
+    STDMETHODIMP_(NTSTATUS) RegisterNotificationEvent(_In_ PKEVENT NotificationEvent);
+    STDMETHODIMP_(NTSTATUS) UnregisterNotificationEvent(_In_ PKEVENT NotificationEvent);
+    
+    // IMiniportWaveRTOutputStream (packet mode)
     STDMETHODIMP_(NTSTATUS) SetWritePacket(_In_ ULONG PacketNumber, _In_ DWORD Flags, _In_ ULONG EosPacketLength);
-    STDMETHODIMP_(NTSTATUS) GetReadPacket(_Out_ ULONG *PacketNumber, _Out_ DWORD *Flags, _Out_ ULONG *EosPacketLength);
+    STDMETHODIMP_(NTSTATUS) GetOutputStreamPresentationPosition(_Out_ KSAUDIO_PRESENTATION_POSITION *PresentationPosition);
+    STDMETHODIMP_(NTSTATUS) GetPacketCount(_Out_ ULONG *PacketCount);
     
-    // Pipe forwarding
-    NTSTATUS ConnectPipe();
-    VOID DisconnectPipe();
-    NTSTATUS ForwardToPipe(_In_reads_bytes_(Length) PVOID Buffer, _In_ ULONG Length);
+    // Buffer for either allocation path, split into Packets packets
+    NTSTATUS AllocateBuffer(
+        _In_ ULONG Packets,
+        _In_ ULONG RequestedSize,
+        _Out_ PMDL *AudioBufferMdl,
+        _Out_ ULONG *ActualSize,
+        _Out_ ULONG *OffsetFromFirstPage,
+        _Out_ MEMORY_CACHING_TYPE *CacheType
+    );
+    VOID SignalNotifications();
+    
+    // Forwarding
     VOID WriteBytes(_In_ ULONG ByteDisplacement);
+    VOID UpdatePosition(_In_ LARGE_INTEGER Qpc);
+    NTSTATUS AcquireOutput();
+    VOID ReleaseOutput();
+    NTSTATUS InitResampler();
+    VOID CleanupResampler();
+    VOID MixBytes(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+    VOID ResampleFrames(_In_reads_bytes_opt_(Frames * m_Resampler.GetFrameSize()) const BYTE *Buffer, _In_ SIZE_T Frames);
+    VOID MixFrames(_In_reads_bytes_(Frames * m_pWfExt->Format.nBlockAlign) const BYTE *Buffer, _In_ SIZE_T Frames);
+    VOID MixFloat(_In_reads_(Frames * m_pWfExt->Format.nChannels) const float *Samples, _In_ SIZE_T Frames);
+    NTSTATUS InitRoute();
+    VOID CleanupRoute();
+    CAVERN_SAMPLE_FORMAT GetSampleFormat();
+    VOID CompleteEndOfStream();
+    
+    // Stream volume and mute (KSPROPSETID_CavernStream), applied to the
+    // mix slot through the miniport
+    VOID SetGain(_In_ LONG VolumeLevel, _In_ BOOLEAN Mute);
+    LONG GetVolumeLevel() { return m_lVolumeLevel; }
+    BOOLEAN IsMuted() { return m_bMute; }
+    LONG GetMixSlot() { return m_lMixSlot; }
+    
+    // PCM streams are mixed with the others; bitstreams own the output.
+    BOOLEAN IsMixed() { return m_bMixed; }
+    PWAVEFORMATEXTENSIBLE GetFormat() { return m_pWfExt; }
+    
+    // Rate the stream reaches the mix or the output at
+    ULONG GetOutputRate();
+    
+    friend EXT_CALLBACK CavernTimerNotify;
 
 private:
     PCCavernMiniportWaveRT    m_pMiniport;
     PPORTWAVERTSTREAM         m_pPortStream;
     KSSTATE                   m_State;
     BOOLEAN                   m_Running;
-    PVOID                     m_pDmaBuffer;
+    PVOID                     m_pDmaBuffer;         // system mapping of m_pDmaMdl
+    PMDL                      m_pDmaMdl;
     ULONG                     m_ulDmaBufferSize;
     ULONGLONG                 m_ullLinearPosition;
     PWAVEFORMATEXTENSIBLE     m_pWfExt;
-    HANDLE                    m_hPipe;
-    UNICODE_STRING            m_PipeName;
-    KSPIN_LOCK                m_PipeLock;
-    BOOLEAN                   m_PipeConnected;
+    BOOLEAN                   m_bMixed;
+    BOOLEAN                   m_bOutputAcquired;
+    BOOLEAN                   m_bMixStarted;
+    
+    // Position timer (emulates the DMA engine)
+    PEX_TIMER                 m_pTimer;
+    BOOLEAN                   m_bTimerRunning;
+    KSPIN_LOCK                m_PositionLock;
+    LARGE_INTEGER             m_PerfFrequency;
+    ULONG                     m_ulDmaMovementRate;
+    ULONGLONG                 m_hnsDmaTimeStamp;
+    ULONGLONG                 m_hnsElapsedTimeCarryForward;
+    ULONG                     m_ulByteDisplacementCarryForward;
+    
+    // Converts PCM to CAVERN_NETWORK_SAMPLE_RATE between the DMA ring and
+    // the mixer, writing float into m_pMixBuffer
+    CCavernResampler          m_Resampler;
+    
+    // Slot of a PCM stream in the miniport's mixer, and the float staging
+    // it is written through; a frame split across two runs of the DMA ring
+    // waits in the carry.
+    LONG                      m_lMixSlot;
+    LONG                      m_lVolumeLevel;
+    BOOLEAN                   m_bMute;
+    CAVERN_CONVERTER          m_Converter;
+    float                    *m_pMixBuffer;
+    
+    // Takes each channel to the mix speaker it is tagged for, or folds it
+    // into its neighbours when the mix has no such speaker; NULL buffer
+    // when the stream is already in the mix layout
+    CCavernChannelRouter      m_Router;
+    float                    *m_pRouteBuffer;
+    BYTE                      m_FrameCarry[CAVERN_MAX_FRAME_BYTES];
+    ULONG                     m_ulFrameCarryBytes;
+    
+    // Packet mode and end of stream, under m_PositionLock
+    CAVERN_PACKET_STATE       m_Packets;
+    
+    // Event mode: packets per buffer (0 without notifications) and the
+    // registered events, under m_PositionLock
+    ULONG                     m_ulNotificationsPerBuffer;
+    LIST_ENTRY                m_NotificationList;
+    
+    // Position/clock register page, one PAGE_SIZE allocation
+    PCAVERN_POSITION_REGISTER m_pRegisters;
 };
 
 //=============================================================================
@@ -99,7 +465,7 @@ public:
     // IMiniportWaveRT
     STDMETHODIMP_(NTSTATUS) GetDescription(_Out_ PPCFILTER_DESCRIPTOR *Description);
     STDMETHODIMP_(NTSTATUS) NewStream(
-        _Out_ PMiniportWaveRTStream *Stream,
+        _Out_ PMINIPORTWAVERTSTREAM *Stream,
         _In_ PPORTWAVERTSTREAM PortStream,
         _In_ ULONG Pin,
         _In_ BOOLEAN Capture,
@@ -124,7 +490,7 @@ public:
         _In_ PKSOFFLOAD_PIN_OFFLOAD Stream
     );
     STDMETHODIMP_(NTSTATUS) GetStreamCount(_Out_ PULONG StreamCount);
-    STDMETHODIMP_(NTSTATUS) GetStream(_In_ ULONG StreamIndex, _Out_ PMiniportWaveRTStream *Stream);
+    STDMETHODIMP_(NTSTATUS) GetStream(_In_ ULONG StreamIndex, _Out_ PMINIPORTWAVERTSTREAM *Stream);
     STDMETHODIMP_(NTSTATUS) GetPerformanceCounters(_Out_ PKSAUDIOMODULE_PERFORMANCE_COUNTERS Counters);
     STDMETHODIMP_(NTSTATUS) ValidateFormat(_In_ PKSDATAFORMAT Format, _In_ ULONG PinId);
     
@@ -138,10 +504,95 @@ public:
     // Stream management
     NTSTATUS StreamCreated(_In_ PCCavernMiniportWaveRTStream Stream);
     NTSTATUS StreamClosed(_In_ PCCavernMiniportWaveRTStream Stream);
+    
+    // Output ownership, from SetState. A bitstream stream opens the output
+    // for itself; PCM streams join the mix, which opens it for the first
+    // and closes it after the last.
+    NTSTATUS OpenExclusiveOutput(_In_ PCCavernMiniportWaveRTStream Stream);
+    VOID CloseExclusiveOutput(_In_ PCCavernMiniportWaveRTStream Stream);
+    NTSTATUS JoinMix(_In_ PCCavernMiniportWaveRTStream Stream, _Out_ PLONG Slot);
+    VOID LeaveMix(_Inout_ PLONG Slot);
+    
+    // Passes the stream's current gain to its mix slot, if it has one
+    VOID UpdateMixGain(_In_ PCCavernMiniportWaveRTStream Stream);
+    VOID StartMix();
+    VOID StopMix();
+    VOID MixOutput(_In_ LARGE_INTEGER Qpc);
+    
+    // Delays each mix channel (speaker) by the given time, from the next
+    // mix block on. Channels from Count on are not delayed. The delays are
+    // kept for later mixes. Set through KSPROPERTY_CAVERN_ROOM_CHANNEL_DELAYS.
+    VOID SetChannelDelays(_In_reads_(Count) const ULONG *Microseconds, _In_ ULONG Count);
+    VOID GetChannelDelays(_Out_writes_(CAVERN_MAX_CHANNELS) PULONG Microseconds);
+    
+    // Replaces the room EQ filters, from the next mix block on. They are
+    // kept for later mixes and redesigned for each mix rate. Set through
+    // KSPROPERTY_CAVERN_ROOM_CHANNEL_EQ; Get returns how many are stored.
+    VOID SetChannelEq(_In_reads_(Count) const CAVERN_EQ_FILTER *Filters, _In_ ULONG Count);
+    ULONG GetChannelEq(_Out_writes_(CAVERN_EQ_MAX_FILTERS) PCAVERN_EQ_FILTER Filters);
+    
+    PCCavernPipeOutput GetOutput() { return &m_Output; }
+    CCavernStreamMixer *GetMixer() { return &m_Mixer; }
+    
+    // Speakers of the open mix, in channel order
+    CAVERN_LAYOUT_ID GetMixLayout() { return m_MixLayout; }
+    
+    friend EXT_CALLBACK CavernMixTimerNotify;
 
 private:
+    VOID ReadChannelDelays();
+    VOID ApplyChannelDelays();
+    VOID ReadChannelEq();
+    VOID ApplyChannelEq();
+    VOID ReadRoomFilterPath();
+    VOID LoadRoomFilter();
+    VOID ReadLimiterMode();
+    VOID ReadMixLayout();
+    
     PPORTWAVERT                  m_pPort;
-    PCCavernMiniportWaveRTStream m_pStream;
+    
+    // Open streams; slots are claimed and cleared with interlocked
+    // exchanges. A bitstream stream is admitted only alone.
+    PCCavernMiniportWaveRTStream volatile m_pStreams[CAVERN_MIXER_MAX_STREAMS];
+    PCCavernMiniportWaveRTStream volatile m_pExclusiveStream;
+    
+    // Serializes output open/close and mix start/stop (PASSIVE_LEVEL)
+    KMUTEX                       m_OutputMutex;
+    CCavernPipeOutput            m_Output;
+    
+    // Sums the PCM streams on its own timer into the output
+    CCavernStreamMixer           m_Mixer;
+    ULONG                        m_ulMixStreams;
+    ULONG                        m_ulMixRunning;
+    PEX_TIMER                    m_pMixTimer;
+    KSPIN_LOCK                   m_MixLock;
+    WAVEFORMATEXTENSIBLE         m_MixFormat;
+    CAVERN_LAYOUT_ID             m_MixLayout;
+    ULONG                        m_ulMixLayoutSetting;  // CavernLayoutCount: follow the first stream
+    CCavernRequantizer           m_MixRequantizer;
+    
+    // Room EQ, room correction FIR and speaker time alignment on the
+    // summed output
+    CCavernBiquadCascade         m_Eq;
+    CAVERN_EQ_SETTINGS           m_EqSettings;
+    CCavernConvolver             m_RoomFilter;
+    WCHAR                        m_szRoomFilterPath[CAVERN_ROOM_FILTER_MAX_PATH];
+    CCavernDelayLine             m_DelayLine;
+    ULONG                        m_ulChannelDelaysUs[CAVERN_MAX_CHANNELS];
+    
+    // Keeps the summed output under full scale for the integer formats
+    CCavernLimiter               m_Limiter;
+    ULONG                        m_ulLimiterMode;
+    
+    float                       *m_pMixBlock;
+    PBYTE                        m_pMixBytes;
+    LARGE_INTEGER                m_PerfFrequency;
+    LONGLONG                     m_llMixStartQpc;
+    ULONGLONG                    m_ullMixedFrames;
+    
+    // Bytes the mix has forwarded since the output opened, for the
+    // consumer's position page; unlike m_ullMixedFrames it survives PAUSE
+    ULONGLONG                    m_ullMixForwardedBytes;
 };
 
 // Create function
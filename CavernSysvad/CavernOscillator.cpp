@@ -0,0 +1,183 @@
+/***************************************************************************
+ * CavernOscillator.cpp
+ *
+ * Phase-accumulator sine oscillator implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernOscillator.h"
+
+#define CAVERN_OSCILLATOR_FRACTION_BITS (32 - CAVERN_OSCILLATOR_TABLE_BITS)
+#define CAVERN_OSCILLATOR_FRACTION_MASK ((1UL << CAVERN_OSCILLATOR_FRACTION_BITS) - 1)
+
+// Radians per phase step
+#define CAVERN_OSCILLATOR_RADIANS       (6.283185307179586 / 4294967296.0)
+
+CCavernOscillator::CCavernOscillator()
+    : m_pTable(NULL),
+      m_ulSampleRate(0),
+      m_ulIncrement(0),
+      m_ulRemainder(0),
+      m_ulCarry(0),
+      m_ulPhase(0),
+      m_fAmplitude(0.0f),
+      m_fOffset(0.0f),
+      m_AllowSimd(FALSE)
+{
+}
+
+CCavernOscillator::~CCavernOscillator()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernOscillator::Init(
+    _In_ ULONG FrequencyHz,
+    _In_ ULONG SampleRate,
+    _In_ float Amplitude,
+    _In_ float Offset,
+    _In_ double InitialPhase,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!SampleRate) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    m_pTable = (float *)CavernAllocate(
+        (CAVERN_OSCILLATOR_TABLE_SIZE + CAVERN_OSCILLATOR_QUARTER) * sizeof(float),
+        CAVERN_OSCILLATOR_POOLTAG);
+    if (!m_pTable) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < CAVERN_OSCILLATOR_TABLE_SIZE + CAVERN_OSCILLATOR_QUARTER; i++) {
+        m_pTable[i] = (float)sin(6.283185307179586 * i / CAVERN_OSCILLATOR_TABLE_SIZE);
+    }
+
+    // Frequencies at or above the rate alias to the same phase steps
+    ULONGLONG step = ((ULONGLONG)(FrequencyHz % SampleRate)) << 32;
+    m_ulIncrement = (ULONG)(step / SampleRate);
+    m_ulRemainder = (ULONG)(step % SampleRate);
+    m_ulCarry = 0;
+    m_ulSampleRate = SampleRate;
+
+    double turns = InitialPhase / 6.283185307179586;
+    turns -= floor(turns);
+    m_ulPhase = (ULONG)(ULONGLONG)(turns * 4294967296.0);
+
+    m_fAmplitude = Amplitude;
+    m_fOffset = Offset;
+    m_AllowSimd = AllowSimd;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernOscillator::Cleanup()
+{
+    if (m_pTable) {
+        CavernFree(m_pTable, CAVERN_OSCILLATOR_POOLTAG);
+        m_pTable = NULL;
+    }
+    m_ulSampleRate = 0;
+    m_ulIncrement = 0;
+    m_ulRemainder = 0;
+    m_ulCarry = 0;
+    m_ulPhase = 0;
+}
+
+VOID CCavernOscillator::Generate(
+    _Out_writes_(FrameCount) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_pTable || !Samples) {
+        return;
+    }
+
+    const float *table = m_pTable;
+    const float *cosine = m_pTable + CAVERN_OSCILLATOR_QUARTER;
+    const float radians = (float)CAVERN_OSCILLATOR_RADIANS;
+    const ULONG start = m_ulPhase;
+    ULONG phase = start;
+    SIZE_T n = 0;
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (m_AllowSimd && FrameCount >= 8) {
+        const __m256i mask = _mm256_set1_epi32((int)CAVERN_OSCILLATOR_FRACTION_MASK);
+        const __m256i step = _mm256_set1_epi32((int)(m_ulIncrement * 8));
+        const __m256 scale = _mm256_set1_ps(radians);
+        const __m256 half = _mm256_set1_ps(0.5f);
+        const __m256 amplitude = _mm256_set1_ps(m_fAmplitude);
+        const __m256 offset = _mm256_set1_ps(m_fOffset);
+        __m256i phases = _mm256_add_epi32(
+            _mm256_set1_epi32((int)phase),
+            _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32((int)m_ulIncrement)));
+
+        for (; n + 8 <= FrameCount; n += 8) {
+            __m256i index = _mm256_srli_epi32(phases, CAVERN_OSCILLATOR_FRACTION_BITS);
+            __m256 d = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_and_si256(phases, mask)), scale);
+            __m256 s = _mm256_i32gather_ps(table, index, 4);
+            __m256 c = _mm256_i32gather_ps(cosine, index, 4);
+            __m256 h = _mm256_mul_ps(_mm256_mul_ps(d, d), half);
+            __m256 y = _mm256_add_ps(_mm256_sub_ps(s, _mm256_mul_ps(s, h)), _mm256_mul_ps(c, d));
+
+            _mm256_storeu_ps(Samples + n, _mm256_add_ps(offset, _mm256_mul_ps(amplitude, y)));
+            phases = _mm256_add_epi32(phases, step);
+        }
+        phase = start + (ULONG)n * m_ulIncrement;
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (m_AllowSimd && n + 4 <= FrameCount) {
+        const __m128i mask = _mm_set1_epi32((int)CAVERN_OSCILLATOR_FRACTION_MASK);
+        const __m128i step = _mm_set1_epi32((int)(m_ulIncrement * 4));
+        const __m128 scale = _mm_set1_ps(radians);
+        const __m128 half = _mm_set1_ps(0.5f);
+        const __m128 amplitude = _mm_set1_ps(m_fAmplitude);
+        const __m128 offset = _mm_set1_ps(m_fOffset);
+        __m128i phases = _mm_setr_epi32(
+            (int)phase, (int)(phase + m_ulIncrement),
+            (int)(phase + 2 * m_ulIncrement), (int)(phase + 3 * m_ulIncrement));
+
+        for (; n + 4 <= FrameCount; n += 4) {
+            __m128i index = _mm_srli_epi32(phases, CAVERN_OSCILLATOR_FRACTION_BITS);
+            __m128 d = _mm_mul_ps(_mm_cvtepi32_ps(_mm_and_si128(phases, mask)), scale);
+
+            // No gather before AVX2: the four table reads are scalar
+            ULONG i0 = (ULONG)_mm_cvtsi128_si32(index);
+            ULONG i1 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(index, 4));
+            ULONG i2 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(index, 8));
+            ULONG i3 = (ULONG)_mm_cvtsi128_si32(_mm_srli_si128(index, 12));
+            __m128 s = _mm_setr_ps(table[i0], table[i1], table[i2], table[i3]);
+            __m128 c = _mm_setr_ps(cosine[i0], cosine[i1], cosine[i2], cosine[i3]);
+
+            __m128 h = _mm_mul_ps(_mm_mul_ps(d, d), half);
+            __m128 y = _mm_add_ps(_mm_sub_ps(s, _mm_mul_ps(s, h)), _mm_mul_ps(c, d));
+
+            _mm_storeu_ps(Samples + n, _mm_add_ps(offset, _mm_mul_ps(amplitude, y)));
+            phases = _mm_add_epi32(phases, step);
+        }
+        phase = start + (ULONG)n * m_ulIncrement;
+    }
+#endif
+
+    for (; n < FrameCount; n++) {
+        ULONG index = phase >> CAVERN_OSCILLATOR_FRACTION_BITS;
+        float d = (float)(LONG)(phase & CAVERN_OSCILLATOR_FRACTION_MASK) * radians;
+        float s = table[index];
+        float c = cosine[index];
+        float h = (d * d) * 0.5f;
+        float y = (s - s * h) + c * d;
+
+        Samples[n] = m_fOffset + m_fAmplitude * y;
+        phase += m_ulIncrement;
+    }
+
+    // Whole steps for the frames written, plus the carried remainder
+    ULONGLONG carry = (ULONGLONG)m_ulCarry + (ULONGLONG)FrameCount * m_ulRemainder;
+    m_ulPhase = start + (ULONG)FrameCount * m_ulIncrement + (ULONG)(carry / m_ulSampleRate);
+    m_ulCarry = (ULONG)(carry % m_ulSampleRate);
+}
@@ -0,0 +1,79 @@
+/***************************************************************************
+ * CavernOscillator.h
+ *
+ * Sine oscillator for test tones without a sin() call per frame. The phase
+ * is a 32-bit integer accumulator (one turn = 2^32) advanced by the
+ * frequency as an exact fraction of the sample rate: the integer part of
+ * the increment is added every frame and the remainder is carried between
+ * calls, so over any run the phase is where FrequencyHz * n / SampleRate
+ * puts it and the tone never drifts.
+ *
+ * The top CAVERN_OSCILLATOR_TABLE_BITS of the phase pick a point of a sine
+ * table; the rest is the distance d past it, and
+ *
+ *     sin(a + d) = sin(a) (1 - d^2 / 2) + cos(a) d
+ *
+ * with cos(a) read from the same table a quarter turn on. The terms left
+ * out are below float resolution, so the output is as clean as a float
+ * sine can be. Frames are computed as SIMD lanes (SSE2, AVX2 with table
+ * gathers), bit-identical to the scalar loop.
+ *
+ * Init builds the table, so it must be bracketed with
+ * KeSaveFloatingPointState / KeRestoreFloatingPointState like Generate.
+ ***************************************************************************/
+
+#ifndef _CAVERN_OSCILLATOR_H_
+#define _CAVERN_OSCILLATOR_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_OSCILLATOR_POOLTAG       'sOvC'
+
+// Sine table points per turn (2^bits), plus a quarter turn so cosines
+// come from the same table
+#define CAVERN_OSCILLATOR_TABLE_BITS    10
+#define CAVERN_OSCILLATOR_TABLE_SIZE    (1 << CAVERN_OSCILLATOR_TABLE_BITS)
+#define CAVERN_OSCILLATOR_QUARTER       (CAVERN_OSCILLATOR_TABLE_SIZE / 4)
+
+class CCavernOscillator
+{
+public:
+    CCavernOscillator();
+    ~CCavernOscillator();
+
+    // Output is Offset + Amplitude * sin(phase), starting at InitialPhase
+    // radians.
+    NTSTATUS Init(
+        _In_ ULONG FrequencyHz,
+        _In_ ULONG SampleRate,
+        _In_ float Amplitude,
+        _In_ float Offset,
+        _In_ double InitialPhase,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Writes the next FrameCount values, one per frame.
+    VOID Generate(
+        _Out_writes_(FrameCount) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    BOOLEAN IsInitialized() const { return m_pTable != NULL; }
+
+    // Phase of the next frame, 2^32 per turn
+    ULONG GetPhase() const { return m_ulPhase; }
+
+private:
+    float              *m_pTable;           // TABLE_SIZE + QUARTER points
+    ULONG               m_ulSampleRate;
+    ULONG               m_ulIncrement;      // whole phase steps per frame
+    ULONG               m_ulRemainder;      // and SampleRate-ths of one
+    ULONG               m_ulCarry;          // remainder accumulated so far
+    ULONG               m_ulPhase;
+    float               m_fAmplitude;
+    float               m_fOffset;
+    BOOLEAN             m_AllowSimd;
+};
+
+#endif // _CAVERN_OSCILLATOR_H_
@@ -0,0 +1,128 @@
+/***************************************************************************
+ * CavernPacketState.cpp
+ *
+ * Packet-mode bookkeeping implementation
+ ***************************************************************************/
+
+#include "CavernPacketState.h"
+
+VOID CavernPacketReset(_Inout_ PCAVERN_PACKET_STATE State)
+{
+    State->PacketCounter = 0;
+    State->LastOsWritePacket = CAVERN_NO_PACKET;
+    State->EosLinearPosition = 0;
+    State->EosPacketLength = 0;
+    State->EoSReceived = FALSE;
+    State->LastBufferRendered = FALSE;
+}
+
+NTSTATUS CavernPacketWrite(
+    _Inout_ PCAVERN_PACKET_STATE State,
+    _In_ BOOLEAN Running,
+    _In_ ULONGLONG LinearPosition,
+    _In_ ULONG PacketNumber,
+    _In_ BOOLEAN EndOfStream,
+    _In_ ULONG EosPacketLength,
+    _Out_ BOOLEAN *CompleteNow
+)
+{
+    *CompleteNow = FALSE;
+
+    if (!State->PacketSize) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // No packet may follow the EOS packet
+    if (State->EoSReceived) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    // While running the current packet is already being forwarded, so the
+    // OS should be writing the one after it.
+    ULONG expectedPacket = (ULONG)State->PacketCounter;
+    if (Running) {
+        expectedPacket++;
+    }
+
+    LONG deltaFromExpectedPacket = (LONG)(PacketNumber - expectedPacket);   // Modulo arithmetic
+    if (deltaFromExpectedPacket < 0) {
+        return STATUS_DATA_LATE_ERROR;
+    } else if (deltaFromExpectedPacket > 0) {
+        return STATUS_DATA_OVERRUN;
+    }
+
+    if (EndOfStream) {
+        if (EosPacketLength > State->PacketSize) {
+            return STATUS_INVALID_PARAMETER;
+        }
+
+        // EOS position is the start of this packet plus its length; packet
+        // numbers only carry the low 32 bits of the counter.
+        ULONGLONG packetStart = ((ULONGLONG)State->PacketCounter +
+                                 (ULONG)(PacketNumber - (ULONG)State->PacketCounter)) * State->PacketSize;
+
+        State->EosLinearPosition = packetStart + EosPacketLength;
+        State->EosPacketLength = EosPacketLength;
+        State->EoSReceived = TRUE;
+
+        // Already consumed (not running, EOS inside the current packet)
+        *CompleteNow = (LinearPosition >= State->EosLinearPosition);
+    }
+
+    State->LastOsWritePacket = PacketNumber;
+
+    return STATUS_SUCCESS;
+}
+
+ULONGLONG CavernPacketClamp(
+    _In_ const CAVERN_PACKET_STATE *State,
+    _In_ ULONGLONG LinearPosition,
+    _In_ ULONGLONG Bytes
+)
+{
+    // Never read past the end of stream
+    if (State->EoSReceived) {
+        Bytes = min(Bytes, State->EosLinearPosition - min(LinearPosition, State->EosLinearPosition));
+    }
+
+    return Bytes;
+}
+
+BOOLEAN CavernPacketAdvance(
+    _Inout_ PCAVERN_PACKET_STATE State,
+    _In_ ULONGLONG LinearPosition
+)
+{
+    if (State->PacketSize) {
+        State->PacketCounter = (LONGLONG)(LinearPosition / State->PacketSize);
+    }
+
+    return State->EoSReceived && !State->LastBufferRendered &&
+           LinearPosition >= State->EosLinearPosition;
+}
+
+NTSTATUS CavernPacketRead(
+    _In_ const CAVERN_PACKET_STATE *State,
+    _Out_ ULONG *PacketNumber,
+    _Out_ BOOLEAN *EndOfStream,
+    _Out_ ULONG *EosPacketLength
+)
+{
+    if (!State->PacketSize) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (State->LastBufferRendered) {
+        *PacketNumber = State->LastOsWritePacket;
+        *EndOfStream = TRUE;
+        *EosPacketLength = State->EosPacketLength;
+    } else if (State->PacketCounter == 0) {
+        return STATUS_DEVICE_NOT_READY;
+    } else {
+        *PacketNumber = (ULONG)(State->PacketCounter - 1);
+        *EndOfStream = FALSE;
+        *EosPacketLength = 0;
+    }
+
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,80 @@
+/***************************************************************************
+ * CavernPacketState.h
+ *
+ * Packet-mode bookkeeping for the Cavern render stream, modeled on
+ * CMiniportWaveRTStream::SetWritePacket/GetReadPacket. The DMA buffer is
+ * split into equal packets; the OS announces each packet it has written,
+ * and may flag one as the end of stream with the number of valid bytes in
+ * it. The stream then stops reading at that byte and flushes what it still
+ * holds.
+ *
+ * The caller serializes every call (the driver holds m_PositionLock), so
+ * the EOS check and the EOS update are one step. Integer work only.
+ ***************************************************************************/
+
+#ifndef _CAVERN_PACKETSTATE_H_
+#define _CAVERN_PACKETSTATE_H_
+
+#include "CavernPortable.h"
+
+// No packet written yet
+#define CAVERN_NO_PACKET    0xFFFFFFFF
+
+typedef struct _CAVERN_PACKET_STATE {
+    ULONG       PacketSize;             // bytes; 0 until the buffer exists
+    LONGLONG    PacketCounter;          // packets fully read
+    ULONG       LastOsWritePacket;
+    ULONGLONG   EosLinearPosition;      // byte the stream ends at
+    ULONG       EosPacketLength;
+    BOOLEAN     EoSReceived;
+    BOOLEAN     LastBufferRendered;     // read up to EOS and flushed
+} CAVERN_PACKET_STATE, *PCAVERN_PACKET_STATE;
+
+// Back to no packets and no EOS, keeping PacketSize
+VOID CavernPacketReset(_Inout_ PCAVERN_PACKET_STATE State);
+
+//
+// SetWritePacket. Running: the current packet is being read, so the OS
+// must be writing the next one. Fails with STATUS_INVALID_DEVICE_STATE
+// after EOS, STATUS_DATA_LATE_ERROR or STATUS_DATA_OVERRUN for a packet
+// other than the expected one. *CompleteNow is set when the EOS byte has
+// already been read (the stream is not running), so the caller flushes
+// at once.
+//
+NTSTATUS CavernPacketWrite(
+    _Inout_ PCAVERN_PACKET_STATE State,
+    _In_ BOOLEAN Running,
+    _In_ ULONGLONG LinearPosition,
+    _In_ ULONG PacketNumber,
+    _In_ BOOLEAN EndOfStream,
+    _In_ ULONG EosPacketLength,
+    _Out_ BOOLEAN *CompleteNow
+);
+
+// Bytes the position may advance by from LinearPosition: Bytes, cut at EOS
+ULONGLONG CavernPacketClamp(
+    _In_ const CAVERN_PACKET_STATE *State,
+    _In_ ULONGLONG LinearPosition,
+    _In_ ULONGLONG Bytes
+);
+
+// Updates the packet counter after the position moved; TRUE once the
+// position reaches EOS and the stream has not been flushed yet
+BOOLEAN CavernPacketAdvance(
+    _Inout_ PCAVERN_PACKET_STATE State,
+    _In_ ULONGLONG LinearPosition
+);
+
+//
+// Read side: the last packet fully read, or the EOS packet with its
+// length once it has been flushed. STATUS_DEVICE_NOT_READY before the
+// first packet is done.
+//
+NTSTATUS CavernPacketRead(
+    _In_ const CAVERN_PACKET_STATE *State,
+    _Out_ ULONG *PacketNumber,
+    _Out_ BOOLEAN *EndOfStream,
+    _Out_ ULONG *EosPacketLength
+);
+
+#endif // _CAVERN_PACKETSTATE_H_
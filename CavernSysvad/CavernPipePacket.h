@@ -0,0 +1,73 @@
+/***************************************************************************
+ * CavernPipePacket.h
+ *
+ * Framing of the byte stream on \\.\pipe\CavernAudioPipe. Everything the
+ * driver forwards goes out as a packet: a 16-byte CAVERN_PIPE_PACKET
+ * header followed by Length bytes of payload, queued whole or not at all.
+ * Audio packets carry frame-aligned PCM or codec frames; a silence packet
+ * carries one CAVERN_SILENCE_MARKER (CavernSilenceGate.h) in place of the
+ * frames it stands for.
+ *
+ * A receiver reads a header, then exactly Length bytes, so the payload is
+ * never searched and may hold any bytes. Only when it has no packet
+ * boundary to go by (the pipe connected in the middle of a packet, or a
+ * header failed the check) does it scan for the next header that passes
+ * CavernIsPipePacket, dropping what came before it.
+ ***************************************************************************/
+
+#ifndef _CAVERN_PIPE_PACKET_H_
+#define _CAVERN_PIPE_PACKET_H_
+
+#include "CavernPortable.h"
+
+// "CAVP" in stream byte order
+#define CAVERN_PIPE_PACKET_MAGIC        0x50564143u
+
+// Largest payload a packet may declare; a silence marker never stands for
+// more bytes than this either
+#define CAVERN_PIPE_PACKET_MAX_LENGTH   (16 * 1024 * 1024)
+
+typedef enum _CAVERN_PIPE_PACKET_TYPE {
+    CavernPipePacketAudio = 1,          // forwarded frames
+    CavernPipePacketSilence = 2,        // one CAVERN_SILENCE_MARKER
+    CavernPipePacketTypeCount
+} CAVERN_PIPE_PACKET_TYPE;
+
+typedef struct _CAVERN_PIPE_PACKET {
+    ULONG       Magic;          // CAVERN_PIPE_PACKET_MAGIC
+    USHORT      Type;           // CAVERN_PIPE_PACKET_TYPE
+    USHORT      Reserved;
+    ULONG       Length;         // payload bytes that follow
+    ULONG       Check;          // CavernPipePacketCheck(Type, Length)
+} CAVERN_PIPE_PACKET, *PCAVERN_PIPE_PACKET;
+
+inline ULONG CavernPipePacketCheck(_In_ USHORT Type, _In_ ULONG Length)
+{
+    return ~(Length ^ ((ULONG)Type * 0x9E3779B1u));
+}
+
+inline VOID CavernInitPipePacket(
+    _Out_ PCAVERN_PIPE_PACKET Packet,
+    _In_ CAVERN_PIPE_PACKET_TYPE Type,
+    _In_ ULONG Length
+)
+{
+    Packet->Magic = CAVERN_PIPE_PACKET_MAGIC;
+    Packet->Type = (USHORT)Type;
+    Packet->Reserved = 0;
+    Packet->Length = Length;
+    Packet->Check = CavernPipePacketCheck((USHORT)Type, Length);
+}
+
+// TRUE for a header a receiver may trust: known type, a length within
+// the limit and a matching check.
+inline BOOLEAN CavernIsPipePacket(_In_ const CAVERN_PIPE_PACKET *Packet)
+{
+    return Packet->Magic == CAVERN_PIPE_PACKET_MAGIC &&
+        Packet->Type >= CavernPipePacketAudio && Packet->Type < CavernPipePacketTypeCount &&
+        Packet->Reserved == 0 &&
+        Packet->Length <= CAVERN_PIPE_PACKET_MAX_LENGTH &&
+        Packet->Check == CavernPipePacketCheck(Packet->Type, Packet->Length);
+}
+
+#endif // _CAVERN_PIPE_PACKET_H_
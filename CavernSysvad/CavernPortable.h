@@ -0,0 +1,160 @@
+/***************************************************************************
+ * CavernPortable.h
+ *
+ * Kernel/user portability shim for the Cavern stream processing modules.
+ * In the driver build (_KERNEL_MODE) this is just ntddk.h; elsewhere it
+ * maps the handful of NT types, status codes and Rtl/Ex routines the
+ * modules use onto the C runtime so they can be built and profiled on
+ * Linux or in user mode.
+ ***************************************************************************/
+
+#ifndef _CAVERN_PORTABLE_H_
+#define _CAVERN_PORTABLE_H_
+
+#if defined(_KERNEL_MODE)
+
+#include <ntddk.h>
+
+#define CavernAllocate(Size, Tag) \
+    ExAllocatePool2(POOL_FLAG_NON_PAGED, (Size), (Tag))
+#define CavernFree(Buffer, Tag) \
+    ExFreePoolWithTag((Buffer), (Tag))
+
+#define CavernMemoryBarrier()           KeMemoryBarrier()
+#define CavernInterlockedIncrement(p)   InterlockedIncrement(p)
+#define CavernInterlockedDecrement(p)   InterlockedDecrement(p)
+#define CavernInterlockedExchange(p, x) InterlockedExchange((p), (x))
+#define CavernInterlockedCompareExchange(p, x, c) InterlockedCompareExchange((p), (x), (c))
+
+#else // !_KERNEL_MODE
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef uint8_t         UCHAR, BYTE, BOOLEAN;
+typedef uint8_t         *PUCHAR, *PBYTE;
+typedef int16_t         SHORT;
+typedef uint16_t        USHORT, WORD;
+typedef int32_t         LONG, NTSTATUS;
+typedef uint32_t        ULONG, DWORD;
+typedef ULONG           *PULONG;
+typedef LONG            *PLONG;
+typedef int64_t         LONGLONG;
+typedef uint64_t        ULONGLONG;
+typedef size_t          SIZE_T;
+typedef void            VOID, *PVOID;
+
+#ifndef TRUE
+#define TRUE    1
+#define FALSE   0
+#endif
+
+#define NT_SUCCESS(Status)              (((NTSTATUS)(Status)) >= 0)
+#define STATUS_SUCCESS                  ((NTSTATUS)0x00000000L)
+#define STATUS_BUFFER_TOO_SMALL         ((NTSTATUS)0xC0000023L)
+#define STATUS_INVALID_PARAMETER        ((NTSTATUS)0xC000000DL)
+#define STATUS_INSUFFICIENT_RESOURCES   ((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED            ((NTSTATUS)0xC00000BBL)
+#define STATUS_INVALID_DEVICE_STATE     ((NTSTATUS)0xC0000184L)
+#define STATUS_DATA_OVERRUN             ((NTSTATUS)0xC000003CL)
+#define STATUS_DATA_LATE_ERROR          ((NTSTATUS)0xC000003DL)
+#define STATUS_DEVICE_NOT_READY         ((NTSTATUS)0xC00000A3L)
+
+#define RtlCopyMemory(Dst, Src, Len)    memcpy((Dst), (Src), (Len))
+#define RtlMoveMemory(Dst, Src, Len)    memmove((Dst), (Src), (Len))
+#define RtlZeroMemory(Dst, Len)         memset((Dst), 0, (Len))
+
+#ifndef PAGE_SIZE
+#define PAGE_SIZE                       4096
+#endif
+
+#if defined(_MSC_VER)
+#include <malloc.h>
+#define CavernAlignedAlloc(Alignment, Size) _aligned_malloc((Size), (Alignment))
+#define CavernFree(Buffer, Tag)         _aligned_free(Buffer)
+#else
+#define CavernAlignedAlloc(Alignment, Size) aligned_alloc((Alignment), (Size))
+#define CavernFree(Buffer, Tag)         free(Buffer)
+#endif
+
+// Zeroed like ExAllocatePool2, and like the pool, allocations of a page or
+// more start on a page boundary (direct I/O from them relies on it)
+static inline void *CavernAllocateZeroed(size_t Size)
+{
+    size_t alignment = (Size < PAGE_SIZE) ? 16 : PAGE_SIZE;
+    size_t rounded = (Size + alignment - 1) & ~(alignment - 1);
+    void *buffer = CavernAlignedAlloc(alignment, rounded ? rounded : alignment);
+    if (buffer) {
+        memset(buffer, 0, rounded);
+    }
+    return buffer;
+}
+
+#define CavernAllocate(Size, Tag)       CavernAllocateZeroed(Size)
+
+#if defined(__GNUC__)
+#define CavernMemoryBarrier()           __atomic_thread_fence(__ATOMIC_SEQ_CST)
+#define CavernInterlockedIncrement(p)   __atomic_add_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define CavernInterlockedDecrement(p)   __atomic_sub_fetch((p), 1, __ATOMIC_SEQ_CST)
+#define CavernInterlockedExchange(p, x) __atomic_exchange_n((p), (x), __ATOMIC_SEQ_CST)
+#define CavernInterlockedCompareExchange(p, x, c) __sync_val_compare_and_swap((p), (c), (x))
+#else
+#include <intrin.h>
+#define CavernMemoryBarrier()           _ReadWriteBarrier()
+#define CavernInterlockedIncrement(p)   _InterlockedIncrement((long volatile *)(p))
+#define CavernInterlockedDecrement(p)   _InterlockedDecrement((long volatile *)(p))
+#define CavernInterlockedExchange(p, x) _InterlockedExchange((long volatile *)(p), (x))
+#define CavernInterlockedCompareExchange(p, x, c) _InterlockedCompareExchange((long volatile *)(p), (x), (c))
+#endif
+
+// C++ users that include the standard library can opt out with NOMINMAX
+#if !defined(min) && !defined(NOMINMAX)
+#define min(a, b)   (((a) < (b)) ? (a) : (b))
+#define max(a, b)   (((a) > (b)) ? (a) : (b))
+#endif
+
+#ifndef ASSERT
+#define ASSERT(e)   ((void)0)
+#endif
+
+#define UNREFERENCED_PARAMETER(P)       ((void)(P))
+
+// SAL annotations used by the Cavern modules
+#ifndef _In_
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _In_reads_(n)
+#define _In_reads_bytes_(n)
+#define _In_reads_bytes_opt_(n)
+#define _Out_writes_(n)
+#define _Out_writes_opt_(n)
+#define _Out_writes_bytes_(n)
+#define _Out_writes_bytes_opt_(n)
+#define _Inout_updates_(n)
+#define _Inout_updates_bytes_(n)
+#endif
+
+#endif // _KERNEL_MODE
+
+// SSE2 is part of the x64 baseline and may be used at any IRQL there.
+#if defined(_M_X64) || defined(__SSE2__)
+#define CAVERN_HAVE_SSE2 1
+#include <emmintrin.h>
+#endif
+
+// AVX2/FMA paths are only built when the compiler targets them (/arch:AVX2,
+// -mavx2 -mfma); the driver build stays on the SSE2 baseline.
+#if defined(__AVX2__)
+#define CAVERN_HAVE_AVX2 1
+#include <immintrin.h>
+#endif
+#if defined(__FMA__) || (defined(_MSC_VER) && defined(__AVX2__))
+#define CAVERN_HAVE_FMA 1
+#endif
+
+#endif // _CAVERN_PORTABLE_H_
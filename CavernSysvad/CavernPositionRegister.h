@@ -0,0 +1,104 @@
+/***************************************************************************
+ * CavernPositionRegister.h
+ *
+ * Position and clock register page for the Cavern stream. The timer DPC
+ * publishes the stream position into one non-paged page; the audio engine
+ * reads BufferPosition/Qpc through the WaveRT position and clock registers.
+ *
+ * The output has a page of its own for the downstream consumer, in a named
+ * section it can map read-only instead of polling the position through an
+ * IOCTL: OpenFileMapping(FILE_MAP_READ, CAVERN_POSITION_SECTION_USER_NAME)
+ * and MapViewOfFile(FILE_MAP_READ). Whoever owns the output writes it:
+ * a bitstream stream mirrors its own position, the mix publishes the bytes
+ * it has forwarded. BufferSize and BufferPosition are zero there, as the
+ * output has no DMA buffer. The section lives as long as the device.
+ *
+ * The page is a sequence lock: Sequence is odd while the writer updates
+ * the fields, so a reader that sees the same even value before and after
+ * copying them has a consistent snapshot. There is exactly one writer
+ * (the stream, under its position lock).
+ ***************************************************************************/
+
+#ifndef _CAVERN_POSITION_REGISTER_H_
+#define _CAVERN_POSITION_REGISTER_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_POSITION_REGISTER_POOLTAG    'rPvC'
+#define CAVERN_POSITION_REGISTER_VERSION    1
+
+// The output's page, as the driver names it and as user mode opens it
+#define CAVERN_POSITION_SECTION_NAME        L"\\BaseNamedObjects\\CavernPositionRegister"
+#define CAVERN_POSITION_SECTION_USER_NAME   L"Global\\CavernPositionRegister"
+
+typedef struct _CAVERN_POSITION_REGISTER {
+    volatile ULONG      Sequence;           // odd while an update is in progress
+    ULONG               Version;            // CAVERN_POSITION_REGISTER_VERSION
+    volatile ULONG      BufferPosition;     // byte offset in the DMA buffer
+    ULONG               BufferSize;         // DMA buffer size in bytes
+    volatile ULONGLONG  LinearPosition;     // bytes consumed since STOP
+    volatile LONGLONG   Qpc;                // performance counter at the update
+    volatile LONGLONG   PacketCount;        // completed packets since STOP
+    LONGLONG            QpcFrequency;       // performance counter frequency
+} CAVERN_POSITION_REGISTER, *PCAVERN_POSITION_REGISTER;
+
+typedef struct _CAVERN_POSITION_SNAPSHOT {
+    ULONGLONG   LinearPosition;
+    LONGLONG    Qpc;
+    LONGLONG    PacketCount;
+    ULONG       BufferPosition;
+    ULONG       Sequence;
+} CAVERN_POSITION_SNAPSHOT, *PCAVERN_POSITION_SNAPSHOT;
+
+// Writer side. Not safe against a second concurrent writer.
+inline VOID CavernPublishPosition(
+    _Inout_ PCAVERN_POSITION_REGISTER Register,
+    _In_ ULONGLONG LinearPosition,
+    _In_ LONGLONG Qpc,
+    _In_ LONGLONG PacketCount
+)
+{
+    Register->Sequence++;
+    CavernMemoryBarrier();
+
+    Register->BufferPosition = Register->BufferSize ?
+        (ULONG)(LinearPosition % Register->BufferSize) : 0;
+    Register->LinearPosition = LinearPosition;
+    Register->Qpc = Qpc;
+    Register->PacketCount = PacketCount;
+
+    CavernMemoryBarrier();
+    Register->Sequence++;
+}
+
+// Reader side. Retries while the writer is mid-update; never blocks it.
+inline VOID CavernReadPosition(
+    _In_ const CAVERN_POSITION_REGISTER *Register,
+    _Out_ PCAVERN_POSITION_SNAPSHOT Snapshot
+)
+{
+    ULONG sequence;
+
+    for (;;) {
+        sequence = Register->Sequence;
+        CavernMemoryBarrier();
+
+        if (sequence & 1) {
+            continue;
+        }
+
+        Snapshot->LinearPosition = Register->LinearPosition;
+        Snapshot->Qpc = Register->Qpc;
+        Snapshot->PacketCount = Register->PacketCount;
+        Snapshot->BufferPosition = Register->BufferPosition;
+
+        CavernMemoryBarrier();
+        if (Register->Sequence == sequence) {
+            break;
+        }
+    }
+
+    Snapshot->Sequence = sequence;
+}
+
+#endif // _CAVERN_POSITION_REGISTER_H_
@@ -0,0 +1,369 @@
+/***************************************************************************
+ * CavernRequantizer.cpp
+ *
+ * Dithered requantization implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernRequantizer.h"
+
+// Two 32-bit draws scaled to +-0.5 LSB each
+#define DITHER_DRAW_SCALE   (1.0f / 4294967296.0f)
+
+// Error-feedback filters, NTF(z) = 1 - sum(c[k] z^-(k+1)). The weighted
+// set is Wannamaker's 3-tap F-weighted filter: about -12 dB at low
+// frequencies, rising to +11 dB at the top of the band.
+static const float g_ShapingCoefficients[CavernDitherModeCount][CAVERN_DITHER_MAX_TAPS] = {
+    { 0.0f, 0.0f, 0.0f },
+    { 0.0f, 0.0f, 0.0f },
+    { 1.0f, 0.0f, 0.0f },
+    { 1.623f, -0.982f, 0.109f },
+};
+
+//=============================================================================
+// Scalar kernel. Clamping, rounding and the feedback sum follow the SSE2
+// kernel operation for operation: max/min return the bound for NaN, and
+// rounding is to nearest-even as cvtps2dq does.
+//=============================================================================
+
+static inline ULONG NextRandom(ULONG State)
+{
+    State ^= State << 13;
+    State ^= State >> 17;
+    State ^= State << 5;
+    return State;
+}
+
+static inline float RoundEven(float Value)
+{
+    float magic = (Value >= 0.0f) ? 8388608.0f : -8388608.0f;
+    float rounded = (Value + magic) - magic;
+
+    return (Value >= 8388608.0f || Value <= -8388608.0f) ? Value : rounded;
+}
+
+template <BOOLEAN Dither, ULONG Taps>
+static VOID RequantizeScalar(
+    PCAVERN_REQUANTIZE_STATE State,
+    const float *Source,
+    float *Destination,
+    SIZE_T Frames
+)
+{
+    const ULONG channels = State->Channels;
+    const float scale = State->Scale;
+    const float inverse = State->InverseScale;
+    const float low = State->Low;
+    const float high = State->High;
+    const float k0 = State->Coefficients[0];
+    const float k1 = State->Coefficients[1];
+    const float k2 = State->Coefficients[2];
+
+    // Frame by frame, so the channels' generator chains overlap
+    for (SIZE_T f = 0; f < Frames; f++) {
+        for (ULONG c = 0; c < channels; c++) {
+            float u = Source[f * channels + c] * scale;
+
+            if (Taps >= 1) {
+                float feedback = k0 * State->Error[0][c];
+                if (Taps >= 2) {
+                    feedback = feedback + k1 * State->Error[1][c];
+                }
+                if (Taps >= 3) {
+                    feedback = feedback + k2 * State->Error[2][c];
+                }
+                u = u - feedback;
+            }
+
+            float v = u;
+            if (Dither) {
+                ULONG r1 = NextRandom(State->Random[c]);
+                ULONG r2 = NextRandom(r1);
+                State->Random[c] = r2;
+                v = v + ((float)(LONG)r1 + (float)(LONG)r2) * DITHER_DRAW_SCALE;
+            }
+
+            v = (v > low) ? v : low;
+            v = (v < high) ? v : high;
+            float q = RoundEven(v);
+
+            if (Taps >= 1) {
+                float e = q - u;
+                e = (e < CAVERN_DITHER_MAX_ERROR) ? e : CAVERN_DITHER_MAX_ERROR;
+                e = (e > -CAVERN_DITHER_MAX_ERROR) ? e : -CAVERN_DITHER_MAX_ERROR;
+                State->Error[2][c] = State->Error[1][c];
+                State->Error[1][c] = State->Error[0][c];
+                State->Error[0][c] = e;
+            }
+
+            Destination[f * channels + c] = q * inverse;
+        }
+    }
+}
+
+#if defined(CAVERN_HAVE_SSE2)
+
+//=============================================================================
+// SSE2 kernel: four channels per vector. Frames are the outer loop so the
+// generator and feedback chains of up to four vectors overlap instead of
+// running back to back; a last group of fewer than four channels goes
+// through a small staging array.
+//=============================================================================
+
+#define DITHER_VECTORS  (CAVERN_MAX_CHANNELS / 4)
+
+static inline __m128i NextRandomSse2(__m128i State)
+{
+    State = _mm_xor_si128(State, _mm_slli_epi32(State, 13));
+    State = _mm_xor_si128(State, _mm_srli_epi32(State, 17));
+    return _mm_xor_si128(State, _mm_slli_epi32(State, 5));
+}
+
+template <BOOLEAN Dither, ULONG Taps>
+static VOID RequantizeSse2(
+    PCAVERN_REQUANTIZE_STATE State,
+    const float *Source,
+    float *Destination,
+    SIZE_T Frames
+)
+{
+    const ULONG channels = State->Channels;
+    const ULONG vectors = (channels + 3) / 4;
+    const ULONG tailLanes = channels - (vectors - 1) * 4;
+    const __m128 scale = _mm_set1_ps(State->Scale);
+    const __m128 inverse = _mm_set1_ps(State->InverseScale);
+    const __m128 low = _mm_set1_ps(State->Low);
+    const __m128 high = _mm_set1_ps(State->High);
+    const __m128 drawScale = _mm_set1_ps(DITHER_DRAW_SCALE);
+    const __m128 maxError = _mm_set1_ps(CAVERN_DITHER_MAX_ERROR);
+    const __m128 minError = _mm_set1_ps(-CAVERN_DITHER_MAX_ERROR);
+    const __m128 k0 = _mm_set1_ps(State->Coefficients[0]);
+    const __m128 k1 = _mm_set1_ps(State->Coefficients[1]);
+    const __m128 k2 = _mm_set1_ps(State->Coefficients[2]);
+    __m128i random[DITHER_VECTORS];
+    __m128 e1[DITHER_VECTORS];
+    __m128 e2[DITHER_VECTORS];
+    __m128 e3[DITHER_VECTORS];
+
+    for (ULONG v = 0; v < vectors; v++) {
+        random[v] = _mm_loadu_si128((const __m128i *)(State->Random + v * 4));
+        e1[v] = _mm_loadu_ps(State->Error[0] + v * 4);
+        e2[v] = _mm_loadu_ps(State->Error[1] + v * 4);
+        e3[v] = _mm_loadu_ps(State->Error[2] + v * 4);
+    }
+
+    for (SIZE_T f = 0; f < Frames; f++) {
+        const float *in = Source + f * channels;
+        float *out = Destination + f * channels;
+
+        for (ULONG v = 0; v < vectors; v++) {
+            const ULONG lanes = (v + 1 < vectors) ? 4 : tailLanes;
+            __m128 x;
+
+            if (lanes == 4) {
+                x = _mm_loadu_ps(in + v * 4);
+            } else {
+                float staged[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+                for (ULONG l = 0; l < lanes; l++) {
+                    staged[l] = in[v * 4 + l];
+                }
+                x = _mm_loadu_ps(staged);
+            }
+
+            __m128 u = _mm_mul_ps(x, scale);
+
+            if (Taps >= 1) {
+                __m128 feedback = _mm_mul_ps(k0, e1[v]);
+                if (Taps >= 2) {
+                    feedback = _mm_add_ps(feedback, _mm_mul_ps(k1, e2[v]));
+                }
+                if (Taps >= 3) {
+                    feedback = _mm_add_ps(feedback, _mm_mul_ps(k2, e3[v]));
+                }
+                u = _mm_sub_ps(u, feedback);
+            }
+
+            __m128 y = u;
+            if (Dither) {
+                __m128i r1 = NextRandomSse2(random[v]);
+                random[v] = NextRandomSse2(r1);
+                y = _mm_add_ps(y, _mm_mul_ps(_mm_add_ps(_mm_cvtepi32_ps(r1), _mm_cvtepi32_ps(random[v])), drawScale));
+            }
+
+            y = _mm_min_ps(_mm_max_ps(y, low), high);
+            __m128 q = _mm_cvtepi32_ps(_mm_cvtps_epi32(y));
+
+            if (Taps >= 1) {
+                e3[v] = e2[v];
+                e2[v] = e1[v];
+                e1[v] = _mm_max_ps(_mm_min_ps(_mm_sub_ps(q, u), maxError), minError);
+            }
+
+            q = _mm_mul_ps(q, inverse);
+
+            if (lanes == 4) {
+                _mm_storeu_ps(out + v * 4, q);
+            } else {
+                float staged[4];
+                _mm_storeu_ps(staged, q);
+                for (ULONG l = 0; l < lanes; l++) {
+                    out[v * 4 + l] = staged[l];
+                }
+            }
+        }
+    }
+
+    for (ULONG v = 0; v < vectors; v++) {
+        _mm_storeu_si128((__m128i *)(State->Random + v * 4), random[v]);
+        _mm_storeu_ps(State->Error[0] + v * 4, e1[v]);
+        _mm_storeu_ps(State->Error[1] + v * 4, e2[v]);
+        _mm_storeu_ps(State->Error[2] + v * 4, e3[v]);
+    }
+}
+
+#endif // CAVERN_HAVE_SSE2
+
+static PCAVERN_REQUANTIZE_KERNEL SelectRequantizeKernel(CAVERN_DITHER_MODE Mode, BOOLEAN AllowSimd)
+{
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        switch (Mode) {
+            case CavernDitherTpdf:      return RequantizeSse2<TRUE, 0>;
+            case CavernDitherHighpass:  return RequantizeSse2<TRUE, 1>;
+            case CavernDitherWeighted:  return RequantizeSse2<TRUE, 3>;
+            default:                    return RequantizeSse2<FALSE, 0>;
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(AllowSimd);
+#endif
+
+    switch (Mode) {
+        case CavernDitherTpdf:      return RequantizeScalar<TRUE, 0>;
+        case CavernDitherHighpass:  return RequantizeScalar<TRUE, 1>;
+        case CavernDitherWeighted:  return RequantizeScalar<TRUE, 3>;
+        default:                    return RequantizeScalar<FALSE, 0>;
+    }
+}
+
+CCavernRequantizer::CCavernRequantizer()
+    : m_Mode(CavernDitherNone),
+      m_Kernel(NULL),
+      m_ulFrameSize(0)
+{
+    RtlZeroMemory(&m_Converter, sizeof(m_Converter));
+    RtlZeroMemory(&m_State, sizeof(m_State));
+}
+
+NTSTATUS CCavernRequantizer::Init(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ ULONG Channels,
+    _In_ CAVERN_DITHER_MODE Mode,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    m_State.Channels = 0;
+    m_Kernel = NULL;
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || (ULONG)Mode >= CavernDitherModeCount) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = CavernSelectConverter(Format, AllowSimd, &m_Converter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    switch (Format) {
+        case CavernSampleU8:
+            m_State.Scale = 128.0f;
+            break;
+        case CavernSampleS16:
+            m_State.Scale = 32768.0f;
+            break;
+        case CavernSampleS24Packed:
+        case CavernSampleS24In32:
+            m_State.Scale = 8388608.0f;
+            break;
+        default:
+            m_State.Scale = 0.0f;
+            break;
+    }
+
+    if (m_State.Scale != 0.0f && Mode != CavernDitherNone) {
+        m_State.InverseScale = 1.0f / m_State.Scale;
+        m_State.Low = -m_State.Scale;
+        m_State.High = m_State.Scale - 1.0f;
+        for (ULONG k = 0; k < CAVERN_DITHER_MAX_TAPS; k++) {
+            m_State.Coefficients[k] = g_ShapingCoefficients[Mode][k];
+        }
+        m_Kernel = SelectRequantizeKernel(Mode, AllowSimd);
+    }
+
+    m_Mode = Mode;
+    m_ulFrameSize = Channels * m_Converter.BytesPerSample;
+    m_State.Channels = Channels;
+    Reset();
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernRequantizer::Reset()
+{
+    for (ULONG c = 0; c < CAVERN_MAX_CHANNELS; c++) {
+        // Distinct, never-zero seeds so channels get uncorrelated dither
+        ULONG seed = 0x2545F491u ^ ((c + 1) * 0x9E3779B9u);
+        m_State.Random[c] = seed ? seed : 1;
+
+        for (ULONG k = 0; k < CAVERN_DITHER_MAX_TAPS; k++) {
+            m_State.Error[k][c] = 0.0f;
+        }
+    }
+}
+
+VOID CCavernRequantizer::Process(
+    _In_reads_(FrameCount * m_State.Channels) const float *Source,
+    _Out_writes_bytes_(FrameCount * m_ulFrameSize) VOID *Destination,
+    _In_ SIZE_T FrameCount
+)
+{
+    const ULONG channels = m_State.Channels;
+
+    if (!channels) {
+        return;
+    }
+
+    if (!m_Kernel) {
+        m_Converter.FromFloat(Source, Destination, FrameCount * channels);
+        return;
+    }
+
+    BYTE *destination = (BYTE *)Destination;
+    while (FrameCount) {
+        SIZE_T block = min(FrameCount, (SIZE_T)CAVERN_DITHER_BLOCK_FRAMES);
+        SIZE_T samples = block * channels;
+
+        // Digital silence stays digital silence, with the shaping history
+        // cleared so nothing rings out of it
+        BOOLEAN silent = TRUE;
+        for (SIZE_T i = 0; i < samples && silent; i++) {
+            silent = (Source[i] == 0.0f);
+        }
+
+        if (silent) {
+            m_Converter.FromFloat(Source, destination, samples);
+            for (ULONG k = 0; k < CAVERN_DITHER_MAX_TAPS; k++) {
+                for (ULONG c = 0; c < channels; c++) {
+                    m_State.Error[k][c] = 0.0f;
+                }
+            }
+        } else {
+            m_Kernel(&m_State, Source, m_Block, block);
+            m_Converter.FromFloat(m_Block, destination, samples);
+        }
+
+        Source += samples;
+        destination += block * m_ulFrameSize;
+        FrameCount -= block;
+    }
+}
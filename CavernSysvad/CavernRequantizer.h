@@ -0,0 +1,107 @@
+/***************************************************************************
+ * CavernRequantizer.h
+ *
+ * Float to 8/16/24-bit requantization with TPDF dither and optional
+ * error-feedback noise shaping. Each channel has its own xorshift32
+ * generator; two draws per sample give triangular dither of +-1 LSB, so
+ * the error is signal-independent instead of harmonic distortion. The
+ * shaped modes feed the error back through a short FIR, moving the noise
+ * toward the top of the band. The SSE2 kernel runs four channels per
+ * vector with the same operation order as the scalar one, so the output is
+ * bit-identical.
+ *
+ * Blocks of digital zero are written as zero without dither, so idle
+ * streams stay silent for CCavernSilenceGate. 32-bit integer and float
+ * targets are converted as they are: the float mantissa is already below
+ * their LSB.
+ *
+ * Process must be bracketed with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState.
+ ***************************************************************************/
+
+#ifndef _CAVERN_REQUANTIZER_H_
+#define _CAVERN_REQUANTIZER_H_
+
+#include "CavernFormatConvert.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+// Error-feedback taps of the longest shaping filter
+#define CAVERN_DITHER_MAX_TAPS      3
+
+// Largest error (LSB) fed back; keeps the shaping loop stable when the
+// output clips
+#define CAVERN_DITHER_MAX_ERROR     2.0f
+
+// Frames requantized per pass into the staging block
+#define CAVERN_DITHER_BLOCK_FRAMES  64
+
+// Mode the stream paths requantize with
+#define CAVERN_DEFAULT_DITHER       CavernDitherTpdf
+
+typedef enum _CAVERN_DITHER_MODE {
+    CavernDitherNone = 0,       // round to nearest, as FromFloat
+    CavernDitherTpdf,           // triangular dither, flat noise
+    CavernDitherHighpass,       // TPDF, first-order shaping (1 - z^-1)
+    CavernDitherWeighted,       // TPDF, 3-tap psychoacoustic shaping
+    CavernDitherModeCount
+} CAVERN_DITHER_MODE;
+
+typedef struct _CAVERN_REQUANTIZE_STATE {
+    ULONG   Channels;
+    float   Scale;              // full scale in LSB
+    float   InverseScale;
+    float   Low;                // clamp range in LSB
+    float   High;
+    float   Coefficients[CAVERN_DITHER_MAX_TAPS];
+    ULONG   Random[CAVERN_MAX_CHANNELS];
+    float   Error[CAVERN_DITHER_MAX_TAPS][CAVERN_MAX_CHANNELS];    // newest first
+} CAVERN_REQUANTIZE_STATE, *PCAVERN_REQUANTIZE_STATE;
+
+// Requantizes Frames interleaved frames to float values that land exactly
+// on the target's integer grid.
+typedef VOID (*PCAVERN_REQUANTIZE_KERNEL)(
+    _Inout_ PCAVERN_REQUANTIZE_STATE State,
+    _In_reads_(Frames * State->Channels) const float *Source,
+    _Out_writes_(Frames * State->Channels) float *Destination,
+    _In_ SIZE_T Frames
+);
+
+class CCavernRequantizer
+{
+public:
+    CCavernRequantizer();
+
+    NTSTATUS Init(
+        _In_ CAVERN_SAMPLE_FORMAT Format,
+        _In_ ULONG Channels,
+        _In_ CAVERN_DITHER_MODE Mode,
+        _In_ BOOLEAN AllowSimd
+    );
+
+    // Reseeds the generators and clears the shaping history.
+    VOID Reset();
+
+    // Converts FrameCount interleaved float frames to the Init format.
+    VOID Process(
+        _In_reads_(FrameCount * m_State.Channels) const float *Source,
+        _Out_writes_bytes_(FrameCount * m_ulFrameSize) VOID *Destination,
+        _In_ SIZE_T FrameCount
+    );
+
+    BOOLEAN IsInitialized() const { return m_State.Channels != 0; }
+    CAVERN_DITHER_MODE GetMode() const { return m_Kernel ? m_Mode : CavernDitherNone; }
+
+private:
+    CAVERN_CONVERTER            m_Converter;
+    CAVERN_DITHER_MODE          m_Mode;
+    PCAVERN_REQUANTIZE_KERNEL   m_Kernel;       // NULL: FromFloat alone
+    ULONG                       m_ulFrameSize;
+    CAVERN_REQUANTIZE_STATE     m_State;
+
+    float                       m_Block[CAVERN_DITHER_BLOCK_FRAMES * CAVERN_MAX_CHANNELS];
+};
+
+#endif // _CAVERN_REQUANTIZER_H_
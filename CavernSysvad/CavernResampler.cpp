@@ -0,0 +1,480 @@
+/***************************************************************************
+ * CavernResampler.cpp
+ *
+ * Polyphase sample-rate converter implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernResampler.h"
+
+#define CAVERN_SRC_PI   3.14159265358979323846
+
+//=============================================================================
+// Dot product kernels: one output sample of one channel
+//=============================================================================
+
+static VOID DotScalar(const float *Coefficients, const float *History, ULONG Taps, float *Result)
+{
+    float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+
+    for (ULONG t = 0; t < Taps; t += 4) {
+        sum[0] += Coefficients[t + 0] * History[t + 0];
+        sum[1] += Coefficients[t + 1] * History[t + 1];
+        sum[2] += Coefficients[t + 2] * History[t + 2];
+        sum[3] += Coefficients[t + 3] * History[t + 3];
+    }
+    *Result = (sum[0] + sum[2]) + (sum[1] + sum[3]);
+}
+
+#if defined(CAVERN_HAVE_SSE2)
+static VOID DotSse2(const float *Coefficients, const float *History, ULONG Taps, float *Result)
+{
+    __m128 a = _mm_setzero_ps();
+    __m128 b = _mm_setzero_ps();
+
+    // Taps is a multiple of 8; two accumulators hide the add latency
+    for (ULONG t = 0; t < Taps; t += 8) {
+        a = _mm_add_ps(a, _mm_mul_ps(_mm_loadu_ps(Coefficients + t), _mm_loadu_ps(History + t)));
+        b = _mm_add_ps(b, _mm_mul_ps(_mm_loadu_ps(Coefficients + t + 4), _mm_loadu_ps(History + t + 4)));
+    }
+    a = _mm_add_ps(a, b);
+    a = _mm_add_ps(a, _mm_movehl_ps(a, a));
+    a = _mm_add_ss(a, _mm_shuffle_ps(a, a, 1));
+    _mm_store_ss(Result, a);
+}
+#endif
+
+#if defined(CAVERN_HAVE_AVX2) && defined(CAVERN_HAVE_FMA)
+static VOID DotAvx2(const float *Coefficients, const float *History, ULONG Taps, float *Result)
+{
+    __m256 a = _mm256_setzero_ps();
+    __m256 b = _mm256_setzero_ps();
+    ULONG t = 0;
+
+    for (; t + 16 <= Taps; t += 16) {
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(Coefficients + t), _mm256_loadu_ps(History + t), a);
+        b = _mm256_fmadd_ps(_mm256_loadu_ps(Coefficients + t + 8), _mm256_loadu_ps(History + t + 8), b);
+    }
+    if (t < Taps) {
+        a = _mm256_fmadd_ps(_mm256_loadu_ps(Coefficients + t), _mm256_loadu_ps(History + t), a);
+    }
+    a = _mm256_add_ps(a, b);
+
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(a), _mm256_extractf128_ps(a, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    _mm_store_ss(Result, s);
+}
+#endif
+
+//=============================================================================
+// Filter design
+//=============================================================================
+
+static ULONG Gcd(ULONG a, ULONG b)
+{
+    while (b) {
+        ULONG r = a % b;
+        a = b;
+        b = r;
+    }
+    return a;
+}
+
+// Zeroth-order modified Bessel function of the first kind
+static double BesselI0(double x)
+{
+    double sum = 1.0;
+    double term = 1.0;
+
+    for (int k = 1; k < 64; k++) {
+        double f = x / (2.0 * k);
+        term *= f * f;
+        sum += term;
+        if (term < sum * 1e-16) {
+            break;
+        }
+    }
+    return sum;
+}
+
+//
+// Fills the bank: row r evaluates the windowed sinc at an output instant
+// r/m_ulPhases of an input frame after the centre tap, and is normalized
+// to unity DC gain so no phase modulates the level.
+//
+NTSTATUS CCavernResampler::BuildBank(double Cutoff)
+{
+    const ULONG rows = m_ulPhases + (m_bInterpolated ? 1 : 0);
+    const double half = (double)m_ulTaps / 2.0;
+    const double norm = BesselI0(CAVERN_SRC_KAISER_BETA);
+
+    for (ULONG r = 0; r < rows; r++) {
+        float *row = m_pBank + (SIZE_T)r * m_ulTaps;
+        double fraction = (double)r / (double)m_ulPhases;
+        double sum = 0.0;
+
+        for (ULONG t = 0; t < m_ulTaps; t++) {
+            double x = half - 1.0 - (double)t + fraction;
+            double h = 0.0;
+
+            if (fabs(x) < half) {
+                double ratio = x / half;
+                double sinc = (x == 0.0) ? 2.0 * Cutoff : sin(2.0 * CAVERN_SRC_PI * Cutoff * x) / (CAVERN_SRC_PI * x);
+                h = sinc * BesselI0(CAVERN_SRC_KAISER_BETA * sqrt(1.0 - ratio * ratio)) / norm;
+            }
+            row[t] = (float)h;
+            sum += h;
+        }
+
+        if (sum == 0.0) {
+            return STATUS_INVALID_PARAMETER;
+        }
+        for (ULONG t = 0; t < m_ulTaps; t++) {
+            row[t] = (float)((double)row[t] / sum);
+        }
+    }
+
+    return STATUS_SUCCESS;
+}
+
+//=============================================================================
+// CCavernResampler
+//=============================================================================
+
+CCavernResampler::CCavernResampler()
+    : m_Dot(NULL),
+      m_ulChannels(0),
+      m_ulFrameSize(0),
+      m_bVariable(FALSE),
+      m_bInterpolated(FALSE),
+      m_pBank(NULL),
+      m_ulTaps(0),
+      m_ulPhases(0),
+      m_ulInterpolation(1),
+      m_ulDecimation(1),
+      m_ulPhase(0),
+      m_ulFraction(0),
+      m_ullBaseStep(0),
+      m_ullStep(0),
+      m_pHistory(NULL),
+      m_ulHistoryStride(0),
+      m_ulValid(0),
+      m_ulWindow(0),
+      m_pInputBlock(NULL),
+      m_pOutputBlock(NULL),
+      m_pRow(NULL)
+{
+    RtlZeroMemory(&m_Converter, sizeof(m_Converter));
+}
+
+CCavernResampler::~CCavernResampler()
+{
+    Cleanup();
+}
+
+VOID CCavernResampler::Cleanup()
+{
+    if (m_pBank) {
+        CavernFree(m_pBank, CAVERN_RESAMPLER_POOLTAG);
+        m_pBank = NULL;
+    }
+    if (m_pHistory) {
+        CavernFree(m_pHistory, CAVERN_RESAMPLER_POOLTAG);
+        m_pHistory = NULL;
+    }
+
+    // The scratch blocks and the row share the history allocation
+    m_pInputBlock = NULL;
+    m_pOutputBlock = NULL;
+    m_pRow = NULL;
+    m_ulChannels = 0;
+}
+
+NTSTATUS CCavernResampler::Init(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ ULONG Channels,
+    _In_ ULONG InputRate,
+    _In_ ULONG OutputRate,
+    _In_ BOOLEAN Variable,
+    _In_ CAVERN_DITHER_MODE Dither,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || !InputRate || !OutputRate) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    NTSTATUS status = CavernSelectConverter(Format, AllowSimd, &m_Converter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    status = m_Requantizer.Init(Format, Channels, Dither, AllowSimd);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    ULONG gcd = Gcd(InputRate, OutputRate);
+    m_ulInterpolation = OutputRate / gcd;
+    m_ulDecimation = InputRate / gcd;
+    m_bVariable = Variable;
+    m_bInterpolated = Variable || m_ulInterpolation > CAVERN_SRC_MAX_PHASES;
+    m_ulPhases = m_bInterpolated ? CAVERN_SRC_VARIABLE_PHASES : m_ulInterpolation;
+
+    // Longer filters when decimating, so the transition band keeps its
+    // width relative to the output rate. Multiples of 8 for the kernels.
+    ULONGLONG taps = CAVERN_SRC_BASE_TAPS;
+    if (InputRate > OutputRate) {
+        taps = ((ULONGLONG)CAVERN_SRC_BASE_TAPS * InputRate + OutputRate - 1) / OutputRate;
+    }
+    m_ulTaps = (ULONG)((taps + 7) & ~7ull);
+
+    // Outputs step at most ceil(M/L) input frames, so the history holds a
+    // window, one input block, and one step of overshoot.
+    ULONG jump = (m_ulDecimation + m_ulInterpolation - 1) / m_ulInterpolation;
+    m_ulHistoryStride = (m_ulTaps + CAVERN_SRC_BLOCK_FRAMES + jump + 3) & ~3u;
+
+    SIZE_T bankFloats = (SIZE_T)(m_ulPhases + 1) * m_ulTaps;
+    SIZE_T workFloats = (SIZE_T)Channels * m_ulHistoryStride +
+                        2 * (SIZE_T)CAVERN_SRC_BLOCK_FRAMES * Channels +
+                        m_ulTaps;
+
+    m_pBank = (float *)CavernAllocate(bankFloats * sizeof(float), CAVERN_RESAMPLER_POOLTAG);
+    m_pHistory = (float *)CavernAllocate(workFloats * sizeof(float), CAVERN_RESAMPLER_POOLTAG);
+    if (!m_pBank || !m_pHistory) {
+        Cleanup();
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    m_pInputBlock = m_pHistory + (SIZE_T)Channels * m_ulHistoryStride;
+    m_pOutputBlock = m_pInputBlock + (SIZE_T)CAVERN_SRC_BLOCK_FRAMES * Channels;
+    m_pRow = m_pOutputBlock + (SIZE_T)CAVERN_SRC_BLOCK_FRAMES * Channels;
+
+    // Cutoff in cycles per input frame, below the lower Nyquist frequency
+    double cutoff = 0.5 * CAVERN_SRC_CUTOFF;
+    if (OutputRate < InputRate) {
+        cutoff = cutoff * (double)OutputRate / (double)InputRate;
+    }
+
+    status = BuildBank(cutoff);
+    if (!NT_SUCCESS(status)) {
+        Cleanup();
+        return status;
+    }
+
+    m_Dot = DotScalar;
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        m_Dot = DotSse2;
+    }
+#endif
+#if defined(CAVERN_HAVE_AVX2) && defined(CAVERN_HAVE_FMA)
+    if (AllowSimd) {
+        m_Dot = DotAvx2;
+    }
+#endif
+
+    m_ullBaseStep = (((ULONGLONG)InputRate << 32) + OutputRate / 2) / OutputRate;
+    m_ullStep = m_ullBaseStep;
+    m_ulFrameSize = Channels * m_Converter.BytesPerSample;
+    m_ulChannels = Channels;
+
+    Reset();
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernResampler::Reset()
+{
+    if (!m_pHistory) {
+        return;
+    }
+
+    // Prime with silence so the first output is centred on the first input
+    RtlZeroMemory(m_pHistory, (SIZE_T)m_ulChannels * m_ulHistoryStride * sizeof(float));
+    m_ulValid = m_ulTaps / 2 - 1;
+    m_ulWindow = 0;
+    m_ulPhase = 0;
+    m_ulFraction = 0;
+    m_Requantizer.Reset();
+}
+
+NTSTATUS CCavernResampler::SetDrift(_In_ LONG DriftPpb)
+{
+    if (!m_bVariable) {
+        return STATUS_INVALID_DEVICE_STATE;
+    }
+
+    LONGLONG drift = min(max((LONGLONG)DriftPpb, -(LONGLONG)CAVERN_SRC_MAX_DRIFT_PPB), (LONGLONG)CAVERN_SRC_MAX_DRIFT_PPB);
+    m_ullStep = (ULONGLONG)((LONGLONG)m_ullBaseStep + ((LONGLONG)m_ullBaseStep * drift) / 1000000000);
+
+    return STATUS_SUCCESS;
+}
+
+//
+// Appends Frames input frames to the planar history (silence for NULL).
+//
+VOID CCavernResampler::LoadInput(const BYTE *Input, ULONG Frames)
+{
+    const ULONG channels = m_ulChannels;
+
+    if (!Input) {
+        for (ULONG c = 0; c < channels; c++) {
+            RtlZeroMemory(m_pHistory + (SIZE_T)c * m_ulHistoryStride + m_ulValid, Frames * sizeof(float));
+        }
+        m_ulValid += Frames;
+        return;
+    }
+
+    m_Converter.ToFloat(Input, m_pInputBlock, (SIZE_T)Frames * channels);
+
+    for (ULONG c = 0; c < channels; c++) {
+        float *row = m_pHistory + (SIZE_T)c * m_ulHistoryStride + m_ulValid;
+        const float *source = m_pInputBlock + c;
+
+        for (ULONG f = 0; f < Frames; f++) {
+            row[f] = source[(SIZE_T)f * channels];
+        }
+    }
+    m_ulValid += Frames;
+}
+
+VOID CCavernResampler::Filter(const float *Coefficients, ULONG Offset, float *Frame)
+{
+    for (ULONG c = 0; c < m_ulChannels; c++) {
+        m_Dot(Coefficients, m_pHistory + (SIZE_T)c * m_ulHistoryStride + Offset, m_ulTaps, &Frame[c]);
+    }
+}
+
+VOID CCavernResampler::Process(
+    _In_reads_bytes_opt_(InputFrames * m_ulFrameSize) const VOID *Input,
+    _In_ SIZE_T InputFrames,
+    _Out_writes_bytes_(OutputFrames * m_ulFrameSize) VOID *Output,
+    _In_ SIZE_T OutputFrames,
+    _Out_ SIZE_T *InputUsed,
+    _Out_ SIZE_T *OutputProduced
+)
+{
+    Convert(Input, InputFrames, (BYTE *)Output, NULL, OutputFrames, InputUsed, OutputProduced);
+}
+
+VOID CCavernResampler::ProcessFloat(
+    _In_reads_bytes_opt_(InputFrames * m_ulFrameSize) const VOID *Input,
+    _In_ SIZE_T InputFrames,
+    _Out_writes_(OutputFrames * m_ulChannels) float *Output,
+    _In_ SIZE_T OutputFrames,
+    _Out_ SIZE_T *InputUsed,
+    _Out_ SIZE_T *OutputProduced
+)
+{
+    Convert(Input, InputFrames, NULL, Output, OutputFrames, InputUsed, OutputProduced);
+}
+
+//
+// Filters into FloatOutput directly when it is given, otherwise into the
+// scratch block, requantized into Output one block at a time.
+//
+VOID CCavernResampler::Convert(
+    const VOID *Input,
+    SIZE_T InputFrames,
+    BYTE *Output,
+    float *FloatOutput,
+    SIZE_T OutputFrames,
+    SIZE_T *InputUsed,
+    SIZE_T *OutputProduced
+)
+{
+    const BYTE *input = (const BYTE *)Input;
+    SIZE_T used = 0;
+    SIZE_T produced = 0;
+    ULONG pending = 0;
+
+    *InputUsed = 0;
+    *OutputProduced = 0;
+
+    if (!m_pBank) {
+        return;
+    }
+
+    while (produced + pending < OutputFrames) {
+        if (m_ulWindow + m_ulTaps > m_ulValid) {
+            if (used == InputFrames) {
+                break;
+            }
+
+            // Drop what no window will read again, then take another block
+            ULONG shift = min(m_ulWindow, m_ulValid);
+            if (shift) {
+                for (ULONG c = 0; c < m_ulChannels; c++) {
+                    float *row = m_pHistory + (SIZE_T)c * m_ulHistoryStride;
+                    RtlMoveMemory(row, row + shift, (m_ulValid - shift) * sizeof(float));
+                }
+                m_ulValid -= shift;
+                m_ulWindow -= shift;
+            }
+
+            ULONG frames = (ULONG)min(InputFrames - used, (SIZE_T)CAVERN_SRC_BLOCK_FRAMES);
+            frames = min(frames, m_ulHistoryStride - m_ulValid);
+
+            LoadInput(input ? input + used * m_ulFrameSize : NULL, frames);
+            used += frames;
+            continue;
+        }
+
+        float *frame = FloatOutput ?
+            FloatOutput + (produced + pending) * m_ulChannels :
+            m_pOutputBlock + (SIZE_T)pending * m_ulChannels;
+
+        if (m_bInterpolated) {
+            // Blend the two bank rows around the fractional position
+            ULONGLONG scaled = (ULONGLONG)m_ulFraction * m_ulPhases;
+            const float *lower = m_pBank + (SIZE_T)(scaled >> 32) * m_ulTaps;
+            const float *upper = lower + m_ulTaps;
+            float alpha = (float)(ULONG)scaled * (1.0f / 4294967296.0f);
+            ULONG t = 0;
+
+#if defined(CAVERN_HAVE_SSE2)
+            __m128 a = _mm_set1_ps(alpha);
+            for (; t < m_ulTaps; t += 4) {
+                __m128 l = _mm_loadu_ps(lower + t);
+                _mm_storeu_ps(m_pRow + t, _mm_add_ps(l, _mm_mul_ps(a, _mm_sub_ps(_mm_loadu_ps(upper + t), l))));
+            }
+#endif
+            for (; t < m_ulTaps; t++) {
+                m_pRow[t] = lower[t] + alpha * (upper[t] - lower[t]);
+            }
+
+            Filter(m_pRow, m_ulWindow, frame);
+
+            ULONGLONG position = (ULONGLONG)m_ulFraction + m_ullStep;
+            m_ulWindow += (ULONG)(position >> 32);
+            m_ulFraction = (ULONG)position;
+        } else {
+            Filter(m_pBank + (SIZE_T)m_ulPhase * m_ulTaps, m_ulWindow, frame);
+
+            m_ulPhase += m_ulDecimation;
+            m_ulWindow += m_ulPhase / m_ulInterpolation;
+            m_ulPhase %= m_ulInterpolation;
+        }
+
+        if (++pending == CAVERN_SRC_BLOCK_FRAMES) {
+            if (!FloatOutput) {
+                m_Requantizer.Process(m_pOutputBlock, Output + produced * m_ulFrameSize, pending);
+            }
+            produced += pending;
+            pending = 0;
+        }
+    }
+
+    if (pending) {
+        if (!FloatOutput) {
+            m_Requantizer.Process(m_pOutputBlock, Output + produced * m_ulFrameSize, pending);
+        }
+        produced += pending;
+    }
+
+    *InputUsed = used;
+    *OutputProduced = produced;
+}
@@ -0,0 +1,171 @@
+/***************************************************************************
+ * CavernResampler.h
+ *
+ * Polyphase sample-rate conversion of interleaved PCM. The filter bank is
+ * a Kaiser-windowed sinc computed once at Init for the stream's reduced
+ * ratio L/M: in fixed mode every output lands exactly on one of L phases,
+ * stepped with integer arithmetic. Variable mode uses a finer bank with
+ * linear interpolation between phases and a 32.32 input position whose
+ * step can be nudged by a measured clock drift while the stream runs.
+ *
+ * The filter length grows with the decimation factor so the cutoff stays
+ * below the lower of the two Nyquist frequencies. Process requantizes the
+ * filter output to the input format; ProcessFloat hands it over as float
+ * for callers that mix or requantize it themselves. Init builds the bank
+ * with double math and Process runs float kernels; callers must bracket
+ * both with KeSaveFloatingPointState / KeRestoreFloatingPointState.
+ ***************************************************************************/
+
+#ifndef _CAVERN_RESAMPLER_H_
+#define _CAVERN_RESAMPLER_H_
+
+#include "CavernFormatConvert.h"
+#include "CavernRequantizer.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_RESAMPLER_POOLTAG    'rSvC'
+
+// Taps per phase at ratios near 1:1; scaled up by the decimation factor
+#define CAVERN_SRC_BASE_TAPS        128
+
+// Kaiser window shape (about 90 dB stopband) and cutoff as a fraction of
+// the lower Nyquist frequency
+#define CAVERN_SRC_KAISER_BETA      9.0
+#define CAVERN_SRC_CUTOFF           0.91
+
+// Fixed mode takes the exact bank when the reduced ratio has at most this
+// many phases (44.1 kHz -> 192 kHz is 640); otherwise it interpolates.
+#define CAVERN_SRC_MAX_PHASES       1024
+
+// Phases of the interpolated bank (variable mode, or too many exact phases)
+#define CAVERN_SRC_VARIABLE_PHASES  256
+
+// Largest drift correction SetDrift accepts (1000 ppm)
+#define CAVERN_SRC_MAX_DRIFT_PPB    1000000
+
+// Input frames converted to float per pass
+#define CAVERN_SRC_BLOCK_FRAMES     256
+
+typedef VOID (*PCAVERN_SRC_DOT)(
+    _In_reads_(Taps) const float *Coefficients,
+    _In_reads_(Taps) const float *History,
+    _In_ ULONG Taps,
+    _Out_ float *Result
+);
+
+class CCavernResampler
+{
+public:
+    CCavernResampler();
+    ~CCavernResampler();
+
+    // Variable: follow SetDrift corrections instead of the exact ratio.
+    // Dither: how integer output is requantized from the float filter.
+    NTSTATUS Init(
+        _In_ CAVERN_SAMPLE_FORMAT Format,
+        _In_ ULONG Channels,
+        _In_ ULONG InputRate,
+        _In_ ULONG OutputRate,
+        _In_ BOOLEAN Variable,
+        _In_ CAVERN_DITHER_MODE Dither,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Forgets the history and phase (stream restart).
+    VOID Reset();
+
+    // Input clock drift relative to the output clock, in parts per
+    // billion; positive when the input runs fast. Variable mode only.
+    NTSTATUS SetDrift(_In_ LONG DriftPpb);
+
+    // Converts InputFrames frames of the Init format, writing at most
+    // OutputFrames frames. *InputUsed tells how many input frames were
+    // taken (they are kept in the history); the rest must be offered again.
+    // A NULL Input feeds silence, which drains the filter at end of stream.
+    VOID Process(
+        _In_reads_bytes_opt_(InputFrames * m_ulFrameSize) const VOID *Input,
+        _In_ SIZE_T InputFrames,
+        _Out_writes_bytes_(OutputFrames * m_ulFrameSize) VOID *Output,
+        _In_ SIZE_T OutputFrames,
+        _Out_ SIZE_T *InputUsed,
+        _Out_ SIZE_T *OutputProduced
+    );
+
+    // As Process, but writes interleaved float, unclipped and without the
+    // requantizer; the Init dither mode does not apply.
+    VOID ProcessFloat(
+        _In_reads_bytes_opt_(InputFrames * m_ulFrameSize) const VOID *Input,
+        _In_ SIZE_T InputFrames,
+        _Out_writes_(OutputFrames * m_ulChannels) float *Output,
+        _In_ SIZE_T OutputFrames,
+        _Out_ SIZE_T *InputUsed,
+        _Out_ SIZE_T *OutputProduced
+    );
+
+    // Group delay in input frames.
+    ULONG GetLatencyFrames() const { return m_ulTaps / 2; }
+
+    BOOLEAN IsInitialized() const { return m_pBank != NULL; }
+    BOOLEAN IsVariable() const { return m_bVariable; }
+    ULONG GetTaps() const { return m_ulTaps; }
+    ULONG GetPhases() const { return m_ulPhases; }
+    ULONG GetFrameSize() const { return m_ulFrameSize; }
+
+private:
+    NTSTATUS BuildBank(_In_ double Cutoff);
+    VOID Convert(
+        _In_reads_bytes_opt_(InputFrames * m_ulFrameSize) const VOID *Input,
+        _In_ SIZE_T InputFrames,
+        _Out_writes_bytes_opt_(OutputFrames * m_ulFrameSize) BYTE *Output,
+        _Out_writes_opt_(OutputFrames * m_ulChannels) float *FloatOutput,
+        _In_ SIZE_T OutputFrames,
+        _Out_ SIZE_T *InputUsed,
+        _Out_ SIZE_T *OutputProduced
+    );
+    VOID LoadInput(_In_reads_bytes_(Frames * m_ulFrameSize) const BYTE *Input, _In_ ULONG Frames);
+    VOID Filter(_In_ const float *Coefficients, _In_ ULONG Offset, _Out_writes_(m_ulChannels) float *Frame);
+
+    CAVERN_CONVERTER    m_Converter;
+    CCavernRequantizer  m_Requantizer;
+    PCAVERN_SRC_DOT     m_Dot;
+    ULONG               m_ulChannels;
+    ULONG               m_ulFrameSize;
+    BOOLEAN             m_bVariable;
+    BOOLEAN             m_bInterpolated;    // bank is stepped by m_ullStep
+
+    // Bank: m_ulPhases rows (+1 when interpolated) of m_ulTaps coefficients,
+    // oldest input first, rows aligned for vector loads.
+    float              *m_pBank;
+    ULONG               m_ulTaps;
+    ULONG               m_ulPhases;
+
+    // Exact bank: output k sits at input k*M/L; m_ulPhase is (k*M) mod L.
+    ULONG               m_ulInterpolation;  // L
+    ULONG               m_ulDecimation;     // M
+    ULONG               m_ulPhase;
+
+    // Interpolated bank: 32.32 fractional position and step, in input frames
+    ULONG               m_ulFraction;
+    ULONGLONG           m_ullBaseStep;
+    ULONGLONG           m_ullStep;
+
+    // Planar history, one row of m_ulHistoryStride floats per channel.
+    // m_ulValid samples are loaded; the next output's window starts at
+    // m_ulWindow and needs m_ulTaps of them.
+    float              *m_pHistory;
+    ULONG               m_ulHistoryStride;
+    ULONG               m_ulValid;
+    ULONG               m_ulWindow;
+
+    // Scratch: one block of interleaved input, one of output, and the
+    // interpolated coefficient row.
+    float              *m_pInputBlock;
+    float              *m_pOutputBlock;
+    float              *m_pRow;
+};
+
+#endif // _CAVERN_RESAMPLER_H_
@@ -0,0 +1,360 @@
+/***************************************************************************
+ * CavernSilenceGate.cpp
+ *
+ * Idle detection and silence markers implementation
+ ***************************************************************************/
+
+#include "CavernSilenceGate.h"
+
+//=============================================================================
+// Scalar kernels. Threshold is in the raw units of the format; for float it
+// is the bit pattern of the positive limit, compared against |x| as an
+// integer (NaN compares loud).
+//=============================================================================
+
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample>
+static BOOLEAN QuietScalar(const BYTE *Buffer, SIZE_T Length, ULONG Threshold)
+{
+    const LONG limit = (LONG)Threshold;
+
+    for (SIZE_T i = 0; i + BytesPerSample <= Length; i += BytesPerSample) {
+        const BYTE *p = Buffer + i;
+        LONG value;
+
+        switch (Format) {
+            case CavernSampleU8:
+                value = (LONG)p[0] - 128;
+                break;
+            case CavernSampleS16:
+                value = *(const SHORT *)p;
+                break;
+            case CavernSampleS24Packed:
+                value = (LONG)(((ULONG)p[0] << 8) | ((ULONG)p[1] << 16) | ((ULONG)p[2] << 24)) >> 8;
+                break;
+            case CavernSampleF32:
+                value = (LONG)(*(const ULONG *)p & 0x7FFFFFFF);
+                break;
+            default:
+                value = *(const LONG *)p;
+                break;
+        }
+
+        if (value > limit || value < -limit) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+#if defined(CAVERN_HAVE_SSE2)
+
+//=============================================================================
+// SSE2 kernels: 128 bytes per pass, one movemask per pass to leave at the
+// first loud sample. Signed formats test x > T or x < -T in their own lane
+// width; U8 is made signed by flipping the top bit.
+//=============================================================================
+
+template <CAVERN_SAMPLE_FORMAT Format, ULONG BytesPerSample>
+static BOOLEAN QuietSse2(const BYTE *Buffer, SIZE_T Length, ULONG Threshold)
+{
+    __m128i high;
+    __m128i low;
+    __m128i bias = _mm_setzero_si128();
+    __m128i mask = _mm_set1_epi32(-1);
+
+    switch (Format) {
+        case CavernSampleU8:
+            high = _mm_set1_epi8((char)Threshold);
+            low = _mm_set1_epi8((char)-(LONG)Threshold);
+            bias = _mm_set1_epi8((char)0x80);
+            break;
+        case CavernSampleS16:
+            high = _mm_set1_epi16((SHORT)Threshold);
+            low = _mm_set1_epi16((SHORT)-(LONG)Threshold);
+            break;
+        case CavernSampleF32:
+            high = _mm_set1_epi32((LONG)Threshold);
+            low = _mm_set1_epi32(-1);
+            mask = _mm_set1_epi32(0x7FFFFFFF);
+            break;
+        default:
+            high = _mm_set1_epi32((LONG)Threshold);
+            low = _mm_set1_epi32(-(LONG)Threshold);
+            break;
+    }
+
+    SIZE_T i = 0;
+    for (; i + 128 <= Length; i += 128) {
+        __m128i loud = _mm_setzero_si128();
+
+        for (ULONG v = 0; v < 8; v++) {
+            __m128i x = _mm_loadu_si128((const __m128i *)(Buffer + i + v * 16));
+
+            switch (Format) {
+                case CavernSampleU8:
+                    x = _mm_xor_si128(x, bias);
+                    loud = _mm_or_si128(loud, _mm_or_si128(_mm_cmpgt_epi8(x, high), _mm_cmplt_epi8(x, low)));
+                    break;
+                case CavernSampleS16:
+                    loud = _mm_or_si128(loud, _mm_or_si128(_mm_cmpgt_epi16(x, high), _mm_cmplt_epi16(x, low)));
+                    break;
+                case CavernSampleF32:
+                    loud = _mm_or_si128(loud, _mm_cmpgt_epi32(_mm_and_si128(x, mask), high));
+                    break;
+                default:
+                    loud = _mm_or_si128(loud, _mm_or_si128(_mm_cmpgt_epi32(x, high), _mm_cmplt_epi32(x, low)));
+                    break;
+            }
+        }
+
+        if (_mm_movemask_epi8(loud)) {
+            return FALSE;
+        }
+    }
+
+    return QuietScalar<Format, BytesPerSample>(Buffer + i, Length - i, Threshold);
+}
+
+//
+// Packed 24-bit has no lane width to compare in, so 48 bytes (16 samples)
+// at a time are first tested for all-zero bytes, the common idle case, and
+// only blocks with some bits set go through the scalar compare.
+//
+static BOOLEAN QuietSse2S24Packed(const BYTE *Buffer, SIZE_T Length, ULONG Threshold)
+{
+    const __m128i zero = _mm_setzero_si128();
+
+    SIZE_T i = 0;
+    for (; i + 48 <= Length; i += 48) {
+        __m128i bits = _mm_or_si128(
+            _mm_or_si128(_mm_loadu_si128((const __m128i *)(Buffer + i)),
+                         _mm_loadu_si128((const __m128i *)(Buffer + i + 16))),
+            _mm_loadu_si128((const __m128i *)(Buffer + i + 32)));
+
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(bits, zero)) != 0xFFFF &&
+            !QuietScalar<CavernSampleS24Packed, 3>(Buffer + i, 48, Threshold)) {
+            return FALSE;
+        }
+    }
+
+    return QuietScalar<CavernSampleS24Packed, 3>(Buffer + i, Length - i, Threshold);
+}
+
+#endif // CAVERN_HAVE_SSE2
+
+static PCAVERN_QUIET_KERNEL SelectQuietKernel(CAVERN_SAMPLE_FORMAT Format, BOOLEAN AllowSimd)
+{
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        switch (Format) {
+            case CavernSampleU8:        return QuietSse2<CavernSampleU8, 1>;
+            case CavernSampleS16:       return QuietSse2<CavernSampleS16, 2>;
+            case CavernSampleS24Packed: return QuietSse2S24Packed;
+            case CavernSampleS24In32:   return QuietSse2<CavernSampleS24In32, 4>;
+            case CavernSampleS32:       return QuietSse2<CavernSampleS32, 4>;
+            case CavernSampleF32:       return QuietSse2<CavernSampleF32, 4>;
+            default:                    break;
+        }
+    }
+#else
+    UNREFERENCED_PARAMETER(AllowSimd);
+#endif
+
+    switch (Format) {
+        case CavernSampleU8:        return QuietScalar<CavernSampleU8, 1>;
+        case CavernSampleS16:       return QuietScalar<CavernSampleS16, 2>;
+        case CavernSampleS24Packed: return QuietScalar<CavernSampleS24Packed, 3>;
+        case CavernSampleS24In32:   return QuietScalar<CavernSampleS24In32, 4>;
+        case CavernSampleS32:       return QuietScalar<CavernSampleS32, 4>;
+        case CavernSampleF32:       return QuietScalar<CavernSampleF32, 4>;
+        default:                    return NULL;
+    }
+}
+
+//
+// Scales a threshold in 16-bit LSBs to the raw units of Format. Float gets
+// the bit pattern of Lsb16 / 32768, built with integer math (Lsb16 has at
+// most 15 significant bits, so it is exact).
+//
+static ULONG ScaleThreshold(CAVERN_SAMPLE_FORMAT Format, ULONG Lsb16)
+{
+    switch (Format) {
+        case CavernSampleU8:
+            return Lsb16 >> 8;
+        case CavernSampleS16:
+            return Lsb16;
+        case CavernSampleS24Packed:
+            return Lsb16 << 8;
+        case CavernSampleS24In32:
+        case CavernSampleS32:
+            return Lsb16 << 16;
+        default: {
+            if (!Lsb16) {
+                return 0;
+            }
+            ULONG msb = 0;
+            while (Lsb16 >> (msb + 1)) {
+                msb++;
+            }
+            return ((msb + 127 - 15) << 23) | ((Lsb16 << (23 - msb)) & 0x7FFFFF);
+        }
+    }
+}
+
+CCavernSilenceGate::CCavernSilenceGate()
+    : m_Kernel(NULL),
+      m_ulThreshold(0),
+      m_ulFrameSize(0),
+      m_Fill(0),
+      m_ulHoldFrames(0),
+      m_ulMarkerFrames(1),
+      m_Sink(NULL),
+      m_MarkerSink(NULL),
+      m_SinkContext(NULL),
+      m_bIdle(FALSE),
+      m_ullSilentFrames(0),
+      m_ulPendingFrames(0),
+      m_ullSuppressedFrames(0),
+      m_ulIdleCount(0)
+{
+}
+
+NTSTATUS CCavernSilenceGate::Init(
+    _In_ CAVERN_SAMPLE_FORMAT Format,
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG ThresholdLsb16,
+    _In_ BOOLEAN AllowSimd,
+    _In_ PCAVERN_FORWARD_SINK Sink,
+    _In_ PCAVERN_FORWARD_SINK MarkerSink,
+    _In_opt_ PVOID SinkContext
+)
+{
+    m_Kernel = NULL;
+
+    if (!Channels || Channels > 0xFFFF / 4 || !SampleRate || !Sink || !MarkerSink) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    CAVERN_CONVERTER converter;
+    NTSTATUS status = CavernSelectConverter(Format, FALSE, &converter);
+    if (!NT_SUCCESS(status)) {
+        return status;
+    }
+
+    m_ulThreshold = ScaleThreshold(Format, min(ThresholdLsb16, 32767u));
+    m_ulFrameSize = Channels * converter.BytesPerSample;
+    m_Fill = (Format == CavernSampleU8) ? 0x80 : 0;
+    m_ulHoldFrames = SampleRate / 1000 * CAVERN_SILENCE_HOLD_MS;
+    m_ulMarkerFrames = max(SampleRate / 1000 * CAVERN_SILENCE_MARKER_MS, 1u);
+    m_Sink = Sink;
+    m_MarkerSink = MarkerSink;
+    m_SinkContext = SinkContext;
+    m_ullSuppressedFrames = 0;
+    m_ulIdleCount = 0;
+    Reset();
+
+    m_Kernel = SelectQuietKernel(Format, AllowSimd);
+
+    return m_Kernel ? STATUS_SUCCESS : STATUS_NOT_SUPPORTED;
+}
+
+VOID CCavernSilenceGate::Cleanup()
+{
+    m_Kernel = NULL;
+    Reset();
+}
+
+VOID CCavernSilenceGate::Reset()
+{
+    m_bIdle = FALSE;
+    m_ullSilentFrames = 0;
+    m_ulPendingFrames = 0;
+}
+
+//
+// Sends the pending count, split so that no marker stands for more than
+// CAVERN_PIPE_PACKET_MAX_LENGTH bytes, the most a receiver will expand.
+//
+NTSTATUS CCavernSilenceGate::SendMarker()
+{
+    const ULONG maxFrames = CAVERN_PIPE_PACKET_MAX_LENGTH / m_ulFrameSize;
+    NTSTATUS status = STATUS_SUCCESS;
+
+    while (m_ulPendingFrames) {
+        CAVERN_SILENCE_MARKER marker;
+        marker.Frames = min(m_ulPendingFrames, maxFrames);
+        marker.FrameBytes = (USHORT)m_ulFrameSize;
+        marker.Fill = m_Fill;
+        marker.Reserved = 0;
+
+        // Counted as sent either way; a dropped marker is a gap in the idle
+        // stream, the same as a dropped run of zeros would be.
+        m_ulPendingFrames -= marker.Frames;
+
+        NTSTATUS sent = m_MarkerSink(m_SinkContext, (const BYTE *)&marker, sizeof(marker));
+        if (NT_SUCCESS(status)) {
+            status = sent;
+        }
+    }
+
+    return status;
+}
+
+//
+// Silent chunks keep flowing until the hold time of silence has been sent;
+// after that they only add to the pending count, sent as a marker every
+// CAVERN_SILENCE_MARKER_MS. A chunk with signal sends the pending count
+// and is forwarded in the same call. Chunks that are not whole frames (the
+// aligner's latency escape) are forwarded as signal.
+//
+NTSTATUS CCavernSilenceGate::Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length)
+{
+    if (!m_Kernel) {
+        return m_Sink ? m_Sink(m_SinkContext, Buffer, Length) : STATUS_INVALID_DEVICE_STATE;
+    }
+
+    if (!Length) {
+        return STATUS_SUCCESS;
+    }
+
+    ULONG frames = Length / m_ulFrameSize;
+
+    if (frames * m_ulFrameSize != Length || !m_Kernel(Buffer, Length, m_ulThreshold)) {
+        NTSTATUS status = STATUS_SUCCESS;
+
+        if (m_bIdle) {
+            status = SendMarker();
+            m_bIdle = FALSE;
+        }
+        m_ullSilentFrames = 0;
+
+        NTSTATUS forwarded = m_Sink(m_SinkContext, Buffer, Length);
+        return NT_SUCCESS(status) ? forwarded : status;
+    }
+
+    if (!m_bIdle) {
+        if (m_ullSilentFrames < m_ulHoldFrames) {
+            m_ullSilentFrames += frames;
+            return m_Sink(m_SinkContext, Buffer, Length);
+        }
+        m_bIdle = TRUE;
+        m_ulIdleCount++;
+    }
+
+    m_ullSilentFrames += frames;
+    m_ulPendingFrames += frames;
+    m_ullSuppressedFrames += frames;
+
+    if (m_ulPendingFrames >= m_ulMarkerFrames) {
+        return SendMarker();
+    }
+
+    return STATUS_SUCCESS;
+}
+
+NTSTATUS CCavernSilenceGate::Flush()
+{
+    return m_Kernel ? SendMarker() : STATUS_SUCCESS;
+}
@@ -0,0 +1,111 @@
+/***************************************************************************
+ * CavernSilenceGate.h
+ *
+ * Idle detection for the forwarded PCM stream. Every chunk the aligner
+ * emits is scanned (SIMD compare per sample width, early exit on the
+ * first loud vector); once the stream has been silent for the hold time
+ * the gate goes idle and, instead of the zeros, hands its marker sink a
+ * CAVERN_SILENCE_MARKER for every CAVERN_SILENCE_MARKER_MS of silence;
+ * the pipe carries it as a silence packet (CavernPipePacket.h). The first
+ * chunk with signal flushes the pending count and is forwarded in the
+ * same call, so resuming adds no latency.
+ *
+ * Chunks must hold whole frames. Only integer work is done, so no
+ * floating point state is needed.
+ ***************************************************************************/
+
+#ifndef _CAVERN_SILENCEGATE_H_
+#define _CAVERN_SILENCEGATE_H_
+
+#include "CavernFormatConvert.h"
+#include "CavernFrameAligner.h"
+#include "CavernPipePacket.h"
+
+// Continuous silence needed before the gate goes idle
+#define CAVERN_SILENCE_HOLD_MS          200
+
+// Silence summarized by one marker while idle
+#define CAVERN_SILENCE_MARKER_MS        20
+
+// Stands for Frames frames of FrameBytes bytes, every byte equal to Fill
+// (0x80 for unsigned 8-bit, else 0), never more than
+// CAVERN_PIPE_PACKET_MAX_LENGTH bytes. Sent in place of the audio, always
+// between frames.
+typedef struct _CAVERN_SILENCE_MARKER {
+    ULONG       Frames;
+    USHORT      FrameBytes;
+    BYTE        Fill;
+    BYTE        Reserved;
+} CAVERN_SILENCE_MARKER, *PCAVERN_SILENCE_MARKER;
+
+// TRUE when every sample of the buffer is within the threshold (raw units).
+typedef BOOLEAN (*PCAVERN_QUIET_KERNEL)(
+    _In_reads_bytes_(Length) const BYTE *Buffer,
+    _In_ SIZE_T Length,
+    _In_ ULONG Threshold
+);
+
+class CCavernSilenceGate
+{
+public:
+    CCavernSilenceGate();
+
+    // ThresholdLsb16: largest magnitude still counted as silence, in 16-bit
+    // LSBs (0 = digital zero only; the idle stream decodes to exact zeros).
+    // Sink gets the audio, MarkerSink each CAVERN_SILENCE_MARKER.
+    NTSTATUS Init(
+        _In_ CAVERN_SAMPLE_FORMAT Format,
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG ThresholdLsb16,
+        _In_ BOOLEAN AllowSimd,
+        _In_ PCAVERN_FORWARD_SINK Sink,
+        _In_ PCAVERN_FORWARD_SINK MarkerSink,
+        _In_opt_ PVOID SinkContext
+    );
+
+    // Back to pass-through: Push forwards everything to the sink unscanned.
+    VOID Cleanup();
+
+    // Leaves idle without sending the pending count (stream reset).
+    VOID Reset();
+
+    // Forwards Length bytes of whole frames, or accounts them as silence.
+    NTSTATUS Push(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ ULONG Length);
+
+    // Sends the pending silence count, if any (end of stream).
+    NTSTATUS Flush();
+
+    // Scan only: TRUE when the whole buffer is below the threshold.
+    BOOLEAN IsQuiet(_In_reads_bytes_(Length) const BYTE *Buffer, _In_ SIZE_T Length) const
+    {
+        return m_Kernel(Buffer, Length, m_ulThreshold);
+    }
+
+    BOOLEAN IsInitialized() const { return m_Kernel != NULL; }
+    BOOLEAN IsIdle() const { return m_bIdle; }
+    ULONGLONG GetSuppressedFrames() const { return m_ullSuppressedFrames; }
+    ULONG GetIdleCount() const { return m_ulIdleCount; }
+
+private:
+    NTSTATUS SendMarker();
+
+    PCAVERN_QUIET_KERNEL    m_Kernel;
+    ULONG                   m_ulThreshold;      // raw sample units
+    ULONG                   m_ulFrameSize;
+    BYTE                    m_Fill;             // byte value of silence
+    ULONG                   m_ulHoldFrames;
+    ULONG                   m_ulMarkerFrames;
+    PCAVERN_FORWARD_SINK    m_Sink;
+    PCAVERN_FORWARD_SINK    m_MarkerSink;
+    PVOID                   m_SinkContext;
+
+    BOOLEAN                 m_bIdle;
+    ULONGLONG               m_ullSilentFrames;  // current run, idle or not
+    ULONG                   m_ulPendingFrames;  // idle frames not yet in a marker
+
+    ULONGLONG               m_ullSuppressedFrames;
+    ULONG                   m_ulIdleCount;
+};
+
+#endif // _CAVERN_SILENCEGATE_H_
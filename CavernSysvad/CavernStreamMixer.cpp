@@ -0,0 +1,483 @@
+/***************************************************************************
+ * CavernStreamMixer.cpp
+ *
+ * Multi-stream software mixer implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernStreamMixer.h"
+
+//
+// Destination = Source * Gain, or Destination += Source * Gain, over
+// Samples contiguous samples. Multiply then add in every path, so the
+// vector kernels round exactly as the scalar loop does.
+//
+static VOID MixSteady(
+    _Inout_updates_(Samples) float *Destination,
+    _In_reads_(Samples) const float *Source,
+    _In_ SIZE_T Samples,
+    _In_ float Gain,
+    _In_ BOOLEAN Accumulate,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    SIZE_T i = 0;
+
+    if (Gain == 0.0f) {
+        if (!Accumulate) {
+            RtlZeroMemory(Destination, Samples * sizeof(float));
+        }
+        return;
+    }
+
+#if defined(CAVERN_HAVE_AVX2)
+    if (AllowSimd) {
+        const __m256 gain = _mm256_set1_ps(Gain);
+        if (Accumulate) {
+            for (; i + 8 <= Samples; i += 8) {
+                __m256 x = _mm256_mul_ps(_mm256_loadu_ps(Source + i), gain);
+                _mm256_storeu_ps(Destination + i, _mm256_add_ps(_mm256_loadu_ps(Destination + i), x));
+            }
+        } else {
+            for (; i + 8 <= Samples; i += 8) {
+                _mm256_storeu_ps(Destination + i, _mm256_mul_ps(_mm256_loadu_ps(Source + i), gain));
+            }
+        }
+    }
+#endif
+
+#if defined(CAVERN_HAVE_SSE2)
+    if (AllowSimd) {
+        const __m128 gain = _mm_set1_ps(Gain);
+        if (Accumulate) {
+            for (; i + 4 <= Samples; i += 4) {
+                __m128 x = _mm_mul_ps(_mm_loadu_ps(Source + i), gain);
+                _mm_storeu_ps(Destination + i, _mm_add_ps(_mm_loadu_ps(Destination + i), x));
+            }
+        } else {
+            for (; i + 4 <= Samples; i += 4) {
+                _mm_storeu_ps(Destination + i, _mm_mul_ps(_mm_loadu_ps(Source + i), gain));
+            }
+        }
+    }
+#endif
+
+    UNREFERENCED_PARAMETER(AllowSimd);
+
+    if (Accumulate) {
+        for (; i < Samples; i++) {
+            Destination[i] += Source[i] * Gain;
+        }
+    } else {
+        for (; i < Samples; i++) {
+            Destination[i] = Source[i] * Gain;
+        }
+    }
+}
+
+//
+// As MixSteady with a gain that moves linearly per frame. The gain of
+// frame f is From + (First + f) * Step from an exact frame index, so long
+// ramps do not drift from repeated additions. Ramps last a few ms and are
+// left scalar.
+//
+static VOID MixRamp(
+    _Inout_updates_(Frames * Channels) float *Destination,
+    _In_reads_(Frames * Channels) const float *Source,
+    _In_ SIZE_T Frames,
+    _In_ ULONG Channels,
+    _In_ float From,
+    _In_ float Step,
+    _In_ ULONG First,
+    _In_ BOOLEAN Accumulate
+)
+{
+    for (SIZE_T f = 0; f < Frames; f++) {
+        float gain = From + (float)(First + f) * Step;
+        const float *s = Source + f * Channels;
+        float *d = Destination + f * Channels;
+
+        if (Accumulate) {
+            for (ULONG c = 0; c < Channels; c++) {
+                d[c] += s[c] * gain;
+            }
+        } else {
+            for (ULONG c = 0; c < Channels; c++) {
+                d[c] = s[c] * gain;
+            }
+        }
+    }
+}
+
+static float LevelToGain(_In_ LONG VolumeLevel, _In_ LONG Mute)
+{
+    if (Mute) {
+        return 0.0f;
+    }
+    if (!VolumeLevel) {
+        return 1.0f;
+    }
+    return (float)pow(10.0, (double)VolumeLevel / 65536.0 / 20.0);
+}
+
+CCavernStreamMixer::CCavernStreamMixer()
+    : m_pRings(NULL),
+      m_ulChannels(0),
+      m_ulSampleRate(0),
+      m_ulLeadFrames(0),
+      m_ulRingFrames(0),
+      m_ulRingMask(0),
+      m_ulRampFrames(1),
+      m_AllowSimd(FALSE)
+{
+    RtlZeroMemory(m_Slots, sizeof(m_Slots));
+}
+
+CCavernStreamMixer::~CCavernStreamMixer()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernStreamMixer::Init(
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ BOOLEAN AllowSimd
+)
+{
+    Cleanup();
+
+    if (!Channels || Channels > CAVERN_MAX_CHANNELS || !SampleRate) {
+        return STATUS_NOT_SUPPORTED;
+    }
+
+    ULONG leadFrames = max((ULONG)((ULONGLONG)SampleRate * CAVERN_MIXER_LEAD_MS / 1000), 1u);
+    ULONG ringFrames = CAVERN_MIXER_MIN_RING_FRAMES;
+    while (ringFrames < 4 * leadFrames) {
+        ringFrames <<= 1;
+    }
+
+    SIZE_T ringSamples = (SIZE_T)ringFrames * Channels;
+    m_pRings = (float *)CavernAllocate(CAVERN_MIXER_MAX_STREAMS * ringSamples * sizeof(float), CAVERN_MIXER_POOLTAG);
+    if (!m_pRings) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    RtlZeroMemory(m_Slots, sizeof(m_Slots));
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        m_Slots[i].Ring = m_pRings + i * ringSamples;
+    }
+
+    m_ulChannels = Channels;
+    m_ulSampleRate = SampleRate;
+    m_ulLeadFrames = leadFrames;
+    m_ulRingFrames = ringFrames;
+    m_ulRingMask = ringFrames - 1;
+    m_ulRampFrames = max((ULONG)((ULONGLONG)SampleRate * CAVERN_MIXER_RAMP_MS / 1000), 1u);
+    m_AllowSimd = AllowSimd;
+
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernStreamMixer::Cleanup()
+{
+    if (m_pRings) {
+        CavernFree(m_pRings, CAVERN_MIXER_POOLTAG);
+        m_pRings = NULL;
+    }
+
+    RtlZeroMemory(m_Slots, sizeof(m_Slots));
+    m_ulChannels = 0;
+    m_ulSampleRate = 0;
+    m_ulRingFrames = 0;
+    m_ulRingMask = 0;
+}
+
+//
+// The slot is reset while Claimed, where neither Mix nor any other Open
+// looks at it, and only published as Active once it is consistent.
+//
+LONG CCavernStreamMixer::Open(_In_ LONG VolumeLevel, _In_ BOOLEAN Mute)
+{
+    if (!m_pRings) {
+        return -1;
+    }
+
+    for (LONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        PCAVERN_MIXER_SLOT slot = &m_Slots[i];
+
+        if (slot->State != CavernMixerSlotFree ||
+            CavernInterlockedCompareExchange(&slot->State, CavernMixerSlotClaimed, CavernMixerSlotFree) != CavernMixerSlotFree) {
+            continue;
+        }
+
+        slot->Write = 0;
+        slot->Read = 0;
+        slot->VolumeLevel = VolumeLevel;
+        slot->Mute = Mute;
+        slot->GainResolved = FALSE;
+        slot->RampFrames = 0;
+        slot->RampDone = 0;
+        slot->Primed = FALSE;
+        RtlZeroMemory(&slot->Stats, sizeof(slot->Stats));
+
+        CavernMemoryBarrier();
+        slot->State = CavernMixerSlotActive;
+
+        return i;
+    }
+
+    return -1;
+}
+
+VOID CCavernStreamMixer::Close(_In_ LONG Slot)
+{
+    if (Slot < 0 || Slot >= CAVERN_MIXER_MAX_STREAMS) {
+        return;
+    }
+
+    CavernInterlockedCompareExchange(&m_Slots[Slot].State, CavernMixerSlotClosing, CavernMixerSlotActive);
+}
+
+VOID CCavernStreamMixer::SetGain(_In_ LONG Slot, _In_ LONG VolumeLevel, _In_ BOOLEAN Mute)
+{
+    if (Slot < 0 || Slot >= CAVERN_MIXER_MAX_STREAMS) {
+        return;
+    }
+
+    m_Slots[Slot].VolumeLevel = VolumeLevel;
+    m_Slots[Slot].Mute = Mute;
+}
+
+//
+// Copies into the ring in at most two runs (around the wrap). The data is
+// in place before Write moves, and the free space is taken from a Read
+// that Mix only advances after it has finished reading.
+//
+SIZE_T CCavernStreamMixer::Write(
+    _In_ LONG Slot,
+    _In_reads_(Frames * m_ulChannels) const float *Source,
+    _In_ SIZE_T Frames
+)
+{
+    if (Slot < 0 || Slot >= CAVERN_MIXER_MAX_STREAMS) {
+        return 0;
+    }
+
+    PCAVERN_MIXER_SLOT slot = &m_Slots[Slot];
+    if (slot->State != CavernMixerSlotActive) {
+        return 0;
+    }
+
+    const ULONG channels = m_ulChannels;
+    ULONG write = slot->Write;
+    ULONG queued = write - slot->Read;
+    CavernMemoryBarrier();
+
+    SIZE_T accepted = min(Frames, (SIZE_T)(m_ulRingFrames - queued));
+    SIZE_T done = 0;
+
+    while (done < accepted) {
+        ULONG offset = (write + (ULONG)done) & m_ulRingMask;
+        SIZE_T run = min(accepted - done, (SIZE_T)(m_ulRingFrames - offset));
+        RtlCopyMemory(slot->Ring + (SIZE_T)offset * channels, Source + done * channels, run * channels * sizeof(float));
+
+        done += run;
+    }
+
+    CavernMemoryBarrier();
+    slot->Write = write + (ULONG)accepted;
+
+    slot->Stats.DroppedFrames += Frames - accepted;
+    return accepted;
+}
+
+//
+// A new level starts a ramp from wherever the gain is now, mid-ramp
+// included. A freshly opened slot jumps straight to its level.
+//
+VOID CCavernStreamMixer::UpdateGain(_Inout_ PCAVERN_MIXER_SLOT Slot)
+{
+    LONG level = Slot->VolumeLevel;
+    LONG mute = Slot->Mute;
+
+    if (Slot->GainResolved && level == Slot->AppliedLevel && mute == Slot->AppliedMute) {
+        return;
+    }
+
+    float target = LevelToGain(level, mute);
+
+    Slot->AppliedLevel = level;
+    Slot->AppliedMute = mute;
+
+    if (!Slot->GainResolved) {
+        Slot->GainResolved = TRUE;
+        Slot->Gain = target;
+        Slot->RampFrames = 0;
+        return;
+    }
+
+    Slot->RampFrom = Slot->Gain;
+    Slot->RampTo = target;
+    Slot->RampDone = 0;
+    Slot->RampFrames = m_ulRampFrames;
+}
+
+//
+// Mixes up to Frames frames of one slot into Destination, whose first
+// Filled frames already hold the sum of earlier slots: those are added
+// to, the rest are written. Returns the frames this slot covered.
+//
+SIZE_T CCavernStreamMixer::MixSlot(
+    _Inout_ PCAVERN_MIXER_SLOT Slot,
+    _Inout_updates_(Frames * m_ulChannels) float *Destination,
+    _In_ SIZE_T Frames,
+    _In_ SIZE_T Filled
+)
+{
+    const ULONG channels = m_ulChannels;
+    ULONG read = Slot->Read;
+    ULONG available = Slot->Write - read;
+    CavernMemoryBarrier();
+
+    if (!Slot->Primed) {
+        if (available < m_ulLeadFrames) {
+            return 0;
+        }
+        Slot->Primed = TRUE;
+    }
+
+    // Back to the lead if a burst from the producer left a long backlog
+    if (available > m_ulRingFrames / 2 && available - m_ulLeadFrames > Frames) {
+        ULONG skip = available - m_ulLeadFrames - (ULONG)Frames;
+        read += skip;
+        available -= skip;
+        Slot->Stats.SkippedFrames += skip;
+    }
+
+    SIZE_T frames = min(Frames, (SIZE_T)available);
+    SIZE_T done = 0;
+
+    UpdateGain(Slot);
+
+    while (done < frames) {
+        ULONG offset = (read + (ULONG)done) & m_ulRingMask;
+        SIZE_T run = min(frames - done, (SIZE_T)(m_ulRingFrames - offset));
+        BOOLEAN accumulate = done < Filled;
+
+        if (accumulate) {
+            run = min(run, Filled - done);
+        }
+        if (Slot->RampFrames) {
+            run = min(run, (SIZE_T)(Slot->RampFrames - Slot->RampDone));
+        }
+
+        const float *source = Slot->Ring + (SIZE_T)offset * channels;
+        float *destination = Destination + done * channels;
+
+        if (Slot->RampFrames) {
+            float step = (Slot->RampTo - Slot->RampFrom) / (float)Slot->RampFrames;
+
+            MixRamp(destination, source, run, channels, Slot->RampFrom, step, Slot->RampDone, accumulate);
+
+            Slot->RampDone += (ULONG)run;
+            Slot->Gain = Slot->RampFrom + (float)Slot->RampDone * step;
+            if (Slot->RampDone == Slot->RampFrames) {
+                // Land exactly on the target, whatever the float steps added up to
+                Slot->Gain = Slot->RampTo;
+                Slot->RampFrames = 0;
+            }
+        } else {
+            MixSteady(destination, source, run * channels, Slot->Gain, accumulate, m_AllowSimd);
+        }
+
+        done += run;
+    }
+
+    CavernMemoryBarrier();
+    Slot->Read = read + (ULONG)frames;
+
+    Slot->Stats.MixedFrames += frames;
+
+    if (frames < Frames) {
+        Slot->Primed = FALSE;
+        Slot->Stats.Underruns++;
+    }
+
+    return frames;
+}
+
+//
+// Slots are summed in index order. The first slot with data writes the
+// block and later ones add to it; frames no slot covered are zeroed, so an
+// empty mix is silence.
+//
+VOID CCavernStreamMixer::Mix(
+    _Out_writes_(Frames * m_ulChannels) float *Destination,
+    _In_ SIZE_T Frames
+)
+{
+    SIZE_T filled = 0;
+
+    if (!m_pRings) {
+        return;
+    }
+
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        PCAVERN_MIXER_SLOT slot = &m_Slots[i];
+        LONG state = slot->State;
+
+        if (state == CavernMixerSlotClosing) {
+            CavernMemoryBarrier();
+            slot->State = CavernMixerSlotFree;
+            continue;
+        }
+        if (state != CavernMixerSlotActive) {
+            continue;
+        }
+
+        SIZE_T covered = MixSlot(slot, Destination, Frames, filled);
+        filled = max(filled, covered);
+    }
+
+    if (filled < Frames) {
+        RtlZeroMemory(Destination + filled * m_ulChannels, (Frames - filled) * m_ulChannels * sizeof(float));
+    }
+}
+
+VOID CCavernStreamMixer::Reset()
+{
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        PCAVERN_MIXER_SLOT slot = &m_Slots[i];
+
+        if (slot->State == CavernMixerSlotClosing) {
+            slot->State = CavernMixerSlotFree;
+        } else if (slot->State == CavernMixerSlotActive) {
+            slot->Read = slot->Write;
+            slot->Primed = FALSE;
+        }
+    }
+}
+
+ULONG CCavernStreamMixer::GetActiveCount() const
+{
+    ULONG count = 0;
+
+    for (ULONG i = 0; i < CAVERN_MIXER_MAX_STREAMS; i++) {
+        if (m_Slots[i].State == CavernMixerSlotActive) {
+            count++;
+        }
+    }
+
+    return count;
+}
+
+BOOLEAN CCavernStreamMixer::GetStats(_In_ LONG Slot, _Out_ PCAVERN_MIXER_STATS Stats) const
+{
+    if (Slot < 0 || Slot >= CAVERN_MIXER_MAX_STREAMS ||
+        (m_Slots[Slot].State != CavernMixerSlotActive && m_Slots[Slot].State != CavernMixerSlotClosing)) {
+        return FALSE;
+    }
+
+    *Stats = m_Slots[Slot].Stats;
+    return TRUE;
+}
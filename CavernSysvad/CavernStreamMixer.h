@@ -0,0 +1,168 @@
+/***************************************************************************
+ * CavernStreamMixer.h
+ *
+ * Software mix of concurrent PCM render streams. Every stream owns one of
+ * CAVERN_MIXER_MAX_STREAMS slots, each a single-producer/single-consumer
+ * ring of float frames in the mix channel layout; the stream's position
+ * timer routes its channels to that layout and writes into its ring, and
+ * the mix timer sums all rings into one output block with a per-stream
+ * gain.
+ *
+ * All rings are allocated at Init, so opening or closing a stream never
+ * allocates, locks or touches another stream's ring. Slots move
+ * Free -> Claimed -> Active -> Closing -> Free with interlocked exchanges;
+ * only Mix returns a Closing slot to Free, so a slot is never reused while
+ * a mix pass may still be reading it. A stream that falls behind only
+ * silences itself: its slot waits for CAVERN_MIXER_LEAD_MS of data again
+ * before it is mixed, and the others carry on untouched.
+ *
+ * Gains arrive as KSPROPERTY_AUDIO_VOLUMELEVEL values (1/65536 dB) and
+ * mute flags and are reached through a short linear ramp. Steady gains
+ * are applied with SSE2/AVX2 multiply and add (no FMA, so the result is
+ * bit-identical to the scalar loop). The sum is not clipped; saturation
+ * happens when the caller requantizes the block.
+ *
+ * Open/Close/SetGain do no float work. Write and Mix must be bracketed
+ * with KeSaveFloatingPointState / KeRestoreFloatingPointState. Each slot
+ * has one producer (Write, then Close) at a time; Mix and Reset are called
+ * from one thread at a time.
+ ***************************************************************************/
+
+#ifndef _CAVERN_STREAMMIXER_H_
+#define _CAVERN_STREAMMIXER_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_MIXER_POOLTAG        'xMvC'
+
+// Concurrent streams; one ring each
+#define CAVERN_MIXER_MAX_STREAMS    32
+
+// Smallest slot ring, about 42 ms at 48 kHz. Init sizes each ring to the
+// smallest power of two of frames that is at least this and four leads,
+// so the lead stays a quarter of the ring at any rate.
+#define CAVERN_MIXER_MIN_RING_FRAMES 2048
+
+// Data a slot waits for before it is mixed (again); covers the jitter
+// between the stream and mix timer DPCs
+#define CAVERN_MIXER_LEAD_MS        5
+
+// Length of the fade to a new gain
+#define CAVERN_MIXER_RAMP_MS        5
+
+typedef enum _CAVERN_MIXER_SLOT_STATE {
+    CavernMixerSlotFree = 0,
+    CavernMixerSlotClaimed,     // being reset by Open
+    CavernMixerSlotActive,      // producer may write, Mix reads
+    CavernMixerSlotClosing      // Close done, Mix frees it
+} CAVERN_MIXER_SLOT_STATE;
+
+typedef struct _CAVERN_MIXER_STATS {
+    ULONGLONG   MixedFrames;
+    ULONGLONG   DroppedFrames;      // did not fit the ring (producer ahead)
+    ULONGLONG   SkippedFrames;      // trimmed back to the lead (backlog)
+    ULONG       Underruns;          // ran dry while primed
+} CAVERN_MIXER_STATS, *PCAVERN_MIXER_STATS;
+
+typedef struct _CAVERN_MIXER_SLOT {
+    volatile LONG   State;
+
+    // Frame counters; free-running, the ring index is the low bits
+    volatile ULONG  Write;          // producer
+    volatile ULONG  Read;           // Mix
+
+    // Requested gain; plain LONG stores so SetGain needs no float
+    volatile LONG   VolumeLevel;
+    volatile LONG   Mute;
+
+    // Mix state
+    LONG            AppliedLevel;
+    LONG            AppliedMute;
+    float           Gain;
+    BOOLEAN         GainResolved;   // FALSE: jump to the level, no ramp
+    float           RampFrom;
+    float           RampTo;
+    ULONG           RampDone;
+    ULONG           RampFrames;     // 0: steady
+    BOOLEAN         Primed;
+
+    CAVERN_MIXER_STATS Stats;
+    float          *Ring;
+} CAVERN_MIXER_SLOT, *PCAVERN_MIXER_SLOT;
+
+class CCavernStreamMixer
+{
+public:
+    CCavernStreamMixer();
+    ~CCavernStreamMixer();
+
+    NTSTATUS Init(
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ BOOLEAN AllowSimd
+    );
+    VOID Cleanup();
+
+    // Claims a free slot at the given gain. Returns the slot, or -1 when
+    // all are in use (or still being freed by Mix).
+    LONG Open(_In_ LONG VolumeLevel, _In_ BOOLEAN Mute);
+
+    // Hands the slot back; whatever is still in its ring is dropped.
+    VOID Close(_In_ LONG Slot);
+
+    // Records a new gain for the slot; picked up by the next Mix.
+    VOID SetGain(_In_ LONG Slot, _In_ LONG VolumeLevel, _In_ BOOLEAN Mute);
+
+    // Queues Frames interleaved float frames, already in the mix channel
+    // layout (see CavernCompileRemap / CCavernMatrixMixer). Returns the
+    // frames that fit.
+    SIZE_T Write(
+        _In_ LONG Slot,
+        _In_reads_(Frames * m_ulChannels) const float *Source,
+        _In_ SIZE_T Frames
+    );
+
+    // Sums the next Frames frames of every active slot into Destination.
+    VOID Mix(
+        _Out_writes_(Frames * m_ulChannels) float *Destination,
+        _In_ SIZE_T Frames
+    );
+
+    // Frees every Closing slot and drops all queued data. Not to be
+    // called while any slot is being written.
+    VOID Reset();
+
+    BOOLEAN IsInitialized() const { return m_pRings != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+    ULONG GetSampleRate() const { return m_ulSampleRate; }
+    ULONG GetRingFrames() const { return m_ulRingFrames; }
+    ULONG GetLeadFrames() const { return m_ulLeadFrames; }
+    ULONG GetActiveCount() const;
+    BOOLEAN GetStats(_In_ LONG Slot, _Out_ PCAVERN_MIXER_STATS Stats) const;
+
+private:
+    VOID UpdateGain(_Inout_ PCAVERN_MIXER_SLOT Slot);
+    SIZE_T MixSlot(
+        _Inout_ PCAVERN_MIXER_SLOT Slot,
+        _Inout_updates_(Frames * m_ulChannels) float *Destination,
+        _In_ SIZE_T Frames,
+        _In_ SIZE_T Filled
+    );
+
+    float              *m_pRings;
+    ULONG               m_ulChannels;
+    ULONG               m_ulSampleRate;
+    ULONG               m_ulLeadFrames;
+    ULONG               m_ulRingFrames;     // power of two
+    ULONG               m_ulRingMask;
+    ULONG               m_ulRampFrames;
+    BOOLEAN             m_AllowSimd;
+
+    CAVERN_MIXER_SLOT   m_Slots[CAVERN_MIXER_MAX_STREAMS];
+};
+
+#endif // _CAVERN_STREAMMIXER_H_
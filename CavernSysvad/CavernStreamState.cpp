@@ -0,0 +1,95 @@
+/***************************************************************************
+ * CavernStreamState.cpp
+ *
+ * KSSTATE transition plans implementation
+ ***************************************************************************/
+
+#include "CavernStreamState.h"
+
+static VOID AddAction(_Inout_ PCAVERN_STATE_PLAN Plan, _In_ CAVERN_STATE_ACTION Action)
+{
+    if (Plan->Count < CAVERN_STATE_MAX_ACTIONS) {
+        Plan->Actions[Plan->Count++] = Action;
+    }
+}
+
+VOID CavernPlanStateChange(
+    _In_ const CAVERN_STREAM_STATUS *Status,
+    _In_ CAVERN_STREAM_STATE Target,
+    _Out_ PCAVERN_STATE_PLAN Plan
+)
+{
+    Plan->Count = 0;
+
+    if (Target == Status->State) {
+        return;
+    }
+
+    // Leaving RUN: the timer goes first, so no DPC runs while the
+    // position is caught up or the output is let go
+    if (Target != CavernStateRun && Status->TimerRunning) {
+        AddAction(Plan, CavernActionStopTimer);
+
+        if (Target == CavernStatePause) {
+            AddAction(Plan, CavernActionCatchUp);
+        }
+    }
+
+    switch (Target) {
+        case CavernStateStop:
+            if (Status->MixStarted) {
+                AddAction(Plan, CavernActionStopMix);
+            }
+            if (Status->OutputAcquired) {
+                AddAction(Plan, CavernActionReleaseOutput);
+            }
+            // Nothing may be forwarded once the position is reset
+            AddAction(Plan, CavernActionResetPosition);
+            break;
+
+        case CavernStateAcquire:
+        case CavernStatePause:
+        case CavernStateRun:
+            // KS steps through ACQUIRE, but a stream coming straight from
+            // STOP still needs its output
+            if (Status->State == CavernStateStop && !Status->OutputAcquired) {
+                AddAction(Plan, CavernActionAcquireOutput);
+            }
+
+            if (Target == CavernStatePause && Status->MixStarted) {
+                AddAction(Plan, CavernActionStopMix);
+            }
+
+            if (Target == CavernStateRun) {
+                if (Status->Mixed) {
+                    if (!Status->MixStarted) {
+                        AddAction(Plan, CavernActionStartMix);
+                    }
+                } else {
+                    AddAction(Plan, CavernActionConnect);
+                }
+
+                AddAction(Plan, CavernActionStampClock);
+                AddAction(Plan, CavernActionStartTimer);
+            }
+            break;
+    }
+}
+
+const char *CavernStateActionName(_In_ CAVERN_STATE_ACTION Action)
+{
+    static const char *names[CavernActionCount] = {
+        "StopTimer",
+        "CatchUp",
+        "StopMix",
+        "ReleaseOutput",
+        "ResetPosition",
+        "AcquireOutput",
+        "StartMix",
+        "Connect",
+        "StampClock",
+        "StartTimer"
+    };
+
+    return (ULONG)Action < CavernActionCount ? names[Action] : "?";
+}
@@ -0,0 +1,73 @@
+/***************************************************************************
+ * CavernStreamState.h
+ *
+ * What a Cavern render stream does on each KSSTATE transition, as an
+ * ordered list of actions, so the driver's SetState and the Linux stream
+ * simulator (tools/CavernStreamSim) run the same sequence.
+ *
+ * The output (the mix slot, or the pipe for a bitstream) is acquired on
+ * STOP->ACQUIRE and released only on ->STOP, so PAUSE<->RUN toggles keep
+ * the pipe warm. The position timer is started last on RUN, once the
+ * output is connected and the clock stamped, and stopped first on the way
+ * down, before anything it uses is touched.
+ ***************************************************************************/
+
+#ifndef _CAVERN_STREAMSTATE_H_
+#define _CAVERN_STREAMSTATE_H_
+
+#include "CavernPortable.h"
+
+// Same values as KSSTATE
+typedef enum _CAVERN_STREAM_STATE {
+    CavernStateStop = 0,
+    CavernStateAcquire = 1,
+    CavernStateRun = 2,
+    CavernStatePause = 3
+} CAVERN_STREAM_STATE;
+
+typedef enum _CAVERN_STATE_ACTION {
+    CavernActionStopTimer = 0,  // cancel the position timer, flush its DPCs
+    CavernActionCatchUp,        // account for the bytes since the last tick
+    CavernActionStopMix,        // leave the running mix
+    CavernActionReleaseOutput,  // hand back the mix slot or the pipe
+    CavernActionResetPosition,  // position and packet state back to zero
+    CavernActionAcquireOutput,  // join the mix or open the pipe; may fail
+    CavernActionStartMix,       // join the running mix
+    CavernActionConnect,        // have the pipe connect now, arm first byte
+    CavernActionStampClock,     // DMA time stamp = now
+    CavernActionStartTimer,     // start the position timer
+    CavernActionCount
+} CAVERN_STATE_ACTION;
+
+#define CAVERN_STATE_MAX_ACTIONS 8
+
+// The stream's state as the plan depends on it
+typedef struct _CAVERN_STREAM_STATUS {
+    CAVERN_STREAM_STATE State;
+    BOOLEAN             Mixed;          // PCM, goes through the mix
+    BOOLEAN             OutputAcquired;
+    BOOLEAN             MixStarted;
+    BOOLEAN             TimerRunning;
+} CAVERN_STREAM_STATUS, *PCAVERN_STREAM_STATUS;
+
+typedef struct _CAVERN_STATE_PLAN {
+    ULONG               Count;
+    CAVERN_STATE_ACTION Actions[CAVERN_STATE_MAX_ACTIONS];
+} CAVERN_STATE_PLAN, *PCAVERN_STATE_PLAN;
+
+//
+// Fills Plan with the actions that take a stream in Status to Target, in
+// the order they must run. The caller runs them, updating Status as they
+// succeed, and stops at the first failure; the state is only changed once
+// all have run.
+//
+VOID CavernPlanStateChange(
+    _In_ const CAVERN_STREAM_STATUS *Status,
+    _In_ CAVERN_STREAM_STATE Target,
+    _Out_ PCAVERN_STATE_PLAN Plan
+);
+
+// Short name of an action, for logs and the simulator
+const char *CavernStateActionName(_In_ CAVERN_STATE_ACTION Action);
+
+#endif // _CAVERN_STREAMSTATE_H_
@@ -0,0 +1,211 @@
+/***************************************************************************
+ * CavernTestSignal.cpp
+ *
+ * Sweep / MLS / ID burst measurement signal implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernTestSignal.h"
+
+// Sweep range, and the raised-cosine fades at its ends (1/32 of the sweep)
+#define CAVERN_TEST_SWEEP_START_HZ      100.0
+#define CAVERN_TEST_SWEEP_END           0.45
+#define CAVERN_TEST_SWEEP_FADE_SHIFT    5
+
+#define CAVERN_TEST_CHECK_SEED          0xA5
+
+// Galois LFSR feedback of a primitive polynomial per order
+static const ULONG g_MlsFeedback[CAVERN_TEST_MAX_ORDER - CAVERN_TEST_MIN_ORDER + 1] = {
+    0x0240,     // x^10 + x^7 + 1
+    0x0500,     // x^11 + x^9 + 1
+    0x0E08,     // x^12 + x^11 + x^10 + x^4 + 1
+    0x1C80,     // x^13 + x^12 + x^11 + x^8 + 1
+    0x3802      // x^14 + x^13 + x^12 + x^2 + 1
+};
+
+VOID CavernTestExcitation(
+    _In_ CAVERN_TEST_SIGNAL Kind,
+    _In_ ULONG Order,
+    _In_ ULONG SampleRate,
+    _Out_writes_(1 << Order) float *Excitation
+)
+{
+    ULONG length = 1UL << Order;
+
+    if (Kind == CavernTestSweep) {
+        // Exponential sweep: the phase is K (e^(t L / T) - 1), L = ln(f2 / f1)
+        double start = CAVERN_TEST_SWEEP_START_HZ;
+        double end = CAVERN_TEST_SWEEP_END * SampleRate;
+        double rate = log(end / start);
+        double scale = 6.283185307179586 * start * length / (SampleRate * rate);
+        ULONG fade = length >> CAVERN_TEST_SWEEP_FADE_SHIFT;
+
+        for (ULONG n = 0; n < length; n++) {
+            double value = sin(scale * (exp(rate * n / length) - 1.0));
+            ULONG edge = min(n, length - 1 - n);
+            if (edge < fade) {
+                value *= 0.5 - 0.5 * cos(3.141592653589793 * edge / fade);
+            }
+            Excitation[n] = (float)value;
+        }
+        return;
+    }
+
+    ULONG feedback = g_MlsFeedback[Order - CAVERN_TEST_MIN_ORDER];
+    ULONG state = 1;
+
+    for (ULONG n = 0; n + 1 < length; n++) {
+        ULONG bit = state & 1;
+        state >>= 1;
+        if (bit) {
+            state ^= feedback;
+        }
+        Excitation[n] = bit ? 1.0f : -1.0f;
+    }
+    Excitation[length - 1] = 0.0f;
+}
+
+ULONGLONG CavernTestMarker(_In_ ULONGLONG Frame, _In_ ULONG Channel)
+{
+    ULONGLONG payload = ((Frame & ((1ULL << CAVERN_TEST_COUNTER_BITS) - 1)) << 8) | (Channel & 0xFF);
+    ULONG check = CAVERN_TEST_CHECK_SEED;
+
+    for (ULONG i = 0; i < 7; i++) {
+        check ^= (ULONG)(payload >> (8 * i)) & 0xFF;
+    }
+    return (payload << 8) | check;
+}
+
+BOOLEAN CavernTestParseMarker(_In_ ULONGLONG Marker, _Out_ ULONGLONG *Frame, _Out_ ULONG *Channel)
+{
+    ULONGLONG payload = Marker >> 8;
+
+    *Frame = payload >> 8;
+    *Channel = (ULONG)payload & 0xFF;
+    return CavernTestMarker(*Frame, *Channel) == Marker;
+}
+
+CCavernTestSignal::CCavernTestSignal()
+    : m_Kind(CavernTestNone),
+      m_pExcitation(NULL),
+      m_ulChannels(0),
+      m_ulLength(0),
+      m_ulPeriod(0),
+      m_fAmplitude(0.0f),
+      m_ullFrame(0),
+      m_ullPeriods(0),
+      m_ulPosition(0),
+      m_ulActive(CAVERN_TEST_ALL_CHANNELS),
+      m_ullMarker(0)
+{
+}
+
+CCavernTestSignal::~CCavernTestSignal()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernTestSignal::Init(
+    _In_ CAVERN_TEST_SIGNAL Kind,
+    _In_ ULONG Channels,
+    _In_ ULONG SampleRate,
+    _In_ ULONG Order,
+    _In_ float Amplitude
+)
+{
+    Cleanup();
+
+    if (Kind <= CavernTestNone || Kind >= CavernTestSignalCount ||
+        !Channels || Channels > CAVERN_MAX_CHANNELS || !SampleRate ||
+        Order < CAVERN_TEST_MIN_ORDER || Order > CAVERN_TEST_MAX_ORDER) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    ULONG length = 1UL << Order;
+
+    m_pExcitation = (float *)CavernAllocate(length * sizeof(float), CAVERN_TEST_POOLTAG);
+    if (!m_pExcitation) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+    CavernTestExcitation(Kind, Order, SampleRate, m_pExcitation);
+
+    m_Kind = Kind;
+    m_ulChannels = Channels;
+    m_ulLength = length;
+    m_ulPeriod = 2 * length;
+    m_fAmplitude = Amplitude;
+    m_ullFrame = 0;
+    m_ullPeriods = 0;
+    m_ulPosition = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernTestSignal::Cleanup()
+{
+    if (m_pExcitation) {
+        CavernFree(m_pExcitation, CAVERN_TEST_POOLTAG);
+        m_pExcitation = NULL;
+    }
+    m_Kind = CavernTestNone;
+    m_ulChannels = 0;
+    m_ulLength = 0;
+    m_ulPeriod = 0;
+}
+
+VOID CCavernTestSignal::StartPeriod()
+{
+    m_ulActive = (m_Kind == CavernTestIdBurst) ? (ULONG)(m_ullPeriods % m_ulChannels) : CAVERN_TEST_ALL_CHANNELS;
+    m_ullMarker = CavernTestMarker(m_ullFrame, m_ulActive);
+    m_ullPeriods++;
+}
+
+VOID CCavernTestSignal::Generate(
+    _Out_writes_(FrameCount * m_ulChannels) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_pExcitation || !Samples) {
+        return;
+    }
+
+    while (FrameCount) {
+        if (m_ulPosition == 0) {
+            StartPeriod();
+        }
+
+        // The run of frames up to the next change of what is played
+        ULONG position = m_ulPosition;
+        const float *excitation = NULL;
+        float level = 0.0f;
+        ULONG run;
+
+        if (position < CAVERN_TEST_MARKER_FRAMES) {
+            ULONG bit = (ULONG)(m_ullMarker >> (CAVERN_TEST_MARKER_BITS - 1 - position / (2 * CAVERN_TEST_HALF_BIT_FRAMES))) & 1;
+            ULONG half = (position / CAVERN_TEST_HALF_BIT_FRAMES) & 1;
+
+            level = (bit ^ half) ? m_fAmplitude : -m_fAmplitude;
+            run = CAVERN_TEST_HALF_BIT_FRAMES - position % CAVERN_TEST_HALF_BIT_FRAMES;
+        } else if (position < CAVERN_TEST_EXCITATION_OFFSET) {
+            run = CAVERN_TEST_EXCITATION_OFFSET - position;
+        } else if (position < CAVERN_TEST_EXCITATION_OFFSET + m_ulLength) {
+            excitation = m_pExcitation + (position - CAVERN_TEST_EXCITATION_OFFSET);
+            run = CAVERN_TEST_EXCITATION_OFFSET + m_ulLength - position;
+        } else {
+            run = m_ulPeriod - position;
+        }
+        run = (ULONG)min((SIZE_T)run, FrameCount);
+
+        for (ULONG i = 0; i < run; i++) {
+            float value = excitation ? m_fAmplitude * excitation[i] : level;
+
+            for (ULONG c = 0; c < m_ulChannels; c++) {
+                Samples[c] = (m_ulActive == CAVERN_TEST_ALL_CHANNELS || c == m_ulActive) ? value : 0.0f;
+            }
+            Samples += m_ulChannels;
+        }
+
+        m_ulPosition = (position + run == m_ulPeriod) ? 0 : position + run;
+        m_ullFrame += run;
+        FrameCount -= run;
+    }
+}
@@ -0,0 +1,132 @@
+/***************************************************************************
+ * CavernTestSignal.h
+ *
+ * Measurement signals for end-to-end latency: an exponential sine sweep,
+ * a maximum length sequence (MLS), or per-channel ID bursts (the MLS on
+ * one channel at a time, in turn). The signal repeats every period of
+ * 2 * 2^Order frames:
+ *
+ *     | marker | gap | excitation (2^Order frames) | silence ... |
+ *
+ * The marker is CAVERN_TEST_MARKER_BITS Manchester-coded bits (each bit a
+ * half period of +A and one of -A, so gain and DC do not matter) holding
+ * the generator frame counter at the start of the period, the channel
+ * that plays the period and a check byte. The frame counter counts frames
+ * handed out by Generate since Init, so it is the position in the stream
+ * the frames are written to.
+ *
+ * CCavernLatencyAnalyzer (CavernLatencyAnalyzer.h) finds the excitation in
+ * a capture by cross-correlation, reads the marker in front of it and so
+ * relates a capture frame to the generator frame that produced it.
+ *
+ * Init builds the excitation, so it and Generate must be bracketed with
+ * KeSaveFloatingPointState / KeRestoreFloatingPointState.
+ ***************************************************************************/
+
+#ifndef _CAVERN_TESTSIGNAL_H_
+#define _CAVERN_TESTSIGNAL_H_
+
+#include "CavernPortable.h"
+
+#ifndef CAVERN_MAX_CHANNELS
+#define CAVERN_MAX_CHANNELS 16
+#endif
+
+#define CAVERN_TEST_POOLTAG             'gTvC'
+
+// Excitation lengths (2^Order frames) Init accepts; the period is twice
+// that, 43 ms to 683 ms at 48 kHz
+#define CAVERN_TEST_MIN_ORDER           10
+#define CAVERN_TEST_MAX_ORDER           14
+
+// Marker: 48-bit frame counter, channel byte, check byte; each bit is two
+// halves of CAVERN_TEST_HALF_BIT_FRAMES
+#define CAVERN_TEST_MARKER_BITS         64
+#define CAVERN_TEST_HALF_BIT_FRAMES     4
+#define CAVERN_TEST_MARKER_FRAMES       (CAVERN_TEST_MARKER_BITS * 2 * CAVERN_TEST_HALF_BIT_FRAMES)
+#define CAVERN_TEST_COUNTER_BITS        48
+
+// Silence between the marker and the excitation, for the marker's tail
+// through filters to die away
+#define CAVERN_TEST_GAP_FRAMES          64
+#define CAVERN_TEST_EXCITATION_OFFSET   (CAVERN_TEST_MARKER_FRAMES + CAVERN_TEST_GAP_FRAMES)
+
+// Channel field of a period every channel plays
+#define CAVERN_TEST_ALL_CHANNELS        0xFF
+
+typedef enum _CAVERN_TEST_SIGNAL {
+    CavernTestNone = 0,
+    CavernTestSweep,                    // exponential sine sweep
+    CavernTestMls,                      // maximum length sequence
+    CavernTestIdBurst,                  // MLS on one channel per period
+    CavernTestSignalCount
+} CAVERN_TEST_SIGNAL;
+
+//
+// Fills Excitation with the 2^Order frames of Kind's excitation, peak 1.
+// An MLS is 2^Order - 1 frames long and ends with a zero.
+//
+VOID CavernTestExcitation(
+    _In_ CAVERN_TEST_SIGNAL Kind,
+    _In_ ULONG Order,
+    _In_ ULONG SampleRate,
+    _Out_writes_(1 << Order) float *Excitation
+);
+
+//
+// The marker for a period starting at Frame and played by Channel.
+//
+ULONGLONG CavernTestMarker(_In_ ULONGLONG Frame, _In_ ULONG Channel);
+
+//
+// Checks a received marker and splits it; FALSE if the check byte does
+// not match.
+//
+BOOLEAN CavernTestParseMarker(_In_ ULONGLONG Marker, _Out_ ULONGLONG *Frame, _Out_ ULONG *Channel);
+
+class CCavernTestSignal
+{
+public:
+    CCavernTestSignal();
+    ~CCavernTestSignal();
+
+    NTSTATUS Init(
+        _In_ CAVERN_TEST_SIGNAL Kind,
+        _In_ ULONG Channels,
+        _In_ ULONG SampleRate,
+        _In_ ULONG Order,
+        _In_ float Amplitude
+    );
+    VOID Cleanup();
+
+    // Writes the next FrameCount interleaved frames.
+    VOID Generate(
+        _Out_writes_(FrameCount * m_ulChannels) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    BOOLEAN IsInitialized() const { return m_pExcitation != NULL; }
+    ULONG GetChannels() const { return m_ulChannels; }
+    ULONG GetPeriodFrames() const { return m_ulPeriod; }
+
+    // Frames generated since Init
+    ULONGLONG GetFrame() const { return m_ullFrame; }
+
+private:
+    VOID StartPeriod();
+
+    CAVERN_TEST_SIGNAL  m_Kind;
+    float              *m_pExcitation;
+    ULONG               m_ulChannels;
+    ULONG               m_ulLength;         // excitation frames
+    ULONG               m_ulPeriod;
+    float               m_fAmplitude;
+
+    ULONGLONG           m_ullFrame;
+    ULONGLONG           m_ullPeriods;       // started so far
+    ULONG               m_ulPosition;       // frame within the period
+    ULONG               m_ulActive;         // channel playing, or ALL
+    ULONGLONG           m_ullMarker;
+};
+
+#endif // _CAVERN_TESTSIGNAL_H_
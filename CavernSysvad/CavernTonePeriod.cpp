@@ -0,0 +1,110 @@
+/***************************************************************************
+ * CavernTonePeriod.cpp
+ *
+ * Cached tone periods implementation
+ ***************************************************************************/
+
+#include <math.h>
+#include "CavernTonePeriod.h"
+
+CCavernTonePeriod::CCavernTonePeriod()
+    : m_pSamples(NULL),
+      m_ulFrames(0),
+      m_ulPeriodFrames(0),
+      m_ulNext(0)
+{
+}
+
+CCavernTonePeriod::~CCavernTonePeriod()
+{
+    Cleanup();
+}
+
+NTSTATUS CCavernTonePeriod::Init(
+    _In_ ULONG FrequencyHz,
+    _In_ ULONG SampleRate,
+    _In_ double Amplitude,
+    _In_ double Offset,
+    _In_ double InitialPhase
+)
+{
+    Cleanup();
+
+    if (!SampleRate) {
+        return STATUS_INVALID_PARAMETER;
+    }
+
+    // Frequencies at or above the rate alias to the same frames
+    ULONG frequency = FrequencyHz % SampleRate;
+    ULONG a = SampleRate;
+    ULONG b = frequency;
+    while (b != 0) {
+        ULONG r = a % b;
+        a = b;
+        b = r;
+    }
+
+    ULONG periodFrames = SampleRate / a;
+    if (periodFrames > CAVERN_TONE_PERIOD_MAX_FRAMES) {
+        return STATUS_NOT_SUPPORTED;
+    }
+    ULONG frames = (CAVERN_TONE_PERIOD_MIN_FRAMES + periodFrames - 1) / periodFrames * periodFrames;
+
+    m_pSamples = (float *)CavernAllocate(frames * sizeof(float), CAVERN_TONE_PERIOD_POOLTAG);
+    if (!m_pSamples) {
+        return STATUS_INSUFFICIENT_RESOURCES;
+    }
+
+    for (ULONG i = 0; i < periodFrames; i++) {
+        // Phase reduced in integers, exact for every frame of the period
+        ULONGLONG cycle = (ULONGLONG)i * frequency % SampleRate;
+        m_pSamples[i] = (float)(Offset + Amplitude *
+            sin(6.283185307179586 * (double)cycle / SampleRate + InitialPhase));
+    }
+    for (ULONG i = periodFrames; i < frames; i++) {
+        m_pSamples[i] = m_pSamples[i - periodFrames];
+    }
+
+    m_ulFrames = frames;
+    m_ulPeriodFrames = periodFrames;
+    m_ulNext = 0;
+    return STATUS_SUCCESS;
+}
+
+VOID CCavernTonePeriod::Cleanup()
+{
+    if (m_pSamples) {
+        CavernFree(m_pSamples, CAVERN_TONE_PERIOD_POOLTAG);
+        m_pSamples = NULL;
+    }
+    m_ulFrames = 0;
+    m_ulPeriodFrames = 0;
+    m_ulNext = 0;
+}
+
+VOID CCavernTonePeriod::Generate(
+    _Out_writes_(FrameCount) float *Samples,
+    _In_ SIZE_T FrameCount
+)
+{
+    if (!m_pSamples || !Samples) {
+        return;
+    }
+
+    while (FrameCount > 0) {
+        SIZE_T copy = m_ulFrames - m_ulNext;
+        if (copy > FrameCount) {
+            copy = FrameCount;
+        }
+
+        RtlCopyMemory(Samples, m_pSamples + m_ulNext, copy * sizeof(float));
+
+        m_ulNext += (ULONG)copy;
+        if (m_ulNext == m_ulFrames) {
+            m_ulNext = 0;
+        }
+
+        Samples += copy;
+        FrameCount -= copy;
+    }
+}
@@ -0,0 +1,71 @@
+/***************************************************************************
+ * CavernTonePeriod.h
+ *
+ * Whole periods of a test tone, computed once and played back by copying.
+ * A tone of F Hz at R Hz repeats exactly every R / gcd(R, F) frames (48
+ * frames covers 1, 2 and 3 kHz at 48 kHz), so Init computes that period
+ * in double precision, with the phase of every frame reduced in integers,
+ * and repeats it to at least CAVERN_TONE_PERIOD_MIN_FRAMES so copies are
+ * long. Generate copies from it with wrap-around, one value per frame, in
+ * place of CCavernOscillator::Generate.
+ *
+ * The period is kept as float, before any gain or requantization: a cache
+ * of dithered samples would repeat one dither realization every period and
+ * turn the noise floor into spurs. The caller scales and requantizes each
+ * block after the copy, as it does the oscillator's output.
+ *
+ * Init must be bracketed with KeSaveFloatingPointState /
+ * KeRestoreFloatingPointState; Generate does no float math.
+ ***************************************************************************/
+
+#ifndef _CAVERN_TONE_PERIOD_H_
+#define _CAVERN_TONE_PERIOD_H_
+
+#include "CavernPortable.h"
+
+#define CAVERN_TONE_PERIOD_POOLTAG      'pTvC'
+
+// Shortest cache; periods are repeated up to this
+#define CAVERN_TONE_PERIOD_MIN_FRAMES   1024
+
+// Longest cache; tones with longer periods are left to the oscillator
+#define CAVERN_TONE_PERIOD_MAX_FRAMES   (64 * 1024)
+
+class CCavernTonePeriod
+{
+public:
+    CCavernTonePeriod();
+    ~CCavernTonePeriod();
+
+    // Output is Offset + Amplitude * sin(phase), starting at InitialPhase
+    // radians. STATUS_NOT_SUPPORTED when the period is longer than
+    // CAVERN_TONE_PERIOD_MAX_FRAMES.
+    NTSTATUS Init(
+        _In_ ULONG FrequencyHz,
+        _In_ ULONG SampleRate,
+        _In_ double Amplitude,
+        _In_ double Offset,
+        _In_ double InitialPhase
+    );
+    VOID Cleanup();
+
+    // Writes the next FrameCount values, one per frame.
+    VOID Generate(
+        _Out_writes_(FrameCount) float *Samples,
+        _In_ SIZE_T FrameCount
+    );
+
+    BOOLEAN IsInitialized() const { return m_pSamples != NULL; }
+
+    // Frames of one period, and of the cache
+    ULONG GetPeriodFrames() const { return m_ulPeriodFrames; }
+    ULONG GetCacheFrames() const { return m_ulFrames; }
+
+private:
+    float              *m_pSamples;
+    ULONG               m_ulFrames;
+    ULONG               m_ulPeriodFrames;
+    ULONG               m_ulNext;           // next frame to copy
+};
+
+#endif // _CAVERN_TONE_PERIOD_H_
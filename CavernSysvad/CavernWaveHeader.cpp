@@ -0,0 +1,198 @@
+/***************************************************************************
+ * CavernWaveHeader.cpp
+ *
+ * RIFF / RF64 / Wave64 capture file header implementation
+ ***************************************************************************/
+
+#include "CavernWaveHeader.h"
+
+// Smallest fmt payload: WAVEFORMAT up to nBlockAlign
+#define CAVERN_WAVE_MIN_FORMAT          14
+
+// ds64 payload: RIFF size, data size, frame count, table length
+#define CAVERN_WAVE_DS64_BYTES          28
+
+#define CAVERN_WAVE_GUID_BYTES          16
+#define CAVERN_WAVE64_CHUNK_BYTES       (CAVERN_WAVE_GUID_BYTES + 8)
+#define CAVERN_WAVE_RIFF_CHUNK_BYTES    8
+
+// Wave64 chunk IDs, GUIDs as stored in the file
+static const UCHAR g_Wave64Riff[CAVERN_WAVE_GUID_BYTES] = {
+    'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
+};
+static const UCHAR g_Wave64Wave[CAVERN_WAVE_GUID_BYTES] = {
+    'w', 'a', 'v', 'e', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static const UCHAR g_Wave64Format[CAVERN_WAVE_GUID_BYTES] = {
+    'f', 'm', 't', ' ', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static const UCHAR g_Wave64Data[CAVERN_WAVE_GUID_BYTES] = {
+    'd', 'a', 't', 'a', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static const UCHAR g_Wave64Junk[CAVERN_WAVE_GUID_BYTES] = {
+    'j', 'u', 'n', 'k', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+
+static VOID PutTag(_Out_writes_bytes_(4) PUCHAR Destination, _In_ const char *Tag)
+{
+    RtlCopyMemory(Destination, Tag, 4);
+}
+
+static VOID PutLe32(_Out_writes_bytes_(4) PUCHAR Destination, _In_ ULONG Value)
+{
+    for (ULONG i = 0; i < 4; i++) {
+        Destination[i] = (UCHAR)(Value >> (8 * i));
+    }
+}
+
+static VOID PutLe64(_Out_writes_bytes_(8) PUCHAR Destination, _In_ ULONGLONG Value)
+{
+    for (ULONG i = 0; i < 8; i++) {
+        Destination[i] = (UCHAR)(Value >> (8 * i));
+    }
+}
+
+static ULONG Saturate32(_In_ ULONGLONG Value)
+{
+    return (Value > 0xFFFFFFFFULL) ? 0xFFFFFFFF : (ULONG)Value;
+}
+
+//
+// Header without filler
+//
+static ULONG PackedHeaderBytes(_In_ CAVERN_WAVE_CONTAINER Container, _In_ ULONG FormatBytes)
+{
+    switch (Container) {
+    case CavernWaveRiff:
+        return 12 + 8 + FormatBytes + (FormatBytes & 1) + 8;
+    case CavernWaveRf64:
+        return 12 + 8 + CAVERN_WAVE_DS64_BYTES + 8 + FormatBytes + (FormatBytes & 1) + 8;
+    case CavernWave64:
+        return CAVERN_WAVE64_CHUNK_BYTES + CAVERN_WAVE_GUID_BYTES +
+               CAVERN_WAVE64_CHUNK_BYTES + ((FormatBytes + 7) & ~7UL) +
+               CAVERN_WAVE64_CHUNK_BYTES;
+    default:
+        return 0;
+    }
+}
+
+ULONG CavernWaveHeaderBytes(
+    _In_ CAVERN_WAVE_CONTAINER Container,
+    _In_ ULONG FormatBytes,
+    _In_ ULONG DataAlignment
+)
+{
+    if (FormatBytes < CAVERN_WAVE_MIN_FORMAT || FormatBytes > CAVERN_WAVE_MAX_FORMAT ||
+        DataAlignment > CAVERN_WAVE_MAX_ALIGNMENT || (DataAlignment & (DataAlignment - 1))) {
+        return 0;
+    }
+
+    ULONG packed = PackedHeaderBytes(Container, FormatBytes);
+    if (!packed || DataAlignment <= 1) {
+        return packed;
+    }
+
+    // The filler needs room for its own chunk header
+    ULONG fillerMin = (Container == CavernWave64) ? CAVERN_WAVE64_CHUNK_BYTES : CAVERN_WAVE_RIFF_CHUNK_BYTES;
+    ULONG size = (packed + DataAlignment - 1) & ~(DataAlignment - 1);
+
+    while (size != packed && size - packed < fillerMin) {
+        size += DataAlignment;
+    }
+    return size;
+}
+
+ULONG CavernWavePadBytes(_In_ CAVERN_WAVE_CONTAINER Container, _In_ ULONGLONG DataBytes)
+{
+    if (Container == CavernWave64) {
+        return (ULONG)((8 - (DataBytes & 7)) & 7);
+    }
+    return (ULONG)(DataBytes & 1);
+}
+
+NTSTATUS CavernWaveBuildHeader(
+    _In_ CAVERN_WAVE_CONTAINER Container,
+    _In_reads_bytes_(FormatBytes) const VOID *Format,
+    _In_ ULONG FormatBytes,
+    _In_ ULONG DataAlignment,
+    _In_ ULONGLONG DataBytes,
+    _Out_writes_bytes_(HeaderBytes) PUCHAR Header,
+    _In_ ULONG HeaderBytes
+)
+{
+    ULONG size = CavernWaveHeaderBytes(Container, FormatBytes, DataAlignment);
+    ULONG filler = size - PackedHeaderBytes(Container, FormatBytes);
+
+    if (!size || !Format || !Header) {
+        return STATUS_INVALID_PARAMETER;
+    }
+    if (HeaderBytes < size) {
+        return STATUS_BUFFER_TOO_SMALL;
+    }
+
+    const UCHAR *format = (const UCHAR *)Format;
+    ULONGLONG fileBytes = (ULONGLONG)size + DataBytes + CavernWavePadBytes(Container, DataBytes);
+    PUCHAR p = Header;
+
+    RtlZeroMemory(Header, size);
+
+    if (Container == CavernWave64) {
+        RtlCopyMemory(p, g_Wave64Riff, CAVERN_WAVE_GUID_BYTES);
+        PutLe64(p + 16, fileBytes);
+        RtlCopyMemory(p + 24, g_Wave64Wave, CAVERN_WAVE_GUID_BYTES);
+        p += CAVERN_WAVE64_CHUNK_BYTES + CAVERN_WAVE_GUID_BYTES;
+
+        RtlCopyMemory(p, g_Wave64Format, CAVERN_WAVE_GUID_BYTES);
+        PutLe64(p + 16, CAVERN_WAVE64_CHUNK_BYTES + FormatBytes);
+        RtlCopyMemory(p + CAVERN_WAVE64_CHUNK_BYTES, format, FormatBytes);
+        p += CAVERN_WAVE64_CHUNK_BYTES + ((FormatBytes + 7) & ~7UL);
+
+        if (filler) {
+            RtlCopyMemory(p, g_Wave64Junk, CAVERN_WAVE_GUID_BYTES);
+            PutLe64(p + 16, filler);
+            p += filler;
+        }
+
+        RtlCopyMemory(p, g_Wave64Data, CAVERN_WAVE_GUID_BYTES);
+        PutLe64(p + 16, CAVERN_WAVE64_CHUNK_BYTES + DataBytes);
+        return STATUS_SUCCESS;
+    }
+
+    ULONGLONG riffBytes = fileBytes - 8;
+    BOOLEAN large = (Container == CavernWaveRf64) && riffBytes > 0xFFFFFFFFULL;
+
+    PutTag(p, large ? "RF64" : "RIFF");
+    PutLe32(p + 4, large ? 0xFFFFFFFF : Saturate32(riffBytes));
+    PutTag(p + 8, "WAVE");
+    p += 12;
+
+    // Until the file needs it, ds64 is kept as a JUNK chunk of its size
+    if (Container == CavernWaveRf64) {
+        PutTag(p, large ? "ds64" : "JUNK");
+        PutLe32(p + 4, CAVERN_WAVE_DS64_BYTES);
+        if (large) {
+            USHORT blockAlign = (USHORT)(format[12] | (format[13] << 8));
+
+            PutLe64(p + 8, riffBytes);
+            PutLe64(p + 16, DataBytes);
+            PutLe64(p + 24, blockAlign ? DataBytes / blockAlign : 0);
+        }
+        p += 8 + CAVERN_WAVE_DS64_BYTES;
+    }
+
+    PutTag(p, "fmt ");
+    PutLe32(p + 4, FormatBytes);
+    RtlCopyMemory(p + 8, format, FormatBytes);
+    p += 8 + FormatBytes + (FormatBytes & 1);
+
+    if (filler) {
+        PutTag(p, "JUNK");
+        PutLe32(p + 4, filler - CAVERN_WAVE_RIFF_CHUNK_BYTES);
+        p += filler;
+    }
+
+    // In RF64 the 32-bit sizes are -1 and the ds64 chunk holds the real ones
+    PutTag(p, "data");
+    PutLe32(p + 4, large ? 0xFFFFFFFF : Saturate32(DataBytes));
+    return STATUS_SUCCESS;
+}
@@ -0,0 +1,78 @@
+/***************************************************************************
+ * CavernWaveHeader.h
+ *
+ * Headers for capture files whose data may pass 4 GB (16 channels of
+ * 32-bit at 192 kHz do in under six minutes). The header is built at a
+ * fixed size for the container, so it can be rewritten in place at any
+ * time with a positional write: the data behind it never moves.
+ *
+ *   CavernWaveRiff   RIFF/WAVE. Sizes are 32-bit and saturate at 4 GB.
+ *   CavernWaveRf64   EBU Tech 3306 RF64. Up to 4 GB it is a RIFF file whose
+ *                    "JUNK" chunk reserves room for a ds64 chunk. Past that,
+ *                    the same bytes become "RF64" and "ds64" with 64-bit
+ *                    RIFF and data sizes, and the 32-bit fields are set to
+ *                    0xFFFFFFFF.
+ *   CavernWave64     Sony Wave64: GUID chunk IDs and 64-bit chunk sizes
+ *                    that count the 24-byte chunk header, 8-byte aligned.
+ *
+ * The fmt chunk holds Format (a WAVEFORMATEX, or a PCMWAVEFORMAT) as is.
+ * With a DataAlignment, a filler chunk ("JUNK", or the Wave64 "junk" GUID)
+ * ahead of the data chunk pushes the first data byte to a multiple of it,
+ * for writers that need sector-aligned file offsets.
+ * The containers pad an odd (RIFF/RF64) or unaligned (Wave64) data chunk.
+ * CavernWavePadBytes says how many zero bytes to append after the data
+ * when the file is finished.
+ ***************************************************************************/
+
+#ifndef _CAVERN_WAVEHEADER_H_
+#define _CAVERN_WAVEHEADER_H_
+
+#include "CavernPortable.h"
+
+// Largest fmt chunk payload accepted, and the header it gives in any
+// container without a DataAlignment
+#define CAVERN_WAVE_MAX_FORMAT          128
+#define CAVERN_WAVE_MAX_HEADER          256
+
+// Largest DataAlignment; an aligned header is a multiple of it
+#define CAVERN_WAVE_MAX_ALIGNMENT       4096
+
+typedef enum _CAVERN_WAVE_CONTAINER {
+    CavernWaveRiff = 0,
+    CavernWaveRf64,
+    CavernWave64,
+    CavernWaveContainerCount
+} CAVERN_WAVE_CONTAINER;
+
+//
+// Header size for Container with a FormatBytes fmt chunk, the file offset
+// of the first data byte. DataAlignment is 0 (packed) or a power of two up
+// to CAVERN_WAVE_MAX_ALIGNMENT. 0 if either is out of range.
+//
+ULONG CavernWaveHeaderBytes(
+    _In_ CAVERN_WAVE_CONTAINER Container,
+    _In_ ULONG FormatBytes,
+    _In_ ULONG DataAlignment
+);
+
+//
+// Writes the CavernWaveHeaderBytes() header for DataBytes of data to
+// Header. The frame count in ds64 is DataBytes over the format's
+// nBlockAlign.
+//
+NTSTATUS CavernWaveBuildHeader(
+    _In_ CAVERN_WAVE_CONTAINER Container,
+    _In_reads_bytes_(FormatBytes) const VOID *Format,
+    _In_ ULONG FormatBytes,
+    _In_ ULONG DataAlignment,
+    _In_ ULONGLONG DataBytes,
+    _Out_writes_bytes_(HeaderBytes) PUCHAR Header,
+    _In_ ULONG HeaderBytes
+);
+
+//
+// Zero bytes that end the data chunk of a finished file.
+//
+ULONG CavernWavePadBytes(_In_ CAVERN_WAVE_CONTAINER Container, _In_ ULONGLONG DataBytes);
+
+#endif // _CAVERN_WAVEHEADER_H_
@@ -187,6 +187,14 @@ Return Value:
         m_LoopbackStreams = NULL;
     }
 
+    if (m_LoopbackReaders)
+    {
+        ExFreePoolWithTag( m_LoopbackReaders, MINWAVERT_POOLTAG );
+        m_LoopbackReaders = NULL;
+    }
+
+    m_LoopbackFanout.Cleanup();
+
     if (m_pAudioModules)
     {
         FreeStreamAudioModules(m_pAudioModules, GetAudioModuleListCount());
@@ -395,6 +403,8 @@ Return Value:
     m_SystemStreams                     = NULL;
     m_OffloadStreams                    = NULL;
     m_LoopbackStreams                   = NULL;
+    m_LoopbackReaders                   = NULL;
+    m_pLoopbackSource                   = NULL;
     m_bGfxEnabled                       = FALSE;
     m_pbMuted                           = NULL;
     m_plVolumeLevel                     = NULL;
@@ -509,6 +519,20 @@ Return Value:
             {
                 return STATUS_INSUFFICIENT_RESOURCES;
             }
+
+            // Loopback readers of the render fan-out, one per stream slot.
+            size = sizeof(CAVERN_LOOPBACK_READER) * m_ulMaxLoopbackStreams;
+            m_LoopbackReaders = (PCAVERN_LOOPBACK_READER)ExAllocatePool2(POOL_FLAG_NON_PAGED, size, MINWAVERT_POOLTAG);
+            if (m_LoopbackReaders == NULL)
+            {
+                return STATUS_INSUFFICIENT_RESOURCES;
+            }
+
+            ntStatus = m_LoopbackFanout.Init(CAVERN_LOOPBACK_RING_BYTES);
+            if (!NT_SUCCESS(ntStatus))
+            {
+                return ntStatus;
+            }
         }
 
         if (IsOffloadSupported())
@@ -1261,6 +1285,10 @@ CMiniportWaveRT::StreamCreated
             if (streams[i] == NULL)
             {
                 streams[i] = _Stream;
+                if (streams == m_LoopbackStreams)
+                {
+                    m_LoopbackFanout.AttachReader(&m_LoopbackReaders[i]);
+                }
                 break;
             }
         }
@@ -1328,6 +1356,13 @@ CMiniportWaveRT::StreamClosed
         {
             if (streams[i] == _Stream)
             {
+                if (streams == m_LoopbackStreams)
+                {
+                    DPF(D_TERSE, ("Loopback reader %u: read %I64u, lost %I64u in %u laps, silence %I64u bytes",
+                        i, m_LoopbackReaders[i].ReadBytes, m_LoopbackReaders[i].LostBytes,
+                        m_LoopbackReaders[i].Laps, m_LoopbackReaders[i].SilenceBytes));
+                    m_LoopbackFanout.DetachReader(&m_LoopbackReaders[i]);
+                }
                 streams[i] = NULL;
                 break;
             }
@@ -1346,6 +1381,151 @@ CMiniportWaveRT::StreamClosed
     return STATUS_SUCCESS;
 }
 
+//=============================================================================
+#pragma code_seg()
+NTSTATUS
+CMiniportWaveRT::StartLoopbackSource
+(
+    _In_ PCMiniportWaveRTStream _Stream,
+    _In_ PWAVEFORMATEX          _pWfEx,
+    _In_ ULONGLONG              _LinearPosition
+)
+/*++
+
+Routine Description:
+
+  Makes a system render stream entering RUN the source of the loopback
+  pins, unless another stream already is. Only the source publishes to
+  the fan-out, so it keeps a single writer.
+
+Arguments:
+
+  _Stream - render stream.
+
+  _pWfEx - its format; the loopback pins carry the same format.
+
+  _LinearPosition - its linear position, where the published data starts.
+
+Return Value:
+
+  NT status code.
+
+--*/
+{
+    NTSTATUS ntStatus;
+
+    DPF_ENTER(("[CMiniportWaveRT::StartLoopbackSource]"));
+
+    if (!m_LoopbackFanout.IsInitialized())
+    {
+        return STATUS_SUCCESS;
+    }
+
+    if (InterlockedCompareExchangePointer((PVOID volatile *)&m_pLoopbackSource, _Stream, NULL) != NULL)
+    {
+        return STATUS_SUCCESS;
+    }
+
+    ntStatus = m_LoopbackFanout.Start(_pWfEx->nBlockAlign, _pWfEx->nAvgBytesPerSec, _LinearPosition);
+    if (!NT_SUCCESS(ntStatus))
+    {
+        InterlockedExchangePointer((PVOID volatile *)&m_pLoopbackSource, NULL);
+    }
+
+    return ntStatus;
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+CMiniportWaveRT::StopLoopbackSource
+(
+    _In_ PCMiniportWaveRTStream _Stream
+)
+/*++
+
+Routine Description:
+
+  Called when a render stream leaves RUN, after its timer DPC has been
+  flushed. The loopback readers fall back to silence until a render
+  stream runs again.
+
+--*/
+{
+    if (m_pLoopbackSource != _Stream)
+    {
+        return;
+    }
+
+    m_LoopbackFanout.Stop();
+    InterlockedExchangePointer((PVOID volatile *)&m_pLoopbackSource, NULL);
+}
+
+//=============================================================================
+#pragma code_seg()
+VOID
+CMiniportWaveRT::PublishLoopback
+(
+    _In_ PCMiniportWaveRTStream         _Stream,
+    _In_reads_bytes_(_Length) BYTE *    _Buffer,
+    _In_ ULONG                          _Length
+)
+/*++
+
+Routine Description:
+
+  Publishes render data consumed from the DMA buffer to the loopback
+  readers. Never waits for them.
+
+--*/
+{
+    if (m_pLoopbackSource == _Stream)
+    {
+        m_LoopbackFanout.Publish(_Buffer, _Length);
+    }
+}
+
+//=============================================================================
+#pragma code_seg()
+ULONG
+CMiniportWaveRT::ReadLoopback
+(
+    _In_ PCMiniportWaveRTStream             _Stream,
+    _In_ PWAVEFORMATEX                      _pWfEx,
+    _In_ ULONGLONG                          _LinearPosition,
+    _Out_writes_bytes_(_Length) BYTE *      _Buffer,
+    _In_ ULONG                              _Length
+)
+/*++
+
+Routine Description:
+
+  Fills a loopback stream's DMA buffer with the published render data.
+  Data the stream was too slow for, or that was never rendered, is
+  written as silence.
+
+Return Value:
+
+  Number of bytes that carry render data.
+
+--*/
+{
+    if (m_LoopbackStreams != NULL && m_LoopbackReaders != NULL)
+    {
+        for (ULONG i = 0; i < m_ulMaxLoopbackStreams; ++i)
+        {
+            if (m_LoopbackStreams[i] == _Stream)
+            {
+                return m_LoopbackFanout.Read(&m_LoopbackReaders[i], _pWfEx->nBlockAlign,
+                                             _LinearPosition, _Buffer, _Length);
+            }
+        }
+    }
+
+    RtlZeroMemory(_Buffer, _Length);
+    return 0;
+}
+
 //=============================================================================
 #pragma code_seg("PAGE")
 NTSTATUS
@@ -21,6 +21,7 @@ Abstract:
 #ifdef SYSVAD_USB_SIDEBAND
 #include "usbhsmicwavtable.h"
 #endif // SYSVAD_USB_SIDEBAND
+#include "CavernLoopbackFanout.h"
 
 //=============================================================================
 // Referenced Forward
@@ -150,6 +151,13 @@ private:
     PCMiniportWaveRTStream            * m_OffloadStreams;
     PCMiniportWaveRTStream            * m_LoopbackStreams;
 
+    // Render data for the loopback pins: the first system render stream to
+    // run publishes, each loopback stream reads through the reader in the
+    // slot matching its m_LoopbackStreams entry.
+    CCavernLoopbackFanout               m_LoopbackFanout;
+    PCAVERN_LOOPBACK_READER             m_LoopbackReaders;
+    PCMiniportWaveRTStream volatile     m_pLoopbackSource;
+
     BOOL                                m_bGfxEnabled;
     PBOOL                               m_pbMuted;
     PLONG                               m_plVolumeLevel;
@@ -231,6 +239,34 @@ public:
         _In_ ULONG _Pin,
         _In_ PCMiniportWaveRTStream _Stream
     );
+
+    NTSTATUS StartLoopbackSource
+    (
+        _In_ PCMiniportWaveRTStream _Stream,
+        _In_ PWAVEFORMATEX          _pWfEx,
+        _In_ ULONGLONG              _LinearPosition
+    );
+
+    VOID StopLoopbackSource
+    (
+        _In_ PCMiniportWaveRTStream _Stream
+    );
+
+    VOID PublishLoopback
+    (
+        _In_ PCMiniportWaveRTStream         _Stream,
+        _In_reads_bytes_(_Length) BYTE *    _Buffer,
+        _In_ ULONG                          _Length
+    );
+
+    ULONG ReadLoopback
+    (
+        _In_ PCMiniportWaveRTStream             _Stream,
+        _In_ PWAVEFORMATEX                      _pWfEx,
+        _In_ ULONGLONG                          _LinearPosition,
+        _Out_writes_bytes_(_Length) BYTE *      _Buffer,
+        _In_ ULONG                              _Length
+    );
     
     NTSTATUS IsFormatSupported
     ( 
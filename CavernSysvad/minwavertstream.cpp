@@ -44,6 +44,8 @@ Return Value:
             m_AudioModuleCount = 0;
         }
     
+        m_pMiniport->StopLoopbackSource(this);
+
         if (m_bUnregisterStream)
         {
             m_pMiniport->StreamClosed(m_ulPin, this);
@@ -1282,6 +1284,9 @@ NTSTATUS CMiniportWaveRTStream::SetState
                     }
                 }
 
+                // The timer DPC is flushed; stop publishing to the loopback pins.
+                m_pMiniport->StopLoopbackSource(this);
+
 #if defined(SYSVAD_BTH_BYPASS) || defined(SYSVAD_USB_SIDEBAND)
                 if (m_SidebandStarted)
                 {
@@ -1335,6 +1340,16 @@ NTSTATUS CMiniportWaveRTStream::SetState
             }
 #endif // defined(SYSVAD_BTH_BYPASS) || defined(SYSVAD_USB_SIDEBAND)
 
+            // Feed the loopback pins, unless another render stream already does.
+            if (!m_bCapture && m_pMiniport->IsSystemRenderPin(m_ulPin))
+            {
+                NTSTATUS loopbackStatus = m_pMiniport->StartLoopbackSource(this, (PWAVEFORMATEX)m_pWfExt, m_ullLinearPosition);
+                if (!NT_SUCCESS(loopbackStatus))
+                {
+                    DPF(D_ERROR, ("SetState: KSSTATE_RUN, StartLoopbackSource failed, 0x%x", loopbackStatus));
+                }
+            }
+
             // Start DMA
             LARGE_INTEGER ullPerfCounterTemp;
             if (m_pMiniport->IsKeywordDetectorPin(m_ulPin))
@@ -1469,11 +1484,8 @@ VOID CMiniportWaveRTStream::UpdatePosition
                                         0);
         }
 
-        if (!g_DoNotCreateDataFiles)
-        {
-            // Read from buffer and write to a file.
-            ReadBytes(ByteDisplacement);
-        }
+        // Read from buffer, publish to loopback and write to a file.
+        ReadBytes(ByteDisplacement);
     }
     
     // Increment the DMA position by the number of bytes displaced since the last
@@ -1502,7 +1514,9 @@ VOID CMiniportWaveRTStream::WriteBytes
 
 Routine Description:
 
-This function writes the audio buffer using a sine wave generator
+This function writes the audio buffer using a sine wave generator, or for
+loopback pins with the render data published by the render stream.
+
 Arguments:
 
 ByteDisplacement - # of bytes to process.
@@ -1510,14 +1524,25 @@ ByteDisplacement - # of bytes to process.
 --*/
 {
     ULONG bufferOffset = m_ullLinearPosition % m_ulDmaBufferSize;
+    ULONGLONG linearPosition = m_ullLinearPosition;
+    BOOL loopback = m_pMiniport->IsLoopbackPin(m_ulPin);
 
     // Normally this will loop no more than once for a single wrap, but if
     // many bytes have been displaced then this may loops many times.
     while (ByteDisplacement > 0)
     {
         ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
+        if (loopback)
+        {
+            m_pMiniport->ReadLoopback(this, (PWAVEFORMATEX)m_pWfExt, linearPosition,
+                                      m_pDmaBuffer + bufferOffset, runWrite);
+        }
+        else
+        {
             m_ToneGenerator.GenerateSine(m_pDmaBuffer + bufferOffset, runWrite);
+        }
         bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
+        linearPosition += runWrite;
         ByteDisplacement -= runWrite;
     }
 }
@@ -1532,7 +1557,8 @@ VOID CMiniportWaveRTStream::ReadBytes
 
 Routine Description:
 
-This function reads the audio buffer and saves the data in a file.
+This function reads the audio buffer, publishes it to the loopback pins
+and saves the data in a file.
 
 Arguments:
 
@@ -1547,7 +1573,11 @@ ByteDisplacement - # of bytes to process.
     while (ByteDisplacement > 0)
     {
         ULONG runWrite = min(ByteDisplacement, m_ulDmaBufferSize - bufferOffset);
-        m_SaveData.WriteData(m_pDmaBuffer + bufferOffset, runWrite);
+        m_pMiniport->PublishLoopback(this, m_pDmaBuffer + bufferOffset, runWrite);
+        if (!g_DoNotCreateDataFiles)
+        {
+            m_SaveData.WriteData(m_pDmaBuffer + bufferOffset, runWrite);
+        }
         bufferOffset = (bufferOffset + runWrite) % m_ulDmaBufferSize;
         ByteDisplacement -= runWrite;
     }
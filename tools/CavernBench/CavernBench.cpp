@@ -0,0 +1,854 @@
+/***************************************************************************
+ * CavernBench.cpp
+ *
+ * Reference receiver and synthetic load generator for the Cavern
+ * forwarding protocol.
+ *
+ * The driver writes the content of the render ring (PCM frames or an
+ * IEC 61937 / raw bitstream) to \\.\pipe\CavernAudioPipe as packets, a
+ * CAVERN_PIPE_PACKET header in front of each forward (CavernPipePacket.h).
+ * This tool speaks the same byte stream over a Unix domain socket, a FIFO
+ * or a shared-memory ring so transport changes can be measured on Linux
+ * without the C# CavernPipeServer.
+ *
+ * Build:
+ *   g++ -O2 -std=c++17 -pthread -o cavern_bench CavernBench.cpp -lrt
+ *
+ * Usage:
+ *   cavern_bench recv  --transport unix|fifo|shm --path P [options]
+ *   cavern_bench gen   --transport unix|fifo|shm --path P [options]
+ *   cavern_bench loop  --transport unix|fifo|shm --path P [options]
+ *   cavern_bench reg   [--seconds S]
+ *
+ * Options:
+ *   --channels N     PCM channels               (default 16)
+ *   --rate HZ        PCM sample rate            (default 192000)
+ *   --bits N         PCM container bits         (default 32)
+ *   --bitstream BPS  Replay as a bitstream at BPS bytes/s instead of PCM
+ *   --file F         Replay a capture (.raw) instead of synthetic data
+ *   --speed X        Pacing multiplier, 0 = as fast as possible (default 1)
+ *   --chunk-ms MS    Write period in milliseconds (default 10)
+ *   --seconds S      Run time (default 10)
+ *   --no-stamp       Do not embed chunk markers (replayed captures only)
+ *   --shm-size B     Shared-memory ring size (default 4 MiB)
+ *
+ * gen sends every chunk as one audio packet; it does not send silence
+ * packets. Every chunk starts with a 16-byte marker (magic, sequence, send
+ * time) unless --no-stamp is given. The marker is ordinary payload as far
+ * as the wire is concerned; the receiver uses it to compute latency
+ * percentiles and to count dropped chunks. recv finds chunks by their
+ * packet headers, and counts the bytes it had to skip to find one.
+ *
+ * reg measures the driver's position register page (CavernPositionRegister.h)
+ * from a shared mapping against a socket round trip standing in for a
+ * position IOCTL, with a writer thread publishing every millisecond like
+ * the timer DPC. The driver exports the output's page as the named
+ * section CAVERN_POSITION_SECTION_USER_NAME; the POSIX shared mapping
+ * stands in for it here.
+ ***************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#define NOMINMAX
+#include "../../CavernSysvad/CavernPositionRegister.h"
+#include "../../CavernSysvad/CavernPipePacket.h"
+
+#define CAVERN_BENCH_MAGIC      0x4D425643u     // "CVBM"
+#define CAVERN_BENCH_STAMP_SIZE 16u
+
+//=============================================================================
+// Options
+//=============================================================================
+
+enum Transport { TransportUnix, TransportFifo, TransportShm };
+
+struct Options
+{
+    std::string Mode;
+    Transport   Kind = TransportUnix;
+    std::string Path = "/tmp/CavernAudioPipe";
+    std::string File;
+    uint32_t    Channels = 16;
+    uint32_t    Rate = 192000;
+    uint32_t    Bits = 32;
+    uint64_t    BitstreamRate = 0;
+    double      Speed = 1.0;
+    uint32_t    ChunkMs = 10;
+    double      Seconds = 10.0;
+    bool        Stamp = true;
+    size_t      ShmSize = 4u << 20;
+
+    uint64_t BytesPerSecond() const
+    {
+        if (BitstreamRate) {
+            return BitstreamRate;
+        }
+        return (uint64_t)Channels * (Bits / 8) * Rate;
+    }
+
+    uint32_t BlockAlign() const
+    {
+        return BitstreamRate ? 1 : Channels * (Bits / 8);
+    }
+
+    // Chunk size rounded down to whole frames, never smaller than a stamp.
+    size_t ChunkBytes() const
+    {
+        uint64_t bytes = BytesPerSecond() * ChunkMs / 1000;
+        bytes -= bytes % BlockAlign();
+        return (size_t)std::max<uint64_t>(bytes, CAVERN_BENCH_STAMP_SIZE);
+    }
+};
+
+static std::atomic<bool> g_Running(true);
+
+static void OnSignal(int)
+{
+    g_Running = false;
+}
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+//=============================================================================
+// Shared-memory ring (single producer, single consumer)
+//=============================================================================
+
+struct ShmRingHeader
+{
+    uint32_t              Magic;
+    uint32_t              Reserved;
+    uint64_t              Size;
+    std::atomic<uint64_t> WritePos;     // bytes ever written
+    char                  Pad0[40];
+    std::atomic<uint64_t> ReadPos;      // bytes ever read
+    std::atomic<uint32_t> Closed;
+    char                  Pad1[52];
+};
+
+//=============================================================================
+// Transport - byte stream endpoint
+//=============================================================================
+
+class Endpoint
+{
+public:
+    virtual ~Endpoint() {}
+    // Returns bytes moved, 0 on end of stream, -1 on error.
+    virtual ssize_t Write(const uint8_t *Data, size_t Length) = 0;
+    virtual ssize_t Read(uint8_t *Data, size_t Length) = 0;
+};
+
+class FdEndpoint : public Endpoint
+{
+public:
+    explicit FdEndpoint(int Fd) : m_Fd(Fd) {}
+    ~FdEndpoint() override { if (m_Fd >= 0) close(m_Fd); }
+
+    ssize_t Write(const uint8_t *Data, size_t Length) override
+    {
+        size_t done = 0;
+        while (done < Length) {
+            ssize_t n = write(m_Fd, Data + done, Length - done);
+            if (n < 0) {
+                if (errno == EINTR) continue;
+                return -1;
+            }
+            done += (size_t)n;
+        }
+        return (ssize_t)done;
+    }
+
+    ssize_t Read(uint8_t *Data, size_t Length) override
+    {
+        for (;;) {
+            ssize_t n = read(m_Fd, Data, Length);
+            if (n < 0 && errno == EINTR) {
+                if (!g_Running) return 0;
+                continue;
+            }
+            return n;
+        }
+    }
+
+private:
+    int m_Fd;
+};
+
+class ShmEndpoint : public Endpoint
+{
+public:
+    ShmEndpoint(ShmRingHeader *Header, size_t MapSize, bool Owner, const std::string &Name)
+        : m_Header(Header), m_Data((uint8_t *)(Header + 1)), m_MapSize(MapSize),
+          m_Owner(Owner), m_Name(Name) {}
+
+    ~ShmEndpoint() override
+    {
+        if (m_Owner) {
+            m_Header->Closed.store(1, std::memory_order_release);
+        }
+        munmap(m_Header, m_MapSize);
+        if (!m_Owner) {
+            shm_unlink(m_Name.c_str());
+        }
+    }
+
+    ssize_t Write(const uint8_t *Data, size_t Length) override
+    {
+        const uint64_t size = m_Header->Size;
+        size_t done = 0;
+        while (done < Length) {
+            uint64_t w = m_Header->WritePos.load(std::memory_order_relaxed);
+            uint64_t r = m_Header->ReadPos.load(std::memory_order_acquire);
+            size_t room = (size_t)(size - (w - r));
+            if (room == 0) {
+                if (!g_Running) return -1;
+                std::this_thread::yield();
+                continue;
+            }
+            size_t run = std::min({ room, Length - done, (size_t)(size - w % size) });
+            memcpy(m_Data + w % size, Data + done, run);
+            m_Header->WritePos.store(w + run, std::memory_order_release);
+            done += run;
+        }
+        return (ssize_t)done;
+    }
+
+    ssize_t Read(uint8_t *Data, size_t Length) override
+    {
+        const uint64_t size = m_Header->Size;
+        for (;;) {
+            uint64_t r = m_Header->ReadPos.load(std::memory_order_relaxed);
+            uint64_t w = m_Header->WritePos.load(std::memory_order_acquire);
+            if (w != r) {
+                size_t run = std::min({ (size_t)(w - r), Length, (size_t)(size - r % size) });
+                memcpy(Data, m_Data + r % size, run);
+                m_Header->ReadPos.store(r + run, std::memory_order_release);
+                return (ssize_t)run;
+            }
+            if (m_Header->Closed.load(std::memory_order_acquire) || !g_Running) {
+                return 0;
+            }
+            std::this_thread::yield();
+        }
+    }
+
+private:
+    ShmRingHeader *m_Header;
+    uint8_t       *m_Data;
+    size_t         m_MapSize;
+    bool           m_Owner;
+    std::string    m_Name;
+};
+
+static std::string ShmName(const std::string &Path)
+{
+    std::string name = Path;
+    std::replace(name.begin(), name.end(), '/', '_');
+    return "/" + name;
+}
+
+// The receiver owns the listening side of every transport, like the pipe
+// server owns \\.\pipe\CavernAudioPipe.
+static Endpoint *OpenReceiver(const Options &Opt)
+{
+    if (Opt.Kind == TransportUnix) {
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, Opt.Path.c_str(), sizeof(addr.sun_path) - 1);
+        unlink(Opt.Path.c_str());
+        if (listener < 0 ||
+            bind(listener, (sockaddr *)&addr, sizeof(addr)) < 0 ||
+            listen(listener, 1) < 0) {
+            perror("unix listen");
+            return nullptr;
+        }
+        int fd = accept(listener, nullptr, nullptr);
+        close(listener);
+        unlink(Opt.Path.c_str());
+        return fd < 0 ? nullptr : new FdEndpoint(fd);
+    }
+
+    if (Opt.Kind == TransportFifo) {
+        unlink(Opt.Path.c_str());
+        if (mkfifo(Opt.Path.c_str(), 0600) < 0) {
+            perror("mkfifo");
+            return nullptr;
+        }
+        int fd = open(Opt.Path.c_str(), O_RDONLY);
+        unlink(Opt.Path.c_str());
+        if (fd >= 0) {
+            fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+        }
+        return fd < 0 ? nullptr : new FdEndpoint(fd);
+    }
+
+    std::string name = ShmName(Opt.Path);
+    size_t mapSize = sizeof(ShmRingHeader) + Opt.ShmSize;
+    shm_unlink(name.c_str());
+    int fd = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0600);
+    if (fd < 0 || ftruncate(fd, (off_t)mapSize) < 0) {
+        perror("shm_open");
+        return nullptr;
+    }
+    void *map = mmap(nullptr, mapSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        perror("mmap");
+        return nullptr;
+    }
+    ShmRingHeader *header = new (map) ShmRingHeader();
+    header->Size = Opt.ShmSize;
+    header->WritePos.store(0);
+    header->ReadPos.store(0);
+    header->Closed.store(0);
+    std::atomic_thread_fence(std::memory_order_release);
+    header->Magic = CAVERN_BENCH_MAGIC;
+    return new ShmEndpoint(header, mapSize, false, name);
+}
+
+static Endpoint *OpenSender(const Options &Opt)
+{
+    // Like the driver, keep retrying until the receiver is listening.
+    for (int attempt = 0; attempt < 500 && g_Running; attempt++) {
+        if (Opt.Kind == TransportUnix) {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            sockaddr_un addr = {};
+            addr.sun_family = AF_UNIX;
+            strncpy(addr.sun_path, Opt.Path.c_str(), sizeof(addr.sun_path) - 1);
+            if (fd >= 0 && connect(fd, (sockaddr *)&addr, sizeof(addr)) == 0) {
+                return new FdEndpoint(fd);
+            }
+            if (fd >= 0) close(fd);
+        }
+        else if (Opt.Kind == TransportFifo) {
+            int fd = open(Opt.Path.c_str(), O_WRONLY | O_NONBLOCK);
+            if (fd >= 0) {
+                fcntl(fd, F_SETFL, 0);
+                fcntl(fd, F_SETPIPE_SZ, 1 << 20);
+                return new FdEndpoint(fd);
+            }
+        }
+        else {
+            std::string name = ShmName(Opt.Path);
+            int fd = shm_open(name.c_str(), O_RDWR, 0);
+            struct stat st;
+            if (fd >= 0 && fstat(fd, &st) == 0 && (size_t)st.st_size > sizeof(ShmRingHeader)) {
+                void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+                close(fd);
+                ShmRingHeader *header = (ShmRingHeader *)map;
+                if (map != MAP_FAILED && header->Magic == CAVERN_BENCH_MAGIC) {
+                    return new ShmEndpoint(header, (size_t)st.st_size, true, name);
+                }
+                if (map != MAP_FAILED) munmap(map, (size_t)st.st_size);
+            }
+            else if (fd >= 0) {
+                close(fd);
+            }
+        }
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+    fprintf(stderr, "cavern_bench: receiver at %s not reachable\n", Opt.Path.c_str());
+    return nullptr;
+}
+
+//=============================================================================
+// Load generator
+//=============================================================================
+
+struct GenStats
+{
+    uint64_t Bytes = 0;
+    uint64_t Chunks = 0;
+    uint64_t Late = 0;          // chunks written after their deadline
+    double   Seconds = 0;
+};
+
+static std::vector<uint8_t> LoadSource(const Options &Opt)
+{
+    std::vector<uint8_t> source;
+
+    if (!Opt.File.empty()) {
+        FILE *f = fopen(Opt.File.c_str(), "rb");
+        if (!f) {
+            perror(Opt.File.c_str());
+            return source;
+        }
+        uint8_t buffer[1 << 16];
+        size_t n;
+        while ((n = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            source.insert(source.end(), buffer, buffer + n);
+        }
+        fclose(f);
+        source.resize(source.size() - source.size() % Opt.BlockAlign());
+        return source;
+    }
+
+    // One second of a per-channel ramp, so the payload is not trivially
+    // compressible and every channel differs.
+    source.resize((size_t)Opt.BytesPerSecond());
+    uint32_t seed = 0x12345678;
+    for (size_t i = 0; i < source.size(); i++) {
+        seed = seed * 1664525u + 1013904223u;
+        source[i] = (uint8_t)(seed >> 24);
+    }
+    return source;
+}
+
+static GenStats RunGenerator(const Options &Opt, Endpoint *Out)
+{
+    GenStats stats;
+    std::vector<uint8_t> source = LoadSource(Opt);
+    if (source.empty()) {
+        return stats;
+    }
+
+    const size_t chunkBytes = Opt.ChunkBytes();
+    const double chunkNs = Opt.Speed > 0 ?
+        (double)chunkBytes * 1e9 / ((double)Opt.BytesPerSecond() * Opt.Speed) : 0;
+    std::vector<uint8_t> packet(sizeof(CAVERN_PIPE_PACKET) + chunkBytes);
+    uint8_t *chunk = packet.data() + sizeof(CAVERN_PIPE_PACKET);
+    size_t sourcePos = 0;
+    const uint64_t start = NowNs();
+    const uint64_t end = start + (uint64_t)(Opt.Seconds * 1e9);
+
+    while (g_Running) {
+        uint64_t deadline = start + (uint64_t)(chunkNs * (double)stats.Chunks);
+        uint64_t now = NowNs();
+        if (now >= end) {
+            break;
+        }
+        if (chunkNs > 0) {
+            if (now < deadline) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now));
+            }
+            else if (now - deadline > (uint64_t)chunkNs) {
+                stats.Late++;
+            }
+        }
+
+        for (size_t filled = 0; filled < chunkBytes; ) {
+            size_t run = std::min(chunkBytes - filled, source.size() - sourcePos);
+            memcpy(chunk + filled, source.data() + sourcePos, run);
+            filled += run;
+            sourcePos = (sourcePos + run) % source.size();
+        }
+
+        if (Opt.Stamp) {
+            uint32_t magic = CAVERN_BENCH_MAGIC;
+            uint32_t seq = (uint32_t)stats.Chunks;
+            uint64_t sent = NowNs();
+            memcpy(chunk, &magic, 4);
+            memcpy(chunk + 4, &seq, 4);
+            memcpy(chunk + 8, &sent, 8);
+        }
+
+        CavernInitPipePacket((PCAVERN_PIPE_PACKET)packet.data(), CavernPipePacketAudio, (ULONG)chunkBytes);
+        if (Out->Write(packet.data(), packet.size()) != (ssize_t)packet.size()) {
+            fprintf(stderr, "cavern_bench: write failed\n");
+            break;
+        }
+        stats.Bytes += chunkBytes;
+        stats.Chunks++;
+    }
+
+    stats.Seconds = (double)(NowNs() - start) / 1e9;
+    return stats;
+}
+
+//=============================================================================
+// Receiver
+//=============================================================================
+
+struct RecvStats
+{
+    uint64_t Bytes = 0;
+    uint64_t Reads = 0;
+    uint64_t Chunks = 0;
+    uint64_t Dropped = 0;       // sequence gaps
+    uint64_t BadMarkers = 0;    // chunk boundary without a marker
+    uint64_t Packets = 0;
+    uint64_t Skipped = 0;       // bytes dropped looking for a packet header
+    double   Seconds = 0;
+    std::vector<uint64_t> LatencyNs;
+};
+
+static RecvStats RunReceiver(const Options &Opt, Endpoint *In)
+{
+    RecvStats stats;
+    std::vector<uint8_t> buffer(1 << 16);
+    CAVERN_PIPE_PACKET header;
+    size_t headerFill = 0;
+    size_t payloadRemaining = 0;
+    size_t payloadOffset = 0;
+    uint8_t stamp[CAVERN_BENCH_STAMP_SIZE];
+    uint32_t expectedSeq = 0;
+    uint64_t start = 0;
+
+    stats.LatencyNs.reserve((size_t)(Opt.Seconds * 1000 / std::max(1u, Opt.ChunkMs) * 2 + 16));
+
+    for (;;) {
+        ssize_t n = In->Read(buffer.data(), buffer.size());
+        if (n <= 0) {
+            break;
+        }
+        uint64_t now = NowNs();
+        if (!start) {
+            start = now;
+        }
+        stats.Reads++;
+
+        // Walk packets; a header or the stamp may straddle two reads.
+        for (size_t pos = 0; pos < (size_t)n; ) {
+            if (!payloadRemaining) {
+                size_t take = std::min((size_t)n - pos, sizeof(header) - headerFill);
+                memcpy((uint8_t *)&header + headerFill, buffer.data() + pos, take);
+                headerFill += take;
+                pos += take;
+                if (headerFill < sizeof(header)) {
+                    break;
+                }
+
+                if (!CavernIsPipePacket(&header)) {
+                    // Out of step: look for a header one byte on
+                    memmove(&header, (uint8_t *)&header + 1, sizeof(header) - 1);
+                    headerFill = sizeof(header) - 1;
+                    stats.Skipped++;
+                    continue;
+                }
+
+                headerFill = 0;
+                payloadRemaining = header.Length;
+                payloadOffset = 0;
+                stats.Packets++;
+                continue;
+            }
+
+            size_t run = std::min((size_t)n - pos, payloadRemaining);
+            if (Opt.Stamp && header.Type == CavernPipePacketAudio && payloadOffset < CAVERN_BENCH_STAMP_SIZE) {
+                size_t take = std::min(run, CAVERN_BENCH_STAMP_SIZE - payloadOffset);
+                memcpy(stamp + payloadOffset, buffer.data() + pos, take);
+                if (payloadOffset + take == CAVERN_BENCH_STAMP_SIZE) {
+                    uint32_t magic, seq;
+                    uint64_t sent;
+                    memcpy(&magic, stamp, 4);
+                    memcpy(&seq, stamp + 4, 4);
+                    memcpy(&sent, stamp + 8, 8);
+                    if (magic != CAVERN_BENCH_MAGIC) {
+                        stats.BadMarkers++;
+                    }
+                    else {
+                        if (seq != expectedSeq) {
+                            stats.Dropped += (uint32_t)(seq - expectedSeq);
+                        }
+                        expectedSeq = seq + 1;
+                        stats.Chunks++;
+                        if (now >= sent) {
+                            stats.LatencyNs.push_back(now - sent);
+                        }
+                    }
+                }
+            }
+            payloadOffset += run;
+            payloadRemaining -= run;
+            stats.Bytes += run;
+            pos += run;
+        }
+    }
+
+    stats.Seconds = start ? (double)(NowNs() - start) / 1e9 : 0;
+    return stats;
+}
+
+static double Percentile(const std::vector<uint64_t> &Sorted, double P)
+{
+    if (Sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(P / 100.0 * (double)(Sorted.size() - 1) + 0.5);
+    return (double)Sorted[std::min(index, Sorted.size() - 1)] / 1000.0;
+}
+
+static void PrintReceiver(const Options &Opt, RecvStats &Stats)
+{
+    double rate = Stats.Seconds > 0 ? (double)Stats.Bytes / Stats.Seconds : 0;
+    printf("[recv] %llu bytes in %.3f s, %llu reads\n",
+        (unsigned long long)Stats.Bytes, Stats.Seconds, (unsigned long long)Stats.Reads);
+    printf("[recv] throughput %.2f MB/s (%.2fx real time)\n",
+        rate / 1e6, rate / (double)Opt.BytesPerSecond());
+    printf("[recv] packets %llu, %llu bytes skipped out of sync\n",
+        (unsigned long long)Stats.Packets, (unsigned long long)Stats.Skipped);
+
+    if (!Opt.Stamp) {
+        return;
+    }
+
+    std::sort(Stats.LatencyNs.begin(), Stats.LatencyNs.end());
+    printf("[recv] chunks %llu, dropped %llu, bad markers %llu\n",
+        (unsigned long long)Stats.Chunks, (unsigned long long)Stats.Dropped,
+        (unsigned long long)Stats.BadMarkers);
+    printf("[recv] latency us: p50 %.1f  p90 %.1f  p99 %.1f  p99.9 %.1f  max %.1f\n",
+        Percentile(Stats.LatencyNs, 50), Percentile(Stats.LatencyNs, 90),
+        Percentile(Stats.LatencyNs, 99), Percentile(Stats.LatencyNs, 99.9),
+        Percentile(Stats.LatencyNs, 100));
+}
+
+static void PrintGenerator(const Options &Opt, const GenStats &Stats)
+{
+    double rate = Stats.Seconds > 0 ? (double)Stats.Bytes / Stats.Seconds : 0;
+    printf("[gen]  %llu bytes in %llu chunks of %zu, %.3f s, %llu late\n",
+        (unsigned long long)Stats.Bytes, (unsigned long long)Stats.Chunks,
+        Opt.ChunkBytes(), Stats.Seconds, (unsigned long long)Stats.Late);
+    printf("[gen]  offered %.2f MB/s (%.2fx real time)\n",
+        rate / 1e6, rate / (double)Opt.BytesPerSecond());
+}
+
+//=============================================================================
+// Position register page vs. syscall query
+//=============================================================================
+
+static int RunRegisterBench(const Options &Opt)
+{
+    PCAVERN_POSITION_REGISTER reg = (PCAVERN_POSITION_REGISTER)mmap(nullptr, 4096,
+        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (reg == MAP_FAILED) {
+        perror("mmap");
+        return 1;
+    }
+    reg->Version = CAVERN_POSITION_REGISTER_VERSION;
+    reg->BufferSize = 65536;
+    reg->QpcFrequency = 1000000000;
+
+    // Writer: one publish per millisecond, like CavernTimerNotify
+    const uint64_t bytesPerMs = Opt.BytesPerSecond() / 1000;
+    std::atomic<bool> writing(true);
+    std::thread writer([&]() {
+        uint64_t position = 0;
+        int64_t packets = 0;
+        while (writing) {
+            position += bytesPerMs;
+            packets = (int64_t)(position / (reg->BufferSize / 2));
+            CavernPublishPosition(reg, position, (int64_t)NowNs(), packets);
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+    });
+
+    // Query server: answers each one-byte request with a snapshot
+    int sv[2];
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) != 0) {
+        perror("socketpair");
+        writing = false;
+        writer.join();
+        return 1;
+    }
+    std::thread server([&]() {
+        char request;
+        while (read(sv[1], &request, 1) == 1) {
+            CAVERN_POSITION_SNAPSHOT snapshot;
+            CavernReadPosition(reg, &snapshot);
+            if (write(sv[1], &snapshot, sizeof(snapshot)) != (ssize_t)sizeof(snapshot)) {
+                break;
+            }
+        }
+    });
+
+    const uint64_t phaseNs = (uint64_t)(Opt.Seconds * 5e8);
+
+    // Mapped reads
+    uint64_t mappedReads = 0;
+    uint64_t regressions = 0;
+    uint64_t last = 0;
+    uint64_t start = NowNs();
+    uint64_t end = start;
+    while (g_Running && (end = NowNs()) - start < phaseNs) {
+        for (int i = 0; i < 1024; i++) {
+            CAVERN_POSITION_SNAPSHOT snapshot;
+            CavernReadPosition(reg, &snapshot);
+            if (snapshot.LinearPosition < last) {
+                regressions++;
+            }
+            last = snapshot.LinearPosition;
+        }
+        mappedReads += 1024;
+    }
+    double mappedNs = (double)(end - start) / (double)std::max<uint64_t>(mappedReads, 1);
+
+    // Round-trip queries
+    uint64_t queries = 0;
+    start = NowNs();
+    while (g_Running && (end = NowNs()) - start < phaseNs) {
+        char request = 0;
+        CAVERN_POSITION_SNAPSHOT snapshot;
+        if (write(sv[0], &request, 1) != 1 ||
+            read(sv[0], &snapshot, sizeof(snapshot)) != (ssize_t)sizeof(snapshot)) {
+            break;
+        }
+        queries++;
+    }
+    double queryNs = (double)(end - start) / (double)std::max<uint64_t>(queries, 1);
+
+    close(sv[0]);
+    server.join();
+    close(sv[1]);
+    writing = false;
+    writer.join();
+
+    printf("[reg] mapped page: %llu reads, %.1f ns/read, %llu position regressions\n",
+        (unsigned long long)mappedReads, mappedNs, (unsigned long long)regressions);
+    printf("[reg] syscall query: %llu round trips, %.1f ns/query (%.0fx)\n",
+        (unsigned long long)queries, queryNs, mappedNs > 0 ? queryNs / mappedNs : 0.0);
+    printf("[reg] writer sequence %u, position %llu bytes\n",
+        reg->Sequence, (unsigned long long)reg->LinearPosition);
+
+    munmap(reg, 4096);
+    return regressions ? 1 : 0;
+}
+
+//=============================================================================
+// main
+//=============================================================================
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: cavern_bench recv|gen|loop --transport unix|fifo|shm --path P\n"
+        "       cavern_bench reg [--seconds S]\n"
+        "       [--channels N] [--rate HZ] [--bits N] [--bitstream BPS]\n"
+        "       [--file F] [--speed X] [--chunk-ms MS] [--seconds S]\n"
+        "       [--no-stamp] [--shm-size BYTES]\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options &Opt)
+{
+    if (argc < 2) {
+        return false;
+    }
+    Opt.Mode = argv[1];
+    if (Opt.Mode != "recv" && Opt.Mode != "gen" && Opt.Mode != "loop" && Opt.Mode != "reg") {
+        return false;
+    }
+
+    for (int i = 2; i < argc; i++) {
+        std::string arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if (arg == "--no-stamp") {
+            Opt.Stamp = false;
+            continue;
+        }
+        if (!value) {
+            return false;
+        }
+        i++;
+
+        if (arg == "--transport") {
+            std::string kind = value;
+            if (kind == "unix") Opt.Kind = TransportUnix;
+            else if (kind == "fifo") Opt.Kind = TransportFifo;
+            else if (kind == "shm") Opt.Kind = TransportShm;
+            else return false;
+        }
+        else if (arg == "--path") Opt.Path = value;
+        else if (arg == "--file") Opt.File = value;
+        else if (arg == "--channels") Opt.Channels = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--rate") Opt.Rate = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--bits") Opt.Bits = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--bitstream") Opt.BitstreamRate = strtoull(value, nullptr, 0);
+        else if (arg == "--speed") Opt.Speed = strtod(value, nullptr);
+        else if (arg == "--chunk-ms") Opt.ChunkMs = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--seconds") Opt.Seconds = strtod(value, nullptr);
+        else if (arg == "--shm-size") Opt.ShmSize = (size_t)strtoull(value, nullptr, 0);
+        else return false;
+    }
+
+    if (!Opt.Channels || !Opt.Rate || (Opt.Bits % 8) || !Opt.Bits || !Opt.ChunkMs) {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!ParseArgs(argc, argv, opt)) {
+        Usage();
+        return 2;
+    }
+
+    signal(SIGINT, OnSignal);
+    signal(SIGPIPE, SIG_IGN);
+
+    if (opt.Mode == "reg") {
+        return RunRegisterBench(opt);
+    }
+
+    printf("[cavern_bench] %s, %llu B/s, chunk %zu bytes every %u ms, speed %.2fx\n",
+        opt.BitstreamRate ? "bitstream" : "pcm",
+        (unsigned long long)opt.BytesPerSecond(), opt.ChunkBytes(), opt.ChunkMs, opt.Speed);
+
+    if (opt.Mode == "recv") {
+        Endpoint *in = OpenReceiver(opt);
+        if (!in) return 1;
+        RecvStats stats = RunReceiver(opt, in);
+        delete in;
+        PrintReceiver(opt, stats);
+        return 0;
+    }
+
+    if (opt.Mode == "gen") {
+        Endpoint *out = OpenSender(opt);
+        if (!out) return 1;
+        GenStats stats = RunGenerator(opt, out);
+        delete out;
+        PrintGenerator(opt, stats);
+        return 0;
+    }
+
+    // loop: receiver and generator in one process
+    RecvStats recvStats;
+    std::thread receiver([&]() {
+        Endpoint *in = OpenReceiver(opt);
+        if (in) {
+            recvStats = RunReceiver(opt, in);
+            delete in;
+        }
+    });
+
+    Endpoint *out = OpenSender(opt);
+    GenStats genStats;
+    if (out) {
+        genStats = RunGenerator(opt, out);
+        delete out;
+    }
+    else {
+        g_Running = false;
+    }
+    receiver.join();
+
+    PrintGenerator(opt, genStats);
+    PrintReceiver(opt, recvStats);
+    return out ? 0 : 1;
+}
@@ -0,0 +1,1521 @@
+/***************************************************************************
+ * CavernCaptureBench.cpp
+ *
+ * Linux version of the CavernSimple render capture engine (CSaveData in
+ * CavernSimple/savedata.cpp) and a benchmark against the engine it
+ * replaced.
+ *
+ * queue   The driver's engine: WriteData copies into CCavernCaptureQueue
+ *         (CavernSysvad/CavernCaptureQueue.h) and never waits; one writer
+ *         thread drains it with one pwrite per run of contiguous slots, up
+ *         to 1 MiB, keeping the file open. The header (RIFF, RF64 or
+ *         Wave64, CavernSysvad/CavernWaveHeader.h) is rewritten in place
+ *         every second of data. --backend picks how the data reaches the
+ *         file, as RenderDataBackend does in the driver:
+ *           buffered  pwrite through the page cache
+ *           mmap      memcpy into a sliding 4 MiB MAP_SHARED window of a
+ *                     file fallocate()d 10 s of stream ahead (the driver:
+ *                     a section view, the section sized to the reserve)
+ *           direct    O_DIRECT pwrite straight from the queue's slots, the
+ *                     last sector padded through CCavernCaptureAligner, the
+ *                     file fallocate()d ahead with FALLOC_FL_KEEP_SIZE and
+ *                     the data starting on a 4 KiB boundary (the driver:
+ *                     FILE_NO_INTERMEDIATE_BUFFERING, allocation size)
+ *         mmap and direct truncate the file to the data when it closes.
+ * legacy  The engine before it: four frames of four DMA buffers each, a
+ *         work item per full frame that opens the file, writes the frame
+ *         and closes it, and whole writes dropped while the frame they
+ *         would go into is still being saved.
+ *
+ * A producer thread stands in for the timer DPC: every --period-ms it
+ * hands the engine one period of 16 ch / 192 kHz / 32-bit data (by
+ * default) carrying a counting pattern. --stall-ms makes the writer (or
+ * the legacy workers) stop for that long once per second of stream, like
+ * a disk under writeback pressure. Afterwards the file is read back: the
+ * header must describe the data and, if nothing was dropped, the data
+ * must be the pattern. The header is parsed here, chunk by chunk, not with
+ * CavernWaveHeader.
+ *
+ * large   Writes --size bytes (10 GiB by default) through the queue engine
+ *         as fast as the disk takes them, with the producer waiting for
+ *         room instead of dropping. While it runs, a probe reads the
+ *         header back every 250 ms and checks that it parses and does not
+ *         claim more data than the file holds. RF64 goes from RIFF to RF64
+ *         on the first checkpoint past 4 GB. The whole file is verified at
+ *         the end, so the run needs --size of free disk space.
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -std=c++17 -pthread -ICavernSysvad -o cavern_capture_bench \
+ *       tools/CavernCaptureBench/CavernCaptureBench.cpp CavernSysvad/CavernCaptureQueue.cpp \
+ *       CavernSysvad/CavernCaptureAligner.cpp CavernSysvad/CavernWaveHeader.cpp
+ *
+ * Usage:
+ *   cavern_capture_bench [both|queue|legacy|large] [options]
+ *
+ * Options:
+ *   --path P         Capture file               (default /tmp/cavern_capture.wav)
+ *   --container C    riff|rf64|w64              (default rf64, as the driver)
+ *   --backend B      buffered|mmap|direct       (default buffered, as the driver)
+ *   --channels N     PCM channels               (default 16)
+ *   --rate HZ        PCM sample rate            (default 192000)
+ *   --bits N         PCM container bits         (default 32)
+ *   --seconds S      Stream time to capture     (default 10)
+ *   --size B         Data to capture instead, K/M/G suffixes (large: 10G)
+ *   --speed X        Pacing multiplier, 0 = as fast as possible (default 1)
+ *   --period-ms MS   DPC period, one WriteData per period (default 10)
+ *   --dma-ms MS      DMA buffer, sizes the legacy frames (default 20)
+ *   --buffer-ms MS   Capture queue length       (default 500, as the driver)
+ *   --stall-ms MS    Writer stall per second of stream (default 0)
+ *   --pause-s S      Flush the partial slot every S s of stream, as a
+ *                    pause does (WaitAllWrites); leaves direct writes
+ *                    unaligned from then on (default 0, never)
+ *   --keep           Keep the capture file
+ *
+ * Exit status is 1 if the queue engine dropped data although its buffer
+ * is longer than the stall, or if a capture does not verify. Each run
+ * reports its CPU time and how much of the file is left in the page cache
+ * (before verification reads it back). Memory is
+ * locked where allowed, as the driver's buffers are non-paged; it is
+ * locked as it is touched (MCL_ONFAULT), so file mappings are not read in
+ * ahead, and CavernAllocate zeroes the queue up front, so page faults on
+ * first use do not count against WriteData.
+ ***************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define NOMINMAX
+#include "CavernCaptureQueue.h"
+#include "CavernCaptureAligner.h"
+#include "CavernWaveHeader.h"
+
+// As CavernSimple/savedata.cpp
+#define CAPTURE_SLOT_SIZE           (64u * 1024)
+#define CAPTURE_MAX_BATCH           (1024u * 1024)
+#define CAPTURE_WRITER_PERIOD_MS    20
+#define CAPTURE_CHECKPOINT_MS       1000
+#define CAPTURE_RESERVE_MS          10000
+#define CAPTURE_MIN_RESERVE         (16ull * 1024 * 1024)
+#define CAPTURE_MAP_WINDOW          (4ull * 1024 * 1024)
+#define CAPTURE_SECTOR_ALIGNMENT    4096u
+
+// Header probe period in large mode
+#define LARGE_PROBE_MS              250
+
+// The legacy engine's frame ring and work item pool
+#define LEGACY_FRAME_COUNT          4
+#define LEGACY_WORK_ITEMS           15
+#define LEGACY_WORKER_THREADS       4
+
+//=============================================================================
+// Options
+//=============================================================================
+
+enum CaptureBackend
+{
+    BackendBuffered = 0,
+    BackendMmap,
+    BackendDirect,
+    BackendCount
+};
+
+static const char *g_BackendNames[BackendCount] = { "buffered", "mmap", "direct" };
+
+struct Options
+{
+    std::string Engine = "both";
+    std::string Path = "/tmp/cavern_capture.wav";
+    CAVERN_WAVE_CONTAINER Container = CavernWaveRf64;
+    CaptureBackend Backend = BackendBuffered;
+    uint32_t    Channels = 16;
+    uint32_t    Rate = 192000;
+    uint32_t    Bits = 32;
+    double      Seconds = 10.0;
+    uint64_t    Size = 0;
+    double      Speed = 1.0;
+    uint32_t    PeriodMs = 10;
+    uint32_t    DmaMs = 20;
+    uint32_t    BufferMs = 500;
+    uint32_t    StallMs = 0;
+    double      PauseSeconds = 0;
+    bool        Keep = false;
+
+    uint32_t BlockAlign() const { return Channels * (Bits / 8); }
+    uint64_t BytesPerSecond() const { return (uint64_t)BlockAlign() * Rate; }
+
+    uint32_t FramesBytes(uint32_t Ms) const
+    {
+        return (uint32_t)std::max<uint64_t>((uint64_t)Rate * Ms / 1000, 1) * BlockAlign();
+    }
+
+    uint64_t TotalBytes() const
+    {
+        if (Size) {
+            return Size - Size % BlockAlign();
+        }
+        uint64_t frames = (uint64_t)(Seconds * Rate);
+        return frames * BlockAlign();
+    }
+};
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static bool WriteAll(int Fd, const uint8_t *Data, size_t Length, uint64_t Offset)
+{
+    while (Length) {
+        ssize_t n = pwrite(Fd, Data, Length, (off_t)Offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        Data += n;
+        Length -= (size_t)n;
+        Offset += (uint64_t)n;
+    }
+    return true;
+}
+
+//=============================================================================
+// Wave file: WAVE_FORMAT_EXTENSIBLE as the driver streams it, in one of the
+// CavernWaveHeader.h containers
+//=============================================================================
+
+#define WAVE_FORMAT_BYTES   40u
+
+static const char *g_ContainerNames[CavernWaveContainerCount] = { "riff", "rf64", "w64" };
+
+static void PutLe(uint8_t *P, uint64_t Value, int Bytes)
+{
+    for (int i = 0; i < Bytes; i++) {
+        P[i] = (uint8_t)(Value >> (8 * i));
+    }
+}
+
+static uint64_t GetLe(const uint8_t *P, int Bytes)
+{
+    uint64_t value = 0;
+    for (int i = Bytes - 1; i >= 0; i--) {
+        value = (value << 8) | P[i];
+    }
+    return value;
+}
+
+static void BuildFormat(const Options &Opt, uint8_t *Format)
+{
+    static const uint8_t pcmSubtype[16] = {
+        0x01, 0x00, 0x00, 0x00, 0x00, 0x00, 0x10, 0x00,
+        0x80, 0x00, 0x00, 0xAA, 0x00, 0x38, 0x9B, 0x71
+    };
+
+    PutLe(Format, 0xFFFE, 2);
+    PutLe(Format + 2, Opt.Channels, 2);
+    PutLe(Format + 4, Opt.Rate, 4);
+    PutLe(Format + 8, Opt.BytesPerSecond(), 4);
+    PutLe(Format + 12, Opt.BlockAlign(), 2);
+    PutLe(Format + 14, Opt.Bits, 2);
+    PutLe(Format + 16, 22, 2);
+    PutLe(Format + 18, Opt.Bits, 2);
+    PutLe(Format + 20, (Opt.Channels >= 32) ? 0xFFFFFFFFu : ((1u << Opt.Channels) - 1), 4);
+    memcpy(Format + 24, pcmSubtype, 16);
+}
+
+static uint32_t HeaderBytes(CAVERN_WAVE_CONTAINER Container, uint32_t DataAlignment = 0)
+{
+    return CavernWaveHeaderBytes(Container, WAVE_FORMAT_BYTES, DataAlignment);
+}
+
+// Positional write of the header for DataBytes of data (packed)
+static bool WriteHeader(int Fd, const Options &Opt, CAVERN_WAVE_CONTAINER Container, uint64_t DataBytes)
+{
+    uint8_t format[WAVE_FORMAT_BYTES];
+    uint8_t header[CAVERN_WAVE_MAX_HEADER];
+
+    BuildFormat(Opt, format);
+    if (!NT_SUCCESS(CavernWaveBuildHeader(Container, format, sizeof(format), 0, DataBytes, header, sizeof(header)))) {
+        return false;
+    }
+    return WriteAll(Fd, header, HeaderBytes(Container), 0);
+}
+
+//=============================================================================
+// Test pattern: the stream as little-endian 32-bit word indices
+//=============================================================================
+
+static void FillPattern(uint8_t *Data, size_t Length, uint64_t Offset)
+{
+    size_t i = 0;
+
+    for (; i < Length && ((Offset + i) & 3); i++) {
+        Data[i] = (uint8_t)((uint32_t)((Offset + i) >> 2) >> (8 * ((Offset + i) & 3)));
+    }
+    for (; i + 4 <= Length; i += 4) {
+        uint32_t word = (uint32_t)((Offset + i) >> 2);
+        memcpy(Data + i, &word, 4);
+    }
+    for (; i < Length; i++) {
+        Data[i] = (uint8_t)((uint32_t)((Offset + i) >> 2) >> (8 * ((Offset + i) & 3)));
+    }
+}
+
+//=============================================================================
+// Engines
+//=============================================================================
+
+struct CaptureStats
+{
+    uint64_t Queued = 0;        // bytes accepted by WriteData
+    uint64_t Dropped = 0;
+    uint64_t Drops = 0;         // WriteData calls that lost data
+    uint64_t Written = 0;       // bytes written to the file
+    uint64_t Writes = 0;
+    uint64_t WriteNs = 0;       // time spent in file writes
+    uint64_t MaxWriteNs = 0;
+    uint32_t HighWater = 0;     // queue engine: most slots pending
+    uint32_t Slots = 0;
+    uint64_t Checkpoints = 0;   // in-place header updates
+    uint64_t Reserves = 0;      // fallocate() extents
+    uint64_t Copied = 0;        // direct: bytes through the bounce buffer
+    CAVERN_WAVE_CONTAINER Container = CavernWaveRiff;
+    uint32_t HeaderBytes = 0;
+    bool     IoError = false;
+};
+
+class CaptureEngine
+{
+public:
+    virtual ~CaptureEngine() {}
+    virtual const char *Name() const = 0;
+    virtual bool Open(const Options &Opt) = 0;
+
+    // Called from the producer thread only, like the DPC.
+    virtual void WriteData(const uint8_t *Data, uint32_t Bytes) = 0;
+
+    // Writes out everything queued, updates the header and closes.
+    virtual void Close() = 0;
+
+    // Whether Bytes can be queued without a drop; large mode waits for it.
+    virtual bool HasRoom(uint32_t Bytes) const { (void)Bytes; return true; }
+
+    // Hands the partly filled slot to the writer, as a pause does.
+    virtual void Pause() {}
+
+    CaptureStats Stats;
+
+protected:
+    // Stall of --stall-ms whenever the written data passes another
+    // second of stream.
+    void MaybeStall(uint64_t WrittenBefore, uint64_t WrittenAfter)
+    {
+        if (m_StallMs && WrittenBefore / m_BytesPerSecond != WrittenAfter / m_BytesPerSecond) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(m_StallMs));
+        }
+    }
+
+    void TimedWrite(int Fd, const uint8_t *Data, size_t Length, uint64_t Offset)
+    {
+        uint64_t start = NowNs();
+        CountWrite(start, Length, WriteAll(Fd, Data, Length, Offset));
+    }
+
+    void CountWrite(uint64_t StartNs, size_t Length, bool Ok)
+    {
+        uint64_t elapsed = NowNs() - StartNs;
+
+        if (!Ok) {
+            Stats.IoError = true;
+        }
+        Stats.WriteNs += elapsed;
+        Stats.MaxWriteNs = std::max(Stats.MaxWriteNs, elapsed);
+        Stats.Writes++;
+        Stats.Written += Length;
+    }
+
+    uint64_t m_BytesPerSecond = 1;
+    uint32_t m_StallMs = 0;
+};
+
+//
+// The capture file behind the queue engine, one backend per
+// CSaveData::FileWrite branch: buffered, mapped window, direct.
+//
+class CaptureFile
+{
+public:
+    ~CaptureFile() { Close(); }
+
+    bool Open(const Options &Opt)
+    {
+        m_Opt = Opt;
+        m_Backend = Opt.Backend;
+        m_HeaderBytes = HeaderBytes(Opt.Container, (m_Backend == BackendDirect) ? CAPTURE_SECTOR_ALIGNMENT : 0);
+        m_ReserveBytes = std::max<uint64_t>(Opt.BytesPerSecond() * CAPTURE_RESERVE_MS / 1000, CAPTURE_MIN_RESERVE);
+        m_ReserveBytes = (m_ReserveBytes + CAPTURE_MAP_WINDOW - 1) & ~(CAPTURE_MAP_WINDOW - 1);
+        m_Reserved = 0;
+        BuildFormat(Opt, m_Format);
+
+        // Page aligned, as O_DIRECT needs
+        m_Header = (uint8_t *)CavernAllocate(CAPTURE_SECTOR_ALIGNMENT, 0);
+        if (!m_Header) {
+            return false;
+        }
+        if (m_Backend == BackendDirect &&
+            (!NT_SUCCESS(m_Aligner.Init(CAPTURE_SECTOR_ALIGNMENT, CAPTURE_MAX_BATCH)) ||
+             !NT_SUCCESS(m_Aligner.Reset(m_HeaderBytes)))) {
+            fprintf(stderr, "cavern_capture_bench: aligner setup failed\n");
+            return false;
+        }
+
+        int flags = O_RDWR | O_CREAT | O_TRUNC | ((m_Backend == BackendDirect) ? O_DIRECT : 0);
+        m_Fd = open(Opt.Path.c_str(), flags, 0644);
+        if (m_Fd < 0) {
+            perror("cavern_capture_bench: open");
+            return false;
+        }
+
+        // The first extent comes with the new file
+        if (m_Backend != BackendBuffered && !Reserve(m_HeaderBytes + 1)) {
+            return false;
+        }
+        return WriteHeader(0);
+    }
+
+    uint32_t GetHeaderBytes() const { return m_HeaderBytes; }
+    uint64_t GetReserves() const { return m_Reserves; }
+    uint64_t GetCopied() const { return m_Aligner.GetCopiedBytes(); }
+
+    // Data at Offset, the end of the stream
+    bool Write(const uint8_t *Data, uint32_t Bytes, uint64_t Offset)
+    {
+        switch (m_Backend) {
+        case BackendMmap:
+            return WriteMapped(Data, Bytes, Offset);
+        case BackendDirect:
+            return WriteDirect(Data, Bytes, Offset);
+        default:
+            return WriteAll(m_Fd, Data, Bytes, Offset);
+        }
+    }
+
+    bool WriteHeader(uint64_t DataBytes)
+    {
+        return NT_SUCCESS(CavernWaveBuildHeader(m_Opt.Container, m_Format, sizeof(m_Format),
+                   (m_Backend == BackendDirect) ? CAPTURE_SECTOR_ALIGNMENT : 0, DataBytes,
+                   m_Header, CAPTURE_SECTOR_ALIGNMENT)) &&
+               WriteAll(m_Fd, m_Header, m_HeaderBytes, 0);
+    }
+
+    // FileFinish: the file ends at the data and its padding, which reads
+    // as zeros, and gets its last header
+    bool Finish(uint64_t End)
+    {
+        Unmap();
+        uint64_t length = End + CavernWavePadBytes(m_Opt.Container, End - m_HeaderBytes);
+        bool ok = ftruncate(m_Fd, (off_t)length) == 0;
+        return WriteHeader(End - m_HeaderBytes) && ok;
+    }
+
+    void Close()
+    {
+        Unmap();
+        if (m_Fd >= 0) {
+            close(m_Fd);
+            m_Fd = -1;
+        }
+        if (m_Header) {
+            CavernFree(m_Header, 0);
+            m_Header = nullptr;
+        }
+    }
+
+private:
+    // FileReserve: space up to End, a whole extent at a time. The mapped
+    // window needs it in the file size; direct writes extend the size
+    // themselves.
+    bool Reserve(uint64_t End)
+    {
+        if (End <= m_Reserved) {
+            return true;
+        }
+        uint64_t reserved = End + m_ReserveBytes;
+        int mode = (m_Backend == BackendDirect) ? FALLOC_FL_KEEP_SIZE : 0;
+
+        if (fallocate(m_Fd, mode, 0, (off_t)reserved) != 0 &&
+            (m_Backend != BackendMmap || ftruncate(m_Fd, (off_t)reserved) != 0)) {
+            perror("cavern_capture_bench: fallocate");
+            return false;
+        }
+        m_Reserved = reserved;
+        m_Reserves++;
+        return true;
+    }
+
+    bool WriteMapped(const uint8_t *Data, uint32_t Bytes, uint64_t Offset)
+    {
+        if (!Reserve(Offset + Bytes)) {
+            return false;
+        }
+
+        while (Bytes) {
+            if (!m_View || Offset < m_ViewOffset || Offset >= m_ViewOffset + m_ViewBytes) {
+                Unmap();
+                m_ViewOffset = Offset & ~(CAPTURE_MAP_WINDOW - 1);
+                m_ViewBytes = (size_t)std::min<uint64_t>(CAPTURE_MAP_WINDOW, m_Reserved - m_ViewOffset);
+                void *view = mmap(nullptr, m_ViewBytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_Fd, (off_t)m_ViewOffset);
+                if (view == MAP_FAILED) {
+                    perror("cavern_capture_bench: mmap");
+                    return false;
+                }
+                m_View = (uint8_t *)view;
+            }
+
+            size_t at = (size_t)(Offset - m_ViewOffset);
+            size_t run = std::min<size_t>(Bytes, m_ViewBytes - at);
+            memcpy(m_View + at, Data, run);
+            Data += run;
+            Bytes -= (uint32_t)run;
+            Offset += run;
+        }
+        return true;
+    }
+
+    bool WriteDirect(const uint8_t *Data, uint32_t Bytes, uint64_t Offset)
+    {
+        CAVERN_ALIGNED_WRITE writes[CAVERN_ALIGNER_MAX_WRITES];
+        ULONG count = 0;
+
+        if (m_Aligner.GetEnd() != Offset || !Reserve(Offset + Bytes + CAPTURE_SECTOR_ALIGNMENT) ||
+            !NT_SUCCESS(m_Aligner.Plan(Data, Bytes, writes, &count))) {
+            return false;
+        }
+        for (ULONG i = 0; i < count; i++) {
+            if (!WriteAll(m_Fd, writes[i].Data, writes[i].Bytes, writes[i].Offset)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void Unmap()
+    {
+        if (m_View) {
+            munmap(m_View, m_ViewBytes);
+            m_View = nullptr;
+        }
+    }
+
+    Options                 m_Opt;
+    CaptureBackend          m_Backend = BackendBuffered;
+    int                     m_Fd = -1;
+    uint8_t                 m_Format[WAVE_FORMAT_BYTES];
+    uint8_t                *m_Header = nullptr;
+    uint32_t                m_HeaderBytes = 0;
+    uint64_t                m_ReserveBytes = 0;
+    uint64_t                m_Reserved = 0;
+    uint64_t                m_Reserves = 0;
+    uint8_t                *m_View = nullptr;
+    uint64_t                m_ViewOffset = 0;
+    size_t                  m_ViewBytes = 0;
+    CCavernCaptureAligner   m_Aligner;
+};
+
+//
+// CSaveData as it is now: lock-free slot queue, one long-lived writer.
+//
+class QueueCapture : public CaptureEngine
+{
+public:
+    const char *Name() const override { return "queue"; }
+
+    bool Open(const Options &Opt) override
+    {
+        m_Opt = Opt;
+        m_BytesPerSecond = Opt.BytesPerSecond();
+        m_StallMs = Opt.StallMs;
+
+        // GetBufferSize: --buffer-ms of the stream in a power-of-two count
+        // of slots, at least four
+        uint64_t bufferBytes = std::max<uint64_t>(Opt.BytesPerSecond() * Opt.BufferMs / 1000, 4 * CAPTURE_SLOT_SIZE);
+        uint32_t slots = 1;
+        while ((uint64_t)slots * CAPTURE_SLOT_SIZE < bufferBytes && slots < CAVERN_CAPTURE_MAX_SLOTS) {
+            slots <<= 1;
+        }
+        if (!NT_SUCCESS(m_Queue.Init(CAPTURE_SLOT_SIZE, slots))) {
+            fprintf(stderr, "cavern_capture_bench: queue allocation failed\n");
+            return false;
+        }
+        m_WakeSlots = std::max<uint32_t>(m_Queue.GetSlotCount() / 4, 1);
+        Stats.Slots = m_Queue.GetSlotCount();
+        Stats.Container = Opt.Container;
+
+        if (!m_File.Open(Opt)) {
+            perror("cavern_capture_bench: write");
+            return false;
+        }
+        m_HeaderBytes = m_File.GetHeaderBytes();
+        Stats.HeaderBytes = m_HeaderBytes;
+        m_Offset = m_HeaderBytes;
+        m_CheckpointBytes = std::max<uint64_t>(Opt.BytesPerSecond() * CAPTURE_CHECKPOINT_MS / 1000, CAPTURE_SLOT_SIZE);
+        m_NextCheckpoint = m_Offset + m_CheckpointBytes;
+
+        m_Stop = false;
+        m_Writer = std::thread([this]() { WriterThread(); });
+        return true;
+    }
+
+    void WriteData(const uint8_t *Data, uint32_t Bytes) override
+    {
+        if (m_Queue.Write(Data, Bytes) != Bytes) {
+            Stats.Drops++;
+        }
+        if (m_Queue.GetPendingSlots() >= m_WakeSlots) {
+            m_WakeFlag.store(true, std::memory_order_release);
+            m_Wake.notify_one();
+        }
+    }
+
+    void Close() override
+    {
+        // WaitAllWrites, then StopWriter as the destructor does
+        m_Queue.Flush();
+        m_Stop = true;
+        m_Wake.notify_one();
+        if (m_Writer.joinable()) {
+            m_Writer.join();
+        }
+
+        Stats.Queued = m_Queue.GetQueuedBytes();
+        Stats.Dropped = m_Queue.GetDroppedBytes();
+        Stats.HighWater = m_Queue.GetHighWater();
+
+        Stats.Reserves = m_File.GetReserves();
+        Stats.Copied = m_File.GetCopied();
+        m_File.Close();
+    }
+
+    void Pause() override
+    {
+        m_Queue.Flush();
+        m_WakeFlag.store(true, std::memory_order_release);
+        m_Wake.notify_one();
+    }
+
+    bool HasRoom(uint32_t Bytes) const override
+    {
+        uint64_t free = (uint64_t)(m_Queue.GetSlotCount() - m_Queue.GetPendingSlots() - 1) * m_Queue.GetSlotBytes();
+        return free >= Bytes;
+    }
+
+private:
+    void WriterThread()
+    {
+        bool stop = false;
+
+        while (!stop) {
+            {
+                std::unique_lock<std::mutex> lock(m_WakeLock);
+                m_Wake.wait_for(lock, std::chrono::milliseconds(CAPTURE_WRITER_PERIOD_MS), [this]() {
+                    return m_WakeFlag.load(std::memory_order_acquire) || m_Stop.load();
+                });
+                m_WakeFlag.store(false, std::memory_order_relaxed);
+            }
+            stop = m_Stop.load();
+            DrainQueue();
+        }
+
+        if (!m_File.Finish(m_Offset)) {
+            Stats.IoError = true;
+        }
+        Stats.Checkpoints++;
+    }
+
+    void Checkpoint()
+    {
+        if (!m_File.WriteHeader(m_Offset - m_HeaderBytes)) {
+            Stats.IoError = true;
+        }
+        Stats.Checkpoints++;
+        m_NextCheckpoint = m_Offset + m_CheckpointBytes;
+    }
+
+    void DrainQueue()
+    {
+        CAVERN_CAPTURE_RUN run;
+
+        while (m_Queue.Peek(&run, CAPTURE_MAX_BATCH)) {
+            uint64_t before = Stats.Written;
+
+            uint64_t start = NowNs();
+            CountWrite(start, run.Bytes, m_File.Write(run.Data, run.Bytes, m_Offset));
+            m_Offset += run.Bytes;
+            m_Queue.Release(&run);
+
+            if (m_Offset >= m_NextCheckpoint) {
+                Checkpoint();
+            }
+            MaybeStall(before, Stats.Written);
+        }
+    }
+
+    Options                 m_Opt;
+    CCavernCaptureQueue     m_Queue;
+    uint32_t                m_WakeSlots = 1;
+    CaptureFile             m_File;
+    uint32_t                m_HeaderBytes = 0;
+    uint64_t                m_Offset = 0;
+    uint64_t                m_CheckpointBytes = 0;
+    uint64_t                m_NextCheckpoint = 0;
+
+    std::thread             m_Writer;
+    std::mutex              m_WakeLock;
+    std::condition_variable m_Wake;
+    std::atomic<bool>       m_WakeFlag{false};
+    std::atomic<bool>       m_Stop{false};
+};
+
+//
+// CSaveData before the writer thread: frame ring, work item per frame,
+// open / write / close per frame.
+//
+class LegacyCapture : public CaptureEngine
+{
+public:
+    const char *Name() const override { return "legacy"; }
+
+    bool Open(const Options &Opt) override
+    {
+        m_Opt = Opt;
+        m_BytesPerSecond = Opt.BytesPerSecond();
+        m_StallMs = Opt.StallMs;
+
+        // SetMaxWriteSize(RequestedSize_ * 4)
+        m_FrameSize = Opt.FramesBytes(Opt.DmaMs) * 4;
+        m_Buffer.assign((size_t)m_FrameSize * LEGACY_FRAME_COUNT, 0);
+        for (auto &used : m_FrameUsed) {
+            used = false;
+        }
+        m_FrameIndex = 0;
+        m_BufferOffset = 0;
+
+        int fd = open(Opt.Path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            perror("cavern_capture_bench: open");
+            return false;
+        }
+        // Always the 32-bit RIFF header
+        bool ok = WriteHeader(fd, Opt, CavernWaveRiff, 0);
+        close(fd);
+        if (!ok) {
+            perror("cavern_capture_bench: write");
+            return false;
+        }
+        m_FilePtr = HeaderBytes(CavernWaveRiff);
+        Stats.HeaderBytes = (uint32_t)m_FilePtr;
+
+        m_Stop = false;
+        for (int i = 0; i < LEGACY_WORKER_THREADS; i++) {
+            m_Workers.emplace_back([this]() { WorkerThread(); });
+        }
+        return true;
+    }
+
+    void WriteData(const uint8_t *Data, uint32_t Bytes) override
+    {
+        uint32_t offered = Bytes;
+        uint32_t queued = 0;
+        bool saveFrame = false;
+        uint32_t saveFrameIndex = 0;
+
+        Bytes = std::min(Bytes, m_FrameSize);
+
+        if (!m_FrameUsed[m_FrameIndex].load()) {
+            uint32_t writeBytes = std::min<uint32_t>(Bytes, (uint32_t)m_Buffer.size() - m_BufferOffset);
+
+            memcpy(m_Buffer.data() + m_BufferOffset, Data, writeBytes);
+            m_BufferOffset += writeBytes;
+            queued = writeBytes;
+
+            if (m_BufferOffset >= (m_FrameIndex + 1) * m_FrameSize) {
+                saveFrame = true;
+            }
+            if (m_BufferOffset == m_Buffer.size()) {
+                saveFrame = true;
+                m_BufferOffset = 0;
+            }
+            if (saveFrame) {
+                m_FrameUsed[m_FrameIndex] = true;
+                saveFrameIndex = m_FrameIndex;
+                m_FrameIndex = (m_FrameIndex + 1) % LEGACY_FRAME_COUNT;
+            }
+
+            if (writeBytes != Bytes && !m_FrameUsed[m_FrameIndex].load()) {
+                memcpy(m_Buffer.data() + m_BufferOffset, Data + writeBytes, Bytes - writeBytes);
+                m_BufferOffset += Bytes - writeBytes;
+                queued = Bytes;
+            }
+
+            if (saveFrame) {
+                SaveFrame(saveFrameIndex, m_FrameSize);
+            }
+        }
+
+        Stats.Queued += queued;
+        if (queued != offered) {
+            Stats.Dropped += offered - queued;
+            Stats.Drops++;
+        }
+    }
+
+    void Close() override
+    {
+        // WaitAllWorkItems: the partly filled frame, then every work item
+        if (m_BufferOffset > m_FrameIndex * m_FrameSize) {
+            SaveFrame(m_FrameIndex, m_BufferOffset - m_FrameIndex * m_FrameSize);
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_QueueLock);
+            m_Stop = true;
+        }
+        m_QueueReady.notify_all();
+        for (auto &worker : m_Workers) {
+            worker.join();
+        }
+        m_Workers.clear();
+
+        int fd = open(m_Opt.Path.c_str(), O_WRONLY);
+        if (fd >= 0) {
+            if (!WriteHeader(fd, m_Opt, CavernWaveRiff, m_FilePtr - HeaderBytes(CavernWaveRiff))) {
+                Stats.IoError = true;
+            }
+            close(fd);
+        }
+    }
+
+private:
+    struct WorkItem
+    {
+        uint32_t FrameNo;
+        uint32_t DataSize;
+    };
+
+    void SaveFrame(uint32_t FrameNo, uint32_t DataSize)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_QueueLock);
+            if (m_InFlight == LEGACY_WORK_ITEMS) {
+                return;             // GetNewWorkItem found none free
+            }
+            m_InFlight++;
+            m_Queue.push_back({FrameNo, DataSize});
+        }
+        m_QueueReady.notify_one();
+    }
+
+    void WorkerThread()
+    {
+        for (;;) {
+            WorkItem item;
+            {
+                std::unique_lock<std::mutex> lock(m_QueueLock);
+                m_QueueReady.wait(lock, [this]() { return m_Stop || !m_Queue.empty(); });
+                if (m_Queue.empty()) {
+                    return;
+                }
+                item = m_Queue.front();
+                m_Queue.pop_front();
+            }
+
+            {
+                // SaveFrameWorkerCallback under m_FileSync
+                std::lock_guard<std::mutex> lock(m_FileSync);
+                uint64_t before = Stats.Written;
+                int fd = open(m_Opt.Path.c_str(), O_WRONLY);
+                if (fd >= 0) {
+                    TimedWrite(fd, m_Buffer.data() + (size_t)item.FrameNo * m_FrameSize, item.DataSize, m_FilePtr);
+                    m_FilePtr += item.DataSize;
+                    close(fd);
+                }
+                else {
+                    Stats.IoError = true;
+                }
+                m_FrameUsed[item.FrameNo] = false;
+                MaybeStall(before, Stats.Written);
+            }
+
+            std::lock_guard<std::mutex> lock(m_QueueLock);
+            m_InFlight--;
+        }
+    }
+
+    Options                 m_Opt;
+    std::vector<uint8_t>    m_Buffer;
+    uint32_t                m_FrameSize = 0;
+    uint32_t                m_FrameIndex = 0;
+    uint32_t                m_BufferOffset = 0;
+    std::atomic<bool>       m_FrameUsed[LEGACY_FRAME_COUNT];
+    std::mutex              m_FileSync;
+    uint64_t                m_FilePtr = 0;
+
+    std::vector<std::thread> m_Workers;
+    std::mutex              m_QueueLock;
+    std::condition_variable m_QueueReady;
+    std::deque<WorkItem>    m_Queue;
+    uint32_t                m_InFlight = 0;
+    bool                    m_Stop = false;
+};
+
+//=============================================================================
+// Producer and verification
+//=============================================================================
+
+struct ProducerStats
+{
+    uint64_t Calls = 0;
+    uint64_t Late = 0;
+    uint64_t Waits = 0;         // periods held back for room (large mode)
+    double   Seconds = 0;
+    std::vector<uint64_t> CallNs;
+};
+
+//
+// Hands the engine one period at a time, paced to --speed. With Wait, a
+// period waits until the engine can take it whole instead of dropping.
+//
+static ProducerStats RunProducer(const Options &Opt, CaptureEngine *Engine, bool Wait)
+{
+    ProducerStats stats;
+    const uint32_t chunkBytes = Opt.FramesBytes(Opt.PeriodMs);
+    const uint64_t total = Opt.TotalBytes();
+    const double chunkNs = Opt.Speed > 0 ?
+        (double)chunkBytes * 1e9 / ((double)Opt.BytesPerSecond() * Opt.Speed) : 0;
+    std::vector<uint8_t> chunk(chunkBytes);
+    const uint64_t pauseBytes = (uint64_t)(Opt.PauseSeconds * (double)Opt.BytesPerSecond());
+    uint64_t offset = 0;
+    const uint64_t start = NowNs();
+
+    stats.CallNs.reserve((size_t)(total / chunkBytes + 1));
+
+    while (offset < total) {
+        uint32_t bytes = (uint32_t)std::min<uint64_t>(chunkBytes, total - offset);
+
+        if (chunkNs > 0) {
+            uint64_t deadline = start + (uint64_t)(chunkNs * (double)stats.Calls);
+            uint64_t now = NowNs();
+            if (now < deadline) {
+                std::this_thread::sleep_for(std::chrono::nanoseconds(deadline - now));
+            }
+            else if (now - deadline > (uint64_t)chunkNs) {
+                stats.Late++;
+            }
+        }
+
+        FillPattern(chunk.data(), bytes, offset);
+
+        if (Wait && !Engine->HasRoom(bytes)) {
+            stats.Waits++;
+            while (!Engine->HasRoom(bytes)) {
+                std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            }
+        }
+
+        uint64_t begin = NowNs();
+        Engine->WriteData(chunk.data(), bytes);
+        stats.CallNs.push_back(NowNs() - begin);
+
+        if (pauseBytes && offset / pauseBytes != (offset + bytes) / pauseBytes) {
+            Engine->Pause();
+        }
+        offset += bytes;
+        stats.Calls++;
+    }
+
+    stats.Seconds = (double)(NowNs() - start) / 1e9;
+    return stats;
+}
+
+// Enough of the file for any header, sector-aligned ones included
+#define WAVE_READ_BYTES     (CAVERN_WAVE_MAX_ALIGNMENT * 2)
+
+//
+// What a wave header says, read independently of CavernWaveHeader
+//
+struct WaveInfo
+{
+    CAVERN_WAVE_CONTAINER Container = CavernWaveRiff;
+    bool     Large = false;     // RF64 with ds64 in use
+    uint64_t FileBytes = 0;     // from the RIFF/RF64/riff size
+    uint64_t DataOffset = 0;
+    uint64_t DataBytes = 0;
+    uint64_t Frames = 0;        // ds64 frame count
+    uint32_t BlockAlign = 0;
+};
+
+static const uint8_t g_W64Riff[16] = {
+    'r', 'i', 'f', 'f', 0x2E, 0x91, 0xCF, 0x11, 0xA5, 0xD6, 0x28, 0xDB, 0x04, 0xC1, 0x00, 0x00
+};
+static const uint8_t g_W64Wave[16] = {
+    'w', 'a', 'v', 'e', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static const uint8_t g_W64Fmt[16] = {
+    'f', 'm', 't', ' ', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+static const uint8_t g_W64Data[16] = {
+    'd', 'a', 't', 'a', 0xF3, 0xAC, 0xD3, 0x11, 0x8C, 0xD1, 0x00, 0xC0, 0x4F, 0x8E, 0xDB, 0x8A
+};
+
+static bool ParseWave64(const uint8_t *Header, size_t Bytes, WaveInfo &Info)
+{
+    Info.Container = CavernWave64;
+    Info.FileBytes = GetLe(Header + 16, 8);
+
+    for (size_t pos = 40; pos + 24 <= Bytes; ) {
+        uint64_t size = GetLe(Header + pos + 16, 8);
+        if (size < 24) {
+            return false;
+        }
+        if (!memcmp(Header + pos, g_W64Fmt, 16) && pos + 24 + 14 <= Bytes) {
+            Info.BlockAlign = (uint32_t)GetLe(Header + pos + 24 + 12, 2);
+        }
+        if (!memcmp(Header + pos, g_W64Data, 16)) {
+            Info.DataOffset = pos + 24;
+            Info.DataBytes = size - 24;
+            return true;
+        }
+        pos += (size_t)((size + 7) & ~7ull);
+    }
+    return false;
+}
+
+static bool ParseRiff(const uint8_t *Header, size_t Bytes, WaveInfo &Info)
+{
+    Info.Large = !memcmp(Header, "RF64", 4);
+    Info.Container = Info.Large ? CavernWaveRf64 : CavernWaveRiff;
+    Info.FileBytes = GetLe(Header + 4, 4) + 8;
+    if (Info.Large && Info.FileBytes != 0xFFFFFFFFull + 8) {
+        return false;
+    }
+
+    bool ds64 = false;
+    uint64_t data64 = 0;
+
+    for (size_t pos = 12; pos + 8 <= Bytes; ) {
+        uint32_t size = (uint32_t)GetLe(Header + pos + 4, 4);
+
+        if (!memcmp(Header + pos, "ds64", 4) && pos + 8 + 24 <= Bytes) {
+            Info.FileBytes = GetLe(Header + pos + 8, 8) + 8;
+            data64 = GetLe(Header + pos + 16, 8);
+            Info.Frames = GetLe(Header + pos + 24, 8);
+            ds64 = true;
+        }
+        else if (!memcmp(Header + pos, "JUNK", 4) && pos == 12) {
+            // RF64 file still under 4 GB: the ds64 placeholder
+            Info.Container = CavernWaveRf64;
+        }
+        else if (!memcmp(Header + pos, "fmt ", 4) && pos + 8 + 14 <= Bytes) {
+            Info.BlockAlign = (uint32_t)GetLe(Header + pos + 8 + 12, 2);
+        }
+        else if (!memcmp(Header + pos, "data", 4)) {
+            Info.DataOffset = pos + 8;
+            Info.DataBytes = size;
+            if (Info.Large) {
+                // The 32-bit size must be -1, the real one is in ds64
+                if (!ds64 || size != 0xFFFFFFFF) {
+                    return false;
+                }
+                Info.DataBytes = data64;
+            }
+            return true;
+        }
+        pos += 8 + (size_t)size + (size & 1);
+    }
+    return false;
+}
+
+//
+// Walks the chunks of Header (the start of the file) up to data.
+//
+static bool ParseWave(const uint8_t *Header, size_t Bytes, WaveInfo &Info, std::string &Detail)
+{
+    bool ok;
+
+    Info = WaveInfo();
+    if (Bytes >= 40 && !memcmp(Header, g_W64Riff, 16) && !memcmp(Header + 24, g_W64Wave, 16)) {
+        ok = ParseWave64(Header, Bytes, Info);
+    }
+    else if (Bytes >= 12 && (!memcmp(Header, "RIFF", 4) || !memcmp(Header, "RF64", 4)) &&
+             !memcmp(Header + 8, "WAVE", 4)) {
+        ok = ParseRiff(Header, Bytes, Info);
+    }
+    else {
+        Detail = "not a wave file";
+        return false;
+    }
+
+    if (!ok || !Info.BlockAlign) {
+        Detail = std::string("malformed ") + g_ContainerNames[Info.Container] + " header";
+        return false;
+    }
+    return true;
+}
+
+static bool ReadWave(int Fd, WaveInfo &Info, std::string &Detail)
+{
+    uint8_t header[WAVE_READ_BYTES];
+    ssize_t got = pread(Fd, header, sizeof(header), 0);
+
+    if (got <= 0) {
+        Detail = "cannot read the header";
+        return false;
+    }
+    return ParseWave(header, (size_t)got, Info, Detail);
+}
+
+//
+// Checks the header against the file and the data against the pattern;
+// the pattern only if nothing was dropped.
+//
+static bool VerifyCapture(const Options &Opt, const CaptureStats &Stats, std::string &Detail)
+{
+    int fd = open(Opt.Path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        Detail = "cannot open capture";
+        return false;
+    }
+
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t fileBytes = (uint64_t)st.st_size;
+    WaveInfo info;
+
+    if (!ReadWave(fd, info, Detail)) {
+        close(fd);
+        return false;
+    }
+    if (info.Container != Stats.Container || info.DataOffset != Stats.HeaderBytes) {
+        close(fd);
+        Detail = "header is not the expected " + std::string(g_ContainerNames[Stats.Container]) + " layout";
+        return false;
+    }
+
+    // The 32-bit RIFF sizes stop at 4 GB; everything else is exact
+    uint64_t dataBytes = Stats.Queued;
+    uint64_t expectFile = info.DataOffset + dataBytes + CavernWavePadBytes(Stats.Container, dataBytes);
+    uint64_t expectData = dataBytes;
+    if (Stats.Container == CavernWaveRiff) {
+        expectFile = std::min<uint64_t>(expectFile - 8, 0xFFFFFFFF) + 8;
+        expectData = std::min<uint64_t>(expectData, 0xFFFFFFFF);
+    }
+    if (info.FileBytes != expectFile || info.DataBytes != expectData ||
+        fileBytes != info.DataOffset + dataBytes + CavernWavePadBytes(Stats.Container, dataBytes)) {
+        close(fd);
+        Detail = "header sizes do not match the file (" + std::to_string(fileBytes) + " bytes, " +
+            std::to_string(dataBytes) + " queued)";
+        return false;
+    }
+    if (info.Large != (Stats.Container == CavernWaveRf64 && expectFile - 8 > 0xFFFFFFFF) ||
+        (info.Large && info.Frames != dataBytes / info.BlockAlign)) {
+        close(fd);
+        Detail = "ds64 missing, unexpected or with a wrong frame count";
+        return false;
+    }
+
+    if (Stats.Dropped) {
+        close(fd);
+        Detail = std::string(g_ContainerNames[info.Container]) + " header ok, data not checked (drops)";
+        return true;
+    }
+
+    std::vector<uint8_t> block(1 << 20), expected(1 << 20);
+    for (uint64_t offset = 0; offset < dataBytes; ) {
+        size_t run = (size_t)std::min<uint64_t>(block.size(), dataBytes - offset);
+        if (pread(fd, block.data(), run, (off_t)(info.DataOffset + offset)) != (ssize_t)run) {
+            close(fd);
+            Detail = "short read";
+            return false;
+        }
+        FillPattern(expected.data(), run, offset);
+        if (memcmp(block.data(), expected.data(), run)) {
+            size_t at = 0;
+            while (block[at] == expected[at]) {
+                at++;
+            }
+            close(fd);
+            Detail = "data differs at byte " + std::to_string(offset + at);
+            return false;
+        }
+        offset += run;
+    }
+
+    close(fd);
+    Detail = std::string(g_ContainerNames[info.Container]) + (info.Large ? " (ds64)" : "") +
+        " header and " + std::to_string(dataBytes) + " data bytes ok";
+    return true;
+}
+
+static double Percentile(const std::vector<uint64_t> &Sorted, double P)
+{
+    if (Sorted.empty()) {
+        return 0;
+    }
+    size_t index = (size_t)(P / 100.0 * (double)(Sorted.size() - 1) + 0.5);
+    return (double)Sorted[std::min(index, Sorted.size() - 1)] / 1000.0;
+}
+
+static void CpuSeconds(double &User, double &System)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    User = (double)usage.ru_utime.tv_sec + (double)usage.ru_utime.tv_usec / 1e6;
+    System = (double)usage.ru_stime.tv_sec + (double)usage.ru_stime.tv_usec / 1e6;
+}
+
+//
+// Bytes of the file resident in the page cache
+//
+static uint64_t CachedBytes(const std::string &Path)
+{
+    int fd = open(Path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    struct stat st;
+    fstat(fd, &st);
+    uint64_t cached = 0;
+    size_t length = (size_t)st.st_size;
+    void *map = length ? mmap(nullptr, length, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+
+    if (map != MAP_FAILED) {
+        size_t pageBytes = (size_t)sysconf(_SC_PAGESIZE);
+        std::vector<unsigned char> resident((length + pageBytes - 1) / pageBytes);
+        if (mincore(map, length, resident.data()) == 0) {
+            for (unsigned char page : resident) {
+                cached += (page & 1) ? pageBytes : 0;
+            }
+        }
+        munmap(map, length);
+    }
+    close(fd);
+    return std::min<uint64_t>(cached, length);
+}
+
+static bool RunEngine(const Options &Opt, CaptureEngine *Engine, bool Wait)
+{
+    double userStart, systemStart, userEnd, systemEnd;
+
+    CpuSeconds(userStart, systemStart);
+    if (!Engine->Open(Opt)) {
+        return false;
+    }
+    ProducerStats producer = RunProducer(Opt, Engine, Wait);
+    uint64_t closeStart = NowNs();
+    Engine->Close();
+    double closeMs = (double)(NowNs() - closeStart) / 1e6;
+    CpuSeconds(userEnd, systemEnd);
+    uint64_t cached = CachedBytes(Opt.Path);
+
+    const CaptureStats &stats = Engine->Stats;
+    std::string detail;
+    bool verified = VerifyCapture(Opt, stats, detail);
+    if (!Opt.Keep) {
+        unlink(Opt.Path.c_str());
+    }
+
+    const char *name = Engine->Name();
+    double rate = producer.Seconds > 0 ? (double)stats.Queued / producer.Seconds : 0;
+    printf("[%s] %.1f MB offered in %.3f s (%.2fx real time), %llu late periods, close %.1f ms\n",
+        name, (double)(stats.Queued + stats.Dropped) / 1e6, producer.Seconds,
+        rate / (double)Opt.BytesPerSecond(), (unsigned long long)producer.Late, closeMs);
+    printf("[%s] dropped %llu bytes in %llu of %llu WriteData calls\n",
+        name, (unsigned long long)stats.Dropped, (unsigned long long)stats.Drops,
+        (unsigned long long)producer.Calls);
+    if (Wait) {
+        printf("[%s] producer waited for room before %llu periods\n",
+            name, (unsigned long long)producer.Waits);
+    }
+    printf("[%s] %llu file writes, %.1f KiB average, %.2f ms max, %.1f MB/s while writing\n",
+        name, (unsigned long long)stats.Writes,
+        stats.Writes ? (double)stats.Written / stats.Writes / 1024.0 : 0.0,
+        (double)stats.MaxWriteNs / 1e6,
+        stats.WriteNs ? (double)stats.Written * 1e3 / (double)stats.WriteNs : 0.0);
+    if (stats.Slots) {
+        printf("[%s] queue high water %u of %u slots of %u KiB, %llu %s header checkpoints\n",
+            name, stats.HighWater, stats.Slots, CAPTURE_SLOT_SIZE / 1024,
+            (unsigned long long)stats.Checkpoints, g_ContainerNames[stats.Container]);
+        printf("[%s] %s backend: %llu file extents reserved, %.1f MB through the bounce buffer\n",
+            name, g_BackendNames[Opt.Backend], (unsigned long long)stats.Reserves, (double)stats.Copied / 1e6);
+    }
+    printf("[%s] cpu %.2f s user, %.2f s system; %.1f of %.1f MB of the file in the page cache\n",
+        name, userEnd - userStart, systemEnd - systemStart, (double)cached / 1e6,
+        (double)(stats.HeaderBytes + stats.Queued) / 1e6);
+
+    std::sort(producer.CallNs.begin(), producer.CallNs.end());
+    printf("[%s] WriteData us: p50 %.1f  p99 %.1f  max %.1f\n",
+        name, Percentile(producer.CallNs, 50), Percentile(producer.CallNs, 99),
+        Percentile(producer.CallNs, 100));
+    printf("[%s] verify: %s%s\n", name, verified ? "" : "FAIL ", detail.c_str());
+
+    if (stats.IoError) {
+        printf("[%s] FAIL file write error\n", name);
+        return false;
+    }
+    return verified;
+}
+
+//=============================================================================
+// Large capture: header probe
+//=============================================================================
+
+struct ProbeStats
+{
+    uint64_t Probes = 0;
+    uint64_t Failures = 0;
+    uint64_t LargeAt = 0;       // file size when ds64 was first seen
+    uint64_t MaxLagBytes = 0;   // most data on disk past the header's count
+    std::string FirstFailure;
+};
+
+//
+// Reads the live file's header like a reader opening the capture midway:
+// it must parse, and never claim data the file does not hold yet (data is
+// written before the checkpoint that counts it). A header read while the
+// writer replaces it may tear, so only a header read the same twice counts.
+//
+static void ProbeHeader(const Options &Opt, std::atomic<bool> &Stop, ProbeStats &Stats)
+{
+    while (!Stop.load()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(LARGE_PROBE_MS));
+
+        int fd = open(Opt.Path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            continue;
+        }
+
+        uint8_t first[WAVE_READ_BYTES], second[WAVE_READ_BYTES];
+        ssize_t got = pread(fd, first, sizeof(first), 0);
+        struct stat st;
+        fstat(fd, &st);
+        bool stable = got > 0 && pread(fd, second, sizeof(second), 0) == got && !memcmp(first, second, (size_t)got);
+        close(fd);
+        if (!stable) {
+            continue;
+        }
+
+        WaveInfo info;
+        std::string detail;
+        Stats.Probes++;
+        if (!ParseWave(first, (size_t)got, info, detail)) {
+            if (!Stats.Failures++) {
+                Stats.FirstFailure = detail;
+            }
+            continue;
+        }
+
+        uint64_t onDisk = (uint64_t)st.st_size;
+        uint64_t claimed = info.DataOffset + info.DataBytes;
+        if (info.Container == Opt.Container && claimed <= onDisk && (!info.Large || info.Frames * info.BlockAlign == info.DataBytes)) {
+            Stats.MaxLagBytes = std::max(Stats.MaxLagBytes, onDisk - claimed);
+        }
+        else if (!Stats.Failures++) {
+            Stats.FirstFailure = "header claims " + std::to_string(claimed) + " bytes of a " +
+                std::to_string(onDisk) + " byte file";
+        }
+        if (info.Large && !Stats.LargeAt) {
+            Stats.LargeAt = onDisk;
+        }
+    }
+}
+
+static bool RunLarge(const Options &Opt)
+{
+    std::atomic<bool> stop(false);
+    ProbeStats probe;
+    std::thread prober(ProbeHeader, std::cref(Opt), std::ref(stop), std::ref(probe));
+
+    QueueCapture engine;
+    bool ok = RunEngine(Opt, &engine, true);
+
+    stop = true;
+    prober.join();
+
+    printf("[large] %llu header probes, %llu bad, at most %.1f MB of data ahead of the header\n",
+        (unsigned long long)probe.Probes, (unsigned long long)probe.Failures,
+        (double)probe.MaxLagBytes / 1e6);
+    if (probe.LargeAt) {
+        printf("[large] header switched to RF64/ds64 by %.2f GB\n", (double)probe.LargeAt / 1e9);
+    }
+    if (probe.Failures) {
+        printf("[large] FAIL header probe: %s\n", probe.FirstFailure.c_str());
+        ok = false;
+    }
+    if (engine.Stats.Dropped) {
+        printf("[large] FAIL dropped data with a waiting producer\n");
+        ok = false;
+    }
+    return ok;
+}
+
+//=============================================================================
+// main
+//=============================================================================
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: cavern_capture_bench [both|queue|legacy|large] [--path P]\n"
+        "       [--container riff|rf64|w64] [--backend buffered|mmap|direct]\n"
+        "       [--channels N] [--rate HZ] [--bits N]\n"
+        "       [--seconds S] [--size B[K|M|G]] [--speed X]\n"
+        "       [--period-ms MS] [--dma-ms MS] [--buffer-ms MS] [--stall-ms MS]\n"
+        "       [--pause-s S] [--keep]\n");
+}
+
+static uint64_t ParseSize(const char *Value)
+{
+    char *end = nullptr;
+    uint64_t size = strtoull(Value, &end, 0);
+
+    switch (end ? *end : 0) {
+    case 'G': case 'g': return size << 30;
+    case 'M': case 'm': return size << 20;
+    case 'K': case 'k': return size << 10;
+    default:            return size;
+    }
+}
+
+static bool ParseArgs(int argc, char **argv, Options &Opt)
+{
+    int i = 1;
+    if (i < argc && argv[i][0] != '-') {
+        Opt.Engine = argv[i++];
+        if (Opt.Engine != "both" && Opt.Engine != "queue" && Opt.Engine != "legacy" && Opt.Engine != "large") {
+            return false;
+        }
+    }
+
+    for (; i < argc; i++) {
+        std::string arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if (arg == "--keep") {
+            Opt.Keep = true;
+            continue;
+        }
+        if (!value) {
+            return false;
+        }
+        i++;
+
+        if (arg == "--path") Opt.Path = value;
+        else if (arg == "--container") {
+            int container = 0;
+            while (container < CavernWaveContainerCount && strcmp(value, g_ContainerNames[container])) {
+                container++;
+            }
+            if (container == CavernWaveContainerCount) {
+                return false;
+            }
+            Opt.Container = (CAVERN_WAVE_CONTAINER)container;
+        }
+        else if (arg == "--size") Opt.Size = ParseSize(value);
+        else if (arg == "--backend") {
+            int backend = 0;
+            while (backend < BackendCount && strcmp(value, g_BackendNames[backend])) {
+                backend++;
+            }
+            if (backend == BackendCount) {
+                return false;
+            }
+            Opt.Backend = (CaptureBackend)backend;
+        }
+        else if (arg == "--channels") Opt.Channels = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--rate") Opt.Rate = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--bits") Opt.Bits = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--seconds") Opt.Seconds = strtod(value, nullptr);
+        else if (arg == "--speed") Opt.Speed = strtod(value, nullptr);
+        else if (arg == "--period-ms") Opt.PeriodMs = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--dma-ms") Opt.DmaMs = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--buffer-ms") Opt.BufferMs = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--stall-ms") Opt.StallMs = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--pause-s") Opt.PauseSeconds = strtod(value, nullptr);
+        else return false;
+    }
+
+    if (!Opt.Channels || Opt.Channels > 32 || !Opt.Rate || !Opt.Bits || (Opt.Bits % 8) ||
+        !Opt.PeriodMs || !Opt.DmaMs || Opt.Seconds <= 0) {
+        return false;
+    }
+
+    // Large mode goes as fast as the disk allows; it needs --size of space
+    if (Opt.Engine == "large") {
+        Opt.Speed = 0;
+        if (!Opt.Size) {
+            Opt.Size = 10ull << 30;
+        }
+    }
+    return Opt.TotalBytes() != 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!ParseArgs(argc, argv, opt)) {
+        Usage();
+        return 2;
+    }
+
+    printf("[cavern_capture_bench] %u ch, %u Hz, %u-bit: %.2f MB/s, %.1f MB at %.2fx, "
+        "period %u ms, stall %u ms/s -> %s (%s, %s)\n",
+        opt.Channels, opt.Rate, opt.Bits, (double)opt.BytesPerSecond() / 1e6,
+        (double)opt.TotalBytes() / 1e6, opt.Speed, opt.PeriodMs, opt.StallMs, opt.Path.c_str(),
+        g_ContainerNames[opt.Container], g_BackendNames[opt.Backend]);
+
+    if (mlockall(MCL_CURRENT | MCL_FUTURE | MCL_ONFAULT) != 0) {
+        printf("[cavern_capture_bench] memory not locked, first use of the buffers faults\n");
+    }
+
+    bool ok = true;
+
+    if (opt.Engine == "large") {
+        ok = RunLarge(opt);
+    }
+    if (opt.Engine == "both" || opt.Engine == "queue") {
+        QueueCapture engine;
+        ok = RunEngine(opt, &engine, false) && ok;
+
+        // A stall the buffer covers must not cost data; at --speed X the
+        // buffer lasts BufferMs / X of wall time
+        if (engine.Stats.Dropped && opt.Speed > 0 &&
+            (opt.StallMs + CAPTURE_WRITER_PERIOD_MS) * opt.Speed < opt.BufferMs) {
+            printf("[queue] FAIL dropped data with a %u ms buffer and %u ms stalls\n",
+                opt.BufferMs, opt.StallMs);
+            ok = false;
+        }
+    }
+    if (opt.Engine == "both" || opt.Engine == "legacy") {
+        LegacyCapture engine;
+        ok = RunEngine(opt, &engine, false) && ok;
+    }
+
+    return ok ? 0 : 1;
+}
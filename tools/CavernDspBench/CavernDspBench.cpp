@@ -0,0 +1,3751 @@
+/***************************************************************************
+ * CavernDspBench.cpp
+ *
+ * Linux benchmark and bit-exactness check for the portable Cavern stream
+ * processing modules in CavernSysvad/. Every SIMD kernel is compared with
+ * its scalar fallback before it is timed; a mismatch fails the run.
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -std=c++17 -msse2 -ICavernSysvad -o cavern_dsp_bench \
+ *       tools/CavernDspBench/CavernDspBench.cpp CavernSysvad/CavernFormatConvert.cpp \
+ *       CavernSysvad/CavernChannelRemap.cpp CavernSysvad/CavernMatrixMixer.cpp \
+ *       CavernSysvad/CavernLevelMeter.cpp CavernSysvad/CavernGainStage.cpp \
+ *       CavernSysvad/CavernResampler.cpp CavernSysvad/CavernSilenceGate.cpp \
+ *       CavernSysvad/CavernRequantizer.cpp CavernSysvad/CavernLoopbackFanout.cpp \
+ *       CavernSysvad/CavernStreamMixer.cpp CavernSysvad/CavernDelayLine.cpp \
+ *       CavernSysvad/CavernBiquadCascade.cpp CavernSysvad/CavernFft.cpp \
+ *       CavernSysvad/CavernConvolver.cpp CavernSysvad/CavernLimiter.cpp \
+ *       CavernSysvad/CavernOscillator.cpp CavernSysvad/CavernTestSignal.cpp \
+ *       CavernSysvad/CavernLatencyAnalyzer.cpp -pthread
+ *
+ * Add -mavx2 -mfma to build the AVX2 paths.
+ *
+ * Usage:
+ *   cavern_dsp_bench [all|convert|remap|mix|meter|gain|src|silence|dither|loopback|streams|delay|eq|conv|limit|tone|latency] [--channels N] [--rate HZ] [--seconds S]
+ *
+ * Default workload is 16 channels at 192 kHz; results are reported as
+ * nanoseconds per sample and as a multiple of real time.
+ ***************************************************************************/
+
+#include <algorithm>
+#include <atomic>
+#include <complex>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <random>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#define NOMINMAX
+#include "CavernFormatConvert.h"
+#include "CavernChannelRemap.h"
+#include "CavernMatrixMixer.h"
+#include "CavernLevelMeter.h"
+#include "CavernGainStage.h"
+#include "CavernResampler.h"
+#include "CavernSilenceGate.h"
+#include "CavernRequantizer.h"
+#include "CavernLoopbackFanout.h"
+#include "CavernStreamMixer.h"
+#include "CavernDelayLine.h"
+#include "CavernBiquadCascade.h"
+#include "CavernConvolver.h"
+#include "CavernLimiter.h"
+#include "CavernOscillator.h"
+#include "CavernTestSignal.h"
+#include "CavernTonePeriod.h"
+#include "CavernLatencyAnalyzer.h"
+
+struct Options
+{
+    std::string Suite = "all";
+    uint32_t    Channels = 16;
+    uint32_t    Rate = 192000;
+    double      Seconds = 1.0;
+
+    size_t BlockSamples() const
+    {
+        // 10 ms of interleaved samples, the driver's typical period
+        return (size_t)Channels * Rate / 100;
+    }
+};
+
+static uint64_t NowNs()
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Runs Body repeatedly for Opt.Seconds and returns ns per call.
+template <typename Body>
+static double TimeIt(const Options &Opt, Body body)
+{
+    uint64_t calls = 0;
+    uint64_t start = NowNs();
+    uint64_t end = start;
+    uint64_t budget = (uint64_t)(Opt.Seconds * 1e9);
+
+    do {
+        for (int i = 0; i < 16; i++) {
+            body();
+        }
+        calls += 16;
+        end = NowNs();
+    } while (end - start < budget);
+
+    return (double)(end - start) / (double)calls;
+}
+
+static void Report(const Options &Opt, const char *Name, double NsPerBlock)
+{
+    double nsPerSample = NsPerBlock / (double)Opt.BlockSamples();
+    double realTime = 10e6 / NsPerBlock;    // a block is 10 ms of audio
+
+    printf("  %-28s %8.3f ns/sample %10.1fx real time\n", Name, nsPerSample, realTime);
+}
+
+static int g_Failures = 0;
+
+static void Check(bool Condition, const char *What)
+{
+    if (!Condition) {
+        printf("  FAIL: %s\n", What);
+        g_Failures++;
+    }
+}
+
+//=============================================================================
+// Format conversion
+//=============================================================================
+
+static const char *g_FormatNames[CavernSampleFormatCount] = {
+    "unknown", "u8", "s16", "s24", "s24in32", "s32", "f32"
+};
+
+// The conversion ToneGenerator::InitNewFrame did per sample before the
+// kernels existed, kept as the baseline.
+static void LegacyFloatToS16(const float *Source, short *Destination, size_t Samples)
+{
+    for (size_t i = 0; i < Samples; i++) {
+        Destination[i] = (short)((double)Source[i] * 32767.0);
+    }
+}
+
+static std::vector<float> TestSignal(size_t Samples)
+{
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-1.2f, 1.2f);
+    std::vector<float> signal(Samples);
+
+    for (size_t i = 0; i < Samples; i++) {
+        signal[i] = dist(rng);
+    }
+
+    // Edges: full scale, just inside, half-LSB ties, NaN and infinities
+    const float edges[] = {
+        1.0f, -1.0f, 0.99999994f, -0.99999994f, 0.0f, -0.0f,
+        0.5f / 32768.0f, 1.5f / 32768.0f, -2.5f / 32768.0f,
+        0.5f / 8388608.0f, 2.5f / 8388608.0f, 0.5f / 128.0f,
+        std::numeric_limits<float>::quiet_NaN(),
+        std::numeric_limits<float>::infinity(),
+        -std::numeric_limits<float>::infinity(), 1e30f, -1e30f
+    };
+    for (size_t i = 0; i < sizeof(edges) / sizeof(edges[0]) && i < Samples; i++) {
+        signal[i * 7 % Samples] = edges[i];
+    }
+    return signal;
+}
+
+static void RunConvert(const Options &Opt)
+{
+    const size_t samples = Opt.BlockSamples();
+    std::vector<float> signal = TestSignal(samples);
+    std::vector<float> floatsA(samples), floatsB(samples);
+    std::vector<uint8_t> bytesA(samples * 4 + 16), bytesB(samples * 4 + 16);
+
+    printf("convert: %u ch x %u Hz, %zu samples per block\n", Opt.Channels, Opt.Rate, samples);
+
+    for (int f = CavernSampleU8; f < CavernSampleFormatCount; f++) {
+        CAVERN_CONVERTER scalar, simd;
+        CavernSelectConverter((CAVERN_SAMPLE_FORMAT)f, FALSE, &scalar);
+        CavernSelectConverter((CAVERN_SAMPLE_FORMAT)f, TRUE, &simd);
+
+        // Bit exactness, over odd lengths so the scalar tails run too
+        for (size_t length : { samples, samples - 1, (size_t)13, (size_t)1 }) {
+            std::fill(bytesA.begin(), bytesA.end(), 0xCD);
+            std::fill(bytesB.begin(), bytesB.end(), 0xCD);
+            scalar.FromFloat(signal.data(), bytesA.data(), length);
+            simd.FromFloat(signal.data(), bytesB.data(), length);
+            Check(bytesA == bytesB, "FromFloat SIMD != scalar");
+
+            scalar.ToFloat(bytesA.data(), floatsA.data(), length);
+            simd.ToFloat(bytesA.data(), floatsB.data(), length);
+            Check(memcmp(floatsA.data(), floatsB.data(), length * sizeof(float)) == 0,
+                  "ToFloat SIMD != scalar");
+        }
+
+        // Integer -> float -> integer must be lossless up to 24 bits
+        if (f != CavernSampleF32 && f != CavernSampleS32) {
+            scalar.FromFloat(signal.data(), bytesA.data(), samples);
+            scalar.ToFloat(bytesA.data(), floatsA.data(), samples);
+            scalar.FromFloat(floatsA.data(), bytesB.data(), samples);
+            Check(memcmp(bytesA.data(), bytesB.data(), samples * scalar.BytesPerSample) == 0,
+                  "integer round trip is not lossless");
+        }
+
+        printf(" %s (%u bytes)%s\n", g_FormatNames[f], scalar.BytesPerSample,
+               simd.Simd ? ", SIMD checked against scalar" : "");
+
+        Report(Opt, "to float, scalar",   TimeIt(Opt, [&]() { scalar.ToFloat(bytesA.data(), floatsA.data(), samples); }));
+        Report(Opt, "to float, simd",     TimeIt(Opt, [&]() { simd.ToFloat(bytesA.data(), floatsA.data(), samples); }));
+        Report(Opt, "from float, scalar", TimeIt(Opt, [&]() { scalar.FromFloat(signal.data(), bytesA.data(), samples); }));
+        Report(Opt, "from float, simd",   TimeIt(Opt, [&]() { simd.FromFloat(signal.data(), bytesA.data(), samples); }));
+    }
+
+    printf(" legacy per-sample double conversion\n");
+    Report(Opt, "from float to s16", TimeIt(Opt, [&]() {
+        LegacyFloatToS16(signal.data(), (short *)bytesA.data(), samples);
+    }));
+}
+
+//=============================================================================
+// Channel remap
+//=============================================================================
+
+// Baseline: copy the frame out, then route each target channel through a
+// per-sample lookup.
+static void ScalarRemap(const CAVERN_REMAP_PLAN &Plan, const uint32_t *Source, uint32_t *Destination, size_t Frames)
+{
+    uint32_t frame[CAVERN_MAX_CHANNELS];
+
+    for (size_t f = 0; f < Frames; f++) {
+        memcpy(frame, Source + f * Plan.SourceChannels, Plan.SourceChannels * sizeof(uint32_t));
+        for (ULONG t = 0; t < Plan.TargetChannels; t++) {
+            LONG s = Plan.Map[t];
+            Destination[f * Plan.TargetChannels + t] = (s >= 0) ? frame[s] : 0;
+        }
+    }
+}
+
+static void RunRemap(const Options &Opt)
+{
+    const size_t frames = Opt.Rate / 100;
+    const ULONG mask5_1Side = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER |
+                              SPEAKER_LOW_FREQUENCY | SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT;
+    const ULONG mask5_1Back = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER |
+                              SPEAKER_LOW_FREQUENCY | SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT;
+    const ULONG mask7_1_4 = mask5_1Back | SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT |
+                            SPEAKER_TOP_FRONT_LEFT | SPEAKER_TOP_FRONT_RIGHT |
+                            SPEAKER_TOP_BACK_LEFT | SPEAKER_TOP_BACK_RIGHT;
+
+    struct Case { const char *Name; ULONG Mask; ULONG Channels; CAVERN_LAYOUT_ID Target; bool Reverse; };
+    const Case cases[] = {
+        { "5.1(back) -> 5.1",          mask5_1Back, 6,  CavernLayout5_1,    false },
+        { "5.1(side) -> 7.1",          mask5_1Side, 6,  CavernLayout7_1,    false },
+        { "7.1.4 -> 16ch",             mask7_1_4,   12, CavernLayoutFull16, false },
+        { "16ch -> 16ch reversed",     0x3F6FF,     16, CavernLayoutFull16, true  },
+        { "7.1.4 -> 7.1.4 (identity)", mask7_1_4,   12, CavernLayout7_1_4,  false },
+    };
+
+    printf("remap: %zu frames per block\n", frames);
+
+    // Mix layout the driver picks for its first stream
+    struct Cover { ULONG Mask; CAVERN_LAYOUT_ID Layout; };
+    const Cover covers[] = {
+        { SPEAKER_FRONT_CENTER,        CavernLayoutStereo },
+        { CavernDefaultChannelMask(2), CavernLayoutStereo },
+        { CavernDefaultChannelMask(4), CavernLayout5_1 },      // backs take the side alias
+        { mask5_1Back,                 CavernLayout5_1 },
+        { mask5_1Side,                 CavernLayout5_1 },
+        { CavernDefaultChannelMask(8), CavernLayout7_1 },
+        { mask7_1_4,                   CavernLayout7_1_4 },
+        { 0x3F6FF,                     CavernLayoutFull16 },
+    };
+    for (const Cover &c : covers) {
+        Check(CavernCoveringLayout(c.Mask) == c.Layout, "wrong covering layout");
+    }
+
+    for (const Case &c : cases) {
+        CAVERN_CHANNEL_LAYOUT source, target;
+        CAVERN_REMAP_PLAN plan;
+
+        CavernLayoutFromMask(c.Mask, c.Channels, &source);
+        CavernGetStandardLayout(c.Target, &target);
+        if (c.Reverse) {
+            for (ULONG i = 0; i < target.Channels / 2; i++) {
+                std::swap(target.Speakers[i], target.Speakers[target.Channels - 1 - i]);
+            }
+        }
+        CavernCompileRemap(&source, &target, &plan);
+
+        std::vector<uint32_t> in(frames * plan.SourceChannels);
+        std::vector<uint32_t> outA(frames * plan.TargetChannels), outB(outA.size());
+        for (size_t i = 0; i < in.size(); i++) {
+            in[i] = (uint32_t)(i * 2654435761u) | 1;
+        }
+
+        ScalarRemap(plan, in.data(), outA.data(), frames);
+        CavernRemap(&plan, in.data(), outB.data(), frames);
+        Check(outA == outB, "remap kernel != scalar reference");
+
+        printf(" %s: %u -> %u ch%s, dropped 0x%X\n", c.Name, plan.SourceChannels, plan.TargetChannels,
+               plan.Identity ? " (copy)" : "", plan.DroppedSources);
+
+        Options frameOpt = Opt;
+        frameOpt.Channels = plan.TargetChannels;
+        Report(frameOpt, "memcpy + scalar lookup", TimeIt(Opt, [&]() { ScalarRemap(plan, in.data(), outA.data(), frames); }));
+        Report(frameOpt, "compiled plan", TimeIt(Opt, [&]() { CavernRemap(&plan, in.data(), outB.data(), frames); }));
+    }
+}
+
+//=============================================================================
+// Matrix mixer
+//=============================================================================
+
+// Double precision reference of the same matrix
+static void ReferenceMix(const CAVERN_MIX_MATRIX &Matrix, const float *Source, double *Destination, size_t Frames)
+{
+    for (size_t f = 0; f < Frames; f++) {
+        for (ULONG o = 0; o < Matrix.OutputChannels; o++) {
+            double sum = 0.0;
+            for (ULONG i = 0; i < Matrix.InputChannels; i++) {
+                sum += (double)Source[f * Matrix.InputChannels + i] * Matrix.Columns[i][o];
+            }
+            Destination[f * Matrix.OutputChannels + o] = sum;
+        }
+    }
+}
+
+static void RunMix(const Options &Opt)
+{
+    const size_t frames = Opt.Rate / 100;
+    const ULONG mask5_1 = SPEAKER_FRONT_LEFT | SPEAKER_FRONT_RIGHT | SPEAKER_FRONT_CENTER |
+                          SPEAKER_LOW_FREQUENCY | SPEAKER_SIDE_LEFT | SPEAKER_SIDE_RIGHT;
+    const ULONG mask7_1_4 = mask5_1 | SPEAKER_BACK_LEFT | SPEAKER_BACK_RIGHT |
+                            SPEAKER_TOP_FRONT_LEFT | SPEAKER_TOP_FRONT_RIGHT |
+                            SPEAKER_TOP_BACK_LEFT | SPEAKER_TOP_BACK_RIGHT;
+    const ULONG maskFull16 = 0x3F6FF;
+
+    struct Case { const char *Name; ULONG Mask; ULONG Channels; CAVERN_LAYOUT_ID Target; CAVERN_LFE_POLICY Lfe; };
+    const Case cases[] = {
+        { "16ch -> 5.1",           maskFull16,  16, CavernLayout5_1,    CavernLfeKeep },
+        { "16ch -> 7.1.4",         maskFull16,  16, CavernLayout7_1_4,  CavernLfeKeep },
+        { "7.1.4 -> 5.1",          mask7_1_4,   12, CavernLayout5_1,    CavernLfeKeep },
+        { "16ch -> stereo (fold)", maskFull16,  16, CavernLayoutStereo, CavernLfeFold },
+        { "stereo -> 5.1",         0x3,         2,  CavernLayout5_1,    CavernLfeKeep },
+        { "5.1 -> stereo (drop)",  mask5_1,     6,  CavernLayoutStereo, CavernLfeDrop },
+    };
+
+    printf("mix: %zu frames per block\n", frames);
+
+    CCavernMatrixMixer mixer;
+
+    for (const Case &c : cases) {
+        if (!NT_SUCCESS(mixer.Configure(c.Mask, c.Channels, c.Target, c.Lfe))) {
+            Check(false, "mixer configuration failed");
+            continue;
+        }
+        const CAVERN_MIX_MATRIX &matrix = *mixer.GetMatrix();
+
+        std::vector<float> in(frames * matrix.InputChannels);
+        std::mt19937 rng(1234);
+        std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+        for (float &sample : in) {
+            sample = dist(rng);
+        }
+        std::vector<float> outScalar(frames * matrix.OutputChannels), outSimd(outScalar.size());
+        std::vector<double> reference(outScalar.size());
+
+        ReferenceMix(matrix, in.data(), reference.data(), frames);
+        mixer.ForceScalar(TRUE);
+        mixer.Process(in.data(), outScalar.data(), frames);
+        mixer.ForceScalar(FALSE);
+        mixer.Process(in.data(), outSimd.data(), frames);
+
+        // FMA rounds once per term, so only closeness to the reference is
+        // checked, not bit equality between the kernels.
+        double worst = 0.0, peak = 0.0;
+        for (size_t s = 0; s < reference.size(); s++) {
+            worst = std::max(worst, std::fabs(outScalar[s] - reference[s]));
+            worst = std::max(worst, std::fabs(outSimd[s] - reference[s]));
+        }
+        for (ULONG o = 0; o < matrix.OutputChannels; o++) {
+            double row = 0.0;
+            for (ULONG i = 0; i < matrix.InputChannels; i++) {
+                row += matrix.Columns[i][o];
+            }
+            peak = std::max(peak, row);
+        }
+        Check(worst < 1e-5, "mix kernel differs from double reference");
+        Check(peak <= 1.0 + 1e-6, "mix matrix can exceed full scale");
+
+        printf(" %s: %u -> %u ch, max error %.2e, max row gain %.3f\n", c.Name,
+               matrix.InputChannels, matrix.OutputChannels, worst, peak);
+
+        Options frameOpt = Opt;
+        frameOpt.Channels = matrix.InputChannels;
+        mixer.ForceScalar(TRUE);
+        Report(frameOpt, "scalar", TimeIt(Opt, [&]() { mixer.Process(in.data(), outScalar.data(), frames); }));
+        mixer.ForceScalar(FALSE);
+        Report(frameOpt, "specialized", TimeIt(Opt, [&]() { mixer.Process(in.data(), outSimd.data(), frames); }));
+    }
+
+    // Reconfiguring to a cached key must not rebuild the matrix
+    ULONG misses = mixer.GetCacheMisses();
+    mixer.Configure(maskFull16, 16, CavernLayout5_1, CavernLfeKeep);
+    mixer.Configure(mask5_1, 6, CavernLayoutStereo, CavernLfeDrop);
+    Check(mixer.GetCacheMisses() == misses, "matrix cache missed on a known key");
+}
+
+//=============================================================================
+// Level meter
+//=============================================================================
+
+// Feeds Bytes through Meter in chunks of the given sizes (cycled) and
+// returns the levels of the first completed window.
+static CAVERN_LEVELS MeterInChunks(CCavernLevelMeter &Meter, const std::vector<uint8_t> &Bytes,
+                                   const size_t *Chunks, size_t ChunkCount)
+{
+    CAVERN_LEVELS levels = {};
+    size_t offset = 0;
+
+    Meter.Reset();
+    for (size_t k = 0; offset < Bytes.size(); k++) {
+        size_t length = std::min(Chunks[k % ChunkCount], Bytes.size() - offset);
+        if (Meter.Measure(Bytes.data() + offset, length)) {
+            levels = *Meter.GetLevels();
+            break;
+        }
+        offset += length;
+    }
+    return levels;
+}
+
+static void RunMeter(const Options &Opt)
+{
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * Opt.Channels;
+    const CAVERN_SAMPLE_FORMAT formats[] = {
+        CavernSampleU8, CavernSampleS16, CavernSampleS24Packed, CavernSampleS24In32,
+        CavernSampleS32, CavernSampleF32,
+    };
+
+    printf("meter: %u channels, %zu frames per block\n", Opt.Channels, frames);
+
+    // Per-channel amplitude steps so every lane must land on its own channel
+    std::vector<float> signal(samples);
+    for (size_t i = 0; i < samples; i++) {
+        float amplitude = (float)((i % Opt.Channels) + 1) / (float)(Opt.Channels + 1);
+        signal[i] = amplitude * (float)sin((double)(i / Opt.Channels) * 0.05);
+    }
+
+    for (CAVERN_SAMPLE_FORMAT format : formats) {
+        CAVERN_CONVERTER converter;
+        CCavernLevelMeter scalar, simd, ragged;
+
+        CavernSelectConverter(format, FALSE, &converter);
+        std::vector<uint8_t> bytes(samples * converter.BytesPerSample);
+        converter.FromFloat(signal.data(), bytes.data(), samples);
+
+        // The ragged meter drops the samples its chunks split, so it gets a
+        // half-block window that completes before the data runs out.
+        if (!NT_SUCCESS(scalar.Init(format, Opt.Channels, (ULONG)frames, FALSE)) ||
+            !NT_SUCCESS(simd.Init(format, Opt.Channels, (ULONG)frames, TRUE)) ||
+            !NT_SUCCESS(ragged.Init(format, Opt.Channels, (ULONG)frames / 2, TRUE))) {
+            Check(false, "meter init failed");
+            continue;
+        }
+
+        const size_t whole[] = { bytes.size() };
+        const size_t chunks[] = { 1, 7, 4093, 33, 2, 65536 + 3 };
+        CAVERN_LEVELS reference = MeterInChunks(scalar, bytes, whole, 1);
+        CAVERN_LEVELS vectored = MeterInChunks(simd, bytes, whole, 1);
+        CAVERN_LEVELS split = MeterInChunks(ragged, bytes, chunks, sizeof(chunks) / sizeof(chunks[0]));
+
+        // Peaks are exact; squared sums only differ by float vs double
+        // accumulation order. Every channel must see its own amplitude
+        // (within a step of u8 quantization) whatever the chunking.
+        double tolerance = (format == CavernSampleU8) ? 1.5 / 128.0 : 1e-3;
+        double peakError = 0.0, rmsError = 0.0, channelError = 0.0;
+        for (ULONG c = 0; c < Opt.Channels; c++) {
+            double amplitude = (double)(c + 1) / (double)(Opt.Channels + 1);
+            peakError = std::max(peakError, (double)std::fabs(vectored.Peak[c] - reference.Peak[c]));
+            rmsError = std::max(rmsError, std::fabs(vectored.Rms[c] - reference.Rms[c]) / amplitude);
+            channelError = std::max(channelError, std::fabs(reference.Peak[c] - amplitude));
+            channelError = std::max(channelError, std::fabs(split.Peak[c] - amplitude));
+        }
+        Check(peakError == 0.0, "meter peak differs from scalar reference");
+        Check(rmsError < 1e-5, "meter RMS differs from scalar reference");
+        Check(channelError < tolerance, "meter levels landed on the wrong channel");
+
+        printf(" %-8s peak(ch0)=%.4f rms(ch0)=%.4f rms error %.1e\n", g_FormatNames[format],
+               reference.Peak[0], reference.Rms[0], rmsError);
+
+        std::vector<uint8_t> copy(bytes.size());
+        double memcpyNs = TimeIt(Opt, [&]() { memcpy(copy.data(), bytes.data(), bytes.size()); });
+        double scalarNs = TimeIt(Opt, [&]() { scalar.Measure(bytes.data(), bytes.size()); });
+        double simdNs = TimeIt(Opt, [&]() { simd.Measure(bytes.data(), bytes.size()); });
+
+        Report(Opt, "memcpy of the block", memcpyNs);
+        Report(Opt, "scalar meter", scalarNs);
+        Report(Opt, "simd meter", simdNs);
+        printf("  %-28s %8.0f%% of memcpy\n", "simd meter cost", 100.0 * simdNs / memcpyNs);
+    }
+}
+
+//=============================================================================
+// Gain stage
+//=============================================================================
+
+// Runs a full-scale DC signal through Stage in ragged chunks and returns
+// the output.
+static std::vector<float> GainInChunks(CCavernGainStage &Stage, uint32_t Channels, size_t Frames)
+{
+    const size_t chunks[] = { 1, 3, 64, 5, 511, 2, 1000 };
+    std::vector<float> samples(Frames * Channels, 1.0f);
+    size_t frame = 0;
+
+    for (size_t k = 0; frame < Frames; k++) {
+        size_t count = std::min(chunks[k % (sizeof(chunks) / sizeof(chunks[0]))], Frames - frame);
+        Stage.ProcessFloat(samples.data() + frame * Channels, count);
+        frame += count;
+    }
+    return samples;
+}
+
+static void RunGain(const Options &Opt)
+{
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * Opt.Channels;
+    const ULONG rampMs = 5;
+    const size_t rampFrames = std::max<size_t>(Opt.Rate / 1000 * rampMs, 1);
+
+    printf("gain: %u channels, %zu frames per block, %zu frame ramp\n", Opt.Channels, frames, rampFrames);
+
+    // At 0 dB with nothing pending the stage must not touch the data.
+    {
+        CCavernGainStage stage;
+        CAVERN_CONVERTER converter;
+
+        CavernSelectConverter(CavernSampleS24Packed, FALSE, &converter);
+        std::vector<float> signal = TestSignal(samples);
+        std::vector<uint8_t> bytes(samples * converter.BytesPerSample);
+        converter.FromFloat(signal.data(), bytes.data(), samples);
+        std::vector<uint8_t> original = bytes;
+
+        Check(NT_SUCCESS(stage.Init(CavernSampleS24Packed, Opt.Channels, Opt.Rate, rampMs, CAVERN_DEFAULT_DITHER, TRUE)),
+              "gain init failed");
+        stage.Process(bytes.data(), frames);
+        Check(bytes == original, "unity gain changed the data");
+    }
+
+    // Ramps: every channel heads somewhere else (mute on channel 0), the
+    // SIMD and scalar paths must agree, no frame-to-frame change may exceed
+    // one ramp step, and each channel must settle exactly on its target.
+    CCavernGainStage scalar, simd;
+    if (!NT_SUCCESS(scalar.Init(CavernSampleF32, Opt.Channels, Opt.Rate, rampMs, CavernDitherNone, FALSE)) ||
+        !NT_SUCCESS(simd.Init(CavernSampleF32, Opt.Channels, Opt.Rate, rampMs, CavernDitherNone, TRUE))) {
+        Check(false, "gain init failed");
+        return;
+    }
+
+    for (ULONG c = 0; c < Opt.Channels; c++) {
+        LONG level = -(LONG)(c * 3 + 1) * 0x10000;
+        scalar.SetTarget(c, level, c == 0);
+        simd.SetTarget(c, level, c == 0);
+    }
+
+    std::vector<float> reference = GainInChunks(scalar, Opt.Channels, rampFrames * 3);
+    std::vector<float> vectored = GainInChunks(simd, Opt.Channels, rampFrames * 3);
+
+    double pathError = 0.0, worstJump = 0.0, settleError = 0.0;
+    for (ULONG c = 0; c < Opt.Channels; c++) {
+        double target = (c == 0) ? 0.0 : pow(10.0, -(double)(c * 3 + 1) / 20.0);
+        double step = (1.0 - target) / (double)rampFrames;
+        double previous = 1.0;
+
+        for (size_t f = 0; f < rampFrames * 3; f++) {
+            double value = vectored[f * Opt.Channels + c];
+            pathError = std::max(pathError, std::fabs(value - reference[f * Opt.Channels + c]));
+            worstJump = std::max(worstJump, std::fabs(value - previous) / step);
+            previous = value;
+        }
+        settleError = std::max(settleError, std::fabs(previous - target));
+    }
+    Check(pathError == 0.0, "simd gain differs from scalar");
+    Check(worstJump < 1.01, "gain stepped by more than one ramp increment");
+    Check(settleError < 1e-6, "gain did not settle on its target");
+
+    printf("  simd vs scalar %.1e, largest step %.3f of a ramp increment, settle error %.1e\n",
+           pathError, worstJump, settleError);
+
+    // Timing: a steady -6 dB, and a block that is ramping the whole time
+    std::vector<float> block(samples, 0.25f);
+    std::vector<float> copy(samples);
+    auto steady = [&](CCavernGainStage &Stage) {
+        for (ULONG c = 0; c < Opt.Channels; c++) {
+            Stage.SetTarget(c, -6 * 0x10000, FALSE);
+        }
+        GainInChunks(Stage, Opt.Channels, rampFrames);
+    };
+    steady(scalar);
+    steady(simd);
+
+    // Each pass scales a fresh copy; scaling one block over and over would
+    // run it down into denormals and time those instead.
+    double memcpyNs = TimeIt(Opt, [&]() { memcpy(copy.data(), block.data(), samples * sizeof(float)); });
+    double scalarNs = TimeIt(Opt, [&]() {
+        memcpy(copy.data(), block.data(), samples * sizeof(float));
+        scalar.ProcessFloat(copy.data(), frames);
+    });
+    double simdNs = TimeIt(Opt, [&]() {
+        memcpy(copy.data(), block.data(), samples * sizeof(float));
+        simd.ProcessFloat(copy.data(), frames);
+    });
+
+    LONG flip = 0;
+    double rampNs = TimeIt(Opt, [&]() {
+        flip ^= 0x10000;
+        for (ULONG c = 0; c < Opt.Channels; c++) {
+            simd.SetTarget(c, -6 * 0x10000 - flip, FALSE);
+        }
+        memcpy(copy.data(), block.data(), samples * sizeof(float));
+        simd.ProcessFloat(copy.data(), frames);
+    });
+
+    Report(Opt, "memcpy of the block", memcpyNs);
+    Report(Opt, "memcpy + scalar steady gain", scalarNs);
+    Report(Opt, "memcpy + simd steady gain", simdNs);
+    Report(Opt, "memcpy + simd, new target", rampNs);
+}
+
+//=============================================================================
+// Sample-rate conversion
+//=============================================================================
+
+// Pushes Input through Stage in ragged chunks, with the output capacity
+// limited too, then drains the filter with silence. Float takes the
+// ProcessFloat path the driver mixes from.
+static std::vector<float> Resample(CCavernResampler &Stage, const std::vector<float> &Input, uint32_t Channels,
+                                   bool Float = false)
+{
+    const size_t chunks[] = { 1, 480, 7, 1024, 33, 4096 };
+    const size_t inputFrames = Input.size() / Channels;
+    std::vector<float> output;
+    std::vector<float> block(4096 * Channels);
+    size_t frame = 0;
+
+    size_t silence = Stage.GetLatencyFrames();
+
+    // Keep calling until a call stops short of its output capacity; only
+    // then has everything the input allows been produced.
+    for (size_t k = 0; ; k++) {
+        size_t capacity = chunks[(k + 3) % (sizeof(chunks) / sizeof(chunks[0]))];
+        size_t used = 0, produced = 0;
+
+        if (frame < inputFrames) {
+            size_t count = std::min(chunks[k % (sizeof(chunks) / sizeof(chunks[0]))], inputFrames - frame);
+            if (Float) {
+                Stage.ProcessFloat(Input.data() + frame * Channels, count, block.data(), capacity, &used, &produced);
+            } else {
+                Stage.Process(Input.data() + frame * Channels, count, block.data(), capacity, &used, &produced);
+            }
+            frame += used;
+        } else {
+            if (Float) {
+                Stage.ProcessFloat(nullptr, silence, block.data(), capacity, &used, &produced);
+            } else {
+                Stage.Process(nullptr, silence, block.data(), capacity, &used, &produced);
+            }
+            silence -= used;
+        }
+        output.insert(output.end(), block.begin(), block.begin() + produced * Channels);
+
+        if (frame == inputFrames && !silence && produced < capacity) {
+            break;
+        }
+    }
+    return output;
+}
+
+// Fits A sin + B cos at the tone frequency over the settled part of one
+// channel and returns the residual relative to the fitted tone, in dB.
+static double ThdPlusNoise(const std::vector<float> &Output, uint32_t Channels, double Frequency,
+                           double Rate, size_t Skip, size_t Frames)
+{
+    double ss = 0, sc = 0, cc = 0, xs = 0, xc = 0;
+    for (size_t k = Skip; k < Skip + Frames; k++) {
+        double w = 2.0 * M_PI * Frequency * (double)k / Rate;
+        double x = Output[k * Channels];
+        ss += sin(w) * sin(w);
+        sc += sin(w) * cos(w);
+        cc += cos(w) * cos(w);
+        xs += x * sin(w);
+        xc += x * cos(w);
+    }
+
+    double det = ss * cc - sc * sc;
+    double a = (xs * cc - xc * sc) / det;
+    double b = (xc * ss - xs * sc) / det;
+    double signal = 0, residual = 0;
+    for (size_t k = Skip; k < Skip + Frames; k++) {
+        double w = 2.0 * M_PI * Frequency * (double)k / Rate;
+        double fit = a * sin(w) + b * cos(w);
+        double error = Output[k * Channels] - fit;
+        signal += fit * fit;
+        residual += error * error;
+    }
+    return 10.0 * log10(residual / signal);
+}
+
+static void RunSrc(const Options &Opt)
+{
+    struct Ratio { uint32_t In, Out; bool Variable; LONG DriftPpb; };
+    const Ratio ratios[] = {
+        { 44100, 48000, false, 0 }, { 8000, 48000, false, 0 }, { 22050, 48000, false, 0 },
+        { 32000, 48000, false, 0 }, { 88200, 48000, false, 0 }, { 96000, 48000, false, 0 },
+        { 176400, 48000, false, 0 }, { 192000, 48000, false, 0 }, { 44100, 192000, false, 0 },
+        { 44100, 48000, true, 0 }, { 48000, 48000, true, 250000 }, { 192000, 48000, true, -100000 },
+    };
+    const double tones[] = { 1000.0, 9000.0, 17000.0 };
+    const double limitDb = -90.0;
+    const uint32_t channels = Opt.Channels;
+
+    printf("src: %u channels, THD+N limit %.0f dB\n", channels, limitDb);
+
+    for (const Ratio &r : ratios) {
+        CCavernResampler scalar, simd;
+        if (!NT_SUCCESS(scalar.Init(CavernSampleF32, channels, r.In, r.Out, r.Variable, CavernDitherNone, FALSE)) ||
+            !NT_SUCCESS(simd.Init(CavernSampleF32, channels, r.In, r.Out, r.Variable, CavernDitherNone, TRUE))) {
+            Check(false, "resampler init failed");
+            continue;
+        }
+        if (r.DriftPpb) {
+            scalar.SetDrift(r.DriftPpb);
+            simd.SetDrift(r.DriftPpb);
+        }
+
+        // Half a second of each tone at -1 dBFS on every channel; the drift
+        // cases are measured against the rate they actually produce.
+        const size_t inputFrames = r.In / 2;
+        const double outRate = (double)r.Out / (1.0 + (double)r.DriftPpb * 1e-9);
+        double worst = -200.0, pathError = 0.0;
+        size_t lengthError = 0;
+        bool floatMatches = true;
+
+        for (double tone : tones) {
+            // Only tones both rates can carry
+            if (tone >= 0.45 * std::min(r.In, r.Out)) {
+                continue;
+            }
+
+            std::vector<float> input(inputFrames * channels);
+            for (size_t f = 0; f < inputFrames; f++) {
+                float value = (float)(0.891 * sin(2.0 * M_PI * tone * (double)f / (double)r.In));
+                for (uint32_t c = 0; c < channels; c++) {
+                    input[f * channels + c] = value;
+                }
+            }
+
+            scalar.Reset();
+            simd.Reset();
+            std::vector<float> reference = Resample(scalar, input, channels);
+            std::vector<float> vectored = Resample(simd, input, channels);
+            simd.Reset();
+            std::vector<float> direct = Resample(simd, input, channels, true);
+            floatMatches = floatMatches && direct == vectored;
+
+            size_t expected = (size_t)((double)inputFrames * outRate / (double)r.In);
+            size_t frames = vectored.size() / channels;
+            lengthError = std::max(lengthError, frames > expected ? frames - expected : expected - frames);
+
+            for (size_t i = 0; i < std::min(reference.size(), vectored.size()); i++) {
+                pathError = std::max(pathError, (double)std::fabs(reference[i] - vectored[i]));
+            }
+
+            // Skip the filter's start-up and the tail drained with silence
+            size_t skip = scalar.GetTaps() * 2;
+            size_t settled = std::min(frames, expected) - 2 * skip;
+            double db = ThdPlusNoise(vectored, channels, tone, outRate, skip, settled);
+            worst = std::max(worst, db);
+        }
+
+        char name[64];
+        snprintf(name, sizeof(name), "%u->%u%s", r.In, r.Out, r.Variable ? " var" : "");
+        printf(" %-20s %4u taps %4u phases  THD+N %7.1f dB  simd error %.1e\n",
+               name, simd.GetTaps(), simd.GetPhases(), worst, pathError);
+
+        Check(worst < limitDb, "resampler THD+N above limit");
+        Check(pathError < 1e-5, "simd resampler differs from scalar");
+        Check(lengthError <= 2, "resampler produced the wrong number of frames");
+        Check(floatMatches, "ProcessFloat differs from Process");
+    }
+
+    // Timing: 10 ms of 16-bit input per call, steady state
+    for (const Ratio &r : { ratios[0], ratios[7] }) {
+        Options timing = Opt;
+        timing.Rate = r.In;
+
+        CCavernResampler stage;
+        stage.Init(CavernSampleS16, channels, r.In, r.Out, FALSE, CAVERN_DEFAULT_DITHER, TRUE);
+
+        const size_t inputFrames = r.In / 100;
+        std::vector<short> input(inputFrames * channels, 1000);
+        std::vector<short> output((inputFrames * r.Out / r.In + 8) * channels);
+
+        char name[64];
+        snprintf(name, sizeof(name), "s16 %u->%u", r.In, r.Out);
+        double ns = TimeIt(timing, [&]() {
+            size_t offset = 0;
+            while (offset < inputFrames) {
+                size_t used = 0, produced = 0;
+                stage.Process(input.data() + offset * channels, inputFrames - offset,
+                              output.data(), output.size() / channels, &used, &produced);
+                offset += used;
+            }
+        });
+        Report(timing, name, ns);
+
+        // The driver's path: s16 in, float out for the mixer, no dither
+        CCavernResampler direct;
+        direct.Init(CavernSampleS16, channels, r.In, r.Out, FALSE, CavernDitherNone, TRUE);
+        std::vector<float> floats(output.size());
+
+        snprintf(name, sizeof(name), "s16 %u->%u float", r.In, r.Out);
+        ns = TimeIt(timing, [&]() {
+            size_t offset = 0;
+            while (offset < inputFrames) {
+                size_t used = 0, produced = 0;
+                direct.ProcessFloat(input.data() + offset * channels, inputFrames - offset,
+                                    floats.data(), floats.size() / channels, &used, &produced);
+                offset += used;
+            }
+        });
+        Report(timing, name, ns);
+    }
+}
+
+//=============================================================================
+// Silence gate
+//=============================================================================
+
+// What the gate handed to the pipe, one entry per sink call
+struct GateWrite
+{
+    size_t                  Push;       // index of the Push that sent it
+    CAVERN_PIPE_PACKET_TYPE Type;
+    std::vector<uint8_t>    Bytes;
+};
+
+struct GateCapture
+{
+    size_t                  Push = 0;
+    std::vector<GateWrite>  Writes;
+};
+
+static NTSTATUS CaptureSink(PVOID Context, const BYTE *Buffer, ULONG Length)
+{
+    GateCapture *capture = (GateCapture *)Context;
+    capture->Writes.push_back({ capture->Push, CavernPipePacketAudio, std::vector<uint8_t>(Buffer, Buffer + Length) });
+    return STATUS_SUCCESS;
+}
+
+static NTSTATUS CaptureMarkerSink(PVOID Context, const BYTE *Buffer, ULONG Length)
+{
+    GateCapture *capture = (GateCapture *)Context;
+    capture->Writes.push_back({ capture->Push, CavernPipePacketSilence, std::vector<uint8_t>(Buffer, Buffer + Length) });
+    return STATUS_SUCCESS;
+}
+
+// The bytes the driver queues for the pipe: a packet per sink call.
+static std::vector<uint8_t> FramePackets(const GateCapture &Capture)
+{
+    std::vector<uint8_t> stream;
+
+    for (const GateWrite &write : Capture.Writes) {
+        CAVERN_PIPE_PACKET packet;
+        CavernInitPipePacket(&packet, write.Type, (ULONG)write.Bytes.size());
+        stream.insert(stream.end(), (const uint8_t *)&packet, (const uint8_t *)&packet + sizeof(packet));
+        stream.insert(stream.end(), write.Bytes.begin(), write.Bytes.end());
+    }
+
+    return stream;
+}
+
+// Rebuilds the stream the pipe server would write to its capture file,
+// reading from Start as a server that connected there would. Skipped
+// counts the bytes dropped while looking for a packet boundary.
+static std::vector<uint8_t> ExpandPackets(const std::vector<uint8_t> &Stream, size_t Start,
+                                          size_t *Markers, size_t *Skipped)
+{
+    std::vector<uint8_t> output;
+    bool synced = false;
+    size_t pos = Start;
+    *Markers = 0;
+    *Skipped = 0;
+
+    while (pos + sizeof(CAVERN_PIPE_PACKET) <= Stream.size()) {
+        CAVERN_PIPE_PACKET packet;
+        memcpy(&packet, Stream.data() + pos, sizeof(packet));
+
+        bool valid = CavernIsPipePacket(&packet) && pos + sizeof(packet) + packet.Length <= Stream.size();
+        CAVERN_SILENCE_MARKER marker = {};
+        if (valid && packet.Type == CavernPipePacketSilence) {
+            valid = packet.Length == sizeof(marker);
+            if (valid) {
+                memcpy(&marker, Stream.data() + pos + sizeof(packet), sizeof(marker));
+                valid = marker.FrameBytes && (uint64_t)marker.Frames * marker.FrameBytes <= CAVERN_PIPE_PACKET_MAX_LENGTH;
+            }
+        }
+
+        if (!valid) {
+            // Out of step: look for the next header one byte on
+            synced = false;
+            (*Skipped)++;
+            pos++;
+            continue;
+        }
+
+        synced = true;
+        const uint8_t *payload = Stream.data() + pos + sizeof(packet);
+        if (packet.Type == CavernPipePacketSilence) {
+            output.insert(output.end(), (size_t)marker.Frames * marker.FrameBytes, marker.Fill);
+            (*Markers)++;
+        } else {
+            output.insert(output.end(), payload, payload + packet.Length);
+        }
+        pos += sizeof(packet) + packet.Length;
+    }
+
+    if (!synced || pos != Stream.size()) {
+        *Skipped += Stream.size() - pos;
+    }
+
+    return output;
+}
+
+static void RunSilence(const Options &Opt)
+{
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * Opt.Channels;
+    const ULONG thresholdLsb16 = 512;
+    const CAVERN_SAMPLE_FORMAT formats[] = {
+        CavernSampleU8, CavernSampleS16, CavernSampleS24Packed, CavernSampleS24In32,
+        CavernSampleS32, CavernSampleF32,
+    };
+
+    printf("silence: %u channels, %zu frames per block\n", Opt.Channels, frames);
+
+    for (CAVERN_SAMPLE_FORMAT format : formats) {
+        CAVERN_CONVERTER converter;
+        CCavernSilenceGate scalar, simd, exact;
+        GateCapture unused;
+
+        CavernSelectConverter(format, FALSE, &converter);
+        if (!NT_SUCCESS(scalar.Init(format, Opt.Channels, Opt.Rate, thresholdLsb16, FALSE,
+                                    CaptureSink, CaptureMarkerSink, &unused)) ||
+            !NT_SUCCESS(simd.Init(format, Opt.Channels, Opt.Rate, thresholdLsb16, TRUE,
+                                  CaptureSink, CaptureMarkerSink, &unused)) ||
+            !NT_SUCCESS(exact.Init(format, Opt.Channels, Opt.Rate, 0, TRUE,
+                                   CaptureSink, CaptureMarkerSink, &unused))) {
+            Check(false, "silence gate init failed");
+            continue;
+        }
+
+        const ULONG bytesPerSample = converter.BytesPerSample;
+        std::vector<float> quiet(samples, 0.0f);
+        std::vector<uint8_t> bytes(samples * bytesPerSample);
+        converter.FromFloat(quiet.data(), bytes.data(), samples);
+        const std::vector<uint8_t> zeros = bytes;
+
+        Check(scalar.IsQuiet(bytes.data(), bytes.size()) && simd.IsQuiet(bytes.data(), bytes.size()) &&
+              exact.IsQuiet(bytes.data(), bytes.size()), "digital zero not detected as silence");
+
+        // One sample at the threshold stays quiet, one a step of 8-bit
+        // resolution above it is loud; tried at every position of the
+        // vector loop and the scalar tail, with both signs.
+        const float atThreshold = (float)thresholdLsb16 / 32768.0f;
+        const float aboveThreshold = (float)(thresholdLsb16 + 256) / 32768.0f;
+        const size_t positions[] = { 0, 1, 15, 16, 17, 63, 64, samples / 2, samples - 17, samples - 2, samples - 1 };
+        bool agree = true, thresholdOk = true, exactOk = true;
+
+        for (size_t position : positions) {
+            for (float sign : { 1.0f, -1.0f }) {
+                const float values[] = { sign * atThreshold, sign * aboveThreshold };
+                for (int loud = 0; loud < 2; loud++) {
+                    bytes = zeros;
+                    converter.FromFloat(&values[loud], bytes.data() + position * bytesPerSample, 1);
+
+                    BOOLEAN a = scalar.IsQuiet(bytes.data(), bytes.size());
+                    BOOLEAN b = simd.IsQuiet(bytes.data(), bytes.size());
+                    agree = agree && (a == b);
+                    thresholdOk = thresholdOk && (a == (loud ? FALSE : TRUE));
+                    exactOk = exactOk && !exact.IsQuiet(bytes.data(), bytes.size());
+                }
+            }
+        }
+        Check(agree, "simd silence detection differs from scalar");
+        Check(thresholdOk, "silence threshold misplaced");
+        Check(exactOk, "zero threshold let a non-zero sample through");
+
+        if (format == CavernSampleF32) {
+            // -0.0 is silence; the smallest denormal and NaN are not
+            const uint32_t patterns[] = { 0x80000000u, 0x00000001u, 0x7FC00000u };
+            for (int i = 0; i < 3; i++) {
+                bytes = zeros;
+                memcpy(bytes.data() + (samples - 1) * 4, &patterns[i], 4);
+                Check(exact.IsQuiet(bytes.data(), bytes.size()) == (i == 0), "float zero test wrong for -0, denormal or NaN");
+            }
+        }
+
+        printf(" %-8s threshold %u LSB16 ok\n", g_FormatNames[format], thresholdLsb16);
+
+        std::vector<uint8_t> copy(zeros.size());
+        double memcpyNs = TimeIt(Opt, [&]() { memcpy(copy.data(), zeros.data(), zeros.size()); });
+        double scalarNs = TimeIt(Opt, [&]() { scalar.IsQuiet(zeros.data(), zeros.size()); });
+        double simdNs = TimeIt(Opt, [&]() { simd.IsQuiet(zeros.data(), zeros.size()); });
+
+        Report(Opt, "memcpy of the block", memcpyNs);
+        Report(Opt, "scalar scan (all quiet)", scalarNs);
+        Report(Opt, "simd scan (all quiet)", simdNs);
+        printf("  %-28s %8.0f%% of memcpy\n", "simd scan cost", 100.0 * simdNs / memcpyNs);
+    }
+
+    // Gate state machine on 10 ms chunks: 100 ms of signal, a second of
+    // digital zero, then signal again, framed into packets as the driver
+    // queues them. The signal carries a well-formed silence packet, which
+    // must reach the capture as audio.
+    {
+        CCavernSilenceGate gate;
+        GateCapture capture;
+        CAVERN_CONVERTER converter;
+
+        CavernSelectConverter(CavernSampleS16, FALSE, &converter);
+        gate.Init(CavernSampleS16, Opt.Channels, Opt.Rate, 0, TRUE, CaptureSink, CaptureMarkerSink, &capture);
+
+        std::vector<float> signal = TestSignal(samples);
+        std::vector<uint8_t> loud(samples * 2), quiet(samples * 2, 0);
+        converter.FromFloat(signal.data(), loud.data(), samples);
+
+        const size_t forgedAt = 64;
+        CAVERN_PIPE_PACKET forged;
+        CAVERN_SILENCE_MARKER forgedMarker = { 1000, 4, 0, 0 };
+        CavernInitPipePacket(&forged, CavernPipePacketSilence, sizeof(forgedMarker));
+        memcpy(loud.data() + forgedAt, &forged, sizeof(forged));
+        memcpy(loud.data() + forgedAt + sizeof(forged), &forgedMarker, sizeof(forgedMarker));
+
+        std::vector<uint8_t> input;
+        size_t resumePush = 0;
+        for (size_t chunk = 0; chunk < 112; chunk++) {
+            const std::vector<uint8_t> &block = (chunk < 10 || chunk >= 110) ? loud : quiet;
+            if (chunk == 110) {
+                resumePush = capture.Push;
+            }
+            gate.Push(block.data(), (ULONG)block.size());
+            input.insert(input.end(), block.begin(), block.end());
+            capture.Push++;
+        }
+        gate.Flush();
+
+        const std::vector<uint8_t> framed = FramePackets(capture);
+        size_t markers = 0, skipped = 0;
+        std::vector<uint8_t> stream = ExpandPackets(framed, 0, &markers, &skipped);
+
+        // The loud chunk after the idle stretch must leave in its own Push
+        bool resumed = false;
+        for (const GateWrite &write : capture.Writes) {
+            if (write.Push == resumePush && write.Bytes == loud) {
+                resumed = true;
+            }
+        }
+
+        Check(stream == input && skipped == 0, "silence packets do not expand back to the input");
+
+        // A server connecting in the middle of the first packet, past the
+        // forged header, drops the rest of it and picks up at the next
+        const size_t cut = sizeof(CAVERN_PIPE_PACKET) + 2 * forgedAt;
+        size_t lateMarkers = 0, lateSkipped = 0;
+        std::vector<uint8_t> late = ExpandPackets(framed, cut, &lateMarkers, &lateSkipped);
+        Check(late.size() == input.size() - loud.size() &&
+              std::equal(late.begin(), late.end(), input.begin() + loud.size()) &&
+              lateSkipped == sizeof(CAVERN_PIPE_PACKET) + loud.size() - cut,
+              "receiver did not resynchronize at the next packet");
+        Check(gate.GetIdleCount() == 1, "gate should go idle exactly once");
+        Check(resumed, "signal after idle was not forwarded in the same push");
+        Check(gate.GetSuppressedFrames() == (size_t)Opt.Rate * (1000 - CAVERN_SILENCE_HOLD_MS) / 1000,
+              "gate idled after the wrong hold time");
+
+        printf(" gate: %zu markers, %zu of %zu bytes sent with framing (%.1f%%)\n", markers, framed.size(),
+               input.size(), 100.0 * (double)framed.size() / (double)input.size());
+    }
+
+    // A single push of more silence than a packet may stand for is split
+    // into markers a receiver will expand
+    {
+        CCavernSilenceGate gate;
+        GateCapture capture;
+        const ULONG frameBytes = 2 * 2;
+        const size_t holdBytes = (size_t)Opt.Rate / 1000 * CAVERN_SILENCE_HOLD_MS * frameBytes;
+        std::vector<uint8_t> quiet(holdBytes + CAVERN_PIPE_PACKET_MAX_LENGTH + 1000 * frameBytes, 0);
+
+        gate.Init(CavernSampleS16, 2, Opt.Rate, 0, TRUE, CaptureSink, CaptureMarkerSink, &capture);
+        gate.Push(quiet.data(), (ULONG)holdBytes);
+        gate.Push(quiet.data() + holdBytes, (ULONG)(quiet.size() - holdBytes));
+
+        size_t markers = 0, skipped = 0;
+        std::vector<uint8_t> stream = ExpandPackets(FramePackets(capture), 0, &markers, &skipped);
+        Check(stream.size() == quiet.size() && skipped == 0 && markers == 2,
+              "oversized silence not split into markers within the packet limit");
+    }
+}
+
+//=============================================================================
+// Dithered requantization
+//=============================================================================
+
+static const char *g_DitherNames[CavernDitherModeCount] = { "round", "tpdf", "highpass", "weighted" };
+
+// In-place radix-2 FFT; Data.size() must be a power of two.
+static void Fft(std::vector<std::complex<double>> &Data)
+{
+    const size_t n = Data.size();
+
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            std::swap(Data[i], Data[j]);
+        }
+    }
+
+    for (size_t length = 2; length <= n; length <<= 1) {
+        std::complex<double> step = std::polar(1.0, -2.0 * M_PI / (double)length);
+        for (size_t i = 0; i < n; i += length) {
+            std::complex<double> w = 1.0;
+            for (size_t k = 0; k < length / 2; k++) {
+                std::complex<double> a = Data[i + k];
+                std::complex<double> b = Data[i + k + length / 2] * w;
+                Data[i + k] = a + b;
+                Data[i + k + length / 2] = a - b;
+                w *= step;
+            }
+        }
+    }
+}
+
+// Welch power spectrum of Signal: Hann-windowed segments of Size samples,
+// averaged, scaled so the bins sum to the mean square of the signal.
+static std::vector<double> PowerSpectrum(const std::vector<double> &Signal, size_t Size)
+{
+    std::vector<double> window(Size), power(Size / 2 + 1, 0.0);
+    double windowPower = 0.0;
+    for (size_t i = 0; i < Size; i++) {
+        window[i] = 0.5 - 0.5 * cos(2.0 * M_PI * (double)i / (double)Size);
+        windowPower += window[i] * window[i];
+    }
+
+    size_t segments = 0;
+    std::vector<std::complex<double>> data(Size);
+    for (size_t start = 0; start + Size <= Signal.size(); start += Size, segments++) {
+        for (size_t i = 0; i < Size; i++) {
+            data[i] = Signal[start + i] * window[i];
+        }
+        Fft(data);
+        for (size_t k = 0; k <= Size / 2; k++) {
+            power[k] += std::norm(data[k]) * ((k == 0 || k == Size / 2) ? 1.0 : 2.0);
+        }
+    }
+
+    for (double &bin : power) {
+        bin /= (double)segments * windowPower * (double)Size;
+    }
+    return power;
+}
+
+// Mean bin power between two frequencies
+static double BandPower(const std::vector<double> &Power, double Rate, double Low, double High)
+{
+    const double binWidth = Rate / (double)((Power.size() - 1) * 2);
+    double sum = 0.0;
+    size_t bins = 0;
+
+    for (size_t k = (size_t)ceil(Low / binWidth); k < Power.size() && (double)k * binWidth < High; k++) {
+        sum += Power[k];
+        bins++;
+    }
+    return bins ? sum / (double)bins : 0.0;
+}
+
+static double Db(double Power)
+{
+    return 10.0 * log10(Power);
+}
+
+// Requantizes a mono float signal to s16 and returns the output minus the
+// input, in LSB.
+static std::vector<double> RequantizationError(CAVERN_DITHER_MODE Mode, const std::vector<float> &Input)
+{
+    CCavernRequantizer requantizer;
+    std::vector<int16_t> output(Input.size());
+    std::vector<double> error(Input.size());
+
+    requantizer.Init(CavernSampleS16, 1, Mode, TRUE);
+    requantizer.Process(Input.data(), output.data(), Input.size());
+
+    for (size_t i = 0; i < Input.size(); i++) {
+        error[i] = (double)output[i] - (double)Input[i] * 32768.0;
+    }
+    return error;
+}
+
+static void RunDither(const Options &Opt)
+{
+    const CAVERN_SAMPLE_FORMAT formats[] = {
+        CavernSampleU8, CavernSampleS16, CavernSampleS24Packed, CavernSampleS24In32,
+    };
+
+    printf("dither: %u channels, %u Hz\n", Opt.Channels, Opt.Rate);
+
+    // SIMD against scalar, bit for bit, over ragged chunks and channel
+    // counts that leave a partial vector; round mode against FromFloat.
+    {
+        const uint32_t channelCounts[] = { 1, 2, 3, 6, Opt.Channels };
+        const size_t frames = 4801;
+        bool exact = true, roundOk = true, silenceOk = true;
+
+        for (uint32_t channels : channelCounts) {
+            std::vector<float> signal = TestSignal(frames * channels);
+            for (size_t i = 0; i < signal.size(); i += 3) {
+                signal[i] *= 1e-4f;     // low-level samples, where dither matters
+            }
+
+            for (CAVERN_SAMPLE_FORMAT format : formats) {
+                CAVERN_CONVERTER converter;
+                CavernSelectConverter(format, FALSE, &converter);
+                const size_t bytes = signal.size() * converter.BytesPerSample;
+
+                for (int mode = 0; mode < CavernDitherModeCount; mode++) {
+                    CCavernRequantizer scalar, simd;
+                    std::vector<uint8_t> a(bytes), b(bytes), plain(bytes);
+
+                    scalar.Init(format, channels, (CAVERN_DITHER_MODE)mode, FALSE);
+                    simd.Init(format, channels, (CAVERN_DITHER_MODE)mode, TRUE);
+
+                    const size_t chunks[] = { 1, 63, 64, 65, 1000, 7 };
+                    for (size_t done = 0, c = 0; done < frames; c++) {
+                        size_t count = std::min(chunks[c % 6], frames - done);
+                        scalar.Process(signal.data() + done * channels, a.data() + done * channels * converter.BytesPerSample, count);
+                        simd.Process(signal.data() + done * channels, b.data() + done * channels * converter.BytesPerSample, count);
+                        done += count;
+                    }
+                    exact = exact && (a == b);
+
+                    if (mode == CavernDitherNone) {
+                        converter.FromFloat(signal.data(), plain.data(), signal.size());
+                        roundOk = roundOk && (a == plain);
+                    }
+
+                    std::vector<float> zeros(signal.size(), 0.0f);
+                    std::vector<float> back(signal.size(), 1.0f);
+                    simd.Process(zeros.data(), b.data(), frames);
+                    converter.ToFloat(b.data(), back.data(), back.size());
+                    silenceOk = silenceOk && std::all_of(back.begin(), back.end(), [](float v) { return v == 0.0f; });
+                }
+            }
+        }
+
+        Check(exact, "simd requantization differs from scalar");
+        Check(roundOk, "round mode differs from FromFloat");
+        Check(silenceOk, "digital silence picked up dither");
+        printf(" simd/scalar bit-exact, round == FromFloat, silence kept\n");
+    }
+
+    // Spectral checks on s16 at 48 kHz, 2^20 samples averaged over 4096-point
+    // segments (bins of 11.7 Hz).
+    {
+        const double rate = 48000.0;
+        const size_t size = 4096;
+        const size_t length = size * 256;
+        const double tone = 86.0 * rate / (double)size;     // 1007.8 Hz, on a bin
+        std::vector<float> sine(length);
+        for (size_t i = 0; i < length; i++) {
+            sine[i] = (float)(3.3 / 32768.0 * sin(2.0 * M_PI * tone * (double)i / rate));
+        }
+
+        // Harmonics of a 3.3 LSB sine, relative to the median noise bin
+        double spur[CavernDitherModeCount];
+        std::vector<double> spectra[CavernDitherModeCount];
+        for (int mode = 0; mode < CavernDitherModeCount; mode++) {
+            spectra[mode] = PowerSpectrum(RequantizationError((CAVERN_DITHER_MODE)mode, sine), size);
+            std::vector<double> sorted(spectra[mode].begin() + 1, spectra[mode].end());
+            std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+            double median = sorted[sorted.size() / 2];
+            double peak = 0.0;
+            for (size_t h = 2; h <= 9; h++) {
+                size_t bin = 86 * h;
+                for (size_t k = bin - 2; k <= bin + 2; k++) {
+                    peak = std::max(peak, spectra[mode][k]);
+                }
+            }
+            spur[mode] = Db(peak / median);
+        }
+
+        const double tpdfLow = BandPower(spectra[CavernDitherTpdf], rate, 100.0, 2000.0);
+        const double tpdfHigh = BandPower(spectra[CavernDitherTpdf], rate, 16000.0, 20000.0);
+        const double highpassLow = BandPower(spectra[CavernDitherHighpass], rate, 100.0, 2000.0);
+        const double weightedLow = BandPower(spectra[CavernDitherWeighted], rate, 100.0, 2000.0);
+        const double weightedHigh = BandPower(spectra[CavernDitherWeighted], rate, 16000.0, 20000.0);
+
+        printf(" harmonic spurs above median floor: round %.1f dB, tpdf %.1f dB, highpass %.1f dB, weighted %.1f dB\n",
+               spur[CavernDitherNone], spur[CavernDitherTpdf], spur[CavernDitherHighpass], spur[CavernDitherWeighted]);
+        printf(" noise 0.1-2 kHz vs tpdf: highpass %.1f dB, weighted %.1f dB; 16-20 kHz: tpdf %+.1f dB, weighted %+.1f dB\n",
+               Db(highpassLow / tpdfLow), Db(weightedLow / tpdfLow), Db(tpdfHigh / tpdfLow), Db(weightedHigh / tpdfLow));
+
+        Check(spur[CavernDitherNone] > 20.0, "undithered rounding should show harmonics");
+        Check(spur[CavernDitherTpdf] < 6.0 && spur[CavernDitherHighpass] < 6.0 && spur[CavernDitherWeighted] < 6.0,
+              "dithered output shows harmonic distortion");
+        Check(fabs(Db(tpdfHigh / tpdfLow)) < 1.0, "tpdf noise is not flat");
+        Check(Db(highpassLow / tpdfLow) < -15.0, "first-order shaping did not lower the low band");
+        Check(Db(weightedLow / tpdfLow) < -8.0, "weighted shaping did not lower the low band");
+        Check(Db(weightedHigh / tpdfLow) > 6.0, "weighted shaping did not move noise up");
+
+        // TPDF makes the error power independent of the signal: 1/4 LSB^2
+        // (1/6 dither + 1/12 rounding) wherever a DC input sits between
+        // two codes. Rounding alone swings from 0 to 1/4.
+        double worst = 0.0;
+        for (double offset : { 0.0, 0.125, 0.25, 0.5, 0.75 }) {
+            std::vector<float> dc(1 << 18, (float)((100.0 + offset) / 32768.0));
+            std::vector<double> error = RequantizationError(CavernDitherTpdf, dc);
+            double mean = 0.0, power = 0.0;
+            for (double e : error) {
+                mean += e;
+                power += e * e;
+            }
+            mean /= (double)error.size();
+            power = power / (double)error.size() - mean * mean;
+            worst = std::max(worst, std::max(fabs(power / 0.25 - 1.0), fabs(mean) * 10.0));
+        }
+        printf(" tpdf error power at 5 dc offsets: within %.1f%% of 1/4 LSB^2\n", 100.0 * worst);
+        Check(worst < 0.03, "tpdf error power or mean depends on the signal");
+
+        // Channels must get independent dither
+        {
+            CCavernRequantizer requantizer;
+            const size_t frames = 1 << 18;
+            std::vector<float> stereo(frames * 2, (float)(0.3 / 32768.0));
+            std::vector<int16_t> output(frames * 2);
+            requantizer.Init(CavernSampleS16, 2, CavernDitherTpdf, TRUE);
+            requantizer.Process(stereo.data(), output.data(), frames);
+
+            double sum01 = 0.0, sum00 = 0.0, sum11 = 0.0;
+            for (size_t f = 0; f < frames; f++) {
+                double e0 = output[f * 2] - 0.3, e1 = output[f * 2 + 1] - 0.3;
+                sum01 += e0 * e1;
+                sum00 += e0 * e0;
+                sum11 += e1 * e1;
+            }
+            double correlation = sum01 / sqrt(sum00 * sum11);
+            printf(" channel 0/1 error correlation %.4f\n", correlation);
+            Check(fabs(correlation) < 0.02, "channels share dither");
+        }
+    }
+
+    // Cost at the workload size, against the plain conversion
+    {
+        const size_t frames = Opt.Rate / 100;
+        const size_t samples = frames * Opt.Channels;
+        std::vector<float> signal = TestSignal(samples);
+        std::vector<uint8_t> output(samples * 2);
+        CAVERN_CONVERTER converter;
+        CavernSelectConverter(CavernSampleS16, TRUE, &converter);
+
+        Report(Opt, "s16 FromFloat (simd)", TimeIt(Opt, [&]() { converter.FromFloat(signal.data(), output.data(), samples); }));
+
+        for (int mode = CavernDitherTpdf; mode < CavernDitherModeCount; mode++) {
+            for (BOOLEAN simd : { FALSE, TRUE }) {
+                CCavernRequantizer requantizer;
+                requantizer.Init(CavernSampleS16, Opt.Channels, (CAVERN_DITHER_MODE)mode, simd);
+                std::string name = std::string(simd ? "simd " : "scalar ") + g_DitherNames[mode] + " -> s16";
+                Report(Opt, name.c_str(), TimeIt(Opt, [&]() { requantizer.Process(signal.data(), output.data(), frames); }));
+            }
+        }
+    }
+}
+
+//=============================================================================
+// Loopback fan-out
+//=============================================================================
+
+// Render data for the fan-out: the 32-bit word at byte position p holds
+// p / 4 in four 7-bit digits, each byte offset by one, so no byte of real
+// data is zero and any whole word a reader gets says where it came from.
+static void FillPositions(uint8_t *Buffer, uint64_t Position, size_t Length)
+{
+    for (size_t i = 0; i < Length; i++) {
+        uint64_t p = Position + i;
+        Buffer[i] = (uint8_t)(1 + (((p / 4) >> (7 * (p % 4))) & 0x7F));
+    }
+}
+
+// Follows what one reader wrote into its capture buffer, word by word.
+// Whole words must sit on the reader's frame phase and follow each other;
+// a jump is only allowed across silence or where the reader counted a
+// loss. Words mixing data and zeros are where silence cut a frame.
+struct LoopbackTrace
+{
+    uint64_t    Linear = 0;
+    uint8_t     Word[4] = {};
+    bool        HavePrevious = false;
+    uint64_t    Previous = 0;
+    bool        GapSincePrevious = false;
+    uint64_t    Words = 0;
+    uint64_t    Jumps = 0;
+    uint64_t    Partial = 0;
+    uint64_t    Errors = 0;
+
+    void Feed(const uint8_t *Output, size_t Length, ULONG BlockAlign, bool Lost)
+    {
+        for (size_t i = 0; i < Length; i++) {
+            Word[Linear % 4] = Output[i];
+            Linear++;
+            if (Linear % 4) {
+                continue;
+            }
+
+            int zeros = (Word[0] == 0) + (Word[1] == 0) + (Word[2] == 0) + (Word[3] == 0);
+            if (zeros) {
+                Partial += (zeros < 4);
+                GapSincePrevious = true;
+                continue;
+            }
+
+            uint64_t index = 0;
+            for (int j = 3; j >= 0; j--) {
+                index = (index << 7) | (uint64_t)((Word[j] - 1) & 0x7F);
+            }
+            if ((index * 4) % BlockAlign != (Linear - 4) % BlockAlign) {
+                Errors++;
+            }
+            if (HavePrevious && index != ((Previous + 1) & 0xFFFFFFF)) {
+                if (GapSincePrevious || Lost) {
+                    Jumps++;
+                }
+                else {
+                    Errors++;
+                }
+            }
+            HavePrevious = true;
+            Previous = index;
+            GapSincePrevious = false;
+            Words++;
+        }
+    }
+};
+
+// A stream timer: ticks every 9 to 11 ms and moves as many bytes as the
+// SysVAD DPC would for the time elapsed, remainder carried.
+struct LoopbackClock
+{
+    uint32_t    Next = 0;
+    uint32_t    Last = 0;
+    uint64_t    Carry = 0;
+    uint64_t    Linear = 0;
+
+    ULONG Advance(uint32_t Now, ULONG BytesPerSecond, std::mt19937 &Random)
+    {
+        uint64_t total = (uint64_t)BytesPerSecond * (Now - Last) + Carry;
+        Last = Now;
+        Next = Now + 9 + (uint32_t)(Random() % 3);
+        Carry = total % 1000;
+        return (ULONG)(total / 1000);
+    }
+};
+
+static void RunLoopback(const Options &Opt)
+{
+    const ULONG blockAlign = Opt.Channels * 4;
+    const ULONG bytesPerSecond = blockAlign * Opt.Rate;
+    const ULONG capacity = bytesPerSecond / 1000 * CAVERN_LOOPBACK_RING_MS;
+
+    printf("loopback: %u channels, 32-bit, %.1f ms lead, %u ms ring\n", Opt.Channels,
+           (double)CAVERN_LOOPBACK_LEAD_MS, CAVERN_LOOPBACK_RING_MS);
+
+    // Simulated 1 ms steps: the render stream publishes from the start,
+    // pauses at 2200 ms for 100 ms; reader A keeps up, reader B's DPC is
+    // held off for 700 ms, reader C attaches at 1500 ms.
+    {
+        CCavernLoopbackFanout fanout;
+        CAVERN_LOOPBACK_READER readers[3];
+        LoopbackTrace traces[3];
+        LoopbackClock render, clocks[3];
+        std::mt19937 random(39);
+        std::vector<uint8_t> span, output;
+        bool attached[3] = { false, false, false };
+        bool dataAfterPause = false, silentWhilePaused = true;
+
+        if (!NT_SUCCESS(fanout.Init(capacity)) ||
+            !NT_SUCCESS(fanout.Start(blockAlign, bytesPerSecond, 0))) {
+            Check(false, "fan-out init failed");
+            return;
+        }
+
+        // No reader yet: the render side only moves its position
+        span.resize(blockAlign * 10 + 3);
+        FillPositions(span.data(), 0, span.size());
+        fanout.Publish(span.data(), (ULONG)span.size());
+        render.Linear = span.size();
+        Check(fanout.GetPublishedBytes() == 0, "fan-out copied data with no reader attached");
+
+        fanout.AttachReader(&readers[0]);
+        fanout.AttachReader(&readers[1]);
+        attached[0] = attached[1] = true;
+
+        for (uint32_t now = 1; now <= 3000; now++) {
+            if (now == 1500) {
+                fanout.AttachReader(&readers[2]);
+                attached[2] = true;
+                clocks[2].Next = clocks[2].Last = now;
+            }
+            if (now == 2200) {
+                fanout.Stop();
+            }
+            if (now == 2300) {
+                fanout.Start(blockAlign, bytesPerSecond, render.Linear);
+                render.Last = now;
+            }
+
+            bool paused = now >= 2200 && now < 2300;
+            if (!paused && now >= render.Next) {
+                ULONG bytes = render.Advance(now, bytesPerSecond, random);
+                span.resize(bytes);
+                FillPositions(span.data(), render.Linear, bytes);
+                fanout.Publish(span.data(), bytes);
+                render.Linear += bytes;
+            }
+
+            for (int r = 0; r < 3; r++) {
+                bool stalled = (r == 1) && now >= 1000 && now < 1700;
+                if (!attached[r] || stalled || now < clocks[r].Next) {
+                    continue;
+                }
+
+                ULONG bytes = clocks[r].Advance(now, bytesPerSecond, random);
+                ULONGLONG lost = readers[r].LostBytes;
+
+                output.resize(bytes);
+                ULONG got = fanout.Read(&readers[r], blockAlign, clocks[r].Linear, output.data(), bytes);
+                traces[r].Feed(output.data(), bytes, blockAlign, readers[r].LostBytes != lost);
+                clocks[r].Linear += bytes;
+
+                if (r == 0 && now >= 2210 && now < 2300) {
+                    silentWhilePaused = silentWhilePaused && got == 0;
+                }
+                if (r == 0 && now >= 2400 && got) {
+                    dataAfterPause = true;
+                }
+            }
+        }
+
+        const char *names[3] = { "A (keeps up)", "B (stalled)", "C (late)" };
+        for (int r = 0; r < 3; r++) {
+            printf(" reader %-13s read %9llu lost %9llu silence %9llu bytes, %u laps, %llu jumps\n",
+                   names[r], (unsigned long long)readers[r].ReadBytes,
+                   (unsigned long long)readers[r].LostBytes, (unsigned long long)readers[r].SilenceBytes,
+                   readers[r].Laps, (unsigned long long)traces[r].Jumps);
+            Check(traces[r].Errors == 0, "loopback reader got data out of place or out of order");
+            Check(traces[r].Words > 0, "loopback reader got no data");
+        }
+
+        Check(readers[0].Laps == 0 && readers[0].LostBytes < 2 * blockAlign,
+              "reader that keeps up lost data");
+        Check(readers[1].Laps >= 1 && readers[1].LostBytes >= (ULONGLONG)bytesPerSecond / 10,
+              "stalled reader was not overrun");
+        Check(silentWhilePaused, "loopback carried data while the render stream was paused");
+        Check(dataAfterPause, "loopback did not resume after the render stream did");
+
+        for (int r = 0; r < 3; r++) {
+            fanout.DetachReader(&readers[r]);
+        }
+        Check(fanout.GetReaderCount() == 0, "reader count not back to zero");
+    }
+
+    // Threads: the render thread publishes 10 ms spans as fast as it can
+    // while two readers poll and one sleeps between reads. No reader may
+    // keep data from a span that was overwritten while it copied; the
+    // writer never waits, it only shares memory bandwidth with them.
+    {
+        const size_t spanBytes = (size_t)bytesPerSecond / 100;
+        CCavernLoopbackFanout fanout;
+        std::vector<uint8_t> from(spanBytes, 1), to(spanBytes);
+
+        fanout.Init(capacity);
+        Report(Opt, "memcpy of the span", TimeIt(Opt, [&]() { memcpy(to.data(), from.data(), spanBytes); }));
+
+        for (int readerCount : { 1, 3 }) {
+            CAVERN_LOOPBACK_READER readers[3];
+            LoopbackTrace traces[3];
+            volatile bool done = false;
+            std::vector<std::thread> threads;
+
+            for (int r = 0; r < readerCount; r++) {
+                fanout.AttachReader(&readers[r]);
+            }
+
+            for (int r = 0; r < readerCount; r++) {
+                threads.emplace_back([&, r]() {
+                    std::vector<uint8_t> output(spanBytes);
+                    uint64_t linear = 0;
+                    while (!done) {
+                        ULONGLONG lost = readers[r].LostBytes;
+                        fanout.Read(&readers[r], blockAlign, linear, output.data(), (ULONG)spanBytes);
+                        traces[r].Feed(output.data(), spanBytes, blockAlign, readers[r].LostBytes != lost);
+                        linear += spanBytes;
+                        if (r == 2) {
+                            std::this_thread::sleep_for(std::chrono::microseconds(200));
+                        }
+                    }
+                });
+            }
+
+            std::vector<uint8_t> span(spanBytes);
+            uint64_t publishNs = 0;
+            fanout.Start(blockAlign, bytesPerSecond, 0);
+            uint64_t spans = 0;
+            uint64_t end = NowNs() + (uint64_t)(Opt.Seconds * 1e9);
+            for (; NowNs() < end; spans++) {
+                FillPositions(span.data(), spans * spanBytes, spanBytes);
+                uint64_t start = NowNs();
+                fanout.Publish(span.data(), (ULONG)spanBytes);
+                publishNs += NowNs() - start;
+            }
+            double ns = (double)publishNs / (double)spans;
+            done = true;
+            for (std::thread &thread : threads) {
+                thread.join();
+            }
+
+            uint64_t laps = 0, errors = 0, words = 0;
+            for (int r = 0; r < readerCount; r++) {
+                laps += readers[r].Laps;
+                errors += traces[r].Errors;
+                words += traces[r].Words;
+                fanout.DetachReader(&readers[r]);
+            }
+
+            char name[64];
+            snprintf(name, sizeof(name), "publish, %d reader thread%s", readerCount, readerCount > 1 ? "s" : "");
+            Report(Opt, name, ns);
+            printf("  %-28s %llu words checked, %llu laps\n", "", (unsigned long long)words,
+                   (unsigned long long)laps);
+            Check(errors == 0, "threaded loopback reader saw a torn span");
+        }
+    }
+}
+
+//=============================================================================
+// Stream mixer
+//=============================================================================
+
+// Mix rate of the driver (CAVERN_NETWORK_SAMPLE_RATE) and its mix timer
+// period
+static const uint32_t g_MixRate = 48000;
+static const size_t g_MixTickFrames = g_MixRate / 1000;
+
+// Samples on the 16-bit grid, at most a quarter of full scale, so sums of
+// up to four streams at unity gain are exact in float.
+static std::vector<float> GridSignal(size_t Samples, uint32_t Seed)
+{
+    std::mt19937 rng(Seed);
+    std::uniform_int_distribution<int> dist(-8192, 8192);
+    std::vector<float> signal(Samples);
+
+    for (size_t i = 0; i < Samples; i++) {
+        signal[i] = (float)dist(rng) / 32768.0f;
+    }
+    return signal;
+}
+
+// One mix tick: every fed stream writes a tick of its signal, then the
+// mixer produces a tick. Streams with a null signal are left unfed.
+struct MixerFeed
+{
+    LONG                        Slot = -1;
+    const std::vector<float>   *Signal = nullptr;
+    size_t                      Position = 0;
+    uint32_t                    Channels = 0;
+    CCavernChannelRouter        Route;          // to the mix layout, as the driver does
+};
+
+// Routes a feed to the mix layout as the driver does: a feed with the mix
+// channel count is in the layout, others carry the default mask for their
+// count
+static void RouteFeed(MixerFeed &Feed, CAVERN_LAYOUT_ID Layout, uint32_t MixChannels)
+{
+    ULONG mask = (Feed.Channels == MixChannels) ? CavernLayoutMask(Layout) : CavernDefaultChannelMask(Feed.Channels);
+
+    Feed.Route.Configure(mask, Feed.Channels, Layout, CavernLfeKeep);
+}
+
+static void MixTick(CCavernStreamMixer &Mixer, std::vector<MixerFeed> &Feeds, size_t Frames, float *Output)
+{
+    std::vector<float> routed(Frames * Mixer.GetChannels());
+
+    for (MixerFeed &feed : Feeds) {
+        if (feed.Slot < 0 || !feed.Signal) {
+            continue;
+        }
+        size_t total = feed.Signal->size() / feed.Channels;
+        size_t frames = std::min(Frames, total - feed.Position % total);
+        const float *source = feed.Signal->data() + (feed.Position % total) * feed.Channels;
+        if (feed.Channels != Mixer.GetChannels()) {
+            feed.Route.Process(source, routed.data(), frames);
+            source = routed.data();
+        }
+        Mixer.Write(feed.Slot, source, frames);
+        feed.Position += frames;
+    }
+    Mixer.Mix(Output, Frames);
+}
+
+static void RunStreams(const Options &Opt)
+{
+    // The mix runs on the layout the driver picks for a first stream of
+    // Opt.Channels channels
+    const CAVERN_LAYOUT_ID layout =
+        CavernCoveringLayout(CavernDefaultChannelMask(std::min(Opt.Channels, (uint32_t)CAVERN_MAX_CHANNELS)));
+    CAVERN_CHANNEL_LAYOUT speakers;
+    CavernGetStandardLayout(layout, &speakers);
+    const uint32_t channels = speakers.Channels;
+    const size_t lead = g_MixRate * CAVERN_MIXER_LEAD_MS / 1000;
+
+    printf("streams: %u channels at %u Hz, %zu-frame ticks, %zu-frame lead, up to %d streams\n",
+           channels, g_MixRate, g_MixTickFrames, lead, CAVERN_MIXER_MAX_STREAMS);
+
+    // Every rate the render pin offers gets a ring of at least four leads
+    for (ULONG rate : { 8000u, 44100u, 48000u, 96000u, 176400u, 192000u }) {
+        CCavernStreamMixer mixer;
+        bool ok = NT_SUCCESS(mixer.Init(2, rate, TRUE));
+        ULONG ring = mixer.GetRingFrames();
+
+        Check(ok && ring >= CAVERN_MIXER_MIN_RING_FRAMES && !(ring & (ring - 1)) &&
+              ring >= 4 * mixer.GetLeadFrames(), "mixer ring not sized for the rate");
+        if (rate == 192000) {
+            printf("  %u Hz: %u-frame ring for a %u-frame lead\n", rate, ring, mixer.GetLeadFrames());
+        }
+    }
+
+    // SIMD against scalar: five streams, mixed channel counts, ragged ticks
+    // across the ring wrap, a gain ramp and a mute in the middle
+    {
+        CCavernStreamMixer scalar, simd;
+        std::vector<float> signals[5];
+        std::vector<MixerFeed> feedsA(5), feedsB(5);
+        const uint32_t feedChannels[5] = { channels, channels, 2, 1, 6 };
+        std::mt19937 random(40);
+
+        if (!NT_SUCCESS(scalar.Init(channels, g_MixRate, FALSE)) ||
+            !NT_SUCCESS(simd.Init(channels, g_MixRate, TRUE))) {
+            Check(false, "mixer init failed");
+            return;
+        }
+
+        for (int s = 0; s < 5; s++) {
+            signals[s] = TestSignal((size_t)feedChannels[s] * 3001);
+            for (float &x : signals[s]) {
+                if (!std::isfinite(x) || fabsf(x) > 2.0f) {
+                    x = 0.5f;
+                }
+            }
+            LONG level = -s * 3 * 65536 - 0x1234;
+            feedsA[s].Slot = scalar.Open(level, FALSE);
+            feedsB[s].Slot = simd.Open(level, FALSE);
+            feedsA[s].Signal = feedsB[s].Signal = &signals[s];
+            feedsA[s].Channels = feedsB[s].Channels = feedChannels[s];
+            RouteFeed(feedsA[s], layout, channels);
+            RouteFeed(feedsB[s], layout, channels);
+        }
+
+        std::vector<float> outA(256 * channels), outB(256 * channels);
+        bool same = true;
+        for (int tick = 0; tick < 400; tick++) {
+            size_t frames = 1 + random() % 97;
+            if (tick == 100) {
+                scalar.SetGain(feedsA[1].Slot, -20 * 65536, FALSE);
+                simd.SetGain(feedsB[1].Slot, -20 * 65536, FALSE);
+            }
+            if (tick == 200) {
+                scalar.SetGain(feedsA[2].Slot, 0, TRUE);
+                simd.SetGain(feedsB[2].Slot, 0, TRUE);
+            }
+            MixTick(scalar, feedsA, frames, outA.data());
+            MixTick(simd, feedsB, frames, outB.data());
+            same = same && memcmp(outA.data(), outB.data(), frames * channels * sizeof(float)) == 0;
+        }
+        Check(same, "stream mix SIMD != scalar");
+        printf("  5 streams (%u/%u/2/1/6 ch), ramps and mute: SIMD checked against scalar\n",
+               channels, channels);
+    }
+
+    // Routing: a 5.1 stream in a stereo mix goes through the matrix, so its
+    // surrounds are folded into the fronts instead of being dropped
+    {
+        CCavernStreamMixer mixer;
+        std::vector<float> surround(g_MixTickFrames * 6 * 40, 0.0f);
+        std::vector<MixerFeed> feeds(1);
+        std::vector<float> out(g_MixTickFrames * 2);
+        double left = 0.0, right = 0.0;
+
+        for (size_t f = 0; f < surround.size() / 6; f++) {
+            surround[f * 6 + 4] = 0.25f;        // back left only
+        }
+        mixer.Init(2, g_MixRate, TRUE);
+        feeds[0].Slot = mixer.Open(0, FALSE);
+        feeds[0].Signal = &surround;
+        feeds[0].Channels = 6;
+        RouteFeed(feeds[0], CavernLayoutStereo, 2);
+
+        for (int tick = 0; tick < 20; tick++) {
+            MixTick(mixer, feeds, g_MixTickFrames, out.data());
+            for (size_t f = 0; f < g_MixTickFrames; f++) {
+                left += fabs(out[f * 2]);
+                right += fabs(out[f * 2 + 1]);
+            }
+        }
+        Check(feeds[0].Route.UsesMatrix(), "5.1 in a stereo mix not routed through the matrix");
+        Check(left > 0.0 && right == 0.0, "back left did not fold into front left alone");
+        printf("  5.1 in a stereo mix: back left folded into front left by the matrix\n");
+    }
+
+    // Isolation: A and B play throughout; C opens at tick 50, B is not fed
+    // for 20 ticks from 150, C closes at 250. Each stream is modelled on
+    // its own (wait for the lead, play what is queued, drop out when dry)
+    // and the output must be exactly the sum of the models: nobody's
+    // timing or level moves because of the others.
+    {
+        struct StreamModel
+        {
+            size_t  Queued = 0;
+            size_t  Read = 0;
+            bool    Primed = false;
+        };
+
+        CCavernStreamMixer mixer;
+        const size_t ticks = 400;
+        std::vector<float> signals[3] = {
+            GridSignal(g_MixTickFrames * ticks * channels, 1),
+            GridSignal(g_MixTickFrames * ticks * channels, 2),
+            GridSignal(g_MixTickFrames * ticks * channels, 3)
+        };
+        std::vector<MixerFeed> feeds(3);
+        StreamModel models[3];
+        std::vector<float> out(g_MixTickFrames * channels);
+        bool exact = true;
+        size_t heard[3] = { 0, 0, 0 };
+        ULONG underruns = 0;
+
+        mixer.Init(channels, g_MixRate, TRUE);
+        for (int s = 0; s < 3; s++) {
+            feeds[s].Signal = &signals[s];
+            feeds[s].Channels = channels;
+        }
+        feeds[0].Slot = mixer.Open(0, FALSE);
+        feeds[1].Slot = mixer.Open(0, FALSE);
+
+        for (size_t tick = 0; tick < ticks; tick++) {
+            if (tick == 50) {
+                feeds[2].Slot = mixer.Open(0, FALSE);
+            }
+            if (tick == 250) {
+                CAVERN_MIXER_STATS stats;
+                mixer.GetStats(feeds[1].Slot, &stats);
+                underruns = stats.Underruns;
+                mixer.Close(feeds[2].Slot);
+                feeds[2].Slot = -1;
+            }
+
+            const std::vector<float> *signalB = feeds[1].Signal;
+            if (tick >= 150 && tick < 170) {
+                feeds[1].Signal = nullptr;
+            }
+
+            size_t before[3];
+            for (int s = 0; s < 3; s++) {
+                before[s] = feeds[s].Position;
+            }
+            MixTick(mixer, feeds, g_MixTickFrames, out.data());
+            feeds[1].Signal = signalB;
+
+            std::vector<float> expected(out.size(), 0.0f);
+            for (int s = 0; s < 3; s++) {
+                StreamModel &model = models[s];
+                if (feeds[s].Slot < 0) {
+                    continue;
+                }
+                model.Queued += feeds[s].Position - before[s];
+                if (!model.Primed && model.Queued >= lead) {
+                    model.Primed = true;
+                }
+                if (!model.Primed) {
+                    continue;
+                }
+                size_t frames = std::min(g_MixTickFrames, model.Queued);
+                for (size_t i = 0; i < frames * channels; i++) {
+                    expected[i] += signals[s][model.Read * channels + i];
+                }
+                model.Read += frames;
+                model.Queued -= frames;
+                model.Primed = frames == g_MixTickFrames;
+                heard[s] += frames;
+            }
+
+            exact = exact && memcmp(out.data(), expected.data(), out.size() * sizeof(float)) == 0;
+        }
+
+        Check(exact, "a stream's output changed when another opened, starved or closed");
+        Check(heard[2] > 0 && underruns > 0, "late stream not heard or starved stream did not drop out");
+        printf("  open/underrun/close of others: sum exact over %zu ticks, B underruns %u, slots in use %u\n",
+               ticks, underruns, mixer.GetActiveCount());
+    }
+
+    // Saturation: four full-scale streams in phase requantize to the s16
+    // rails, never wrap around
+    {
+        CCavernStreamMixer mixer;
+        CCavernRequantizer requantizer;
+        std::vector<float> loud(g_MixTickFrames * channels);
+        std::vector<MixerFeed> feeds(4);
+        std::vector<float> out(g_MixTickFrames * channels);
+        std::vector<int16_t> pcm(g_MixTickFrames * channels);
+        bool railed = true;
+        size_t clipped = 0;
+
+        for (size_t i = 0; i < loud.size(); i++) {
+            loud[i] = (i / channels) % 2 ? 0.9f : -0.9f;
+        }
+
+        mixer.Init(channels, g_MixRate, TRUE);
+        requantizer.Init(CavernSampleS16, channels, CAVERN_DEFAULT_DITHER, TRUE);
+        for (MixerFeed &feed : feeds) {
+            feed.Slot = mixer.Open(0, FALSE);
+            feed.Signal = &loud;
+            feed.Channels = channels;
+        }
+
+        for (int tick = 0; tick < 20; tick++) {
+            MixTick(mixer, feeds, g_MixTickFrames, out.data());
+            requantizer.Process(out.data(), pcm.data(), g_MixTickFrames);
+            for (size_t i = 0; i < pcm.size(); i++) {
+                if (out[i] > 1.0f) {
+                    railed = railed && pcm[i] == 32767;
+                    clipped++;
+                } else if (out[i] < -1.0f) {
+                    railed = railed && pcm[i] == -32768;
+                    clipped++;
+                }
+            }
+        }
+        Check(railed && clipped > 0, "saturated mix did not hold the s16 rails");
+        printf("  4 x 0.9 full scale: %zu samples held at the s16 rails\n", clipped);
+    }
+
+    // Registry under churn: the mix thread feeds a steady stream itself
+    // while other threads open, write and close streams of silence as fast
+    // as they can. The steady stream must come out continuous.
+    {
+        CCavernStreamMixer mixer;
+        std::atomic<bool> done(false);
+        std::atomic<uint64_t> opens(0), refused(0);
+        std::vector<std::thread> threads;
+
+        mixer.Init(channels, g_MixRate, TRUE);
+        LONG steady = mixer.Open(0, FALSE);
+
+        for (int t = 0; t < 4; t++) {
+            threads.emplace_back([&, t]() {
+                std::vector<float> zeros(g_MixTickFrames * channels);
+                std::mt19937 random(t);
+                while (!done) {
+                    LONG slot = mixer.Open(-(LONG)(random() % 40) * 65536, FALSE);
+                    if (slot < 0) {
+                        refused++;
+                        std::this_thread::yield();
+                        continue;
+                    }
+                    opens++;
+                    for (int n = random() % 8; n >= 0; n--) {
+                        mixer.Write(slot, zeros.data(), g_MixTickFrames);
+                    }
+                    mixer.Close(slot);
+                }
+            });
+        }
+
+        std::vector<float> tick(g_MixTickFrames * channels), out(g_MixTickFrames * channels);
+        uint64_t written = 0, expected = 0, mixed = 0, errors = 0;
+        uint64_t end = NowNs() + (uint64_t)(Opt.Seconds * 1e9);
+        while (NowNs() < end) {
+            for (size_t i = 0; i < tick.size(); i++) {
+                tick[i] = (float)((written * channels + i) % 16384) / 32768.0f;
+            }
+            mixer.Write(steady, tick.data(), g_MixTickFrames);
+            written += g_MixTickFrames;
+
+            mixer.Mix(out.data(), g_MixTickFrames);
+            if (written >= lead) {
+                for (size_t i = 0; i < out.size(); i++) {
+                    float want = (float)((expected * channels + i) % 16384) / 32768.0f;
+                    errors += out[i] != want;
+                }
+                expected += g_MixTickFrames;
+            }
+            mixed++;
+        }
+        done = true;
+        for (std::thread &thread : threads) {
+            thread.join();
+        }
+
+        printf("  churn: %llu opens (%llu refused) by 4 threads over %llu mix ticks\n",
+               (unsigned long long)opens.load(), (unsigned long long)refused.load(),
+               (unsigned long long)mixed);
+        Check(errors == 0, "steady stream glitched while others opened and closed");
+        Check(opens > 0, "churn threads never got a slot");
+    }
+
+    // Cost against stream count: each stream writes a tick, then one mix
+    for (BOOLEAN allowSimd : { FALSE, TRUE }) {
+        printf(" %s\n", allowSimd ? "simd" : "scalar");
+        for (int streams = 1; streams <= CAVERN_MIXER_MAX_STREAMS; streams *= 2) {
+            CCavernStreamMixer mixer;
+            std::vector<std::vector<float>> signals(streams);
+            std::vector<MixerFeed> feeds(streams);
+            std::vector<float> out(g_MixTickFrames * channels);
+
+            mixer.Init(channels, g_MixRate, allowSimd);
+            for (int s = 0; s < streams; s++) {
+                signals[s] = GridSignal(g_MixTickFrames * 64 * channels, 100 + s);
+                feeds[s].Slot = mixer.Open(-s * 65536, FALSE);
+                feeds[s].Signal = &signals[s];
+                feeds[s].Channels = channels;
+            }
+            for (size_t i = 0; i < lead; i += g_MixTickFrames) {
+                MixTick(mixer, feeds, g_MixTickFrames, out.data());
+            }
+
+            double ns = TimeIt(Opt, [&]() { MixTick(mixer, feeds, g_MixTickFrames, out.data()); });
+            double samples = (double)g_MixTickFrames * channels;
+
+            char name[64];
+            snprintf(name, sizeof(name), "%2d stream%s", streams, streams > 1 ? "s" : " ");
+            printf("  %-28s %8.3f ns/output sample %6.3f ns/stream sample %8.1fx real time\n",
+                   name, ns / samples, ns / samples / streams, 1e6 / ns);
+        }
+    }
+}
+
+//=============================================================================
+// Speaker delay lines
+//=============================================================================
+
+// Runs Input through Line in chunks of 1 to 700 frames (crossing the
+// internal block size and the ring end) and returns the output.
+static std::vector<float> DelayInChunks(CCavernDelayLine &Line, const std::vector<float> &Input, uint32_t Channels)
+{
+    static const size_t chunks[] = { 1, 700, 256, 33, 255, 512, 7, 300 };
+    std::vector<float> output = Input;
+    size_t frames = Input.size() / Channels;
+    size_t done = 0;
+
+    for (size_t i = 0; done < frames; i++) {
+        size_t n = std::min(chunks[i % 8], frames - done);
+        Line.Process(output.data() + done * Channels, n);
+        done += n;
+    }
+    return output;
+}
+
+static void RunDelay(const Options &Opt)
+{
+    const uint32_t channels = std::min<uint32_t>(Opt.Channels, CAVERN_MAX_CHANNELS);
+    const ULONG one = 1UL << CAVERN_DELAY_FRACTION_BITS;
+
+    printf("delay: %u channels, up to %u ms\n", channels, CAVERN_DELAY_MAX_MS);
+
+    // Whole-frame delays, from none to the maximum, are exact copies.
+    {
+        CCavernDelayLine line;
+        if (!NT_SUCCESS(line.Init(channels, Opt.Rate, CAVERN_DELAY_MAX_MS, TRUE))) {
+            Check(false, "delay init failed");
+            return;
+        }
+
+        std::vector<ULONG> delays(channels);
+        for (uint32_t c = 0; c < channels; c++) {
+            delays[c] = (c == channels - 1) ? line.GetMaxDelay() : c * 97 * one;
+        }
+        line.SetDelays(delays.data(), channels);
+
+        size_t frames = (line.GetMaxDelay() >> CAVERN_DELAY_FRACTION_BITS) + Opt.Rate / 10;
+        std::vector<float> input = TestSignal(frames * channels);
+        std::vector<float> output = DelayInChunks(line, input, channels);
+
+        size_t errors = 0;
+        for (uint32_t c = 0; c < channels; c++) {
+            size_t d = delays[c] >> CAVERN_DELAY_FRACTION_BITS;
+            for (size_t f = 0; f < frames; f++) {
+                float want = (f >= d) ? input[(f - d) * channels + c] : 0.0f;
+                errors += memcmp(&output[f * channels + c], &want, sizeof(float)) != 0;
+            }
+        }
+        Check(errors == 0, "whole-frame delay is not an exact copy");
+        printf("  whole frames 0..%u: %zu mismatches\n", delays[channels - 1] >> CAVERN_DELAY_FRACTION_BITS, errors);
+    }
+
+    // Fractional delays against the delayed sine, per frequency: centred
+    // on the window, and under a frame (off centre).
+    {
+        const double frequencies[] = { 100.0, 1000.0, 4000.0, 10000.0, 16000.0 };
+        const double fractions[] = { 0.1, 0.25, 0.5, 0.75, 0.9 };
+
+        printf("  fractional delay error, dB re tone, worst over 0.1..0.9 frame:\n");
+        printf("    %8s %10s %10s\n", "Hz", "centred", "< 1 frame");
+        for (double frequency : frequencies) {
+            if (frequency >= Opt.Rate / 2.0) {
+                continue;
+            }
+
+            double worst[2] = { 0.0, 0.0 };
+            for (int centred = 0; centred < 2; centred++) {
+                for (double fraction : fractions) {
+                    CCavernDelayLine line;
+                    line.Init(1, Opt.Rate, CAVERN_DELAY_MAX_MS, TRUE);
+                    ULONG delay = (ULONG)(((centred ? 20.0 : 0.0) + fraction) * one);
+                    line.SetDelays(&delay, 1);
+
+                    double d = (double)delay / one;
+                    double w = 2.0 * M_PI * frequency / Opt.Rate;
+                    size_t frames = Opt.Rate / 20;
+                    std::vector<float> signal(frames);
+                    for (size_t n = 0; n < frames; n++) {
+                        signal[n] = (float)(0.5 * sin(w * n));
+                    }
+                    std::vector<float> out = DelayInChunks(line, signal, 1);
+
+                    for (size_t n = 64; n < frames; n++) {
+                        worst[centred] = std::max(worst[centred], std::fabs(out[n] - 0.5 * sin(w * (n - d))));
+                    }
+                }
+            }
+
+            double centredDb = 20.0 * log10(std::max(worst[1], 1e-12) / 0.5);
+            double shortDb = 20.0 * log10(std::max(worst[0], 1e-12) / 0.5);
+            printf("    %8.0f %10.1f %10.1f\n", frequency, centredDb, shortDb);
+            if (frequency <= 10000.0 && Opt.Rate >= 44100) {
+                Check(centredDb < -75.0, "fractional delay error above -75 dB below 10 kHz");
+            }
+        }
+    }
+
+    // Neither chunking nor the SIMD kernels change the result.
+    {
+        CCavernDelayLine a, b;
+        a.Init(channels, Opt.Rate, CAVERN_DELAY_MAX_MS, FALSE);
+        b.Init(channels, Opt.Rate, CAVERN_DELAY_MAX_MS, TRUE);
+
+        std::vector<ULONG> delays(channels);
+        for (uint32_t c = 0; c < channels; c++) {
+            delays[c] = c * 1234567 % (64 * one);
+        }
+        a.SetDelays(delays.data(), channels);
+        b.SetDelays(delays.data(), channels);
+
+        std::vector<float> input = TestSignal((size_t)Opt.Rate / 10 * channels);
+        for (float &x : input) {
+            if (!std::isfinite(x)) {
+                x = 0.0f;
+            }
+        }
+        std::vector<float> whole = input;
+        a.Process(whole.data(), whole.size() / channels);
+        std::vector<float> chunked = DelayInChunks(b, input, channels);
+        // Bit for bit, unless the compiler fused the scalar loop's
+        // multiply-adds (-mfma)
+        double worst = 0.0;
+        for (size_t i = 0; i < whole.size(); i++) {
+            worst = std::max(worst, (double)std::fabs(whole[i] - chunked[i]));
+        }
+#if defined(CAVERN_HAVE_FMA)
+        Check(worst < 1e-6, "chunked simd delay differs from scalar");
+#else
+        Check(worst == 0.0, "chunked simd delay differs from scalar");
+#endif
+        printf("  chunked simd vs scalar %.1e\n", worst);
+    }
+
+    // Updates are atomic: one thread flips every channel between two
+    // delays while blocks are processed. All channels carry the same
+    // signal, so in any block every channel must come out the same.
+    {
+        CCavernDelayLine line;
+        line.Init(channels, Opt.Rate, CAVERN_DELAY_MAX_MS, TRUE);
+
+        const size_t frames = 64;
+        std::vector<float> block(frames * channels);
+        std::atomic<bool> done(false);
+        std::atomic<uint64_t> updates(0);
+
+        std::thread setter([&]() {
+            std::vector<ULONG> a(channels, 10 * one + one / 3), b(channels, 200 * one);
+            while (!done) {
+                line.SetDelays((updates & 1) ? a.data() : b.data(), channels);
+                updates++;
+
+                // Give the processing loop a chance to see both delays
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+
+        // The 200-frame delay is a copy, so blocks under it are recognised
+        // exactly by their last frame
+        auto signal = [](uint64_t Frame) { return (float)sin((double)Frame * 0.01); };
+        uint64_t blocks = 0, torn = 0, underLong = 0;
+        uint64_t end = NowNs() + (uint64_t)(std::min(Opt.Seconds, 1.0) * 1e9);
+        while (NowNs() < end) {
+            for (size_t f = 0; f < frames; f++) {
+                float x = signal(blocks * frames + f);
+                for (uint32_t c = 0; c < channels; c++) {
+                    block[f * channels + c] = x;
+                }
+            }
+            line.Process(block.data(), frames);
+
+            for (size_t f = 0; f < frames; f++) {
+                if (memcmp(&block[f * channels], &block[f * channels + 1], (channels - 1) * sizeof(float)) != 0) {
+                    torn++;
+                    break;
+                }
+            }
+
+            uint64_t last = (blocks + 1) * frames - 1;
+            underLong += last >= 200 && block[(frames - 1) * channels] == signal(last - 200);
+            blocks++;
+        }
+        done = true;
+        setter.join();
+
+        printf("  %llu updates during %llu blocks (%llu at the long delay): %llu blocks with channels out of step\n",
+               (unsigned long long)updates.load(), (unsigned long long)blocks,
+               (unsigned long long)underLong, (unsigned long long)torn);
+        Check(torn == 0, "a delay update was applied to some channels only");
+        Check(underLong > 0 && underLong < blocks, "delay updates were not picked up");
+    }
+
+    // Cost on the forward path: a 10 ms block of the configured stream
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * channels;
+    std::vector<float> source = TestSignal(samples);
+    for (float &x : source) {
+        if (!std::isfinite(x)) {
+            x = 0.0f;
+        }
+    }
+    std::vector<float> copy(samples);
+
+    auto timed = [&](const char *Name, ULONG Delay, BOOLEAN AllowSimd) {
+        CCavernDelayLine line;
+        line.Init(channels, Opt.Rate, CAVERN_DELAY_MAX_MS, AllowSimd);
+        std::vector<ULONG> delays(channels);
+        for (uint32_t c = 0; c < channels; c++) {
+            delays[c] = Delay ? Delay + c * 31 * one : 0;
+        }
+        line.SetDelays(delays.data(), channels);
+
+        double ns = TimeIt(Opt, [&]() {
+            memcpy(copy.data(), source.data(), samples * sizeof(float));
+            line.Process(copy.data(), frames);
+        });
+        Report(Opt, Name, ns);
+    };
+
+    double memcpyNs = TimeIt(Opt, [&]() { memcpy(copy.data(), source.data(), samples * sizeof(float)); });
+    Report(Opt, "memcpy of the block", memcpyNs);
+    timed("memcpy + no delay (history)", 0, TRUE);
+    timed("memcpy + whole-frame delays", 40 * one, TRUE);
+    timed("memcpy + scalar fractional", 40 * one + one / 3, FALSE);
+    timed("memcpy + simd fractional", 40 * one + one / 3, TRUE);
+}
+
+//=============================================================================
+// Room EQ biquad cascade
+//=============================================================================
+
+static const char *g_BiquadNames[CavernBiquadTypeCount] = { "peak", "low shelf", "high shelf", "low pass", "high pass" };
+
+// Magnitude of one section at Frequency, in dB
+static double BiquadResponseDb(const CAVERN_BIQUAD_COEFFICIENTS &Coefficients, double Frequency, double Rate)
+{
+    std::complex<double> z1 = std::polar(1.0, -2.0 * M_PI * Frequency / Rate);
+    std::complex<double> z2 = z1 * z1;
+    std::complex<double> num = (double)Coefficients.B0 + (double)Coefficients.B1 * z1 + (double)Coefficients.B2 * z2;
+    std::complex<double> den = 1.0 + (double)Coefficients.A1 * z1 + (double)Coefficients.A2 * z2;
+    return 20.0 * log10(std::abs(num / den));
+}
+
+// A room correction curve: a low shelf, peaks spread over the band and a
+// high shelf, different on every channel.
+static void SetRoomEq(CCavernBiquadCascade &Eq, uint32_t Channels, ULONG Bands, uint32_t Rate)
+{
+    Eq.BeginUpdate();
+    Eq.ClearBands();
+    for (uint32_t c = 0; c < Channels; c++) {
+        for (ULONG b = 0; b < Bands; b++) {
+            CAVERN_BIQUAD_TYPE type = (b == 0) ? CavernBiquadLowShelf :
+                (b == Bands - 1) ? CavernBiquadHighShelf : CavernBiquadPeak;
+            double frequency = std::min(40.0 * pow(1.9, (double)b), Rate * 0.4);
+            double gain = (double)((b * 7 + c * 3) % 13) - 6.0;
+            CAVERN_BIQUAD_COEFFICIENTS coefficients;
+
+            if (NT_SUCCESS(CavernBiquadDesign(type, frequency, 1.0 + (b % 3) * 0.7, gain, Rate, &coefficients))) {
+                Eq.SetBand(c, b, &coefficients);
+            }
+        }
+    }
+    Eq.CommitUpdate();
+}
+
+static void RunEq(const Options &Opt)
+{
+    const uint32_t channels = std::min<uint32_t>(Opt.Channels, CAVERN_MAX_CHANNELS);
+    const ULONG bands = 10;
+
+    printf("eq: %u channels x %u bands at %u Hz\n", channels, bands, Opt.Rate);
+
+    // Each filter type, measured with a steady sine against the response
+    // of its coefficients.
+    {
+        const double frequencies[] = { 50.0, 1000.0, 4000.0, 15000.0 };
+
+        printf("  measured gain, dB (1 kHz, Q 0.707, +6 dB), error vs the coefficients' response:\n");
+        printf("    %-10s", "");
+        for (double frequency : frequencies) {
+            printf(" %9.0f Hz", frequency);
+        }
+        printf("\n");
+
+        for (int t = 0; t < CavernBiquadTypeCount; t++) {
+            CAVERN_BIQUAD_COEFFICIENTS coefficients;
+            if (!NT_SUCCESS(CavernBiquadDesign((CAVERN_BIQUAD_TYPE)t, 1000.0, 0.70710678, 6.0, Opt.Rate, &coefficients))) {
+                Check(false, "biquad design failed");
+                continue;
+            }
+
+            printf("    %-10s", g_BiquadNames[t]);
+            for (double frequency : frequencies) {
+                if (frequency >= Opt.Rate / 2.0) {
+                    printf(" %12s", "-");
+                    continue;
+                }
+
+                CCavernBiquadCascade eq;
+                eq.Init(1, TRUE);
+                eq.BeginUpdate();
+                eq.SetBand(0, 0, &coefficients);
+                eq.CommitUpdate();
+
+                // Settle for half a second, then measure the peak over 100 ms
+                size_t settle = Opt.Rate / 2;
+                size_t frames = settle + Opt.Rate / 10;
+                std::vector<float> signal(frames);
+                double w = 2.0 * M_PI * frequency / Opt.Rate;
+                for (size_t n = 0; n < frames; n++) {
+                    signal[n] = (float)(0.25 * sin(w * n));
+                }
+                eq.Process(signal.data(), frames);
+
+                double peak = 0.0;
+                for (size_t n = settle; n < frames; n++) {
+                    peak = std::max(peak, (double)std::fabs(signal[n]));
+                }
+                double measured = 20.0 * log10(peak / 0.25);
+                double expected = BiquadResponseDb(coefficients, frequency, Opt.Rate);
+                printf(" %6.2f %+5.2f", measured, measured - expected);
+                Check(std::fabs(measured - expected) < 0.05, "biquad gain differs from its response");
+            }
+            printf("\n");
+        }
+
+        CAVERN_BIQUAD_COEFFICIENTS unused;
+        Check(!NT_SUCCESS(CavernBiquadDesign(CavernBiquadPeak, Opt.Rate / 2.0, 1.0, 0.0, Opt.Rate, &unused)) &&
+              !NT_SUCCESS(CavernBiquadDesign(CavernBiquadPeak, 1000.0, 0.0, 0.0, Opt.Rate, &unused)),
+              "biquad design accepted Nyquist or Q 0");
+    }
+
+    // Roundoff of the whole cascade against a long double run of the same
+    // coefficients; a 40 Hz shelf at 192 kHz is where float state fails.
+    {
+        CCavernBiquadCascade eq;
+        eq.Init(1, TRUE);
+        SetRoomEq(eq, 1, bands, Opt.Rate);
+
+        std::vector<CAVERN_BIQUAD_COEFFICIENTS> sections(bands);
+        for (ULONG b = 0; b < bands; b++) {
+            CAVERN_BIQUAD_TYPE type = (b == 0) ? CavernBiquadLowShelf :
+                (b == bands - 1) ? CavernBiquadHighShelf : CavernBiquadPeak;
+            CavernBiquadDesign(type, std::min(40.0 * pow(1.9, (double)b), Opt.Rate * 0.4),
+                               1.0 + (b % 3) * 0.7, (double)((b * 7) % 13) - 6.0, Opt.Rate, &sections[b]);
+        }
+
+        size_t frames = Opt.Rate / 2;
+        std::vector<float> signal(frames);
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> dist(-0.5f, 0.5f);
+        for (float &x : signal) {
+            x = dist(rng);
+        }
+
+        std::vector<long double> reference(signal.begin(), signal.end());
+        for (const CAVERN_BIQUAD_COEFFICIENTS &k : sections) {
+            long double z1 = 0.0L, z2 = 0.0L;
+            for (long double &x : reference) {
+                long double y = k.B0 * x + z1;
+                z1 = k.B1 * x + z2 - k.A1 * y;
+                z2 = k.B2 * x - k.A2 * y;
+                x = y;
+            }
+        }
+
+        eq.Process(signal.data(), frames);
+        double error = 0.0, power = 0.0;
+        for (size_t n = 0; n < frames; n++) {
+            double d = (double)(signal[n] - reference[n]);
+            error += d * d;
+            power += (double)(reference[n] * reference[n]);
+        }
+        double errorDb = 10.0 * log10(std::max(error, 1e-300) / power);
+        printf("  10-band cascade roundoff vs long double: %.1f dB\n", errorDb);
+        Check(errorDb < -140.0, "cascade roundoff above -140 dB");
+    }
+
+    // The SIMD lanes match the scalar loop, for channel counts that leave
+    // AVX2, SSE2 and scalar remainders, processed whole or in pieces.
+    for (uint32_t count : { channels, 13u, 6u, 1u }) {
+        if (count > channels) {
+            continue;
+        }
+
+        CCavernBiquadCascade a, b;
+        a.Init(count, FALSE);
+        b.Init(count, TRUE);
+        SetRoomEq(a, count, bands, Opt.Rate);
+        SetRoomEq(b, count, bands, Opt.Rate);
+
+        std::vector<float> input = TestSignal((size_t)Opt.Rate / 10 * count);
+        for (float &x : input) {
+            if (!std::isfinite(x) || std::fabs(x) > 2.0f) {
+                x = 0.0f;
+            }
+        }
+        std::vector<float> whole = input, pieces = input;
+        size_t frames = input.size() / count;
+        a.Process(whole.data(), frames);
+        for (size_t done = 0, i = 0; done < frames; i++) {
+            size_t n = std::min<size_t>((i * 97 % 400) + 1, frames - done);
+            b.Process(pieces.data() + done * count, n);
+            done += n;
+        }
+
+        // Bit for bit, unless the compiler fused the scalar loop's
+        // multiply-adds (-mfma)
+        double worst = 0.0;
+        for (size_t i = 0; i < whole.size(); i++) {
+            worst = std::max(worst, (double)std::fabs(whole[i] - pieces[i]));
+        }
+#if defined(CAVERN_HAVE_FMA)
+        Check(worst < 1e-6, "simd eq differs from scalar");
+#else
+        Check(worst == 0.0, "simd eq differs from scalar");
+#endif
+        printf("  %2u ch simd vs scalar: %.1e\n", count, worst);
+    }
+
+    // Hot swap: one thread switches every channel between the room curve
+    // and a flat set while blocks are processed. All channels carry the
+    // same signal and get the same curve, so in any block every channel
+    // must come out the same.
+    {
+        CCavernBiquadCascade eq;
+        eq.Init(channels, TRUE);
+
+        const size_t frames = 64;
+        std::vector<float> block(frames * channels), input(frames * channels);
+        std::atomic<bool> done(false);
+        std::atomic<uint64_t> updates(0);
+
+        std::thread setter([&]() {
+            std::vector<CAVERN_BIQUAD_COEFFICIENTS> curve(bands);
+            for (ULONG b = 0; b < bands; b++) {
+                CavernBiquadDesign(CavernBiquadPeak, 50.0 * pow(1.8, (double)b), 1.4, (b & 1) ? 4.0 : -3.0, Opt.Rate, &curve[b]);
+            }
+            while (!done) {
+                eq.BeginUpdate();
+                eq.ClearBands();
+                if (updates & 1) {
+                    for (uint32_t c = 0; c < channels; c++) {
+                        for (ULONG b = 0; b < bands; b++) {
+                            eq.SetBand(c, b, &curve[b]);
+                        }
+                    }
+                }
+                eq.CommitUpdate();
+                updates++;
+
+                // Give the processing loop a chance to take each set
+                std::this_thread::sleep_for(std::chrono::microseconds(50));
+            }
+        });
+
+        uint64_t blocks = 0, torn = 0, flat = 0;
+        uint64_t end = NowNs() + (uint64_t)(std::min(Opt.Seconds, 1.0) * 1e9);
+        while (NowNs() < end) {
+            for (size_t f = 0; f < frames; f++) {
+                float x = (float)sin((double)(blocks * frames + f) * 0.01);
+                for (uint32_t c = 0; c < channels; c++) {
+                    input[f * channels + c] = x;
+                }
+            }
+            block = input;
+            eq.Process(block.data(), frames);
+
+            for (size_t f = 0; f < frames; f++) {
+                if (memcmp(&block[f * channels], &block[f * channels + 1], (channels - 1) * sizeof(float)) != 0) {
+                    torn++;
+                    break;
+                }
+            }
+            flat += block == input;
+            blocks++;
+        }
+        done = true;
+        setter.join();
+
+        printf("  %llu updates during %llu blocks (%llu flat): %llu blocks with channels out of step\n",
+               (unsigned long long)updates.load(), (unsigned long long)blocks,
+               (unsigned long long)flat, (unsigned long long)torn);
+        Check(channels < 2 || torn == 0, "a coefficient update was applied to some channels only");
+        Check(flat > 0 && flat < blocks, "coefficient updates were not picked up");
+    }
+
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * channels;
+    std::vector<float> source = TestSignal(samples);
+    for (float &x : source) {
+        if (!std::isfinite(x) || std::fabs(x) > 2.0f) {
+            x = 0.0f;
+        }
+    }
+    std::vector<float> copy(samples);
+
+    // Denormals: after an impulse through slowly decaying low bands, the
+    // tail must reach exact zero and cost no more than live signal.
+    {
+        CCavernBiquadCascade eq;
+        eq.Init(channels, TRUE);
+        eq.BeginUpdate();
+        for (ULONG b = 0; b < bands; b++) {
+            CAVERN_BIQUAD_COEFFICIENTS coefficients;
+            CavernBiquadDesign(CavernBiquadPeak, 30.0 + 10.0 * b, 8.0, 12.0, Opt.Rate, &coefficients);
+            for (uint32_t c = 0; c < channels; c++) {
+                eq.SetBand(c, b, &coefficients);
+            }
+        }
+        eq.CommitUpdate();
+
+        std::fill(copy.begin(), copy.end(), 0.0f);
+        std::fill(copy.begin(), copy.begin() + channels, 1.0f);
+        eq.Process(copy.data(), frames);
+
+        // Ten seconds of silence, timed per second
+        double firstNs = 0.0, lastNs = 0.0;
+        bool silent = false;
+        for (int second = 0; second < 10; second++) {
+            uint64_t start = NowNs();
+            for (int i = 0; i < 100; i++) {
+                std::fill(copy.begin(), copy.end(), 0.0f);
+                eq.Process(copy.data(), frames);
+            }
+            double ns = (double)(NowNs() - start) / 100.0;
+            (second ? lastNs : firstNs) = ns;
+            silent = std::all_of(copy.begin(), copy.end(), [](float x) { return x == 0.0f; });
+        }
+
+        double liveNs = TimeIt(Opt, [&]() {
+            memcpy(copy.data(), source.data(), samples * sizeof(float));
+            eq.Process(copy.data(), frames);
+        });
+        printf("  impulse tail: %.3f ns/sample in the first second, %.3f after 10 s (live %.3f), %s\n",
+               firstNs / samples, lastNs / samples, liveNs / samples, silent ? "decayed to zero" : "NOT zero");
+        Check(silent, "filter state did not decay to zero");
+    }
+
+    // Cost on the forward path: a 10 ms block of the configured stream
+    auto timed = [&](const char *Name, ULONG Bands, BOOLEAN AllowSimd) {
+        CCavernBiquadCascade eq;
+        eq.Init(channels, AllowSimd);
+        SetRoomEq(eq, channels, Bands, Opt.Rate);
+
+        double ns = TimeIt(Opt, [&]() {
+            memcpy(copy.data(), source.data(), samples * sizeof(float));
+            eq.Process(copy.data(), frames);
+        });
+        Report(Opt, Name, ns);
+    };
+
+    Report(Opt, "memcpy of the block", TimeIt(Opt, [&]() { memcpy(copy.data(), source.data(), samples * sizeof(float)); }));
+    timed("memcpy + flat (no bands)", 0, TRUE);
+    timed("memcpy + 10 bands, scalar", bands, FALSE);
+    timed("memcpy + 10 bands, simd", bands, TRUE);
+    timed("memcpy + 16 bands, simd", CAVERN_BIQUAD_MAX_BANDS, TRUE);
+}
+
+//=============================================================================
+// Partitioned convolution
+//=============================================================================
+
+// Error energy of Actual against Reference, in dB of the reference's
+static double ErrorDb(const std::vector<double> &Reference, const float *Actual, size_t Count, double Scale)
+{
+    double error = 0.0, power = 0.0;
+
+    for (size_t i = 0; i < Count; i++) {
+        double d = (double)Actual[i] * Scale - Reference[i];
+        error += d * d;
+        power += Reference[i] * Reference[i];
+    }
+    return 10.0 * log10(std::max(error, 1e-300) / std::max(power, 1e-300));
+}
+
+// Room-like filter: noise under an exponential decay, different per channel
+static std::vector<float> RoomFilter(uint32_t Channels, ULONG Taps, uint32_t Seed)
+{
+    std::mt19937 rng(Seed);
+    std::uniform_real_distribution<float> dist(-1.0f, 1.0f);
+    std::vector<float> taps((size_t)Taps * Channels);
+
+    for (ULONG t = 0; t < Taps; t++) {
+        float envelope = (float)exp(-6.0 * t / Taps);
+        for (uint32_t c = 0; c < Channels; c++) {
+            taps[(size_t)t * Channels + c] = dist(rng) * envelope * 0.05f;
+        }
+    }
+    return taps;
+}
+
+static std::vector<float> ConvInput(size_t Samples)
+{
+    std::vector<float> input = TestSignal(Samples);
+
+    for (float &x : input) {
+        if (!std::isfinite(x) || std::fabs(x) > 2.0f) {
+            x = 0.0f;
+        }
+    }
+    return input;
+}
+
+static void RunConv(const Options &Opt)
+{
+    const uint32_t channels = std::min<uint32_t>(Opt.Channels, CAVERN_MAX_CHANNELS);
+    const ULONG block = CavernConvolverBlockFrames(Opt.Rate, 10);
+
+    printf("conv: %u channels at %u Hz, %u-frame blocks (10 ms period)\n", channels, Opt.Rate, block);
+
+    // The real FFT against a double precision DFT, and the round trip, for
+    // sizes with an even and an odd number of radix-2 stages.
+    for (ULONG size : { 16u, 64u, 512u, 2048u }) {
+        ULONG lanes = CCavernFft::LaneWidth(TRUE);
+        CCavernFft fft, scalar;
+        fft.Init(size, lanes, TRUE);
+        scalar.Init(size, lanes, FALSE);
+
+        std::vector<float> time = ConvInput((size_t)size * lanes);
+        std::vector<float> spectrum(fft.GetSpectrumFloats()), other(fft.GetSpectrumFloats());
+        std::vector<float> back((size_t)size * lanes);
+        fft.Forward(time.data(), spectrum.data());
+        scalar.Forward(time.data(), other.data());
+        fft.Inverse(spectrum.data(), back.data());
+
+        ULONG bins = fft.GetBins();
+        std::vector<double> reference(spectrum.size());
+        for (ULONG k = 0; k < bins; k++) {
+            for (ULONG l = 0; l < lanes; l++) {
+                std::complex<double> sum = 0.0;
+                for (ULONG n = 0; n < size; n++) {
+                    sum += (double)time[(size_t)n * lanes + l] * std::polar(1.0, -2.0 * M_PI * k * n / size);
+                }
+                reference[(size_t)k * lanes + l] = sum.real();
+                reference[((size_t)bins + k) * lanes + l] = sum.imag();
+            }
+        }
+        std::vector<double> original(time.begin(), time.end());
+
+        double forwardDb = ErrorDb(reference, spectrum.data(), spectrum.size(), 1.0);
+        double roundTripDb = ErrorDb(original, back.data(), back.size(), 1.0 / size);
+        double worst = 0.0;
+        for (size_t i = 0; i < spectrum.size(); i++) {
+            worst = std::max(worst, (double)std::fabs(spectrum[i] - other[i]));
+        }
+        printf("  fft %5u: vs DFT %.1f dB, round trip %.1f dB, simd vs scalar %.1e\n",
+               size, forwardDb, roundTripDb, worst);
+        Check(forwardDb < -120.0 && roundTripDb < -120.0, "fft error above -120 dB");
+#if defined(CAVERN_HAVE_FMA)
+        Check(worst < 1e-4, "simd fft differs from scalar");
+#else
+        Check(worst == 0.0, "simd fft differs from scalar");
+#endif
+    }
+
+    // Against direct convolution delayed by one block, for filters shorter
+    // than a block, a few blocks, and not a whole number of blocks, with
+    // input in ragged pieces.
+    for (ULONG taps : { 20u, 64u, 1000u }) {
+        for (uint32_t count : { channels, 3u }) {
+            const ULONG size = 64;
+            CCavernConvolver conv;
+            conv.Init(count, size, taps, TRUE);
+            std::vector<float> h = RoomFilter(count, taps, taps);
+            conv.SetFilters(h.data(), taps);
+
+            size_t frames = 20000;
+            std::vector<float> input = ConvInput(frames * count), output = input;
+            for (size_t done = 0, i = 0; done < frames; i++) {
+                size_t n = std::min<size_t>((i * 37 % 150) + 1, frames - done);
+                conv.Process(output.data() + done * count, n);
+                done += n;
+            }
+
+            std::vector<double> reference(output.size(), 0.0);
+            for (size_t n = size; n < frames; n++) {
+                for (uint32_t c = 0; c < count; c++) {
+                    double sum = 0.0;
+                    for (size_t k = 0; k < taps && k + size <= n; k++) {
+                        sum += (double)h[k * count + c] * input[(n - size - k) * count + c];
+                    }
+                    reference[n * count + c] = sum;
+                }
+            }
+            double errorDb = ErrorDb(reference, output.data(), output.size(), 1.0);
+            printf("  %4u taps, %2u ch vs direct convolution: %.1f dB, latency %u frames\n",
+                   taps, count, errorDb, conv.GetLatency());
+            Check(errorDb < -110.0, "convolution error above -110 dB");
+            Check(conv.GetLatency() == size, "convolver latency is not one block");
+        }
+    }
+
+    // A unit impulse filter delays by exactly one block
+    {
+        CCavernConvolver conv;
+        conv.Init(1, block, block, TRUE);
+        std::vector<float> unit(1, 1.0f);
+        conv.SetFilters(unit.data(), 1);
+
+        std::vector<float> signal(4 * block, 0.0f);
+        signal[5] = 1.0f;
+        conv.Process(signal.data(), signal.size());
+        size_t peak = std::max_element(signal.begin(), signal.end()) - signal.begin();
+        printf("  unit filter: impulse at 5 comes out at %zu (%.7f)\n", peak, signal[peak]);
+        Check(peak == 5 + block && std::fabs(signal[peak] - 1.0f) < 1e-5f, "unit filter is not a one-block delay");
+    }
+
+    // SIMD lanes against the scalar loop
+    for (uint32_t count : { channels, 13u, 6u, 1u }) {
+        if (count > channels) {
+            continue;
+        }
+
+        const ULONG taps = 3000;
+        CCavernConvolver a, b;
+        a.Init(count, 128, taps, FALSE);
+        b.Init(count, 128, taps, TRUE);
+        std::vector<float> h = RoomFilter(count, taps, 7);
+        a.SetFilters(h.data(), taps);
+        b.SetFilters(h.data(), taps);
+
+        std::vector<float> input = ConvInput((size_t)Opt.Rate / 10 * count);
+        std::vector<float> whole = input, pieces = input;
+        size_t frames = input.size() / count;
+        a.Process(whole.data(), frames);
+        for (size_t done = 0, i = 0; done < frames; i++) {
+            size_t n = std::min<size_t>((i * 97 % 400) + 1, frames - done);
+            b.Process(pieces.data() + done * count, n);
+            done += n;
+        }
+
+        double worst = 0.0;
+        for (size_t i = 0; i < whole.size(); i++) {
+            worst = std::max(worst, (double)std::fabs(whole[i] - pieces[i]));
+        }
+#if defined(CAVERN_HAVE_FMA)
+        Check(worst < 1e-5, "simd convolver differs from scalar");
+#else
+        Check(worst == 0.0, "simd convolver differs from scalar");
+#endif
+        printf("  %2u ch simd vs scalar: %.1e\n", count, worst);
+    }
+
+    // Cost on the forward path: a 10 ms block of the configured stream, and
+    // the spread over 1 ms calls (the driver's mix timer), whose worst call
+    // is what a DPC sees.
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * channels;
+    std::vector<float> source = ConvInput(samples);
+    std::vector<float> copy(samples);
+
+    Report(Opt, "memcpy of the block", TimeIt(Opt, [&]() { memcpy(copy.data(), source.data(), samples * sizeof(float)); }));
+
+    for (ULONG taps : { 4096u, 16384u, 65536u }) {
+        for (BOOLEAN simd : { FALSE, TRUE }) {
+            if (!simd && taps > 4096) {
+                continue;
+            }
+
+            CCavernConvolver conv;
+            if (!NT_SUCCESS(conv.Init(channels, block, taps, simd))) {
+                Check(false, "convolver init failed");
+                continue;
+            }
+            std::vector<float> h = RoomFilter(channels, taps, 3);
+            conv.SetFilters(h.data(), taps);
+
+            char name[64];
+            snprintf(name, sizeof(name), "%u taps, %s", taps, simd ? "simd" : "scalar");
+            double ns = TimeIt(Opt, [&]() {
+                memcpy(copy.data(), source.data(), samples * sizeof(float));
+                conv.Process(copy.data(), frames);
+            });
+            Report(Opt, name, ns);
+
+            size_t tick = std::max<size_t>(Opt.Rate / 1000, 1);
+            uint64_t worst = 0, total = 0, calls = 0;
+            for (int pass = 0; pass < 10; pass++) {
+                memcpy(copy.data(), source.data(), samples * sizeof(float));
+                for (size_t done = 0; done + tick <= frames; done += tick) {
+                    uint64_t start = NowNs();
+                    conv.Process(copy.data() + done * channels, tick);
+                    uint64_t elapsed = NowNs() - start;
+                    worst = std::max(worst, elapsed);
+                    total += elapsed;
+                    calls++;
+                }
+            }
+            printf("  %-28s 1 ms calls: mean %.1f us, worst %.1f us\n", "",
+                   total / 1e3 / calls, worst / 1e3);
+        }
+    }
+}
+
+//=============================================================================
+// Output limiter
+//=============================================================================
+
+// Highest magnitude of the band-limited signal through the samples, from a
+// 16x windowed-sinc reconstruction in double precision
+static double ReferenceTruePeak(const std::vector<float> &Signal, uint32_t Channels, uint32_t Channel)
+{
+    const int half = 32;
+    const int over = 16;
+    size_t frames = Signal.size() / Channels;
+    double peak = 0.0;
+
+    for (size_t n = half; n + half < frames; n++) {
+        for (int k = 0; k < over; k++) {
+            double t = (double)k / over;
+            double sum = 0.0;
+            for (int i = -half + 1; i <= half; i++) {
+                double u = t - i;
+                double sinc = (u == 0.0) ? 1.0 : sin(M_PI * u) / (M_PI * u);
+                double window = 0.5 * (1.0 + cos(M_PI * u / half));
+                sum += Signal[(n + i) * Channels + Channel] * sinc * window;
+            }
+            peak = std::max(peak, std::fabs(sum));
+        }
+    }
+    return peak;
+}
+
+static void RunLimit(const Options &Opt)
+{
+    const uint32_t channels = std::min<uint32_t>(Opt.Channels, CAVERN_MAX_CHANNELS);
+    const ULONG lookaheadUs = 1000, releaseMs = 50;
+    const LONG ceilingCentiDb = -30;
+    const double ceiling = pow(10.0, ceilingCentiDb / 2000.0);
+
+    CCavernLimiter probe;
+    probe.Init(channels, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, TRUE, TRUE);
+    const ULONG latency = probe.GetLatency();
+
+    printf("limit: %u channels at %u Hz, %u us look-ahead, %u ms release, ceiling %.1f dBTP, latency %u frames (%.2f ms)\n",
+           channels, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb / 100.0, latency, latency * 1000.0 / Opt.Rate);
+    Check(latency * 1000000.0 / Opt.Rate < 2000.0, "limiter latency above 2 ms");
+
+    // Tones over full scale, including a quarter-rate one whose samples
+    // stay under the ceiling while its true peak does not
+    {
+        const double frequencies[] = { 997.0, 7000.0, Opt.Rate / 4.0, Opt.Rate * 0.3 };
+        const double amplitudes[] = { 2.0, 1.4, 1.3, 1.2 };
+
+        for (int i = 0; i < 4; i++) {
+            CCavernLimiter limiter;
+            limiter.Init(1, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, TRUE, TRUE);
+
+            size_t frames = Opt.Rate / 5;
+            std::vector<float> signal(frames);
+            double w = 2.0 * M_PI * frequencies[i] / Opt.Rate;
+            for (size_t n = 0; n < frames; n++) {
+                signal[n] = (float)(amplitudes[i] * sin(w * n + M_PI / 4.0));
+            }
+            std::vector<float> input = signal;
+            limiter.Process(signal.data(), frames);
+
+            double samplePeak = 0.0;
+            for (float x : signal) {
+                samplePeak = std::max(samplePeak, (double)std::fabs(x));
+            }
+            double inputTruePeak = ReferenceTruePeak(input, 1, 0);
+            double truePeak = ReferenceTruePeak(signal, 1, 0);
+            double overshootDb = 20.0 * log10(truePeak / ceiling);
+            printf("  %7.0f Hz at %+5.1f dBTP: sample peak %.4f, true peak %+.2f dB over the ceiling\n",
+                   frequencies[i], 20.0 * log10(inputTruePeak), samplePeak, overshootDb);
+            Check(samplePeak <= ceiling, "limiter let a sample over the ceiling");
+            Check(overshootDb < 0.2, "limiter true peak more than 0.2 dB over the ceiling");
+        }
+    }
+
+    // Under the ceiling the limiter is a pure delay; an impulse comes out
+    // exactly GetLatency() frames later
+    {
+        CCavernLimiter limiter;
+        limiter.Init(channels, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, TRUE, TRUE);
+
+        size_t frames = Opt.Rate / 10;
+        std::vector<float> input(frames * channels);
+        std::mt19937 rng(5);
+        std::uniform_real_distribution<float> dist(-0.2f, 0.2f);
+        for (size_t n = 0; n < frames; n++) {
+            for (uint32_t c = 0; c < channels; c++) {
+                input[n * channels + c] = (float)(0.5 * sin(0.01 * n * (c + 1))) + dist(rng);
+            }
+        }
+        std::vector<float> output = input;
+        limiter.Process(output.data(), frames);
+
+        bool same = true;
+        for (size_t n = latency; n < frames && same; n++) {
+            same = memcmp(&output[n * channels], &input[(n - latency) * channels], channels * sizeof(float)) == 0;
+        }
+        printf("  under the ceiling: %s, %llu frames limited\n", same ? "delayed copy" : "ALTERED",
+               (unsigned long long)limiter.GetLimitedFrames());
+        Check(same && limiter.GetLimitedFrames() == 0, "limiter altered a signal under the ceiling");
+
+        limiter.Reset();
+        std::vector<float> impulse(4 * latency * channels, 0.0f);
+        impulse[10 * channels] = 0.5f;
+        limiter.Process(impulse.data(), impulse.size() / channels);
+        Check(impulse[(10 + latency) * channels] == 0.5f, "limiter impulse not delayed by its latency");
+    }
+
+    // Linked mode turns every channel down with the loudest; unlinked mode
+    // leaves a quiet channel alone
+    if (channels >= 2) {
+        for (BOOLEAN linked : { TRUE, FALSE }) {
+            CCavernLimiter limiter;
+            limiter.Init(2, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, linked, TRUE);
+
+            size_t frames = Opt.Rate / 10;
+            std::vector<float> input(frames * 2);
+            for (size_t n = 0; n < frames; n++) {
+                input[n * 2] = (float)(2.0 * sin(0.013 * n));
+                input[n * 2 + 1] = (float)(0.25 * sin(0.005 * n));
+            }
+            std::vector<float> output = input;
+            limiter.Process(output.data(), frames);
+
+            double quietGain = 1.0;
+            for (size_t n = frames / 2; n < frames; n++) {
+                float x = input[(n - latency) * 2 + 1];
+                if (std::fabs(x) > 0.1f) {
+                    quietGain = std::min(quietGain, (double)output[n * 2 + 1] / x);
+                }
+            }
+            printf("  %-8s quiet channel gain %.3f\n", linked ? "linked:" : "unlinked:", quietGain);
+            Check(linked ? quietGain < 0.6 : quietGain == 1.0, "limiter channel linking wrong");
+        }
+    }
+
+    // Gain curve: a burst 12 dB over a steady tone ramps down within the
+    // look-ahead and recovers along the release
+    {
+        CCavernLimiter limiter;
+        limiter.Init(1, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, TRUE, TRUE);
+
+        size_t burstStart = Opt.Rate / 10, burstEnd = burstStart + Opt.Rate / 10;
+        size_t frames = burstEnd + Opt.Rate;
+        std::vector<float> input(frames);
+        for (size_t n = 0; n < frames; n++) {
+            double level = (n >= burstStart && n < burstEnd) ? 2.0 : 0.5;
+            input[n] = (float)(level * sin(2.0 * M_PI * 1000.0 * n / Opt.Rate));
+        }
+        std::vector<float> output = input;
+        limiter.Process(output.data(), frames);
+
+        // The gain is the same on every sample, so read it where the input
+        // is well away from zero; steps are per frame across the gaps
+        double step = 0.0, lowest = 1.0, previous = 1.0;
+        double recovered = 0.0;
+        size_t previousAt = latency;
+        size_t recoverAt = burstEnd + latency + (size_t)(5.0 * releaseMs * Opt.Rate / 1000.0);
+        for (size_t n = latency; n < frames; n++) {
+            float x = input[n - latency];
+            if (std::fabs(x) < 0.2f) {
+                continue;
+            }
+            double gain = output[n] / x;
+            if (n > previousAt) {
+                step = std::max(step, std::fabs(gain - previous) / (double)(n - previousAt));
+            }
+            lowest = std::min(lowest, gain);
+            previous = gain;
+            previousAt = n;
+            if (n >= recoverAt && recovered == 0.0) {
+                recovered = gain;
+            }
+        }
+        double lookahead = (double)Opt.Rate * lookaheadUs / 1e6;
+        printf("  +12 dB burst: deepest %.2f dB, largest gain step %.4f (ramp %.4f), %.3f after 5 release times\n",
+               20.0 * log10(lowest), step, (1.0 - lowest) / lookahead, recovered);
+        Check(step <= (1.0 - lowest) / lookahead * 1.5 + 1e-6, "limiter gain stepped instead of ramping");
+        Check(recovered > 0.99, "limiter did not release");
+    }
+
+    // SIMD lanes against the scalar loop, in ragged pieces
+    for (BOOLEAN linked : { TRUE, FALSE }) {
+        for (uint32_t count : { channels, 13u, 6u, 1u }) {
+            if (count > channels) {
+                continue;
+            }
+
+            CCavernLimiter a, b;
+            a.Init(count, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, linked, FALSE);
+            b.Init(count, Opt.Rate, lookaheadUs, releaseMs, ceilingCentiDb, linked, TRUE);
+
+            std::vector<float> input = TestSignal((size_t)Opt.Rate / 10 * count);
+            for (float &x : input) {
+                if (!std::isfinite(x) || std::fabs(x) > 2.0f) {
+                    x = 0.0f;
+                }
+            }
+            std::vector<float> whole = input, pieces = input;
+            size_t frames = input.size() / count;
+            a.Process(whole.data(), frames);
+            for (size_t done = 0, i = 0; done < frames; i++) {
+                size_t n = std::min<size_t>((i * 97 % 400) + 1, frames - done);
+                b.Process(pieces.data() + done * count, n);
+                done += n;
+            }
+
+            double worst = 0.0;
+            for (size_t i = 0; i < whole.size(); i++) {
+                worst = std::max(worst, (double)std::fabs(whole[i] - pieces[i]));
+            }
+#if defined(CAVERN_HAVE_FMA)
+            Check(worst < 1e-4, "simd limiter differs from scalar");
+#else
+            Check(worst == 0.0, "simd limiter differs from scalar");
+#endif
+            printf("  %-8s %2u ch simd vs scalar: %.1e\n", linked ? "linked" : "unlinked", count, worst);
+        }
+    }
+
+    // Cost on the forward path: a 10 ms block, over the ceiling half the
+    // time; the window length must not matter
+    const size_t frames = Opt.Rate / 100;
+    const size_t samples = frames * channels;
+    std::vector<float> source(samples);
+    for (size_t n = 0; n < frames; n++) {
+        double level = (n < frames / 2) ? 0.5 : 1.5;
+        for (uint32_t c = 0; c < channels; c++) {
+            source[n * channels + c] = (float)(level * sin(0.02 * n + c));
+        }
+    }
+    std::vector<float> copy(samples);
+
+    auto timed = [&](const char *Name, ULONG LookaheadUs, BOOLEAN Linked, BOOLEAN AllowSimd) {
+        CCavernLimiter limiter;
+        limiter.Init(channels, Opt.Rate, LookaheadUs, releaseMs, ceilingCentiDb, Linked, AllowSimd);
+
+        double ns = TimeIt(Opt, [&]() {
+            memcpy(copy.data(), source.data(), samples * sizeof(float));
+            limiter.Process(copy.data(), frames);
+        });
+        Report(Opt, Name, ns);
+    };
+
+    Report(Opt, "memcpy of the block", TimeIt(Opt, [&]() { memcpy(copy.data(), source.data(), samples * sizeof(float)); }));
+    timed("linked, scalar", lookaheadUs, TRUE, FALSE);
+    timed("linked, simd", lookaheadUs, TRUE, TRUE);
+    timed("unlinked, scalar", lookaheadUs, FALSE, FALSE);
+    timed("unlinked, simd", lookaheadUs, FALSE, TRUE);
+    timed("unlinked, simd, 250 us", 250, FALSE, TRUE);
+    timed("unlinked, simd, 2 ms", 2000, FALSE, TRUE);
+}
+
+//=============================================================================
+// Tone oscillator
+//=============================================================================
+
+// Frames ToneGenerator synthesizes per call (TONE_BLOCK_FRAMES)
+static const size_t g_ToneBlockFrames = 64;
+
+// What ToneGenerator::InitNewFrames did per frame before the oscillator: a
+// double-precision sin() of a wrapped phase.
+struct LegacyTone
+{
+    double Theta;
+    double Increment;
+    double Amplitude;
+    double Offset;
+
+    LegacyTone(uint32_t Frequency, uint32_t Rate, double Amplitude_, double Phase)
+        : Theta(Phase), Increment(2.0 * M_PI * Frequency / (double)Rate), Amplitude(Amplitude_), Offset(0.0)
+    {
+    }
+
+    void Generate(float *Samples, size_t Frames)
+    {
+        for (size_t i = 0; i < Frames; i++) {
+            Samples[i] = (float)(Offset + Amplitude * sin(Theta));
+            Theta += Increment;
+            if (Theta >= 2.0 * M_PI) {
+                Theta -= 2.0 * M_PI;
+            }
+        }
+    }
+};
+
+// The tone at Frame with the phase reduced in integers, so it is exact
+// however far in
+static double ReferenceTone(uint32_t Frequency, uint32_t Rate, double Phase, uint64_t Frame)
+{
+    uint64_t cycle = (uint64_t)Frequency * Frame % Rate;
+    return sin(2.0 * M_PI * (double)cycle / (double)Rate + Phase);
+}
+
+// Largest spur and everything but the tone, relative to the tone, in dB.
+// The tone sits exactly on a bin, so no window is needed.
+static void TonePurity(const std::vector<float> &Signal, size_t Bin, double *SpurDb, double *NoiseDb)
+{
+    std::vector<std::complex<double>> data(Signal.begin(), Signal.end());
+    Fft(data);
+
+    double tone = std::norm(data[Bin]);
+    double spur = 0.0, rest = 0.0;
+    for (size_t k = 1; k <= data.size() / 2; k++) {
+        if (k != Bin) {
+            spur = std::max(spur, std::norm(data[k]));
+            rest += std::norm(data[k]);
+        }
+    }
+    *SpurDb = Db(spur / tone);
+    *NoiseDb = Db(rest / tone);
+}
+
+// Largest non-tone bin against the mean of the non-tone bins, in dB. Flat
+// noise peaks about 11 dB above its mean over 2^15 bins; noise that
+// repeats every P frames piles into every (N / P)-th bin and peaks far
+// higher.
+static double ToneSpurAboveFloor(const std::vector<float> &Signal, size_t Bin)
+{
+    std::vector<std::complex<double>> data(Signal.begin(), Signal.end());
+    Fft(data);
+
+    double peak = 0.0, sum = 0.0;
+    size_t count = 0;
+    for (size_t k = 1; k <= data.size() / 2; k++) {
+        if (k != Bin) {
+            peak = std::max(peak, std::norm(data[k]));
+            sum += std::norm(data[k]);
+            count++;
+        }
+    }
+    return Db(peak / (sum / (double)count));
+}
+
+static void RunTone(const Options &Opt)
+{
+    printf("tone: phase accumulator + %u-point table against per-frame sin()\n", CAVERN_OSCILLATOR_TABLE_SIZE);
+
+    // Long runs against the exact tone: the phase must not wander
+    struct Tone { uint32_t Frequency, Rate; double Phase; };
+    const Tone tones[] = { { 1000, 48000, 0.0 }, { 997, 44100, 1.0 }, { 19997, 192000, 2.5 }, { 440, 48000, 4.0 } };
+    for (const Tone &t : tones) {
+        CCavernOscillator oscillator;
+        LegacyTone legacy(t.Frequency, t.Rate, 1.0, t.Phase);
+        oscillator.Init(t.Frequency, t.Rate, 1.0f, 0.0f, t.Phase, TRUE);
+
+        const uint64_t frames = (uint64_t)t.Rate * 600;
+        float block[g_ToneBlockFrames], legacyBlock[g_ToneBlockFrames];
+        double worst = 0.0, legacyWorst = 0.0;
+        for (uint64_t n = 0; n < frames; n += g_ToneBlockFrames) {
+            oscillator.Generate(block, g_ToneBlockFrames);
+            legacy.Generate(legacyBlock, g_ToneBlockFrames);
+
+            // Every block's first frame, and all of the last second
+            size_t count = (n + t.Rate >= frames) ? g_ToneBlockFrames : 1;
+            for (size_t i = 0; i < count; i++) {
+                double exact = ReferenceTone(t.Frequency, t.Rate, t.Phase, n + i);
+                worst = std::max(worst, std::fabs(block[i] - exact));
+                legacyWorst = std::max(legacyWorst, std::fabs(legacyBlock[i] - exact));
+            }
+        }
+        printf("  %5u Hz at %6u Hz, 10 minutes: largest error %.1e (sin() per frame %.1e)\n",
+               t.Frequency, t.Rate, worst, legacyWorst);
+        Check(worst < 3e-7, "oscillator strayed from the exact tone");
+    }
+
+    // The phase after any split of the frames is the exact fraction
+    {
+        CCavernOscillator oscillator;
+        oscillator.Init(997, 44100, 1.0f, 0.0f, 0.0, TRUE);
+        std::vector<float> scratch(1000);
+        std::mt19937 rng(45);
+        uint64_t total = 0;
+        bool exact = true;
+        for (int call = 0; call < 20000; call++) {
+            size_t frames = rng() % scratch.size();
+            oscillator.Generate(scratch.data(), frames);
+            total += frames;
+            uint32_t expected = (uint32_t)(((unsigned __int128)total * 997 << 32) / 44100);
+            exact = exact && oscillator.GetPhase() == expected;
+        }
+        printf("  phase after %llu frames in ragged calls: %s\n",
+               (unsigned long long)total, exact ? "exact" : "off");
+        Check(exact, "oscillator phase depends on how the frames are split");
+    }
+
+    // Spectral purity: 2^16 frames at 65536 Hz put every integer tone on a bin
+    const size_t purityFrames = 65536;
+    for (uint32_t frequency : { 997u, 1000u, 12345u, 30001u }) {
+        CCavernOscillator oscillator;
+        LegacyTone legacy(frequency, (uint32_t)purityFrames, 1.0, 0.3);
+        std::vector<float> signal(purityFrames), legacySignal(purityFrames);
+        oscillator.Init(frequency, (uint32_t)purityFrames, 1.0f, 0.0f, 0.3, TRUE);
+        for (size_t n = 0; n < purityFrames; n += g_ToneBlockFrames) {
+            oscillator.Generate(signal.data() + n, g_ToneBlockFrames);
+            legacy.Generate(legacySignal.data() + n, g_ToneBlockFrames);
+        }
+
+        double spur, noise, legacySpur, legacyNoise;
+        TonePurity(signal, frequency, &spur, &noise);
+        TonePurity(legacySignal, frequency, &legacySpur, &legacyNoise);
+        printf("  %5u Hz: largest spur %7.1f dBc, THD+N %7.1f dB (sin() per frame %7.1f, %7.1f)\n",
+               frequency, spur, noise, legacySpur, legacyNoise);
+        Check(spur < -140.0, "oscillator spur above -140 dBc");
+        Check(noise < -130.0, "oscillator THD+N above -130 dB");
+    }
+
+    // Cached periods against the exact tone, over a minute in ragged calls
+    for (const Tone &t : { Tone{ 1000, 48000, 0.0 }, Tone{ 3000, 48000, 0.7 }, Tone{ 440, 48000, 4.0 },
+                           Tone{ 997, 44100, 1.0 } }) {
+        CCavernTonePeriod period;
+        Check(NT_SUCCESS(period.Init(t.Frequency, t.Rate, 1.0, 0.0, t.Phase)), "tone period not cached");
+
+        std::vector<float> scratch(1000);
+        std::mt19937 rng(47);
+        uint64_t total = 0;
+        double worst = 0.0;
+        while (total < (uint64_t)t.Rate * 60) {
+            size_t frames = rng() % scratch.size();
+            period.Generate(scratch.data(), frames);
+            for (size_t i = 0; i < frames; i++) {
+                worst = std::max(worst, std::fabs(scratch[i] - ReferenceTone(t.Frequency, t.Rate, t.Phase, total + i)));
+            }
+            total += frames;
+        }
+        printf("  %5u Hz at %6u Hz, period %u frames cached as %u: largest error %.1e\n",
+               t.Frequency, t.Rate, period.GetPeriodFrames(), period.GetCacheFrames(), worst);
+        Check(worst < 1e-7, "cached period strayed from the exact tone");
+    }
+    {
+        CCavernTonePeriod period;
+        Check(period.Init(19997, 192000, 1.0, 0.0, 0.0) == STATUS_NOT_SUPPORTED,
+              "period longer than the cache limit was cached");
+    }
+
+    // The cached path as ToneGenerator runs it: 3 kHz at 48 kHz repeats
+    // every 16 frames and is cached as 1024, copied to 2 channels in
+    // 64-frame blocks and requantized to s16 with TPDF dither per block.
+    // Against it, the period requantized once and the s16 frames repeated,
+    // whose dither repeats with the cache.
+    {
+        const size_t frames = 65536;
+        const size_t bin = frames * 3000 / 48000;
+        CCavernTonePeriod period;
+        CCavernRequantizer requantizer;
+        period.Init(3000, 48000, 0.5, 0.0, 0.0);
+        requantizer.Init(CavernSampleS16, 2, CAVERN_DEFAULT_DITHER, TRUE);
+
+        std::vector<float> interleaved(g_ToneBlockFrames * 2);
+        std::vector<int16_t> pcm(frames * 2);
+        float block[g_ToneBlockFrames];
+        for (size_t n = 0; n < frames; n += g_ToneBlockFrames) {
+            period.Generate(block, g_ToneBlockFrames);
+            for (size_t i = 0; i < g_ToneBlockFrames; i++) {
+                interleaved[2 * i] = interleaved[2 * i + 1] = block[i];
+            }
+            requantizer.Process(interleaved.data(), pcm.data() + 2 * n, g_ToneBlockFrames);
+        }
+
+        // The whole s16 cache comes out of the same per-block loop, once
+        const size_t cacheFrames = period.GetCacheFrames();
+        std::vector<int16_t> cached(pcm.begin(), pcm.begin() + 2 * cacheFrames);
+
+        std::vector<float> signal(frames), repeated(frames);
+        for (size_t n = 0; n < frames; n++) {
+            signal[n] = pcm[2 * n] / 32768.0f;
+            repeated[n] = cached[2 * (n % cacheFrames)] / 32768.0f;
+        }
+
+        double spur, noise, repeatedSpur, repeatedNoise;
+        TonePurity(signal, bin, &spur, &noise);
+        TonePurity(repeated, bin, &repeatedSpur, &repeatedNoise);
+        double floor = ToneSpurAboveFloor(signal, bin);
+        double repeatedFloor = ToneSpurAboveFloor(repeated, bin);
+        printf("  cached period, s16 tpdf per block: largest spur %.1f dBc (%.1f dB above the mean floor), THD+N %.1f dB\n",
+               spur, floor, noise);
+        printf("  s16 cache repeated: largest spur %.1f dBc (%.1f dB above the mean floor), THD+N %.1f dB\n",
+               repeatedSpur, repeatedFloor, repeatedNoise);
+        // TPDF on s16: 1/4 LSB^2 of noise under a half-scale tone is -87.3 dB
+        Check(floor < 16.0, "cached tone noise floor shows spurs");
+        Check(noise < -86.0, "cached tone THD+N above -86 dB");
+    }
+
+    // SIMD lanes against the scalar loop, in ragged pieces
+    {
+        CCavernOscillator scalar, simd;
+        scalar.Init(19997, 192000, 0.5f, 0.25f, 1.0, FALSE);
+        simd.Init(19997, 192000, 0.5f, 0.25f, 1.0, TRUE);
+        std::vector<float> a(4096), b(4096);
+        double worst = 0.0;
+        for (size_t frames : { (size_t)4096, (size_t)13, (size_t)1, (size_t)64, (size_t)7, (size_t)1000 }) {
+            scalar.Generate(a.data(), frames);
+            simd.Generate(b.data(), frames);
+            for (size_t i = 0; i < frames; i++) {
+                worst = std::max(worst, (double)std::fabs(a[i] - b[i]));
+            }
+        }
+        printf("  simd vs scalar: %.1e\n", worst);
+#if defined(CAVERN_HAVE_FMA)
+        // The compiler may contract the scalar loop into FMAs
+        Check(worst < 1e-6, "oscillator SIMD != scalar");
+#else
+        Check(worst == 0.0, "oscillator SIMD != scalar");
+#endif
+    }
+
+    // The tone path per 10 ms: synthesize a block of frames, copy each to
+    // every channel
+    const size_t frames = Opt.BlockSamples() / Opt.Channels;
+    std::vector<float> output(g_ToneBlockFrames * Opt.Channels);
+    auto fanOut = [&](const float *Block, size_t Frames) {
+        float *sample = output.data();
+        for (size_t i = 0; i < Frames; i++) {
+            for (uint32_t c = 0; c < Opt.Channels; c++) {
+                *sample++ = Block[i];
+            }
+        }
+    };
+
+    LegacyTone legacy(1000, Opt.Rate, 0.5, 0.0);
+    CCavernOscillator scalar, simd;
+    scalar.Init(1000, Opt.Rate, 0.5f, 0.0f, 0.0, FALSE);
+    simd.Init(1000, Opt.Rate, 0.5f, 0.0f, 0.0, TRUE);
+    CCavernTonePeriod period;
+    period.Init(1000, Opt.Rate, 0.5, 0.0, 0.0);
+    float block[g_ToneBlockFrames];
+
+    auto tonePath = [&](auto &&Generate) {
+        for (size_t n = 0; n < frames; n += g_ToneBlockFrames) {
+            size_t count = std::min(g_ToneBlockFrames, frames - n);
+            Generate(block, count);
+            fanOut(block, count);
+        }
+    };
+
+    // The variants take turns over several rounds and the median round
+    // counts, so clock ramps and neighbours on the machine hit all of them
+    // alike. Each round's timings are per 10 ms block (path) and per
+    // frame (synthesis alone, which the channel copies hide at high
+    // channel counts).
+    const int rounds = 7;
+    Options roundOpt = Opt;
+    roundOpt.Seconds = Opt.Seconds / (2 * rounds);
+    std::vector<double> path[4], alone[4];
+
+    for (int round = 0; round < rounds; round++) {
+        path[0].push_back(TimeIt(roundOpt, [&]() {
+            tonePath([&](float *Block, size_t Count) { legacy.Generate(Block, Count); });
+        }));
+        path[1].push_back(TimeIt(roundOpt, [&]() {
+            tonePath([&](float *Block, size_t Count) { scalar.Generate(Block, Count); });
+        }));
+        path[2].push_back(TimeIt(roundOpt, [&]() {
+            tonePath([&](float *Block, size_t Count) { simd.Generate(Block, Count); });
+        }));
+        path[3].push_back(TimeIt(roundOpt, [&]() {
+            tonePath([&](float *Block, size_t Count) { period.Generate(Block, Count); });
+        }));
+        alone[0].push_back(TimeIt(roundOpt, [&]() { legacy.Generate(block, g_ToneBlockFrames); }) / g_ToneBlockFrames);
+        alone[1].push_back(TimeIt(roundOpt, [&]() { scalar.Generate(block, g_ToneBlockFrames); }) / g_ToneBlockFrames);
+        alone[2].push_back(TimeIt(roundOpt, [&]() { simd.Generate(block, g_ToneBlockFrames); }) / g_ToneBlockFrames);
+        alone[3].push_back(TimeIt(roundOpt, [&]() { period.Generate(block, g_ToneBlockFrames); }) / g_ToneBlockFrames);
+    }
+
+    auto median = [](std::vector<double> &Values) {
+        std::sort(Values.begin(), Values.end());
+        return Values[Values.size() / 2];
+    };
+
+    printf(" %u ch x %u Hz, %zu frames per call, median of %d rounds\n",
+           Opt.Channels, Opt.Rate, g_ToneBlockFrames, rounds);
+    Report(Opt, "sin() per frame", median(path[0]));
+    Report(Opt, "oscillator, scalar", median(path[1]));
+    Report(Opt, "oscillator, simd", median(path[2]));
+    Report(Opt, "cached period", median(path[3]));
+    printf("  synthesis only: sin() %.2f, scalar %.2f, simd %.2f, cached %.2f ns/frame\n",
+           median(alone[0]), median(alone[1]), median(alone[2]), median(alone[3]));
+}
+
+//=============================================================================
+// Latency measurement signals
+//=============================================================================
+
+static const char *g_TestSignalNames[CavernTestSignalCount] = { "none", "sweep", "mls", "id bursts" };
+
+// Stand-in for the path from the driver's capture ring to a receiver:
+// ToneGenerator writes the signal into an s16 ring in 64-frame blocks, the
+// consumer reads it TransportFrames behind in ragged packets, delays each
+// channel for speaker alignment, runs the output limiter, reverses the
+// channel order and adds noise; one channel is wired with its polarity
+// reversed.
+struct LatencyChain
+{
+    uint32_t            Channels;
+    uint32_t            TransportFrames;
+    CCavernTestSignal   Generator;
+    CCavernRequantizer  Requantizer;
+    CAVERN_CONVERTER    Converter;
+    CCavernDelayLine    Delays;
+    CCavernLimiter      Limiter;
+    std::vector<ULONG>  ChannelDelays;      // 1/65536 frame
+    std::vector<int16_t> Ring;
+    size_t              Written;
+    size_t              Read;
+    std::mt19937        Rng;
+
+    LatencyChain(CAVERN_TEST_SIGNAL Kind, uint32_t Channels_, uint32_t Rate, ULONG Order)
+        : Channels(Channels_), TransportFrames(480), Written(0), Read(0), Rng(46)
+    {
+        Generator.Init(Kind, Channels, Rate, Order, 0.5f);
+        Requantizer.Init(CavernSampleS16, Channels, CAVERN_DEFAULT_DITHER, TRUE);
+        CavernSelectConverter(CavernSampleS16, TRUE, &Converter);
+        Delays.Init(Channels, Rate, 10, TRUE);
+        Limiter.Init(Channels, Rate, 1000, 50, -30, TRUE, TRUE);
+
+        // Whole frames on even channels, half and quarter frames on odd ones
+        for (uint32_t c = 0; c < Channels; c++) {
+            ChannelDelays.push_back(((10 + 3 * c) << CAVERN_DELAY_FRACTION_BITS) +
+                                    ((c & 1) ? ((c & 2) ? 0x4000 : 0x8000) : 0));
+        }
+        Delays.SetDelays(ChannelDelays.data(), Channels);
+
+        // The transport lag is silence the reader sees first
+        Ring.assign((size_t)TransportFrames * Channels, 0);
+        Written = TransportFrames;
+    }
+
+    // Expected latency of the source channel Source, in frames
+    double Latency(uint32_t Source) const
+    {
+        return TransportFrames + (double)ChannelDelays[Source] / (1 << CAVERN_DELAY_FRACTION_BITS) + Limiter.GetLatency();
+    }
+
+    // Capture channel a source channel arrives on
+    uint32_t Destination(uint32_t Source) const { return Channels - 1 - Source; }
+
+    void Capture(std::vector<float> &Output, size_t Frames)
+    {
+        std::vector<float> block;
+        std::uniform_real_distribution<float> noise(-1e-3f, 1e-3f);
+
+        while (Read < Frames) {
+            // The writer keeps a little ahead, a tone block at a time
+            while (Written < Read + 2048) {
+                std::vector<float> tone((size_t)g_ToneBlockFrames * Channels);
+                Generator.Generate(tone.data(), g_ToneBlockFrames);
+                Ring.resize((Written + g_ToneBlockFrames) * Channels);
+                Requantizer.Process(tone.data(), Ring.data() + Written * Channels, g_ToneBlockFrames);
+                Written += g_ToneBlockFrames;
+            }
+
+            size_t packet = std::min<size_t>(1 + Rng() % 1000, Frames - Read);
+            block.resize(packet * Channels);
+            Converter.ToFloat(Ring.data() + Read * Channels, block.data(), packet * Channels);
+            Delays.Process(block.data(), packet);
+            Limiter.Process(block.data(), packet);
+
+            for (size_t f = 0; f < packet; f++) {
+                for (uint32_t c = 0; c < Channels; c++) {
+                    float value = block[f * Channels + c];
+                    Output[(Read + f) * Channels + Destination(c)] = ((c == 2) ? -value : value) + noise(Rng);
+                }
+            }
+            Read += packet;
+        }
+    }
+};
+
+static void RunLatency(const Options &Opt)
+{
+    const uint32_t channels = std::min<uint32_t>(Opt.Channels, 8);
+    const uint32_t rate = 48000;
+    const ULONG order = CAVERN_TEST_MAX_ORDER;
+
+    printf("latency: %u ch at %u Hz, 2^%lu-frame excitation, s16 ring, ragged reads, delays, limiter, noise\n",
+           channels, rate, (unsigned long)order);
+
+    // Marker round trip and check byte
+    {
+        bool ok = true;
+        for (ULONGLONG frame : { 0ULL, 1ULL, 48000ULL * 3600 * 24 * 365, (1ULL << CAVERN_TEST_COUNTER_BITS) - 1 }) {
+            for (ULONG channel : { (ULONG)0, (ULONG)7, (ULONG)CAVERN_TEST_ALL_CHANNELS }) {
+                ULONGLONG marker = CavernTestMarker(frame, channel), parsedFrame;
+                ULONG parsedChannel;
+                ok = ok && CavernTestParseMarker(marker, &parsedFrame, &parsedChannel) &&
+                     parsedFrame == frame && parsedChannel == channel;
+                for (ULONG bit = 0; bit < CAVERN_TEST_MARKER_BITS; bit += 5) {
+                    ok = ok && !CavernTestParseMarker(marker ^ (1ULL << bit), &parsedFrame, &parsedChannel);
+                }
+            }
+        }
+        Check(ok, "test signal marker does not round trip or misses a flipped bit");
+    }
+
+    for (int kind = CavernTestSweep; kind < CavernTestSignalCount; kind++) {
+        LatencyChain chain((CAVERN_TEST_SIGNAL)kind, channels, rate, order);
+        CCavernLatencyAnalyzer analyzer;
+        analyzer.Init((CAVERN_TEST_SIGNAL)kind, channels, rate, order, TRUE);
+
+        const size_t window = analyzer.GetWindowFrames();
+        const size_t period = chain.Generator.GetPeriodFrames();
+        const size_t frames = 10 * period;
+        std::vector<float> capture(frames * channels);
+        chain.Capture(capture, frames);
+
+        // Windows at odd offsets, so markers get cut off at the start too
+        std::vector<CAVERN_LATENCY_RESULT> results(channels);
+        double worst = 0.0, weakest = 1e9;
+        size_t windows = 0, found = 0, wrong = 0;
+        for (size_t first = period / 3; first + window <= frames; first += period / 3 + 1001) {
+            analyzer.Analyze(capture.data() + first * channels, first, results.data());
+            windows++;
+
+            for (uint32_t c = 0; c < channels; c++) {
+                const CAVERN_LATENCY_RESULT &r = results[c];
+                if (!r.Found) {
+                    // Only ID bursts leave channels without an excitation
+                    wrong += (kind != CavernTestIdBurst);
+                    continue;
+                }
+                found++;
+
+                uint32_t source = (r.SourceChannel == CAVERN_TEST_ALL_CHANNELS) ? channels - 1 - c : r.SourceChannel;
+                if (chain.Destination(source) != c || r.Inverted != (source == 2) ||
+                    (kind != CavernTestIdBurst) != (r.SourceChannel == CAVERN_TEST_ALL_CHANNELS)) {
+                    wrong++;
+                    continue;
+                }
+                worst = std::max(worst, std::fabs(r.Latency - chain.Latency(source)));
+                weakest = std::min(weakest, (double)r.PeakDb);
+            }
+        }
+
+        printf("  %-9s %zu windows, %zu channel hits, %zu wrong: latency error %.3f frames, weakest peak %.1f dB\n",
+               g_TestSignalNames[kind], windows, found, wrong, worst, weakest);
+        Check(wrong == 0, "latency analyzer missed or misread a channel");
+        Check(found >= windows * (kind == CavernTestIdBurst ? 1 : channels), "latency analyzer found too few excitations");
+        Check(worst < 0.2, "latency analyzer off by more than 0.2 frames");
+
+        if (kind == CavernTestMls) {
+            double ns = TimeIt(Opt, [&]() { analyzer.Analyze(capture.data(), 0, results.data()); });
+            printf("  analysis of one %zu-frame window: %.2f ms (%.0fx real time)\n",
+                   window, ns / 1e6, (double)window / rate * 1e9 / ns);
+        }
+    }
+
+    // Generation cost per frame, as the capture pin's DPC pays it
+    CCavernTestSignal generator;
+    generator.Init(CavernTestMls, Opt.Channels, Opt.Rate, order, 0.5f);
+    std::vector<float> block(Opt.BlockSamples());
+    Report(Opt, "mls generation", TimeIt(Opt, [&]() {
+        generator.Generate(block.data(), block.size() / Opt.Channels);
+    }));
+}
+
+//=============================================================================
+// main
+//=============================================================================
+
+static void Usage()
+{
+    fprintf(stderr,
+        "usage: cavern_dsp_bench [all|convert|remap|mix|meter|gain|src|silence|dither|loopback|streams|delay|eq|conv|limit|tone|latency]\n"
+        "       [--channels N] [--rate HZ] [--seconds S]\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options &Opt)
+{
+    int i = 1;
+
+    if (i < argc && argv[i][0] != '-') {
+        Opt.Suite = argv[i++];
+    }
+
+    for (; i < argc; i++) {
+        std::string arg = argv[i];
+        const char *value = (i + 1 < argc) ? argv[i + 1] : nullptr;
+
+        if (!value) {
+            return false;
+        }
+        i++;
+
+        if (arg == "--channels") Opt.Channels = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--rate") Opt.Rate = (uint32_t)strtoul(value, nullptr, 0);
+        else if (arg == "--seconds") Opt.Seconds = strtod(value, nullptr);
+        else return false;
+    }
+
+    return Opt.Channels && Opt.Rate >= 100 && Opt.Seconds > 0;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!ParseArgs(argc, argv, opt)) {
+        Usage();
+        return 2;
+    }
+
+    bool all = opt.Suite == "all";
+    bool ran = false;
+
+    if (all || opt.Suite == "convert") {
+        RunConvert(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "remap") {
+        RunRemap(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "mix") {
+        RunMix(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "meter") {
+        RunMeter(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "gain") {
+        RunGain(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "src") {
+        RunSrc(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "silence") {
+        RunSilence(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "dither") {
+        RunDither(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "loopback") {
+        RunLoopback(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "streams") {
+        RunStreams(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "delay") {
+        RunDelay(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "eq") {
+        RunEq(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "conv") {
+        RunConv(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "limit") {
+        RunLimit(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "tone") {
+        RunTone(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "latency") {
+        RunLatency(opt);
+        ran = true;
+    }
+
+    if (!ran) {
+        Usage();
+        return 2;
+    }
+
+    if (g_Failures) {
+        printf("%d check(s) failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}
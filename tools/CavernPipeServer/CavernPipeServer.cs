@@ -20,9 +20,24 @@ namespace CavernPipeServer
         private const int SNAPSERVER_PORT = 1705;
         private const int BUFFER_SIZE = 65536;
         
+        // Packet framing of the pipe (CAVERN_PIPE_PACKET in CavernPipePacket.h):
+        // "CAVP", type, reserved, payload length, check; then the payload
+        private const uint PACKET_MAGIC = 0x50564143;
+        private const int PACKET_HEADER_SIZE = 16;
+        private const ushort PACKET_AUDIO = 1;
+        private const ushort PACKET_SILENCE = 2;
+        private const int PACKET_MAX_LENGTH = 16 * 1024 * 1024;
+        
+        // Payload of a silence packet (CAVERN_SILENCE_MARKER in
+        // CavernSilenceGate.h): frame count, frame size, fill byte, reserved.
+        // It never stands for more than PACKET_MAX_LENGTH bytes.
+        private const int SILENCE_MARKER_SIZE = 8;
+        
         private static bool _running = true;
         private static long _totalBytesReceived = 0;
         private static long _packetsReceived = 0;
+        private static long _silentFramesReceived = 0;
+        private static long _bytesSkipped = 0;
         private static DateTime _startTime;
         
         static async Task Main(string[] args)
@@ -93,7 +108,16 @@ namespace CavernPipeServer
         
         static async Task HandleClientAsync(NamedPipeServerStream pipeServer)
         {
-            var buffer = new byte[BUFFER_SIZE];
+            // Room in front of each read for a header and marker cut by the
+            // previous one; audio payloads are forwarded as they arrive
+            var buffer = new byte[PACKET_HEADER_SIZE + SILENCE_MARKER_SIZE + BUFFER_SIZE];
+            var silence = new byte[BUFFER_SIZE];
+            int filled = 0;
+            int audioRemaining = 0;
+            bool synced = false;
+            bool formatLogged = false;
+            bool idle = false;
+            long idleFrames = 0;
             
             // Connect to snapserver
             TcpClient snapClient = null;
@@ -112,16 +136,74 @@ namespace CavernPipeServer
                 Console.WriteLine("[Audio will be logged but not forwarded]");
             }
             
-            // Also create a file for raw capture (for debugging)
+            // Also create a file for raw capture (for debugging). It is
+            // flushed when the session ends, not on every read.
             var captureFile = $"cavern_capture_{DateTime.Now:yyyyMMdd_HHmmss}.raw";
             await using var fileStream = new FileStream(captureFile, FileMode.Create, FileAccess.Write);
             Console.WriteLine($"[Capturing to: {captureFile}]");
             
+            // Audio goes to the capture file and on to Snapserver
+            async Task ForwardAudioAsync(int offset, int count)
+            {
+                if (count == 0)
+                {
+                    return;
+                }
+                
+                if (idle)
+                {
+                    Console.WriteLine($"[Signal resumed after {idleFrames:N0} silent frames]");
+                    idle = false;
+                }
+                
+                await fileStream.WriteAsync(buffer, offset, count);
+                
+                // Forward to snapserver if connected
+                if (snapStream != null && snapClient?.Connected == true)
+                {
+                    try
+                    {
+                        await snapStream.WriteAsync(buffer, offset, count);
+                    }
+                    catch
+                    {
+                        Console.WriteLine("[Snapserver connection lost]");
+                        snapStream?.Dispose();
+                        snapClient?.Dispose();
+                        snapStream = null;
+                        snapClient = null;
+                    }
+                }
+            }
+            
+            // Silence is expanded in the capture file so it keeps the
+            // stream's timeline, but is not sent to Snapserver. The marker
+            // was checked against PACKET_MAX_LENGTH, which bounds the fill.
+            async Task WriteSilenceAsync(long frames, int frameBytes, byte fill)
+            {
+                if (!idle)
+                {
+                    Console.WriteLine("[Idle: driver sending silence packets]");
+                    idle = true;
+                    idleFrames = 0;
+                }
+                idleFrames += frames;
+                _silentFramesReceived += frames;
+                
+                Array.Fill(silence, fill);
+                for (long remaining = frames * frameBytes; remaining > 0; )
+                {
+                    int count = (int)Math.Min(remaining, silence.Length);
+                    await fileStream.WriteAsync(silence, 0, count);
+                    remaining -= count;
+                }
+            }
+            
             try
             {
                 while (_running && pipeServer.IsConnected)
                 {
-                    int bytesRead = await pipeServer.ReadAsync(buffer, 0, buffer.Length);
+                    int bytesRead = await pipeServer.ReadAsync(buffer, filled, BUFFER_SIZE);
                     
                     if (bytesRead == 0)
                     {
@@ -133,33 +215,92 @@ namespace CavernPipeServer
                     _totalBytesReceived += bytesRead;
                     _packetsReceived++;
                     
-                    // Write to capture file
-                    await fileStream.WriteAsync(buffer, 0, bytesRead);
-                    await fileStream.FlushAsync();
+                    int available = filled + bytesRead;
+                    int position = 0;
                     
-                    // Forward to snapserver if connected
-                    if (snapStream != null && snapClient?.Connected == true)
+                    for (;;)
                     {
-                        try
+                        // The rest of an audio payload needs no parsing
+                        if (audioRemaining > 0)
                         {
-                            await snapStream.WriteAsync(buffer, 0, bytesRead);
+                            int count = Math.Min(audioRemaining, available - position);
+                            await ForwardAudioAsync(position, count);
+                            position += count;
+                            audioRemaining -= count;
+                            
+                            if (audioRemaining > 0)
+                            {
+                                break;
+                            }
                         }
-                        catch
+                        
+                        if (available - position < PACKET_HEADER_SIZE)
                         {
-                            Console.WriteLine("[Snapserver connection lost]");
-                            snapStream?.Dispose();
-                            snapClient?.Dispose();
-                            snapStream = null;
-                            snapClient = null;
+                            break;
+                        }
+                        
+                        ushort type = BitConverter.ToUInt16(buffer, position + 4);
+                        int length = ReadPacketLength(buffer, position);
+                        
+                        if (length >= 0 && type == PACKET_SILENCE &&
+                            available - position < PACKET_HEADER_SIZE + SILENCE_MARKER_SIZE)
+                        {
+                            // The marker is in the next read
+                            break;
+                        }
+                        
+                        if (length >= 0 && type == PACKET_SILENCE &&
+                            !IsSilenceMarker(buffer, position + PACKET_HEADER_SIZE, length))
+                        {
+                            length = -1;
+                        }
+                        
+                        if (length < 0)
+                        {
+                            // No packet here: the pipe connected mid-packet
+                            // or the stream is damaged. Look one byte on.
+                            if (synced)
+                            {
+                                Console.WriteLine("[Lost packet sync]");
+                                synced = false;
+                            }
+                            _bytesSkipped++;
+                            position++;
+                            continue;
+                        }
+                        
+                        synced = true;
+                        position += PACKET_HEADER_SIZE;
+                        
+                        if (type == PACKET_SILENCE)
+                        {
+                            uint frames = BitConverter.ToUInt32(buffer, position);
+                            ushort frameBytes = BitConverter.ToUInt16(buffer, position + 4);
+                            await WriteSilenceAsync(frames, frameBytes, buffer[position + 6]);
+                            position += SILENCE_MARKER_SIZE;
+                        }
+                        else
+                        {
+                            // Detect format for logging (first audio packet only)
+                            if (!formatLogged && length > 0)
+                            {
+                                DetectAndLogFormat(buffer, position, Math.Min(length, available - position));
+                                formatLogged = true;
+                            }
+                            audioRemaining = length;
                         }
                     }
                     
-                    // Detect format for logging (first packet only)
-                    if (_packetsReceived == 1)
+                    // Keep a header or marker cut by this read
+                    filled = available - position;
+                    if (filled > 0)
                     {
-                        DetectAndLogFormat(buffer, bytesRead);
+                        Buffer.BlockCopy(buffer, position, buffer, 0, filled);
                     }
                 }
+                
+                // A header that never completed carried nothing
+                _bytesSkipped += filled;
             }
             catch (IOException)
             {
@@ -173,14 +314,55 @@ namespace CavernPipeServer
             {
                 snapStream?.Dispose();
                 snapClient?.Dispose();
-                Console.WriteLine($"[Session ended - Captured: {_totalBytesReceived:N0} bytes]");
+                Console.WriteLine($"[Session ended - Captured: {_totalBytesReceived:N0} bytes, {_silentFramesReceived:N0} frames as silence packets, {_bytesSkipped:N0} bytes out of sync]");
+            }
+        }
+        
+        /// <summary>
+        /// Payload length of the packet header at offset, or -1 if the bytes
+        /// there are not a header (CavernIsPipePacket in CavernPipePacket.h).
+        /// </summary>
+        static int ReadPacketLength(byte[] buffer, int offset)
+        {
+            uint magic = BitConverter.ToUInt32(buffer, offset);
+            ushort type = BitConverter.ToUInt16(buffer, offset + 4);
+            ushort reserved = BitConverter.ToUInt16(buffer, offset + 6);
+            uint length = BitConverter.ToUInt32(buffer, offset + 8);
+            uint check = BitConverter.ToUInt32(buffer, offset + 12);
+            
+            if (magic != PACKET_MAGIC || (type != PACKET_AUDIO && type != PACKET_SILENCE) ||
+                reserved != 0 || length > PACKET_MAX_LENGTH ||
+                check != ~(length ^ unchecked(type * 0x9E3779B1u)))
+            {
+                return -1;
             }
+            
+            return (int)length;
         }
         
-        static void DetectAndLogFormat(byte[] buffer, int length)
+        /// <summary>
+        /// True if the silence packet payload at offset is a marker that
+        /// expands to no more than PACKET_MAX_LENGTH bytes.
+        /// </summary>
+        static bool IsSilenceMarker(byte[] buffer, int offset, int length)
+        {
+            if (length != SILENCE_MARKER_SIZE)
+            {
+                return false;
+            }
+            
+            uint frames = BitConverter.ToUInt32(buffer, offset);
+            ushort frameBytes = BitConverter.ToUInt16(buffer, offset + 4);
+            
+            return frameBytes != 0 && (long)frames * frameBytes <= PACKET_MAX_LENGTH;
+        }
+        
+        static void DetectAndLogFormat(byte[] data, int offset, int length)
         {
             if (length < 4) return;
             
+            var buffer = new ReadOnlySpan<byte>(data, offset, length);
+            
             // Check for AC3/E-AC3 (0x0B77)
             if (buffer[0] == 0x0B && buffer[1] == 0x77)
             {
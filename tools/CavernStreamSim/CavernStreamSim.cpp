@@ -0,0 +1,994 @@
+/***************************************************************************
+ * CavernStreamSim.cpp
+ *
+ * Linux simulator for the Cavern render stream's control and forwarding
+ * paths. It runs the driver's portable code against a model of the
+ * miniport on a simulated millisecond clock, and checks the ordering and
+ * framing the driver depends on.
+ *
+ * state   KSSTATE transitions (CavernSysvad/CavernStreamState.h). Every
+ *         plan is executed action by action against a model stream: the
+ *         position timer must start last on RUN, after the output is
+ *         acquired, connected (or the mix started) and the clock stamped,
+ *         and stop first on the way down, before the position is caught up
+ *         or the output released. STOP->ACQUIRE->PAUSE->RUN->PAUSE->STOP
+ *         must acquire and connect the output once, however often PAUSE
+ *         and RUN toggle, forward exactly the bytes of the time spent in
+ *         RUN, and deliver the first byte on the first timer tick when the
+ *         pipe was pre-warmed. Bitstream and mixed streams, a failing
+ *         AcquireOutput, skipped states and a long random walk are run.
+ *
+ * align   Frame-aligned forwarding (CavernSysvad/CavernFrameAligner.h).
+ *         IEC 61937 AC-3, E-AC-3 and MAT bursts are pushed in 1 ms DMA
+ *         runs and in ragged runs, with the escape hatch the driver sets
+ *         up (CAVERN_MAX_FORWARD_LATENCY_MS at 48 kHz stereo s16). Every
+ *         write must be whole bursts starting on a preamble, with no
+ *         forced flush, and the data must come out unchanged. A stream
+ *         without sync must still be forwarded within the latency budget,
+ *         a truncated burst must be recovered from, and PCM must be cut
+ *         at nBlockAlign.
+ *
+ * packets Packet mode and end of stream (CavernSysvad/CavernPacketState.h).
+ *         A model audio engine writes each packet of a two-packet DMA
+ *         buffer as SetWritePacket expects it and flags a random packet as
+ *         EOS with a random length; the timer reads the buffer at the
+ *         stream rate through the frame aligner. Every byte up to the EOS
+ *         byte, and none after it, must reach the sink, flushed on the
+ *         tick that reaches EOS, and GetReadPacket must report the EOS
+ *         packet. Wrong packet numbers, packets after EOS, EOS behind a
+ *         paused position and 32-bit packet number wrap are checked too.
+ *
+ * Build (from the repository root):
+ *   g++ -O2 -std=c++17 -ICavernSysvad -o cavern_stream_sim \
+ *       tools/CavernStreamSim/CavernStreamSim.cpp CavernSysvad/CavernStreamState.cpp \
+ *       CavernSysvad/CavernFrameAligner.cpp CavernSysvad/CavernPacketState.cpp
+ *
+ * Usage:
+ *   cavern_stream_sim [all|state|align|packets] [--connect-ms MS] [--steps N] [--seed N]
+ *
+ * --connect-ms is how long the pipe server takes to accept a connection
+ * (default 8); --steps and --seed drive the random walk and the packet
+ * sequences. Exit status is 1
+ * if any check fails.
+ ***************************************************************************/
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define NOMINMAX
+#include "CavernStreamState.h"
+#include "CavernFrameAligner.h"
+#include "CavernPacketState.h"
+
+struct Options
+{
+    std::string Suite = "all";
+    uint64_t    ConnectMs = 8;
+    uint32_t    Steps = 100000;
+    uint32_t    Seed = 1;
+};
+
+static int g_Failures = 0;
+
+static void Check(bool Condition, const char *What)
+{
+    if (!Condition) {
+        printf("  FAIL: %s\n", What);
+        g_Failures++;
+    }
+}
+
+static const char *g_StateNames[] = { "STOP", "ACQUIRE", "RUN", "PAUSE" };
+
+//=============================================================================
+// Model miniport and stream
+//=============================================================================
+
+// The miniport's output as the streams see it: the pipe writer, which
+// connects on its own once started, and the mix
+struct SimOutput
+{
+    uint64_t    Now = 0;                // ms
+    uint64_t    ConnectMs = 8;
+    bool        WriterRunning = false;
+    uint64_t    ConnectedAt = 0;        // valid while WriterRunning
+    int         WriterStarts = 0;
+    int         Users = 0;              // streams holding the output
+    int         MixRunning = 0;
+    bool        Armed = false;
+    uint64_t    RunAt = 0;
+    bool        FirstByteSeen = false;
+    uint64_t    FirstByteLatency = 0;
+
+    void StartWriter()
+    {
+        if (!WriterRunning) {
+            WriterRunning = true;
+            ConnectedAt = Now + ConnectMs;
+            WriterStarts++;
+        }
+    }
+
+    void Arm()
+    {
+        Armed = true;
+        RunAt = Now;
+        FirstByteSeen = false;
+    }
+
+    // Bytes queued at Now reach the server once the pipe is up
+    void Deliver()
+    {
+        if (Armed && !FirstByteSeen) {
+            uint64_t at = Now > ConnectedAt ? Now : ConnectedAt;
+
+            FirstByteLatency = at - RunAt;
+            FirstByteSeen = true;
+        }
+    }
+};
+
+struct SimStream
+{
+    SimOutput          *Output = nullptr;
+    CAVERN_STREAM_STATUS Status = {};
+    uint32_t            BytesPerMs = 768;   // 48 kHz, 8 ch, s16
+    bool                FailAcquire = false;
+
+    uint64_t            Stamp = 0;
+    uint64_t            Position = 0;
+    uint64_t            Forwarded = 0;
+    uint64_t            RunMs = 0;          // time spent in RUN
+
+    int                 Counts[CavernActionCount] = {};
+
+    SimStream(SimOutput *Out, bool Mixed)
+    {
+        Output = Out;
+        Status.State = CavernStateStop;
+        Status.Mixed = Mixed;
+    }
+
+    void UpdatePosition()
+    {
+        uint64_t bytes = (Output->Now - Stamp) * BytesPerMs;
+
+        Check(Status.OutputAcquired, "position advanced without an output");
+        Position += bytes;
+        Stamp = Output->Now;
+
+        if (bytes && Status.OutputAcquired) {
+            Forwarded += bytes;
+            if (!Status.Mixed || Output->MixRunning) {
+                Output->Deliver();
+            }
+        }
+    }
+
+    void Tick()
+    {
+        if (Status.TimerRunning) {
+            UpdatePosition();
+        }
+        if (Status.State == CavernStateRun) {
+            RunMs++;
+        }
+    }
+
+    // Runs the plan as SetState does, checking each step
+    bool SetState(CAVERN_STREAM_STATE Target)
+    {
+        CAVERN_STATE_PLAN plan;
+        bool stamped = false;
+        bool connected = false;
+
+        CavernPlanStateChange(&Status, Target, &plan);
+
+        for (ULONG i = 0; i < plan.Count; i++) {
+            CAVERN_STATE_ACTION action = plan.Actions[i];
+
+            Counts[action]++;
+
+            switch (action) {
+                case CavernActionStopTimer:
+                    Check(i == 0, "StopTimer is not the first action");
+                    Check(Status.TimerRunning, "StopTimer with the timer stopped");
+                    Status.TimerRunning = FALSE;
+                    break;
+
+                case CavernActionCatchUp:
+                    Check(!Status.TimerRunning, "CatchUp with the timer running");
+                    UpdatePosition();
+                    break;
+
+                case CavernActionStopMix:
+                    Check(!Status.TimerRunning, "StopMix with the timer running");
+                    Check(Status.MixStarted, "StopMix without StartMix");
+                    Output->MixRunning--;
+                    Status.MixStarted = FALSE;
+                    break;
+
+                case CavernActionReleaseOutput:
+                    Check(!Status.TimerRunning, "ReleaseOutput with the timer running");
+                    Check(!Status.MixStarted, "ReleaseOutput before StopMix");
+                    Check(Status.OutputAcquired, "ReleaseOutput without an output");
+                    if (--Output->Users == 0) {
+                        Output->WriterRunning = false;
+                        Output->Armed = false;
+                    }
+                    Status.OutputAcquired = FALSE;
+                    break;
+
+                case CavernActionResetPosition:
+                    Check(!Status.TimerRunning, "ResetPosition with the timer running");
+                    Check(!Status.OutputAcquired, "ResetPosition with the output held");
+                    Position = 0;
+                    break;
+
+                case CavernActionAcquireOutput:
+                    Check(!Status.OutputAcquired, "AcquireOutput twice");
+                    if (FailAcquire) {
+                        return false;
+                    }
+                    // Open starts the writer, which pre-warms the pipe
+                    Output->Users++;
+                    Output->StartWriter();
+                    Status.OutputAcquired = TRUE;
+                    break;
+
+                case CavernActionStartMix:
+                    Check(Status.Mixed, "StartMix on a bitstream");
+                    Check(Status.OutputAcquired, "StartMix without an output");
+                    if (Output->MixRunning++ == 0) {
+                        Output->Arm();
+                    }
+                    Status.MixStarted = TRUE;
+                    break;
+
+                case CavernActionConnect:
+                    Check(!Status.Mixed, "Connect on a mixed stream");
+                    Check(Status.OutputAcquired, "Connect without an output");
+                    Output->Arm();
+                    connected = true;
+                    break;
+
+                case CavernActionStampClock:
+                    Stamp = Output->Now;
+                    stamped = true;
+                    break;
+
+                case CavernActionStartTimer:
+                    Check(i + 1 == plan.Count, "StartTimer is not the last action");
+                    Check(Status.OutputAcquired, "StartTimer without an output");
+                    Check(stamped, "StartTimer before the clock is stamped");
+                    Check(Status.Mixed ? Status.MixStarted : connected,
+                          "StartTimer before the output is started");
+                    Status.TimerRunning = TRUE;
+                    break;
+
+                default:
+                    Check(false, "unknown action");
+                    break;
+            }
+        }
+
+        Status.State = Target;
+
+        Check((Target == CavernStateRun) == !!Status.TimerRunning, "timer running outside RUN");
+        Check((Target == CavernStateRun && Status.Mixed) == !!Status.MixStarted, "mix started outside RUN");
+        Check((Target != CavernStateStop) == !!Status.OutputAcquired, "output held outside ACQUIRE..RUN");
+        return true;
+    }
+};
+
+static void Advance(SimOutput &Output, std::vector<SimStream *> Streams, uint64_t Ms)
+{
+    for (uint64_t i = 0; i < Ms; i++) {
+        Output.Now++;
+        for (SimStream *stream : Streams) {
+            stream->Tick();
+        }
+    }
+}
+
+static void PrintPlan(const CAVERN_STREAM_STATUS &Status, CAVERN_STREAM_STATE Target)
+{
+    CAVERN_STATE_PLAN plan;
+    std::string line;
+
+    CavernPlanStateChange(&Status, Target, &plan);
+    for (ULONG i = 0; i < plan.Count; i++) {
+        line += i ? ", " : "";
+        line += CavernStateActionName(plan.Actions[i]);
+    }
+
+    printf("  %-7s -> %-7s : %s\n", g_StateNames[Status.State], g_StateNames[Target],
+           line.empty() ? "(nothing)" : line.c_str());
+}
+
+//=============================================================================
+// state
+//=============================================================================
+
+// STOP->ACQUIRE->PAUSE->RUN->PAUSE->RUN->PAUSE->STOP with the given dwell
+// times; returns the first-byte latency of the first RUN
+static uint64_t RunToggleSequence(const Options &Opt, bool Mixed, uint64_t AcquireMs, const char *Name)
+{
+    SimOutput output;
+    SimStream stream(&output, Mixed);
+    std::vector<SimStream *> all = { &stream };
+    char what[128];
+
+    output.ConnectMs = Opt.ConnectMs;
+
+    stream.SetState(CavernStateAcquire);
+    Advance(output, all, AcquireMs);
+    stream.SetState(CavernStatePause);
+    Advance(output, all, 3);
+
+    stream.SetState(CavernStateRun);
+    Advance(output, all, 100);
+    uint64_t firstByte = output.FirstByteLatency;
+    bool seen = output.FirstByteSeen;
+
+    stream.SetState(CavernStatePause);
+    uint64_t pausedAt = stream.Forwarded;
+    Advance(output, all, 30);
+    snprintf(what, sizeof(what), "%s: bytes forwarded while paused", Name);
+    Check(stream.Forwarded == pausedAt, what);
+
+    stream.SetState(CavernStateRun);
+    Advance(output, all, 50);
+    stream.SetState(CavernStatePause);
+    Advance(output, all, 5);
+    uint64_t position = stream.Position;
+    stream.SetState(CavernStateStop);
+
+    snprintf(what, sizeof(what), "%s: output acquired more than once", Name);
+    Check(stream.Counts[CavernActionAcquireOutput] == 1 && stream.Counts[CavernActionReleaseOutput] == 1, what);
+    snprintf(what, sizeof(what), "%s: pipe reopened across PAUSE/RUN", Name);
+    Check(output.WriterStarts == 1, what);
+    snprintf(what, sizeof(what), "%s: timer not started and stopped twice", Name);
+    Check(stream.Counts[CavernActionStartTimer] == 2 && stream.Counts[CavernActionStopTimer] == 2, what);
+    snprintf(what, sizeof(what), "%s: bytes forwarded differ from the time in RUN", Name);
+    Check(position == 150ull * stream.BytesPerMs && stream.Forwarded == position, what);
+    snprintf(what, sizeof(what), "%s: no first byte", Name);
+    Check(seen, what);
+    snprintf(what, sizeof(what), "%s: not released on STOP", Name);
+    Check(!output.WriterRunning && output.MixRunning == 0 && output.Users == 0 && stream.Position == 0, what);
+
+    if (Mixed) {
+        snprintf(what, sizeof(what), "%s: mix not joined and left twice", Name);
+        Check(stream.Counts[CavernActionStartMix] == 2 && stream.Counts[CavernActionStopMix] == 2, what);
+    }
+
+    printf("  %-34s first byte %3llu ms after RUN, %llu bytes in 150 ms of RUN\n",
+           Name, (unsigned long long)firstByte, (unsigned long long)position);
+    return firstByte;
+}
+
+static void RunState(const Options &Opt)
+{
+    printf("state: KSSTATE transitions, pipe connect takes %llu ms\n", (unsigned long long)Opt.ConnectMs);
+
+    // The plans themselves, for the record
+    CAVERN_STREAM_STATUS status = {};
+    status.Mixed = FALSE;
+    status.State = CavernStateStop;
+    PrintPlan(status, CavernStateAcquire);
+    status.OutputAcquired = TRUE;
+    status.State = CavernStatePause;
+    PrintPlan(status, CavernStateRun);
+    status.State = CavernStateRun;
+    status.TimerRunning = TRUE;
+    PrintPlan(status, CavernStatePause);
+    status.TimerRunning = FALSE;
+    status.State = CavernStatePause;
+    PrintPlan(status, CavernStateStop);
+    status.Mixed = TRUE;
+    status.MixStarted = TRUE;
+    status.TimerRunning = TRUE;
+    status.State = CavernStateRun;
+    PrintPlan(status, CavernStatePause);
+
+    // With the pipe pre-warmed during ACQUIRE/PAUSE the first tick goes
+    // straight out; RUN right after ACQUIRE still waits for the server
+    uint64_t warm = RunToggleSequence(Opt, false, Opt.ConnectMs + 10, "bitstream, pre-warmed");
+    uint64_t cold = RunToggleSequence(Opt, false, 0, "bitstream, RUN at once");
+    RunToggleSequence(Opt, true, Opt.ConnectMs + 10, "mixed, pre-warmed");
+
+    Check(warm == 1, "pre-warmed pipe: first byte not on the first tick");
+    Check(cold <= Opt.ConnectMs, "first byte later than the pipe connect");
+
+    // A failing AcquireOutput leaves the stream in STOP with nothing held
+    {
+        SimOutput output;
+        SimStream stream(&output, true);
+
+        output.ConnectMs = Opt.ConnectMs;
+        stream.FailAcquire = true;
+        Check(!stream.SetState(CavernStateAcquire), "failed acquire reported as success");
+        Check(stream.Status.State == CavernStateStop && !stream.Status.OutputAcquired && output.Users == 0,
+              "failed acquire left state behind");
+        stream.FailAcquire = false;
+        Check(stream.SetState(CavernStateAcquire) && stream.Status.OutputAcquired, "acquire after a failure");
+        stream.SetState(CavernStateStop);
+        Check(output.Users == 0, "output held after STOP");
+        printf("  %-34s ok\n", "failed AcquireOutput");
+    }
+
+    // KS steps through the states, but skipped ones are still handled
+    {
+        SimOutput output;
+        SimStream stream(&output, false);
+        std::vector<SimStream *> all = { &stream };
+
+        output.ConnectMs = Opt.ConnectMs;
+        stream.SetState(CavernStateRun);
+        Advance(output, all, 20);
+        stream.SetState(CavernStateStop);
+        Check(stream.Forwarded == 20ull * stream.BytesPerMs, "STOP->RUN->STOP forwarded the wrong bytes");
+        Check(output.Users == 0 && !stream.Status.TimerRunning, "RUN->STOP left the output or timer");
+        printf("  %-34s ok\n", "STOP->RUN->STOP");
+    }
+
+    // Random walk over the legal transitions: two mixed streams sharing
+    // the mix, and a bitstream on its own output
+    {
+        std::mt19937 rng(Opt.Seed);
+        SimOutput mixOutput;
+        SimOutput pipeOutput;
+        SimStream a(&mixOutput, true);
+        SimStream b(&mixOutput, true);
+        SimStream c(&pipeOutput, false);
+        SimStream *streams[] = { &a, &b, &c };
+        std::vector<SimStream *> onMix = { &a, &b };
+        std::vector<SimStream *> onPipe = { &c };
+
+        mixOutput.ConnectMs = pipeOutput.ConnectMs = Opt.ConnectMs;
+
+        for (uint32_t step = 0; step < Opt.Steps; step++) {
+            SimStream *stream = streams[rng() % 3];
+            CAVERN_STREAM_STATE state = stream->Status.State;
+            CAVERN_STREAM_STATE next;
+
+            // KS order: STOP <-> ACQUIRE <-> PAUSE <-> RUN
+            switch (state) {
+                case CavernStateStop:    next = CavernStateAcquire; break;
+                case CavernStateAcquire: next = rng() & 1 ? CavernStatePause : CavernStateStop; break;
+                case CavernStatePause:   next = rng() & 1 ? CavernStateRun : CavernStateAcquire; break;
+                default:                 next = CavernStatePause; break;
+            }
+            if (stream->SetState(next) && next == CavernStateStop) {
+                Check(stream->Position == 0, "position not reset on STOP");
+            }
+
+            uint64_t dwell = rng() % 6;
+            Advance(mixOutput, onMix, dwell);
+            Advance(pipeOutput, onPipe, dwell);
+
+            Check(mixOutput.MixRunning == (int)a.Status.MixStarted + (int)b.Status.MixStarted,
+                  "mix run count out of step with the streams");
+        }
+
+        for (SimStream *stream : streams) {
+            stream->SetState(CavernStatePause);
+            Check(stream->Forwarded == stream->RunMs * stream->BytesPerMs,
+                  "random walk: bytes forwarded differ from the time in RUN");
+            stream->SetState(CavernStateStop);
+        }
+        Check(mixOutput.Users == 0 && pipeOutput.Users == 0 && mixOutput.MixRunning == 0,
+              "random walk: output held at the end");
+
+        printf("  %-34s %u transitions, %d/%d/%d timer starts\n", "random walk", Opt.Steps,
+               a.Counts[CavernActionStartTimer], b.Counts[CavernActionStartTimer],
+               c.Counts[CavernActionStartTimer]);
+    }
+}
+
+//=============================================================================
+// align
+//=============================================================================
+
+// Collects what the aligner forwards
+struct AlignSink
+{
+    std::vector<uint8_t>    Data;
+    std::vector<uint32_t>   Writes;
+
+    static NTSTATUS Sink(PVOID Context, const BYTE *Buffer, ULONG Length)
+    {
+        AlignSink *sink = (AlignSink *)Context;
+
+        sink->Data.insert(sink->Data.end(), Buffer, Buffer + Length);
+        sink->Writes.push_back(Length);
+        return STATUS_SUCCESS;
+    }
+};
+
+// IEC 61937 bursts of the given data type and repetition period, each
+// with a distinct payload that never contains a preamble
+static std::vector<uint8_t> MakeBursts(uint32_t DataType, uint32_t PeriodBytes, uint32_t Bursts)
+{
+    std::vector<uint8_t> stream((size_t)PeriodBytes * Bursts, 0);
+
+    for (uint32_t b = 0; b < Bursts; b++) {
+        uint8_t *burst = stream.data() + (size_t)b * PeriodBytes;
+        uint32_t payload = PeriodBytes / 2;
+
+        burst[0] = 0x72;
+        burst[1] = 0xF8;
+        burst[2] = 0x1F;
+        burst[3] = 0x4E;
+        burst[4] = (uint8_t)DataType;
+        burst[5] = 0;
+        burst[6] = (uint8_t)(payload * 8);
+        burst[7] = (uint8_t)((payload * 8) >> 8);
+        for (uint32_t i = 8; i < 8 + payload; i++) {
+            burst[i] = (uint8_t)((b + i) & 0x3F);
+        }
+    }
+
+    return stream;
+}
+
+struct AlignResult
+{
+    uint32_t    Writes = 0;
+    uint32_t    Forced = 0;
+    uint32_t    MaxHeld = 0;
+    bool        Intact = false;
+};
+
+// Pushes Stream in runs of Push bytes (0: random 1..5000) and flushes
+static AlignResult PushAll(const std::vector<uint8_t> &Stream, CAVERN_FORWARD_MODE Mode, ULONG BlockAlign,
+                           ULONG LatencyBytes, uint32_t Push, AlignSink &Sink)
+{
+    CCavernFrameAligner aligner;
+    AlignResult result;
+    std::mt19937 rng(7);
+    size_t pos = 0;
+
+    if (!NT_SUCCESS(aligner.Init(Mode, BlockAlign, CAVERN_FORWARD_STAGING_SIZE, LatencyBytes,
+                                 AlignSink::Sink, &Sink))) {
+        Check(false, "aligner init");
+        return result;
+    }
+
+    while (pos < Stream.size()) {
+        size_t run = Push ? Push : 1 + rng() % 5000;
+
+        run = std::min(run, Stream.size() - pos);
+        aligner.Push(Stream.data() + pos, (ULONG)run);
+        pos += run;
+        result.MaxHeld = std::max(result.MaxHeld, (uint32_t)aligner.GetPendingBytes());
+    }
+
+    result.Forced = aligner.GetForcedFlushCount();
+    aligner.Flush();
+
+    result.Writes = (uint32_t)Sink.Writes.size();
+    result.Intact = Sink.Data == Stream;
+    return result;
+}
+
+static bool IsPreamble(const uint8_t *Data)
+{
+    return Data[0] == 0x72 && Data[1] == 0xF8 && Data[2] == 0x1F && Data[3] == 0x4E;
+}
+
+// TRUE if writes [First, end) are each whole bursts of PeriodBytes
+static bool WholeBursts(const AlignSink &Sink, uint32_t PeriodBytes, size_t First)
+{
+    size_t offset = 0;
+
+    for (size_t i = 0; i < Sink.Writes.size(); i++) {
+        uint32_t length = Sink.Writes[i];
+
+        if (i >= First && (length % PeriodBytes || !IsPreamble(&Sink.Data[offset]))) {
+            return false;
+        }
+        offset += length;
+    }
+    return true;
+}
+
+static void RunAlign(const Options &Opt)
+{
+    (void)Opt;
+
+    // The hatch InitAligner sets up for an IEC 61937 stream carried as
+    // 48 kHz stereo s16
+    const ULONG bytesPerSec = 48000 * 4;
+    const ULONG latencyBytes = bytesPerSec * CAVERN_MAX_FORWARD_LATENCY_MS / 1000;
+    char what[160];
+
+    printf("align: IEC 61937 bursts and PCM frames, escape hatch %lu bytes (%u ms)\n",
+           (unsigned long)latencyBytes, CAVERN_MAX_FORWARD_LATENCY_MS);
+
+    struct {
+        const char *Name;
+        uint32_t    DataType;
+        uint32_t    PeriodBytes;
+        uint32_t    Push;
+    } cases[] = {
+        { "AC-3, 192-byte runs",        1, 1536 * 4,  192 },
+        { "AC-3, ragged runs",          1, 1536 * 4,  0 },
+        { "E-AC-3, 192-byte runs",     21, 6144 * 4,  192 },
+        { "E-AC-3, ragged runs",       21, 6144 * 4,  0 },
+        { "MAT, 768-byte runs",        22, 15360 * 4, 768 },
+        { "DTS type I, 192-byte runs", 11, 512 * 4,   192 },
+    };
+
+    for (const auto &c : cases) {
+        AlignSink sink;
+        std::vector<uint8_t> stream = MakeBursts(c.DataType, c.PeriodBytes, 2000000 / c.PeriodBytes + 4);
+        AlignResult r = PushAll(stream, CavernForwardCodecFrames, 1, latencyBytes, c.Push, sink);
+
+        snprintf(what, sizeof(what), "%s: data changed", c.Name);
+        Check(r.Intact, what);
+        snprintf(what, sizeof(what), "%s: forced flushes", c.Name);
+        Check(r.Forced == 0, what);
+        snprintf(what, sizeof(what), "%s: a write is not whole bursts", c.Name);
+        Check(WholeBursts(sink, c.PeriodBytes, 0), what);
+        snprintf(what, sizeof(what), "%s: held more than a burst", c.Name);
+        Check(r.MaxHeld < c.PeriodBytes, what);
+
+        printf("  %-28s %6u writes of %5u bytes, %u forced, held at most %5u bytes\n",
+               c.Name, r.Writes, c.PeriodBytes, r.Forced, r.MaxHeld);
+    }
+
+    // No sync anywhere: the hatch forwards within the latency budget
+    {
+        AlignSink sink;
+        std::vector<uint8_t> stream(1 << 20);
+
+        for (size_t i = 0; i < stream.size(); i++) {
+            stream[i] = (uint8_t)(i & 0x3F);
+        }
+        AlignResult r = PushAll(stream, CavernForwardCodecFrames, 1, latencyBytes, 192, sink);
+
+        Check(r.Intact, "no sync: data changed");
+        Check(r.Forced > 0, "no sync: escape hatch never fired");
+        Check(r.MaxHeld <= latencyBytes, "no sync: held past the latency budget");
+        printf("  %-28s %6u writes, %u forced, held at most %5u bytes\n", "no sync, 192-byte runs",
+               r.Writes, r.Forced, r.MaxHeld);
+    }
+
+    // A burst cut short: at most the damaged bursts go out torn, then
+    // whole bursts again
+    {
+        AlignSink sink;
+        std::vector<uint8_t> stream = MakeBursts(1, 6144, 40);
+        std::vector<uint8_t> damaged(stream.begin(), stream.begin() + 10 * 6144 + 1000);
+
+        damaged.insert(damaged.end(), stream.begin() + 11 * 6144, stream.end());
+        AlignResult r = PushAll(damaged, CavernForwardCodecFrames, 1, latencyBytes, 192, sink);
+
+        Check(r.Intact, "truncated burst: data changed");
+        Check(sink.Writes.size() > 20 && WholeBursts(sink, 6144, sink.Writes.size() - 20),
+              "truncated burst: not back to whole bursts");
+        printf("  %-28s %6u writes, %u forced, last 20 whole bursts\n", "truncated burst",
+               r.Writes, r.Forced);
+    }
+
+    // PCM: whole nBlockAlign frames, 3 channels of s16
+    {
+        AlignSink sink;
+        std::vector<uint8_t> stream(6 * 48000);
+
+        for (size_t i = 0; i < stream.size(); i++) {
+            stream[i] = (uint8_t)i;
+        }
+        AlignResult r = PushAll(stream, CavernForwardPcmFrames, 6, 6 * 960, 100, sink);
+        bool whole = true;
+
+        for (uint32_t length : sink.Writes) {
+            whole = whole && length % 6 == 0;
+        }
+        Check(r.Intact, "pcm: data changed");
+        Check(whole, "pcm: a write is not whole frames");
+        printf("  %-28s %6u writes, all whole 6-byte frames\n", "PCM 3ch s16, 100-byte runs", r.Writes);
+    }
+}
+
+//=============================================================================
+// packets
+//=============================================================================
+
+// Content of the stream at a linear byte position
+static uint8_t StreamByte(uint64_t Position)
+{
+    return (uint8_t)((Position * 131) >> 3);
+}
+
+// A stream in packet mode: the DMA buffer, the packet state the driver
+// keeps under m_PositionLock, and UpdatePosition/CompleteEndOfStream
+struct PacketStream
+{
+    std::vector<uint8_t>    Dma;
+    CAVERN_PACKET_STATE     Packets = {};
+    CCavernFrameAligner     Aligner;
+    AlignSink               Sink;
+    uint64_t                Position = 0;
+    uint32_t                BytesPerSec = 0;
+    uint64_t                Carry = 0;          // bytes x 1000
+    uint32_t                Completions = 0;
+    uint64_t                CompletedAt = 0;    // position at CompleteEndOfStream
+
+    PacketStream(uint32_t PacketBytes, uint32_t BlockAlign, uint32_t Rate)
+        : Dma(2 * PacketBytes)
+    {
+        Packets.PacketSize = PacketBytes;
+        CavernPacketReset(&Packets);
+        BytesPerSec = Rate;
+        Aligner.Init(CavernForwardPcmFrames, BlockAlign, CAVERN_FORWARD_STAGING_SIZE,
+                     BlockAlign * 960, AlignSink::Sink, &Sink);
+    }
+
+    // The audio engine writes packet Number: the buffer half it maps to
+    void Fill(uint64_t Number)
+    {
+        uint64_t start = Number * Packets.PacketSize;
+
+        for (uint32_t i = 0; i < Packets.PacketSize; i++) {
+            Dma[(start + i) % Dma.size()] = StreamByte(start + i);
+        }
+    }
+
+    void CompleteEndOfStream()
+    {
+        Aligner.Flush();
+        Packets.LastBufferRendered = TRUE;
+        Completions++;
+        CompletedAt = Position;
+    }
+
+    // One timer tick of Ms milliseconds
+    void UpdatePosition(uint32_t Ms)
+    {
+        uint64_t bytes = (uint64_t)BytesPerSec * Ms + Carry;
+
+        Carry = bytes % 1000;
+        bytes = CavernPacketClamp(&Packets, Position, bytes / 1000);
+
+        while (bytes) {
+            uint64_t offset = Position % Dma.size();
+            uint64_t run = std::min<uint64_t>(bytes, Dma.size() - offset);
+
+            Aligner.Push(Dma.data() + offset, (ULONG)run);
+            Position += run;
+            bytes -= run;
+        }
+
+        if (CavernPacketAdvance(&Packets, Position)) {
+            CompleteEndOfStream();
+        }
+    }
+
+    NTSTATUS Write(bool Running, ULONG Number, bool Eos, ULONG EosLength)
+    {
+        BOOLEAN completeNow;
+        NTSTATUS status = CavernPacketWrite(&Packets, Running, Position, Number, Eos, EosLength, &completeNow);
+
+        if (NT_SUCCESS(status) && completeNow) {
+            CompleteEndOfStream();
+        }
+        return status;
+    }
+
+    // Every byte before EOS reached the sink unchanged, and none after it
+    bool Complete(uint64_t EosPosition) const
+    {
+        if (Sink.Data.size() != EosPosition) {
+            return false;
+        }
+        for (uint64_t i = 0; i < EosPosition; i++) {
+            if (Sink.Data[i] != StreamByte(i)) {
+                return false;
+            }
+        }
+        return true;
+    }
+};
+
+static void RunPackets(const Options &Opt)
+{
+    std::mt19937 rng(Opt.Seed);
+    const uint32_t rates[] = { 44100 * 4, 48000 * 4, 48000 * 12, 96000 * 16, 192000 * 64 };
+    const uint32_t aligns[] = { 4, 4, 12, 16, 64 };
+    uint32_t sequences = std::max<uint32_t>(Opt.Steps / 100, 100);
+    uint32_t failed = 0;
+    uint32_t lateTicks = 0;
+
+    printf("packets: packet mode and end of stream, %u random sequences\n", sequences);
+
+    for (uint32_t seq = 0; seq < sequences; seq++) {
+        uint32_t format = rng() % 5;
+        uint32_t packetMs = 5 + rng() % 20;
+        uint32_t packetBytes = (uint32_t)((uint64_t)rates[format] * packetMs / 1000);
+        uint32_t eosPacket = rng() % 12;
+        uint32_t eosLength;
+
+        // Lengths at the edges, off frame boundaries and in between
+        switch (rng() % 4) {
+            case 0:  eosLength = 0; break;
+            case 1:  eosLength = packetBytes; break;
+            case 2:  eosLength = 1 + rng() % 7; break;
+            default: eosLength = rng() % (packetBytes + 1); break;
+        }
+
+        PacketStream stream(packetBytes, aligns[format], rates[format]);
+        uint64_t eosPosition = (uint64_t)eosPacket * packetBytes + eosLength;
+        bool ok = true;
+
+        // Before RUN the engine writes the first packet, then one packet
+        // ahead of the one being read
+        stream.Fill(0);
+        ok &= stream.Write(false, 0, eosPacket == 0, eosLength) == STATUS_SUCCESS;
+        uint32_t written = 1;
+
+        for (uint32_t tick = 0; tick < 1000 && !stream.Packets.LastBufferRendered; tick++) {
+            stream.UpdatePosition(1);
+
+            if (!stream.Packets.EoSReceived && stream.Packets.PacketCounter + 1 >= written) {
+                stream.Fill(written);
+                ok &= stream.Write(true, written, written == eosPacket, eosLength) == STATUS_SUCCESS;
+                written++;
+            }
+
+            // Not reached yet: the tick that crosses EOS completes it
+            if (!stream.Packets.LastBufferRendered && stream.Position >= eosPosition && stream.Packets.EoSReceived) {
+                lateTicks++;
+            }
+        }
+
+        ULONG number = 0;
+        BOOLEAN eos = FALSE;
+        ULONG length = 0;
+
+        ok &= stream.Completions == 1 && stream.CompletedAt == eosPosition;
+        ok &= stream.Complete(eosPosition);
+        ok &= CavernPacketRead(&stream.Packets, &number, &eos, &length) == STATUS_SUCCESS &&
+              eos && number == eosPacket && length == eosLength;
+
+        // Nothing after EOS: no packet accepted, no byte read
+        ok &= stream.Write(true, written, false, 0) == STATUS_INVALID_DEVICE_STATE;
+        stream.UpdatePosition(50);
+        ok &= stream.Position == eosPosition && stream.Sink.Data.size() == eosPosition;
+
+        if (!ok) {
+            if (!failed) {
+                printf("  first failure: %u bytes/s, %u-byte packets, EOS packet %u length %u\n",
+                       rates[format], packetBytes, eosPacket, eosLength);
+            }
+            failed++;
+        }
+    }
+
+    Check(failed == 0, "packet sequences left bytes behind or read past EOS");
+    Check(lateTicks == 0, "EOS completed after the tick that reached it");
+    printf("  %-34s %u of %u sequences forwarded every byte up to EOS\n", "random EOS", sequences - failed, sequences);
+
+    // Wrong packet numbers
+    {
+        PacketStream stream(1920, 4, 192000);
+
+        Check(stream.Write(false, 1, false, 0) == STATUS_DATA_OVERRUN, "packet ahead not refused");
+        Check(stream.Write(false, 0, false, 0) == STATUS_SUCCESS, "first packet refused");
+        Check(stream.Write(true, 0, false, 0) == STATUS_DATA_LATE_ERROR, "packet behind not refused");
+        Check(stream.Write(true, 1, true, 1921) == STATUS_INVALID_PARAMETER, "EOS longer than a packet accepted");
+        Check(stream.Write(true, 1, true, 100) == STATUS_SUCCESS, "EOS packet refused");
+        Check(stream.Write(true, 2, false, 0) == STATUS_INVALID_DEVICE_STATE, "packet after EOS accepted");
+        Check(stream.Write(true, 2, true, 0) == STATUS_INVALID_DEVICE_STATE, "second EOS accepted");
+
+        ULONG number;
+        BOOLEAN eos;
+        ULONG length;
+        PacketStream empty(0, 4, 192000);
+        Check(CavernPacketRead(&stream.Packets, &number, &eos, &length) == STATUS_DEVICE_NOT_READY,
+              "read packet before the first one is done");
+        Check(empty.Write(false, 0, false, 0) == STATUS_INVALID_DEVICE_STATE, "packet without a buffer accepted");
+        printf("  %-34s ok\n", "late, ahead, after EOS");
+    }
+
+    // Paused inside a packet, EOS lands behind the position: flushed at once
+    {
+        PacketStream paused(1920, 4, 192000);
+        paused.Fill(0);
+        paused.Write(false, 0, false, 0);
+        for (int i = 0; i < 5; i++) {
+            paused.UpdatePosition(1);
+        }
+        // Paused 960 bytes into packet 0, EOS at 400 bytes of it
+        Check(paused.Write(false, 0, true, 400) == STATUS_SUCCESS, "EOS in the current packet refused");
+        Check(paused.Completions == 1 && paused.Sink.Data.size() == paused.Position,
+              "EOS behind a paused position not flushed at once");
+        printf("  %-34s ok\n", "EOS behind a paused position");
+    }
+
+    // The packet number only carries the low 32 bits of the counter
+    {
+        PacketStream stream(1920, 4, 192000);
+        uint64_t counter = 0xFFFFFFFFull + 3;
+
+        stream.Position = counter * 1920;
+        stream.Packets.PacketCounter = (LONGLONG)counter;
+        Check(stream.Write(true, (ULONG)(counter + 1), true, 8) == STATUS_SUCCESS, "EOS across the wrap refused");
+        Check(stream.Packets.EosLinearPosition == (counter + 1) * 1920 + 8, "EOS position across the wrap");
+        printf("  %-34s ok\n", "32-bit packet number wrap");
+    }
+}
+
+//=============================================================================
+// main
+//=============================================================================
+
+static void Usage()
+{
+    printf("usage: cavern_stream_sim [all|state|align|packets] [--connect-ms MS] [--steps N] [--seed N]\n");
+}
+
+static bool ParseArgs(int argc, char **argv, Options &Opt)
+{
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+
+        if (arg[0] != '-') {
+            Opt.Suite = arg;
+        } else if (i + 1 < argc && !strcmp(arg, "--connect-ms")) {
+            Opt.ConnectMs = strtoull(argv[++i], nullptr, 0);
+        } else if (i + 1 < argc && !strcmp(arg, "--steps")) {
+            Opt.Steps = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        } else if (i + 1 < argc && !strcmp(arg, "--seed")) {
+            Opt.Seed = (uint32_t)strtoul(argv[++i], nullptr, 0);
+        } else {
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    Options opt;
+    if (!ParseArgs(argc, argv, opt)) {
+        Usage();
+        return 2;
+    }
+
+    bool all = opt.Suite == "all";
+    bool ran = false;
+
+    if (all || opt.Suite == "state") {
+        RunState(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "align") {
+        RunAlign(opt);
+        ran = true;
+    }
+
+    if (all || opt.Suite == "packets") {
+        RunPackets(opt);
+        ran = true;
+    }
+
+    if (!ran) {
+        Usage();
+        return 2;
+    }
+
+    if (g_Failures) {
+        printf("%d check(s) failed\n", g_Failures);
+        return 1;
+    }
+    return 0;
+}